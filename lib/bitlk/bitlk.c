@@ -28,6 +28,7 @@
 
 #include "bitlk.h"
 #include "internal.h"
+#include "utils_threadpool.h"
 
 #define BITLK_BOOTCODE_V1 "\xeb\x52\x90"
 #define BITLK_BOOTCODE_V2 "\xeb\x58\x90"
@@ -58,6 +59,8 @@
 
 #define BITLK_KDF_HASH "sha256"
 #define BITLK_KDF_ITERATION_COUNT 0x100000
+/* rounds between checks of the parallel unlock cancellation */
+#define BITLK_KDF_CHUNK 0x10000
 
 /* maximum number of segments for the DM device */
 #define MAX_BITLK_SEGMENTS 10
@@ -437,8 +440,7 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	}
 
 	/* read and check the signature */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), &sig, sizeof(sig), 0) != sizeof(sig)) {
+	if (device_read_probe(cd, device, devfd, &sig, sizeof(sig), 0) != sizeof(sig)) {
 		log_dbg(cd, "Failed to read BITLK signature from %s.", device_path(device));
 		r = -EIO;
 		goto out;
@@ -481,8 +483,7 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 	}
 
 	/* read GUID and FVE metadata offsets */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), &sb, sizeof(sb), fve_offset) != sizeof(sb)) {
+	if (device_read_probe(cd, device, devfd, &sb, sizeof(sb), fve_offset) != sizeof(sb)) {
 		log_err(cd, _("Failed to read BITLK header from %s."), device_path(device));
 		r = -EINVAL;
 		goto out;
@@ -504,8 +505,7 @@ int BITLK_read_sb(struct crypt_device *cd, struct bitlk_metadata *params)
 		sizeof(fve), device_path(device), params->metadata_offset[0]);
 
 	/* read FVE metadata from the first metadata area */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-		device_alignment(device), &fve, sizeof(fve), params->metadata_offset[0]) != sizeof(fve) ||
+	if (device_read_probe(cd, device, devfd, &fve, sizeof(fve), params->metadata_offset[0]) != sizeof(fve) ||
 		memcmp(fve.signature, BITLK_SIGNATURE, sizeof(fve.signature)) ||
 		le16_to_cpu(fve.fve_version) != 2) {
 		log_err(cd, _("Failed to read BITLK FVE metadata from %s."), device_path(device));
@@ -989,13 +989,14 @@ static int bitlk_kdf(struct crypt_device *cd,
 		     size_t passwordLen,
 		     bool recovery,
 		     const uint8_t *salt,
+		     const int *cancel,
 		     struct volume_key **vk)
 {
 	struct bitlk_kdf_data kdf = {};
 	struct crypt_hash *hd = NULL;
 	int len = 0;
 	char16_t *utf16Password = NULL;
-	int i = 0;
+	int i = 0, j;
 	int r = 0;
 
 	memcpy(kdf.salt, salt, 16);
@@ -1037,12 +1038,33 @@ static int bitlk_kdf(struct crypt_device *cd,
 			goto out;
 	}
 
-	for (i = 0; i < BITLK_KDF_ITERATION_COUNT; i++) {
-		crypt_hash_write(hd, (const char*) &kdf, sizeof(kdf));
-		r = crypt_hash_final(hd, kdf.last_sha256, len);
-		if (r < 0)
+	/*
+	 * Fixed size rounds, use direct SHA-256 chain unless the backend
+	 * implementation is required (FIPS mode).
+	 */
+	for (i = 0; i < BITLK_KDF_ITERATION_COUNT; i += BITLK_KDF_CHUNK) {
+		if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+			r = -EAGAIN;
 			goto out;
-		kdf.count = cpu_to_le64(le64_to_cpu(kdf.count) + 1);
+		}
+
+		if (!crypt_fips_mode()) {
+			r = crypt_sha256_chain(kdf.last_sha256, kdf.initial_sha256,
+					       sizeof(kdf.initial_sha256) + sizeof(kdf.salt),
+					       le64_to_cpu(kdf.count), BITLK_KDF_CHUNK);
+			if (r < 0)
+				goto out;
+			kdf.count = cpu_to_le64(le64_to_cpu(kdf.count) + BITLK_KDF_CHUNK);
+			continue;
+		}
+
+		for (j = 0; j < BITLK_KDF_CHUNK; j++) {
+			crypt_hash_write(hd, (const char*) &kdf, sizeof(kdf));
+			r = crypt_hash_final(hd, kdf.last_sha256, len);
+			if (r < 0)
+				goto out;
+			kdf.count = cpu_to_le64(le64_to_cpu(kdf.count) + 1);
+		}
 	}
 
 	*vk = crypt_alloc_volume_key(len, kdf.last_sha256);
@@ -1107,11 +1129,148 @@ out:
 	return r;
 }
 
-int BITLK_get_volume_key(struct crypt_device *cd,
-			 const char *password,
-			 size_t passwordLen,
-			 const struct bitlk_metadata *params,
-			 struct volume_key **open_fvek_key)
+/* VMK decryption keys of password based protectors derived in advance */
+struct bitlk_kdf_keys {
+	struct crypt_device *cd;
+	const char *password;
+	size_t passwordLen;
+	struct volume_key *recovery_key;
+	unsigned int count;
+	const struct bitlk_vmk **vmks;
+	struct volume_key **keys;
+	int *r;
+	int found;
+};
+
+static int bitlk_derive_key_job(void *arg, unsigned int job)
+{
+	struct bitlk_kdf_keys *kk = arg;
+	const struct bitlk_vmk *vmk = kk->vmks[job];
+	struct volume_key *key;
+	char *outbuf;
+
+	if (vmk->protection == BITLK_PROTECTION_PASSPHRASE)
+		kk->r[job] = bitlk_kdf(kk->cd, kk->password, kk->passwordLen, false,
+				       vmk->salt, &kk->found, &kk->keys[job]);
+	else
+		kk->r[job] = bitlk_kdf(kk->cd, kk->recovery_key->key, kk->recovery_key->keylength,
+				       true, vmk->salt, &kk->found, &kk->keys[job]);
+	if (kk->r[job] < 0)
+		return 0;
+
+	/* VMK is authenticated, a matching protector cancels all other derivations */
+	key = kk->keys[job];
+	outbuf = crypt_safe_alloc(vmk->vk->keylength);
+	if (!outbuf)
+		return 0;
+
+	if (!crypt_bitlk_decrypt_key(key->key, key->keylength, vmk->vk->key, outbuf,
+				     vmk->vk->keylength, (const char *)vmk->nonce, BITLK_NONCE_SIZE,
+				     (const char *)vmk->mac_tag, BITLK_VMK_MAC_TAG_SIZE))
+		__atomic_store_n(&kk->found, 1, __ATOMIC_RELAXED);
+
+	crypt_safe_free(outbuf);
+	return 0;
+}
+
+static void bitlk_kdf_keys_free(struct bitlk_kdf_keys *kk)
+{
+	unsigned int i;
+
+	for (i = 0; kk->keys && i < kk->count; i++)
+		crypt_free_volume_key(kk->keys[i]);
+	crypt_free_volume_key(kk->recovery_key);
+	free(kk->keys);
+	free(kk->vmks);
+	free(kk->r);
+	memset(kk, 0, sizeof(*kk));
+}
+
+/*
+ * Derive keys of all passphrase and recovery passphrase protectors
+ * concurrently, VMK decryption is then done in the original order.
+ */
+static int bitlk_derive_keys(struct crypt_device *cd,
+			     const char *password,
+			     size_t passwordLen,
+			     const struct bitlk_metadata *params,
+			     struct bitlk_kdf_keys *kk)
+{
+	struct crypt_threadpool *tp = NULL;
+	const struct bitlk_vmk *vmk;
+	unsigned int count = 0, threads;
+	int r;
+
+	if (get_recovery_key(cd, password, passwordLen, &kk->recovery_key) < 0)
+		kk->recovery_key = NULL;
+
+	for (vmk = params->vmks; vmk; vmk = vmk->next)
+		if (vmk->protection == BITLK_PROTECTION_PASSPHRASE ||
+		    (vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE && kk->recovery_key))
+			count++;
+
+	threads = crypt_get_threads(cd);
+	if (threads > count)
+		threads = count;
+	if (threads < 2) {
+		bitlk_kdf_keys_free(kk);
+		return -ENOTSUP;
+	}
+
+	kk->vmks = calloc(count, sizeof(*kk->vmks));
+	kk->keys = calloc(count, sizeof(*kk->keys));
+	kk->r = calloc(count, sizeof(*kk->r));
+	if (!kk->vmks || !kk->keys || !kk->r) {
+		bitlk_kdf_keys_free(kk);
+		return -ENOMEM;
+	}
+
+	for (vmk = params->vmks; vmk; vmk = vmk->next)
+		if (vmk->protection == BITLK_PROTECTION_PASSPHRASE ||
+		    (vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE && kk->recovery_key))
+			kk->vmks[kk->count++] = vmk;
+
+	kk->cd = cd;
+	kk->password = password;
+	kk->passwordLen = passwordLen;
+
+	log_dbg(cd, "BITLK: deriving %u VMK keys in parallel.", kk->count);
+
+	r = crypt_threadpool_init(cd, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, kk->count, bitlk_derive_key_job, kk);
+	crypt_threadpool_destroy(tp);
+
+	if (r < 0)
+		bitlk_kdf_keys_free(kk);
+
+	return r;
+}
+
+/* Returns -ENOENT if key of the protector was not derived in advance */
+static int bitlk_kdf_key(struct bitlk_kdf_keys *kk,
+			 const struct bitlk_vmk *vmk,
+			 struct volume_key **vk)
+{
+	unsigned int i;
+
+	for (i = 0; kk && i < kk->count; i++) {
+		if (kk->vmks[i] != vmk)
+			continue;
+		*vk = kk->keys[i];
+		kk->keys[i] = NULL;
+		return kk->r[i];
+	}
+
+	return -ENOENT;
+}
+
+static int bitlk_get_volume_key(struct crypt_device *cd,
+				const char *password,
+				size_t passwordLen,
+				const struct bitlk_metadata *params,
+				struct bitlk_kdf_keys *kk,
+				struct volume_key **open_fvek_key)
 {
 	int r = 0;
 	struct volume_key *open_vmk_key = NULL;
@@ -1122,31 +1281,46 @@ int BITLK_get_volume_key(struct crypt_device *cd,
 	next_vmk = params->vmks;
 	while (next_vmk) {
 		if (next_vmk->protection == BITLK_PROTECTION_PASSPHRASE) {
-			r = bitlk_kdf(cd, password, passwordLen, false, next_vmk->salt, &vmk_dec_key);
+			r = bitlk_kdf_key(kk, next_vmk, &vmk_dec_key);
+			if (r == -ENOENT)
+				r = bitlk_kdf(cd, password, passwordLen, false, next_vmk->salt, NULL, &vmk_dec_key);
 			if (r) {
 				/* something wrong happened, but we still want to check other key slots */
 				next_vmk = next_vmk->next;
 				continue;
 			}
 		} else if (next_vmk->protection == BITLK_PROTECTION_RECOVERY_PASSPHRASE) {
-			r = get_recovery_key(cd, password, passwordLen, &recovery_key);
-			if (r) {
-				/* something wrong happened, but we still want to check other key slots */
+			r = bitlk_kdf_key(kk, next_vmk, &vmk_dec_key);
+			if (r == -EAGAIN) {
+				/* derivation cancelled, other protector matched */
 				next_vmk = next_vmk->next;
 				continue;
 			}
-			if (recovery_key == NULL) {
-				/* r = 0 but no key -> given passphrase is not a recovery passphrase */
-				r = -EPERM;
-				next_vmk = next_vmk->next;
-				continue;
+			if (r != -ENOENT) {
+				log_dbg(cd, "Trying to use given password as a recovery key.");
+				if (r)
+					return r;
+			} else {
+				r = get_recovery_key(cd, password, passwordLen, &recovery_key);
+				if (r) {
+					/* something wrong happened, but we still want to check other key slots */
+					next_vmk = next_vmk->next;
+					continue;
+				}
+				if (recovery_key == NULL) {
+					/* r = 0 but no key -> given passphrase is not a recovery passphrase */
+					r = -EPERM;
+					next_vmk = next_vmk->next;
+					continue;
+				}
+				log_dbg(cd, "Trying to use given password as a recovery key.");
+				r = bitlk_kdf(cd, recovery_key->key, recovery_key->keylength,
+					      true, next_vmk->salt, NULL, &vmk_dec_key);
+				crypt_free_volume_key(recovery_key);
+				recovery_key = NULL;
+				if (r)
+					return r;
 			}
-			log_dbg(cd, "Trying to use given password as a recovery key.");
-			r = bitlk_kdf(cd, recovery_key->key, recovery_key->keylength,
-				      true, next_vmk->salt, &vmk_dec_key);
-			crypt_free_volume_key(recovery_key);
-			if (r)
-				return r;
 		} else if (next_vmk->protection == BITLK_PROTECTION_STARTUP_KEY) {
 			r = get_startup_key(cd, password, passwordLen, next_vmk, &vmk_dec_key, params);
 			if (r) {
@@ -1202,6 +1376,33 @@ int BITLK_get_volume_key(struct crypt_device *cd,
 	return 0;
 }
 
+int BITLK_get_volume_key(struct crypt_device *cd,
+			 const char *password,
+			 size_t passwordLen,
+			 const struct bitlk_metadata *params,
+			 struct volume_key **open_fvek_key)
+{
+	struct bitlk_kdf_keys kk = {};
+	bool retry;
+	int r;
+
+	if (bitlk_derive_keys(cd, password, passwordLen, params, &kk) < 0)
+		log_dbg(cd, "BITLK: deriving VMK keys serially.");
+
+	r = bitlk_get_volume_key(cd, password, passwordLen, params,
+				 kk.count ? &kk : NULL, open_fvek_key);
+
+	/* matching protector did not unlock FVEK, cancelled ones were not tried */
+	retry = r < 0 && kk.found;
+	bitlk_kdf_keys_free(&kk);
+	if (retry) {
+		log_dbg(cd, "BITLK: retrying cancelled VMK key derivations.");
+		r = bitlk_get_volume_key(cd, password, passwordLen, params, NULL, open_fvek_key);
+	}
+
+	return r;
+}
+
 static int _activate_check(struct crypt_device *cd,
 		           const struct bitlk_metadata *params)
 {
@@ -91,6 +91,8 @@ extern "C" {
 #define ARGON2_DEFAULT_FLAGS UINT32_C(0)
 #define ARGON2_FLAG_CLEAR_PASSWORD (UINT32_C(1) << 0)
 #define ARGON2_FLAG_CLEAR_SECRET (UINT32_C(1) << 1)
+/* Pin pooled lane worker threads to separate CPUs (does not affect output). */
+#define ARGON2_FLAG_CPU_AFFINITY (UINT32_C(1) << 3)
 
 /* Global flag to determine if we are wiping internal memory buffers. This flag
  * is defined in core.c and defaults to 1 (wipe internal memory). */
@@ -154,13 +156,18 @@ typedef enum Argon2_ErrorCodes {
 
     ARGON2_DECODING_LENGTH_FAIL = -34,
 
-    ARGON2_VERIFY_MISMATCH = -35
+    ARGON2_VERIFY_MISMATCH = -35,
+
+    ARGON2_ABORTED = -36
 } argon2_error_codes;
 
 /* Memory allocator types --- for external allocation */
 typedef int (*allocate_fptr)(uint8_t **memory, size_t bytes_to_allocate);
 typedef void (*deallocate_fptr)(uint8_t *memory, size_t bytes_to_allocate);
 
+/* Abort callback --- non-zero return value stops hashing */
+typedef int (*abort_fptr)(void);
+
 /* Argon2 external data structures */
 
 /*
@@ -213,6 +220,7 @@ typedef struct Argon2_Context {
 
     allocate_fptr allocate_cbk; /* pointer to memory allocator */
     deallocate_fptr free_cbk;   /* pointer to memory deallocator */
+    abort_fptr abort_cbk;       /* checked between segments, can be NULL */
 
     uint32_t flags; /* array of bool options */
 } argon2_context;
@@ -251,12 +251,22 @@ uint32_t index_alpha(const argon2_instance_t *instance,
     return absolute_position;
 }
 
+/* Check abort callback at segment boundary */
+static int aborted(const argon2_instance_t *instance) {
+    const argon2_context *context = instance->context_ptr;
+
+    return context && context->abort_cbk && (context->abort_cbk)();
+}
+
 /* Single-threaded version for p=1 case */
 static int fill_memory_blocks_st(argon2_instance_t *instance) {
     uint32_t r, s, l;
 
     for (r = 0; r < instance->passes; ++r) {
         for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
+            if (aborted(instance)) {
+                return ARGON2_ABORTED;
+            }
             for (l = 0; l < instance->lanes; ++l) {
                 argon2_position_t position = {r, l, (uint8_t)s, 0};
                 fill_segment(instance, position);
@@ -282,12 +292,67 @@ static void *fill_segment_thr(void *thread_data)
     return 0;
 }
 
+/* One slice of a pass, lanes are processed as pool jobs */
+typedef struct Argon2_pool_slice {
+    argon2_instance_t *instance;
+    uint32_t pass;
+    uint8_t slice;
+} argon2_pool_slice;
+
+static void fill_segment_job(void *arg, uint32_t lane) {
+    argon2_pool_slice *ps = arg;
+    argon2_position_t position;
+
+    position.pass = ps->pass;
+    position.lane = lane;
+    position.slice = ps->slice;
+    position.index = 0;
+    fill_segment(ps->instance, position);
+}
+
+/* Multi-threaded version on persistent worker pool (pool is acquired) */
+static int fill_memory_blocks_pool(argon2_instance_t *instance) {
+    argon2_pool_slice ps;
+    uint32_t r, s;
+    int rc = ARGON2_OK;
+
+    ps.instance = instance;
+
+    for (r = 0; r < instance->passes && rc == ARGON2_OK; ++r) {
+        for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
+            /* All lanes are finished here, check abort in between */
+            if (aborted(instance)) {
+                rc = ARGON2_ABORTED;
+                break;
+            }
+
+            ps.pass = r;
+            ps.slice = (uint8_t)s;
+            argon2_thread_pool_run(fill_segment_job, &ps, instance->lanes);
+        }
+
+#ifdef GENKAT
+        internal_kat(instance, r); /* Print all memory blocks */
+#endif
+    }
+
+    argon2_thread_pool_release();
+    return rc;
+}
+
 /* Multi-threaded version for p > 1 case */
 static int fill_memory_blocks_mt(argon2_instance_t *instance) {
     uint32_t r, s;
     argon2_thread_handle_t *thread = NULL;
     argon2_thread_data *thr_data = NULL;
     int rc = ARGON2_OK;
+    int cpu_affinity = instance->context_ptr &&
+        (instance->context_ptr->flags & ARGON2_FLAG_CPU_AFFINITY);
+
+    /* 0. Reuse pooled workers, create threads per slice only if unavailable */
+    if (!argon2_thread_pool_acquire(instance->threads, cpu_affinity)) {
+        return fill_memory_blocks_pool(instance);
+    }
 
     /* 1. Allocating space for threads */
     thread = calloc(instance->lanes, sizeof(argon2_thread_handle_t));
@@ -306,6 +371,12 @@ static int fill_memory_blocks_mt(argon2_instance_t *instance) {
         for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
             uint32_t l, ll;
 
+            /* All threads are joined here, check abort in between */
+            if (aborted(instance)) {
+                rc = ARGON2_ABORTED;
+                goto fail;
+            }
+
             /* 2. Calling threads */
             for (l = 0; l < instance->lanes; ++l) {
                 argon2_position_t position;
@@ -217,6 +217,18 @@ void finalize(const argon2_context *context, argon2_instance_t *instance);
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position);
 
+/*
+ * Function that fills a new memory block, the same as fill_block() in ref.c
+ */
+typedef void (*fill_block_fn)(const block *prev_block, const block *ref_block,
+                              block *next_block, int with_xor);
+
+/*
+ * Returns the best fill_block() SIMD implementation supported by the CPU
+ * or NULL if there is none
+ */
+fill_block_fn fill_block_simd(void);
+
 /*
  * Function that fills the entire memory t_cost times based on the first two
  * blocks in each lane
@@ -81,10 +81,10 @@ static void fill_block(const block *prev_block, const block *ref_block,
 }
 
 static void next_addresses(block *address_block, block *input_block,
-                           const block *zero_block) {
+                           const block *zero_block, fill_block_fn fill) {
     input_block->v[6]++;
-    fill_block(zero_block, input_block, address_block, 0);
-    fill_block(zero_block, address_block, address_block, 0);
+    fill(zero_block, input_block, address_block, 0);
+    fill(zero_block, address_block, address_block, 0);
 }
 
 void fill_segment(const argon2_instance_t *instance,
@@ -96,11 +96,17 @@ void fill_segment(const argon2_instance_t *instance,
     uint32_t starting_index;
     uint32_t i;
     int data_independent_addressing;
+    fill_block_fn fill;
 
     if (instance == NULL) {
         return;
     }
 
+    fill = fill_block_simd();
+    if (fill == NULL) {
+        fill = fill_block;
+    }
+
     data_independent_addressing =
         (instance->type == Argon2_i) ||
         (instance->type == Argon2_id && (position.pass == 0) &&
@@ -125,7 +131,7 @@ void fill_segment(const argon2_instance_t *instance,
 
         /* Don't forget to generate the first block of addresses: */
         if (data_independent_addressing) {
-            next_addresses(&address_block, &input_block, &zero_block);
+            next_addresses(&address_block, &input_block, &zero_block, fill);
         }
     }
 
@@ -152,7 +158,7 @@ void fill_segment(const argon2_instance_t *instance,
         /* 1.2.1 Taking pseudo-random value from the previous block */
         if (data_independent_addressing) {
             if (i % ARGON2_ADDRESSES_IN_BLOCK == 0) {
-                next_addresses(&address_block, &input_block, &zero_block);
+                next_addresses(&address_block, &input_block, &zero_block, fill);
             }
             pseudo_rand = address_block.v[i % ARGON2_ADDRESSES_IN_BLOCK];
         } else {
@@ -180,14 +186,14 @@ void fill_segment(const argon2_instance_t *instance,
         curr_block = instance->memory + curr_offset;
         if (ARGON2_VERSION_10 == instance->version) {
             /* version 1.2.1 and earlier: overwrite, not XOR */
-            fill_block(instance->memory + prev_offset, ref_block, curr_block, 0);
+            fill(instance->memory + prev_offset, ref_block, curr_block, 0);
         } else {
             if(0 == position.pass) {
-                fill_block(instance->memory + prev_offset, ref_block,
-                           curr_block, 0);
+                fill(instance->memory + prev_offset, ref_block,
+                     curr_block, 0);
             } else {
-                fill_block(instance->memory + prev_offset, ref_block,
-                           curr_block, 1);
+                fill(instance->memory + prev_offset, ref_block,
+                     curr_block, 1);
             }
         }
     }
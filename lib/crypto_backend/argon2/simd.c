@@ -0,0 +1,343 @@
+/*
+ * Argon2 runtime dispatched SIMD fill_block() implementations
+ *
+ * Based on opt.c and blamka-round-opt.h from the Argon2 reference source
+ * code package.
+ *
+ * Copyright 2015
+ * Daniel Dinu, Dmitry Khovratovich, Jean-Philippe Aumasson, and Samuel Neves
+ *
+ * You may use this work under the terms of a Creative Commons CC0 1.0
+ * License/Waiver or the Apache Public License 2.0, at your option. The terms of
+ * these licenses can be found at:
+ *
+ * - CC0 1.0 Universal : https://creativecommons.org/publicdomain/zero/1.0
+ * - Apache 2.0        : https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * You should have received a copy of both of these licenses along with this
+ * software. If not, they may be obtained at the above URLs.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "argon2.h"
+#include "core.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define ARGON2_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define ARGON2_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * All variants compute the same as fill_block() in ref.c:
+ * R = ref_block ^ prev_block, next_block = P(R) ^ R (^ next_block if with_xor)
+ */
+
+#if ARGON2_SIMD_X86
+#define AVX2_ROTR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define AVX2_ROTR24(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, \
+    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define AVX2_ROTR16(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, \
+    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define AVX2_ROTR63(x) _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+#define AVX2_MULADD(x, y, ml) \
+    do { \
+        ml = _mm256_mul_epu32(x, y); \
+        ml = _mm256_add_epi64(ml, ml); \
+        x = _mm256_add_epi64(x, _mm256_add_epi64(y, ml)); \
+    } while ((void)0, 0)
+
+#define AVX2_G(A, B, C, D, RD, RB, ml) \
+    do { \
+        AVX2_MULADD(A, B, ml); \
+        D = RD(_mm256_xor_si256(D, A)); \
+        AVX2_MULADD(C, D, ml); \
+        B = RB(_mm256_xor_si256(B, C)); \
+    } while ((void)0, 0)
+
+#define AVX2_G12(A0, A1, B0, B1, C0, C1, D0, D1, ml) \
+    do { \
+        AVX2_G(A0, B0, C0, D0, AVX2_ROTR32, AVX2_ROTR24, ml); \
+        AVX2_G(A1, B1, C1, D1, AVX2_ROTR32, AVX2_ROTR24, ml); \
+        AVX2_G(A0, B0, C0, D0, AVX2_ROTR16, AVX2_ROTR63, ml); \
+        AVX2_G(A1, B1, C1, D1, AVX2_ROTR16, AVX2_ROTR63, ml); \
+    } while ((void)0, 0)
+
+/* Round over columns, each register holds four words of one row */
+#define AVX2_ROUND_1(A0, A1, B0, B1, C0, C1, D0, D1, ml) \
+    do { \
+        AVX2_G12(A0, A1, B0, B1, C0, C1, D0, D1, ml); \
+        B0 = _mm256_permute4x64_epi64(B0, _MM_SHUFFLE(0, 3, 2, 1)); \
+        C0 = _mm256_permute4x64_epi64(C0, _MM_SHUFFLE(1, 0, 3, 2)); \
+        D0 = _mm256_permute4x64_epi64(D0, _MM_SHUFFLE(2, 1, 0, 3)); \
+        B1 = _mm256_permute4x64_epi64(B1, _MM_SHUFFLE(0, 3, 2, 1)); \
+        C1 = _mm256_permute4x64_epi64(C1, _MM_SHUFFLE(1, 0, 3, 2)); \
+        D1 = _mm256_permute4x64_epi64(D1, _MM_SHUFFLE(2, 1, 0, 3)); \
+        AVX2_G12(A0, A1, B0, B1, C0, C1, D0, D1, ml); \
+        B0 = _mm256_permute4x64_epi64(B0, _MM_SHUFFLE(2, 1, 0, 3)); \
+        C0 = _mm256_permute4x64_epi64(C0, _MM_SHUFFLE(1, 0, 3, 2)); \
+        D0 = _mm256_permute4x64_epi64(D0, _MM_SHUFFLE(0, 3, 2, 1)); \
+        B1 = _mm256_permute4x64_epi64(B1, _MM_SHUFFLE(2, 1, 0, 3)); \
+        C1 = _mm256_permute4x64_epi64(C1, _MM_SHUFFLE(1, 0, 3, 2)); \
+        D1 = _mm256_permute4x64_epi64(D1, _MM_SHUFFLE(0, 3, 2, 1)); \
+    } while ((void)0, 0)
+
+/* Round over rows, words of one row are split over two registers */
+#define AVX2_ROUND_2(A0, A1, B0, B1, C0, C1, D0, D1, ml, t1, t2) \
+    do { \
+        AVX2_G12(A0, A1, B0, B1, C0, C1, D0, D1, ml); \
+        t1 = _mm256_blend_epi32(B0, B1, 0xCC); \
+        t2 = _mm256_blend_epi32(B0, B1, 0x33); \
+        B1 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+        B0 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+        t1 = C0; C0 = C1; C1 = t1; \
+        t1 = _mm256_blend_epi32(D0, D1, 0xCC); \
+        t2 = _mm256_blend_epi32(D0, D1, 0x33); \
+        D0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+        D1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+        AVX2_G12(A0, A1, B0, B1, C0, C1, D0, D1, ml); \
+        t1 = _mm256_blend_epi32(B0, B1, 0xCC); \
+        t2 = _mm256_blend_epi32(B0, B1, 0x33); \
+        B0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+        B1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+        t1 = C0; C0 = C1; C1 = t1; \
+        t1 = _mm256_blend_epi32(D0, D1, 0x33); \
+        t2 = _mm256_blend_epi32(D0, D1, 0xCC); \
+        D0 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1)); \
+        D1 = _mm256_permute4x64_epi64(t2, _MM_SHUFFLE(2, 3, 0, 1)); \
+    } while ((void)0, 0)
+
+__attribute__((target("avx2")))
+static void fill_block_avx2(const block *prev_block, const block *ref_block,
+                            block *next_block, int with_xor) {
+    __m256i state[ARGON2_HWORDS_IN_BLOCK], block_XY[ARGON2_HWORDS_IN_BLOCK];
+    __m256i ml, t1, t2;
+    unsigned int i;
+
+    for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++) {
+        state[i] = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *)prev_block->v + i),
+            _mm256_loadu_si256((const __m256i *)ref_block->v + i));
+        block_XY[i] = with_xor ? _mm256_xor_si256(state[i],
+            _mm256_loadu_si256((const __m256i *)next_block->v + i)) : state[i];
+    }
+
+    for (i = 0; i < 4; ++i) {
+        AVX2_ROUND_1(state[8 * i + 0], state[8 * i + 4], state[8 * i + 1], state[8 * i + 5],
+                     state[8 * i + 2], state[8 * i + 6], state[8 * i + 3], state[8 * i + 7], ml);
+    }
+
+    for (i = 0; i < 4; ++i) {
+        AVX2_ROUND_2(state[ 0 + i], state[ 4 + i], state[ 8 + i], state[12 + i],
+                     state[16 + i], state[20 + i], state[24 + i], state[28 + i], ml, t1, t2);
+    }
+
+    for (i = 0; i < ARGON2_HWORDS_IN_BLOCK; i++)
+        _mm256_storeu_si256((__m256i *)next_block->v + i,
+                            _mm256_xor_si256(state[i], block_XY[i]));
+
+    _mm256_zeroupper();
+}
+
+#define AVX512_MULADD(x, y, z) \
+    do { \
+        z = _mm512_mul_epu32(x, y); \
+        x = _mm512_add_epi64(_mm512_add_epi64(x, y), _mm512_add_epi64(z, z)); \
+    } while ((void)0, 0)
+
+#define AVX512_G(A, B, C, D, RD, RB, z) \
+    do { \
+        AVX512_MULADD(A, B, z); \
+        D = _mm512_ror_epi64(_mm512_xor_si512(D, A), RD); \
+        AVX512_MULADD(C, D, z); \
+        B = _mm512_ror_epi64(_mm512_xor_si512(B, C), RB); \
+    } while ((void)0, 0)
+
+#define AVX512_G12(A0, B0, C0, D0, A1, B1, C1, D1, z) \
+    do { \
+        AVX512_G(A0, B0, C0, D0, 32, 24, z); \
+        AVX512_G(A1, B1, C1, D1, 32, 24, z); \
+        AVX512_G(A0, B0, C0, D0, 16, 63, z); \
+        AVX512_G(A1, B1, C1, D1, 16, 63, z); \
+    } while ((void)0, 0)
+
+#define AVX512_PERMUTE(B0, B1, C0, C1, D0, D1, b, c, d) \
+    do { \
+        B0 = _mm512_permutex_epi64(B0, b); \
+        B1 = _mm512_permutex_epi64(B1, b); \
+        C0 = _mm512_permutex_epi64(C0, c); \
+        C1 = _mm512_permutex_epi64(C1, c); \
+        D0 = _mm512_permutex_epi64(D0, d); \
+        D1 = _mm512_permutex_epi64(D1, d); \
+    } while ((void)0, 0)
+
+#define AVX512_ROUND(A0, B0, C0, D0, A1, B1, C1, D1, z) \
+    do { \
+        AVX512_G12(A0, B0, C0, D0, A1, B1, C1, D1, z); \
+        AVX512_PERMUTE(B0, B1, C0, C1, D0, D1, _MM_SHUFFLE(0, 3, 2, 1), \
+                       _MM_SHUFFLE(1, 0, 3, 2), _MM_SHUFFLE(2, 1, 0, 3)); \
+        AVX512_G12(A0, B0, C0, D0, A1, B1, C1, D1, z); \
+        AVX512_PERMUTE(B0, B1, C0, C1, D0, D1, _MM_SHUFFLE(2, 1, 0, 3), \
+                       _MM_SHUFFLE(1, 0, 3, 2), _MM_SHUFFLE(0, 3, 2, 1)); \
+    } while ((void)0, 0)
+
+#define AVX512_SWAP_HALVES(A0, A1, t0, t1) \
+    do { \
+        t0 = _mm512_shuffle_i64x2(A0, A1, _MM_SHUFFLE(1, 0, 1, 0)); \
+        t1 = _mm512_shuffle_i64x2(A0, A1, _MM_SHUFFLE(3, 2, 3, 2)); \
+        A0 = t0; \
+        A1 = t1; \
+    } while ((void)0, 0)
+
+#define AVX512_SWAP_QUARTERS(A0, A1, t0, t1, q) \
+    do { \
+        AVX512_SWAP_HALVES(A0, A1, t0, t1); \
+        A0 = _mm512_permutexvar_epi64(q, A0); \
+        A1 = _mm512_permutexvar_epi64(q, A1); \
+    } while ((void)0, 0)
+
+#define AVX512_UNSWAP_QUARTERS(A0, A1, t0, t1, q) \
+    do { \
+        A0 = _mm512_permutexvar_epi64(q, A0); \
+        A1 = _mm512_permutexvar_epi64(q, A1); \
+        AVX512_SWAP_HALVES(A0, A1, t0, t1); \
+    } while ((void)0, 0)
+
+__attribute__((target("avx512f")))
+static void fill_block_avx512(const block *prev_block, const block *ref_block,
+                              block *next_block, int with_xor) {
+    __m512i state[ARGON2_512BIT_WORDS_IN_BLOCK], block_XY[ARGON2_512BIT_WORDS_IN_BLOCK];
+    __m512i z, t0, t1, q;
+    __m512i *s;
+    unsigned int i;
+
+    for (i = 0; i < ARGON2_512BIT_WORDS_IN_BLOCK; i++) {
+        state[i] = _mm512_xor_si512(
+            _mm512_loadu_si512((const __m512i *)prev_block->v + i),
+            _mm512_loadu_si512((const __m512i *)ref_block->v + i));
+        block_XY[i] = with_xor ? _mm512_xor_si512(state[i],
+            _mm512_loadu_si512((const __m512i *)next_block->v + i)) : state[i];
+    }
+
+    /* A0, C0, B0, D0, A1, C1, B1, D1 order as BLAKE2_ROUND_1 in blamka-round-opt.h */
+    for (i = 0; i < 2; ++i) {
+        s = &state[8 * i];
+        AVX512_SWAP_HALVES(s[0], s[2], t0, t1);
+        AVX512_SWAP_HALVES(s[1], s[3], t0, t1);
+        AVX512_SWAP_HALVES(s[4], s[6], t0, t1);
+        AVX512_SWAP_HALVES(s[5], s[7], t0, t1);
+        AVX512_ROUND(s[0], s[2], s[1], s[3], s[4], s[6], s[5], s[7], z);
+        AVX512_SWAP_HALVES(s[0], s[2], t0, t1);
+        AVX512_SWAP_HALVES(s[1], s[3], t0, t1);
+        AVX512_SWAP_HALVES(s[4], s[6], t0, t1);
+        AVX512_SWAP_HALVES(s[5], s[7], t0, t1);
+    }
+
+    q = _mm512_setr_epi64(0, 1, 4, 5, 2, 3, 6, 7);
+    for (i = 0; i < 2; ++i) {
+        s = &state[i];
+        AVX512_SWAP_QUARTERS(s[0], s[2], t0, t1, q);
+        AVX512_SWAP_QUARTERS(s[4], s[6], t0, t1, q);
+        AVX512_SWAP_QUARTERS(s[8], s[10], t0, t1, q);
+        AVX512_SWAP_QUARTERS(s[12], s[14], t0, t1, q);
+        AVX512_ROUND(s[0], s[4], s[8], s[12], s[2], s[6], s[10], s[14], z);
+        AVX512_UNSWAP_QUARTERS(s[0], s[2], t0, t1, q);
+        AVX512_UNSWAP_QUARTERS(s[4], s[6], t0, t1, q);
+        AVX512_UNSWAP_QUARTERS(s[8], s[10], t0, t1, q);
+        AVX512_UNSWAP_QUARTERS(s[12], s[14], t0, t1, q);
+    }
+
+    for (i = 0; i < ARGON2_512BIT_WORDS_IN_BLOCK; i++)
+        _mm512_storeu_si512((__m512i *)next_block->v + i,
+                            _mm512_xor_si512(state[i], block_XY[i]));
+
+    _mm256_zeroupper();
+}
+#endif /* ARGON2_SIMD_X86 */
+
+#if ARGON2_SIMD_NEON
+#define NEON_ROTR(x, n) vsriq_n_u64(vshlq_n_u64((x), 64 - (n)), (x), (n))
+#define NEON_ROTR32(x) vreinterpretq_u64_u32(vrev64q_u32(vreinterpretq_u32_u64(x)))
+
+#define NEON_MULADD(x, y, z) \
+    do { \
+        z = vmull_u32(vmovn_u64(x), vmovn_u64(y)); \
+        x = vaddq_u64(vaddq_u64(x, y), vaddq_u64(z, z)); \
+    } while ((void)0, 0)
+
+#define NEON_G(A, B, C, D, z) \
+    do { \
+        NEON_MULADD(A, B, z); \
+        D = NEON_ROTR32(veorq_u64(D, A)); \
+        NEON_MULADD(C, D, z); \
+        B = NEON_ROTR(veorq_u64(B, C), 24); \
+        NEON_MULADD(A, B, z); \
+        D = NEON_ROTR(veorq_u64(D, A), 16); \
+        NEON_MULADD(C, D, z); \
+        B = NEON_ROTR(veorq_u64(B, C), 63); \
+    } while ((void)0, 0)
+
+/* Two words per register, the same layout as BLAKE2_ROUND for SSE */
+#define NEON_ROUND(A0, A1, B0, B1, C0, C1, D0, D1, z, t0, t1) \
+    do { \
+        NEON_G(A0, B0, C0, D0, z); \
+        NEON_G(A1, B1, C1, D1, z); \
+        t0 = vextq_u64(B0, B1, 1); t1 = vextq_u64(B1, B0, 1); B0 = t0; B1 = t1; \
+        t0 = C0; C0 = C1; C1 = t0; \
+        t0 = vextq_u64(D0, D1, 1); t1 = vextq_u64(D1, D0, 1); D0 = t1; D1 = t0; \
+        NEON_G(A0, B0, C0, D0, z); \
+        NEON_G(A1, B1, C1, D1, z); \
+        t0 = vextq_u64(B1, B0, 1); t1 = vextq_u64(B0, B1, 1); B0 = t0; B1 = t1; \
+        t0 = C0; C0 = C1; C1 = t0; \
+        t0 = vextq_u64(D1, D0, 1); t1 = vextq_u64(D0, D1, 1); D0 = t1; D1 = t0; \
+    } while ((void)0, 0)
+
+static void fill_block_neon(const block *prev_block, const block *ref_block,
+                            block *next_block, int with_xor) {
+    uint64x2_t state[ARGON2_OWORDS_IN_BLOCK], block_XY[ARGON2_OWORDS_IN_BLOCK];
+    uint64x2_t z, t0, t1;
+    unsigned int i;
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++) {
+        state[i] = veorq_u64(vld1q_u64(&prev_block->v[2 * i]),
+                             vld1q_u64(&ref_block->v[2 * i]));
+        block_XY[i] = with_xor ? veorq_u64(state[i],
+                                 vld1q_u64(&next_block->v[2 * i])) : state[i];
+    }
+
+    for (i = 0; i < 8; ++i) {
+        NEON_ROUND(state[8 * i + 0], state[8 * i + 1], state[8 * i + 2],
+                   state[8 * i + 3], state[8 * i + 4], state[8 * i + 5],
+                   state[8 * i + 6], state[8 * i + 7], z, t0, t1);
+    }
+
+    for (i = 0; i < 8; ++i) {
+        NEON_ROUND(state[8 * 0 + i], state[8 * 1 + i], state[8 * 2 + i],
+                   state[8 * 3 + i], state[8 * 4 + i], state[8 * 5 + i],
+                   state[8 * 6 + i], state[8 * 7 + i], z, t0, t1);
+    }
+
+    for (i = 0; i < ARGON2_OWORDS_IN_BLOCK; i++)
+        vst1q_u64(&next_block->v[2 * i], veorq_u64(state[i], block_XY[i]));
+}
+#endif /* ARGON2_SIMD_NEON */
+
+fill_block_fn fill_block_simd(void) {
+#if ARGON2_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return fill_block_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return fill_block_avx2;
+#elif ARGON2_SIMD_NEON
+    return fill_block_neon;
+#endif
+    return NULL;
+}
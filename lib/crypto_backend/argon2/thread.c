@@ -20,6 +20,9 @@
 #include "thread.h"
 #if defined(_WIN32)
 #include <windows.h>
+#else
+#include <sched.h>
+#include <unistd.h>
 #endif
 
 int argon2_thread_create(argon2_thread_handle_t *handle,
@@ -46,4 +49,246 @@ int argon2_thread_join(argon2_thread_handle_t handle) {
 #endif
 }
 
+#if defined(_WIN32)
+
+int argon2_thread_pool_acquire(uint32_t threads, int cpu_affinity) {
+    (void)threads;
+    (void)cpu_affinity;
+    return -1;
+}
+
+void argon2_thread_pool_run(argon2_pool_job_t func, void *arg, uint32_t jobs) {
+    uint32_t job;
+
+    for (job = 0; job < jobs; ++job) {
+        func(arg, job);
+    }
+}
+
+void argon2_thread_pool_release(void) {
+}
+
+#else
+
+struct argon2_pool_worker {
+    pthread_t thread;
+    uint32_t index;
+    int cpu_affinity; /* affinity currently applied to the worker */
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Protected by pool_lock */
+static struct {
+    struct argon2_pool_worker workers[ARGON2_POOL_MAX_THREADS];
+    uint32_t count; /* running workers */
+
+    /* current owner settings, only workers with index < limit take jobs */
+    int busy;
+    uint32_t limit;
+    int cpu_affinity;
+
+    /* current run */
+    argon2_pool_job_t func;
+    void *arg;
+    uint32_t jobs;
+    uint32_t next_job;
+    uint32_t done;
+
+    int exit;
+} pool;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_worker_affinity(struct argon2_pool_worker *w,
+                                 int cpu_affinity) {
+#if defined(__linux__) && defined(CPU_SETSIZE)
+    cpu_set_t allowed, set;
+    int cpu, n, count;
+
+    if (w->cpu_affinity == cpu_affinity) {
+        return;
+    }
+    w->cpu_affinity = cpu_affinity;
+
+    /* Process (main thread) mask, worker own mask can be already pinned */
+    if (sched_getaffinity(getpid(), sizeof(allowed), &allowed)) {
+        return;
+    }
+
+    if (!cpu_affinity) {
+        pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+        return;
+    }
+
+    count = CPU_COUNT(&allowed);
+    if (count <= 0) {
+        return;
+    }
+
+    /* Worker n runs on n-th allowed CPU (wraps around on small systems) */
+    n = (int)(w->index % (uint32_t)count);
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            break;
+        }
+    }
+#else
+    w->cpu_affinity = cpu_affinity;
+#endif
+}
+
+static void *pool_worker(void *data) {
+    struct argon2_pool_worker *w = data;
+    argon2_pool_job_t func;
+    void *arg;
+    uint32_t job;
+    int cpu_affinity;
+
+    pthread_mutex_lock(&pool_lock);
+    while (!pool.exit) {
+        if (w->index >= pool.limit || pool.next_job >= pool.jobs) {
+            pthread_cond_wait(&pool_work_cond, &pool_lock);
+            continue;
+        }
+
+        job = pool.next_job++;
+        func = pool.func;
+        arg = pool.arg;
+        cpu_affinity = pool.cpu_affinity;
+        pthread_mutex_unlock(&pool_lock);
+
+        pool_worker_affinity(w, cpu_affinity);
+        func(arg, job);
+
+        pthread_mutex_lock(&pool_lock);
+        if (++pool.done == pool.jobs) {
+            pthread_cond_signal(&pool_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return NULL;
+}
+
+static void pool_atfork_prepare(void) {
+    pthread_mutex_lock(&pool_lock);
+}
+
+static void pool_atfork_parent(void) {
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Workers do not exist in the child, start with an empty pool */
+static void pool_atfork_child(void) {
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_work_cond, NULL);
+    pthread_cond_init(&pool_done_cond, NULL);
+    pool.count = 0;
+    pool.busy = 0;
+    pool.limit = 0;
+    pool.func = NULL;
+    pool.arg = NULL;
+    pool.jobs = pool.next_job = pool.done = 0;
+}
+
+static void pool_init_once(void) {
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent, pool_atfork_child);
+}
+
+/* Stop workers before the code they run is unloaded (exit or dlclose) */
+#if defined(__GNUC__)
+__attribute__((destructor))
+#endif
+static void pool_destroy(void) {
+    uint32_t i, count;
+
+    pthread_mutex_lock(&pool_lock);
+    pool.exit = 1;
+    count = pool.count;
+    pthread_cond_broadcast(&pool_work_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (i = 0; i < count; ++i) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    pool.count = 0;
+}
+
+int argon2_thread_pool_acquire(uint32_t threads, int cpu_affinity) {
+    struct argon2_pool_worker *w;
+
+    if (threads == 0 || threads > ARGON2_POOL_MAX_THREADS) {
+        return -1;
+    }
+
+    pthread_once(&pool_once, pool_init_once);
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool.busy || pool.exit) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+
+    while (pool.count < threads) {
+        w = &pool.workers[pool.count];
+        w->index = pool.count;
+        w->cpu_affinity = 0;
+        if (pthread_create(&w->thread, NULL, pool_worker, w)) {
+            break;
+        }
+        pool.count++;
+    }
+
+    if (pool.count < threads) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+
+    pool.busy = 1;
+    pool.limit = threads;
+    pool.cpu_affinity = cpu_affinity;
+    pthread_mutex_unlock(&pool_lock);
+
+    return 0;
+}
+
+void argon2_thread_pool_run(argon2_pool_job_t func, void *arg, uint32_t jobs) {
+    if (jobs == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool.func = func;
+    pool.arg = arg;
+    pool.jobs = jobs;
+    pool.next_job = 0;
+    pool.done = 0;
+    pthread_cond_broadcast(&pool_work_cond);
+
+    while (pool.done < pool.jobs) {
+        pthread_cond_wait(&pool_done_cond, &pool_lock);
+    }
+
+    pool.func = NULL;
+    pool.arg = NULL;
+    pool.jobs = pool.next_job = pool.done = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void argon2_thread_pool_release(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool.busy = 0;
+    pool.limit = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+#endif
+
 #endif /* ARGON2_NO_THREADS */
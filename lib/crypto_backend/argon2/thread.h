@@ -20,6 +20,8 @@
 
 #if !defined(ARGON2_NO_THREADS)
 
+#include <stdint.h>
+
 /*
         Here we implement an abstraction layer for the simpĺe requirements
         of the Argon2 code. We only require 3 primitives---thread creation,
@@ -58,5 +60,23 @@ int argon2_thread_create(argon2_thread_handle_t *handle,
 */
 int argon2_thread_join(argon2_thread_handle_t handle);
 
+/*
+ * Persistent lane worker pool, shared by all Argon2 calls in the process.
+ * Workers are created on first use and reused across slices, passes and
+ * calls. Only one caller can hold the pool at a time; if acquire fails
+ * (pool busy, too many threads or no pthreads) use per-slice threads.
+ */
+#define ARGON2_POOL_MAX_THREADS 64
+
+typedef void (*argon2_pool_job_t)(void *arg, uint32_t job);
+
+/* Reserve pool with threads workers, pin them to separate CPUs if requested */
+int argon2_thread_pool_acquire(uint32_t threads, int cpu_affinity);
+
+/* Process jobs <0, jobs) on reserved workers and wait for completion */
+void argon2_thread_pool_run(argon2_pool_job_t func, void *arg, uint32_t jobs);
+
+void argon2_thread_pool_release(void);
+
 #endif /* ARGON2_NO_THREADS */
 #endif
@@ -20,6 +20,9 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "crypto_backend_internal.h"
 #if HAVE_ARGON2_H
 #include <argon2.h>
@@ -29,6 +32,140 @@
 
 #define CONST_CAST(x) (x)(uintptr_t)
 
+#define ARGON2_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+#define ARGON2_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+/*
+ * Argon2 memory arena, one per calling thread (argon2_ctx allocates memory
+ * only once and frees it at the end in the same thread).
+ */
+struct argon2_arena {
+	void *base;
+	size_t size;
+	const char *type;
+	bool locked;
+};
+
+static __thread struct argon2_arena _arena;
+static __thread uint32_t _arena_flags;
+
+void crypt_argon2_set_memory_flags(uint32_t flags)
+{
+	_arena_flags = flags;
+}
+
+uint32_t crypt_argon2_get_memory_flags(void)
+{
+	return _arena_flags;
+}
+
+const char *crypt_argon2_memory_type(bool *locked)
+{
+	if (locked)
+		*locked = _arena.locked;
+	return _arena.type;
+}
+
+#if USE_INTERNAL_ARGON2 || HAVE_ARGON2_H
+static size_t arena_align(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+static void arena_prefault(uint8_t *memory, size_t size)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(memory, size, MADV_POPULATE_WRITE))
+		return;
+#endif
+	if (page_size <= 0)
+		page_size = 4096;
+
+	for (i = 0; i < size; i += page_size)
+		((volatile uint8_t *)memory)[i] = 0;
+}
+
+/*
+ * Try explicit huge pages (pre-faulted by MAP_POPULATE) first, then
+ * transparent huge pages on 2 MiB aligned mapping and plain mmap.
+ */
+static int arena_allocate(uint8_t **memory, size_t bytes)
+{
+	size_t size = arena_align(bytes, ARGON2_HUGE_PAGE_SIZE), head;
+	uint8_t *p;
+
+	*memory = NULL;
+	_arena.base = NULL;
+	_arena.type = NULL;
+	_arena.locked = false;
+
+#ifdef ARGON2_MAP_HUGE_2MB
+	if (bytes >= ARGON2_HUGE_PAGE_SIZE) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS |
+			 MAP_HUGETLB | ARGON2_MAP_HUGE_2MB | MAP_POPULATE, -1, 0);
+		if (p != MAP_FAILED) {
+			_arena.base = p;
+			_arena.size = size;
+			_arena.type = "hugetlb";
+		}
+	}
+#endif
+	if (!_arena.base && bytes >= ARGON2_HUGE_PAGE_SIZE) {
+		p = mmap(NULL, size + ARGON2_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			/* trim the mapping to huge page aligned area */
+			head = arena_align((uintptr_t)p, ARGON2_HUGE_PAGE_SIZE) - (uintptr_t)p;
+			if (head)
+				munmap(p, head);
+			munmap(p + head + size, ARGON2_HUGE_PAGE_SIZE - head);
+			p += head;
+#ifdef MADV_HUGEPAGE
+			if (!madvise(p, size, MADV_HUGEPAGE))
+				_arena.type = "transparent huge pages";
+#endif
+			arena_prefault(p, size);
+			_arena.base = p;
+			_arena.size = size;
+		}
+	}
+
+	if (!_arena.base) {
+		p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		_arena.base = p;
+		_arena.size = bytes;
+	}
+
+	if (!_arena.type)
+		_arena.type = "mmap";
+
+	if ((_arena_flags & CRYPT_ARGON2_MEMORY_LOCK) && !mlock(_arena.base, _arena.size))
+		_arena.locked = true;
+
+	*memory = _arena.base;
+	return 0;
+}
+
+static void arena_free(uint8_t *memory, size_t bytes __attribute__((unused)))
+{
+	if (!memory || memory != _arena.base)
+		return;
+
+	if (_arena.locked)
+		munlock(_arena.base, _arena.size);
+	munmap(_arena.base, _arena.size);
+	_arena.base = NULL;
+}
+#endif
+
 int argon2(const char *type, const char *password, size_t password_length,
 	   const char *salt, size_t salt_length,
 	   char *key, size_t key_length,
@@ -51,6 +188,11 @@ int argon2(const char *type, const char *password, size_t password_length,
 		.pwdlen = (uint32_t)password_length,
 		.salt = CONST_CAST(uint8_t *)salt,
 		.saltlen = (uint32_t)salt_length,
+		.allocate_cbk = arena_allocate,
+		.free_cbk = arena_free,
+#if !HAVE_ARGON2_H
+		.abort_cbk = crypt_pbkdf_aborted,
+#endif
 	};
 	int r;
 
@@ -61,6 +203,11 @@ int argon2(const char *type, const char *password, size_t password_length,
 	else
 		return -EINVAL;
 
+#if !HAVE_ARGON2_H
+	if (_arena_flags & CRYPT_ARGON2_CPU_AFFINITY)
+		context.flags |= ARGON2_FLAG_CPU_AFFINITY;
+#endif
+
 	switch (argon2_ctx(&context, atype)) {
 	case ARGON2_OK:
 		r = 0;
@@ -70,6 +217,11 @@ int argon2(const char *type, const char *password, size_t password_length,
 	case ARGON2_ALLOCATE_MEMORY_CBK_NULL:
 		r = -ENOMEM;
 		break;
+#if !HAVE_ARGON2_H
+	case ARGON2_ABORTED:
+		r = -ECANCELED;
+		break;
+#endif
 	default:
 		r = -EINVAL;
 	}
@@ -27,45 +27,48 @@
 
 #include "crypto_backend.h"
 
-#define WHITESPACE " \t\n\r"
-
 /* https://tools.ietf.org/html/rfc4648#section-4 */
-static char base64char(int x)
+static const char base64_table[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				     "abcdefghijklmnopqrstuvwxyz"
+				     "0123456789+/";
+
+/*
+ * Decoding table, 0-63 for alphabet characters, B64_WS for whitespace
+ * (" \t\n\r"), 0x41 for padding and 0xff for everything else.
+ * Only alphabet values are below 64, OR of several values is then below 64
+ * only if all of them are alphabet characters.
+ */
+#define B64_WS 0x40
+
+static const uint8_t unbase64_table[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x40, 0x40, 0xff, 0xff, 0x40, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x40, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,   62, 0xff, 0xff, 0xff,   63,
+	  52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0xff, 0xff, 0xff, 0x41, 0xff, 0xff,
+	0xff,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+	  15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+	  41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static inline char base64char(int x)
 {
-	static const char table[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-				      "abcdefghijklmnopqrstuvwxyz"
-				      "0123456789+/";
-	return table[x & 63];
+	return base64_table[x & 63];
 }
 
-static int unbase64char(char c)
+static inline int unbase64char(char c)
 {
-	unsigned offset;
-
-	if (c >= 'A' && c <= 'Z')
-		return c - 'A';
-
-	offset = 'Z' - 'A' + 1;
-
-	if (c >= 'a' && c <= 'z')
-		return c - 'a' + offset;
-
-	offset += 'z' - 'a' + 1;
-
-	if (c >= '0' && c <= '9')
-		return c - '0' + offset;
+	uint8_t v = unbase64_table[(uint8_t)c];
 
-	offset += '9' - '0' + 1;
-
-	if (c == '+')
-		return offset;
-
-	offset++;
-
-	if (c == '/')
-		return offset;
-
-	return -EINVAL;
+	return v < 64 ? v : -EINVAL;
 }
 
 int crypt_base64_encode(char **out, size_t *out_length, const char *in, size_t in_length)
@@ -81,12 +84,15 @@ int crypt_base64_encode(char **out, size_t *out_length, const char *in, size_t i
 	if (!r)
 		return -ENOMEM;
 
-	for (x = (const uint8_t *)in; x < (const uint8_t*)in + (in_length / 3) * 3; x += 3) {
-		/* x[0] == XXXXXXXX; x[1] == YYYYYYYY; x[2] == ZZZZZZZZ */
-		*(z++) = base64char(x[0] >> 2);                    /* 00XXXXXX */
-		*(z++) = base64char((x[0] & 3) << 4 | x[1] >> 4);  /* 00XXYYYY */
-		*(z++) = base64char((x[1] & 15) << 2 | x[2] >> 6); /* 00YYYYZZ */
-		*(z++) = base64char(x[2] & 63);                    /* 00ZZZZZZ */
+	/* no data dependency between groups, the loop can be vectorized */
+	for (x = (const uint8_t *)in; x < (const uint8_t*)in + (in_length / 3) * 3; x += 3, z += 4) {
+		/* v == XXXXXXXXYYYYYYYYZZZZZZZZ */
+		uint32_t v = (uint32_t)x[0] << 16 | (uint32_t)x[1] << 8 | x[2];
+
+		z[0] = base64_table[v >> 18];        /* 00XXXXXX */
+		z[1] = base64_table[(v >> 12) & 63]; /* 00XXYYYY */
+		z[2] = base64_table[(v >> 6) & 63];  /* 00YYYYZZ */
+		z[3] = base64_table[v & 63];         /* 00ZZZZZZ */
 	}
 
 	switch (in_length % 3) {
@@ -127,7 +133,7 @@ static int unbase64_next(const char **p, size_t *l)
 		if (*l == 0)
 			return -EPIPE;
 
-		if (!strchr(WHITESPACE, **p))
+		if (unbase64_table[(uint8_t)**p] != B64_WS)
 			break;
 
 		/* Skip leading whitespace */
@@ -147,7 +153,7 @@ static int unbase64_next(const char **p, size_t *l)
 
 		if (*l == 0)
 			break;
-		if (!strchr(WHITESPACE, **p))
+		if (unbase64_table[(uint8_t)**p] != B64_WS)
 			break;
 
 		/* Skip following whitespace */
@@ -182,6 +188,21 @@ int crypt_base64_decode(char **out, size_t *out_length, const char *in, size_t i
 	for (x = in, z = buf;;) {
 		int a, b, c, d; /* a == 00XXXXXX; b == 00YYYYYY; c == 00ZZZZZZ; d == 00WWWWWW */
 
+		/* Fast path, whole groups of four alphabet characters (no whitespace or padding) */
+		while (in_length >= 4) {
+			uint8_t ta = unbase64_table[(uint8_t)x[0]], tb = unbase64_table[(uint8_t)x[1]],
+				tc = unbase64_table[(uint8_t)x[2]], td = unbase64_table[(uint8_t)x[3]];
+
+			if ((ta | tb | tc | td) >= 64)
+				break;
+
+			*(z++) = ta << 2 | tb >> 4; /* XXXXXXYY */
+			*(z++) = tb << 4 | tc >> 2; /* YYYYZZZZ */
+			*(z++) = tc << 6 | td;      /* ZZWWWWWW */
+			x += 4;
+			in_length -= 4;
+		}
+
 		a = unbase64_next(&x, &in_length);
 		if (a == -EPIPE) /* End of string */
 			break;
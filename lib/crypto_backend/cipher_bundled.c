@@ -0,0 +1,893 @@
+/*
+ * Bundled userspace block ciphers (fallback if kernel crypto API is not available)
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Only ciphers and modes used for LUKS keyslots and common data encryption
+ * are provided (AES, Serpent and Twofish in ECB, CBC and XTS mode).
+ *
+ * All implementations avoid secret dependent table lookups and branches:
+ * AES S-box is computed as GF(2^8) inversion (eight bytes in parallel),
+ * Serpent S-boxes are evaluated as boolean functions of bitsliced input and
+ * Twofish key dependent S-boxes are computed on the fly from 4-bit
+ * permutations packed in 64-bit constants (shift by variable amount).
+ *
+ * The code is optimized for small amounts of data (keyslot areas) and it is
+ * much slower than kernel or crypto library implementations.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crypto_backend_internal.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AES_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define BLOCK_SIZE 16
+
+typedef enum { MODE_ECB = 0, MODE_CBC, MODE_XTS } cipher_mode;
+
+struct aes_key {
+	uint8_t rk[15][BLOCK_SIZE];
+	uint8_t dk[15][BLOCK_SIZE]; /* AES-NI decryption round keys */
+	unsigned int rounds;
+	bool aesni;
+};
+
+struct serpent_key {
+	uint32_t k[33][4];
+};
+
+struct twofish_key {
+	uint32_t k[40];
+	uint32_t s[4];
+	unsigned int words;
+};
+
+union cipher_key {
+	struct aes_key aes;
+	struct serpent_key serpent;
+	struct twofish_key twofish;
+};
+
+typedef void (*block_fn)(const union cipher_key *key, uint8_t *out, const uint8_t *in);
+
+struct crypt_cipher_bundled {
+	cipher_mode mode;
+	block_fn encrypt;
+	block_fn decrypt;
+	union cipher_key key;
+	union cipher_key tweak_key; /* XTS only */
+};
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t rol32(uint32_t x, unsigned int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+/*
+ * AES
+ */
+#define LANES UINT64_C(0x0101010101010101)
+
+static inline uint64_t xtime64(uint64_t a)
+{
+	return ((a & (LANES * 0x7f)) << 1) ^ (((a >> 7) & LANES) * 0x1b);
+}
+
+static uint64_t gf_mul64(uint64_t a, uint64_t b)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		r ^= a & (((b >> i) & LANES) * 0xff);
+		a = xtime64(a);
+	}
+
+	return r;
+}
+
+/* x^254 is inversion in GF(2^8), zero maps to zero */
+static uint64_t gf_inv64(uint64_t x)
+{
+	uint64_t x2, x3, x12, x15, x240;
+
+	x2 = gf_mul64(x, x);
+	x3 = gf_mul64(x2, x);
+	x12 = gf_mul64(x3, x3);
+	x12 = gf_mul64(x12, x12);
+	x15 = gf_mul64(x12, x3);
+	x240 = gf_mul64(x15, x15);
+	x240 = gf_mul64(x240, x240);
+	x240 = gf_mul64(x240, x240);
+	x240 = gf_mul64(x240, x240);
+
+	return gf_mul64(gf_mul64(x240, x12), x2);
+}
+
+static inline uint64_t rotl8x8(uint64_t x, unsigned int n)
+{
+	return ((x << n) & (LANES * ((0xff << n) & 0xff))) |
+	       ((x >> (8 - n)) & (LANES * (0xff >> (8 - n))));
+}
+
+static uint64_t aes_sub64(uint64_t x)
+{
+	x = gf_inv64(x);
+	return x ^ rotl8x8(x, 1) ^ rotl8x8(x, 2) ^ rotl8x8(x, 3) ^ rotl8x8(x, 4) ^ (LANES * 0x63);
+}
+
+static uint64_t aes_inv_sub64(uint64_t x)
+{
+	return gf_inv64(rotl8x8(x, 1) ^ rotl8x8(x, 3) ^ rotl8x8(x, 6) ^ (LANES * 0x05));
+}
+
+static void aes_sub_bytes(uint8_t s[BLOCK_SIZE], bool inverse)
+{
+	uint64_t x[2];
+
+	memcpy(x, s, sizeof(x));
+	x[0] = inverse ? aes_inv_sub64(x[0]) : aes_sub64(x[0]);
+	x[1] = inverse ? aes_inv_sub64(x[1]) : aes_sub64(x[1]);
+	memcpy(s, x, sizeof(x));
+}
+
+static void aes_shift_rows(uint8_t s[BLOCK_SIZE], bool inverse)
+{
+	uint8_t t[BLOCK_SIZE];
+	int r, c;
+
+	for (c = 0; c < 4; c++)
+		for (r = 0; r < 4; r++) {
+			if (inverse)
+				t[r + 4 * ((c + r) & 3)] = s[r + 4 * c];
+			else
+				t[r + 4 * c] = s[r + 4 * ((c + r) & 3)];
+		}
+
+	memcpy(s, t, sizeof(t));
+}
+
+static inline uint32_t xtime32(uint32_t a)
+{
+	return ((a & 0x7f7f7f7f) << 1) ^ (((a >> 7) & 0x01010101) * 0x1b);
+}
+
+static void aes_mix_columns(uint8_t s[BLOCK_SIZE], bool inverse)
+{
+	uint32_t w, t;
+	int c;
+
+	for (c = 0; c < 4; c++) {
+		w = load_le32(s + 4 * c);
+		if (inverse)
+			w ^= xtime32(xtime32(w ^ ror32(w, 16)));
+		t = ror32(w, 8);
+		w = xtime32(w ^ t) ^ t ^ ror32(w, 16) ^ ror32(w, 24);
+		store_le32(s + 4 * c, w);
+	}
+}
+
+static inline void xor_block(uint8_t *out, const uint8_t *a, const uint8_t *b)
+{
+	int i;
+
+	for (i = 0; i < BLOCK_SIZE; i++)
+		out[i] = a[i] ^ b[i];
+}
+
+static void aes_encrypt_generic(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct aes_key *k = &key->aes;
+	uint8_t s[BLOCK_SIZE];
+	unsigned int i;
+
+	xor_block(s, in, k->rk[0]);
+	for (i = 1; i <= k->rounds; i++) {
+		aes_sub_bytes(s, false);
+		aes_shift_rows(s, false);
+		if (i != k->rounds)
+			aes_mix_columns(s, false);
+		xor_block(s, s, k->rk[i]);
+	}
+
+	memcpy(out, s, BLOCK_SIZE);
+	crypt_backend_memzero(s, sizeof(s));
+}
+
+static void aes_decrypt_generic(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct aes_key *k = &key->aes;
+	uint8_t s[BLOCK_SIZE];
+	unsigned int i;
+
+	xor_block(s, in, k->rk[k->rounds]);
+	for (i = k->rounds; i > 0; i--) {
+		aes_shift_rows(s, true);
+		aes_sub_bytes(s, true);
+		xor_block(s, s, k->rk[i - 1]);
+		if (i != 1)
+			aes_mix_columns(s, true);
+	}
+
+	memcpy(out, s, BLOCK_SIZE);
+	crypt_backend_memzero(s, sizeof(s));
+}
+
+#if AES_X86
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_aesni(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct aes_key *k = &key->aes;
+	__m128i s;
+	unsigned int i;
+
+	s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in),
+			  _mm_loadu_si128((const __m128i *)k->rk[0]));
+	for (i = 1; i < k->rounds; i++)
+		s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i *)k->rk[i]));
+	s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i *)k->rk[k->rounds]));
+
+	_mm_storeu_si128((__m128i *)out, s);
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_decrypt_aesni(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct aes_key *k = &key->aes;
+	__m128i s;
+	unsigned int i;
+
+	s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in),
+			  _mm_loadu_si128((const __m128i *)k->dk[0]));
+	for (i = 1; i < k->rounds; i++)
+		s = _mm_aesdec_si128(s, _mm_loadu_si128((const __m128i *)k->dk[i]));
+	s = _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i *)k->dk[k->rounds]));
+
+	_mm_storeu_si128((__m128i *)out, s);
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_setkey_aesni(struct aes_key *k)
+{
+	unsigned int i;
+
+	memcpy(k->dk[0], k->rk[k->rounds], BLOCK_SIZE);
+	for (i = 1; i < k->rounds; i++)
+		_mm_storeu_si128((__m128i *)k->dk[i],
+			_mm_aesimc_si128(_mm_loadu_si128((const __m128i *)k->rk[k->rounds - i])));
+	memcpy(k->dk[k->rounds], k->rk[0], BLOCK_SIZE);
+}
+
+static bool cpu_has_aesni(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+#endif
+
+static int aes_setkey(union cipher_key *key, const uint8_t *k, size_t key_length)
+{
+	struct aes_key *a = &key->aes;
+	uint8_t w[60][4], t[4], rcon = 1;
+	uint64_t x;
+	unsigned int i, nk;
+
+	if (key_length != 16 && key_length != 24 && key_length != 32)
+		return -EINVAL;
+
+	nk = key_length / 4;
+	a->rounds = nk + 6;
+	memcpy(w, k, key_length);
+
+	for (i = nk; i < 4 * (a->rounds + 1); i++) {
+		memcpy(t, w[i - 1], 4);
+		if (i % nk == 0) {
+			t[0] = w[i - 1][1];
+			t[1] = w[i - 1][2];
+			t[2] = w[i - 1][3];
+			t[3] = w[i - 1][0];
+		}
+		if (i % nk == 0 || (nk > 6 && i % nk == 4)) {
+			x = load_le32(t);
+			store_le32(t, (uint32_t)aes_sub64(x));
+		}
+		if (i % nk == 0) {
+			t[0] ^= rcon;
+			rcon = (uint8_t)((rcon << 1) ^ ((rcon >> 7) * 0x1b));
+		}
+		w[i][0] = w[i - nk][0] ^ t[0];
+		w[i][1] = w[i - nk][1] ^ t[1];
+		w[i][2] = w[i - nk][2] ^ t[2];
+		w[i][3] = w[i - nk][3] ^ t[3];
+	}
+
+	memcpy(a->rk, w, 16 * (a->rounds + 1));
+	crypt_backend_memzero(w, sizeof(w));
+	crypt_backend_memzero(t, sizeof(t));
+
+	a->aesni = false;
+#if AES_X86
+	if (cpu_has_aesni()) {
+		aes_setkey_aesni(a);
+		a->aesni = true;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Serpent (bitsliced variant, compatible with Linux kernel implementation)
+ */
+static const uint8_t serpent_sbox[8][16] = {
+	{  3,  8, 15,  1, 10,  6,  5, 11, 14, 13,  4,  2,  7,  0,  9, 12 },
+	{ 15, 12,  2,  7,  9,  0,  5, 10,  1, 11, 14,  8,  6, 13,  3,  4 },
+	{  8,  6,  7,  9,  3, 12, 10, 15, 13,  1, 14,  4,  0, 11,  5,  2 },
+	{  0, 15, 11,  8, 12,  9,  6,  3, 13,  1,  2,  4, 10,  7,  5, 14 },
+	{  1, 15,  8,  3, 12,  0, 11,  6,  2,  5,  4, 10,  9, 14,  7, 13 },
+	{ 15,  5,  2, 11,  4, 10,  9, 12,  0,  3, 14,  8, 13,  6,  7,  1 },
+	{  7,  2, 12,  5,  8,  4,  6, 11, 14,  9,  1, 15, 13,  3, 10,  0 },
+	{  1, 13, 15,  0, 14,  8,  2, 11,  7,  4, 12, 10,  9,  3,  5,  6 }
+};
+
+#define SERPENT_PHI 0x9e3779b9
+
+/*
+ * S-box applied to 32 4-bit columns (bit i of column from word x[i]) as sum
+ * of minterms. Only the (public) table drives branches.
+ */
+static void serpent_sbox_apply(unsigned int sbox, uint32_t x[4], bool inverse)
+{
+	const uint8_t *s = serpent_sbox[sbox];
+	uint32_t y[4] = { 0, 0, 0, 0 }, m;
+	unsigned int v, in, out, b;
+
+	for (v = 0; v < 16; v++) {
+		in = inverse ? s[v] : v;
+		out = inverse ? v : s[v];
+		m = ((in & 1) ? x[0] : ~x[0]) & ((in & 2) ? x[1] : ~x[1]) &
+		    ((in & 4) ? x[2] : ~x[2]) & ((in & 8) ? x[3] : ~x[3]);
+		for (b = 0; b < 4; b++)
+			if (out & (1 << b))
+				y[b] |= m;
+	}
+
+	memcpy(x, y, sizeof(y));
+}
+
+static void serpent_lt(uint32_t x[4])
+{
+	x[0] = rol32(x[0], 13);
+	x[2] = rol32(x[2], 3);
+	x[1] ^= x[0] ^ x[2];
+	x[3] ^= x[2] ^ (x[0] << 3);
+	x[1] = rol32(x[1], 1);
+	x[3] = rol32(x[3], 7);
+	x[0] ^= x[1] ^ x[3];
+	x[2] ^= x[3] ^ (x[1] << 7);
+	x[0] = rol32(x[0], 5);
+	x[2] = rol32(x[2], 22);
+}
+
+static void serpent_inv_lt(uint32_t x[4])
+{
+	x[2] = ror32(x[2], 22);
+	x[0] = ror32(x[0], 5);
+	x[2] ^= x[3] ^ (x[1] << 7);
+	x[0] ^= x[1] ^ x[3];
+	x[3] = ror32(x[3], 7);
+	x[1] = ror32(x[1], 1);
+	x[3] ^= x[2] ^ (x[0] << 3);
+	x[1] ^= x[0] ^ x[2];
+	x[2] = ror32(x[2], 3);
+	x[0] = ror32(x[0], 13);
+}
+
+static inline void serpent_xor_key(uint32_t x[4], const uint32_t k[4])
+{
+	x[0] ^= k[0];
+	x[1] ^= k[1];
+	x[2] ^= k[2];
+	x[3] ^= k[3];
+}
+
+static void serpent_encrypt(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct serpent_key *k = &key->serpent;
+	uint32_t x[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		x[i] = load_le32(in + 4 * i);
+
+	for (i = 0; i < 32; i++) {
+		serpent_xor_key(x, k->k[i]);
+		serpent_sbox_apply(i & 7, x, false);
+		if (i != 31)
+			serpent_lt(x);
+	}
+	serpent_xor_key(x, k->k[32]);
+
+	for (i = 0; i < 4; i++)
+		store_le32(out + 4 * i, x[i]);
+	crypt_backend_memzero(x, sizeof(x));
+}
+
+static void serpent_decrypt(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct serpent_key *k = &key->serpent;
+	uint32_t x[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		x[i] = load_le32(in + 4 * i);
+
+	serpent_xor_key(x, k->k[32]);
+	for (i = 31; i >= 0; i--) {
+		if (i != 31)
+			serpent_inv_lt(x);
+		serpent_sbox_apply(i & 7, x, true);
+		serpent_xor_key(x, k->k[i]);
+	}
+
+	for (i = 0; i < 4; i++)
+		store_le32(out + 4 * i, x[i]);
+	crypt_backend_memzero(x, sizeof(x));
+}
+
+static int serpent_setkey(union cipher_key *key, const uint8_t *k, size_t key_length)
+{
+	struct serpent_key *s = &key->serpent;
+	uint8_t k8[32];
+	uint32_t w[140];
+	int i;
+
+	if (key_length > sizeof(k8))
+		return -EINVAL;
+
+	/* short keys are padded with one bit and zeroes */
+	memset(k8, 0, sizeof(k8));
+	memcpy(k8, k, key_length);
+	if (key_length < sizeof(k8))
+		k8[key_length] = 1;
+
+	for (i = 0; i < 8; i++)
+		w[i] = load_le32(k8 + 4 * i);
+	for (i = 8; i < 140; i++)
+		w[i] = rol32(w[i - 8] ^ w[i - 5] ^ w[i - 3] ^ w[i - 1] ^
+			     SERPENT_PHI ^ (uint32_t)(i - 8), 11);
+
+	for (i = 0; i < 33; i++) {
+		memcpy(s->k[i], &w[8 + 4 * i], sizeof(s->k[i]));
+		serpent_sbox_apply((3 - i) & 7, s->k[i], false);
+	}
+
+	crypt_backend_memzero(k8, sizeof(k8));
+	crypt_backend_memzero(w, sizeof(w));
+	return 0;
+}
+
+/*
+ * Twofish
+ */
+
+/* 4-bit permutations t0..t3 of q0 and q1, entry i in bits 4i..4i+3 */
+static const uint64_t twofish_q[2][4] = {
+	{ UINT64_C(0x4ACE95B023F6D718), UINT64_C(0xD9076A4F53218BCE),
+	  UINT64_C(0x17423F8C09D6E5AB), UINT64_C(0xAC5803B9E6214F7D) },
+	{ UINT64_C(0x5CA04913E67FDB82), UINT64_C(0x809F5AD673C4B2E1),
+	  UINT64_C(0xF3B28DE0A96157C4), UINT64_C(0xA802F746ED3C159B) }
+};
+
+static inline unsigned int ror4(unsigned int x)
+{
+	return ((x >> 1) | (x << 3)) & 0xf;
+}
+
+static uint8_t twofish_qperm(unsigned int q, uint8_t x)
+{
+	const uint64_t *t = twofish_q[q];
+	unsigned int a0, b0, a1, b1;
+
+	a0 = x >> 4;
+	b0 = x & 0xf;
+	a1 = a0 ^ b0;
+	b1 = (a0 ^ ror4(b0) ^ (a0 << 3)) & 0xf;
+	a0 = (t[0] >> (4 * a1)) & 0xf;
+	b0 = (t[1] >> (4 * b1)) & 0xf;
+	a1 = a0 ^ b0;
+	b1 = (a0 ^ ror4(b0) ^ (a0 << 3)) & 0xf;
+	a0 = (t[2] >> (4 * a1)) & 0xf;
+	b0 = (t[3] >> (4 * b1)) & 0xf;
+
+	return (uint8_t)((b0 << 4) | a0);
+}
+
+/* multiplication by public constant in GF(2^8) */
+static inline uint8_t gf_mul_const(uint8_t x, uint8_t c, unsigned int poly)
+{
+	unsigned int r = 0, a = x;
+
+	while (c) {
+		if (c & 1)
+			r ^= a;
+		a = (a << 1) ^ (poly & -(a >> 7));
+		a &= 0xff;
+		c >>= 1;
+	}
+
+	return (uint8_t)r;
+}
+
+#define TWOFISH_MDS_POLY 0x169
+#define TWOFISH_RS_POLY  0x14d
+
+static const uint8_t twofish_mds[4][4] = {
+	{ 0x01, 0xef, 0x5b, 0x5b },
+	{ 0x5b, 0xef, 0xef, 0x01 },
+	{ 0xef, 0x5b, 0x01, 0xef },
+	{ 0xef, 0x01, 0xef, 0x5b }
+};
+
+static const uint8_t twofish_rs[4][8] = {
+	{ 0x01, 0xa4, 0x55, 0x87, 0x5a, 0x58, 0xdb, 0x9e },
+	{ 0xa4, 0x56, 0x82, 0xf3, 0x1e, 0xc6, 0x68, 0xe5 },
+	{ 0x02, 0xa1, 0xfc, 0xc1, 0x47, 0xae, 0x3d, 0x19 },
+	{ 0xa4, 0x55, 0x87, 0x5a, 0x58, 0xdb, 0x9e, 0x03 }
+};
+
+/* q-permutation used in stage i (0 = last stage before MDS) for byte j */
+static const uint8_t twofish_h_q[5][4] = {
+	{ 1, 0, 1, 0 },
+	{ 0, 0, 1, 1 },
+	{ 0, 1, 0, 1 },
+	{ 1, 1, 0, 0 },
+	{ 1, 0, 0, 1 }
+};
+
+static uint32_t twofish_h(uint32_t x, const uint32_t *l, unsigned int k)
+{
+	uint8_t y[4];
+	uint32_t z = 0;
+	int i, j;
+
+	for (j = 0; j < 4; j++)
+		y[j] = (uint8_t)(x >> (8 * j));
+
+	for (i = k; i >= 0; i--)
+		for (j = 0; j < 4; j++) {
+			y[j] = twofish_qperm(twofish_h_q[i][j], y[j]);
+			if (i)
+				y[j] ^= (uint8_t)(l[i - 1] >> (8 * j));
+		}
+
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 4; j++)
+			z ^= (uint32_t)gf_mul_const(y[j], twofish_mds[i][j], TWOFISH_MDS_POLY) << (8 * i);
+
+	return z;
+}
+
+static void twofish_round(const struct twofish_key *k, uint32_t *r, int round, bool inverse)
+{
+	uint32_t t0, t1, f0, f1;
+
+	t0 = twofish_h(r[0], k->s, k->words);
+	t1 = twofish_h(rol32(r[1], 8), k->s, k->words);
+	f0 = t0 + t1 + k->k[2 * round + 8];
+	f1 = t0 + 2 * t1 + k->k[2 * round + 9];
+
+	if (inverse) {
+		r[2] = rol32(r[2], 1) ^ f0;
+		r[3] = ror32(r[3] ^ f1, 1);
+	} else {
+		r[2] = ror32(r[2] ^ f0, 1);
+		r[3] = rol32(r[3], 1) ^ f1;
+	}
+}
+
+static void twofish_encrypt(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct twofish_key *k = &key->twofish;
+	uint32_t r[4], t;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		r[i] = load_le32(in + 4 * i) ^ k->k[i];
+
+	for (i = 0; i < 16; i++) {
+		twofish_round(k, r, i, false);
+		t = r[0]; r[0] = r[2]; r[2] = t;
+		t = r[1]; r[1] = r[3]; r[3] = t;
+	}
+
+	for (i = 0; i < 4; i++)
+		store_le32(out + 4 * i, r[(i + 2) & 3] ^ k->k[i + 4]);
+	crypt_backend_memzero(r, sizeof(r));
+}
+
+static void twofish_decrypt(const union cipher_key *key, uint8_t *out, const uint8_t *in)
+{
+	const struct twofish_key *k = &key->twofish;
+	uint32_t r[4], t;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		r[(i + 2) & 3] = load_le32(in + 4 * i) ^ k->k[i + 4];
+
+	for (i = 15; i >= 0; i--) {
+		t = r[0]; r[0] = r[2]; r[2] = t;
+		t = r[1]; r[1] = r[3]; r[3] = t;
+		twofish_round(k, r, i, true);
+	}
+
+	for (i = 0; i < 4; i++)
+		store_le32(out + 4 * i, r[i] ^ k->k[i]);
+	crypt_backend_memzero(r, sizeof(r));
+}
+
+static int twofish_setkey(union cipher_key *key, const uint8_t *k, size_t key_length)
+{
+	struct twofish_key *tf = &key->twofish;
+	uint32_t me[4], mo[4], a, b;
+	unsigned int i, j, n;
+	uint8_t s;
+
+	if (key_length != 16 && key_length != 24 && key_length != 32)
+		return -EINVAL;
+
+	n = key_length / 8;
+	tf->words = n;
+
+	for (i = 0; i < n; i++) {
+		me[i] = load_le32(k + 8 * i);
+		mo[i] = load_le32(k + 8 * i + 4);
+
+		/* S vector is in reversed order */
+		tf->s[n - 1 - i] = 0;
+		for (j = 0; j < 4; j++) {
+			s = 0;
+			for (a = 0; a < 8; a++)
+				s ^= gf_mul_const(k[8 * i + a], twofish_rs[j][a], TWOFISH_RS_POLY);
+			tf->s[n - 1 - i] |= (uint32_t)s << (8 * j);
+		}
+	}
+
+	for (i = 0; i < 20; i++) {
+		a = twofish_h(UINT32_C(0x02020202) * i, me, n);
+		b = rol32(twofish_h(UINT32_C(0x02020202) * i + UINT32_C(0x01010101), mo, n), 8);
+		tf->k[2 * i] = a + b;
+		tf->k[2 * i + 1] = rol32(a + 2 * b, 9);
+	}
+
+	crypt_backend_memzero(me, sizeof(me));
+	crypt_backend_memzero(mo, sizeof(mo));
+	return 0;
+}
+
+/*
+ * Modes
+ */
+struct cipher_alg {
+	const char *name;
+	int (*setkey)(union cipher_key *key, const uint8_t *k, size_t key_length);
+	block_fn encrypt;
+	block_fn decrypt;
+};
+
+static const struct cipher_alg cipher_algs[] = {
+	{ "aes",     aes_setkey,     aes_encrypt_generic, aes_decrypt_generic },
+	{ "serpent", serpent_setkey, serpent_encrypt,     serpent_decrypt },
+	{ "twofish", twofish_setkey, twofish_encrypt,     twofish_decrypt },
+	{ NULL,      NULL,           NULL,                NULL }
+};
+
+static int cipher_setkey(struct crypt_cipher_bundled *ctx, const struct cipher_alg *alg,
+			 union cipher_key *key, const void *k, size_t key_length)
+{
+	int r;
+
+	r = alg->setkey(key, k, key_length);
+	if (r < 0)
+		return r;
+
+	ctx->encrypt = alg->encrypt;
+	ctx->decrypt = alg->decrypt;
+#if AES_X86
+	if (alg->setkey == aes_setkey && key->aes.aesni) {
+		ctx->encrypt = aes_encrypt_aesni;
+		ctx->decrypt = aes_decrypt_aesni;
+	}
+#endif
+	return 0;
+}
+
+int crypt_cipher_init_bundled(struct crypt_cipher_bundled **ctx, const char *name,
+			      const char *mode, const void *key, size_t key_length)
+{
+	struct crypt_cipher_bundled *h;
+	const struct cipher_alg *alg;
+	int r;
+
+	for (alg = cipher_algs; alg->name; alg++)
+		if (!strcmp(alg->name, name))
+			break;
+	if (!alg->name)
+		return -ENOENT;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+	memset(h, 0, sizeof(*h));
+
+	if (!strcmp(mode, "ecb"))
+		h->mode = MODE_ECB;
+	else if (!strcmp(mode, "cbc"))
+		h->mode = MODE_CBC;
+	else if (!strcmp(mode, "xts"))
+		h->mode = MODE_XTS;
+	else {
+		free(h);
+		return -ENOENT;
+	}
+
+	if (h->mode == MODE_XTS) {
+		if (key_length % 2)
+			r = -EINVAL;
+		else {
+			key_length /= 2;
+			r = cipher_setkey(h, alg, &h->tweak_key, (const char *)key + key_length, key_length);
+		}
+		if (!r)
+			r = cipher_setkey(h, alg, &h->key, key, key_length);
+	} else
+		r = cipher_setkey(h, alg, &h->key, key, key_length);
+
+	if (r < 0) {
+		crypt_cipher_destroy_bundled(h);
+		return r;
+	}
+
+	*ctx = h;
+	return 0;
+}
+
+void crypt_cipher_destroy_bundled(struct crypt_cipher_bundled *ctx)
+{
+	if (!ctx)
+		return;
+
+	crypt_backend_memzero(ctx, sizeof(*ctx));
+	free(ctx);
+}
+
+/* multiply tweak by x in GF(2^128), little-endian (IEEE P1619) */
+static void xts_next_tweak(uint8_t t[BLOCK_SIZE])
+{
+	unsigned int carry = 0, c;
+	int i;
+
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		c = t[i] >> 7;
+		t[i] = (uint8_t)((t[i] << 1) | carry);
+		carry = c;
+	}
+	t[0] ^= 0x87 & -carry;
+}
+
+static int cipher_crypt(struct crypt_cipher_bundled *ctx,
+			const char *in, char *out, size_t length,
+			const char *iv, size_t iv_length, bool encrypt)
+{
+	const uint8_t *src = (const uint8_t *)in;
+	uint8_t *dst = (uint8_t *)out;
+	uint8_t chain[BLOCK_SIZE], tmp[BLOCK_SIZE];
+	block_fn fn = encrypt ? ctx->encrypt : ctx->decrypt;
+	size_t i;
+
+	if (!in || !out || !length || length % BLOCK_SIZE)
+		return -EINVAL;
+
+	if (ctx->mode == MODE_ECB) {
+		if (iv_length)
+			return -EINVAL;
+	} else if (!iv || iv_length != BLOCK_SIZE)
+		return -EINVAL;
+
+	if (ctx->mode == MODE_XTS)
+		ctx->encrypt(&ctx->tweak_key, chain, (const uint8_t *)iv);
+	else if (ctx->mode == MODE_CBC)
+		memcpy(chain, iv, BLOCK_SIZE);
+
+	for (i = 0; i < length; i += BLOCK_SIZE) {
+		switch (ctx->mode) {
+		case MODE_ECB:
+			fn(&ctx->key, dst + i, src + i);
+			break;
+		case MODE_CBC:
+			if (encrypt) {
+				xor_block(tmp, src + i, chain);
+				fn(&ctx->key, dst + i, tmp);
+				memcpy(chain, dst + i, BLOCK_SIZE);
+			} else {
+				/* in and out can be the same buffer */
+				memcpy(tmp, src + i, BLOCK_SIZE);
+				fn(&ctx->key, dst + i, tmp);
+				xor_block(dst + i, dst + i, chain);
+				memcpy(chain, tmp, BLOCK_SIZE);
+			}
+			break;
+		case MODE_XTS:
+			xor_block(tmp, src + i, chain);
+			fn(&ctx->key, tmp, tmp);
+			xor_block(dst + i, tmp, chain);
+			xts_next_tweak(chain);
+			break;
+		}
+	}
+
+	crypt_backend_memzero(chain, sizeof(chain));
+	crypt_backend_memzero(tmp, sizeof(tmp));
+	return 0;
+}
+
+int crypt_cipher_encrypt_bundled(struct crypt_cipher_bundled *ctx,
+				 const char *in, char *out, size_t length,
+				 const char *iv, size_t iv_length)
+{
+	return cipher_crypt(ctx, in, out, length, iv, iv_length, true);
+}
+
+int crypt_cipher_decrypt_bundled(struct crypt_cipher_bundled *ctx,
+				 const char *in, char *out, size_t length,
+				 const char *iv, size_t iv_length)
+{
+	return cipher_crypt(ctx, in, out, length, iv, iv_length, false);
+}
@@ -20,7 +20,10 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include "bitops.h"
 #include "crypto_backend_internal.h"
 
 #ifndef CLOCK_MONOTONIC_RAW
@@ -159,3 +162,296 @@ int crypt_cipher_perf_kernel(const char *name, const char *mode, char *buffer, s
 
 	return  0;
 }
+
+/*
+ * Per-sector IV generator emulation (sector numbers in 512-byte units as dm-crypt
+ * uses by default). Without generator the fixed IV is used for every sector.
+ */
+struct perf_iv {
+	enum { PERF_IV_FIXED, PERF_IV_PLAIN, PERF_IV_PLAIN64, PERF_IV_ESSIV } type;
+	struct crypt_cipher_kernel essiv;
+	size_t iv_size;
+	uint64_t sector;
+	char *ivs;
+};
+
+static int perf_iv_init(struct perf_iv *piv, const char *name, const char *iv_name,
+			const char *key, size_t key_size, const char *iv, size_t iv_size,
+			size_t sectors)
+{
+	struct crypt_hash *h;
+	char essiv_key[64];
+	int hash_size, r;
+	size_t i;
+
+	memset(piv, 0, sizeof(*piv));
+	piv->essiv.tfmfd = piv->essiv.opfd = -1;
+	piv->essiv.pipefd[0] = piv->essiv.pipefd[1] = -1;
+	piv->iv_size = iv_size;
+
+	if (!iv_name || !iv_size)
+		piv->type = PERF_IV_FIXED;
+	else if (!strcmp(iv_name, "plain"))
+		piv->type = PERF_IV_PLAIN;
+	else if (!strcmp(iv_name, "plain64"))
+		piv->type = PERF_IV_PLAIN64;
+	else if (!strncmp(iv_name, "essiv:", 6))
+		piv->type = PERF_IV_ESSIV;
+	else
+		return -ENOTSUP;
+
+	if (piv->type != PERF_IV_FIXED && iv_size < sizeof(uint64_t))
+		return -EINVAL;
+
+	if (!iv_size)
+		return 0;
+
+	piv->ivs = malloc(sectors * iv_size);
+	if (!piv->ivs)
+		return -ENOMEM;
+
+	if (piv->type == PERF_IV_FIXED) {
+		for (i = 0; i < sectors; i++)
+			memcpy(&piv->ivs[i * iv_size], iv, iv_size);
+		return 0;
+	}
+
+	if (piv->type != PERF_IV_ESSIV)
+		return 0;
+
+	hash_size = crypt_hash_size(&iv_name[6]);
+	if (hash_size <= 0 || (size_t)hash_size > sizeof(essiv_key))
+		return -ENOTSUP;
+
+	if (crypt_hash_init(&h, &iv_name[6]))
+		return -ENOTSUP;
+	r = crypt_hash_write(h, key, key_size);
+	if (!r)
+		r = crypt_hash_final(h, essiv_key, hash_size);
+	crypt_hash_destroy(h);
+
+	if (!r)
+		r = crypt_cipher_init_kernel(&piv->essiv, name, "ecb", essiv_key, hash_size);
+	crypt_backend_memzero(essiv_key, sizeof(essiv_key));
+
+	return r;
+}
+
+/* IVs for all sectors of one request, ESSIV is encrypted in one ECB call */
+static int perf_iv_generate(struct perf_iv *piv, size_t sectors, size_t sector_size)
+{
+	uint64_t val;
+	uint32_t val32;
+	size_t i;
+
+	if (piv->type == PERF_IV_FIXED)
+		return 0;
+
+	memset(piv->ivs, 0, sectors * piv->iv_size);
+	for (i = 0; i < sectors; i++, piv->sector += sector_size >> 9) {
+		if (piv->type == PERF_IV_PLAIN) {
+			val32 = cpu_to_le32(piv->sector & 0xffffffff);
+			memcpy(&piv->ivs[i * piv->iv_size], &val32, sizeof(val32));
+		} else {
+			val = cpu_to_le64(piv->sector);
+			memcpy(&piv->ivs[i * piv->iv_size], &val, sizeof(val));
+		}
+	}
+
+	if (piv->type == PERF_IV_ESSIV)
+		return crypt_cipher_encrypt_kernel(&piv->essiv, piv->ivs, piv->ivs,
+						   sectors * piv->iv_size, NULL, 0);
+	return 0;
+}
+
+static void perf_iv_destroy(struct perf_iv *piv)
+{
+	crypt_cipher_destroy_kernel(&piv->essiv);
+	free(piv->ivs);
+}
+
+/*
+ * Process buffer repeatedly in sector_size requests (as dm-crypt does) for duration_ms.
+ * If iv_name is set, IV for every sector is generated by this IV generator
+ * (plain, plain64 or essiv:<hash>), otherwise fixed iv is used.
+ * Time of every pass over buffer is stored in op_ms (the first max_samples),
+ * ops is number of processed buffers and total_ms the measured time.
+ */
+int crypt_cipher_perf_sectors_kernel(const char *name, const char *mode, char *buffer, size_t buffer_size,
+				     size_t sector_size, const char *key, size_t key_size,
+				     const char *iv, size_t iv_size, const char *iv_name,
+				     int encrypt, double duration_ms,
+				     double *op_ms, size_t max_samples, size_t *ops, double *total_ms)
+{
+	struct crypt_cipher_kernel cipher;
+	struct timespec start, op_start, end;
+	struct perf_iv piv;
+	size_t sectors;
+	double ms;
+	size_t n = 0;
+	int r;
+
+	if (!sector_size || !buffer_size || buffer_size % sector_size)
+		return -EINVAL;
+
+	*ops = 0;
+	*total_ms = 0.0;
+	sectors = buffer_size / sector_size;
+
+	r = perf_iv_init(&piv, name, iv_name, key, key_size, iv, iv_size, sectors);
+	if (r < 0) {
+		perf_iv_destroy(&piv);
+		return r;
+	}
+
+	r = crypt_cipher_init_kernel(&cipher, name, mode, key, key_size);
+	if (r < 0) {
+		perf_iv_destroy(&piv);
+		return r;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &start) < 0) {
+		r = -EINVAL;
+		goto out;
+	}
+	op_start = start;
+
+	while (*total_ms < duration_ms) {
+		r = perf_iv_generate(&piv, sectors, sector_size);
+		if (r < 0)
+			break;
+
+		if (encrypt)
+			r = crypt_cipher_encrypt_sectors_kernel(&cipher, buffer, buffer, buffer_size,
+								sector_size, piv.ivs, iv_size);
+		else
+			r = crypt_cipher_decrypt_sectors_kernel(&cipher, buffer, buffer, buffer_size,
+								sector_size, piv.ivs, iv_size);
+		if (r < 0)
+			break;
+
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &end) < 0) {
+			r = -EINVAL;
+			break;
+		}
+
+		time_ms(&op_start, &end, &ms);
+		if (n < max_samples)
+			op_ms[n] = ms;
+		n++;
+		time_ms(&start, &end, total_ms);
+		op_start = end;
+	}
+
+	*ops = n;
+	if (!r && *total_ms < CIPHER_TIME_MIN_MS)
+		r = -ERANGE;
+out:
+	crypt_cipher_destroy_kernel(&cipher);
+	perf_iv_destroy(&piv);
+
+	return r;
+}
+
+/*
+ * AEAD variant of the per-sector benchmark (dm-crypt with integrity).
+ * Every sector is one AEAD request with associated data of sector number
+ * and IV (as dm-crypt uses) and tag_size bytes of authentication tag.
+ * IV is fixed per sector (random IV generation is not measured),
+ * decryption verifies tags of data sealed before the measurement.
+ */
+int crypt_aead_perf_sectors_kernel(const char *name, const char *mode, const char *integrity,
+				   size_t buffer_size, size_t sector_size,
+				   const char *key, size_t key_size, size_t auth_key_size,
+				   size_t iv_size, size_t tag_size,
+				   int encrypt, double duration_ms,
+				   double *op_ms, size_t max_samples, size_t *ops, double *total_ms)
+{
+	struct crypt_cipher_kernel aead;
+	struct timespec start, op_start, end;
+	char *plain = NULL, *sealed = NULL, *ivs = NULL;
+	size_t i, sectors, assoc_size, plain_size, sealed_size;
+	uint64_t val;
+	double ms;
+	size_t n = 0;
+	int r;
+
+	if (!sector_size || !buffer_size || buffer_size % sector_size ||
+	    !iv_size || !tag_size)
+		return -EINVAL;
+
+	*ops = 0;
+	*total_ms = 0.0;
+	sectors = buffer_size / sector_size;
+	assoc_size = sizeof(uint64_t) + iv_size;
+	plain_size = assoc_size + sector_size;
+	sealed_size = plain_size + tag_size;
+
+	r = crypt_aead_init_kernel(&aead, name, mode, integrity, key, key_size,
+				   auth_key_size, tag_size);
+	if (r < 0)
+		return r;
+
+	plain = calloc(sectors, plain_size);
+	sealed = calloc(sectors, sealed_size);
+	ivs = calloc(sectors, iv_size);
+	if (!plain || !sealed || !ivs) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* Associated data is little-endian sector number followed by IV */
+	for (i = 0; i < sectors; i++) {
+		val = cpu_to_le64(i * (sector_size >> 9));
+		memcpy(&ivs[i * iv_size], &val, iv_size < sizeof(val) ? iv_size : sizeof(val));
+		memcpy(&plain[i * plain_size], &val, sizeof(val));
+		memcpy(&plain[i * plain_size + sizeof(val)], &ivs[i * iv_size], iv_size);
+	}
+
+	if (!encrypt) {
+		r = crypt_aead_encrypt_sectors_kernel(&aead, plain, sealed, sectors, sector_size,
+						      assoc_size, tag_size, ivs, iv_size);
+		if (r < 0)
+			goto out;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &start) < 0) {
+		r = -EINVAL;
+		goto out;
+	}
+	op_start = start;
+
+	while (*total_ms < duration_ms) {
+		if (encrypt)
+			r = crypt_aead_encrypt_sectors_kernel(&aead, plain, sealed, sectors, sector_size,
+							      assoc_size, tag_size, ivs, iv_size);
+		else
+			r = crypt_aead_decrypt_sectors_kernel(&aead, sealed, plain, sectors, sector_size,
+							      assoc_size, tag_size, ivs, iv_size);
+		if (r < 0)
+			break;
+
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &end) < 0) {
+			r = -EINVAL;
+			break;
+		}
+
+		time_ms(&op_start, &end, &ms);
+		if (n < max_samples)
+			op_ms[n] = ms;
+		n++;
+		time_ms(&start, &end, total_ms);
+		op_start = end;
+	}
+
+	*ops = n;
+	if (!r && *total_ms < CIPHER_TIME_MIN_MS)
+		r = -ERANGE;
+out:
+	crypt_cipher_destroy_kernel(&aead);
+	free(plain);
+	free(sealed);
+	free(ivs);
+
+	return r;
+}
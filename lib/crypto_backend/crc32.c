@@ -39,9 +39,18 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "crypto_backend.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32_ARM 1
+#include <arm_acle.h>
+#endif
+
 static const uint32_t crc32_tab[] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
 	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
@@ -172,12 +181,149 @@ static uint32_t compute_crc32(
 	return crc;
 }
 
+#if CRC32_X86
+/* CRC32C (Castagnoli) is directly implemented by SSE4.2 crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t compute_crc32c_sse42(uint32_t seed, const unsigned char *buf, size_t len)
+{
+	uint64_t crc = seed, v;
+
+	for (; len && ((uintptr_t)buf & 7); len--)
+		crc = _mm_crc32_u8((uint32_t)crc, *buf++);
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, sizeof(v));
+		crc = _mm_crc32_u64(crc, v);
+	}
+
+	for (; len; len--)
+		crc = _mm_crc32_u8((uint32_t)crc, *buf++);
+
+	return (uint32_t)crc;
+}
+
+/*
+ * CRC32 (IEEE) by carry-less multiplication folding, see Intel paper
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * Constants are for the bit-reflected polynomial 0xedb88320.
+ */
+#define CRC32_FOLD_MIN 64
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t compute_crc32_pclmul(uint32_t seed, const unsigned char *buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+	size_t tail;
+
+	if (len < CRC32_FOLD_MIN)
+		return compute_crc32(crc32_tab, seed, buf, len);
+
+	tail = len & 15;
+	len -= tail;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)seed));
+	buf += 64;
+	len -= 64;
+
+	/* fold four 128-bit lanes in parallel */
+	for (; len >= 64; len -= 64, buf += 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+	}
+
+	/* fold lanes into one */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+	for (; len >= 16; len -= 16, buf += 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)buf));
+	}
+
+	/* 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return compute_crc32(crc32_tab, (uint32_t)_mm_extract_epi32(x1, 1), buf, tail);
+}
+#endif
+
+#if CRC32_ARM
+static uint32_t compute_crc32_arm(uint32_t seed, const unsigned char *buf, size_t len, int castagnoli)
+{
+	uint32_t crc = seed;
+	uint64_t v;
+
+	for (; len && ((uintptr_t)buf & 7); len--, buf++)
+		crc = castagnoli ? __crc32cb(crc, *buf) : __crc32b(crc, *buf);
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, sizeof(v));
+		crc = castagnoli ? __crc32cd(crc, v) : __crc32d(crc, v);
+	}
+
+	for (; len; len--, buf++)
+		crc = castagnoli ? __crc32cb(crc, *buf) : __crc32b(crc, *buf);
+
+	return crc;
+}
+#endif
+
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len)
 {
+#if CRC32_X86
+	if (len >= CRC32_FOLD_MIN && __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		return compute_crc32_pclmul(seed, buf, len);
+#elif CRC32_ARM
+	return compute_crc32_arm(seed, buf, len, 0);
+#endif
 	return compute_crc32(crc32_tab, seed, buf, len);
 }
 
 uint32_t crypt_crc32c(uint32_t seed, const unsigned char *buf, size_t len)
 {
+#if CRC32_X86
+	if (__builtin_cpu_supports("sse4.2"))
+		return compute_crc32c_sse42(seed, buf, len);
+#elif CRC32_ARM
+	return compute_crc32_arm(seed, buf, len, 1);
+#endif
 	return compute_crc32(crc32c_tab, seed, buf, len);
 }
@@ -54,6 +54,26 @@ int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length);
 int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length);
 void crypt_hash_destroy(struct crypt_hash *ctx);
 
+/*
+ * Hash many equally sized blocks, every digest is calculated over
+ * prefix || block || suffix (both prefix and suffix are optional).
+ * Digests are stored digest_stride bytes apart, context must not contain
+ * any pending data.
+ */
+int crypt_hash_many(struct crypt_hash *ctx,
+		    const char *prefix, size_t prefix_length,
+		    const char *suffix, size_t suffix_length,
+		    const char *buffer, size_t block_size, size_t blocks,
+		    char *digests, size_t digest_size, size_t digest_stride);
+
+/*
+ * Iterated SHA-256, every round replaces digest (32 bytes) with
+ * SHA-256(digest || data || le64(counter)) and increments counter.
+ * Input length is fixed, so rounds avoid any hash context overhead.
+ */
+int crypt_sha256_chain(char *digest, const char *data, size_t data_length,
+		       uint64_t counter, uint64_t iterations);
+
 /* HMAC */
 int crypt_hmac_size(const char *name);
 int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
@@ -88,6 +108,26 @@ int crypt_pbkdf_perf(const char *kdf, const char *hash,
 		uint32_t *iterations_out, uint32_t *memory_out,
 		int (*progress)(uint32_t time_ms, void *usrptr), void *usrptr);
 
+/*
+ * Abort hook for PBKDF running in the calling thread (NULL to unset).
+ * If abort returns non-zero, crypt_pbkdf() fails with -ECANCELED.
+ * Only internal PBKDF2 (between iteration batches) and internal Argon2
+ * (between segments) implementations check it.
+ */
+void crypt_pbkdf_set_abort(int (*abort)(void *usrptr), void *usrptr);
+
+/*
+ * Argon2 memory arena and thread options for PBKDF running in the calling thread.
+ * Memory is allocated by mmap (huge pages are used if possible) and pre-faulted,
+ * memory type returns allocation method used by the last Argon2 call.
+ * Internal Argon2 runs lanes on a persistent worker pool, CPU affinity pins
+ * each pool worker to a separate CPU.
+ */
+#define CRYPT_ARGON2_MEMORY_LOCK  (1 << 0)
+#define CRYPT_ARGON2_CPU_AFFINITY (1 << 1)
+void crypt_argon2_set_memory_flags(uint32_t flags);
+const char *crypt_argon2_memory_type(bool *locked);
+
 /* CRC32 */
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len);
 uint32_t crypt_crc32c(uint32_t seed, const unsigned char *buf, size_t len);
@@ -112,12 +152,33 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length);
+/*
+ * Process length / sector_size independent sectors in one call,
+ * ivs contains IV (of iv_length) for every sector.
+ */
+int crypt_cipher_encrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length);
+int crypt_cipher_decrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length);
 bool crypt_cipher_kernel_only(struct crypt_cipher *ctx);
 
 /* Benchmark of kernel cipher performance */
 int crypt_cipher_perf_kernel(const char *name, const char *mode, char *buffer, size_t buffer_size,
 			     const char *key, size_t key_size, const char *iv, size_t iv_size,
 			     double *encryption_mbs, double *decryption_mbs);
+int crypt_cipher_perf_sectors_kernel(const char *name, const char *mode, char *buffer, size_t buffer_size,
+				     size_t sector_size, const char *key, size_t key_size,
+				     const char *iv, size_t iv_size, const char *iv_name,
+				     int encrypt, double duration_ms,
+				     double *op_ms, size_t max_samples, size_t *ops, double *total_ms);
+int crypt_aead_perf_sectors_kernel(const char *name, const char *mode, const char *integrity,
+				   size_t buffer_size, size_t sector_size,
+				   const char *key, size_t key_size, size_t auth_key_size,
+				   size_t iv_size, size_t tag_size,
+				   int encrypt, double duration_ms,
+				   double *op_ms, size_t max_samples, size_t *ops, double *total_ms);
 
 /* Check availability of a cipher (in kernel only) */
 int crypt_cipher_check_kernel(const char *name, const char *mode,
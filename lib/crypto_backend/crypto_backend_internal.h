@@ -31,17 +31,45 @@ int pkcs5_pbkdf2(const char *hash,
 		 unsigned int dkLen, char *DK,
 		 unsigned int hash_block_size);
 
+/* PBKDF abort hook of the calling thread */
+int crypt_pbkdf_aborted(void);
+void crypt_pbkdf_get_abort(int (**abort)(void *usrptr), void **usrptr);
+
 /* Argon2 implementation wrapper */
 int argon2(const char *type, const char *password, size_t password_length,
 	   const char *salt, size_t salt_length,
 	   char *key, size_t key_length,
 	   uint32_t iterations, uint32_t memory, uint32_t parallel);
+/* CRYPT_ARGON2_* options of the calling thread */
+uint32_t crypt_argon2_get_memory_flags(void);
+
+/* Batch hashing: generic fallback */
+int crypt_hash_many_generic(struct crypt_hash *ctx,
+			    const char *prefix, size_t prefix_length,
+			    const char *suffix, size_t suffix_length,
+			    const char *buffer, size_t block_size, size_t blocks,
+			    char *digests, size_t digest_size, size_t digest_stride);
+
+/* Block ciphers: bundled userspace fallback (AES, Serpent, Twofish; ECB, CBC and XTS) */
+struct crypt_cipher_bundled;
+
+int crypt_cipher_init_bundled(struct crypt_cipher_bundled **ctx, const char *name,
+			      const char *mode, const void *key, size_t key_length);
+int crypt_cipher_encrypt_bundled(struct crypt_cipher_bundled *ctx,
+				 const char *in, char *out, size_t length,
+				 const char *iv, size_t iv_length);
+int crypt_cipher_decrypt_bundled(struct crypt_cipher_bundled *ctx,
+				 const char *in, char *out, size_t length,
+				 const char *iv, size_t iv_length);
+void crypt_cipher_destroy_bundled(struct crypt_cipher_bundled *ctx);
 
 /* Block ciphers: fallback to kernel crypto API */
 
 struct crypt_cipher_kernel {
 	int tfmfd;
 	int opfd;
+	int pipefd[2]; /* zero-copy (splice) path, created on first use */
+	bool no_splice;
 };
 
 int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
@@ -52,7 +80,25 @@ int crypt_cipher_encrypt_kernel(struct crypt_cipher_kernel *ctx,
 int crypt_cipher_decrypt_kernel(struct crypt_cipher_kernel *ctx,
 				const char *in, char *out, size_t length,
 				const char *iv, size_t iv_length);
+int crypt_cipher_encrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+					const char *in, char *out, size_t length,
+					size_t sector_size, const char *ivs, size_t iv_length);
+int crypt_cipher_decrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+					const char *in, char *out, size_t length,
+					size_t sector_size, const char *ivs, size_t iv_length);
 void crypt_cipher_destroy_kernel(struct crypt_cipher_kernel *ctx);
+int crypt_aead_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
+			   const char *mode, const char *integrity,
+			   const void *key, size_t key_length, size_t auth_key_length,
+			   size_t tag_length);
+int crypt_aead_encrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+				      const char *in, char *out, size_t count,
+				      size_t sector_size, uint32_t assoc_length, size_t tag_length,
+				      const char *ivs, size_t iv_length);
+int crypt_aead_decrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+				      const char *in, char *out, size_t count,
+				      size_t sector_size, uint32_t assoc_length, size_t tag_length,
+				      const char *ivs, size_t iv_length);
 int crypt_bitlk_decrypt_key_kernel(const void *key, size_t key_length,
 				   const char *in, char *out, size_t length,
 				   const char *iv, size_t iv_length,
@@ -24,9 +24,12 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include "bitops.h"
 #include "crypto_backend_internal.h"
 
 #ifdef ENABLE_AF_ALG
@@ -40,10 +43,22 @@
 #define SOL_ALG 279
 #endif
 
+#ifndef ALG_SET_AEAD_ASSOCLEN
+#define ALG_SET_AEAD_ASSOCLEN 4
+#endif
 #ifndef ALG_SET_AEAD_AUTHSIZE
 #define ALG_SET_AEAD_AUTHSIZE 5
 #endif
 
+/* rtattr type of authenc() key parameter (crypto/authenc.h) */
+#define CRYPTO_AUTHENC_KEYA_PARAM 1
+
+/* Default pipe capacity, longer requests are sent by sendmsg */
+#define SPLICE_MAX_PAGES 16
+
+/* Maximal length of one request merged from sectors without IV */
+#define SECTORS_MAX_REQUEST (64 * 1024)
+
 /*
  * ciphers
  *
@@ -59,6 +74,8 @@ static int _crypt_cipher_init(struct crypt_cipher_kernel *ctx,
 		return -EINVAL;
 
 	ctx->opfd = -1;
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
+	ctx->no_splice = false;
 	ctx->tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
 	if (ctx->tfmfd < 0) {
 		crypt_cipher_destroy_kernel(ctx);
@@ -108,24 +125,101 @@ int crypt_cipher_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
 	return _crypt_cipher_init(ctx, key, key_length, 0, &sa);
 }
 
-/* The in/out should be aligned to page boundary */
-static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
+/* Zero-copy path is used only for whole pages of page aligned buffer */
+static bool _crypt_cipher_can_splice(struct crypt_cipher_kernel *ctx,
+				     const char *in, size_t in_length)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (ctx->no_splice || page_size <= 0 ||
+	    (uintptr_t)in % page_size || in_length % page_size ||
+	    in_length > (size_t)page_size * SPLICE_MAX_PAGES)
+		return false;
+
+	if (ctx->pipefd[0] < 0 && pipe2(ctx->pipefd, O_CLOEXEC) < 0) {
+		ctx->pipefd[0] = ctx->pipefd[1] = -1;
+		ctx->no_splice = true;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Failed request can leave operation, IV or part of data queued in the op
+ * socket (sent with MSG_MORE). Replace the socket, the next request must not
+ * continue the broken one. Key is set on the tfm socket, so it is kept.
+ */
+static void _crypt_cipher_reset(struct crypt_cipher_kernel *ctx)
+{
+	if (ctx->opfd >= 0)
+		close(ctx->opfd);
+	ctx->opfd = accept(ctx->tfmfd, NULL, 0);
+}
+
+/*
+ * Operation and IV are already set by sendmsg with MSG_MORE, data pages
+ * are mapped to pipe and spliced into the socket without copying.
+ *
+ * Returns 1 if vmsplice is not supported (nothing was queued),
+ * caller then sends data in the usual way.
+ */
+static int _crypt_cipher_splice(struct crypt_cipher_kernel *ctx,
+				const char *in, size_t in_length)
+{
+	struct iovec iov = {
+		.iov_base = (void*)(uintptr_t)in,
+		.iov_len = in_length,
+	};
+	ssize_t len;
+
+	len = vmsplice(ctx->pipefd[1], &iov, 1, 0);
+	if (len <= 0) {
+		ctx->no_splice = true;
+		return 1;
+	}
+
+	if (len != (ssize_t)in_length ||
+	    splice(ctx->pipefd[0], NULL, ctx->opfd, NULL, in_length, 0) != (ssize_t)in_length) {
+		/* Pipe can contain stale data now, do not use it anymore */
+		close(ctx->pipefd[0]);
+		close(ctx->pipefd[1]);
+		ctx->pipefd[0] = ctx->pipefd[1] = -1;
+		ctx->no_splice = true;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * The in/out should be aligned to page boundary.
+ * Process count consecutive requests of in_length/out_length, each request
+ * with its own IV from ivs array. Control message is prepared only once,
+ * but skcipher socket accepts only one IV per request, so every request
+ * is still one send and one read.
+ * For AEAD, every request starts with assoc_length bytes of associated data.
+ */
+static int _crypt_cipher_crypt_many(struct crypt_cipher_kernel *ctx,
 			       const char *in, size_t in_length,
 			       char *out, size_t out_length,
-			       const char *iv, size_t iv_length,
+			       const char *ivs, size_t iv_length,
+			       size_t count, uint32_t assoc_length,
 			       uint32_t direction)
 {
 	int r = 0;
+	size_t i;
 	ssize_t len;
-	struct af_alg_iv *alg_iv;
+	struct af_alg_iv *alg_iv = NULL;
 	struct cmsghdr *header;
 	uint32_t *type;
 	struct iovec iov = {
 		.iov_base = (void*)(uintptr_t)in,
 		.iov_len = in_length,
 	};
-	int iv_msg_size = iv ? CMSG_SPACE(sizeof(*alg_iv) + iv_length) : 0;
-	char buffer[CMSG_SPACE(sizeof(*type)) + iv_msg_size];
+	int iv_msg_size = ivs ? CMSG_SPACE(sizeof(*alg_iv) + iv_length) : 0;
+	int assoc_msg_size = assoc_length ? CMSG_SPACE(sizeof(assoc_length)) : 0;
+	char buffer[CMSG_SPACE(sizeof(*type)) + iv_msg_size + assoc_msg_size];
 	struct msghdr msg = {
 		.msg_control = buffer,
 		.msg_controllen = sizeof(buffer),
@@ -133,10 +227,10 @@ static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 		.msg_iovlen = 1,
 	};
 
-	if (!in || !out || !in_length)
+	if (!in || !out || !in_length || !count)
 		return -EINVAL;
 
-	if ((!iv && iv_length) || (iv && !iv_length))
+	if ((!ivs && iv_length) || (ivs && !iv_length))
 		return -EINVAL;
 
 	memset(buffer, 0, sizeof(buffer));
@@ -153,7 +247,7 @@ static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 	*type = direction;
 
 	/* Set IV */
-	if (iv) {
+	if (ivs) {
 		header = CMSG_NXTHDR(&msg, header);
 		if (!header)
 			return -EINVAL;
@@ -163,22 +257,76 @@ static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
 		header->cmsg_len = iv_msg_size;
 		alg_iv = (void*)CMSG_DATA(header);
 		alg_iv->ivlen = iv_length;
-		memcpy(alg_iv->iv, iv, iv_length);
 	}
 
-	len = sendmsg(ctx->opfd, &msg, 0);
-	if (len != (ssize_t)(in_length))
-		r = -EIO;
-	else {
-		len = read(ctx->opfd, out, out_length);
-		if (len != (ssize_t)out_length)
+	/* Set length of associated data */
+	if (assoc_length) {
+		header = CMSG_NXTHDR(&msg, header);
+		if (!header)
+			return -EINVAL;
+
+		header->cmsg_level = SOL_ALG;
+		header->cmsg_type = ALG_SET_AEAD_ASSOCLEN;
+		header->cmsg_len = CMSG_LEN(sizeof(assoc_length));
+		memcpy(CMSG_DATA(header), &assoc_length, sizeof(assoc_length));
+	}
+
+	for (i = 0; i < count; i++) {
+		iov.iov_base = (void*)(uintptr_t)(in + i * in_length);
+		if (alg_iv)
+			memcpy(alg_iv->iv, ivs + i * iv_length, iv_length);
+
+		if (_crypt_cipher_can_splice(ctx, iov.iov_base, in_length)) {
+			/* Only operation and IV, data follows */
+			msg.msg_iovlen = 0;
+			if (sendmsg(ctx->opfd, &msg, MSG_MORE) < 0) {
+				r = -EIO;
+				break;
+			}
+			msg.msg_iovlen = 1;
+
+			r = _crypt_cipher_splice(ctx, in + i * in_length, in_length);
+			if (r < 0)
+				break;
+
+			/* Splice not possible, continue the request with data copy */
+			if (r > 0)
+				len = send(ctx->opfd, iov.iov_base, in_length, 0);
+			else
+				len = in_length;
+			r = 0;
+		} else
+			len = sendmsg(ctx->opfd, &msg, 0);
+
+		if (len != (ssize_t)(in_length)) {
+			r = -EIO;
+			break;
+		}
+
+		len = read(ctx->opfd, out + i * out_length, out_length);
+		if (len != (ssize_t)out_length) {
 			r = -EIO;
+			break;
+		}
 	}
 
+	if (r < 0)
+		_crypt_cipher_reset(ctx);
+
 	crypt_backend_memzero(buffer, sizeof(buffer));
 	return r;
 }
 
+static int _crypt_cipher_crypt(struct crypt_cipher_kernel *ctx,
+			       const char *in, size_t in_length,
+			       char *out, size_t out_length,
+			       const char *iv, size_t iv_length,
+			       uint32_t direction)
+{
+	return _crypt_cipher_crypt_many(ctx, in, in_length, out, out_length,
+					iv, iv_length, 1, 0, direction);
+}
+
 int crypt_cipher_encrypt_kernel(struct crypt_cipher_kernel *ctx,
 				const char *in, char *out, size_t length,
 				const char *iv, size_t iv_length)
@@ -195,15 +343,163 @@ int crypt_cipher_decrypt_kernel(struct crypt_cipher_kernel *ctx,
 				   iv, iv_length, ALG_OP_DECRYPT);
 }
 
+/*
+ * Sectors without IV (ECB) are independent, consecutive sectors are merged
+ * into one request. Sectors with IV need one request per sector.
+ */
+static int _crypt_cipher_crypt_sectors(struct crypt_cipher_kernel *ctx,
+				       const char *in, char *out, size_t length,
+				       size_t sector_size, const char *ivs, size_t iv_length,
+				       uint32_t direction)
+{
+	size_t i, chunk;
+	int r;
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	if (ivs)
+		return _crypt_cipher_crypt_many(ctx, in, sector_size, out, sector_size,
+						ivs, iv_length, length / sector_size, 0, direction);
+
+	chunk = SECTORS_MAX_REQUEST - SECTORS_MAX_REQUEST % sector_size;
+	if (!chunk)
+		chunk = sector_size;
+	for (i = 0; i < length; i += chunk) {
+		if (chunk > length - i)
+			chunk = length - i;
+		r = _crypt_cipher_crypt_many(ctx, in + i, chunk, out + i, chunk,
+					     NULL, 0, 1, 0, direction);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+int crypt_cipher_encrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+					const char *in, char *out, size_t length,
+					size_t sector_size, const char *ivs, size_t iv_length)
+{
+	return _crypt_cipher_crypt_sectors(ctx, in, out, length, sector_size,
+					   ivs, iv_length, ALG_OP_ENCRYPT);
+}
+
+int crypt_cipher_decrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+					const char *in, char *out, size_t length,
+					size_t sector_size, const char *ivs, size_t iv_length)
+{
+	return _crypt_cipher_crypt_sectors(ctx, in, out, length, sector_size,
+					   ivs, iv_length, ALG_OP_DECRYPT);
+}
+
+/*
+ * AEAD transformation as used by dm-crypt with integrity (no IV generator in mode).
+ * For authenc() the authentication key is the last auth_key_length bytes of key.
+ */
+int crypt_aead_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
+			   const char *mode, const char *integrity,
+			   const void *key, size_t key_length, size_t auth_key_length,
+			   size_t tag_length)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "aead",
+	};
+	struct {
+		uint16_t rta_len;
+		uint16_t rta_type;
+		uint32_t enckeylen;
+	} param;
+	char *authenc_key;
+	size_t authenc_key_length;
+	int r;
+
+	if (!integrity || !strcmp(integrity, "none") || auth_key_length > key_length)
+		return -EINVAL;
+
+	if (!strcmp(integrity, "poly1305"))
+		r = snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "rfc7539(%s,poly1305)", name);
+	else if (!mode || !*mode)
+		r = snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "%s", name);
+	else if (!strcmp(integrity, "aead") && !strcmp(mode, "ccm"))
+		r = snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "rfc4309(%s(%s))", mode, name);
+	else if (!strcmp(integrity, "aead"))
+		r = snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "%s(%s)", mode, name);
+	else
+		r = snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "authenc(%s,%s(%s))",
+			     integrity, mode, name);
+	if (r < 0 || (size_t)r >= sizeof(sa.salg_name))
+		return -EINVAL;
+
+	if (strncmp((char *)sa.salg_name, "authenc(", 8))
+		return _crypt_cipher_init(ctx, key, key_length, tag_length, &sa);
+
+	/* authenc() key: parameter with encryption key length, authentication key, encryption key */
+	authenc_key_length = sizeof(param) + key_length;
+	authenc_key = malloc(authenc_key_length);
+	if (!authenc_key)
+		return -ENOMEM;
+
+	param.rta_len = sizeof(param);
+	param.rta_type = CRYPTO_AUTHENC_KEYA_PARAM;
+	param.enckeylen = cpu_to_be32(key_length - auth_key_length);
+	memcpy(authenc_key, &param, sizeof(param));
+	memcpy(authenc_key + sizeof(param), (const char *)key + key_length - auth_key_length, auth_key_length);
+	memcpy(authenc_key + sizeof(param) + auth_key_length, key, key_length - auth_key_length);
+
+	r = _crypt_cipher_init(ctx, authenc_key, authenc_key_length, tag_length, &sa);
+
+	crypt_backend_memzero(authenc_key, authenc_key_length);
+	free(authenc_key);
+
+	return r;
+}
+
+/*
+ * Process count sectors, every request is assoc_length bytes of associated data
+ * followed by sector_size bytes of data (and tag_length bytes of tag for sealed data).
+ */
+int crypt_aead_encrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+				      const char *in, char *out, size_t count,
+				      size_t sector_size, uint32_t assoc_length, size_t tag_length,
+				      const char *ivs, size_t iv_length)
+{
+	if (!sector_size || !assoc_length)
+		return -EINVAL;
+
+	return _crypt_cipher_crypt_many(ctx, in, assoc_length + sector_size,
+					out, assoc_length + sector_size + tag_length,
+					ivs, iv_length, count, assoc_length, ALG_OP_ENCRYPT);
+}
+
+int crypt_aead_decrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+				      const char *in, char *out, size_t count,
+				      size_t sector_size, uint32_t assoc_length, size_t tag_length,
+				      const char *ivs, size_t iv_length)
+{
+	if (!sector_size || !assoc_length)
+		return -EINVAL;
+
+	return _crypt_cipher_crypt_many(ctx, in, assoc_length + sector_size + tag_length,
+					out, assoc_length + sector_size,
+					ivs, iv_length, count, assoc_length, ALG_OP_DECRYPT);
+}
+
 void crypt_cipher_destroy_kernel(struct crypt_cipher_kernel *ctx)
 {
 	if (ctx->tfmfd >= 0)
 		close(ctx->tfmfd);
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
+	if (ctx->pipefd[0] >= 0)
+		close(ctx->pipefd[0]);
+	if (ctx->pipefd[1] >= 0)
+		close(ctx->pipefd[1]);
 
 	ctx->tfmfd = -1;
 	ctx->opfd = -1;
+	ctx->pipefd[0] = ctx->pipefd[1] = -1;
 }
 
 int crypt_cipher_check_kernel(const char *name, const char *mode,
@@ -335,6 +631,39 @@ int crypt_cipher_decrypt_kernel(struct crypt_cipher_kernel *ctx,
 {
 	return -EINVAL;
 }
+int crypt_cipher_encrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+					const char *in, char *out, size_t length,
+					size_t sector_size, const char *ivs, size_t iv_length)
+{
+	return -EINVAL;
+}
+int crypt_cipher_decrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+					const char *in, char *out, size_t length,
+					size_t sector_size, const char *ivs, size_t iv_length)
+{
+	return -EINVAL;
+}
+int crypt_aead_init_kernel(struct crypt_cipher_kernel *ctx, const char *name,
+			   const char *mode, const char *integrity,
+			   const void *key, size_t key_length, size_t auth_key_length,
+			   size_t tag_length)
+{
+	return -ENOTSUP;
+}
+int crypt_aead_encrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+				      const char *in, char *out, size_t count,
+				      size_t sector_size, uint32_t assoc_length, size_t tag_length,
+				      const char *ivs, size_t iv_length)
+{
+	return -EINVAL;
+}
+int crypt_aead_decrypt_sectors_kernel(struct crypt_cipher_kernel *ctx,
+				      const char *in, char *out, size_t count,
+				      size_t sector_size, uint32_t assoc_length, size_t tag_length,
+				      const char *ivs, size_t iv_length)
+{
+	return -EINVAL;
+}
 int crypt_cipher_check_kernel(const char *name, const char *mode,
 			      const char *integrity, size_t key_length)
 {
@@ -270,6 +270,17 @@ void crypt_hash_destroy(struct crypt_hash *ctx)
 	free(ctx);
 }
 
+int crypt_hash_many(struct crypt_hash *ctx,
+		    const char *prefix, size_t prefix_length,
+		    const char *suffix, size_t suffix_length,
+		    const char *buffer, size_t block_size, size_t blocks,
+		    char *digests, size_t digest_size, size_t digest_stride)
+{
+	return crypt_hash_many_generic(ctx, prefix, prefix_length, suffix, suffix_length,
+				       buffer, block_size, blocks,
+				       digests, digest_size, digest_stride);
+}
+
 /* HMAC */
 int crypt_hmac_size(const char *name)
 {
@@ -505,6 +516,56 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 	return 0;
 }
 
+int crypt_cipher_encrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	size_t i;
+
+	if (ctx->use_kernel)
+		return crypt_cipher_encrypt_sectors_kernel(&ctx->u.kernel, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		if (ivs && gcry_cipher_setiv(ctx->u.hd, ivs + i * iv_length, iv_length))
+			return -EINVAL;
+
+		if (gcry_cipher_encrypt(ctx->u.hd, out + i * sector_size, sector_size,
+					in + i * sector_size, sector_size))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int crypt_cipher_decrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	size_t i;
+
+	if (ctx->use_kernel)
+		return crypt_cipher_decrypt_sectors_kernel(&ctx->u.kernel, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		if (ivs && gcry_cipher_setiv(ctx->u.hd, ivs + i * iv_length, iv_length))
+			return -EINVAL;
+
+		if (gcry_cipher_decrypt(ctx->u.hd, out + i * sector_size, sector_size,
+					in + i * sector_size, sector_size))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
 bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 {
 	return ctx->use_kernel;
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <linux/if_alg.h>
@@ -72,8 +73,11 @@ static struct hash_alg hash_algs[] = {
 	{ NULL,        NULL,           0,   0 }
 };
 
+/* Cached bound tfm socket per hash_algs entry, valid after backend init */
+static int hash_tfmfd[sizeof(hash_algs) / sizeof(hash_algs[0])];
+static pthread_mutex_t hash_tfm_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct crypt_hash {
-	int tfmfd;
 	int opfd;
 	int hash_len;
 };
@@ -86,6 +90,8 @@ struct crypt_hmac {
 
 struct crypt_cipher {
 	struct crypt_cipher_kernel ck;
+	/* userspace fallback if the algorithm is not available in kernel */
+	struct crypt_cipher_bundled *bundled;
 };
 
 static int crypt_kernel_socket_init(struct sockaddr_alg *sa, int *tfmfd, int *opfd,
@@ -125,7 +131,7 @@ int crypt_backend_init(bool fips __attribute__((unused)))
 		.salg_type = "hash",
 		.salg_name = "sha256",
 	};
-	int r, tfmfd = -1, opfd = -1;
+	int i, r, tfmfd = -1, opfd = -1;
 
 	if (crypto_backend_initialised)
 		return 0;
@@ -144,13 +150,29 @@ int crypt_backend_init(bool fips __attribute__((unused)))
 	close(tfmfd);
 	close(opfd);
 
+	pthread_mutex_lock(&hash_tfm_lock);
+	for (i = 0; hash_algs[i].name; i++)
+		hash_tfmfd[i] = -1;
 	crypto_backend_initialised = 1;
+	pthread_mutex_unlock(&hash_tfm_lock);
+
 	return 0;
 }
 
 void crypt_backend_destroy(void)
 {
+	int i;
+
+	/* Accepted op sockets keep their tfm referenced in kernel */
+	pthread_mutex_lock(&hash_tfm_lock);
+	if (crypto_backend_initialised)
+		for (i = 0; hash_algs[i].name; i++)
+			if (hash_tfmfd[i] >= 0) {
+				close(hash_tfmfd[i]);
+				hash_tfmfd[i] = -1;
+			}
 	crypto_backend_initialised = 0;
+	pthread_mutex_unlock(&hash_tfm_lock);
 }
 
 uint32_t crypt_backend_flags(void)
@@ -175,6 +197,44 @@ static struct hash_alg *_get_alg(const char *name)
 	return NULL;
 }
 
+/*
+ * Bound tfm socket for unkeyed hash is shared by all contexts, the socket
+ * is created on first use of the algorithm and every context accepts only
+ * its own op socket from it. (HMAC key is tfm property, so HMAC contexts
+ * cannot share it.)
+ */
+static int hash_tfm_get(struct hash_alg *ha)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+	};
+	int *tfmfd = &hash_tfmfd[ha - hash_algs], fd;
+
+	pthread_mutex_lock(&hash_tfm_lock);
+	if (!crypto_backend_initialised) {
+		pthread_mutex_unlock(&hash_tfm_lock);
+		return -EINVAL;
+	}
+
+	fd = *tfmfd;
+	if (fd < 0) {
+		strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name)-1);
+
+		fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			fd = -ENOTSUP;
+		else if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+			close(fd);
+			fd = -ENOENT;
+		} else
+			*tfmfd = fd;
+	}
+	pthread_mutex_unlock(&hash_tfm_lock);
+
+	return fd;
+}
+
 /* HASH */
 int crypt_hash_size(const char *name)
 {
@@ -187,10 +247,7 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 {
 	struct crypt_hash *h;
 	struct hash_alg *ha;
-	struct sockaddr_alg sa = {
-		.salg_family = AF_ALG,
-		.salg_type = "hash",
-	};
+	int tfmfd;
 
 	h = malloc(sizeof(*h));
 	if (!h)
@@ -203,9 +260,14 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 	}
 	h->hash_len = ha->length;
 
-	strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name)-1);
+	tfmfd = hash_tfm_get(ha);
+	if (tfmfd < 0) {
+		free(h);
+		return -EINVAL;
+	}
 
-	if (crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, NULL, 0) < 0) {
+	h->opfd = accept4(tfmfd, NULL, 0, SOCK_CLOEXEC);
+	if (h->opfd < 0) {
 		free(h);
 		return -EINVAL;
 	}
@@ -241,14 +303,23 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
-	if (ctx->tfmfd >= 0)
-		close(ctx->tfmfd);
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
 	memset(ctx, 0, sizeof(*ctx));
 	free(ctx);
 }
 
+int crypt_hash_many(struct crypt_hash *ctx,
+		    const char *prefix, size_t prefix_length,
+		    const char *suffix, size_t suffix_length,
+		    const char *buffer, size_t block_size, size_t blocks,
+		    char *digests, size_t digest_size, size_t digest_stride)
+{
+	return crypt_hash_many_generic(ctx, prefix, prefix_length, suffix, suffix_length,
+				       buffer, block_size, blocks,
+				       digests, digest_size, digest_stride);
+}
+
 /* HMAC */
 int crypt_hmac_size(const char *name)
 {
@@ -373,7 +444,12 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
+	h->bundled = NULL;
 	r = crypt_cipher_init_kernel(&h->ck, name, mode, key, key_length);
+	if (r == -ENOTSUP || r == -ENOENT) {
+		if (!crypt_cipher_init_bundled(&h->bundled, name, mode, key, key_length))
+			r = 0;
+	}
 	if (r < 0) {
 		free(h);
 		return r;
@@ -385,7 +461,10 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 
 void crypt_cipher_destroy(struct crypt_cipher *ctx)
 {
-	crypt_cipher_destroy_kernel(&ctx->ck);
+	if (ctx->bundled)
+		crypt_cipher_destroy_bundled(ctx->bundled);
+	else
+		crypt_cipher_destroy_kernel(&ctx->ck);
 	free(ctx);
 }
 
@@ -393,6 +472,9 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
+	if (ctx->bundled)
+		return crypt_cipher_encrypt_bundled(ctx->bundled, in, out, length, iv, iv_length);
+
 	return crypt_cipher_encrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
 }
 
@@ -400,12 +482,65 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
+	if (ctx->bundled)
+		return crypt_cipher_decrypt_bundled(ctx->bundled, in, out, length, iv, iv_length);
+
 	return crypt_cipher_decrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
 }
 
-bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
+int crypt_cipher_encrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	size_t i;
+	int r;
+
+	if (!ctx->bundled)
+		return crypt_cipher_encrypt_sectors_kernel(&ctx->ck, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		r = crypt_cipher_encrypt_bundled(ctx->bundled, in + i * sector_size,
+						 out + i * sector_size, sector_size,
+						 ivs ? ivs + i * iv_length : NULL, iv_length);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+int crypt_cipher_decrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	size_t i;
+	int r;
+
+	if (!ctx->bundled)
+		return crypt_cipher_decrypt_sectors_kernel(&ctx->ck, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		r = crypt_cipher_decrypt_bundled(ctx->bundled, in + i * sector_size,
+						 out + i * sector_size, sector_size,
+						 ivs ? ivs + i * iv_length : NULL, iv_length);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 {
-	return true;
+	return !ctx->bundled;
 }
 
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
@@ -27,6 +27,10 @@
 #include <nettle/hmac.h>
 #include <nettle/pbkdf2.h>
 #include <nettle/memops.h>
+#if HAVE_NETTLE_XTS_H
+#include <nettle/aes.h>
+#include <nettle/xts.h>
+#endif
 #include "crypto_backend_internal.h"
 
 #if HAVE_NETTLE_VERSION_H
@@ -194,7 +198,22 @@ struct crypt_hmac {
 };
 
 struct crypt_cipher {
-	struct crypt_cipher_kernel ck;
+	bool use_kernel;
+	/* other ciphers if kernel AF_ALG is not available */
+	struct crypt_cipher_bundled *bundled;
+	union {
+	struct crypt_cipher_kernel kernel;
+#if HAVE_NETTLE_XTS_H
+	/* Nettle implements only AES-XTS of the sector modes */
+	struct {
+		size_t key_length;
+		union {
+			struct xts_aes128_key aes128;
+			struct xts_aes256_key aes256;
+		} enc, dec;
+	} lib;
+#endif
+	} u;
 };
 
 uint32_t crypt_backend_flags(void)
@@ -284,6 +303,40 @@ void crypt_hash_destroy(struct crypt_hash *ctx)
 	free(ctx);
 }
 
+/*
+ * Prefix (salt) is processed only once, the intermediate state is copied
+ * for every block.
+ */
+int crypt_hash_many(struct crypt_hash *ctx,
+		    const char *prefix, size_t prefix_length,
+		    const char *suffix, size_t suffix_length,
+		    const char *buffer, size_t block_size, size_t blocks,
+		    char *digests, size_t digest_size, size_t digest_stride)
+{
+	struct crypt_hash prefix_ctx;
+	size_t i;
+
+	if (digest_size > (size_t)ctx->hash->length || digest_stride < digest_size)
+		return -EINVAL;
+
+	if (prefix_length)
+		ctx->hash->update(&ctx->nettle_ctx, prefix_length, (const uint8_t *)prefix);
+	memcpy(&prefix_ctx, ctx, sizeof(prefix_ctx));
+
+	for (i = 0; i < blocks; i++) {
+		if (i)
+			memcpy(&ctx->nettle_ctx, &prefix_ctx.nettle_ctx, sizeof(ctx->nettle_ctx));
+		ctx->hash->update(&ctx->nettle_ctx, block_size, (const uint8_t *)buffer + i * block_size);
+		if (suffix_length)
+			ctx->hash->update(&ctx->nettle_ctx, suffix_length, (const uint8_t *)suffix);
+		ctx->hash->digest(&ctx->nettle_ctx, digest_size, (uint8_t *)digests + i * digest_stride);
+	}
+
+	crypt_hash_restart(ctx);
+	memset(&prefix_ctx, 0, sizeof(prefix_ctx));
+	return 0;
+}
+
 /* HMAC */
 int crypt_hmac_size(const char *name)
 {
@@ -394,6 +447,131 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 }
 
 /* Block ciphers */
+#if HAVE_NETTLE_XTS_H
+static int _cipher_init(struct crypt_cipher *ctx, const char *name,
+			const char *mode, const void *key, size_t key_length)
+{
+	if (strcmp(name, "aes") || strcmp(mode, "xts"))
+		return -ENOENT;
+
+	if (key_length == 2 * AES128_KEY_SIZE) {
+		xts_aes128_set_encrypt_key(&ctx->u.lib.enc.aes128, key);
+		xts_aes128_set_decrypt_key(&ctx->u.lib.dec.aes128, key);
+	} else if (key_length == 2 * AES256_KEY_SIZE) {
+		xts_aes256_set_encrypt_key(&ctx->u.lib.enc.aes256, key);
+		xts_aes256_set_decrypt_key(&ctx->u.lib.dec.aes256, key);
+	} else
+		return -EINVAL;
+
+	ctx->u.lib.key_length = key_length;
+	return 0;
+}
+
+static int _cipher_crypt(struct crypt_cipher *ctx, const char *in, char *out,
+			 size_t length, const char *iv, size_t iv_length, bool enc)
+{
+	if (iv_length != XTS_BLOCK_SIZE || length < XTS_BLOCK_SIZE)
+		return -EINVAL;
+
+	if (ctx->u.lib.key_length == 2 * AES128_KEY_SIZE) {
+		if (enc)
+			xts_aes128_encrypt_message(&ctx->u.lib.enc.aes128, (const uint8_t *)iv,
+						   length, (uint8_t *)out, (const uint8_t *)in);
+		else
+			xts_aes128_decrypt_message(&ctx->u.lib.dec.aes128, (const uint8_t *)iv,
+						   length, (uint8_t *)out, (const uint8_t *)in);
+	} else {
+		if (enc)
+			xts_aes256_encrypt_message(&ctx->u.lib.enc.aes256, (const uint8_t *)iv,
+						   length, (uint8_t *)out, (const uint8_t *)in);
+		else
+			xts_aes256_decrypt_message(&ctx->u.lib.dec.aes256, (const uint8_t *)iv,
+						   length, (uint8_t *)out, (const uint8_t *)in);
+	}
+
+	return 0;
+}
+
+/* Key schedule is computed once in init, every sector uses only its own tweak */
+static int _cipher_crypt_sectors(struct crypt_cipher *ctx, const char *in, char *out,
+				 size_t length, size_t sector_size, const char *ivs,
+				 size_t iv_length, bool enc)
+{
+	size_t i;
+	int r;
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length; i += sector_size, ivs += iv_length) {
+		r = _cipher_crypt(ctx, in + i, out + i, sector_size, ivs, iv_length, enc);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+#else
+static int _cipher_init(struct crypt_cipher *ctx __attribute__((unused)),
+			const char *name __attribute__((unused)),
+			const char *mode __attribute__((unused)),
+			const void *key __attribute__((unused)),
+			size_t key_length __attribute__((unused)))
+{
+	return -ENOENT;
+}
+
+static int _cipher_crypt(struct crypt_cipher *ctx __attribute__((unused)),
+			 const char *in __attribute__((unused)),
+			 char *out __attribute__((unused)),
+			 size_t length __attribute__((unused)),
+			 const char *iv __attribute__((unused)),
+			 size_t iv_length __attribute__((unused)),
+			 bool enc __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
+static int _cipher_crypt_sectors(struct crypt_cipher *ctx __attribute__((unused)),
+				 const char *in __attribute__((unused)),
+				 char *out __attribute__((unused)),
+				 size_t length __attribute__((unused)),
+				 size_t sector_size __attribute__((unused)),
+				 const char *ivs __attribute__((unused)),
+				 size_t iv_length __attribute__((unused)),
+				 bool enc __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+#endif
+
+static int _cipher_bundled_sectors(struct crypt_cipher *ctx,
+				   const char *in, char *out, size_t length,
+				   size_t sector_size, const char *ivs, size_t iv_length,
+				   bool enc)
+{
+	size_t i;
+	int r;
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		if (enc)
+			r = crypt_cipher_encrypt_bundled(ctx->bundled, in + i * sector_size,
+							 out + i * sector_size, sector_size,
+							 ivs ? ivs + i * iv_length : NULL, iv_length);
+		else
+			r = crypt_cipher_decrypt_bundled(ctx->bundled, in + i * sector_size,
+							 out + i * sector_size, sector_size,
+							 ivs ? ivs + i * iv_length : NULL, iv_length);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
 int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		    const char *mode, const void *key, size_t key_length)
 {
@@ -404,19 +582,38 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
-	r = crypt_cipher_init_kernel(&h->ck, name, mode, key, key_length);
+	h->bundled = NULL;
+	if (!_cipher_init(h, name, mode, key, key_length)) {
+		h->use_kernel = false;
+		*ctx = h;
+		return 0;
+	}
+
+	r = crypt_cipher_init_kernel(&h->u.kernel, name, mode, key, key_length);
+	if (r == -ENOTSUP || r == -ENOENT) {
+		if (!crypt_cipher_init_bundled(&h->bundled, name, mode, key, key_length)) {
+			h->use_kernel = false;
+			*ctx = h;
+			return 0;
+		}
+	}
 	if (r < 0) {
 		free(h);
 		return r;
 	}
 
+	h->use_kernel = true;
 	*ctx = h;
 	return 0;
 }
 
 void crypt_cipher_destroy(struct crypt_cipher *ctx)
 {
-	crypt_cipher_destroy_kernel(&ctx->ck);
+	if (ctx->use_kernel)
+		crypt_cipher_destroy_kernel(&ctx->u.kernel);
+	else if (ctx->bundled)
+		crypt_cipher_destroy_bundled(ctx->bundled);
+	crypt_backend_memzero(ctx, sizeof(*ctx));
 	free(ctx);
 }
 
@@ -424,19 +621,59 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
-	return crypt_cipher_encrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
+	if (ctx->use_kernel)
+		return crypt_cipher_encrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
+
+	if (ctx->bundled)
+		return crypt_cipher_encrypt_bundled(ctx->bundled, in, out, length, iv, iv_length);
+
+	return _cipher_crypt(ctx, in, out, length, iv, iv_length, true);
 }
 
 int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
-	return crypt_cipher_decrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
+	if (ctx->use_kernel)
+		return crypt_cipher_decrypt_kernel(&ctx->u.kernel, in, out, length, iv, iv_length);
+
+	if (ctx->bundled)
+		return crypt_cipher_decrypt_bundled(ctx->bundled, in, out, length, iv, iv_length);
+
+	return _cipher_crypt(ctx, in, out, length, iv, iv_length, false);
+}
+
+int crypt_cipher_encrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	if (ctx->use_kernel)
+		return crypt_cipher_encrypt_sectors_kernel(&ctx->u.kernel, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (ctx->bundled)
+		return _cipher_bundled_sectors(ctx, in, out, length, sector_size, ivs, iv_length, true);
+
+	return _cipher_crypt_sectors(ctx, in, out, length, sector_size, ivs, iv_length, true);
+}
+
+int crypt_cipher_decrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	if (ctx->use_kernel)
+		return crypt_cipher_decrypt_sectors_kernel(&ctx->u.kernel, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (ctx->bundled)
+		return _cipher_bundled_sectors(ctx, in, out, length, sector_size, ivs, iv_length, false);
+
+	return _cipher_crypt_sectors(ctx, in, out, length, sector_size, ivs, iv_length, false);
 }
 
-bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
+bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 {
-	return true;
+	return ctx->use_kernel;
 }
 
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
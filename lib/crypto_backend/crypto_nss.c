@@ -61,6 +61,8 @@ struct crypt_hmac {
 
 struct crypt_cipher {
 	struct crypt_cipher_kernel ck;
+	/* userspace fallback if the algorithm is not available in kernel */
+	struct crypt_cipher_bundled *bundled;
 };
 
 static struct hash_alg *_get_alg(const char *name)
@@ -196,6 +198,17 @@ void crypt_hash_destroy(struct crypt_hash *ctx)
 	free(ctx);
 }
 
+int crypt_hash_many(struct crypt_hash *ctx,
+		    const char *prefix, size_t prefix_length,
+		    const char *suffix, size_t suffix_length,
+		    const char *buffer, size_t block_size, size_t blocks,
+		    char *digests, size_t digest_size, size_t digest_stride)
+{
+	return crypt_hash_many_generic(ctx, prefix, prefix_length, suffix, suffix_length,
+				       buffer, block_size, blocks,
+				       digests, digest_size, digest_stride);
+}
+
 /* HMAC */
 int crypt_hmac_size(const char *name)
 {
@@ -352,7 +365,12 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	if (!h)
 		return -ENOMEM;
 
+	h->bundled = NULL;
 	r = crypt_cipher_init_kernel(&h->ck, name, mode, key, key_length);
+	if (r == -ENOTSUP || r == -ENOENT) {
+		if (!crypt_cipher_init_bundled(&h->bundled, name, mode, key, key_length))
+			r = 0;
+	}
 	if (r < 0) {
 		free(h);
 		return r;
@@ -364,7 +382,10 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 
 void crypt_cipher_destroy(struct crypt_cipher *ctx)
 {
-	crypt_cipher_destroy_kernel(&ctx->ck);
+	if (ctx->bundled)
+		crypt_cipher_destroy_bundled(ctx->bundled);
+	else
+		crypt_cipher_destroy_kernel(&ctx->ck);
 	free(ctx);
 }
 
@@ -372,6 +393,9 @@ int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
+	if (ctx->bundled)
+		return crypt_cipher_encrypt_bundled(ctx->bundled, in, out, length, iv, iv_length);
+
 	return crypt_cipher_encrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
 }
 
@@ -379,12 +403,65 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
 {
+	if (ctx->bundled)
+		return crypt_cipher_decrypt_bundled(ctx->bundled, in, out, length, iv, iv_length);
+
 	return crypt_cipher_decrypt_kernel(&ctx->ck, in, out, length, iv, iv_length);
 }
 
-bool crypt_cipher_kernel_only(struct crypt_cipher *ctx __attribute__((unused)))
+int crypt_cipher_encrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	size_t i;
+	int r;
+
+	if (!ctx->bundled)
+		return crypt_cipher_encrypt_sectors_kernel(&ctx->ck, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		r = crypt_cipher_encrypt_bundled(ctx->bundled, in + i * sector_size,
+						 out + i * sector_size, sector_size,
+						 ivs ? ivs + i * iv_length : NULL, iv_length);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+int crypt_cipher_decrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	size_t i;
+	int r;
+
+	if (!ctx->bundled)
+		return crypt_cipher_decrypt_sectors_kernel(&ctx->ck, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size)
+		return -EINVAL;
+
+	for (i = 0; i < length / sector_size; i++) {
+		r = crypt_cipher_decrypt_bundled(ctx->bundled, in + i * sector_size,
+						 out + i * sector_size, sector_size,
+						 ivs ? ivs + i * iv_length : NULL, iv_length);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 {
-	return true;
+	return !ctx->bundled;
 }
 
 int crypt_bitlk_decrypt_key(const void *key, size_t key_length,
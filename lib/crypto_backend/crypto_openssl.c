@@ -40,10 +40,36 @@
 #include <openssl/provider.h>
 #include <openssl/kdf.h>
 #include <openssl/core_names.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+#include <openssl/thread.h>
+#endif
+#include <pthread.h>
 static OSSL_PROVIDER *ossl_legacy = NULL;
 static OSSL_PROVIDER *ossl_default = NULL;
 static OSSL_LIB_CTX  *ossl_ctx = NULL;
 static char backend_version[256] = "OpenSSL";
+
+/*
+ * Library context and providers are loaded on the first algorithm use,
+ * query-only callers (status, UUID, type probes) do not pay for it.
+ */
+static pthread_mutex_t ossl_load_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool ossl_loaded = false;
+static bool ossl_fips = false;
+
+/*
+ * Provider fetch is expensive, fetched algorithms (and failed lookups)
+ * are cached by name until backend exit. Every user gets its own reference.
+ */
+#define FETCH_CACHE_SIZE 32
+struct fetch_cache_entry {
+	char name[64];
+	bool cipher;
+	void *alg;
+};
+static struct fetch_cache_entry fetch_cache[FETCH_CACHE_SIZE];
+static unsigned int fetch_cache_count = 0;
+static pthread_mutex_t fetch_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 #define CONST_CAST(x) (x)(uintptr_t)
@@ -139,9 +165,78 @@ static void HMAC_CTX_free(HMAC_CTX *md)
 	free(md);
 }
 #else
+#if OPENSSL_VERSION_MAJOR >= 3
+static void *fetch_alg(const char *name, bool cipher)
+{
+	return cipher ? (void *)EVP_CIPHER_fetch(ossl_ctx, name, NULL) :
+			(void *)EVP_MD_fetch(ossl_ctx, name, NULL);
+}
+
+static void free_alg(void *alg, bool cipher)
+{
+	if (cipher)
+		EVP_CIPHER_free(alg);
+	else
+		EVP_MD_free(alg);
+}
+
+static int openssl_backend_load(void);
+
+static void *fetch_cached(const char *name, bool cipher)
+{
+	struct fetch_cache_entry *e = NULL;
+	void *alg = NULL;
+	unsigned int i;
+
+	if (!name || openssl_backend_load())
+		return NULL;
+
+	if (strlen(name) >= sizeof(fetch_cache[0].name))
+		return fetch_alg(name, cipher);
+
+	pthread_mutex_lock(&fetch_cache_lock);
+	for (i = 0; i < fetch_cache_count && !e; i++)
+		if (fetch_cache[i].cipher == cipher && !strcmp(fetch_cache[i].name, name))
+			e = &fetch_cache[i];
+
+	if (!e && fetch_cache_count == FETCH_CACHE_SIZE) {
+		pthread_mutex_unlock(&fetch_cache_lock);
+		return fetch_alg(name, cipher);
+	}
+
+	if (!e) {
+		e = &fetch_cache[fetch_cache_count++];
+		strcpy(e->name, name);
+		e->cipher = cipher;
+		e->alg = fetch_alg(name, cipher);
+	}
+
+	if (e->alg && (cipher ? EVP_CIPHER_up_ref(e->alg) : EVP_MD_up_ref(e->alg)) == 1)
+		alg = e->alg;
+	pthread_mutex_unlock(&fetch_cache_lock);
+
+	return alg;
+}
+
+static void fetch_cache_flush(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&fetch_cache_lock);
+	for (i = 0; i < fetch_cache_count; i++)
+		free_alg(fetch_cache[i].alg, fetch_cache[i].cipher);
+	memset(fetch_cache, 0, sizeof(fetch_cache));
+	fetch_cache_count = 0;
+	pthread_mutex_unlock(&fetch_cache_lock);
+}
+#endif
+
 static void openssl_backend_exit(void)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
+	fetch_cache_flush();
+
+	pthread_mutex_lock(&ossl_load_lock);
 	if (ossl_legacy)
 		OSSL_PROVIDER_unload(ossl_legacy);
 	if (ossl_default)
@@ -152,49 +247,76 @@ static void openssl_backend_exit(void)
 	ossl_legacy = NULL;
 	ossl_default = NULL;
 	ossl_ctx = NULL;
+	ossl_loaded = false;
+	pthread_mutex_unlock(&ossl_load_lock);
 #endif
 }
 
-static int openssl_backend_init(bool fips)
-{
-/*
- * OpenSSL >= 3.0.0 provides some algorithms in legacy provider
- */
 #if OPENSSL_VERSION_MAJOR >= 3
+static int openssl_backend_set_version(void)
+{
 	int r;
 
+	r = snprintf(backend_version, sizeof(backend_version), "%s %s%s%s",
+		OpenSSL_version(OPENSSL_VERSION),
+		ossl_default ? "[default]" : "",
+		ossl_legacy  ? "[legacy]" : "",
+		ossl_fips  ? "[fips]" : "");
+
+	return (r < 0 || (size_t)r >= sizeof(backend_version)) ? -EINVAL : 0;
+}
+
+static int openssl_backend_load(void)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&ossl_load_lock);
+	if (ossl_loaded)
+		goto out;
+
 	/*
 	 * In FIPS mode we keep default OpenSSL context & global config
 	 */
-	if (!fips) {
+	if (!ossl_fips) {
 		ossl_ctx = OSSL_LIB_CTX_new();
-		if (!ossl_ctx)
-			return -EINVAL;
+		if (!ossl_ctx) {
+			r = -EINVAL;
+			goto out;
+		}
 
 		ossl_default = OSSL_PROVIDER_try_load(ossl_ctx, "default", 0);
 		if (!ossl_default) {
 			OSSL_LIB_CTX_free(ossl_ctx);
-			return -EINVAL;
+			ossl_ctx = NULL;
+			r = -EINVAL;
+			goto out;
 		}
 
 		/* Optional */
 		ossl_legacy = OSSL_PROVIDER_try_load(ossl_ctx, "legacy", 0);
 	}
 
-	r = snprintf(backend_version, sizeof(backend_version), "%s %s%s%s",
-		OpenSSL_version(OPENSSL_VERSION),
-		ossl_default ? "[default]" : "",
-		ossl_legacy  ? "[legacy]" : "",
-		fips  ? "[fips]" : "");
-
-	if (r < 0 || (size_t)r >= sizeof(backend_version)) {
-		openssl_backend_exit();
-		return -EINVAL;
-	}
+	r = openssl_backend_set_version();
+	ossl_loaded = true;
+out:
+	pthread_mutex_unlock(&ossl_load_lock);
+	return r;
+}
 #endif
+
+static int openssl_backend_init(bool fips)
+{
+/*
+ * OpenSSL >= 3.0.0 provides some algorithms in legacy provider,
+ * providers are loaded later in openssl_backend_load()
+ */
+#if OPENSSL_VERSION_MAJOR >= 3
+	ossl_fips = fips;
+	return openssl_backend_set_version();
+#else
 	return 0;
+#endif
 }
-
 static const char *openssl_backend_version(void)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
@@ -271,7 +393,7 @@ static const char *crypt_hash_compat_name(const char *name)
 static const EVP_MD *hash_id_get(const char *name)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
-	return EVP_MD_fetch(ossl_ctx, crypt_hash_compat_name(name), NULL);
+	return fetch_cached(crypt_hash_compat_name(name), false);
 #else
 	return EVP_get_digestbyname(crypt_hash_compat_name(name));
 #endif
@@ -287,7 +409,7 @@ static void hash_id_free(const EVP_MD *hash_id)
 static const EVP_CIPHER *cipher_type_get(const char *name)
 {
 #if OPENSSL_VERSION_MAJOR >= 3
-	return EVP_CIPHER_fetch(ossl_ctx, name, NULL);
+	return fetch_cached(name, true);
 #else
 	return EVP_get_cipherbyname(name);
 #endif
@@ -350,8 +472,14 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 
 static int crypt_hash_restart(struct crypt_hash *ctx)
 {
+#if OPENSSL_VERSION_MAJOR >= 3
+	/* reuse digest already set in context, no provider lookup */
+	if (EVP_DigestInit_ex2(ctx->md, NULL, NULL) != 1)
+		return -EINVAL;
+#else
 	if (EVP_DigestInit_ex(ctx->md, ctx->hash_id, NULL) != 1)
 		return -EINVAL;
+#endif
 
 	return 0;
 }
@@ -395,6 +523,58 @@ void crypt_hash_destroy(struct crypt_hash *ctx)
 	free(ctx);
 }
 
+/*
+ * Prefix (salt) is processed only once, the intermediate state is cloned
+ * for every block.
+ */
+int crypt_hash_many(struct crypt_hash *ctx,
+		    const char *prefix, size_t prefix_length,
+		    const char *suffix, size_t suffix_length,
+		    const char *buffer, size_t block_size, size_t blocks,
+		    char *digests, size_t digest_size, size_t digest_stride)
+{
+	unsigned char tmp[EVP_MAX_MD_SIZE];
+	unsigned int tmp_len = 0;
+	EVP_MD_CTX *md_prefix = NULL;
+	size_t i;
+	int r = -EINVAL;
+
+	if (!prefix_length)
+		return crypt_hash_many_generic(ctx, NULL, 0, suffix, suffix_length,
+					       buffer, block_size, blocks,
+					       digests, digest_size, digest_stride);
+
+	if (digest_size > (size_t)ctx->hash_len || digest_stride < digest_size)
+		return -EINVAL;
+
+	md_prefix = EVP_MD_CTX_new();
+	if (!md_prefix)
+		return -ENOMEM;
+
+	if (EVP_DigestUpdate(ctx->md, prefix, prefix_length) != 1 ||
+	    EVP_MD_CTX_copy_ex(md_prefix, ctx->md) != 1)
+		goto out;
+
+	for (i = 0; i < blocks; i++) {
+		if (i && EVP_MD_CTX_copy_ex(ctx->md, md_prefix) != 1)
+			goto out;
+		if (EVP_DigestUpdate(ctx->md, buffer + i * block_size, block_size) != 1)
+			goto out;
+		if (suffix_length && EVP_DigestUpdate(ctx->md, suffix, suffix_length) != 1)
+			goto out;
+		if (EVP_DigestFinal_ex(ctx->md, tmp, &tmp_len) != 1 || tmp_len < digest_size)
+			goto out;
+		memcpy(digests + i * digest_stride, tmp, digest_size);
+	}
+	r = 0;
+out:
+	crypt_backend_memzero(tmp, sizeof(tmp));
+	EVP_MD_CTX_free(md_prefix);
+	if (crypt_hash_restart(ctx))
+		r = -EINVAL;
+	return r;
+}
+
 /* HMAC */
 int crypt_hmac_size(const char *name)
 {
@@ -411,6 +591,9 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 		OSSL_PARAM_END
 	};
 
+	if (openssl_backend_load())
+		return -EINVAL;
+
 	h = malloc(sizeof(*h));
 	if (!h)
 		return -ENOMEM;
@@ -560,6 +743,9 @@ static int openssl_pbkdf2(const char *password, size_t password_length,
 		OSSL_PARAM_END
 	};
 
+	if (openssl_backend_load())
+		return -EINVAL;
+
 	pbkdf2 = EVP_KDF_fetch(ossl_ctx, "pbkdf2", NULL);
 	if (!pbkdf2)
 		return -EINVAL;
@@ -589,12 +775,96 @@ static int openssl_pbkdf2(const char *password, size_t password_length,
 	return r == 1 ? 0 : -EINVAL;
 }
 
+#if OPENSSL_VERSION_MAJOR >= 3 && defined(OSSL_KDF_PARAM_ARGON2_LANES) && defined(OSSL_KDF_PARAM_THREADS)
+#define OPENSSL_ARGON2 1
+/*
+ * OpenSSL >= 3.2 Argon2 runs lanes in parallel only if the library context
+ * thread pool is configured and has enough available threads, derive fails
+ * otherwise. Returns -ENOTSUP if threads cannot be used.
+ */
+static int openssl_argon2_derive(const char *type, const char *password, size_t password_length,
+	const char *salt, size_t salt_length, char *key, size_t key_length,
+	uint32_t iterations, uint32_t memory, uint32_t parallel, uint32_t threads)
+{
+	EVP_KDF_CTX *ctx;
+	EVP_KDF *argon2;
+	int r;
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_octet_string(OSSL_KDF_PARAM_PASSWORD,
+			CONST_CAST(void*)password, password_length),
+		OSSL_PARAM_octet_string(OSSL_KDF_PARAM_SALT,
+			CONST_CAST(void*)salt, salt_length),
+		OSSL_PARAM_uint32(OSSL_KDF_PARAM_ITER, &iterations),
+		OSSL_PARAM_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &parallel),
+		OSSL_PARAM_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memory),
+		OSSL_PARAM_uint32(OSSL_KDF_PARAM_THREADS, &threads),
+		OSSL_PARAM_END
+	};
+
+	if (openssl_backend_load())
+		return -ENOTSUP;
+
+	if (threads > 1) {
+		if (OSSL_get_max_threads(ossl_ctx) < threads &&
+		    OSSL_set_max_threads(ossl_ctx, threads) != 1)
+			return -ENOTSUP;
+		/* Thread pool support can be compiled out (no-thread-pool) */
+		if (OSSL_get_max_threads(ossl_ctx) < threads)
+			return -ENOTSUP;
+	}
+
+	argon2 = EVP_KDF_fetch(ossl_ctx, type, NULL);
+	if (!argon2)
+		return -ENOTSUP;
+
+	ctx = EVP_KDF_CTX_new(argon2);
+	if (!ctx) {
+		EVP_KDF_free(argon2);
+		return -EINVAL;
+	}
+
+	/* Fails if the pool has not enough free threads now (e.g. concurrent use) */
+	r = EVP_KDF_derive(ctx, (unsigned char*)key, key_length, params);
+
+	EVP_KDF_CTX_free(ctx);
+	EVP_KDF_free(argon2);
+
+	return r == 1 ? 0 : -ENOTSUP;
+}
+#else
+#define OPENSSL_ARGON2 0
+#endif
+
 static int openssl_argon2(const char *type, const char *password, size_t password_length,
 	const char *salt, size_t salt_length, char *key, size_t key_length,
 	uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
-	return argon2(type, password, password_length, salt, salt_length,
-		      key, key_length, iterations, memory, parallel);
+	int r;
+#if OPENSSL_ARGON2
+	int (*abort)(void *usrptr);
+	void *usrptr;
+
+	/*
+	 * Use OpenSSL only if it really runs lanes in parallel and no option
+	 * it cannot honor is set (abort hook, memory lock or worker CPU affinity),
+	 * otherwise multi-threaded bundled (or libargon2) implementation is used.
+	 */
+	crypt_pbkdf_get_abort(&abort, &usrptr);
+	if (parallel > 1 && !abort && !crypt_argon2_get_memory_flags() &&
+	    !openssl_argon2_derive(type, password, password_length,
+			salt, salt_length, key, key_length, iterations, memory, parallel, parallel))
+		return 0;
+#endif
+	r = argon2(type, password, password_length, salt, salt_length,
+		   key, key_length, iterations, memory, parallel);
+
+#if OPENSSL_ARGON2
+	/* No other Argon2 implementation available, run single-threaded */
+	if (r == -EINVAL && !openssl_argon2_derive(type, password, password_length,
+			salt, salt_length, key, key_length, iterations, memory, parallel, 1))
+		r = 0;
+#endif
+	return r;
 }
 
 /* PBKDF */
@@ -778,6 +1048,73 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			       (unsigned char *)out, length, (const unsigned char*)iv, iv_length);
 }
 
+/*
+ * Without IV (ECB) the whole batch is processed in one update call.
+ * Otherwise only IV is set for every sector (init without cipher and key
+ * keeps the key schedule). Padding is disabled and sectors are multiple
+ * of block size, so no final call is needed, the next init resets state.
+ */
+static int _cipher_crypt_sectors(EVP_CIPHER_CTX *hd, const unsigned char *in,
+				 unsigned char *out, size_t length, size_t sector_size,
+				 const unsigned char *ivs, size_t iv_length, int enc)
+{
+	size_t i;
+	int len;
+
+	if (!iv_length) {
+		if (length > INT_MAX)
+			return -EINVAL;
+		if (EVP_CipherUpdate(hd, out, &len, in, length) != 1 || (size_t)len != length)
+			return -EINVAL;
+		return 0;
+	}
+
+	for (i = 0; i < length; i += sector_size, ivs += iv_length) {
+		if (EVP_CipherInit_ex(hd, NULL, NULL, NULL, ivs, enc) != 1)
+			return -EINVAL;
+
+		if (EVP_CipherUpdate(hd, out + i, &len, in + i, sector_size) != 1 ||
+		    (size_t)len != sector_size)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int crypt_cipher_encrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	if (ctx->use_kernel)
+		return crypt_cipher_encrypt_sectors_kernel(&ctx->u.kernel, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size || sector_size > INT_MAX ||
+	    ctx->u.lib.iv_length != iv_length)
+		return -EINVAL;
+
+	return _cipher_crypt_sectors(ctx->u.lib.hd_enc, (const unsigned char *)in,
+				     (unsigned char *)out, length, sector_size,
+				     (const unsigned char *)ivs, iv_length, 1);
+}
+
+int crypt_cipher_decrypt_sectors(struct crypt_cipher *ctx,
+				 const char *in, char *out, size_t length,
+				 size_t sector_size, const char *ivs, size_t iv_length)
+{
+	if (ctx->use_kernel)
+		return crypt_cipher_decrypt_sectors_kernel(&ctx->u.kernel, in, out, length,
+							   sector_size, ivs, iv_length);
+
+	if (!sector_size || length % sector_size || sector_size > INT_MAX ||
+	    ctx->u.lib.iv_length != iv_length)
+		return -EINVAL;
+
+	return _cipher_crypt_sectors(ctx->u.lib.hd_dec, (const unsigned char *)in,
+				     (unsigned char *)out, length, sector_size,
+				     (const unsigned char *)ivs, iv_length, 0);
+}
+
 bool crypt_cipher_kernel_only(struct crypt_cipher *ctx)
 {
 	return ctx->use_kernel;
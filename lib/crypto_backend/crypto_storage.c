@@ -21,12 +21,16 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <strings.h>
 #include "bitops.h"
 #include "crypto_backend.h"
 
 #define SECTOR_SHIFT	9
 
+/* Number of sectors passed to cipher backend in one call */
+#define STORAGE_BATCH_SECTORS 64
+
 /*
  * Internal IV helper
  * IV documentation: https://gitlab.com/cryptsetup/cryptsetup/wikis/DMCrypt
@@ -34,7 +38,6 @@
 struct crypt_sector_iv {
 	enum { IV_NONE, IV_NULL, IV_PLAIN, IV_PLAIN64, IV_ESSIV, IV_BENBI, IV_PLAIN64BE, IV_EBOIV } type;
 	int iv_size;
-	char *iv;
 	struct crypt_cipher *cipher;
 	int shift;
 };
@@ -45,6 +48,7 @@ struct crypt_storage {
 	unsigned iv_shift;
 	struct crypt_cipher *cipher;
 	struct crypt_sector_iv cipher_iv;
+	char *ivs; /* IVs for STORAGE_BATCH_SECTORS */
 };
 
 static int int_log2(unsigned int x)
@@ -142,62 +146,64 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 	} else
 		return -ENOENT;
 
-	ctx->iv = malloc(ctx->iv_size);
-	if (!ctx->iv)
-		return -ENOMEM;
-
 	return 0;
 }
 
-static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector)
+/* Unencrypted IV for sector, ESSIV and EBOIV are encrypted in batch later */
+static void crypt_sector_iv_fill(struct crypt_sector_iv *ctx, char *iv, uint64_t sector)
 {
 	uint64_t val, *u64_iv;
 	uint32_t *u32_iv;
 
+	memset(iv, 0, ctx->iv_size);
+
 	switch (ctx->type) {
 	case IV_NONE:
-		break;
 	case IV_NULL:
-		memset(ctx->iv, 0, ctx->iv_size);
 		break;
 	case IV_PLAIN:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u32_iv = (void *)ctx->iv;
+		u32_iv = (void *)iv;
 		*u32_iv = cpu_to_le32(sector & 0xffffffff);
 		break;
 	case IV_PLAIN64:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u64_iv = (void *)ctx->iv;
+	case IV_ESSIV:
+		u64_iv = (void *)iv;
 		*u64_iv = cpu_to_le64(sector);
 		break;
 	case IV_PLAIN64BE:
-		memset(ctx->iv, 0, ctx->iv_size);
 		/* iv_size is at least of size u64; usually it is 16 bytes */
-		u64_iv = (void *)&ctx->iv[ctx->iv_size - sizeof(uint64_t)];
+		u64_iv = (void *)&iv[ctx->iv_size - sizeof(uint64_t)];
 		*u64_iv = cpu_to_be64(sector);
 		break;
-	case IV_ESSIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u64_iv = (void *)ctx->iv;
-		*u64_iv = cpu_to_le64(sector);
-		return crypt_cipher_encrypt(ctx->cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
-		break;
 	case IV_BENBI:
-		memset(ctx->iv, 0, ctx->iv_size);
 		val = cpu_to_be64((sector << ctx->shift) + 1);
-		memcpy(ctx->iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
+		memcpy(iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
 		break;
 	case IV_EBOIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		u64_iv = (void *)ctx->iv;
+		u64_iv = (void *)iv;
 		*u64_iv = cpu_to_le64(sector << ctx->shift);
-		return crypt_cipher_encrypt(ctx->cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
 		break;
-	default:
-		return -EINVAL;
 	}
+}
+
+/*
+ * Generate IVs for count sectors, sector numbers are first + j * step.
+ * ESSIV and EBOIV are encrypted by one ECB call for the whole array.
+ */
+static int crypt_sector_ivs_generate(struct crypt_sector_iv *ctx, char *ivs,
+				     size_t count, uint64_t first, uint64_t step,
+				     unsigned int shift)
+{
+	size_t j;
+
+	if (!ctx->iv_size)
+		return 0;
+
+	for (j = 0; j < count; j++)
+		crypt_sector_iv_fill(ctx, &ivs[j * ctx->iv_size], (first + j * step) >> shift);
+
+	if (ctx->type == IV_ESSIV || ctx->type == IV_EBOIV)
+		return crypt_cipher_encrypt(ctx->cipher, ivs, ivs, count * ctx->iv_size, NULL, 0);
 
 	return 0;
 }
@@ -207,11 +213,6 @@ static void crypt_sector_iv_destroy(struct crypt_sector_iv *ctx)
 	if (ctx->type == IV_ESSIV || ctx->type == IV_EBOIV)
 		crypt_cipher_destroy(ctx->cipher);
 
-	if (ctx->iv) {
-		memset(ctx->iv, 0, ctx->iv_size);
-		free(ctx->iv);
-	}
-
 	memset(ctx, 0, sizeof(*ctx));
 }
 
@@ -260,6 +261,14 @@ int crypt_storage_init(struct crypt_storage **ctx,
 		return r;
 	}
 
+	if (s->cipher_iv.iv_size) {
+		s->ivs = malloc(STORAGE_BATCH_SECTORS * s->cipher_iv.iv_size);
+		if (!s->ivs) {
+			crypt_storage_destroy(s);
+			return -ENOMEM;
+		}
+	}
+
 	s->sector_size = sector_size;
 	s->iv_shift = large_iv ? int_log2(sector_size) - SECTOR_SHIFT : 0;
 
@@ -267,11 +276,15 @@ int crypt_storage_init(struct crypt_storage **ctx,
 	return 0;
 }
 
-int crypt_storage_decrypt(struct crypt_storage *ctx,
-		       uint64_t iv_offset,
-		       uint64_t length, char *buffer)
+/*
+ * IVs are generated for a batch of sectors and the whole batch
+ * is then processed by the cipher backend in one call.
+ */
+static int crypt_storage_process(struct crypt_storage *ctx, uint64_t iv_offset,
+				 uint64_t length, char *buffer, bool encrypt)
 {
-	uint64_t i;
+	uint64_t i, sectors;
+	size_t iv_size = ctx->cipher_iv.iv_size;
 	int r = 0;
 
 	if (length & (ctx->sector_size - 1))
@@ -280,16 +293,25 @@ int crypt_storage_decrypt(struct crypt_storage *ctx,
 	if (iv_offset & ((ctx->sector_size >> SECTOR_SHIFT) - 1))
 		return -EINVAL;
 
-	for (i = 0; i < length; i += ctx->sector_size) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift);
+	for (i = 0; i < length; i += sectors * ctx->sector_size) {
+		sectors = (length - i) / ctx->sector_size;
+		if (sectors > STORAGE_BATCH_SECTORS)
+			sectors = STORAGE_BATCH_SECTORS;
+
+		r = crypt_sector_ivs_generate(&ctx->cipher_iv, ctx->ivs, sectors,
+					      iv_offset + (i >> SECTOR_SHIFT),
+					      ctx->sector_size >> SECTOR_SHIFT, ctx->iv_shift);
 		if (r)
-			break;
-		r = crypt_cipher_decrypt(ctx->cipher,
-					 &buffer[i],
-					 &buffer[i],
-					 ctx->sector_size,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
+			return r;
+
+		if (encrypt)
+			r = crypt_cipher_encrypt_sectors(ctx->cipher, &buffer[i], &buffer[i],
+							 sectors * ctx->sector_size, ctx->sector_size,
+							 ctx->ivs, iv_size);
+		else
+			r = crypt_cipher_decrypt_sectors(ctx->cipher, &buffer[i], &buffer[i],
+							 sectors * ctx->sector_size, ctx->sector_size,
+							 ctx->ivs, iv_size);
 		if (r)
 			break;
 	}
@@ -297,34 +319,18 @@ int crypt_storage_decrypt(struct crypt_storage *ctx,
 	return r;
 }
 
-int crypt_storage_encrypt(struct crypt_storage *ctx,
+int crypt_storage_decrypt(struct crypt_storage *ctx,
 		       uint64_t iv_offset,
 		       uint64_t length, char *buffer)
 {
-	uint64_t i;
-	int r = 0;
-
-	if (length & (ctx->sector_size - 1))
-		return -EINVAL;
-
-	if (iv_offset & ((ctx->sector_size >> SECTOR_SHIFT) - 1))
-		return -EINVAL;
-
-	for (i = 0; i < length; i += ctx->sector_size) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, (iv_offset + (i >> SECTOR_SHIFT)) >> ctx->iv_shift);
-		if (r)
-			break;
-		r = crypt_cipher_encrypt(ctx->cipher,
-					 &buffer[i],
-					 &buffer[i],
-					 ctx->sector_size,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
-		if (r)
-			break;
-	}
+	return crypt_storage_process(ctx, iv_offset, length, buffer, false);
+}
 
-	return r;
+int crypt_storage_encrypt(struct crypt_storage *ctx,
+		       uint64_t iv_offset,
+		       uint64_t length, char *buffer)
+{
+	return crypt_storage_process(ctx, iv_offset, length, buffer, true);
 }
 
 void crypt_storage_destroy(struct crypt_storage *ctx)
@@ -332,6 +338,11 @@ void crypt_storage_destroy(struct crypt_storage *ctx)
 	if (!ctx)
 		return;
 
+	if (ctx->ivs) {
+		memset(ctx->ivs, 0, STORAGE_BATCH_SECTORS * ctx->cipher_iv.iv_size);
+		free(ctx->ivs);
+	}
+
 	crypt_sector_iv_destroy(&ctx->cipher_iv);
 
 	if (ctx->cipher)
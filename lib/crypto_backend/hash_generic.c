@@ -0,0 +1,49 @@
+/*
+ * Generic hash utilities
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include "crypto_backend_internal.h"
+
+/* Fallback for backends without specific batch processing */
+int crypt_hash_many_generic(struct crypt_hash *ctx,
+			    const char *prefix, size_t prefix_length,
+			    const char *suffix, size_t suffix_length,
+			    const char *buffer, size_t block_size, size_t blocks,
+			    char *digests, size_t digest_size, size_t digest_stride)
+{
+	size_t i;
+	int r;
+
+	if (digest_stride < digest_size)
+		return -EINVAL;
+
+	for (i = 0; i < blocks; i++) {
+		if (prefix_length && (r = crypt_hash_write(ctx, prefix, prefix_length)))
+			return r;
+		if ((r = crypt_hash_write(ctx, buffer + i * block_size, block_size)))
+			return r;
+		if (suffix_length && (r = crypt_hash_write(ctx, suffix, suffix_length)))
+			return r;
+		if ((r = crypt_hash_final(ctx, digests + i * digest_stride, digest_size)))
+			return r;
+	}
+
+	return 0;
+}
@@ -25,6 +25,9 @@
 
 #include <errno.h>
 #include <alloca.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "crypto_backend_internal.h"
 
 static int hash_buf(const char *src, size_t src_len,
@@ -82,6 +85,175 @@ static int hash_buf(const char *src, size_t src_len,
 
 #define MAX_PRF_BLOCK_LEN 80
 
+/* Iterations between checks of PBKDF abort hook */
+#define PBKDF2_ABORT_CHECK 4096
+
+/* Minimal iteration count for computing output blocks in parallel threads */
+#define PBKDF2_PARALLEL_MIN_ITERATIONS 16384
+#define PBKDF2_MAX_THREADS 16
+
+struct pbkdf2_ctx {
+	const char *hash;
+	const char *key;
+	size_t key_len;
+	const char *S;
+	size_t Slen;
+	unsigned int c, hLen, l, r;
+	char *DK;
+	unsigned int threads;
+	int (*abort)(void *usrptr);
+	void *abort_usrptr;
+};
+
+struct pbkdf2_job {
+	struct pbkdf2_ctx *ctx;
+	unsigned int first;
+	pthread_t thread;
+	bool started;
+	int rc;
+};
+
+/* Compute T_i = F (P, S, c, i) */
+static int pbkdf2_block(struct crypt_hmac *hmac, const char *S, size_t Slen,
+			unsigned int c, unsigned int i, unsigned int hLen,
+			char *T, char *tmp)
+{
+	char U[MAX_PRF_BLOCK_LEN];
+	unsigned int u, k;
+	int rc = -EINVAL;
+
+	memset(T, 0, hLen);
+
+	for (u = 1; u <= c ; u++) {
+		if (!(u % PBKDF2_ABORT_CHECK) && crypt_pbkdf_aborted()) {
+			rc = -ECANCELED;
+			goto out;
+		}
+
+		if (u == 1) {
+			memcpy(tmp, S, Slen);
+			tmp[Slen + 0] = (i & 0xff000000) >> 24;
+			tmp[Slen + 1] = (i & 0x00ff0000) >> 16;
+			tmp[Slen + 2] = (i & 0x0000ff00) >> 8;
+			tmp[Slen + 3] = (i & 0x000000ff) >> 0;
+
+			if (crypt_hmac_write(hmac, tmp, Slen + 4))
+				goto out;
+		} else {
+			if (crypt_hmac_write(hmac, U, hLen))
+				goto out;
+		}
+
+		if (crypt_hmac_final(hmac, U, hLen))
+			goto out;
+
+		for (k = 0; k < hLen; k++)
+			T[k] ^= U[k];
+	}
+	rc = 0;
+out:
+	crypt_backend_memzero(U, sizeof(U));
+	return rc;
+}
+
+/* Job processes blocks first, first + threads, ... with its own HMAC context */
+static int pbkdf2_job_run(struct pbkdf2_job *job)
+{
+	struct pbkdf2_ctx *ctx = job->ctx;
+	struct crypt_hmac *hmac;
+	char T[MAX_PRF_BLOCK_LEN];
+	char *tmp;
+	unsigned int i;
+	int rc = 0;
+
+	tmp = malloc(ctx->Slen + 4);
+	if (!tmp)
+		return -ENOMEM;
+
+	if (crypt_hmac_init(&hmac, ctx->hash, ctx->key, ctx->key_len)) {
+		free(tmp);
+		return -EINVAL;
+	}
+
+	for (i = job->first; i <= ctx->l && !rc; i += ctx->threads) {
+		rc = pbkdf2_block(hmac, ctx->S, ctx->Slen, ctx->c, i, ctx->hLen, T, tmp);
+		if (!rc)
+			memcpy(ctx->DK + (i - 1) * ctx->hLen, T, i == ctx->l ? ctx->r : ctx->hLen);
+	}
+
+	crypt_hmac_destroy(hmac);
+	crypt_backend_memzero(T, sizeof(T));
+	crypt_backend_memzero(tmp, ctx->Slen + 4);
+	free(tmp);
+	return rc;
+}
+
+static void *pbkdf2_thread(void *arg)
+{
+	struct pbkdf2_job *job = arg;
+
+	/* abort hook is thread local */
+	crypt_pbkdf_set_abort(job->ctx->abort, job->ctx->abort_usrptr);
+	job->rc = pbkdf2_job_run(job);
+	crypt_pbkdf_set_abort(NULL, NULL);
+
+	return NULL;
+}
+
+/*
+ * Output blocks are independent iteration chains, compute them in parallel
+ * threads. The calling thread processes the first job and all jobs
+ * for which a thread cannot be created.
+ */
+static int pbkdf2_parallel(struct pbkdf2_ctx *ctx)
+{
+	struct pbkdf2_job jobs[PBKDF2_MAX_THREADS];
+	unsigned int i;
+	int rc = 0;
+
+	crypt_pbkdf_get_abort(&ctx->abort, &ctx->abort_usrptr);
+
+	for (i = 0; i < ctx->threads; i++) {
+		jobs[i].ctx = ctx;
+		jobs[i].first = i + 1;
+		jobs[i].started = false;
+		jobs[i].rc = 0;
+	}
+
+	for (i = 1; i < ctx->threads; i++)
+		if (!pthread_create(&jobs[i].thread, NULL, pbkdf2_thread, &jobs[i]))
+			jobs[i].started = true;
+
+	for (i = 0; i < ctx->threads; i++)
+		if (!jobs[i].started)
+			jobs[i].rc = pbkdf2_job_run(&jobs[i]);
+
+	for (i = 0; i < ctx->threads; i++)
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+
+	for (i = 0; i < ctx->threads && !rc; i++)
+		rc = jobs[i].rc;
+
+	return rc;
+}
+
+static unsigned int pbkdf2_threads(unsigned int c, unsigned int l)
+{
+	long cpus;
+
+	if (l < 2 || c < PBKDF2_PARALLEL_MIN_ITERATIONS)
+		return 1;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 2)
+		return 1;
+	if (cpus > PBKDF2_MAX_THREADS)
+		cpus = PBKDF2_MAX_THREADS;
+
+	return l < (unsigned int)cpus ? l : (unsigned int)cpus;
+}
+
 int pkcs5_pbkdf2(const char *hash,
 			const char *P, size_t Plen,
 			const char *S, size_t Slen,
@@ -89,11 +261,11 @@ int pkcs5_pbkdf2(const char *hash,
 			char *DK, unsigned int hash_block_size)
 {
 	struct crypt_hmac *hmac;
-	char U[MAX_PRF_BLOCK_LEN];
+	struct pbkdf2_ctx ctx;
 	char T[MAX_PRF_BLOCK_LEN];
 	char P_hash[MAX_PRF_BLOCK_LEN];
-	int i, k, rc = -EINVAL;
-	unsigned int u, hLen, l, r;
+	int rc = -EINVAL;
+	unsigned int i, hLen, l, r;
 	size_t tmplen = Slen + 4;
 	char *tmp;
 
@@ -182,49 +354,46 @@ int pkcs5_pbkdf2(const char *hash,
 	 */
 
 	/* If hash_block_size is provided, hash password in advance. */
+	memset(&ctx, 0, sizeof(ctx));
 	if (hash_block_size > 0 && Plen > hash_block_size) {
 		if (hash_buf(P, Plen, P_hash, hLen, hash))
 			return -EINVAL;
+		ctx.key = P_hash;
+		ctx.key_len = hLen;
+	} else {
+		ctx.key = P;
+		ctx.key_len = Plen;
+	}
 
-		if (crypt_hmac_init(&hmac, hash, P_hash, hLen))
-			return -EINVAL;
+	ctx.threads = pbkdf2_threads(c, l);
+	if (ctx.threads > 1) {
+		ctx.hash = hash;
+		ctx.S = S;
+		ctx.Slen = Slen;
+		ctx.c = c;
+		ctx.hLen = hLen;
+		ctx.l = l;
+		ctx.r = r;
+		ctx.DK = DK;
+		rc = pbkdf2_parallel(&ctx);
 		crypt_backend_memzero(P_hash, sizeof(P_hash));
-	} else {
-		if (crypt_hmac_init(&hmac, hash, P, Plen))
-			return -EINVAL;
+		return rc;
 	}
 
-	for (i = 1; (unsigned int) i <= l; i++) {
-		memset(T, 0, hLen);
-
-		for (u = 1; u <= c ; u++) {
-			if (u == 1) {
-				memcpy(tmp, S, Slen);
-				tmp[Slen + 0] = (i & 0xff000000) >> 24;
-				tmp[Slen + 1] = (i & 0x00ff0000) >> 16;
-				tmp[Slen + 2] = (i & 0x0000ff00) >> 8;
-				tmp[Slen + 3] = (i & 0x000000ff) >> 0;
-
-				if (crypt_hmac_write(hmac, tmp, tmplen))
-					goto out;
-			} else {
-				if (crypt_hmac_write(hmac, U, hLen))
-					goto out;
-			}
-
-			if (crypt_hmac_final(hmac, U, hLen))
-				goto out;
+	rc = crypt_hmac_init(&hmac, hash, ctx.key, ctx.key_len);
+	crypt_backend_memzero(P_hash, sizeof(P_hash));
+	if (rc)
+		return -EINVAL;
 
-			for (k = 0; (unsigned int) k < hLen; k++)
-				T[k] ^= U[k];
-		}
+	for (i = 1; i <= l; i++) {
+		rc = pbkdf2_block(hmac, S, Slen, c, i, hLen, T, tmp);
+		if (rc)
+			goto out;
 
-		memcpy(DK + (i - 1) * hLen, T, (unsigned int) i == l ? r : hLen);
+		memcpy(DK + (i - 1) * hLen, T, i == l ? r : hLen);
 	}
-	rc = 0;
 out:
 	crypt_hmac_destroy(hmac);
-	crypt_backend_memzero(U, sizeof(U));
 	crypt_backend_memzero(T, sizeof(T));
 	crypt_backend_memzero(tmp, tmplen);
 
@@ -25,18 +25,38 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-#include "crypto_backend.h"
+#include "crypto_backend_internal.h"
 
 #ifndef CLOCK_MONOTONIC_RAW
 #define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
 #endif
 
-#define BENCH_MIN_MS 250
 #define BENCH_MIN_MS_FAST 10
 #define BENCH_PERCENT_ATLEAST 95
 #define BENCH_PERCENT_ATMOST 110
 #define BENCH_SAMPLES_FAST 3
 #define BENCH_SAMPLES_SLOW 1
+#define BENCH_PROBE_MS 20
+
+static __thread int (*_pbkdf_abort)(void *usrptr);
+static __thread void *_pbkdf_abort_usrptr;
+
+void crypt_pbkdf_set_abort(int (*abort)(void *usrptr), void *usrptr)
+{
+	_pbkdf_abort = abort;
+	_pbkdf_abort_usrptr = abort ? usrptr : NULL;
+}
+
+void crypt_pbkdf_get_abort(int (**abort)(void *usrptr), void **usrptr)
+{
+	*abort = _pbkdf_abort;
+	*usrptr = _pbkdf_abort_usrptr;
+}
+
+int crypt_pbkdf_aborted(void)
+{
+	return _pbkdf_abort && _pbkdf_abort(_pbkdf_abort_usrptr);
+}
 
 /* These PBKDF2 limits must be never violated */
 int crypt_pbkdf_get_limits(const char *kdf, struct crypt_pbkdf_limits *limits)
@@ -94,19 +114,20 @@ static long time_ms(struct rusage *start, struct rusage *end)
 	return ms;
 }
 
-static long timespec_ms(struct timespec *start, struct timespec *end)
+static long timespec_us(struct timespec *start, struct timespec *end)
 {
-	return (end->tv_sec - start->tv_sec) * 1000 +
-	        (end->tv_nsec - start->tv_nsec) / (1000 * 1000);
+	return (end->tv_sec - start->tv_sec) * 1000 * 1000 +
+	        (end->tv_nsec - start->tv_nsec) / 1000;
 }
 
+/* Measured time is in microseconds, ms_atleast is early exit limit */
 static int measure_argon2(const char *kdf, const char *password, size_t password_length,
 			  const char *salt, size_t salt_length,
 			  char *key, size_t key_length,
 			  uint32_t t_cost, uint32_t m_cost, uint32_t parallel,
-			  size_t samples, long ms_atleast, long *out_ms)
+			  size_t samples, long ms_atleast, long *out_us)
 {
-	long ms, ms_min = LONG_MAX;
+	long us, us_min = LONG_MAX;
 	int r;
 	size_t i;
 
@@ -128,23 +149,62 @@ static int measure_argon2(const char *kdf, const char *password, size_t password
 		if (clock_gettime(CLOCK_MONOTONIC_RAW, &tend) < 0)
 			return -EINVAL;
 
-		ms = timespec_ms(&tstart, &tend);
-		if (ms < 0)
+		us = timespec_us(&tstart, &tend);
+		if (us < 0)
 			return -EINVAL;
 
-		if (ms < ms_atleast) {
+		if (us < ms_atleast * 1000) {
 			/* early exit */
-			ms_min = ms;
+			us_min = us;
 			break;
 		}
-		if (ms < ms_min) {
-			ms_min = ms;
+		if (us < us_min) {
+			us_min = us;
 		}
 	}
-	*out_ms = ms_min;
+	*out_us = us_min;
 	return 0;
 }
 
+/*
+ * Argon2 time is (almost) linear in the number of processed memory blocks,
+ * time = a + b * t_cost * m_cost, where a is fixed overhead (allocation,
+ * thread start). Fit the model from two probe runs and estimate parameters
+ * for the target time, memory cost is increased first, then time cost.
+ */
+static void estimate_argon2_params(uint32_t *t_cost, uint32_t *m_cost,
+				   uint32_t min_t_cost, uint32_t min_m_cost,
+				   uint32_t max_m_cost, uint64_t w1, long us1,
+				   uint64_t w2, long us2, uint32_t target_ms)
+{
+	double a, b, w, m, t;
+
+	b = (w2 > w1 && us2 > us1) ? (double)(us2 - us1) / (double)(w2 - w1) : 0.0;
+	a = (double)us1 - b * (double)w1;
+	if (b <= 0.0 || a < 0.0) {
+		/* noisy measurement, assume no fixed overhead */
+		a = 0.0;
+		b = (double)us2 / (double)w2;
+	}
+
+	w = ((double)target_ms * 1000.0 - a) / b;
+
+	m = w / min_t_cost;
+	if (m > max_m_cost)
+		m = max_m_cost;
+	if (m < min_m_cost)
+		m = min_m_cost;
+
+	t = w / m;
+	if (t > UINT32_MAX)
+		t = UINT32_MAX;
+	if (t < min_t_cost)
+		t = min_t_cost;
+
+	*m_cost = (uint32_t)m;
+	*t_cost = (uint32_t)t;
+}
+
 #define CONTINUE 0
 #define FINAL   1
 static int next_argon2_params(uint32_t *t_cost, uint32_t *m_cost,
@@ -217,7 +277,8 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 	int r = 0;
 	char *key = NULL;
 	uint32_t t_cost, m_cost;
-	long ms;
+	uint64_t w1;
+	long ms, us, us1;
 	long ms_atleast = (long)target_ms * BENCH_PERCENT_ATLEAST / 100;
 	long ms_atmost = (long)target_ms * BENCH_PERCENT_ATMOST / 100;
 
@@ -237,11 +298,12 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 	t_cost = min_t_cost;
 	m_cost = min_m_cost;
 
-	/* 1. Find some small parameters, s. t. ms >= BENCH_MIN_MS: */
+	/* 1. Find some small parameters, s. t. ms >= BENCH_PROBE_MS: */
 	while (1) {
 		r = measure_argon2(kdf, password, password_length, salt, salt_length,
 		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_FAST, BENCH_MIN_MS, &ms);
+		                   BENCH_SAMPLES_FAST, 0, &us);
+		ms = us / 1000;
 		if (!r) {
 			/* Update parameters to actual measurement */
 			*out_t_cost = t_cost;
@@ -253,14 +315,14 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 		if (r < 0)
 			goto out;
 
-		if (ms >= BENCH_MIN_MS)
+		if (ms >= BENCH_PROBE_MS)
 			break;
 
 		if (m_cost == max_m_cost) {
 			if (ms < BENCH_MIN_MS_FAST)
 				t_cost *= 16;
 			else {
-				uint32_t new = (t_cost * BENCH_MIN_MS) / (uint32_t)ms;
+				uint32_t new = (t_cost * BENCH_PROBE_MS) / (uint32_t)ms;
 				if (new == t_cost)
 					break;
 
@@ -270,7 +332,7 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			if (ms < BENCH_MIN_MS_FAST)
 				m_cost *= 16;
 			else {
-				uint32_t new = (m_cost * BENCH_MIN_MS) / (uint32_t)ms;
+				uint32_t new = (m_cost * BENCH_PROBE_MS) / (uint32_t)ms;
 				if (new == m_cost)
 					break;
 
@@ -281,9 +343,59 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			}
 		}
 	}
+
+	/*
+	 * 2. If the probe is still far below the target, run the second probe
+	 * with doubled cost, fit the time model and measure the estimate once.
+	 */
+	if (ms < ms_atleast / 2) {
+		w1 = (uint64_t)t_cost * m_cost;
+		us1 = us;
+
+		if (m_cost <= max_m_cost / 2)
+			m_cost *= 2;
+		else
+			t_cost *= 2;
+
+		r = measure_argon2(kdf, password, password_length, salt, salt_length,
+		                   key, key_length, t_cost, m_cost, parallel,
+		                   BENCH_SAMPLES_SLOW, 0, &us);
+		ms = us / 1000;
+		if (!r) {
+			*out_t_cost = t_cost;
+			*out_m_cost = m_cost;
+			if (progress && progress((uint32_t)ms, usrptr))
+				r = -EINTR;
+		}
+		if (r < 0)
+			goto out;
+
+		if (ms < ms_atleast) {
+			estimate_argon2_params(&t_cost, &m_cost, min_t_cost, min_m_cost,
+					       max_m_cost, w1, us1, (uint64_t)t_cost * m_cost,
+					       us, target_ms);
+
+			r = measure_argon2(kdf, password, password_length, salt, salt_length,
+			                   key, key_length, t_cost, m_cost, parallel,
+			                   BENCH_SAMPLES_SLOW, ms_atleast, &us);
+			ms = us / 1000;
+			if (!r) {
+				*out_t_cost = t_cost;
+				*out_m_cost = m_cost;
+				if (progress && progress((uint32_t)ms, usrptr))
+					r = -EINTR;
+			}
+			if (r < 0)
+				goto out;
+		}
+
+		if (ms >= ms_atleast && ms <= ms_atmost)
+			goto out;
+	}
+
 	/*
-	 * 2. Use the params obtained in (1.) to estimate the target params.
-	 * 3. Then repeatedly measure the candidate params and if they fall out of
+	 * 3. Use the last measurement to estimate the target params.
+	 * 4. Then repeatedly measure the candidate params and if they fall out of
 	 * the acceptance range (+-5 %), try to improve the estimate:
 	 */
 	do {
@@ -297,7 +409,8 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 
 		r = measure_argon2(kdf, password, password_length, salt, salt_length,
 		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_SLOW, ms_atleast, &ms);
+		                   BENCH_SAMPLES_SLOW, ms_atleast, &us);
+		ms = us / 1000;
 
 		if (!r) {
 			/* Update parameters to actual measurement */
@@ -0,0 +1,271 @@
+/*
+ * SHA-256 chain for iterated hashing of fixed length inputs
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto_backend.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+#define SHA256_ARM 1
+#include <arm_neon.h>
+#endif
+
+#define SHA256_BLOCK	64
+#define SHA256_DIGEST	32
+#define SHA256_COUNTER	8
+/* message buffer, the whole padded message must fit */
+#define SHA256_CHAIN_MAX_BLOCKS 4
+
+typedef void (*sha256_compress_fn)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void sha256_compress_generic(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be32(data + 4 * i);
+		for (; i < 64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			       (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += SHA256_BLOCK;
+	}
+}
+
+#if SHA256_X86
+/*
+ * SHA extensions keep state in ABEF/CDGH register layout, message
+ * schedule is processed in groups of four words.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_compress_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, msg, abef, cdgh, m[4];
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks--) {
+		abef = state0;
+		cdgh = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+			else
+				m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(
+					_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+					_mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)),
+					m[(i + 3) & 3]);
+
+			msg = _mm_add_epi32(m[i & 3], _mm_load_si128((const __m128i *)&sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += SHA256_BLOCK;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static int cpu_has_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ebx & bit_SHA) ? 1 : 0;
+}
+#endif
+
+#if SHA256_ARM
+static void sha256_compress_arm(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	uint32x4_t state0, state1, abcd, efgh, prev, msg, m[4];
+	int i;
+
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+
+	while (blocks--) {
+		abcd = state0;
+		efgh = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+			else
+				m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]),
+							   m[(i + 2) & 3], m[(i + 3) & 3]);
+
+			msg = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[4 * i]));
+			prev = state0;
+			state0 = vsha256hq_u32(state0, state1, msg);
+			state1 = vsha256h2q_u32(state1, prev, msg);
+		}
+
+		state0 = vaddq_u32(state0, abcd);
+		state1 = vaddq_u32(state1, efgh);
+		data += SHA256_BLOCK;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+#endif
+
+static sha256_compress_fn sha256_compress_select(void)
+{
+#if SHA256_X86
+	if (cpu_has_shani())
+		return sha256_compress_shani;
+#elif SHA256_ARM
+	return sha256_compress_arm;
+#endif
+	return sha256_compress_generic;
+}
+
+/*
+ * Iterated SHA-256 over digest || data || le64(counter), the digest
+ * is replaced by the result and counter incremented in every round.
+ *
+ * Length of all rounds is the same, so the message is padded only once
+ * and every round is just the compression of a few blocks with the new
+ * digest and counter stored in place.
+ */
+int crypt_sha256_chain(char *digest, const char *data, size_t data_length,
+		       uint64_t counter, uint64_t iterations)
+{
+	uint8_t msg[SHA256_CHAIN_MAX_BLOCKS * SHA256_BLOCK];
+	size_t i, length, counter_offset, blocks;
+	uint64_t bits;
+	uint32_t state[8];
+	sha256_compress_fn compress;
+
+	if (!digest || (data_length && !data))
+		return -EINVAL;
+
+	length = SHA256_DIGEST + data_length + SHA256_COUNTER;
+	blocks = (length + 1 + 8 + SHA256_BLOCK - 1) / SHA256_BLOCK;
+	if (blocks > SHA256_CHAIN_MAX_BLOCKS)
+		return -EINVAL;
+
+	compress = sha256_compress_select();
+
+	memset(msg, 0, sizeof(msg));
+	memcpy(msg, digest, SHA256_DIGEST);
+	if (data_length)
+		memcpy(msg + SHA256_DIGEST, data, data_length);
+	counter_offset = SHA256_DIGEST + data_length;
+
+	msg[length] = 0x80;
+	bits = (uint64_t)length * 8;
+	for (i = 0; i < 8; i++)
+		msg[blocks * SHA256_BLOCK - 1 - i] = (uint8_t)(bits >> (8 * i));
+
+	while (iterations--) {
+		for (i = 0; i < SHA256_COUNTER; i++)
+			msg[counter_offset + i] = (uint8_t)(counter >> (8 * i));
+		counter++;
+
+		memcpy(state, sha256_iv, sizeof(state));
+		compress(state, msg, blocks);
+
+		for (i = 0; i < 8; i++)
+			store_be32(msg + 4 * i, state[i]);
+	}
+
+	memcpy(digest, msg, SHA256_DIGEST);
+	crypt_backend_memzero(msg, sizeof(msg));
+	crypt_backend_memzero(state, sizeof(state));
+
+	return 0;
+}
@@ -38,6 +38,9 @@
 /* maximal offset to read metadata block */
 #define FVAULT2_MAX_OFF 1024*1024*1024
 
+/* maximal number of encrypted metadata blocks read at once */
+#define FVAULT2_MD_READ_BLOCKS 128
+
 /* encrypted metadata parsing progress flags (see _read_encrypted_metadata) */
 #define FVAULT2_ENC_MD_PARSED_0x0019 0b001
 #define FVAULT2_ENC_MD_PARSED_0x001A 0b010
@@ -536,9 +539,8 @@ static int _read_volume_header(
 	}
 
 	log_dbg(cd, "Reading FVAULT2 volume header of size %u bytes.", FVAULT2_VOL_HEADER_SIZE);
-	if (read_blockwise(devfd, device_block_size(cd, dev),
-			device_alignment(dev), vol_header,
-			FVAULT2_VOL_HEADER_SIZE) != FVAULT2_VOL_HEADER_SIZE) {
+	if (device_read_probe(cd, dev, devfd, vol_header,
+			FVAULT2_VOL_HEADER_SIZE, 0) != FVAULT2_VOL_HEADER_SIZE) {
 		log_err(cd, _("Could not read %u bytes of volume header."), FVAULT2_VOL_HEADER_SIZE);
 		r = -EIO;
 		goto out;
@@ -667,6 +669,36 @@ out:
 	return r;
 }
 
+/**
+ * Read consecutive encrypted metadata blocks with one request, if that fails
+ * (the extent overlaps end of the device) fall back to reading block by block.
+ * @return number of blocks read
+ */
+static uint64_t _read_md_blocks(
+	int devfd,
+	struct crypt_device *cd,
+	void *buf,
+	off_t off,
+	uint64_t blocks_n)
+{
+	struct device *dev = crypt_metadata_device(cd);
+	size_t bsize = device_block_size(cd, dev);
+	size_t alignment = device_alignment(dev);
+	ssize_t len = blocks_n * FVAULT2_MD_BLOCK_SIZE;
+	uint64_t i;
+
+	if (read_lseek_blockwise(devfd, bsize, alignment, buf, len, off) == len)
+		return blocks_n;
+
+	for (i = 0; i < blocks_n; i++)
+		if (read_lseek_blockwise(devfd, bsize, alignment,
+		    (char *)buf + i * FVAULT2_MD_BLOCK_SIZE, FVAULT2_MD_BLOCK_SIZE,
+		    off + i * FVAULT2_MD_BLOCK_SIZE) != FVAULT2_MD_BLOCK_SIZE)
+			break;
+
+	return i;
+}
+
 /**
  * Extract info from relevant encrypted metadata blocks.
  * @param[in] devfd opened device file descriptor
@@ -688,14 +720,14 @@ static int _read_encrypted_metadata(
 {
 	int r = 0;
 	int status = FVAULT2_ENC_MD_PARSED_NONE;
-	struct device *dev = crypt_metadata_device(cd);
 	struct crypt_cipher *cipher = NULL;
 	void *tweak;
-	void *md_block_enc = NULL;
+	void *md_blocks_enc = NULL;
+	void *md_block_enc;
 	void *md_block = NULL;
 	struct metadata_block_header *md_block_header;
 	uint32_t log_vol_blkoff;
-	uint64_t i, start_off;
+	uint64_t i, start_off, read_n = 0, batch_n = 0, batch_start = 0;
 	off_t off;
 	unsigned int block_type;
 
@@ -705,8 +737,10 @@ static int _read_encrypted_metadata(
 		goto out;
 	}
 
-	md_block_enc = malloc(FVAULT2_MD_BLOCK_SIZE);
-	if (md_block_enc == NULL) {
+	batch_n = blocks_n < FVAULT2_MD_READ_BLOCKS ? blocks_n : FVAULT2_MD_READ_BLOCKS;
+	/* aligned buffer, so the batch is read directly without bounce buffer */
+	if (posix_memalign(&md_blocks_enc, crypt_getpagesize(),
+			   (batch_n ?: 1) * FVAULT2_MD_BLOCK_SIZE)) {
 		r = -ENOMEM;
 		goto out;
 	}
@@ -736,13 +770,22 @@ static int _read_encrypted_metadata(
 			r = -EINVAL;
 			goto out;
 		}
-		if (read_lseek_blockwise(devfd, device_block_size(cd, dev),
-				device_alignment(dev), md_block_enc,
-				FVAULT2_MD_BLOCK_SIZE, off)
-				!= FVAULT2_MD_BLOCK_SIZE) {
-			r = -EIO;
-			goto out;
+
+		if (i == batch_start + read_n) {
+			/* next batch, never read past the offset limit */
+			batch_start = i;
+			batch_n = blocks_n - i;
+			if (batch_n > FVAULT2_MD_READ_BLOCKS)
+				batch_n = FVAULT2_MD_READ_BLOCKS;
+			if (batch_n > (FVAULT2_MAX_OFF - off) / FVAULT2_MD_BLOCK_SIZE + 1)
+				batch_n = (FVAULT2_MAX_OFF - off) / FVAULT2_MD_BLOCK_SIZE + 1;
+			read_n = _read_md_blocks(devfd, cd, md_blocks_enc, off, batch_n);
+			if (!read_n) {
+				r = -EIO;
+				goto out;
+			}
 		}
+		md_block_enc = (char *)md_blocks_enc + (i - batch_start) * FVAULT2_MD_BLOCK_SIZE;
 
 		if (_filled_with(0, md_block_enc, FVAULT2_MD_BLOCK_SIZE))
 			break;
@@ -808,7 +851,7 @@ static int _read_encrypted_metadata(
 	}
 out:
 	free(tweak);
-	free(md_block_enc);
+	free(md_blocks_enc);
 	free(md_block);
 	if (cipher != NULL)
 		crypt_cipher_destroy(cipher);
@@ -19,9 +19,12 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 #include "integrity.h"
@@ -53,7 +56,7 @@ static int INTEGRITY_read_superblock(struct crypt_device *cd,
 	    memcmp(sb->magic, SB_MAGIC, sizeof(sb->magic))) {
 		log_dbg(cd, "No kernel dm-integrity metadata detected on %s.", device_path(device));
 		r = -EINVAL;
-	} else if (sb->version < SB_VERSION_1 || sb->version > SB_VERSION_5) {
+	} else if (sb->version < SB_VERSION_1 || sb->version > SB_VERSION_6) {
 		log_err(cd, _("Incompatible kernel dm-integrity metadata (version %u) detected on %s."),
 			sb->version, device_path(device));
 		r = -EINVAL;
@@ -108,12 +111,13 @@ int INTEGRITY_dump(struct crypt_device *cd, struct device *device, uint64_t offs
 	if (sb.version >= SB_VERSION_2 && (sb.flags & SB_FLAG_RECALCULATING))
 		log_std(cd, "recalc_sector %" PRIu64 "\n", sb.recalc_sector);
 	log_std(cd, "log2_blocks_per_bitmap %u\n", sb.log2_blocks_per_bitmap_bit);
-	log_std(cd, "flags %s%s%s%s%s\n",
+	log_std(cd, "flags %s%s%s%s%s%s\n",
 		sb.flags & SB_FLAG_HAVE_JOURNAL_MAC ? "have_journal_mac " : "",
 		sb.flags & SB_FLAG_RECALCULATING ? "recalculating " : "",
 		sb.flags & SB_FLAG_DIRTY_BITMAP ? "dirty_bitmap " : "",
 		sb.flags & SB_FLAG_FIXED_PADDING ? "fix_padding " : "",
-		sb.flags & SB_FLAG_FIXED_HMAC ? "fix_hmac " : "");
+		sb.flags & SB_FLAG_FIXED_HMAC ? "fix_hmac " : "",
+		sb.flags & SB_FLAG_INLINE ? "inline " : "");
 
 	return 0;
 }
@@ -230,6 +234,7 @@ int INTEGRITY_create_dmd_device(struct crypt_device *cd,
 		       struct crypt_dm_active_device *dmd,
 		       uint32_t flags, uint32_t sb_flags)
 {
+	struct superblock sb;
 	int r;
 
 	if (!dmd)
@@ -243,10 +248,15 @@ int INTEGRITY_create_dmd_device(struct crypt_device *cd,
 	if (sb_flags & SB_FLAG_RECALCULATING)
 		dmd->flags |= CRYPT_ACTIVATE_RECALCULATE;
 
-	r = INTEGRITY_data_sectors(cd, INTEGRITY_metadata_device(cd),
-				   crypt_get_data_offset(cd) * SECTOR_SIZE, &dmd->size);
+	r = INTEGRITY_read_superblock(cd, INTEGRITY_metadata_device(cd),
+				      crypt_get_data_offset(cd) * SECTOR_SIZE, &sb);
 	if (r < 0)
 		return r;
+	dmd->size = sb.provided_data_sectors;
+
+	/* Inline mode is persistent, table must always use it */
+	if (sb.flags & SB_FLAG_INLINE)
+		dmd->flags |= CRYPT_ACTIVATE_INLINE_MODE;
 
 	return dm_integrity_target_set(cd, &dmd->segment, 0, dmd->size,
 			INTEGRITY_metadata_device(cd), crypt_data_device(cd),
@@ -335,10 +345,69 @@ int INTEGRITY_activate(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Inline mode stores tags in per-sector metadata of the data device, it needs
+ * no journal or detached metadata, device with large enough metadata per
+ * integrity sector and kernel support (checked last, device check is cheaper).
+ * Unset (zero) sector size is set to the device metadata interval.
+ * Returns 1 if inline mode can be used, 0 otherwise.
+ */
+int INTEGRITY_inline_supported(struct crypt_device *cd,
+			       const struct crypt_params_integrity *params,
+			       uint32_t tag_size, uint32_t *sector_size,
+			       bool quiet)
+{
+	uint32_t dmi_flags, metadata_bytes, interval_bytes;
+	int r;
+
+	if (INTEGRITY_metadata_device(cd) != crypt_data_device(cd) ||
+	    (params && (params->journal_size || params->journal_watermark || params->journal_commit_time ||
+			params->interleave_sectors || params->journal_integrity || params->journal_crypt))) {
+		if (!quiet)
+			log_err(cd, _("Integrity inline mode cannot be used with journal or detached metadata options."));
+		return 0;
+	}
+
+	r = device_integrity_metadata(crypt_data_device(cd), &metadata_bytes, &interval_bytes);
+	if (r < 0) {
+		if (!quiet)
+			log_err(cd, _("Device %s does not provide per-sector integrity metadata."),
+				device_path(crypt_data_device(cd)));
+		return 0;
+	}
+
+	log_dbg(cd, "Device %s provides %u metadata bytes per %u bytes.",
+		device_path(crypt_data_device(cd)), metadata_bytes, interval_bytes);
+
+	if (!tag_size || metadata_bytes < tag_size) {
+		if (!quiet)
+			log_err(cd, _("Device metadata space (%u bytes) is too small for integrity tag (%u bytes)."),
+				metadata_bytes, tag_size);
+		return 0;
+	}
+
+	if (*sector_size && interval_bytes != *sector_size) {
+		if (!quiet)
+			log_err(cd, _("Device metadata interval (%u bytes) does not match integrity sector size (%u bytes)."),
+				interval_bytes, *sector_size);
+		return 0;
+	}
+
+	if (dm_flags(cd, DM_INTEGRITY, &dmi_flags) || !(dmi_flags & DM_INTEGRITY_INLINE_MODE_SUPPORTED)) {
+		if (!quiet)
+			log_err(cd, _("Kernel does not support dm-integrity inline mode."));
+		return 0;
+	}
+
+	*sector_size = interval_bytes;
+	return 1;
+}
+
 int INTEGRITY_format(struct crypt_device *cd,
 		     const struct crypt_params_integrity *params,
 		     struct volume_key *journal_crypt_key,
-		     struct volume_key *journal_mac_key)
+		     struct volume_key *journal_mac_key,
+		     bool integrity_inline)
 {
 	uint32_t dmi_flags;
 	char tmp_name[64], tmp_uuid[40];
@@ -371,8 +440,13 @@ int INTEGRITY_format(struct crypt_device *cd,
 		return r;
 	}
 
-	log_dbg(cd, "Trying to format INTEGRITY device on top of %s, tmp name %s, tag size %d.",
-		device_path(tgt->data_device), tmp_name, tgt->u.integrity.tag_size);
+	/* Kernel writes inline mode superblock, no journal is created */
+	if (integrity_inline)
+		dmdi.flags |= CRYPT_ACTIVATE_INLINE_MODE;
+
+	log_dbg(cd, "Trying to format INTEGRITY device on top of %s, tmp name %s, tag size %d%s.",
+		device_path(tgt->data_device), tmp_name, tgt->u.integrity.tag_size,
+		integrity_inline ? ", inline mode" : "");
 
 	r = device_block_adjust(cd, tgt->data_device, DEV_EXCL, tgt->u.integrity.offset, NULL, NULL);
 	if (r < 0 && (dm_flags(cd, DM_INTEGRITY, &dmi_flags) || !(dmi_flags & DM_INTEGRITY_SUPPORTED))) {
@@ -400,3 +474,176 @@ int INTEGRITY_format(struct crypt_device *cd,
 
 	return dm_remove_device(cd, tmp_name, CRYPT_DEACTIVATE_FORCE);
 }
+
+/*
+ * Device benchmark for integrity parameters tuning. Data are read and written
+ * back unchanged (no data loss, but device must not be used meanwhile).
+ */
+#define TUNE_LATENCY_BLOCK	4096
+#define TUNE_LATENCY_SAMPLES	32
+#define TUNE_BW_BLOCK		(1024 * 1024)
+#define TUNE_BW_BLOCKS		32
+
+static double tune_time_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int tune_rewrite(int fd, char *buf, size_t len, off_t offset, double *ms)
+{
+	double start;
+
+	if (read_buffer_offset(fd, buf, len, offset) != (ssize_t)len)
+		return -EIO;
+
+	start = tune_time_ms();
+	if (write_buffer_offset(fd, buf, len, offset) != (ssize_t)len)
+		return -EIO;
+	*ms += tune_time_ms() - start;
+
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double d1 = *(const double *)a, d2 = *(const double *)b;
+
+	return d1 < d2 ? -1 : (d1 > d2 ? 1 : 0);
+}
+
+int INTEGRITY_benchmark_device(struct crypt_device *cd, struct device *device,
+			       double *write_latency_ms, double *write_mbs)
+{
+	double samples[TUNE_LATENCY_SAMPLES], bw_ms = 0.0, start;
+	uint64_t size;
+	char *buf = NULL;
+	unsigned int i;
+	int fd, r;
+
+	r = device_size(device, &size);
+	if (r)
+		return r;
+
+	if (size < (uint64_t)TUNE_BW_BLOCK * TUNE_BW_BLOCKS) {
+		log_dbg(cd, "Device %s is too small for benchmark.", device_path(device));
+		return -EINVAL;
+	}
+
+	fd = open(device_path(device), O_RDWR | O_DIRECT | O_DSYNC | O_EXCL);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(device_path(device), O_RDWR | O_DSYNC | O_EXCL);
+	if (fd < 0)
+		return errno == EBUSY ? -EBUSY : -EINVAL;
+
+	if (posix_memalign((void *)&buf, crypt_getpagesize(), TUNE_BW_BLOCK)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* synchronous small writes spread over the device */
+	for (i = 0; i < TUNE_LATENCY_SAMPLES; i++) {
+		samples[i] = 0.0;
+		r = tune_rewrite(fd, buf, TUNE_LATENCY_BLOCK,
+				 (off_t)((size / TUNE_LATENCY_SAMPLES * i) & ~(uint64_t)(TUNE_LATENCY_BLOCK - 1)),
+				 &samples[i]);
+		if (r)
+			goto out;
+	}
+	qsort(samples, TUNE_LATENCY_SAMPLES, sizeof(*samples), cmp_double);
+	*write_latency_ms = samples[TUNE_LATENCY_SAMPLES / 2];
+
+	/* sequential large writes at the device start */
+	start = tune_time_ms();
+	for (i = 0; i < TUNE_BW_BLOCKS; i++) {
+		r = tune_rewrite(fd, buf, TUNE_BW_BLOCK, (off_t)i * TUNE_BW_BLOCK, &bw_ms);
+		if (r)
+			goto out;
+	}
+	if (bw_ms <= 0.0)
+		bw_ms = tune_time_ms() - start;
+	*write_mbs = bw_ms > 0.0 ? (double)TUNE_BW_BLOCKS * TUNE_BW_BLOCK / (1024.0 * 1024.0) / (bw_ms / 1000.0) : 0.0;
+
+	log_dbg(cd, "Device %s write latency %.3f ms, bandwidth %.1f MiB/s.",
+		device_path(device), *write_latency_ms, *write_mbs);
+out:
+	free(buf);
+	close(fd);
+	return r;
+}
+
+static uint64_t tune_clamp(uint64_t val, uint64_t min, uint64_t max)
+{
+	return val < min ? min : (val > max ? max : val);
+}
+
+/*
+ * Simple rules, based on measured device profile:
+ *  - journal mode writes data twice, journal should absorb writes
+ *    for one commit interval, commit interval follows sync latency,
+ *  - bitmap mode writes data once plus bitmap updates, bitmap flush
+ *    interval follows sync latency,
+ *  - direct mode (no journal, LUKS2 AEAD) writes data once.
+ * Tags are written for every data sector in all modes.
+ */
+int INTEGRITY_tune(struct crypt_device *cd, struct device *device,
+		   int mode,
+		   struct crypt_params_integrity *params,
+		   struct crypt_integrity_tune *tune)
+{
+	double tags, lat, mbs;
+	uint64_t journal_mb;
+	unsigned int commit_ms, tag_size;
+	int r;
+
+	if (mode != CRYPT_INTEGRITY_TUNE_JOURNAL && mode != CRYPT_INTEGRITY_TUNE_BITMAP &&
+	    mode != CRYPT_INTEGRITY_TUNE_DIRECT)
+		return -EINVAL;
+
+	r = INTEGRITY_benchmark_device(cd, device, &lat, &mbs);
+	if (r)
+		return r;
+
+	tune->write_latency_ms = lat;
+	tune->write_mbs = mbs;
+
+	tag_size = params->tag_size;
+	if (!tag_size && params->integrity && (r = INTEGRITY_hash_tag_size(params->integrity)) > 0)
+		tag_size = r;
+	tags = (double)tag_size / (params->sector_size ?: SECTOR_SIZE);
+
+	/* fast devices can commit more often, slow ones need bigger batches */
+	commit_ms = (unsigned int)tune_clamp((uint64_t)(lat * 1000.0), 100, 10000);
+
+	if (mbs >= 1000.0)
+		params->buffer_sectors = 512;
+	else if (mbs >= 200.0)
+		params->buffer_sectors = 256;
+	else
+		params->buffer_sectors = 128;
+
+	if (mode == CRYPT_INTEGRITY_TUNE_JOURNAL) {
+		journal_mb = tune_clamp((uint64_t)(mbs * commit_ms / 1000.0), 4, 1024);
+		params->journal_size = journal_mb * 1024 * 1024;
+		params->journal_watermark = 50;
+		params->journal_commit_time = commit_ms;
+		tune->write_amplification = 2.0 + tags;
+		tune->activate_flags = 0;
+	} else if (mode == CRYPT_INTEGRITY_TUNE_BITMAP) {
+		/* overloaded parameters, sectors per bit and bitmap flush time */
+		params->journal_watermark = mbs >= 1000.0 ? 65536 : 32768;
+		params->journal_commit_time = commit_ms;
+		/* one bitmap sector update per sectors-per-bit region */
+		tune->write_amplification = 1.0 + tags + 1.0 / params->journal_watermark;
+		tune->activate_flags = CRYPT_ACTIVATE_NO_JOURNAL_BITMAP;
+	} else {
+		tune->write_amplification = 1.0 + tags;
+		tune->activate_flags = CRYPT_ACTIVATE_NO_JOURNAL;
+	}
+
+	return 0;
+}
@@ -21,6 +21,7 @@
 #ifndef _CRYPTSETUP_INTEGRITY_H
 #define _CRYPTSETUP_INTEGRITY_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 struct crypt_device;
@@ -28,6 +29,7 @@ struct device;
 struct crypt_params_integrity;
 struct volume_key;
 struct crypt_dm_active_device;
+struct crypt_integrity_tune;
 
 /* dm-integrity helper */
 #define SB_MAGIC	"integrt"
@@ -36,12 +38,14 @@ struct crypt_dm_active_device;
 #define SB_VERSION_3	3
 #define SB_VERSION_4	4
 #define SB_VERSION_5	5
+#define SB_VERSION_6	6
 
 #define SB_FLAG_HAVE_JOURNAL_MAC	(1 << 0)
 #define SB_FLAG_RECALCULATING		(1 << 1) /* V2 only */
 #define SB_FLAG_DIRTY_BITMAP		(1 << 2) /* V3 only */
 #define SB_FLAG_FIXED_PADDING		(1 << 3) /* V4 only */
 #define SB_FLAG_FIXED_HMAC		(1 << 4) /* V5 only */
+#define SB_FLAG_INLINE			(1 << 5) /* V6 only */
 
 struct superblock {
 	uint8_t magic[8];
@@ -72,10 +76,16 @@ int INTEGRITY_tag_size(const char *integrity,
 		       const char *cipher_mode);
 int INTEGRITY_hash_tag_size(const char *integrity);
 
+int INTEGRITY_inline_supported(struct crypt_device *cd,
+			       const struct crypt_params_integrity *params,
+			       uint32_t tag_size, uint32_t *sector_size,
+			       bool quiet);
+
 int INTEGRITY_format(struct crypt_device *cd,
 		     const struct crypt_params_integrity *params,
 		     struct volume_key *journal_crypt_key,
-		     struct volume_key *journal_mac_key);
+		     struct volume_key *journal_mac_key,
+		     bool integrity_inline);
 
 int INTEGRITY_activate(struct crypt_device *cd,
 		       const char *name,
@@ -98,4 +108,11 @@ int INTEGRITY_activate_dmd_device(struct crypt_device *cd,
 		       const char *type,
 		       struct crypt_dm_active_device *dmd,
 		       uint32_t sb_flags);
+
+int INTEGRITY_benchmark_device(struct crypt_device *cd, struct device *device,
+			       double *write_latency_ms, double *write_mbs);
+int INTEGRITY_tune(struct crypt_device *cd, struct device *device,
+		   int mode,
+		   struct crypt_params_integrity *params,
+		   struct crypt_integrity_tune *tune);
 #endif
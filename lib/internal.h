@@ -52,6 +52,9 @@
 #define LOG_MAX_LEN		4096
 #define MAX_DM_DEPS		32
 
+#define CRYPT_MAX_THREADS		256 /* upper limit for parallel processing */
+#define CRYPT_DEFAULT_MAX_THREADS	64  /* limit if number of threads is not set */
+
 #define CRYPT_SUBDEV           "SUBDEV" /* prefix for sublayered devices underneath public crypt types */
 
 #ifndef O_CLOEXEC
@@ -65,6 +68,7 @@ struct volume_key {
 	int id;
 	size_t keylength;
 	const char *key_description;
+	int32_t key_serial; /* kernel keyring key id, 0 if not uploaded */
 	struct volume_key *next;
 	char key[];
 };
@@ -75,6 +79,17 @@ void crypt_free_volume_key(struct volume_key *vk);
 int crypt_volume_key_set_description(struct volume_key *key, const char *key_description);
 void crypt_volume_key_set_id(struct volume_key *vk, int id);
 int crypt_volume_key_get_id(const struct volume_key *vk);
+
+void crypt_vk_cache_set_timeout(unsigned int timeout);
+bool crypt_vk_cache_enabled(void);
+int crypt_vk_cache_get(struct crypt_device *cd, const char *uuid, uint64_t seqid, int digest,
+		       int keyslot, const char *password, size_t password_len,
+		       struct volume_key **vk);
+void crypt_vk_cache_put(struct crypt_device *cd, const char *uuid, uint64_t seqid, int digest,
+			int keyslot, const char *password, size_t password_len,
+			const struct volume_key *vk);
+void crypt_vk_cache_flush(void);
+void crypt_vk_cache_destroy(void);
 void crypt_volume_key_add_next(struct volume_key **vks, struct volume_key *vk);
 struct volume_key *crypt_volume_key_next(struct volume_key *vk);
 struct volume_key *crypt_volume_key_by_id(struct volume_key *vk, int id);
@@ -85,6 +100,8 @@ int init_pbkdf_type(struct crypt_device *cd,
 		    const char *dev_type);
 int verify_pbkdf_params(struct crypt_device *cd,
 			const struct crypt_pbkdf_type *pbkdf);
+int verify_pbkdf_memory_limit(struct crypt_device *cd, uint64_t memory_kb,
+			      uint64_t *limit_kb);
 int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 				   struct crypt_pbkdf_type *pbkdf,
 				   size_t volume_key_size);
@@ -93,6 +110,8 @@ const char *crypt_get_cipher_spec(struct crypt_device *cd);
 /* Device backend */
 struct device;
 int device_alloc(struct crypt_device *cd, struct device **device, const char *path);
+int device_alloc_memory(struct crypt_device *cd, struct device **device,
+			const void *buffer, size_t buffer_size, uint64_t device_size);
 int device_alloc_no_check(struct device **device, const char *path);
 void device_close(struct crypt_device *cd, struct device *device);
 void device_free(struct crypt_device *cd, struct device *device);
@@ -113,9 +132,18 @@ void device_release_excl(struct crypt_device *cd, struct device *device);
 void device_disable_direct_io(struct device *device);
 int device_is_identical(struct device *device1, struct device *device2);
 int device_is_rotational(struct device *device);
+int device_hw_queues(struct device *device, int *is_dm);
+int device_numa_node(struct device *device);
+int device_integrity_metadata(struct device *device, uint32_t *metadata_bytes, uint32_t *interval_bytes);
+int device_inline_crypto(struct device *device, const char *mode,
+			 uint32_t data_unit_size, uint32_t *max_dun_bits);
 size_t device_alignment(struct device *device);
 int device_direct_io(const struct device *device);
 int device_fallocate(struct device *device, uint64_t size);
+void device_probe_begin(struct device *device);
+void device_probe_end(struct device *device);
+ssize_t device_read_probe(struct crypt_device *cd, struct device *device, int devfd,
+			  void *buf, size_t length, off_t offset);
 void device_sync(struct crypt_device *cd, struct device *device);
 int device_check_size(struct crypt_device *cd,
 		      struct device *device,
@@ -157,6 +185,19 @@ int crypt_confirm(struct crypt_device *cd, const char *msg);
 
 char *crypt_lookup_dev(const char *dev_id);
 int crypt_dev_is_rotational(int major, int minor);
+#define CRYPT_DEV_STAT_FIELDS 10
+int crypt_dev_stat(int major, int minor, uint64_t stat[CRYPT_DEV_STAT_FIELDS]);
+int crypt_dev_io_stats(int major, int minor, uint64_t *ios, uint64_t *ticks_ms);
+int crypt_dev_hw_queues(int major, int minor);
+int crypt_dev_numa_node(int major, int minor);
+int crypt_dev_is_dm(int major, int minor);
+int crypt_dev_holders(int major, int minor);
+int crypt_dev_queue_limit(int major, int minor, const char *attr, uint64_t *value);
+int crypt_dev_queue_set(int major, int minor, const char *attr, uint64_t value);
+int crypt_dev_workqueue_cpumask(int major, int minor, const char *cpumask);
+int crypt_dev_integrity_metadata(int major, int minor, uint32_t *metadata_bytes, uint32_t *interval_bytes);
+int crypt_dev_inline_crypto(int major, int minor, const char *mode,
+			    uint32_t data_unit_size, uint32_t *max_dun_bits);
 int crypt_dev_is_partition(const char *dev_path);
 char *crypt_get_partition_device(const char *dev_path, uint64_t offset, uint64_t size);
 char *crypt_get_base_device(const char *dev_path);
@@ -167,6 +208,19 @@ int crypt_uuid_cmp(const char *dm_uuid, const char *hdr_uuid);
 
 size_t crypt_getpagesize(void);
 unsigned crypt_cpusonline(void);
+unsigned int crypt_get_threads(struct crypt_device *cd);
+int crypt_get_numa_node(struct crypt_device *cd);
+void crypt_get_executor(struct crypt_device *cd, crypt_executor_run_fn *run, void **usrptr);
+uint32_t crypt_get_token_timeout(struct crypt_device *cd);
+const struct crypt_params_reencrypt_tuning *crypt_get_reencrypt_tuning(struct crypt_device *cd);
+uint64_t crypt_get_pbkdf_memory_limit(struct crypt_device *cd);
+struct crypt_bufpool *crypt_get_bufpool(struct crypt_device *cd);
+bool crypt_memory_lean(struct crypt_device *cd);
+int crypt_keyslot_hint(struct crypt_device *cd);
+void crypt_keyslot_hint_update(struct crypt_device *cd, int keyslot);
+void crypt_keyslot_hint_source(struct crypt_device *cd, int kc_type);
+const char *crypt_get_pbkdf_cache(struct crypt_device *cd);
+const char *crypt_get_verity_stage(struct crypt_device *cd);
 uint64_t crypt_getphysmemory_kb(void);
 uint64_t crypt_getphysmemoryfree_kb(void);
 bool crypt_swapavailable(void);
@@ -180,9 +234,39 @@ int init_crypto(struct crypt_device *ctx);
 
 int crypt_get_debug_level(void);
 
+/* Span of traced operation, reported by crypt_trace_end() */
+struct crypt_trace {
+	crypt_trace_type type;
+	const char *name;
+	uint64_t start_us;
+};
+
+void crypt_trace_begin(struct crypt_trace *t, crypt_trace_type type, const char *name);
+void crypt_trace_end(struct crypt_device *cd, struct crypt_trace *t, uint64_t bytes, int result);
+
+/* Process-wide counters reported by crypt_get_stats() */
+typedef enum {
+	CRYPT_STAT_KDF = 0,
+	CRYPT_STAT_KDF_US,
+	CRYPT_STAT_DM_IOCTL,
+	CRYPT_STAT_UDEV_WAIT,
+	CRYPT_STAT_UDEV_WAIT_US,
+	CRYPT_STAT_HEADER_READ,
+	CRYPT_STAT_HEADER_READ_BYTES,
+	CRYPT_STAT_HEADER_WRITE,
+	CRYPT_STAT_HEADER_WRITE_BYTES,
+	CRYPT_STAT_STORAGE_READ_BYTES,
+	CRYPT_STAT_STORAGE_WRITE_BYTES,
+	CRYPT_STAT_TEMP_DEVICE,
+	CRYPT_STAT_MAX
+} crypt_stat_type;
+
+void crypt_stat_add(crypt_stat_type type, uint64_t value);
+
 void crypt_process_priority(struct crypt_device *cd, int *priority, bool raise);
 
 int crypt_metadata_locking_enabled(void);
+int crypt_parallel_unlock_enabled(void);
 
 int crypt_random_init(struct crypt_device *ctx);
 int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int quality);
@@ -215,6 +299,22 @@ int crypt_wipe_device(struct crypt_device *cd,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr);
 
+struct crypt_wipe_range {
+	uint64_t offset;
+	uint64_t length;
+};
+
+int crypt_wipe_device_ranges(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	struct crypt_wipe_range *ranges,
+	unsigned int count);
+
+int crypt_discard_device(struct crypt_device *cd,
+	struct device *device,
+	uint64_t offset,
+	uint64_t length);
+
 /* Internal integrity helpers */
 const char *crypt_get_integrity(struct crypt_device *cd);
 int crypt_get_integrity_key_size(struct crypt_device *cd);
@@ -223,6 +323,7 @@ int crypt_get_integrity_tag_size(struct crypt_device *cd);
 int crypt_key_in_keyring(struct crypt_device *cd);
 void crypt_set_key_in_keyring(struct crypt_device *cd, unsigned key_in_keyring);
 int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key *vk);
+int crypt_volume_keys_load_in_keyring(struct crypt_device *cd, struct volume_key *vks);
 int crypt_use_keyring_for_vk(struct crypt_device *cd);
 void crypt_drop_keyring_key_by_description(struct crypt_device *cd, const char *key_description, key_type_t ktype);
 void crypt_drop_keyring_key(struct crypt_device *cd, struct volume_key *vks);
@@ -236,6 +337,10 @@ int kernel_version(uint64_t *kversion);
 
 int crypt_serialize_lock(struct crypt_device *cd);
 void crypt_serialize_unlock(struct crypt_device *cd);
+bool crypt_serialize_lock_enabled(struct crypt_device *cd);
+
+int crypt_memory_gate_acquire(struct crypt_device *cd, uint32_t memory_kb, int *gate);
+void crypt_memory_gate_release(struct crypt_device *cd, int gate);
 
 bool crypt_string_in(const char *str, char **list, size_t list_size);
 int crypt_strcmp(const char *a, const char *b);
@@ -133,7 +133,9 @@ static int get_luks2_key_by_keyfile(struct crypt_device *cd,
 	if (r)
 		return r;
 
+	crypt_keyslot_hint_source(cd, CRYPT_KC_TYPE_KEYFILE);
 	r = LUKS2_keyslot_open(cd, keyslot, segment, passphrase, passphrase_size, r_vk);
+	crypt_keyslot_hint_source(cd, CRYPT_KC_TYPE_PASSPHRASE);
 	if (r < 0)
 		kc->error = r;
 
@@ -165,8 +167,10 @@ static int get_luks1_volume_key_by_keyfile(struct crypt_device *cd,
 	if (r)
 		return r;
 
+	crypt_keyslot_hint_source(cd, CRYPT_KC_TYPE_KEYFILE);
 	r = LUKS_open_key_with_hdr(keyslot, passphrase, passphrase_size,
 				   crypt_get_hdr(cd, CRYPT_LUKS1), r_vk, cd);
+	crypt_keyslot_hint_source(cd, CRYPT_KC_TYPE_PASSPHRASE);
 	if (r < 0)
 		kc->error = r;
 
@@ -216,8 +220,14 @@ static int get_luks2_key_by_token(struct crypt_device *cd,
 	assert(kc && kc->type == CRYPT_KC_TYPE_TOKEN);
 	assert(r_vk);
 
-	r = LUKS2_token_unlock_key(cd, crypt_get_hdr(cd, CRYPT_LUKS2), kc->u.t.id, kc->u.t.type,
-				   kc->u.t.pin, kc->u.t.pin_size, segment, kc->u.t.usrptr, r_vk);
+	/* Token resolved already, do not call token handler again */
+	if (kc->u.t.id >= 0)
+		r = LUKS2_token_unlock_key_cached(cd, crypt_get_hdr(cd, CRYPT_LUKS2), kc->u.t.id,
+				kc->u.t.type, kc->u.t.pin, kc->u.t.pin_size, segment, kc->u.t.usrptr,
+				&kc->i_passphrase, &kc->i_passphrase_size, &kc->i_uuid, r_vk);
+	else
+		r = LUKS2_token_unlock_key(cd, crypt_get_hdr(cd, CRYPT_LUKS2), kc->u.t.id, kc->u.t.type,
+					   kc->u.t.pin, kc->u.t.pin_size, segment, kc->u.t.usrptr, r_vk);
 	if (r < 0)
 		kc->error = r;
 
@@ -268,6 +278,7 @@ static void unlock_method_init_internal(struct crypt_keyslot_context *kc)
 	kc->error = 0;
 	kc->i_passphrase = NULL;
 	kc->i_passphrase_size = 0;
+	kc->i_uuid = NULL;
 }
 
 void crypt_keyslot_unlock_by_key_init_internal(struct crypt_keyslot_context *kc,
@@ -350,6 +361,8 @@ void crypt_keyslot_context_destroy_internal(struct crypt_keyslot_context *kc)
 	crypt_safe_free(kc->i_passphrase);
 	kc->i_passphrase = NULL;
 	kc->i_passphrase_size = 0;
+	free(kc->i_uuid);
+	kc->i_uuid = NULL;
 }
 
 void crypt_keyslot_context_free(struct crypt_keyslot_context *kc)
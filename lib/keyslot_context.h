@@ -75,8 +75,11 @@ struct crypt_keyslot_context {
 
 	int error;
 
+	/* keyfile content or token buffer, read once for context lifetime */
 	char *i_passphrase;
 	size_t i_passphrase_size;
+	/* header UUID the token buffer unlocked a keyslot of */
+	char *i_uuid;
 
 	keyslot_context_get_key		get_luks2_key;
 	keyslot_context_get_volume_key	get_luks1_volume_key;
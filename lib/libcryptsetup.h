@@ -27,6 +27,19 @@
  *
  * For more verbose examples of LUKS related use cases,
  * please read @ref index "examples".
+ *
+ * Concurrency model:
+ * Independent @e crypt_device contexts can be used from different threads
+ * concurrently, also for the same underlying device (conflicting metadata
+ * access is serialized by metadata locking). A single context must not be
+ * used by more than one thread at the same time, the caller has to provide
+ * its own synchronization if a context is shared.
+ *
+ * Library-wide settings (@link crypt_set_log_callback @endlink with @e NULL
+ * context, @link crypt_set_debug_level @endlink,
+ * @link crypt_metadata_locking @endlink, @link crypt_token_external_disable @endlink
+ * and @link crypt_token_register @endlink) affect all contexts and should be
+ * set up before other threads use the library.
  */
 
 #ifndef _LIBCRYPTSETUP_H
@@ -82,6 +95,30 @@ int crypt_init_data_device(struct crypt_device **cd,
 	const char *device,
 	const char *data_device);
 
+/**
+ * Initialize crypt device handle with device backed by memory buffer.
+ *
+ * Content of @e buffer is copied to anonymous memory file, so all metadata
+ * operations (like @link crypt_load @endlink, @link crypt_volume_key_get @endlink,
+ * @link crypt_dump @endlink or @link crypt_header_backup @endlink) work without
+ * temporary files or loop devices.
+ *
+ * @param cd Returns pointer to crypt device handle
+ * @param buffer buffer with device content (e.g. LUKS header image)
+ * @param buffer_size size of @e buffer
+ * @param device_size size of memory device, @e 0 means @e buffer_size,
+ * 	  the space after the buffer is zeroed
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Changes of metadata are not written back to @e buffer.
+ * @note Memory backed device cannot be used for device activation.
+ */
+int crypt_init_by_buffer(struct crypt_device **cd,
+	const void *buffer,
+	size_t buffer_size,
+	uint64_t device_size);
+
 /**
  * Initialize crypt device handle from provided active device name,
  * and, optionally, from separate metadata (header) device
@@ -113,6 +150,60 @@ int crypt_init_by_name_and_header(struct crypt_device **cd,
  */
 int crypt_init_by_name(struct crypt_device **cd, const char *name);
 
+/**
+ * @defgroup crypt-init-by-name-flags Flags for crypt_init_by_name_flags
+ * @addtogroup crypt-init-by-name-flags
+ * @{
+ */
+/** Postpone LUKS header load until an operation needs on-disk metadata */
+#define CRYPT_INIT_METADATA_LAZY (UINT32_C(1) << 0)
+/** @} */
+
+/**
+ * Initialize crypt device handle from provided active device name
+ * with additional initialization flags.
+ *
+ * @param cd returns crypt device handle for active device
+ * @param name name of active crypt device
+ * @param header_device optional device containing on-disk header
+ * 	  (@e NULL if it the same as underlying device on there is no on-disk header)
+ * @param flags initialization flags (@ref crypt-init-by-name-flags)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note With @e CRYPT_INIT_METADATA_LAZY active LUKS device context is built
+ * 	 from device-mapper table only. @ref crypt_get_type returns LUKS type
+ * 	 from active device UUID, cipher, key size and sector size are read
+ * 	 from the active table and crypt_get_active_device does not need
+ * 	 the header. LUKS header is read (and its UUID checked against
+ * 	 active device) on first call that needs on-disk metadata.
+ * 	 If that load fails, context behaves as context without header.
+ *
+ * @sa crypt_init_by_name_and_header
+ */
+int crypt_init_by_name_flags(struct crypt_device **cd,
+	const char *name,
+	const char *header_device,
+	uint32_t flags);
+
+/**
+ * Initialize crypt device handle as a copy of another handle with loaded
+ * LUKS header, without reading and validating the header again.
+ *
+ * The clone uses the same devices and context settings (PBKDF, threads,
+ * callbacks and memory lean mode). Cached on-disk header state is shared
+ * between contexts until one of them changes the header.
+ *
+ * @param cd_clone returns crypt device handle of the clone
+ * @param cd crypt device handle with loaded LUKS1 or LUKS2 header
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ * 	   (@e -EBUSY if LUKS2 reencryption context is initialized).
+ *
+ * @note Volume key stored in @e cd (e.g. after format) is not cloned.
+ */
+int crypt_context_clone(struct crypt_device **cd_clone, struct crypt_device *cd);
+
 /**
  * Release crypt device context and used memory.
  *
@@ -227,6 +318,90 @@ void crypt_log(struct crypt_device *cd, int level, const char *msg);
  * @param format formatted log message
  */
 void crypt_logf(struct crypt_device *cd, int level, const char *format, ...);
+
+/**
+ * Traced library operations.
+ */
+typedef enum {
+	CRYPT_TRACE_KDF = 0,	/**< keyslot key derivation (PBKDF) */
+	CRYPT_TRACE_HEADER_READ,	/**< on-disk metadata read */
+	CRYPT_TRACE_HEADER_WRITE,	/**< on-disk metadata write */
+	CRYPT_TRACE_DM_IOCTL,	/**< device-mapper ioctl */
+	CRYPT_TRACE_UDEV_WAIT,	/**< wait for udev processing */
+	CRYPT_TRACE_TOKEN,	/**< token plugin open call */
+	CRYPT_TRACE_REENCRYPT_STEP	/**< one reencryption hotzone step */
+} crypt_trace_type;
+
+/**
+ * Finished traced operation.
+ */
+struct crypt_trace_span {
+	crypt_trace_type type; /**< operation type */
+	const char *name; /**< operation detail (KDF type, metadata format, ioctl, token type) */
+	uint64_t start_us; /**< start time (CLOCK_MONOTONIC) in microseconds */
+	uint64_t duration_us; /**< duration in microseconds */
+	uint64_t bytes; /**< bytes processed (KDF memory cost, metadata or hotzone size), 0 if not applicable */
+	int result; /**< @e 0 or negative errno value of operation */
+};
+
+/**
+ * Set trace function, it is called after every traced operation finished.
+ *
+ * If the library is built with systemtap SDT support, every span is also
+ * reported by @e libcryptsetup:span static tracepoint (USDT).
+ *
+ * @param cd crypt device handle (can be @e NULL to set default trace function)
+ * @param trace user defined trace function reference (@e NULL disables tracing)
+ * @param usrptr provided identification in callback
+ *
+ * @note Function can be called from library internal threads.
+ */
+void crypt_set_trace_callback(struct crypt_device *cd,
+	void (*trace)(struct crypt_device *cd, const struct crypt_trace_span *span, void *usrptr),
+	void *usrptr);
+
+/**
+ * Process-wide library statistics.
+ *
+ * All counters are monotonic since library load or last @link crypt_reset_stats @endlink.
+ * Counters are updated for all traced operations, no trace callback is needed.
+ */
+struct crypt_stats {
+	uint32_t size; /**< size of the structure in bytes, set by caller */
+	uint64_t kdf_count; /**< keyslot key derivations (PBKDF runs) */
+	uint64_t kdf_us; /**< time spent in keyslot key derivations in microseconds */
+	uint64_t dm_ioctls; /**< device-mapper ioctls */
+	uint64_t udev_waits; /**< waits for udev processing */
+	uint64_t udev_wait_us; /**< time spent waiting for udev in microseconds */
+	uint64_t metadata_reads; /**< on-disk metadata (LUKS header) reads */
+	uint64_t metadata_read_bytes; /**< bytes of on-disk metadata read */
+	uint64_t metadata_writes; /**< on-disk metadata (LUKS header) writes */
+	uint64_t metadata_write_bytes; /**< bytes of on-disk metadata written */
+	uint64_t io_read_bytes; /**< bytes read by library block I/O (metadata, keyslot areas, wipe) */
+	uint64_t io_write_bytes; /**< bytes written by library block I/O (metadata, keyslot areas, wipe) */
+	uint64_t storage_read_bytes; /**< bytes read through encrypted storage (keyslot areas, reencryption) */
+	uint64_t storage_write_bytes; /**< bytes written through encrypted storage (keyslot areas, reencryption) */
+	uint64_t temporary_devices; /**< temporary device-mapper devices created */
+};
+
+/**
+ * Get process-wide library statistics.
+ *
+ * @param stats statistics structure to fill,
+ * 	  @e size member must be set to sizeof(struct crypt_stats)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Counters are read separately, the structure is not an atomic snapshot.
+ * @note Only fields inside @e size are filled, so structure can be extended
+ * 	 in later versions.
+ */
+int crypt_get_stats(struct crypt_stats *stats);
+
+/**
+ * Reset process-wide library statistics to zero.
+ */
+void crypt_reset_stats(void);
 /** @} */
 
 /**
@@ -275,6 +450,10 @@ struct crypt_pbkdf_type {
 #define CRYPT_PBKDF_ITER_TIME_SET   (UINT32_C(1) << 0)
 /** Never run benchmarks, use pre-set value or defaults. */
 #define CRYPT_PBKDF_NO_BENCHMARK    (UINT32_C(1) << 1)
+/** Lock memory-hard PBKDF memory in RAM (mlock) during key derivation. */
+#define CRYPT_PBKDF_LOCK_MEMORY     (UINT32_C(1) << 2)
+/** Pin memory-hard PBKDF worker threads to separate CPUs. */
+#define CRYPT_PBKDF_CPU_AFFINITY    (UINT32_C(1) << 3)
 
 /** PBKDF2 according to RFC2898, LUKS1 legacy */
 #define CRYPT_KDF_PBKDF2   "pbkdf2"
@@ -330,6 +509,67 @@ const struct crypt_pbkdf_type *crypt_get_pbkdf_default(const char *type);
  */
 const struct crypt_pbkdf_type *crypt_get_pbkdf_type(struct crypt_device *cd);
 
+/**
+ * Set file used as persistent cache of PBKDF benchmark results.
+ *
+ * Benchmark results are stored per PBKDF type, hash, requested time, memory and
+ * parallel cost, volume key size and per machine identification (CPU model,
+ * number of online CPUs and crypto backend version). The next PBKDF benchmark
+ * with the same parameters reuses cached values instead of running calibration.
+ * To invalidate the cache, remove the file.
+ *
+ * @param cd crypt device handle
+ * @param path path to cache file (e.g. in /run) or @e NULL to disable cache
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note The cache file is used only if it is owned by the process effective user
+ *       and not writable by group or others.
+ */
+int crypt_set_pbkdf_cache(struct crypt_device *cd, const char *path);
+
+/**
+ * Reduce memory footprint of a long living context (e.g. one context per volume
+ * in a service). Cached I/O buffers are not kept and LUKS2 context keeps
+ * no copy of the header for in-memory rollback and no cached on-disk header
+ * state. Metadata updates then always write the whole header and rollback
+ * after failed operation reads the header from disk.
+ *
+ * @param cd crypt device handle
+ * @param enable @e 1 to enable memory lean mode, @e 0 to disable it
+ *
+ * @return 0 on success or negative errno value otherwise.
+ */
+int crypt_set_memory_lean(struct crypt_device *cd, int enable);
+
+/**
+ * Set keyslot tried first if a passphrase or keyfile is used to unlock
+ * LUKS device without specified keyslot. Other keyslots are tried
+ * afterwards in the usual order, priority of keyslots is respected.
+ *
+ * @param cd crypt device handle
+ * @param keyslot keyslot number or @e CRYPT_ANY_SLOT to remove the hint
+ *
+ * @return 0 on success or negative errno value otherwise.
+ */
+int crypt_set_keyslot_hint(struct crypt_device *cd, int keyslot);
+
+/**
+ * Remember keyslot that unlocked the device in a cache directory (e.g. in /run)
+ * and try it first during the next unlock without specified keyslot.
+ * The hint is stored per header UUID and passphrase source (passphrase or keyfile),
+ * a hint set by @link crypt_set_keyslot_hint @endlink takes precedence.
+ *
+ * @param cd crypt device handle
+ * @param path path to cache directory or @e NULL to disable cache
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note The cache file is used only if it is owned by the process effective user
+ *       and not writable by group or others.
+ */
+int crypt_set_keyslot_hint_cache(struct crypt_device *cd, const char *path);
+
 /**
  * Set how long should cryptsetup iterate in PBKDF2 function.
  * Default value heads towards the iterations which takes around 1 second.
@@ -403,6 +643,98 @@ int crypt_get_metadata_size(struct crypt_device *cd,
 	uint64_t *metadata_size,
 	uint64_t *keyslots_size);
 
+/**
+ * Set maximal number of threads used for parallel processing in userspace
+ * (dm-verity hash tree creation and verification).
+ *
+ * @param cd crypt device handle
+ * @param threads number of threads, @e 0 means use all online CPUs (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Value @e 1 disables parallel processing.
+ */
+int crypt_set_threads(struct crypt_device *cd, unsigned int threads);
+
+/** Do not bind worker threads and I/O buffers (default). */
+#define CRYPT_AFFINITY_NONE        UINT32_C(0)
+/** Bind worker threads and I/O buffers to NUMA node of the (data) device. */
+#define CRYPT_AFFINITY_DEVICE_NUMA (UINT32_C(1) << 0)
+
+/**
+ * Set placement policy for parallel processing threads and their buffers.
+ *
+ * @param cd crypt device handle
+ * @param flags CRYPT_AFFINITY_* flags
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note With @e CRYPT_AFFINITY_DEVICE_NUMA worker threads run only on CPUs
+ *	 of the device NUMA node and I/O buffers prefer memory of the node.
+ *	 Nothing is changed if the node is unknown or the system is not NUMA.
+ */
+int crypt_set_thread_affinity(struct crypt_device *cd, uint32_t flags);
+
+/**
+ * Application executor for library parallel processing.
+ *
+ * @param jobs number of jobs
+ * @param fn job function, must be called exactly once for every job index
+ *	  in <0, @e jobs) (in any order and in parallel)
+ * @param arg argument passed to @e fn
+ * @param usrptr provided identification in callback
+ *
+ * @returns @e 0 after all jobs finished or negative errno value otherwise.
+ *
+ * @note Executor must not return before all started @e fn calls returned.
+ */
+typedef int (*crypt_executor_run_fn)(unsigned int jobs,
+	int (*fn)(void *arg, unsigned int job), void *arg, void *usrptr);
+
+/**
+ * Run library parallel processing on application supplied executor
+ * instead of library internal worker threads.
+ *
+ * @param cd crypt device handle
+ * @param run executor callback, @e NULL restores internal worker threads
+ * @param usrptr provided identification in callback
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Number of jobs submitted at once is still bounded
+ *	 by @link crypt_set_threads @endlink.
+ */
+int crypt_set_executor(struct crypt_device *cd, crypt_executor_run_fn run, void *usrptr);
+
+/**
+ * Set total memory limit for memory-hard PBKDF running concurrently
+ * (keyslots created in one batch).
+ *
+ * @param cd crypt device handle
+ * @param memory_kb memory limit in kilobytes, @e 0 means usable physical
+ * 	  memory (default)
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Limit cannot exceed usable physical memory (half of physical memory
+ * 	 or free memory if swap is not available). Single PBKDF always runs
+ * 	 even if it requires more memory than the limit.
+ */
+int crypt_set_pbkdf_memory_limit(struct crypt_device *cd, uint64_t memory_kb);
+
+/**
+ * Probe device-mapper target versions again.
+ *
+ * Detected kernel device-mapper features are shared by all device handles
+ * in the process and probed only once. Use this function if a target module
+ * was loaded or upgraded in the meantime.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ *
+ * @return 0 on success or negative errno value otherwise.
+ */
+int crypt_refresh_dm_features(struct crypt_device *cd);
+
 /** @} */
 
 /**
@@ -524,6 +856,11 @@ struct crypt_params_verity {
 #define CRYPT_VERITY_CREATE_HASH (UINT32_C(1) << 2)
 /** Root hash signature required for activation */
 #define CRYPT_VERITY_ROOT_HASH_SIGNATURE (UINT32_C(1) << 3)
+/** Verify hash in userspace and report all corrupted blocks (with CRYPT_VERITY_CHECK_HASH) */
+#define CRYPT_VERITY_CHECK_HASH_ALL (UINT32_C(1) << 4)
+/** Create hash tree in memory or on scratch device and write it in one pass (with CRYPT_VERITY_CREATE_HASH)
+ *  @see crypt_set_verity_stage */
+#define CRYPT_VERITY_CREATE_STAGED (UINT32_C(1) << 5)
 
 /**
  *
@@ -648,6 +985,40 @@ int crypt_format(struct crypt_device *cd,
 	size_t volume_key_size,
 	void *params);
 
+/**
+ * Create (format) new crypt device with dm-integrity in inline mode.
+ *
+ * Integrity tags are stored directly in per-sector metadata of the data
+ * device (for example NVMe namespace formatted with metadata and without
+ * protection information), there is no separate tag area and no journal.
+ *
+ * @param cd crypt device handle
+ * @param type type of device, only @e CRYPT_INTEGRITY and @e CRYPT_LUKS2 (with integrity) are supported
+ * @param cipher (e.g. "aes"), unused for @e CRYPT_INTEGRITY
+ * @param cipher_mode including IV specification (e.g. "xts-plain"), unused for @e CRYPT_INTEGRITY
+ * @param uuid requested UUID or @e NULL if it should be generated
+ * @param volume_key pre-generated volume key or @e NULL if it should be generated
+ * @param volume_key_size size of volume key in bytes.
+ * @param params crypt type specific parameters (see @link crypt-type @endlink)
+ *
+ * @returns @e 0 on success, @e -ENOTSUP if the device or kernel does not support
+ * 	    inline mode or negative errno value otherwise.
+ *
+ * @note Device must expose enough per-sector metadata bytes for the tag and its
+ * 	 metadata interval must match the integrity sector size. Journal, interleave
+ * 	 and detached metadata device options cannot be used.
+ * @note Plain @link crypt_format @endlink selects inline mode automatically if
+ * 	 the device and kernel support it and no journal related option is requested.
+ */
+int crypt_format_inline(struct crypt_device *cd,
+	const char *type,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *uuid,
+	const char *volume_key,
+	size_t volume_key_size,
+	void *params);
+
 /**
  * Set format compatibility flags.
  *
@@ -759,6 +1130,51 @@ const char *crypt_get_subsystem(struct crypt_device *cd);
  */
 int crypt_volume_key_keyring(struct crypt_device *cd, int enable);
 
+/**
+ * Enable or disable process-wide cache of unlocked volume keys.
+ * If enabled, volume key unlocked from a LUKS2 keyslot is kept in locked
+ * memory for @e timeout seconds and repeated unlock with the same passphrase
+ * (activation, resume, volume key retrieval) skips keyslot PBKDF.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param timeout validity of cached volume keys in seconds,
+ * 	  @e 0 disables the cache (default) and wipes all cached keys
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Cached key is bound to LUKS2 header UUID, header sequence id
+ * 	 and digest, any header update invalidates it. Passphrase is never
+ * 	 stored, only its keyed hash.
+ * @note The switch is global on the library level.
+ */
+int crypt_volume_key_cache(struct crypt_device *cd, unsigned int timeout);
+
+/**
+ * Enable or disable parallel keyslot unlock. When enabled and no keyslot
+ * is specified, PBKDF of all active keyslots is run concurrently
+ * (every keyslot in a separate thread) and the first keyslot that opens
+ * the volume key is used; remaining keyslots are not tried.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param enable 0 to disable parallel unlock (default) otherwise enable it
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Supported for LUKS1 and LUKS2 devices. For LUKS2, keyslots with
+ * 	 the same priority are tried in parallel, the number of concurrently
+ * 	 running memory-hard PBKDF is limited by available physical memory.
+ * 	 Parallel unlock is not used if memory-hard PBKDF serialization
+ * 	 is requested (@link CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF @endlink).
+ * @note For LUKS2 activation by any token, token handlers for tokens
+ * 	 with the same keyslot priority are run in parallel and the first
+ * 	 token that unlocks a keyslot is used. Only if all these handlers declare
+ * 	 @link CRYPT_TOKEN_CAP_PARALLEL_OPEN @endlink (builtin tokens and external
+ * 	 tokens exporting @e CRYPT_TOKEN_ABI_CAPABILITIES), tokens are tried serially otherwise.
+ * @note Number of threads is limited by @link crypt_set_threads @endlink.
+ * @note The switch is global on the library level.
+ */
+int crypt_parallel_unlock(struct crypt_device *cd, int enable);
+
 /**
  * Load crypt device parameters from on-disk header.
  *
@@ -779,6 +1195,43 @@ int crypt_load(struct crypt_device *cd,
 	const char *requested_type,
 	void *params);
 
+/**
+ * LUKS binary header summary, see @link crypt_header_scan_batch @endlink.
+ */
+struct crypt_header_summary {
+	const char *device; /**< path to device or file with LUKS header */
+	int result; /**< output: @e 0 if LUKS header found, @e -EINVAL if not LUKS or negative errno */
+	unsigned int version; /**< output: LUKS version (1 or 2) */
+	uint64_t seqid; /**< output: header sequence id (LUKS2 only) */
+	uint64_t hdr_size; /**< output: header size including JSON area (LUKS2 only) */
+	char uuid[40]; /**< output: header UUID */
+	char label[48]; /**< output: label (LUKS2 only) */
+	char subsystem[48]; /**< output: subsystem label (LUKS2 only) */
+};
+
+/**
+ * Read LUKS binary header summary of many devices at once.
+ *
+ * Only one aligned 4096 bytes read of the primary binary header is issued
+ * per device, JSON metadata is neither read nor validated. Devices are
+ * scanned in parallel.
+ *
+ * @param headers array of header summaries with @e device set
+ * @param count number of items in @e headers
+ * @param threads maximal number of parallel scans, @e 0 means default
+ *
+ * @return @e 0 if all devices were scanned (not all need to contain LUKS header),
+ * 	   otherwise negative errno value. Result of every device is
+ * 	   stored in its @e result member.
+ *
+ * @note Binary header checksum covers also JSON area, so the returned data
+ *	 is not verified. Use @link crypt_load @endlink for full validation.
+ * @note Secondary LUKS2 header is not scanned.
+ */
+int crypt_header_scan_batch(struct crypt_header_summary *headers,
+	size_t count,
+	unsigned int threads);
+
 /**
  * Try to repair crypt device LUKS on-disk header if invalid.
  *
@@ -807,9 +1260,12 @@ int crypt_repair(struct crypt_device *cd,
  *
  * @return @e 0 on success or negative errno value otherwise.
  *
+ * @note Only the length of active dm-crypt table is changed, the volume key
+ * 	 (or its kernel keyring reference) is taken from the active table.
+ *
  * @note Most notably it returns -EPERM when device was activated with volume key
- * 	 in kernel keyring and current device handle (context) doesn't have verified key
- * 	 loaded in kernel. To load volume key for already active device use any of
+ * 	 in kernel keyring, the key referenced by active table is no longer available
+ * 	 and current device handle (context) doesn't have verified key loaded in kernel. To load volume key for already active device use any of
  * 	 @link crypt_activate_by_passphrase @endlink, @link crypt_activate_by_keyfile @endlink,
  * 	 @link crypt_activate_by_keyfile_offset @endlink, @link crypt_activate_by_volume_key @endlink,
  * 	 @link crypt_activate_by_keyring @endlink or @link crypt_activate_by_token @endlink with flag
@@ -833,6 +1289,32 @@ int crypt_resize(struct crypt_device *cd,
 int crypt_suspend(struct crypt_device *cd,
 	const char *name);
 
+/**
+ * Suspend crypt device and keep its volume key for fast resume.
+ *
+ * Volume key is verified against LUKS2 metadata and stored in the user
+ * kernel keyring as a logon key (payload cannot be read from userspace)
+ * that expires after @e timeout seconds. Until then the device can be
+ * resumed by @ref crypt_resume_by_cached_key without keyslot unlock (PBKDF).
+ *
+ * @param cd LUKS2 crypt device handle
+ * @param name name of device to suspend
+ * @param timeout validity of cached volume key in seconds (must be non-zero)
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note Volume key stays in kernel memory while device is suspended,
+ * 	 use only if the suspend is not meant to protect against memory
+ * 	 attacks during the @e timeout period.
+ * @note Device activated with volume key in kernel keyring has no readable
+ * 	 key in the device-mapper table and cannot use this mode (-ENOTSUP).
+ * @note User keyring must be reachable from the session keyring
+ * 	 of the resuming process.
+ */
+int crypt_suspend_cache_key(struct crypt_device *cd,
+	const char *name,
+	unsigned int timeout);
+
 /**
  * Resume crypt device using passphrase.
  *
@@ -941,6 +1423,20 @@ int crypt_resume_by_token_pin(struct crypt_device *cd,
 	const char *pin,
 	size_t pin_size,
 	void *usrptr);
+
+/**
+ * Resume crypt device using volume key cached by @ref crypt_suspend_cache_key.
+ * The cached key is removed from kernel keyring after successful resume.
+ *
+ * @param cd LUKS2 crypt device handle
+ * @param name name of device to resume
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note ENOENT errno means there is no cached volume key (or it expired).
+ */
+int crypt_resume_by_cached_key(struct crypt_device *cd,
+	const char *name);
 /** @} */
 
 /**
@@ -1291,6 +1787,66 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
 	struct crypt_keyslot_context *new_kc,
 	uint32_t flags);
 
+/**
+ * Add more key slots by volume key provided by keyslot context (kc).
+ * Volume key is unlocked only once and used for all new keyslots.
+ * New keyslot @e i will be protected by passphrase provided by @e new_kcs[i].
+ *
+ * @pre @e cd contains initialized and formatted LUKS device context.
+ *
+ * @param cd crypt device handle
+ * @param keyslot_existing existing keyslot or CRYPT_ANY_SLOT to get volume key from.
+ * @param kc keyslot context providing volume key.
+ * @param keyslots_new array of new keyslots or CRYPT_ANY_SLOT (first free number is used),
+ * 	  allocated keyslot numbers are stored back to the array.
+ * @param new_kcs array of keyslot contexts providing passphrase for new keyslots.
+ * @param count number of new keyslots
+ * @param flags key flags to set (the same as for @link crypt_keyslot_add_by_keyslot_context @endlink
+ * 	  except @e CRYPT_VOLUME_KEY_SET)
+ *
+ * @return @e 0 on success or negative errno otherwise.
+ *
+ * @note For LUKS2 metadata is written only once, after all keyslots are stored.
+ * 	 If any keyslot cannot be added, no new keyslot is stored in metadata.
+ * 	 For LUKS1 keyslots are written one by one.
+ */
+int crypt_keyslots_add_by_keyslot_context(struct crypt_device *cd,
+	int keyslot_existing,
+	struct crypt_keyslot_context *kc,
+	int *keyslots_new,
+	struct crypt_keyslot_context **new_kcs,
+	size_t count,
+	uint32_t flags);
+
+/**
+ * Rebalance PBKDF cost of LUKS2 keyslots for the current host.
+ *
+ * Unlock time of every keyslot is estimated from PBKDF benchmark on the current
+ * host. Keyslots with estimated unlock time outside of the requested window
+ * that are unlocked by one of @e kcs are re-encrypted with PBKDF
+ * parameters calibrated for this host (see @link crypt_set_pbkdf_type @endlink).
+ *
+ * @pre @e cd contains initialized and formatted LUKS2 device context.
+ *
+ * @param cd crypt device handle
+ * @param kcs array of keyslot contexts providing passphrases of keyslots
+ * @param count number of items in @e kcs
+ * @param min_time_ms keyslots with faster estimated unlock are rewrapped
+ * @param max_time_ms keyslots with slower estimated unlock are rewrapped
+ *
+ * @return number of rewrapped keyslots or negative errno value otherwise.
+ *
+ * @note Every keyslot is rewrapped through a free keyslot (stored and committed
+ * 	 first, then the old keyslot is destroyed), so a crash or failure never leaves
+ * 	 a keyslot unusable. Keyslots are skipped if there is no free keyslot.
+ * 	 Keyslots not unlocked by any of @e kcs are left untouched.
+ */
+int crypt_keyslots_rebalance_by_keyslot_context(struct crypt_device *cd,
+	struct crypt_keyslot_context **kcs,
+	size_t count,
+	uint32_t min_time_ms,
+	uint32_t max_time_ms);
+
 /**
  * Destroy (and disable) key slot.
  *
@@ -1304,6 +1860,23 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
  * @note Note that there is no passphrase verification used.
  */
 int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot);
+
+/**
+ * Destroy (and disable) more key slots at once.
+ *
+ * @pre @e cd contains initialized and formatted LUKS device context
+ *
+ * @param cd crypt device handle
+ * @param keyslots array of key slots to destroy
+ * @param count number of key slots in array
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note For LUKS2 all keyslot areas are wiped in one pass, device is synced
+ * and metadata written only once.
+ * @note Note that there is no passphrase verification used.
+ */
+int crypt_keyslots_destroy(struct crypt_device *cd, const int *keyslots, size_t count);
 /** @} */
 
 /**
@@ -1369,6 +1942,15 @@ int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot);
 #define CRYPT_ACTIVATE_RECALCULATE_RESET (UINT32_C(1) << 26)
 /** dm-verity: try to use tasklets */
 #define CRYPT_ACTIVATE_TASKLETS (UINT32_C(1) << 27)
+/** dm-integrity: inline mode, tags are stored in per-sector device metadata (no journal) */
+#define CRYPT_ACTIVATE_INLINE_MODE (UINT32_C(1) << 28)
+/** dm-crypt: map LUKS2 device through inline encryption hardware (blk-crypto) if the data device
+ *  supports the cipher, otherwise dm-crypt is used. Volume key is passed in device table
+ *  (cannot be combined with CRYPT_ACTIVATE_KEYRING_KEY) and such device cannot be suspended.
+ *  Set in active device flags only if inline encryption is really used. */
+#define CRYPT_ACTIVATE_INLINE_CRYPT (UINT32_C(1) << 29)
+/** dm-crypt: use high priority workqueues for encryption and I/O submission */
+#define CRYPT_ACTIVATE_HIGH_PRIORITY (UINT32_C(1) << 30)
 
 /**
  * Active device runtime attributes
@@ -1405,17 +1987,124 @@ int crypt_get_active_device(struct crypt_device *cd,
  */
 uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd,
 	const char *name);
-/** @} */
 
 /**
- * @defgroup crypt-pflags LUKS2 Device persistent flags and requirements
- * @addtogroup crypt-pflags
- * @{
+ * Active device I/O statistics
  */
+struct crypt_active_stats {
+	uint32_t size;               /**< size of the structure in bytes, set by caller */
+	uint64_t read_ios;           /**< completed read requests */
+	uint64_t read_sectors;       /**< read sectors (512 bytes) */
+	uint64_t read_ticks_ms;      /**< time spent on read requests in ms */
+	uint64_t write_ios;          /**< completed write requests */
+	uint64_t write_sectors;      /**< written sectors (512 bytes) */
+	uint64_t write_ticks_ms;     /**< time spent on write requests in ms */
+	uint64_t in_flight;          /**< requests in flight */
+	uint64_t io_ticks_ms;        /**< time the device was busy in ms */
+	uint64_t integrity_failures; /**< detected integrity failures */
+};
 
 /**
- * LUKS2 header requirements
- */
+ * Receive I/O statistics of active device.
+ *
+ * Counters are read from kernel block layer statistics of the device-mapper
+ * device, integrity failures are read from dm-integrity device (also
+ * if dm-integrity is used underneath dm-crypt with authenticated encryption).
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param name name of active device
+ * @param stats preallocated active device statistics to fill,
+ * 	  @e size member must be set to sizeof(struct crypt_active_stats)
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Average latency of requests is (read|write)_ticks_ms divided by
+ * 	 number of (read|write) requests.
+ * @note Only fields inside @e size are filled, so structure can be extended
+ * 	 in later versions.
+ */
+int crypt_get_active_stats(struct crypt_device *cd,
+	const char *name,
+	struct crypt_active_stats *stats);
+
+/**
+ * Get progress of background integrity tags recalculation.
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param name name of active dm-integrity device (or dm-crypt device
+ * 	  with authenticated encryption)
+ * @param recalc_sector sector (512 bytes) where recalculation continues
+ * @param data_sectors size of provided data in sectors (512 bytes)
+ *
+ * @return @e 0 if recalculation is not finished, @e -ENOENT if there is
+ * 	   nothing to recalculate or negative errno value otherwise
+ */
+int crypt_get_active_integrity_recalc(struct crypt_device *cd,
+	const char *name,
+	uint64_t *recalc_sector,
+	uint64_t *data_sectors);
+
+/**
+ * Status of one active device reported by @link crypt_status_all @endlink.
+ * All pointers are valid only inside the callback.
+ */
+struct crypt_active_device_status {
+	const char *name;          /**< active device name */
+	const char *type;          /**< device type from DM UUID (e.g. LUKS2, PLAIN, VERITY) */
+	const char *uuid;          /**< DM UUID without CRYPT- prefix */
+	const char *target;        /**< first crypt, verity or integrity target */
+	const char *cipher;        /**< dm-crypt cipher specification or @e NULL */
+	const char *integrity;     /**< integrity algorithm or @e NULL */
+	const char *device;        /**< underlying data device */
+	uint64_t offset;           /**< offset in sectors */
+	uint64_t iv_offset;        /**< IV initialisation sector */
+	uint64_t size;             /**< active device size in sectors */
+	uint32_t flags;            /**< activation flags */
+	uint32_t sector_size;      /**< encryption, integrity or verity data block size */
+	uint32_t tag_size;         /**< integrity tag size */
+	uint32_t volume_key_size;  /**< volume key size in bytes */
+	const char *volume_key;    /**< volume key (only with @link CRYPT_STATUS_ALL_VOLUME_KEY @endlink) */
+	unsigned segments;         /**< number of device-mapper segments */
+	int busy;                  /**< device is opened */
+	struct crypt_active_stats stats; /**< I/O statistics (only with @link CRYPT_STATUS_ALL_STATS @endlink) */
+};
+
+/** read volume keys of devices not using kernel keyring */
+#define CRYPT_STATUS_ALL_VOLUME_KEY	(UINT32_C(1) << 0)
+/** read I/O statistics (integrity failures are not included) */
+#define CRYPT_STATUS_ALL_STATS		(UINT32_C(1) << 1)
+
+/**
+ * Report status of all active crypt, verity and integrity devices.
+ *
+ * Devices are listed with a single device-mapper ioctl and queried in one
+ * device-mapper context, internal helper devices are not reported.
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param flags @e CRYPT_STATUS_ALL_* flags
+ * @param callback function called for every device, non-zero return value stops
+ * 	  the iteration and it is returned from this function
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Volume key is never read from kernel unless requested by flag.
+ */
+int crypt_status_all(struct crypt_device *cd,
+	uint32_t flags,
+	int (*callback)(const struct crypt_active_device_status *status, void *usrptr),
+	void *usrptr);
+/** @} */
+
+/**
+ * @defgroup crypt-pflags LUKS2 Device persistent flags and requirements
+ * @addtogroup crypt-pflags
+ * @{
+ */
+
+/**
+ * LUKS2 header requirements
+ */
 /** Unfinished offline reencryption */
 #define CRYPT_REQUIREMENT_OFFLINE_REENCRYPT	(UINT32_C(1) << 0)
 /** Online reencryption in-progress */
@@ -1465,6 +2154,68 @@ int crypt_persistent_flags_set(struct crypt_device *cd,
 int crypt_persistent_flags_get(struct crypt_device *cd,
 	crypt_flags_type type,
 	uint32_t *flags);
+
+/**
+ * Suggest dm-crypt performance activation flags for device.
+ *
+ * Flags are selected according to data device queue characteristics
+ * (rotational, number of hardware queues), number of online CPUs and
+ * throughput of device cipher measured by a short benchmark.
+ *
+ * @param cd crypt device handle with loaded or formatted metadata
+ * @param flags output, combination of @e CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+ * 	  @e CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS, @e CRYPT_ACTIVATE_NO_READ_WORKQUEUE
+ * 	  and @e CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE supported by running kernel
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Suggested flags can be stored by @link crypt_persistent_flags_set @endlink.
+ */
+int crypt_perf_flags_suggest(struct crypt_device *cd, uint32_t *flags);
+
+/**
+ * Change performance flags of active device without deactivation.
+ *
+ * Active device table is read from kernel, only requested flags are changed
+ * and the table is reloaded. Volume key is not needed, device is
+ * suspended only for the time of the table swap.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param name name of active device
+ * @param flags requested flags values
+ * @param mask flags to change, combination of dm-crypt @e CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+ * 	  @e CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS, @e CRYPT_ACTIVATE_NO_READ_WORKQUEUE,
+ * 	  @e CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE, @e CRYPT_ACTIVATE_HIGH_PRIORITY
+ * 	  and dm-integrity @e CRYPT_ACTIVATE_NO_JOURNAL,
+ * 	  @e CRYPT_ACTIVATE_RECALCULATE and @e CRYPT_ACTIVATE_RECALCULATE_RESET
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note For dm-crypt with authenticated encryption dm-integrity flags are changed
+ * 	 on the underlying dm-integrity device.
+ * @note Clearing @e CRYPT_ACTIVATE_RECALCULATE pauses background recalculation
+ * 	 of integrity tags, the position is kept in superblock and recalculation
+ * 	 continues when the flag is set again. Progress can be read by
+ * 	 @link crypt_get_active_integrity_recalc @endlink.
+ * @note Flags are not stored in metadata, use @link crypt_persistent_flags_set @endlink.
+ */
+int crypt_retune(struct crypt_device *cd, const char *name, uint32_t flags, uint32_t mask);
+
+/**
+ * Restrict encryption workqueue of active dm-crypt device to set of CPUs.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param name name of active dm-crypt device
+ * @param cpumask CPU mask in kernel hexadecimal format (e.g. "f" or "ff,00000000")
+ *
+ * @return @e 0 on success, @e -ENOTSUP if the kernel does not provide
+ * 	   per-device workqueue attributes or the workqueue is bound to CPUs
+ * 	   (@e CRYPT_ACTIVATE_SAME_CPU_CRYPT), negative errno value otherwise
+ *
+ * @note Mask is not stored in metadata and it is not kept over deactivation,
+ * 	 it must be set again after every activation or refresh.
+ */
+int crypt_set_cpumask(struct crypt_device *cd, const char *name, const char *cpumask);
 /** @} */
 
 /**
@@ -1492,6 +2243,142 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	size_t passphrase_size,
 	uint32_t flags);
 
+/**
+ * Prepared passphrase activation, see @link crypt_activate_by_passphrase_batch @endlink.
+ */
+struct crypt_activation {
+	struct crypt_device *cd; /**< crypt device handle with loaded metadata */
+	const char *name; /**< name of device to create, if @e NULL only check passphrase */
+	int keyslot; /**< requested keyslot to check or @e CRYPT_ANY_SLOT */
+	const char *passphrase; /**< passphrase used to unlock volume key */
+	size_t passphrase_size; /**< size of @e passphrase */
+	uint32_t flags; /**< activation flags */
+	int result; /**< output: unlocked key slot number or negative errno */
+};
+
+/**
+ * Activate many devices or check many passphrases at once.
+ *
+ * Volume keys of all devices are unlocked in parallel, then all devices
+ * are created and the function waits for udev processing of all of them
+ * at once.
+ *
+ * @param activations array of prepared activations (each with different crypt device handle)
+ * @param count number of items in @e activations
+ *
+ * @return @e 0 if all activations succeeded, otherwise negative errno value
+ * 	   of the first failed activation. Result of every activation is
+ * 	   stored in its @e result member as for @link crypt_activate_by_passphrase @endlink.
+ *
+ * @note Number of parallel threads is limited by @link crypt_set_threads @endlink
+ * 	 of the first device handle and by available physical memory for memory-hard
+ * 	 PBKDF. Memory-hard PBKDF serialization (@link CRYPT_ACTIVATE_SERIALIZE_MEMORY_HARD_PBKDF @endlink)
+ * 	 disables parallel unlock.
+ * @note Parallel unlock is used for LUKS1 and LUKS2 devices, other devices
+ * 	 (and LUKS2 devices with reencryption in progress) are activated
+ * 	 by @link crypt_activate_by_passphrase @endlink.
+ */
+int crypt_activate_by_passphrase_batch(struct crypt_activation *activations,
+	size_t count);
+
+/**
+ * Do not wait for udev processing of activated and deactivated devices.
+ *
+ * If enabled, device activation and deactivation functions return as soon
+ * as the device-mapper device is created or removed, udev events of all
+ * such devices are then synchronized at once by @link crypt_udev_settle @endlink.
+ * Creation of devices used only internally by the library (and of other than
+ * dm-crypt or dm-verity devices) is always synchronized immediately.
+ *
+ * @param enable @e 1 to enable, @e 0 to disable deferred udev synchronization
+ * 	  (disabling waits for all pending udev processing)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The switch is per thread, udev processing must be settled by the same
+ * 	 thread that activated devices.
+ * @note Device node in /dev/mapper or udev symlinks need not exist until
+ * 	 udev processing is settled.
+ */
+int crypt_udev_defer(int enable);
+
+/**
+ * Wait for udev processing of all devices since @link crypt_udev_defer @endlink
+ * was enabled or since last successful settle.
+ *
+ * @param wait @e 1 to block until udev processing is finished, @e 0 to only check
+ *
+ * @return @e 0 if there is no pending udev processing,
+ * 	   @e -EAGAIN if udev is still processing (only for @e wait @e 0)
+ * 	   or negative errno value otherwise.
+ */
+int crypt_udev_settle(int wait);
+
+/**
+ * Asynchronous activation request, see @link crypt_activate_by_keyslot_context_async @endlink.
+ */
+struct crypt_activation_request;
+
+/**
+ * Submit asynchronous activation of device (or check of keyslot context).
+ *
+ * Activation (including PBKDF, device-mapper and udev processing) runs
+ * on an internal worker thread pool shared by all device handles,
+ * the function returns immediately. Completion is signalled by file
+ * descriptor returned by @link crypt_activation_request_get_fd @endlink,
+ * suitable for poll() in event loop.
+ *
+ * @param cd crypt device handle with loaded metadata
+ * @param name name of device to create, if @e NULL only check keyslot context
+ * @param keyslot requested keyslot to check or @e CRYPT_ANY_SLOT
+ * 	  (ignored for @link CRYPT_KC_TYPE_TOKEN @endlink and @link CRYPT_KC_TYPE_KEY @endlink)
+ * @param kc keyslot context used to unlock volume key
+ * @param flags activation flags
+ * @param req returns activation request handle
+ *
+ * @return @e 0 if request was submitted or negative errno value otherwise.
+ *
+ * @note Device handle @e cd and keyslot context @e kc must not be used
+ * 	 nor freed until the request is completed. Requests for different
+ * 	 device handles are processed concurrently.
+ * @note Log callback of @e cd is called from worker thread.
+ */
+int crypt_activate_by_keyslot_context_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	struct crypt_keyslot_context *kc,
+	uint32_t flags,
+	struct crypt_activation_request **req);
+
+/**
+ * Get file descriptor signalling completion of activation request.
+ * The descriptor becomes readable when the request is completed,
+ * it is owned by the request and closed by @link crypt_activation_request_free @endlink.
+ *
+ * @param req activation request handle
+ *
+ * @return file descriptor or negative errno value otherwise.
+ */
+int crypt_activation_request_get_fd(struct crypt_activation_request *req);
+
+/**
+ * Get result of activation request.
+ *
+ * @param req activation request handle
+ *
+ * @return @e -EINPROGRESS if the request is not completed yet, otherwise
+ * 	   result as for synchronous activation by the keyslot context type
+ * 	   (unlocked key slot number or negative errno).
+ */
+int crypt_activation_request_result(struct crypt_activation_request *req);
+
+/**
+ * Release activation request, waits for its completion if still running.
+ *
+ * @param req activation request handle
+ */
+void crypt_activation_request_free(struct crypt_activation_request *req);
+
 /**
  * Activate device or check using key file.
  *
@@ -1585,6 +2472,65 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	size_t signature_size,
 	uint32_t flags);
 
+/**
+ * Prepared VERITY activation, see @link crypt_activate_by_signed_key_batch @endlink.
+ */
+struct crypt_verity_activation {
+	struct crypt_device *cd; /**< VERITY device handle with loaded metadata */
+	const char *name; /**< name of device to create */
+	const char *root_hash; /**< root hash */
+	size_t root_hash_size; /**< size of @e root_hash */
+	const char *signature; /**< optional root hash signature */
+	size_t signature_size; /**< size of @e signature */
+	uint32_t flags; /**< activation flags */
+	int result; /**< output: @e 0 or negative errno */
+};
+
+/**
+ * Activate many VERITY devices at once.
+ *
+ * Devices are created one by one, but the function waits for udev processing
+ * of all of them at once. The same signature of the same root hash is loaded
+ * in kernel keyring only once for all devices that use it.
+ *
+ * @param activations array of prepared activations (each with different device handle)
+ * @param count number of items in @e activations
+ *
+ * @return @e 0 if all activations succeeded, otherwise negative errno value
+ * 	   of the first failed activation. Result of every activation is
+ * 	   stored in its @e result member.
+ *
+ * @note Signature is always verified by the kernel for every device.
+ */
+int crypt_activate_by_signed_key_batch(struct crypt_verity_activation *activations,
+	size_t count);
+
+/**
+ * Prepared VERITY metadata load, see @link crypt_load_verity_batch @endlink.
+ */
+struct crypt_verity_load {
+	struct crypt_device *cd; /**< VERITY device handle from @link crypt_init_data_device @endlink */
+	struct crypt_params_verity *params; /**< optional parameters as for @link crypt_load @endlink */
+	int result; /**< output: @e 0 or negative errno */
+};
+
+/**
+ * Load VERITY superblocks of many devices in parallel.
+ *
+ * Intended as a preparation step for @link crypt_activate_by_signed_key_batch @endlink.
+ *
+ * @param loads array of prepared loads (each with different device handle)
+ * @param count number of items in @e loads
+ *
+ * @return @e 0 if all loads succeeded, otherwise negative errno value
+ * 	   of the first failed load. Result of every load is stored in its
+ * 	   @e result member.
+ *
+ * @note Number of parallel threads is limited by @link crypt_set_threads @endlink
+ * 	 of the first device handle.
+ */
+int crypt_load_verity_batch(struct crypt_verity_load *loads, size_t count);
+
 /**
  * Activate device using passphrase stored in kernel keyring.
  *
@@ -1634,6 +2580,34 @@ int crypt_deactivate_by_name(struct crypt_device *cd,
  * Deactivate crypt device. See @ref crypt_deactivate_by_name with empty @e flags.
  */
 int crypt_deactivate(struct crypt_device *cd, const char *name);
+
+/**
+ * Prepared deactivation, see @link crypt_deactivate_by_name_batch @endlink.
+ */
+struct crypt_deactivation {
+	struct crypt_device *cd; /**< crypt device handle, can be @e NULL */
+	const char *name; /**< name of device to deactivate */
+	uint32_t flags; /**< deactivation flags */
+	int result; /**< output: @e 0 on success or negative errno */
+};
+
+/**
+ * Deactivate many devices at once.
+ *
+ * Devices are removed in levels of dependency order, a device held by
+ * other devices is removed after all of them. The function waits for udev
+ * processing only once per level (including internal devices
+ * like dm-integrity underneath dm-crypt).
+ *
+ * @param deactivations array of prepared deactivations
+ * @param count number of items in @e deactivations
+ *
+ * @return @e 0 if all deactivations succeeded, otherwise negative errno value
+ * 	   of the first failed deactivation. Result of every deactivation is
+ * 	   stored in its @e result member as for @link crypt_deactivate_by_name @endlink.
+ */
+int crypt_deactivate_by_name_batch(struct crypt_deactivation *deactivations,
+	size_t count);
 /** @} */
 
 /**
@@ -1888,6 +2862,129 @@ int crypt_header_is_detached(struct crypt_device *cd);
 int crypt_get_verity_info(struct crypt_device *cd,
 	struct crypt_params_verity *vp);
 
+/**
+ * Range of data blocks for VERITY hash update.
+ */
+struct crypt_verity_block_range {
+	uint64_t start; /**< first data block */
+	uint64_t count; /**< number of data blocks */
+};
+
+/**
+ * Update VERITY hash area after modification of some data blocks.
+ * Only hash blocks covering changed data blocks and their parents
+ * are recalculated, the rest of hash area must be valid for the old data.
+ *
+ * @param cd crypt device handle (loaded or formatted VERITY device)
+ * @param ranges array of changed data block ranges
+ * @param ranges_count number of items in ranges array
+ * @param root_hash buffer for the new root hash
+ * @param root_hash_size size of root hash buffer
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Superblock is not changed, FEC area (if configured) is recalculated
+ *       completely. Use verification of the whole device to check
+ *       consistency of the updated hash tree.
+ */
+int crypt_verity_update(struct crypt_device *cd,
+	const struct crypt_verity_block_range *ranges,
+	size_t ranges_count,
+	char *root_hash,
+	size_t root_hash_size);
+
+/**
+ * Format VERITY device from data stream (for example a pipe) read until
+ * end of file. The number of data blocks is not known in advance, hash
+ * tree is created while the data is read and the data can be copied
+ * to the data device.
+ *
+ * @param cd crypt device handle (with hash device)
+ * @param uuid requested UUID or @e NULL if it should be generated
+ * @param params verity format parameters, @e data_size must be zero and
+ *        @e CRYPT_VERITY_CREATE_HASH flag must be set. If @e data_device
+ *        is set, data are written to it, otherwise data are only hashed.
+ * @param data_fd file descriptor of data stream
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Data stream size must be a multiple of data block size.
+ *       FEC (if configured) is calculated from the data device after
+ *       the stream ends.
+ */
+int crypt_format_verity_stream(struct crypt_device *cd,
+	const char *uuid,
+	struct crypt_params_verity *params,
+	int data_fd);
+
+/**
+ * Repair corrupted blocks of VERITY device using forward error correction.
+ * Hash tree is verified to find corrupted blocks, only Reed-Solomon blocks
+ * containing them are decoded and repaired blocks are written back
+ * to data (or hash) device. The device is verified again after repair.
+ *
+ * @param cd crypt device handle (loaded VERITY device with FEC device)
+ * @param root_hash expected root hash
+ * @param root_hash_size size of root hash
+ * @param repaired number of repaired blocks, can be @e NULL
+ *
+ * @returns @e 0 on success (device is valid) or negative errno value otherwise,
+ *          @e -EPERM if some blocks cannot be repaired.
+ *
+ * @note Device must not be active (or used) during repair.
+ */
+int crypt_verity_repair(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint64_t *repaired);
+
+/**
+ * Verify only a sample of VERITY device, for example for a quick check
+ * during boot. The sample unit is one hash block of the lowest level with
+ * all data blocks it covers. Digests of every sampled unit are checked
+ * along the hash tree path up to the root hash, only hash blocks on these
+ * paths are read. Samples are verified in parallel.
+ *
+ * @param cd crypt device handle (loaded VERITY device)
+ * @param root_hash expected root hash
+ * @param root_hash_size size of root hash
+ * @param percent percentage of lowest level hash blocks to verify (1-100),
+ *        @e 100 verifies the whole device
+ * @param seed @e 0 for evenly spaced samples, otherwise samples are spread
+ *        pseudo-randomly (the same seed selects the same samples)
+ * @param verified_blocks number of verified data blocks, can be @e NULL
+ *
+ * @returns @e 0 if all samples are valid or negative errno value otherwise,
+ *          @e -EPERM for corrupted sample, @e -EFAULT for root hash mismatch.
+ *
+ * @note Success does not guarantee that not sampled blocks are valid.
+ */
+int crypt_verity_verify_sample(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint32_t percent,
+	uint64_t seed,
+	uint64_t *verified_blocks);
+
+/**
+ * Set staging area of VERITY hash tree for format with @e CRYPT_VERITY_CREATE_STAGED.
+ * The whole tree is created there and then copied to hash device in one
+ * sequential pass, hash writes are not interleaved with data reads
+ * (useful if data and hash area share one rotational device).
+ *
+ * @param cd crypt device handle
+ * @param scratch_device existing scratch device or file, @e NULL to use memory
+ * @param memory_limit size limit of hash tree created in memory (in bytes),
+ *        @e 0 for default (256 MiB)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Must be set before @e crypt_format call.
+ */
+int crypt_set_verity_stage(struct crypt_device *cd,
+	const char *scratch_device,
+	uint64_t memory_limit);
+
 /**
  * Get device parameters for INTEGRITY device.
  *
@@ -1899,6 +2996,50 @@ int crypt_get_verity_info(struct crypt_device *cd,
  */
 int crypt_get_integrity_info(struct crypt_device *cd,
 	struct crypt_params_integrity *ip);
+
+/**
+ * Integrity write mode for parameters tuning.
+ */
+typedef enum {
+	CRYPT_INTEGRITY_TUNE_JOURNAL = 0, /**< data journal (default dm-integrity mode) */
+	CRYPT_INTEGRITY_TUNE_BITMAP,      /**< bitmap tracking of dirty regions */
+	CRYPT_INTEGRITY_TUNE_DIRECT       /**< no journal (LUKS2 with AEAD) */
+} crypt_integrity_tune_mode;
+
+/**
+ * Measured device profile and expected write amplification.
+ */
+struct crypt_integrity_tune {
+	double write_latency_ms;    /**< median synchronous 4 KiB write latency */
+	double write_mbs;           /**< sequential write bandwidth in MiB/s */
+	double write_amplification; /**< expected writes per written data byte */
+	uint32_t activate_flags;    /**< activation flags for the mode (CRYPT_ACTIVATE_NO_JOURNAL*) */
+};
+
+/**
+ * Benchmark data device and recommend INTEGRITY parameters.
+ *
+ * Device is measured for synchronous write latency and sequential write
+ * bandwidth, journal size, journal (or bitmap) commit interval, bitmap
+ * granularity and buffer size are then set in @e params for the requested mode.
+ *
+ * @param cd crypt device handle with data device set (e.g. by @link crypt_init @endlink)
+ * @param mode requested integrity write mode
+ * @param params integrity parameters to update, @e tag_size (or @e integrity)
+ * 	  and @e sector_size (if set) are used for write amplification estimation
+ * @param tune measured values and expected write amplification
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Benchmark reads and writes back the same data, device must not be used
+ * 	 (it is opened exclusively).
+ * @note In bitmap mode @e journal_watermark and @e journal_commit_time are
+ * 	 overloaded as in @link crypt_params_integrity @endlink.
+ */
+int crypt_integrity_tune(struct crypt_device *cd,
+	crypt_integrity_tune_mode mode,
+	struct crypt_params_integrity *params,
+	struct crypt_integrity_tune *tune);
 /** @} */
 
 /**
@@ -1934,6 +3075,156 @@ int crypt_benchmark(struct crypt_device *cd,
 	double *encryption_mbs,
 	double *decryption_mbs);
 
+/**
+ * Parameters of multi-threaded cipher benchmark.
+ */
+struct crypt_params_benchmark {
+	uint32_t threads;     /**< number of parallel threads (0 means 1) */
+	uint32_t sector_size; /**< encryption sector size in bytes (0 means 512) */
+	size_t buffer_size;   /**< size of one request in bytes, multiple of sector size
+				   (0 means 64 KiB) */
+	uint32_t time_ms;     /**< measurement time for each direction (0 means 1000 ms) */
+};
+
+/**
+ * Result of multi-threaded cipher benchmark.
+ */
+struct crypt_benchmark_result {
+	double encryption_mbs;     /**< aggregate encryption speed of all threads in MiB/s */
+	double decryption_mbs;     /**< aggregate decryption speed of all threads in MiB/s */
+	double encryption_p50_us;  /**< median of one request encryption time in microseconds */
+	double encryption_p99_us;  /**< 99th percentile of one request encryption time */
+	double decryption_p50_us;  /**< median of one request decryption time in microseconds */
+	double decryption_p99_us;  /**< 99th percentile of one request decryption time */
+};
+
+/**
+ * Informational benchmark for ciphers processed in parallel threads.
+ *
+ * Every thread processes its own buffer in requests of @e buffer_size bytes,
+ * each request is encrypted per sector of @e sector_size bytes (as dm-crypt does).
+ * If @e cipher_mode contains plain, plain64 or essiv IV generator, the IV
+ * of every sector is generated as in dm-crypt (512-byte IV sectors).
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "xts-plain64"), other IV generators are not supported
+ * @param volume_key_size size of volume key in bytes
+ * @param iv_size size of IV in bytes
+ * @param params benchmark parameters (or @e NULL for defaults)
+ * @param result measured values
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note If the time cannot be properly measured, -ERANGE is returned.
+ */
+int crypt_benchmark_cipher(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t iv_size,
+	const struct crypt_params_benchmark *params,
+	struct crypt_benchmark_result *result);
+
+/**
+ * Result of authenticated encryption benchmark.
+ */
+struct crypt_benchmark_aead_result {
+	double encryption_mbs;    /**< aggregate encryption speed of data in MiB/s */
+	double decryption_mbs;    /**< aggregate decryption (and verification) speed in MiB/s */
+	double encryption_p99_us; /**< 99th percentile of one request encryption time */
+	double decryption_p99_us; /**< 99th percentile of one request decryption time */
+	uint32_t tag_size;        /**< dm-integrity tag size per sector in bytes (IV and authentication tag) */
+	double write_mbs;         /**< estimated effective write speed with tag overhead in MiB/s */
+	double read_mbs;          /**< estimated effective read speed with tag overhead in MiB/s */
+};
+
+/**
+ * Informational benchmark for LUKS2 authenticated encryption (dm-crypt with integrity).
+ *
+ * Every sector of @e sector_size bytes is processed as one AEAD request with
+ * associated data and authentication tag, as dm-crypt does. Tag size is the same
+ * as stored per sector by dm-integrity for the cipher mode and integrity.
+ * Effective speed scales measured speed by the data part of the data and tag
+ * bytes, dm-integrity journal (which writes data twice) is not included.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "gcm-random" or "xts-plain64")
+ * @param integrity integrity in kernel format (e.g. "aead", "poly1305" or "hmac(sha256)")
+ * @param volume_key_size size of volume key in bytes, including integrity key
+ * @param params benchmark parameters (or @e NULL for defaults)
+ * @param result measured values
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Random IV is not generated for every request (it is generated by kernel RNG
+ * 	 in dm-crypt), the measured speed is upper estimate for random IV modes.
+ */
+int crypt_benchmark_aead(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *integrity,
+	size_t volume_key_size,
+	const struct crypt_params_benchmark *params,
+	struct crypt_benchmark_aead_result *result);
+
+/**
+ * Parameters of device-mapper stack benchmark.
+ */
+struct crypt_params_benchmark_stack {
+	uint64_t size;        /**< size of temporary device in bytes (0 means 1 GiB) */
+	uint32_t sector_size; /**< encryption sector size in bytes (0 means 512) */
+	uint32_t flags;       /**< dm-crypt performance activation flags */
+	uint32_t block_size;  /**< size of one I/O request in bytes (0 means 4096) */
+	uint32_t queue_depth; /**< number of parallel requests (0 means 1) */
+	uint32_t time_ms;     /**< measurement time for each direction (0 means 1000 ms) */
+	int random;           /**< random instead of sequential request offsets */
+};
+
+/**
+ * Result of device-mapper stack benchmark.
+ */
+struct crypt_benchmark_stack_result {
+	double write_iops;    /**< write requests per second */
+	double write_mbs;     /**< write bandwidth in MiB/s */
+	double write_p50_us;  /**< median of write request latency in microseconds */
+	double write_p99_us;  /**< 99th percentile of write request latency */
+	double read_iops;     /**< read requests per second */
+	double read_mbs;      /**< read bandwidth in MiB/s */
+	double read_p50_us;   /**< median of read request latency in microseconds */
+	double read_p99_us;   /**< 99th percentile of read request latency */
+};
+
+/**
+ * Informational benchmark of the kernel device-mapper stack.
+ *
+ * Temporary private dm-zero device is created (and dm-crypt device over it
+ * if @e cipher is set), the device is then written and read with direct I/O
+ * requests, every request in flight is issued by one thread.
+ * Without @e cipher only the dm-zero device is measured as a baseline.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param cipher (e.g. "aes") or @e NULL
+ * @param cipher_mode (e.g. "xts-plain64") or @e NULL
+ * @param volume_key_size size of volume key in bytes
+ * @param params benchmark parameters (or @e NULL for defaults)
+ * @param result measured values
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Only @e CRYPT_ACTIVATE_SAME_CPU_CRYPT, @e CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS,
+ * 	 @e CRYPT_ACTIVATE_NO_READ_WORKQUEUE, @e CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE,
+ * 	 @e CRYPT_ACTIVATE_HIGH_PRIORITY and @e CRYPT_ACTIVATE_IV_LARGE_SECTORS
+ * 	 flags are allowed. Requires root privilege.
+ */
+int crypt_benchmark_stack(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	const struct crypt_params_benchmark_stack *params,
+	struct crypt_benchmark_stack_result *result);
+
 /**
  * Informational benchmark for PBKDF.
  *
@@ -2020,6 +3311,46 @@ crypt_keyslot_priority crypt_keyslot_get_priority(struct crypt_device *cd, int k
  */
 int crypt_keyslot_set_priority(struct crypt_device *cd, int keyslot, crypt_keyslot_priority priority);
 
+/**
+ * Keyslot unlock telemetry (LUKS2).
+ */
+struct crypt_keyslot_telemetry {
+	uint64_t unlocks; /**< number of successful keyslot opens */
+	uint32_t time_ms; /**< duration of the last successful open (key derivation) */
+};
+
+/**
+ * Enable or disable keyslot unlock telemetry (LUKS2)
+ *
+ * With telemetry enabled, every device activation that opens a keyslot records
+ * the keyslot open duration and increments its unlock count in LUKS2 metadata
+ * (header is written on activation). Passphrase checks and other keyslot
+ * operations are not recorded. Keyslots in the same priority class are then tried
+ * in order of their unlock count (the most used first).
+ * Disabling telemetry removes all recorded data.
+ *
+ * @param cd crypt device handle
+ * @param enable @e 1 to enable, @e 0 to disable and remove recorded data
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Telemetry is not security relevant, it is not needed for unlocking.
+ */
+int crypt_keyslot_set_telemetry(struct crypt_device *cd, int enable);
+
+/**
+ * Get keyslot unlock telemetry (LUKS2)
+ *
+ * @param cd crypt device handle
+ * @param keyslot keyslot number
+ * @param telemetry telemetry of keyslot
+ *
+ * @return @e 0 on success, @e -ENOENT if telemetry is disabled
+ *         or nothing is recorded for keyslot, negative errno value otherwise.
+ */
+int crypt_keyslot_get_telemetry(struct crypt_device *cd, int keyslot,
+	struct crypt_keyslot_telemetry *telemetry);
+
 /**
  * Get number of keyslots supported for device type.
  *
@@ -2130,6 +3461,32 @@ int crypt_header_backup(struct crypt_device *cd,
 	const char *requested_type,
 	const char *backup_file);
 
+/**
+ * Prepared header backup, see @link crypt_header_backup_batch @endlink.
+ */
+struct crypt_header_backup_request {
+	struct crypt_device *cd; /**< crypt device handle */
+	const char *requested_type; /**< @link crypt-type @endlink or @e NULL for all known */
+	const char *backup_file; /**< file to backup header to */
+	int result; /**< output: @e 0 on success or negative errno */
+};
+
+/**
+ * Backup headers of many devices at once.
+ *
+ * Backups run in parallel, each device must use its own crypt device handle.
+ * Number of threads is taken from the first handle (see @link crypt_set_threads @endlink).
+ *
+ * @param backups array of prepared header backups
+ * @param count number of items in @e backups
+ *
+ * @return @e 0 if all backups succeeded, otherwise negative errno value
+ * 	   of the first failed backup. Result of every backup is stored
+ * 	   in its @e result member as for @link crypt_header_backup @endlink.
+ */
+int crypt_header_backup_batch(struct crypt_header_backup_request *backups,
+	size_t count);
+
 /**
  * Restore header and keyslots from backup file.
  *
@@ -2259,6 +3616,9 @@ int crypt_wipe(struct crypt_device *cd,
 
 /** Use direct-io */
 #define CRYPT_WIPE_NO_DIRECT_IO (UINT32_C(1) << 0)
+/** Allow discard for zero pattern if device does not support write zeroes
+ *  (every discarded range is spot-verified to read zeroes) */
+#define CRYPT_WIPE_ALLOW_DISCARD (UINT32_C(1) << 1)
 /** @} */
 
 /**
@@ -2319,6 +3679,33 @@ int crypt_token_json_set(struct crypt_device *cd,
 	int token,
 	const char *json);
 
+/**
+ * Token update, see @link crypt_token_json_set_batch @endlink.
+ */
+struct crypt_token_update {
+	int token; /**< token id or @e CRYPT_ANY_TOKEN to allocate new one */
+	const char *json; /**< token JSON or @e NULL to remove token */
+	int result; /**< output: token id or negative errno */
+};
+
+/**
+ * Import, replace or remove many tokens in one metadata update.
+ *
+ * Updates are applied in array order, only the changed tokens are validated
+ * and LUKS2 metadata is written once. If any update fails, no change is written.
+ *
+ * @param cd crypt device handle
+ * @param updates array of token updates
+ * @param count number of items in @e updates
+ *
+ * @return @e 0 on success or negative errno value of the first failed update.
+ * 	   Result of every update is stored in its @e result member
+ * 	   as for @link crypt_token_json_set @endlink.
+ */
+int crypt_token_json_set_batch(struct crypt_device *cd,
+	struct crypt_token_update *updates,
+	size_t count);
+
 /**
  * Token info
  */
@@ -2387,6 +3774,38 @@ int crypt_token_luks2_keyring_get(struct crypt_device *cd,
 	int token,
 	struct crypt_token_params_luks2_keyring *params);
 
+/**
+ * LUKS2 volume key escrow token parameters.
+ */
+struct crypt_token_params_luks2_escrow {
+	const char *key_description; /**< Host key ("user" type) in kernel keyring */
+};
+
+/**
+ * Create a new luks2 volume key escrow token.
+ * The volume key unlocked by passphrase is stored wrapped by the host key
+ * (for example unsealed from TPM and loaded to keyring during boot).
+ * Token unlock then needs no PBKDF and the keyslot is kept as a fallback.
+ *
+ * @param cd crypt device handle
+ * @param token token id or @e CRYPT_ANY_TOKEN to allocate new one
+ * @param keyslot keyslot to unlock volume key and to assign token to
+ * 	  (or @e CRYPT_ANY_SLOT)
+ * @param passphrase passphrase used to unlock volume key
+ * @param passphrase_size size of @e passphrase (binary data)
+ * @param params luks2 escrow token params
+ *
+ * @return allocated token id or negative errno otherwise.
+ *
+ * @note The token no longer unlocks the device once the volume key is changed.
+ */
+int crypt_token_luks2_escrow_set(struct crypt_device *cd,
+	int token,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	const struct crypt_token_params_luks2_escrow *params);
+
 /**
  * Assign a token to particular keyslot.
  * (There can be more keyslots assigned to one token id.)
@@ -2539,6 +3958,81 @@ typedef void (*crypt_token_dump_func) (struct crypt_device *cd, const char *json
  */
 typedef const char * (*crypt_token_version_func) (void);
 
+/**
+ * Asynchronous token handler open start function prototype.
+ * This function only initiates retrieval of password from a token
+ * (hardware or network round trip) and must not block. Operation state
+ * is returned in opaque context @e ctx that is later passed to
+ * @link crypt_token_open_poll_func @endlink and
+ * @link crypt_token_open_finish_func @endlink.
+ *
+ * @param cd crypt device handle
+ * @param token token id
+ * @param pin passphrase (or PIN) to unlock token or @e NULL if not provided
+ * @param pin_size size of @e pin
+ * @param usrptr user data in @link crypt_activate_by_token @endlink
+ * @param ctx returned operation context
+ *
+ * @return 0 if operation was started or negative errno otherwise
+ *         (no context is returned then). Error codes have the same meaning
+ *         as for @link crypt_token_open_pin_func @endlink.
+ */
+typedef int (*crypt_token_open_start_func) (
+	struct crypt_device *cd,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	void *usrptr,
+	void **ctx);
+
+/**
+ * Asynchronous token handler open poll function prototype.
+ * This function checks progress of started operation and must not block.
+ *
+ * @param cd crypt device handle
+ * @param ctx operation context
+ * @param fd returned file descriptor library waits for (POLLIN) before
+ *        next poll call or @e -1 if handler needs to be polled periodically
+ *
+ * @return @e -EINPROGRESS while operation is pending, any other value means
+ *         result is ready to be collected by @link crypt_token_open_finish_func @endlink.
+ */
+typedef int (*crypt_token_open_poll_func) (
+	struct crypt_device *cd,
+	void *ctx,
+	int *fd);
+
+/**
+ * Asynchronous token handler open finish function prototype.
+ * This function collects result of operation and always releases the context.
+ * If called while operation is still pending (timeout or another token already
+ * unlocked the device), the operation must be cancelled.
+ *
+ * @param cd crypt device handle
+ * @param ctx operation context
+ * @param buffer returned allocated buffer with password
+ * @param buffer_len length of the buffer
+ *
+ * @return 0 on success (token passed LUKS2 keyslot passphrase in buffer),
+ *         @e -ECANCELED for cancelled operation or negative errno with the same
+ *         meaning as for @link crypt_token_open_pin_func @endlink otherwise.
+ */
+typedef int (*crypt_token_open_finish_func) (
+	struct crypt_device *cd,
+	void *ctx,
+	char **buffer,
+	size_t *buffer_len);
+
+/**
+ * Token handler capabilities function prototype.
+ *
+ * @return bitmask of CRYPT_TOKEN_CAP_* flags
+ */
+typedef uint32_t (*crypt_token_capabilities_func) (void);
+
+/** Token open functions are thread safe, several tokens of this type can be opened concurrently. */
+#define CRYPT_TOKEN_CAP_PARALLEL_OPEN (UINT32_C(1) << 0)
+
 /**
  * Token handler
  */
@@ -2572,8 +4066,22 @@ const char *crypt_token_external_path(void);
  */
 void crypt_token_external_disable(void);
 
+/**
+ * Unload external token handlers (plugins) that are not currently in use.
+ *
+ * Loaded plugins are shared by all contexts in the process and stay loaded
+ * until flushed or until the library is unloaded. Handlers are loaded again
+ * on next use.
+ *
+ * @return @e 0 on success, @e -EBUSY if some handler is in use and
+ *	   was not unloaded.
+ */
+int crypt_token_external_flush(void);
+
 /** ABI version for external token in libcryptsetup-token-[name].so */
 #define CRYPT_TOKEN_ABI_VERSION1    "CRYPTSETUP_TOKEN_1.0"
+/** ABI version for asynchronous external token in libcryptsetup-token-[name].so */
+#define CRYPT_TOKEN_ABI_VERSION2    "CRYPTSETUP_TOKEN_1.1"
 
 /** open by token - ABI exported symbol for external token (mandatory) */
 #define CRYPT_TOKEN_ABI_OPEN        "cryptsetup_token_open"
@@ -2587,6 +4095,31 @@ void crypt_token_external_disable(void);
 #define CRYPT_TOKEN_ABI_DUMP        "cryptsetup_token_dump"
 /** token version - ABI exported symbol for external token */
 #define CRYPT_TOKEN_ABI_VERSION     "cryptsetup_token_version"
+/** start asynchronous open - ABI exported symbol for external token (@e CRYPT_TOKEN_ABI_VERSION2) */
+#define CRYPT_TOKEN_ABI_OPEN_START  "cryptsetup_token_open_start"
+/** poll asynchronous open - ABI exported symbol for external token (@e CRYPT_TOKEN_ABI_VERSION2) */
+#define CRYPT_TOKEN_ABI_OPEN_POLL   "cryptsetup_token_open_poll"
+/** finish asynchronous open - ABI exported symbol for external token (@e CRYPT_TOKEN_ABI_VERSION2) */
+#define CRYPT_TOKEN_ABI_OPEN_FINISH "cryptsetup_token_open_finish"
+/** token capabilities - optional ABI exported symbol for external token (@e CRYPT_TOKEN_ABI_VERSION2) */
+#define CRYPT_TOKEN_ABI_CAPABILITIES "cryptsetup_token_capabilities"
+
+/**
+ * Set timeout for asynchronous token handlers.
+ *
+ * External tokens implementing all @e CRYPT_TOKEN_ABI_VERSION2 symbols are
+ * started together for each keyslot priority class and multiplexed in the
+ * calling thread. Operations not finished in time are cancelled and treated
+ * as tokens with missing hardware (@e -EAGAIN).
+ *
+ * @param cd crypt device handle
+ * @param timeout_ms timeout in milliseconds, @e 0 means no timeout (default)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Synchronous token handlers cannot be interrupted, the timeout does not apply to them.
+ */
+int crypt_token_set_timeout(struct crypt_device *cd, uint32_t timeout_ms);
 
 /**
  * Activate device or check key using a token.
@@ -2685,6 +4218,21 @@ int crypt_activate_by_token_pin(struct crypt_device *cd,
 #define CRYPT_REENCRYPT_RECOVERY           (UINT32_C(1) << 3)
 /** Reencryption requires metadata protection. (in/out) */
 #define CRYPT_REENCRYPT_REPAIR_NEEDED      (UINT32_C(1) << 4)
+/** Adjust hotzone size according to measured metadata commit overhead,
+ *  size is limited by max_hotzone_size and resilience. Ignored for "datashift". (in) */
+#define CRYPT_REENCRYPT_ADAPTIVE_HOTZONE   (UINT32_C(1) << 5)
+/** Offline reencryption optimized for throughput: data device is accessed
+ *  with direct-io only (fails if not supported) and the default hotzone size
+ *  is 256 MiB. Large hotzones are possible only with "none" resilience
+ *  (data of the interrupted hotzone is lost on crash), for "checksum" and
+ *  "journal" resilience the hotzone is still limited by keyslots area size.
+ *  Cannot be used for online reencryption. (in) */
+#define CRYPT_REENCRYPT_OFFLINE_THROUGHPUT (UINT32_C(1) << 6)
+/** Discard data device areas left unused after reencryption (moved segment
+ *  backup and area freed by data shift) instead of overwriting them with random
+ *  data. If the device does not support discards, areas are wiped as usual.
+ *  Discarded data may still be readable on the underlying storage. (in) */
+#define CRYPT_REENCRYPT_DISCARD_UNUSED     (UINT32_C(1) << 7)
 
 /**
  * Reencryption direction
@@ -2723,6 +4271,60 @@ struct crypt_params_reencrypt {
 	uint32_t flags;                           /**< Reencryption flags. */
 };
 
+/**
+ * LUKS2 reencryption performance tuning.
+ *
+ * Set @e size to sizeof(struct crypt_params_reencrypt_tuning), fields added
+ * in future versions are appended after the last field.
+ */
+struct crypt_params_reencrypt_tuning {
+	uint32_t size;                  /**< Size of the structure in bytes. */
+	uint32_t pipeline_depth;        /**< Number of hotzones processed concurrently in offline reencryption
+					     (the next hotzone is read and decrypted while the current one is written).
+					     0 or 1 means no pipelining, currently at most 2 is used.
+					     Ignored for online reencryption and "datashift" resilience. */
+	uint32_t commit_steps;          /**< "none" resilience only: write metadata of finished hotzones
+					     every commit_steps steps. */
+	uint32_t commit_ms;             /**< "none" resilience only: write metadata of finished hotzones
+					     every commit_ms milliseconds. If both are 0, "none" resilience
+					     writes metadata only at the end of reencryption. Data of hotzones
+					     processed since last commit are unreadable after crash.
+					     Other resilience types always write metadata after every hotzone
+					     (the protection area is reused by the next hotzone), these
+					     fields are ignored for them. */
+	uint32_t max_rate_mbs;          /**< Limit reencryption throughput (in MiB/s), 0 means no limit. */
+	uint32_t ioprio;                /**< I/O priority of reencryption (value for ioprio_set(2),
+					     class and data), 0 means no change. Applies to the calling thread
+					     and to read ahead and verification worker threads for the time
+					     of crypt_reencrypt_run(). */
+	uint32_t max_latency_ms;        /**< Target average I/O latency of data device (in ms, measured
+					     for all I/O on the device including reencryption). If exceeded,
+					     hotzone size is decreased and reencryption pauses. 0 means no target. */
+	uint32_t online_batch_steps;    /**< Online reencryption only: device-mapper tables are reloaded once
+					     for this number of consecutive hotzones (0 or 1 means for every hotzone).
+					     I/O to the whole batch area is paused until all its hotzones are finished,
+					     interruption is honored at the end of the batch. Disables adaptive
+					     hotzone size. Ignored for "datashift" resilience. */
+	uint32_t verify_percent;        /**< Offline reencryption only: percentage (1-100) of every finished hotzone
+					     read back, decrypted with the new key and compared while the next
+					     hotzone is processed (evenly spread 1 MiB blocks, 100 means full read back).
+					     Mismatch or read error stops reencryption with error. 0 means no verification.
+					     Ignored for "datashift" resilience. */
+};
+
+/**
+ * Set performance tuning for the next reencryption initialized with this context.
+ * It must be called before @link crypt_reencrypt_init_by_passphrase @endlink
+ * (or keyring variant), the values are not stored in metadata.
+ *
+ * @param cd crypt device handle
+ * @param tuning tuning parameters or @e NULL to reset all values to 0
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_reencrypt_set_tuning(struct crypt_device *cd,
+		const struct crypt_params_reencrypt_tuning *tuning);
+
 /**
  * Initialize reencryption metadata using passphrase.
  *
@@ -2830,6 +4432,64 @@ typedef enum {
  */
 crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 		struct crypt_params_reencrypt *params);
+
+/**
+ * Timing of the last finished reencryption step (hotzone).
+ */
+struct crypt_reencrypt_step_stats {
+	uint64_t offset; /**< hotzone offset in bytes */
+	uint64_t length; /**< hotzone length in bytes */
+	uint64_t read_us; /**< hotzone read (or wait for prefetched data) */
+	uint64_t crypt_us; /**< decryption and encryption in userspace */
+	uint64_t write_us; /**< hotzone write and data sync (including encryption through dm-crypt) */
+	uint64_t commit_us; /**< metadata and resilience data commit */
+	uint64_t step_us; /**< whole step */
+};
+
+/**
+ * Get timing of the last finished reencryption step.
+ * It is intended to be called from @link crypt_reencrypt_run @endlink
+ * progress callback.
+ *
+ * @param cd crypt device handle
+ * @param stats step statistics
+ *
+ * @return @e 0 on success, @e -ENOENT if no step was finished yet,
+ * or negative errno value otherwise.
+ */
+int crypt_reencrypt_step_stats(struct crypt_device *cd,
+		struct crypt_reencrypt_step_stats *stats);
+
+/**
+ * Data area used by upper layer (for example allocated filesystem blocks).
+ */
+struct crypt_reencrypt_range {
+	uint64_t offset; /**< offset in bytes from the start of data segment */
+	uint64_t length; /**< length in bytes */
+};
+
+/**
+ * Set map of data areas used by upper layer for offline reencryption.
+ * Hotzone not intersecting any used area is neither read nor rewritten,
+ * only reencryption metadata are updated. Data in skipped areas are
+ * not readable after reencryption (and are not erased). The map is
+ * not stored in metadata and must be set again after reencryption resume.
+ * It must be called after @link crypt_reencrypt_init_by_passphrase @endlink
+ * (or keyring variant) and before @link crypt_reencrypt_run @endlink.
+ *
+ * @param cd crypt device handle
+ * @param ranges array of used areas (in any order, may overlap), @e NULL to unset the map
+ * @param count number of items in @e ranges array (0 means no data are used)
+ *
+ * @return @e 0 on success, @e -ENOTSUP for online reencryption or "datashift"
+ * resilience, or negative errno value otherwise.
+ *
+ * @note Area not listed in map as used is lost after reencryption, use it only
+ * with an exact (or conservative) map of used blocks.
+ */
+int crypt_reencrypt_set_used_ranges(struct crypt_device *cd,
+		const struct crypt_reencrypt_range *ranges,
+		size_t count);
 /** @} */
 
 /**
@@ -2873,6 +4533,28 @@ void *crypt_safe_realloc(void *data, size_t size);
  */
 void crypt_safe_memzero(void *data, size_t size);
 
+/**
+ * Safe memory allocator statistics.
+ */
+struct crypt_safe_memory_stats {
+	uint64_t locked_bytes; /**< memory locked by allocator (including free slab chunks) */
+	uint64_t slab_bytes;   /**< memory reserved in slabs for small allocations */
+	uint64_t used_bytes;   /**< memory currently allocated (requested sizes) */
+	uint64_t allocations;  /**< number of active allocations */
+};
+
+/**
+ * Get safe memory allocator statistics.
+ *
+ * @param stats statistics structure to be filled
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Small allocations are served from preallocated locked slabs,
+ *	 these are kept reserved for the whole process lifetime.
+ */
+int crypt_safe_memory_stats(struct crypt_safe_memory_stats *stats);
+
 /** @} */
 
 #ifdef __cplusplus
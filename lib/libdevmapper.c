@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <ctype.h>
 #include <errno.h>
 #include <libdevmapper.h>
@@ -39,21 +40,32 @@
 #define DM_LINEAR_TARGET	"linear"
 #define DM_ERROR_TARGET         "error"
 #define DM_ZERO_TARGET		"zero"
+#define DM_DEFAULT_KEY_TARGET	"default-key" /* dm-crypt table through inline encryption (blk-crypto) */
 #define RETRY_COUNT		5
 
-/* Set if DM target versions were probed */
+/*
+ * Set if DM target versions were probed. Detected versions and flags are
+ * shared by all contexts in process, probing is protected by lock.
+ */
+static pthread_mutex_t _dm_versions_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool _dm_ioctl_checked = false;
 static bool _dm_crypt_checked = false;
 static bool _dm_verity_checked = false;
 static bool _dm_integrity_checked = false;
 static bool _dm_zero_checked = false;
 
-static int _quiet_log = 0;
+static __thread int _quiet_log = 0;
 static uint32_t _dm_flags = 0;
 
-static struct crypt_device *_context = NULL;
+/* Per-thread, log callback routes libdevmapper messages to the calling context */
+static __thread struct crypt_device *_context = NULL;
+static pthread_mutex_t _dm_backend_lock = PTHREAD_MUTEX_INITIALIZER;
 static int _dm_use_count = 0;
 
+/* udev cookie shared by batched device creation and removal in this thread */
+static __thread unsigned _dm_udev_batch = 0;
+static __thread uint32_t _dm_udev_batch_cookie = 0;
+
 /* Check if we have DM flag to instruct kernel to force wipe buffers */
 #if !HAVE_DECL_DM_TASK_SECURE_DATA
 static int dm_task_secure_data(struct dm_task *dmt) { return 1; }
@@ -66,12 +78,43 @@ static int dm_task_secure_data(struct dm_task *dmt) { return 1; }
 				DM_UDEV_DISABLE_OTHER_RULES_FLAG
 #define _dm_task_set_cookie	dm_task_set_cookie
 #define _dm_udev_wait		dm_udev_wait
+#if HAVE_DECL_DM_UDEV_WAIT_IMMEDIATE
+#define _dm_udev_wait_immediate	dm_udev_wait_immediate
+#else
+static int _dm_udev_wait_immediate(uint32_t cookie, int *ready) { *ready = 1; return dm_udev_wait(cookie); }
+#endif
 #else
 #define CRYPT_TEMP_UDEV_FLAGS	0
 static int _dm_task_set_cookie(struct dm_task *dmt, uint32_t *cookie, uint16_t flags) { return 0; }
 static int _dm_udev_wait(uint32_t cookie) { return 0; };
+static int _dm_udev_wait_immediate(uint32_t cookie, int *ready) { *ready = 1; return 0; };
 #endif
 
+/* dm_task_run() and udev wait reported as trace spans to the current context */
+static int _dm_task_run(struct dm_task *dmt, const char *op)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_DM_IOCTL, op);
+	r = dm_task_run(dmt);
+	crypt_trace_end(_context, &trace, 0, r ? 0 : -EINVAL);
+
+	return r;
+}
+
+static int _dm_udev_wait_trace(uint32_t cookie)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_UDEV_WAIT, "udev");
+	r = _dm_udev_wait(cookie);
+	crypt_trace_end(_context, &trace, 0, r ? 0 : -EINVAL);
+
+	return r;
+}
+
 static int _dm_use_udev(void)
 {
 #ifdef USE_UDEV /* cannot be enabled if devmapper is too old */
@@ -170,6 +213,9 @@ static void _dm_set_crypt_compat(struct crypt_device *cd,
 	if (_dm_satisfies_version(1, 22, 0, crypt_maj, crypt_min, crypt_patch))
 		_dm_flags |= DM_CRYPT_NO_WORKQUEUE_SUPPORTED;
 
+	if (_dm_satisfies_version(1, 26, 0, crypt_maj, crypt_min, crypt_patch))
+		_dm_flags |= DM_CRYPT_HIGH_PRIORITY_SUPPORTED;
+
 	_dm_crypt_checked = true;
 }
 
@@ -241,6 +287,9 @@ static void _dm_set_integrity_compat(struct crypt_device *cd,
 	if (_dm_satisfies_version(1, 8, 0, integrity_maj, integrity_min, integrity_patch))
 		_dm_flags |= DM_INTEGRITY_RESET_RECALC_SUPPORTED;
 
+	if (_dm_satisfies_version(1, 12, 0, integrity_maj, integrity_min, integrity_patch))
+		_dm_flags |= DM_INTEGRITY_INLINE_MODE_SUPPORTED;
+
 	_dm_integrity_checked = true;
 }
 
@@ -281,12 +330,25 @@ static void _dm_check_target(dm_target_type target_type)
 		return;
 
 	if (dm_task_set_name(dmt, target_name))
-		dm_task_run(dmt);
+		_dm_task_run(dmt, "target-version");
 
 	dm_task_destroy(dmt);
 #endif
 }
 
+static bool _dm_versions_checked(dm_target_type target_type)
+{
+	if (!__atomic_load_n(&_dm_ioctl_checked, __ATOMIC_ACQUIRE))
+		return false;
+
+	return (target_type == DM_CRYPT     && _dm_crypt_checked) ||
+	       (target_type == DM_VERITY    && _dm_verity_checked) ||
+	       (target_type == DM_INTEGRITY && _dm_integrity_checked) ||
+	       (target_type == DM_ZERO      && _dm_zero_checked) ||
+	       (target_type == DM_LINEAR) || (target_type == DM_ERROR) ||
+	       (target_type == DM_UNKNOWN);
+}
+
 static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_type)
 {
 	struct dm_task *dmt;
@@ -295,13 +357,18 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 	unsigned dm_maj, dm_min, dm_patch;
 	int r = 0;
 
-	if ((target_type == DM_CRYPT     && _dm_crypt_checked) ||
-	    (target_type == DM_VERITY    && _dm_verity_checked) ||
-	    (target_type == DM_INTEGRITY && _dm_integrity_checked) ||
-	    (target_type == DM_ZERO      && _dm_zero_checked) ||
-	    (target_type == DM_LINEAR) ||
-	    (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked && _dm_zero_checked))
+	/*
+	 * Generic DM call needs only ioctl check. Not yet loaded target
+	 * is probed again when device with such target is created.
+	 */
+	if (_dm_versions_checked(target_type))
+		return 1;
+
+	pthread_mutex_lock(&_dm_versions_lock);
+	if (_dm_versions_checked(target_type)) {
+		pthread_mutex_unlock(&_dm_versions_lock);
 		return 1;
+	}
 
 	/* Shut up DM while checking */
 	_quiet_log = 1;
@@ -311,7 +378,7 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 	if (!(dmt = dm_task_create(DM_DEVICE_LIST_VERSIONS)))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, "versions"))
 		goto out;
 
 	if (!dm_task_get_driver_version(dmt, dm_version, sizeof(dm_version)))
@@ -353,6 +420,12 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 			_dm_set_zero_compat(cd, (unsigned)target->version[0],
 					    (unsigned)target->version[1],
 					    (unsigned)target->version[2]);
+		} else if (!strcmp(DM_DEFAULT_KEY_TARGET, target->name) &&
+			   !(_dm_flags & DM_INLINE_CRYPT_SUPPORTED)) {
+			log_dbg(cd, "Detected dm-default-key version %i.%i.%i.",
+				(unsigned)target->version[0], (unsigned)target->version[1],
+				(unsigned)target->version[2]);
+			_dm_flags |= DM_INLINE_CRYPT_SUPPORTED;
 		}
 		target = VOIDP_CAST(struct dm_versions *)((char *) target + target->next);
 	} while (last_target != target);
@@ -362,15 +435,31 @@ static int _dm_check_versions(struct crypt_device *cd, dm_target_type target_typ
 		log_dbg(cd, "Device-mapper backend running with UDEV support %sabled.",
 			_dm_use_udev() ? "en" : "dis");
 
-	_dm_ioctl_checked = true;
+	__atomic_store_n(&_dm_ioctl_checked, true, __ATOMIC_RELEASE);
 out:
 	if (dmt)
 		dm_task_destroy(dmt);
 
 	_quiet_log = 0;
+	pthread_mutex_unlock(&_dm_versions_lock);
 	return r;
 }
 
+/* Drop detected versions, next DM call probes all targets again. */
+int dm_refresh_versions(struct crypt_device *cd)
+{
+	pthread_mutex_lock(&_dm_versions_lock);
+	__atomic_store_n(&_dm_ioctl_checked, false, __ATOMIC_RELEASE);
+	_dm_crypt_checked = false;
+	_dm_verity_checked = false;
+	_dm_integrity_checked = false;
+	_dm_zero_checked = false;
+	_dm_flags = 0;
+	pthread_mutex_unlock(&_dm_versions_lock);
+
+	return _dm_check_versions(cd, DM_UNKNOWN) ? 0 : -ENOTSUP;
+}
+
 int dm_flags(struct crypt_device *cd, dm_target_type target, uint32_t *flags)
 {
 	_dm_check_versions(cd, target);
@@ -393,24 +482,31 @@ int dm_flags(struct crypt_device *cd, dm_target_type target, uint32_t *flags)
 /* This doesn't run any kernel checks, just set up userspace libdevmapper */
 void dm_backend_init(struct crypt_device *cd)
 {
+	pthread_mutex_lock(&_dm_backend_lock);
 	if (!_dm_use_count++) {
 		log_dbg(cd, "Initialising device-mapper backend library.");
 		dm_log_init(set_dm_error);
 		dm_log_init_verbose(10);
 	}
+	pthread_mutex_unlock(&_dm_backend_lock);
 }
 
 void dm_backend_exit(struct crypt_device *cd)
 {
+	pthread_mutex_lock(&_dm_backend_lock);
 	if (_dm_use_count && (!--_dm_use_count)) {
 		log_dbg(cd, "Releasing device-mapper backend.");
 		dm_log_init_verbose(0);
 		dm_log_init(NULL);
 		dm_lib_release();
 	}
+	pthread_mutex_unlock(&_dm_backend_lock);
 }
 
-/* libdevmapper is not context friendly, switch context on every DM call. */
+/*
+ * libdevmapper is not context friendly, switch context on every DM call.
+ * Context is per-thread, so DM calls from different threads do not mix logs.
+ */
 static int dm_init_context(struct crypt_device *cd, dm_target_type target)
 {
 	_context = cd;
@@ -443,7 +539,7 @@ char *dm_device_path(const char *prefix, int major, int minor)
 	if (!dm_task_set_minor(dmt, minor) ||
 	    !dm_task_set_major(dmt, major) ||
 	    !dm_task_no_flush(dmt) ||
-	    !dm_task_run(dmt) ||
+	    !_dm_task_run(dmt, "status") ||
 	    !(name = dm_task_get_name(dmt))) {
 		dm_task_destroy(dmt);
 		return NULL;
@@ -554,6 +650,12 @@ static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 	if (!tgt)
 		return NULL;
 
+	/* Inline encryption target takes only hex key and no dm-crypt performance options */
+	if (flags & CRYPT_ACTIVATE_INLINE_CRYPT)
+		flags &= ~(CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS |
+			   CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE |
+			   CRYPT_ACTIVATE_HIGH_PRIORITY);
+
 	r = cipher_dm2c(tgt->u.crypt.cipher, tgt->u.crypt.integrity, tgt->u.crypt.tag_size,
 			cipher_dm, sizeof(cipher_dm), integrity_dm, sizeof(integrity_dm));
 	if (r < 0)
@@ -569,6 +671,8 @@ static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 		num_options++;
 	if (flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE)
 		num_options++;
+	if (flags & CRYPT_ACTIVATE_HIGH_PRIORITY)
+		num_options++;
 	if (flags & CRYPT_ACTIVATE_IV_LARGE_SECTORS)
 		num_options++;
 	if (tgt->u.crypt.integrity)
@@ -576,13 +680,14 @@ static char *get_dm_crypt_params(const struct dm_target *tgt, uint32_t flags)
 	if (tgt->u.crypt.sector_size != SECTOR_SIZE)
 		num_options++;
 
-	if (num_options) { /* MAX length  int32 + 15 + 15 + 23 + 18 + 19 + 17 + 13 + int32 + integrity_str */
-		r = snprintf(features, sizeof(features), " %d%s%s%s%s%s%s%s%s", num_options,
+	if (num_options) { /* MAX length  int32 + 15 + 15 + 23 + 18 + 19 + 14 + 17 + 13 + int32 + integrity_str */
+		r = snprintf(features, sizeof(features), " %d%s%s%s%s%s%s%s%s%s", num_options,
 		(flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) ? " allow_discards" : "",
 		(flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? " same_cpu_crypt" : "",
 		(flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) ? " submit_from_crypt_cpus" : "",
 		(flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE) ? " no_read_workqueue" : "",
 		(flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? " no_write_workqueue" : "",
+		(flags & CRYPT_ACTIVATE_HIGH_PRIORITY) ? " high_priority" : "",
 		(flags & CRYPT_ACTIVATE_IV_LARGE_SECTORS) ? " iv_large_sectors" : "",
 		(tgt->u.crypt.sector_size != SECTOR_SIZE) ?
 			_uf(sector_feature, sizeof(sector_feature), "sector_size", tgt->u.crypt.sector_size) : "",
@@ -885,7 +990,9 @@ static char *get_dm_integrity_params(const struct dm_target *tgt, uint32_t flags
 	if (r < 0 || r >= max_size)
 		goto out;
 
-	if (flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP)
+	if (flags & CRYPT_ACTIVATE_INLINE_MODE)
+		mode = 'I';
+	else if (flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP)
 		mode = 'B';
 	else if (flags & CRYPT_ACTIVATE_RECOVERY)
 		mode = 'R';
@@ -948,10 +1055,15 @@ static int _dm_remove(const char *name, int udev_wait, int deferred)
 {
 	int r = 0;
 	struct dm_task *dmt;
-	uint32_t cookie = 0;
+	uint32_t cookie = 0, *cookie_ptr = &cookie;
+	bool udev_batch = false;
 
 	if (!_dm_use_udev())
 		udev_wait = 0;
+	else if (udev_wait && _dm_udev_batch) {
+		cookie_ptr = &_dm_udev_batch_cookie;
+		udev_batch = true;
+	}
 
 	if (!(dmt = dm_task_create(DM_DEVICE_REMOVE)))
 		return 0;
@@ -967,13 +1079,13 @@ static int _dm_remove(const char *name, int udev_wait, int deferred)
 	if (deferred && !dm_task_deferred_remove(dmt))
 		goto out;
 #endif
-	if (udev_wait && !_dm_task_set_cookie(dmt, &cookie, DM_UDEV_DISABLE_LIBRARY_FALLBACK))
+	if (udev_wait && !_dm_task_set_cookie(dmt, cookie_ptr, DM_UDEV_DISABLE_LIBRARY_FALLBACK))
 		goto out;
 
-	r = dm_task_run(dmt);
+	r = _dm_task_run(dmt, "remove");
 
-	if (udev_wait)
-		(void)_dm_udev_wait(cookie);
+	if (udev_wait && !udev_batch)
+		(void)_dm_udev_wait_trace(cookie);
 out:
 	dm_task_destroy(dmt);
 	return r;
@@ -998,7 +1110,7 @@ static int _dm_simple(int task, const char *name, uint32_t dmflags)
 	    (dmflags & DM_SUSPEND_NOFLUSH) && !dm_task_no_flush(dmt))
 		goto out;
 
-	r = dm_task_run(dmt);
+	r = _dm_task_run(dmt, task == DM_DEVICE_SUSPEND ? "suspend" : "clear");
 out:
 	dm_task_destroy(dmt);
 	return r;
@@ -1026,7 +1138,7 @@ static int _error_device(const char *name, size_t size)
 	if (!dm_task_no_open_count(dmt))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, "reload"))
 		goto out;
 
 	if (_dm_resume_device(name, 0)) {
@@ -1208,7 +1320,8 @@ static int _add_dm_targets(struct dm_task *dmt, struct crypt_dm_active_device *d
 	do {
 		switch (tgt->type) {
 		case DM_CRYPT:
-			target = DM_CRYPT_TARGET;
+			target = (dmd->flags & CRYPT_ACTIVATE_INLINE_CRYPT) ?
+				 DM_DEFAULT_KEY_TARGET : DM_CRYPT_TARGET;
 			break;
 		case DM_VERITY:
 			target = DM_VERITY_TARGET;
@@ -1280,6 +1393,55 @@ err:
 	return r;
 }
 
+#define DM_IO_SEQUENTIAL_READ_AHEAD 8192 /* sectors, 4 MiB */
+
+#ifdef DM_READ_AHEAD_MINIMUM_FLAG
+static int _dm_task_set_read_ahead(struct dm_task *dmt, struct crypt_dm_active_device *dmd)
+{
+	uint32_t read_ahead = 0;
+
+	switch (dmd->io_profile) {
+	case DM_IO_PROFILE_STACKED:
+	case DM_IO_PROFILE_MINIMAL:
+		/* read-ahead is done by top-level device or not needed at all */
+		return dm_task_set_read_ahead(dmt, DM_READ_AHEAD_NONE, 0);
+	case DM_IO_PROFILE_SEQUENTIAL:
+		if (!device_read_ahead(dmd->segment.data_device, &read_ahead) ||
+		    read_ahead < DM_IO_SEQUENTIAL_READ_AHEAD)
+			read_ahead = DM_IO_SEQUENTIAL_READ_AHEAD;
+		return dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG);
+	default:
+		if (!device_read_ahead(dmd->segment.data_device, &read_ahead))
+			return 1;
+		return dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG);
+	}
+}
+#endif
+
+/* Queue settings for helper devices, failure is not fatal (bio based queues ignore most) */
+static void _dm_set_queue_profile(struct crypt_device *cd, const char *name,
+				  const struct dm_info *dmi, enum dm_io_profile io_profile)
+{
+	int r = 1;
+
+	switch (io_profile) {
+	case DM_IO_PROFILE_SEQUENTIAL:
+		/* complete I/O on submitting CPU, reencryption runs on few threads */
+		r = crypt_dev_queue_set(dmi->major, dmi->minor, "rq_affinity", 2) &&
+		    crypt_dev_queue_set(dmi->major, dmi->minor, "nomerges", 0);
+		break;
+	case DM_IO_PROFILE_MINIMAL:
+		/* few small I/Os, skip merge lookups */
+		r = crypt_dev_queue_set(dmi->major, dmi->minor, "nomerges", 2);
+		break;
+	default:
+		break;
+	}
+
+	if (!r)
+		log_dbg(cd, "Failed to set queue attributes of device %s.", name);
+}
+
 static int _dm_create_device(struct crypt_device *cd, const char *name, const char *type,
 			     struct crypt_dm_active_device *dmd)
 {
@@ -1287,11 +1449,17 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	struct dm_info dmi;
 	char dev_uuid[DM_UUID_LEN] = {0};
 	int r = -EINVAL;
-	uint32_t cookie = 0, read_ahead = 0;
+	uint32_t cookie = 0, *cookie_ptr = &cookie;
 	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+	bool udev_batch = false;
 
 	if (dmd->flags & CRYPT_ACTIVATE_PRIVATE)
 		udev_flags |= CRYPT_TEMP_UDEV_FLAGS;
+	/* Private (stacked) devices are used immediately, others can wait. */
+	else if (_dm_udev_batch && (dmd->segment.type == DM_CRYPT || dmd->segment.type == DM_VERITY)) {
+		cookie_ptr = &_dm_udev_batch_cookie;
+		udev_batch = true;
+	}
 
 	/* All devices must have DM_UUID, only resize on old device is exception */
 	if (!dm_prepare_uuid(cd, name, type, dmd->uuid, dev_uuid, sizeof(dev_uuid)))
@@ -1322,14 +1490,13 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 	r = -EINVAL;
 
 #ifdef DM_READ_AHEAD_MINIMUM_FLAG
-	if (device_read_ahead(dmd->segment.data_device, &read_ahead) &&
-	    !dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG))
+	if (!_dm_task_set_read_ahead(dmt, dmd))
 		goto out;
 #endif
-	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, cookie_ptr, udev_flags))
 		goto out;
 
-	if (!dm_task_run(dmt)) {
+	if (!_dm_task_run(dmt, "create")) {
 		r = dm_status_device(cd, name);;
 		if (r >= 0)
 			r = -EEXIST;
@@ -1338,11 +1505,13 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 		goto out;
 	}
 
-	if (dm_task_get_info(dmt, &dmi))
+	if (dm_task_get_info(dmt, &dmi)) {
 		r = 0;
+		_dm_set_queue_profile(cd, name, &dmi, dmd->io_profile);
+	}
 
-	if (_dm_use_udev()) {
-		(void)_dm_udev_wait(cookie);
+	if (_dm_use_udev() && !udev_batch) {
+		(void)_dm_udev_wait_trace(cookie);
 		cookie = 0;
 	}
 
@@ -1351,7 +1520,7 @@ static int _dm_create_device(struct crypt_device *cd, const char *name, const ch
 
 out:
 	if (cookie && _dm_use_udev())
-		(void)_dm_udev_wait(cookie);
+		(void)_dm_udev_wait_trace(cookie);
 
 	if (dmt)
 		dm_task_destroy(dmt);
@@ -1391,11 +1560,11 @@ static int _dm_resume_device(const char *name, uint32_t dmflags)
 	if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
 		goto out;
 
-	if (dm_task_run(dmt))
+	if (_dm_task_run(dmt, "resume"))
 		r = 0;
 out:
 	if (cookie && _dm_use_udev())
-		(void)_dm_udev_wait(cookie);
+		(void)_dm_udev_wait_trace(cookie);
 
 	dm_task_destroy(dmt);
 
@@ -1409,7 +1578,6 @@ static int _dm_reload_device(struct crypt_device *cd, const char *name,
 {
 	int r = -EINVAL;
 	struct dm_task *dmt = NULL;
-	uint32_t read_ahead = 0;
 
 	/* All devices must have DM_UUID, only resize on old device is exception */
 	if (!(dmt = dm_task_create(DM_DEVICE_RELOAD)))
@@ -1434,12 +1602,11 @@ static int _dm_reload_device(struct crypt_device *cd, const char *name,
 	r = -EINVAL;
 
 #ifdef DM_READ_AHEAD_MINIMUM_FLAG
-	if (device_read_ahead(dmd->segment.data_device, &read_ahead) &&
-	    !dm_task_set_read_ahead(dmt, read_ahead, DM_READ_AHEAD_MINIMUM_FLAG))
+	if (!_dm_task_set_read_ahead(dmt, dmd))
 		goto out;
 #endif
 
-	if (dm_task_run(dmt))
+	if (_dm_task_run(dmt, "reload"))
 		r = 0;
 out:
 	if (dmt)
@@ -1533,6 +1700,77 @@ void dm_targets_free(struct crypt_device *cd, struct crypt_dm_active_device *dmd
 	memset(&dmd->segment, 0, sizeof(dmd->segment));
 }
 
+static bool _dm_volume_keys_equal(const struct volume_key *vk1, const struct volume_key *vk2)
+{
+	if (vk1 == vk2)
+		return true;
+
+	if (!vk1 || !vk2 || vk1->keylength != vk2->keylength)
+		return false;
+
+	if (vk1->key_description || vk2->key_description)
+		return vk1->key_description && vk2->key_description &&
+		       !strcmp(vk1->key_description, vk2->key_description);
+
+	return !crypt_backend_memeq(vk1->key, vk2->key, vk1->keylength);
+}
+
+/* Target b continues target a (both mapping and data device position) */
+static bool _dm_targets_mergeable(struct dm_target *a, struct dm_target *b)
+{
+	if (a->type != b->type || a->direction != b->direction ||
+	    a->offset + a->size != b->offset ||
+	    device_is_identical(a->data_device, b->data_device) != 1)
+		return false;
+
+	switch (a->type) {
+	case DM_LINEAR:
+		return a->u.linear.offset + a->size == b->u.linear.offset;
+	case DM_CRYPT:
+		if (a->u.crypt.integrity || b->u.crypt.integrity ||
+		    a->u.crypt.tag_size || b->u.crypt.tag_size ||
+		    a->u.crypt.sector_size != b->u.crypt.sector_size ||
+		    !a->u.crypt.cipher || !b->u.crypt.cipher ||
+		    strcmp(a->u.crypt.cipher, b->u.crypt.cipher))
+			return false;
+		/* IV sector must continue too, otherwise data would not decrypt */
+		if (a->u.crypt.offset + a->size != b->u.crypt.offset ||
+		    a->u.crypt.iv_offset + a->size != b->u.crypt.iv_offset)
+			return false;
+		return _dm_volume_keys_equal(a->u.crypt.vk, b->u.crypt.vk);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Merge adjacent targets mapping continuous area with the same parameters,
+ * every target boundary splits bios in the kernel. Returns merged count.
+ */
+int dm_targets_compact(struct crypt_device *cd, struct crypt_dm_active_device *dmd)
+{
+	struct dm_target *t = &dmd->segment, *next;
+	int merged = 0;
+
+	while ((next = t->next)) {
+		if (!_dm_targets_mergeable(t, next)) {
+			t = next;
+			continue;
+		}
+
+		t->size += next->size;
+		t->next = next->next;
+		_dm_target_erase(cd, next);
+		free(next);
+		merged++;
+	}
+
+	if (merged)
+		log_dbg(cd, "Merged %d adjacent dm targets.", merged);
+
+	return merged;
+}
+
 int dm_targets_allocate(struct dm_target *first, unsigned count)
 {
 	if (!first || first->next || !count)
@@ -1584,9 +1822,55 @@ static int check_retry(struct crypt_device *cd, uint32_t *dmd_flags, uint32_t dm
 		ret = 1;
 	}
 
+	/* Drop high priority workqueues option if not supported */
+	if ((*dmd_flags & CRYPT_ACTIVATE_HIGH_PRIORITY) &&
+	    !(dmt_flags & DM_CRYPT_HIGH_PRIORITY_SUPPORTED)) {
+		log_dbg(cd, "dm-crypt does not support performance options");
+		*dmd_flags = *dmd_flags & ~CRYPT_ACTIVATE_HIGH_PRIORITY;
+		ret = 1;
+	}
+
 	return ret;
 }
 
+void dm_udev_batch_begin(void)
+{
+	_dm_udev_batch++;
+}
+
+int dm_udev_batch_settle(int wait)
+{
+	int ready = 1;
+
+	if (!_dm_udev_batch_cookie || !_dm_use_udev()) {
+		_dm_udev_batch_cookie = 0;
+		return 0;
+	}
+
+	if (wait)
+		(void)_dm_udev_wait_trace(_dm_udev_batch_cookie);
+	else if (!_dm_udev_wait_immediate(_dm_udev_batch_cookie, &ready)) {
+		/* State of cookie is unknown, the blocking wait releases it */
+		(void)_dm_udev_wait_trace(_dm_udev_batch_cookie);
+		ready = 1;
+	}
+
+	/* Cookie is released once udev processing is finished. */
+	if (!ready)
+		return -EAGAIN;
+
+	_dm_udev_batch_cookie = 0;
+	return 0;
+}
+
+void dm_udev_batch_end(void)
+{
+	if (!_dm_udev_batch || --_dm_udev_batch)
+		return;
+
+	(void)dm_udev_batch_settle(1);
+}
+
 int dm_create_device(struct crypt_device *cd, const char *name,
 		     const char *type,
 		     struct crypt_dm_active_device *dmd)
@@ -1627,6 +1911,12 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 		r = -EINVAL;
 	}
 
+	if (dmd->flags & CRYPT_ACTIVATE_HIGH_PRIORITY &&
+	    !(dmt_flags & DM_CRYPT_HIGH_PRIORITY_SUPPORTED)) {
+		log_err(cd, _("Requested dm-crypt performance options are not supported."));
+		r = -EINVAL;
+	}
+
 	if (dmd->flags & (CRYPT_ACTIVATE_IGNORE_CORRUPTION|
 			  CRYPT_ACTIVATE_RESTART_ON_CORRUPTION|
 			  CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS|
@@ -1693,6 +1983,12 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 		log_err(cd, _("Requested dm-integrity bitmap mode is not supported."));
 		r = -EINVAL;
 	}
+
+	if (dmd->segment.type == DM_INTEGRITY && (dmd->flags & CRYPT_ACTIVATE_INLINE_MODE) &&
+	    !(dmt_flags & DM_INTEGRITY_INLINE_MODE_SUPPORTED)) {
+		log_err(cd, _("Requested dm-integrity inline mode is not supported."));
+		r = -EINVAL;
+	}
 out:
 	/*
 	 * Print warning if activating dm-crypt cipher_null device unless it's reencryption helper or
@@ -1702,6 +1998,9 @@ out:
 	    crypt_is_cipher_null(dmd->segment.u.crypt.cipher))
 		log_dbg(cd, "Activated dm-crypt device with cipher_null. Device is not encrypted.");
 
+	if (!r && !strcmp(type, "TEMP"))
+		crypt_stat_add(CRYPT_STAT_TEMP_DEVICE, 1);
+
 	dm_exit_context();
 	return r;
 }
@@ -1730,6 +2029,9 @@ int dm_reload_device(struct crypt_device *cd, const char *name,
 		if ((dmd->flags & (CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE)) &&
 		    !dm_flags(cd, DM_CRYPT, &dmt_flags) && !(dmt_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED))
 			log_err(cd, _("Requested dm-crypt performance options are not supported."));
+		if ((dmd->flags & CRYPT_ACTIVATE_HIGH_PRIORITY) &&
+		    !dm_flags(cd, DM_CRYPT, &dmt_flags) && !(dmt_flags & DM_CRYPT_HIGH_PRIORITY_SUPPORTED))
+			log_err(cd, _("Requested dm-crypt performance options are not supported."));
 		if ((dmd->flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) &&
 		    !dm_flags(cd, DM_CRYPT, &dmt_flags) && !(dmt_flags & DM_DISCARDS_SUPPORTED))
 			log_err(cd, _("Discard/TRIM is not supported."));
@@ -1762,7 +2064,7 @@ static int dm_status_dmi(const char *name, struct dm_info *dmi,
 	if (!dm_task_set_name(dmt, name))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, "info"))
 		goto out;
 
 	if (!dm_task_get_info(dmt, dmi))
@@ -1785,6 +2087,7 @@ static int dm_status_dmi(const char *name, struct dm_info *dmi,
 
 	/* for target == NULL check all supported */
 	if (!target && (strcmp(target_type, DM_CRYPT_TARGET) &&
+			strcmp(target_type, DM_DEFAULT_KEY_TARGET) &&
 			strcmp(target_type, DM_VERITY_TARGET) &&
 			strcmp(target_type, DM_INTEGRITY_TARGET) &&
 			strcmp(target_type, DM_LINEAR_TARGET) &&
@@ -1825,6 +2128,24 @@ int dm_status_device(struct crypt_device *cd, const char *name)
 	return (dmi.open_count > 0) ? 1 : 0;
 }
 
+int dm_device_devno(struct crypt_device *cd, const char *name, int *major, int *minor)
+{
+	int r;
+	struct dm_info dmi;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+	r = dm_status_dmi(name, &dmi, NULL, NULL);
+	dm_exit_context();
+
+	if (r < 0)
+		return r;
+
+	*major = dmi.major;
+	*minor = dmi.minor;
+	return 0;
+}
+
 int dm_status_suspended(struct crypt_device *cd, const char *name)
 {
 	int r;
@@ -1895,6 +2216,53 @@ int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint
 	return 0;
 }
 
+/*
+ * Integrity status is "<mismatches> <provided_data_sectors> <recalc_sector|->",
+ * recalc sector is present only while background recalculation is not finished.
+ */
+int dm_status_integrity_recalc(struct crypt_device *cd, const char *name,
+			       uint64_t *recalc_sector, uint64_t *data_sectors)
+{
+	int r;
+	struct dm_info dmi;
+	char *status_line = NULL, *p, *endp;
+
+	if (dm_init_context(cd, DM_INTEGRITY))
+		return -ENOTSUP;
+
+	r = dm_status_dmi(name, &dmi, DM_INTEGRITY_TARGET, &status_line);
+	if (r < 0 || !status_line) {
+		free(status_line);
+		dm_exit_context();
+		return r < 0 ? r : -EINVAL;
+	}
+
+	log_dbg(cd, "Integrity volume %s status is %s.", name, status_line);
+
+	r = -EINVAL;
+	p = strchr(status_line, ' ');
+	if (!p)
+		goto out;
+
+	*data_sectors = strtoull(p + 1, &endp, 10);
+	if (endp == p + 1 || *endp != ' ')
+		goto out;
+
+	p = endp + 1;
+	if (*p == '-') {
+		r = -ENOENT;
+		goto out;
+	}
+
+	*recalc_sector = strtoull(p, &endp, 10);
+	r = endp == p ? -EINVAL : 0;
+out:
+	free(status_line);
+	dm_exit_context();
+
+	return r;
+}
+
 /* FIXME use hex wrapper, user val wrappers for line parsing */
 static int _dm_target_query_crypt(struct crypt_device *cd, uint32_t get_flags,
 				  char *params, struct dm_target *tgt,
@@ -1975,6 +2343,8 @@ static int _dm_target_query_crypt(struct crypt_device *cd, uint32_t get_flags,
 				*act_flags |= CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
 			else if (!strcasecmp(arg, "no_write_workqueue"))
 				*act_flags |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+			else if (!strcasecmp(arg, "high_priority"))
+				*act_flags |= CRYPT_ACTIVATE_HIGH_PRIORITY;
 			else if (!strcasecmp(arg, "iv_large_sectors"))
 				*act_flags |= CRYPT_ACTIVATE_IV_LARGE_SECTORS;
 			else if (sscanf(arg, "integrity:%u:", &val) == 1) {
@@ -2373,8 +2743,10 @@ static int _dm_target_query_integrity(struct crypt_device *cd,
 
 	/* journal */
 	c = toupper(*(++params));
-	if (!*params || *(++params) != ' ' || (c != 'D' && c != 'J' && c != 'R' && c != 'B'))
+	if (!*params || *(++params) != ' ' || (c != 'D' && c != 'J' && c != 'R' && c != 'B' && c != 'I'))
 		goto err;
+	if (c == 'I')
+		*act_flags |= CRYPT_ACTIVATE_INLINE_MODE;
 	if (c == 'D')
 		*act_flags |= CRYPT_ACTIVATE_NO_JOURNAL;
 	if (c == 'R')
@@ -2645,7 +3017,11 @@ static int dm_target_query(struct crypt_device *cd, struct dm_target *tgt, const
 
 	if (!strcmp(target_type, DM_CRYPT_TARGET))
 		r = _dm_target_query_crypt(cd, get_flags, params, tgt, act_flags);
-	else if (!strcmp(target_type, DM_VERITY_TARGET))
+	else if (!strcmp(target_type, DM_DEFAULT_KEY_TARGET)) {
+		r = _dm_target_query_crypt(cd, get_flags, params, tgt, act_flags);
+		if (!r)
+			*act_flags |= CRYPT_ACTIVATE_INLINE_CRYPT;
+	} else if (!strcmp(target_type, DM_VERITY_TARGET))
 		r = _dm_target_query_verity(cd, get_flags, params, tgt, act_flags);
 	else if (!strcmp(target_type, DM_INTEGRITY_TARGET))
 		r = _dm_target_query_integrity(cd, get_flags, params, tgt, act_flags);
@@ -2685,7 +3061,7 @@ static int _dm_query_device(struct crypt_device *cd, const char *name,
 	if (!dm_task_set_name(dmt, name))
 		goto out;
 	r = -ENODEV;
-	if (!dm_task_run(dmt))
+	if (!_dm_task_run(dmt, "table"))
 		goto out;
 
 	r = -EINVAL;
@@ -2784,6 +3160,68 @@ int dm_query_device(struct crypt_device *cd, const char *name,
 	return r;
 }
 
+/*
+ * Query all active devices with DM UUID in CRYPT namespace using one device-mapper
+ * context and one device list ioctl. Devices removed in the meantime are skipped.
+ */
+int dm_query_all_devices(struct crypt_device *cd, uint32_t get_flags,
+			 int (*fn)(struct crypt_device *cd, const char *name, int major, int minor,
+				   int busy, struct crypt_dm_active_device *dmd, void *arg),
+			 void *arg)
+{
+	struct crypt_dm_active_device dmd;
+	struct dm_task *dmt;
+	struct dm_names *names;
+	unsigned next = 0;
+	int r, busy;
+
+	if (!fn)
+		return -EINVAL;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	r = -EINVAL;
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		goto out;
+
+	if (!_dm_task_run(dmt, "list") || !(names = dm_task_get_names(dmt)))
+		goto out;
+
+	r = 0;
+	if (!names->dev)
+		goto out;
+
+	do {
+		names = (struct dm_names *)((char *)names + next);
+		next = names->next;
+
+		/* Check UUID first, avoid processing devices of other subsystems */
+		memset(&dmd, 0, sizeof(dmd));
+		if (_dm_query_device(cd, names->name, DM_ACTIVE_UUID, &dmd) < 0)
+			continue;
+		dm_targets_free(cd, &dmd);
+		if (!dmd.uuid)
+			continue;
+		free(CONST_CAST(void*)dmd.uuid);
+
+		memset(&dmd, 0, sizeof(dmd));
+		busy = _dm_query_device(cd, names->name, get_flags | DM_ACTIVE_UUID, &dmd);
+		if (busy < 0)
+			continue;
+
+		r = fn(cd, names->name, major(names->dev), minor(names->dev), busy, &dmd, arg);
+
+		dm_targets_free(cd, &dmd);
+		free(CONST_CAST(void*)dmd.uuid);
+	} while (!r && next);
+out:
+	if (dmt)
+		dm_task_destroy(dmt);
+	dm_exit_context();
+	return r;
+}
+
 static int _process_deps(struct crypt_device *cd, const char *prefix, struct dm_deps *deps,
 			 char **names, size_t names_offset, size_t names_length)
 {
@@ -2853,7 +3291,7 @@ int dm_device_deps(struct crypt_device *cd, const char *name, const char *prefix
 			goto out;
 
 		r = -ENODEV;
-		if (!dm_task_run(dmt))
+		if (!_dm_task_run(dmt, "deps"))
 			goto out;
 
 		r = -EINVAL;
@@ -2912,7 +3350,7 @@ static int _dm_message(const char *name, const char *msg)
 	if (!dm_task_set_message(dmt, msg))
 		goto out;
 
-	r = dm_task_run(dmt);
+	r = _dm_task_run(dmt, "message");
 out:
 	dm_task_destroy(dmt);
 	return r;
@@ -2920,6 +3358,7 @@ out:
 
 int dm_suspend_device(struct crypt_device *cd, const char *name, uint32_t dmflags)
 {
+	struct dm_info dmi;
 	uint32_t dmt_flags;
 	int r = -ENOTSUP;
 
@@ -2927,6 +3366,12 @@ int dm_suspend_device(struct crypt_device *cd, const char *name, uint32_t dmflag
 		return r;
 
 	if (dmflags & DM_SUSPEND_WIPE_KEY) {
+		/* key programmed in inline encryption hardware cannot be wiped */
+		if (!dm_status_dmi(name, &dmi, DM_DEFAULT_KEY_TARGET, NULL)) {
+			log_err(cd, _("Device %s uses inline encryption, its volume key cannot be wiped on suspend."), name);
+			goto out;
+		}
+
 		if (dm_flags(cd, DM_CRYPT, &dmt_flags))
 			goto out;
 
@@ -3073,6 +3518,70 @@ int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg
 	return 0;
 }
 
+/*
+ * Check whether dm-crypt segment can be mapped through inline encryption
+ * hardware of the data device (dm-default-key target over blk-crypto).
+ * Cipher, key size and encryption sector size must match a crypto mode
+ * of the device and IV of the last sector must fit hardware DUN width.
+ */
+bool dm_crypt_inline_supported(struct crypt_device *cd, const struct crypt_dm_active_device *dmd)
+{
+	const struct dm_target *tgt = &dmd->segment;
+	const char *mode;
+	uint32_t dmt_flags, max_dun_bits, dun_bits;
+	uint64_t size, last_iv;
+
+	if (!single_segment(dmd) || tgt->type != DM_CRYPT || tgt->u.crypt.tag_size ||
+	    !tgt->u.crypt.vk || !tgt->u.crypt.cipher || !tgt->u.crypt.sector_size)
+		return false;
+
+	/* Explicitly requested dm-crypt options keep software dm-crypt */
+	if (dmd->flags & (CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS |
+			  CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE |
+			  CRYPT_ACTIVATE_HIGH_PRIORITY))
+		return false;
+
+	if (!strcmp(tgt->u.crypt.cipher, "aes-xts-plain64") && tgt->u.crypt.vk->keylength == 64)
+		mode = "AES-256-XTS";
+	else if (!strcmp(tgt->u.crypt.cipher, "xchacha12,aes-adiantum-plain64") &&
+		 tgt->u.crypt.vk->keylength == 32)
+		mode = "Adiantum";
+	else
+		return false;
+
+	if (device_inline_crypto(tgt->data_device, mode, tgt->u.crypt.sector_size, &max_dun_bits) < 0)
+		return false;
+
+	if (dm_flags(cd, DM_CRYPT, &dmt_flags) || !(dmt_flags & DM_INLINE_CRYPT_SUPPORTED)) {
+		log_dbg(cd, "Device %s supports inline encryption, but dm-default-key target is not available.",
+			device_path(tgt->data_device));
+		return false;
+	}
+
+	size = dmd->size;
+	if (!size) {
+		if (device_size(tgt->data_device, &size) < 0)
+			return false;
+		size = size / SECTOR_SIZE - tgt->u.crypt.offset;
+	}
+
+	last_iv = tgt->u.crypt.iv_offset + size;
+	if (dmd->flags & CRYPT_ACTIVATE_IV_LARGE_SECTORS)
+		last_iv /= tgt->u.crypt.sector_size / SECTOR_SIZE;
+	for (dun_bits = 0; last_iv; last_iv >>= 1)
+		dun_bits++;
+
+	if (dun_bits > max_dun_bits) {
+		log_dbg(cd, "Inline encryption DUN width %u bits is too small (%u bits needed).",
+			max_dun_bits, dun_bits);
+		return false;
+	}
+
+	log_dbg(cd, "Device %s supports inline encryption mode %s with %u bytes data unit.",
+		device_path(tgt->data_device), mode, tgt->u.crypt.sector_size);
+	return true;
+}
+
 int dm_verity_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct device *hash_device, struct device *fec_device,
 	const char *root_hash, uint32_t root_hash_size, const char* root_hash_sig_key_desc,
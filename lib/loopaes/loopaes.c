@@ -52,24 +52,10 @@ static unsigned char get_tweak(unsigned int keys_count)
 	return 0x00;
 }
 
-static int hash_key(const char *src, size_t src_len,
-		    char *dst, size_t dst_len,
-		    const char *hash_name)
-{
-	struct crypt_hash *hd = NULL;
-	int r;
-
-	if (crypt_hash_init(&hd, hash_name))
-		return -EINVAL;
-
-	r = crypt_hash_write(hd, src, src_len);
-	if (!r)
-		r = crypt_hash_final(hd, dst, dst_len);
-
-	crypt_hash_destroy(hd);
-	return r;
-}
-
+/*
+ * All keys have the same length, they are hashed in one pass
+ * with single hash context.
+ */
 static int hash_keys(struct crypt_device *cd,
 		     struct volume_key **vk,
 		     const char *hash_override,
@@ -78,10 +64,11 @@ static int hash_keys(struct crypt_device *cd,
 		     unsigned int key_len_output,
 		     unsigned int key_len_input)
 {
+	struct crypt_hash *hd = NULL;
 	const char *hash_name;
-	char tweak, *key_ptr;
+	char tweak, *keys;
 	unsigned int i;
-	int r = 0;
+	int r;
 
 	hash_name = hash_override ?: get_hash(key_len_output);
 	tweak = get_tweak(keys_count);
@@ -92,25 +79,38 @@ static int hash_keys(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
-	*vk = crypt_alloc_volume_key((size_t)key_len_output * keys_count, NULL);
-	if (!*vk)
+	keys = crypt_safe_alloc((size_t)key_len_input * keys_count);
+	if (!keys)
 		return -ENOMEM;
 
-	for (i = 0; i < keys_count; i++) {
-		key_ptr = &(*vk)->key[i * key_len_output];
-		r = hash_key(input_keys[i], key_len_input, key_ptr,
-			     key_len_output, hash_name);
-		if (r < 0)
-			break;
+	for (i = 0; i < keys_count; i++)
+		memcpy(&keys[i * key_len_input], input_keys[i], key_len_input);
 
-		key_ptr[0] ^= tweak;
+	*vk = crypt_alloc_volume_key((size_t)key_len_output * keys_count, NULL);
+	if (!*vk) {
+		crypt_safe_free(keys);
+		return -ENOMEM;
 	}
 
-	if (r < 0 && *vk) {
+	if (crypt_hash_init(&hd, hash_name))
+		r = -EINVAL;
+	else {
+		r = crypt_hash_many(hd, NULL, 0, NULL, 0, keys, key_len_input, keys_count,
+				    (*vk)->key, key_len_output, key_len_output);
+		crypt_hash_destroy(hd);
+	}
+	crypt_safe_free(keys);
+
+	if (r < 0) {
 		crypt_free_volume_key(*vk);
 		*vk = NULL;
+		return r;
 	}
-	return r;
+
+	for (i = 0; i < keys_count; i++)
+		(*vk)->key[i * key_len_output] ^= tweak;
+
+	return 0;
 }
 
 static int keyfile_is_gpg(char *buffer, size_t buffer_len)
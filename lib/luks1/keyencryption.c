@@ -105,6 +105,7 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	if (r)
 		goto out;
 
+	dmd.io_profile = DM_IO_PROFILE_MINIMAL;
 	r = dm_create_device(ctx, name, "TEMP", &dmd);
 	if (r < 0) {
 		if (r != -EACCES && r != -ENOTSUP)
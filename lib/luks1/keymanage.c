@@ -30,10 +30,13 @@
 #include <ctype.h>
 #include <uuid/uuid.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include "luks.h"
 #include "af.h"
 #include "internal.h"
+#include "utils_threadpool.h"
 
 int LUKS_keyslot_area(const struct luks_phdr *hdr,
 	int keyslot,
@@ -232,8 +235,10 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 	hdr_size = LUKS_device_sectors(&hdr) << SECTOR_SHIFT;
 	buffer_size = size_round_up(hdr_size, crypt_getpagesize());
 
-	buffer = malloc(buffer_size);
-	if (!buffer || hdr_size < LUKS_ALIGN_KEYSLOTS || hdr_size > buffer_size) {
+	/* Aligned buffer is read from device in one request (no bounce buffer) */
+	if (hdr_size < LUKS_ALIGN_KEYSLOTS || hdr_size > buffer_size ||
+	    posix_memalign((void *)&buffer, device_alignment(device), buffer_size)) {
+		buffer = NULL;
 		r = -ENOMEM;
 		goto out;
 	}
@@ -604,10 +609,10 @@ int LUKS_read_phdr_backup(const char *backup_file,
 	return r;
 }
 
-int LUKS_read_phdr(struct luks_phdr *hdr,
-		   int require_luks_device,
-		   int repair,
-		   struct crypt_device *ctx)
+static int _read_phdr(struct luks_phdr *hdr,
+		      int require_luks_device,
+		      int repair,
+		      struct crypt_device *ctx)
 {
 	int devfd, r = 0;
 	struct device *device = crypt_metadata_device(ctx);
@@ -631,8 +636,7 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 		return -EINVAL;
 	}
 
-	if (read_lseek_blockwise(devfd, device_block_size(ctx, device), device_alignment(device),
-			   hdr, hdr_size, 0) < hdr_size)
+	if (device_read_probe(ctx, device, devfd, hdr, hdr_size, 0) < hdr_size)
 		r = -EIO;
 	else
 		r = _check_and_convert_hdr(device_path(device), hdr, require_luks_device,
@@ -654,8 +658,23 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 	return r;
 }
 
-int LUKS_write_phdr(struct luks_phdr *hdr,
-		    struct crypt_device *ctx)
+int LUKS_read_phdr(struct luks_phdr *hdr,
+		   int require_luks_device,
+		   int repair,
+		   struct crypt_device *ctx)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_HEADER_READ, "luks1");
+	r = _read_phdr(hdr, require_luks_device, repair, ctx);
+	crypt_trace_end(ctx, &trace, r ? 0 : sizeof(struct luks_phdr), r);
+
+	return r;
+}
+
+static int _write_phdr(struct luks_phdr *hdr,
+		       struct crypt_device *ctx)
 {
 	struct device *device = crypt_metadata_device(ctx);
 	ssize_t hdr_size = sizeof(struct luks_phdr);
@@ -705,7 +724,7 @@ int LUKS_write_phdr(struct luks_phdr *hdr,
 
 	/* Re-read header from disk to be sure that in-memory and on-disk data are the same. */
 	if (!r) {
-		r = LUKS_read_phdr(hdr, 1, 0, ctx);
+		r = _read_phdr(hdr, 1, 0, ctx);
 		if (r)
 			log_err(ctx, _("Error re-reading LUKS header after update on device %s."),
 				device_path(device));
@@ -714,6 +733,19 @@ int LUKS_write_phdr(struct luks_phdr *hdr,
 	return r;
 }
 
+int LUKS_write_phdr(struct luks_phdr *hdr,
+		    struct crypt_device *ctx)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_HEADER_WRITE, "luks1");
+	r = _write_phdr(hdr, ctx);
+	crypt_trace_end(ctx, &trace, r ? 0 : sizeof(struct luks_phdr), r);
+
+	return r;
+}
+
 /* Check that kernel supports requested cipher by decryption of one sector */
 int LUKS_check_cipher(struct crypt_device *ctx, size_t keylength, const char *cipher, const char *cipher_mode)
 {
@@ -883,6 +915,7 @@ int LUKS_set_key(unsigned int keyIndex,
 	char *AfKey = NULL;
 	size_t AFEKSize;
 	struct crypt_pbkdf_type *pbkdf;
+	struct crypt_trace trace;
 	int r;
 
 	if(hdr->keyblock[keyIndex].active != LUKS_KEY_DISABLED) {
@@ -921,10 +954,12 @@ int LUKS_set_key(unsigned int keyIndex,
 	if (r < 0)
 		goto out;
 
+	crypt_trace_begin(&trace, CRYPT_TRACE_KDF, CRYPT_KDF_PBKDF2);
 	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
 			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
 			derived_key->key, hdr->keyBytes,
 			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_trace_end(ctx, &trace, 0, r);
 	if (r < 0) {
 		if ((crypt_backend_flags() & CRYPT_BACKEND_PBKDF2_INT) &&
 		     hdr->keyblock[keyIndex].passwordIterations > INT_MAX)
@@ -996,34 +1031,48 @@ int LUKS_verify_volume_key(const struct luks_phdr *hdr,
 }
 
 /* Try to open a particular key slot */
-static int LUKS_open_key(unsigned int keyIndex,
+static int LUKS_derive_key(unsigned int keyIndex,
 		  const char *password,
 		  size_t passwordLen,
 		  struct luks_phdr *hdr,
-		  struct volume_key **vk,
+		  struct volume_key **derived_key,
 		  struct crypt_device *ctx)
 {
-	crypt_keyslot_info ki = LUKS_keyslot_info(hdr, keyIndex);
-	struct volume_key *derived_key;
-	char *AfKey = NULL;
-	size_t AFEKSize;
+	struct crypt_trace trace;
 	int r;
 
-	log_dbg(ctx, "Trying to open key slot %d [%s].", keyIndex,
-		dbg_slot_state(ki));
+	*derived_key = crypt_alloc_volume_key(hdr->keyBytes, NULL);
+	if (!*derived_key)
+		return -ENOMEM;
 
-	if (ki < CRYPT_SLOT_ACTIVE)
-		return -ENOENT;
+	crypt_trace_begin(&trace, CRYPT_TRACE_KDF, CRYPT_KDF_PBKDF2);
+	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
+			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
+			(*derived_key)->key, hdr->keyBytes,
+			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	crypt_trace_end(ctx, &trace, 0, r);
+	if (r < 0) {
+		crypt_free_volume_key(*derived_key);
+		*derived_key = NULL;
+	}
 
-	derived_key = crypt_alloc_volume_key(hdr->keyBytes, NULL);
-	if (!derived_key)
-		return -ENOMEM;
+	return r;
+}
+
+static int LUKS_open_key_derived(unsigned int keyIndex,
+		  size_t passwordLen,
+		  struct luks_phdr *hdr,
+		  struct volume_key *derived_key,
+		  struct volume_key **vk,
+		  struct crypt_device *ctx)
+{
+	char *AfKey = NULL;
+	size_t AFEKSize;
+	int r;
 
 	*vk = crypt_alloc_volume_key(hdr->keyBytes, NULL);
-	if (!*vk) {
-		r = -ENOMEM;
-		goto out;
-	}
+	if (!*vk)
+		return -ENOMEM;
 
 	AFEKSize = AF_split_sectors(hdr->keyBytes, hdr->keyblock[keyIndex].stripes) * SECTOR_SIZE;
 	AfKey = crypt_safe_alloc(AFEKSize);
@@ -1032,15 +1081,6 @@ static int LUKS_open_key(unsigned int keyIndex,
 		goto out;
 	}
 
-	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
-			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
-			derived_key->key, hdr->keyBytes,
-			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
-	if (r < 0) {
-		log_err(ctx, _("Cannot open keyslot (using hash %s)."), hdr->hashSpec);
-		goto out;
-	}
-
 	log_dbg(ctx, "Reading key slot %d area.", keyIndex);
 	r = LUKS_decrypt_from_storage(AfKey,
 				      AFEKSize,
@@ -1066,29 +1106,206 @@ out:
 		*vk = NULL;
 	}
 	crypt_safe_free(AfKey);
+	return r;
+}
+
+static int LUKS_open_key(unsigned int keyIndex,
+		  const char *password,
+		  size_t passwordLen,
+		  struct luks_phdr *hdr,
+		  struct volume_key **vk,
+		  struct crypt_device *ctx)
+{
+	crypt_keyslot_info ki = LUKS_keyslot_info(hdr, keyIndex);
+	struct volume_key *derived_key;
+	int r;
+
+	log_dbg(ctx, "Trying to open key slot %d [%s].", keyIndex,
+		dbg_slot_state(ki));
+
+	*vk = NULL;
+	if (ki < CRYPT_SLOT_ACTIVE)
+		return -ENOENT;
+
+	r = LUKS_derive_key(keyIndex, password, passwordLen, hdr, &derived_key, ctx);
+	if (r < 0) {
+		log_err(ctx, _("Cannot open keyslot (using hash %s)."), hdr->hashSpec);
+		return r;
+	}
+
+	r = LUKS_open_key_derived(keyIndex, passwordLen, hdr, derived_key, vk, ctx);
 	crypt_free_volume_key(derived_key);
 	return r;
 }
 
-int LUKS_open_key_with_hdr(int keyIndex,
+/*
+ * Parallel unlock, PBKDF of every active keyslot runs in a separate job.
+ * Keyslot area decryption and digest verification is serialized,
+ * the first keyslot that verifies wins, jobs not yet started are skipped
+ * and running PBKDF is aborted.
+ */
+struct luks_unlock {
+	const char *password;
+	size_t passwordLen;
+	struct luks_phdr *hdr;
+	struct crypt_device *ctx;
+	pthread_mutex_t lock;
+	unsigned int slots[LUKS_NUMKEYS];
+	int r[LUKS_NUMKEYS];
+	struct volume_key *vk;
+	int keyslot;
+};
+
+/* PBKDF abort hook, another keyslot already unlocked the volume key */
+static int LUKS_open_key_abort(void *usrptr)
+{
+	struct luks_unlock *lu = usrptr;
+	bool unlocked;
+
+	pthread_mutex_lock(&lu->lock);
+	unlocked = lu->keyslot >= 0;
+	pthread_mutex_unlock(&lu->lock);
+
+	return unlocked;
+}
+
+static int LUKS_open_key_job(void *arg, unsigned int job)
+{
+	struct luks_unlock *lu = arg;
+	struct volume_key *derived_key = NULL;
+	unsigned int keyIndex = lu->slots[job];
+	bool skip;
+	int r;
+
+	pthread_mutex_lock(&lu->lock);
+	skip = lu->keyslot >= 0;
+	if (!skip)
+		log_dbg(lu->ctx, "Trying to open key slot %d [%s].", keyIndex,
+			dbg_slot_state(LUKS_keyslot_info(lu->hdr, keyIndex)));
+	pthread_mutex_unlock(&lu->lock);
+
+	if (skip)
+		return 0;
+
+	crypt_pbkdf_set_abort(LUKS_open_key_abort, lu);
+	r = LUKS_derive_key(keyIndex, lu->password, lu->passwordLen, lu->hdr, &derived_key, lu->ctx);
+	crypt_pbkdf_set_abort(NULL, NULL);
+
+	pthread_mutex_lock(&lu->lock);
+	if (r == -ECANCELED)
+		log_dbg(lu->ctx, "Key slot %d derivation cancelled.", keyIndex);
+	else if (r < 0)
+		log_err(lu->ctx, _("Cannot open keyslot (using hash %s)."), lu->hdr->hashSpec);
+	else if (lu->keyslot < 0) {
+		r = LUKS_open_key_derived(keyIndex, lu->passwordLen, lu->hdr,
+					  derived_key, &lu->vk, lu->ctx);
+		if (!r)
+			lu->keyslot = keyIndex;
+	}
+	lu->r[job] = r;
+	pthread_mutex_unlock(&lu->lock);
+
+	crypt_free_volume_key(derived_key);
+	return 0;
+}
+
+static int LUKS_open_key_parallel(const unsigned int *slots,
+			   unsigned int slots_count,
 			   const char *password,
 			   size_t passwordLen,
 			   struct luks_phdr *hdr,
 			   struct volume_key **vk,
 			   struct crypt_device *ctx)
 {
-	unsigned int i, tried = 0;
+	struct crypt_threadpool *tp = NULL;
+	struct luks_unlock lu = {
+		.password = password,
+		.passwordLen = passwordLen,
+		.hdr = hdr,
+		.ctx = ctx,
+		.keyslot = -1,
+	};
+	unsigned int i, count = 0, tried = 0, threads;
 	int r;
 
+	for (i = 0; i < slots_count; i++)
+		if (LUKS_keyslot_info(hdr, slots[i]) >= CRYPT_SLOT_ACTIVE) {
+			lu.r[count] = -ENOENT;
+			lu.slots[count++] = slots[i];
+		}
+
+	if (!count)
+		return -ENOENT;
+
+	if (pthread_mutex_init(&lu.lock, NULL))
+		return -ENOMEM;
+
+	threads = crypt_get_threads(ctx);
+	if (threads > count)
+		threads = count;
+
+	log_dbg(ctx, "Trying %u active keyslots in parallel.", count);
+
+	r = crypt_threadpool_init(ctx, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, count, LUKS_open_key_job, &lu);
+	crypt_threadpool_destroy(tp);
+	pthread_mutex_destroy(&lu.lock);
+	if (r < 0)
+		return r;
+
+	if (lu.keyslot >= 0) {
+		*vk = lu.vk;
+		return lu.keyslot;
+	}
+
+	/* The same error semantics as in serial trial, in trial order */
+	for (i = 0; i < count; i++) {
+		if ((lu.r[i] != -EPERM) && (lu.r[i] != -ENOENT))
+			return lu.r[i];
+		if (lu.r[i] == -EPERM)
+			tried++;
+	}
+
+	return tried ? -EPERM : -ENOENT;
+}
+
+int LUKS_open_key_with_hdr(int keyIndex,
+			   const char *password,
+			   size_t passwordLen,
+			   struct luks_phdr *hdr,
+			   struct volume_key **vk,
+			   struct crypt_device *ctx)
+{
+	unsigned int i, count = 0, tried = 0, slots[LUKS_NUMKEYS];
+	int r, hint;
+
 	if (keyIndex >= 0) {
 		r = LUKS_open_key(keyIndex, password, passwordLen, hdr, vk, ctx);
 		return (r < 0) ? r : keyIndex;
 	}
 
-	for (i = 0; i < LUKS_NUMKEYS; i++) {
-		r = LUKS_open_key(i, password, passwordLen, hdr, vk, ctx);
-		if (r == 0)
-			return i;
+	/* Hinted keyslot first, then the rest in keyslot order */
+	hint = crypt_keyslot_hint(ctx);
+	if (hint >= 0 && hint < LUKS_NUMKEYS)
+		slots[count++] = hint;
+	for (i = 0; i < LUKS_NUMKEYS; i++)
+		if ((int)i != hint)
+			slots[count++] = i;
+
+	if (crypt_parallel_unlock_enabled()) {
+		r = LUKS_open_key_parallel(slots, count, password, passwordLen, hdr, vk, ctx);
+		if (r >= 0)
+			crypt_keyslot_hint_update(ctx, r);
+		return r;
+	}
+
+	for (i = 0; i < count; i++) {
+		r = LUKS_open_key(slots[i], password, passwordLen, hdr, vk, ctx);
+		if (r == 0) {
+			crypt_keyslot_hint_update(ctx, slots[i]);
+			return slots[i];
+		}
 
 		/* Do not retry for errors that are no -EPERM or -ENOENT,
 		   former meaning password wrong, latter key slot inactive */
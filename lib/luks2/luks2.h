@@ -47,6 +47,7 @@
 #define LUKS2_TOKEN_NAME_MAX 64
 
 #define LUKS2_TOKEN_KEYRING LUKS2_BUILTIN_TOKEN_PREFIX "keyring"
+#define LUKS2_TOKEN_ESCROW LUKS2_BUILTIN_TOKEN_PREFIX "escrow"
 
 #define LUKS2_DIGEST_MAX 8
 
@@ -62,6 +63,9 @@
 /* 1 GiB */
 #define LUKS2_REENCRYPT_MAX_HOTZONE_LENGTH 0x40000000
 
+/* 256 MiBs, offline throughput mode */
+#define LUKS2_THROUGHPUT_REENCRYPTION_LENGTH 0x10000000
+
 /* supported reencryption requirement versions */
 #define LUKS2_REENCRYPT_REQ_VERSION         UINT8_C(2)
 #define LUKS2_DECRYPT_DATASHIFT_REQ_VERSION UINT8_C(3)
@@ -107,6 +111,39 @@ struct luks2_hdr_disk {
 	/* JSON area starts here */
 } __attribute__ ((packed));
 
+/*
+ * Index of keyslot, token, digest and segment objects by id, built from
+ * in-memory JSON after header load or write. Any change of these objects
+ * invalidates it, lookups then fallback to JSON.
+ */
+struct luks2_hdr_disk_cache;
+
+struct luks2_hdr_index {
+	void		*jobj;
+	unsigned int	generation;
+	void		*keyslots[LUKS2_KEYSLOTS_MAX];
+	void		*tokens[LUKS2_TOKENS_MAX];
+	void		*digests[LUKS2_DIGEST_MAX];
+	void		*segments[LUKS2_SEGMENT_MAX];
+};
+
+/*
+ * Keyslot areas sorted by offset, kept in sync by keyslot allocation
+ * and wipe so consecutive allocations do not rescan all keyslots.
+ * Valid only for the same jobj and header index generation.
+ */
+struct luks2_area_map {
+	void		*jobj;
+	unsigned int	generation;
+	unsigned int	count;
+	unsigned int	hint;		/* no gap for hint_length before this area */
+	size_t		hint_length;
+	struct {
+		uint64_t	offset;
+		uint64_t	length;
+	} areas[LUKS2_KEYSLOTS_MAX];
+};
+
 /*
  * LUKS2 header in-memory.
  */
@@ -121,7 +158,13 @@ struct luks2_hdr {
 	uint8_t		salt2[LUKS2_SALT_L];
 	char		uuid[LUKS2_UUID_L];
 	void		*jobj;
-	void		*jobj_rollback;
+	void		*jobj_rollback;	/* NULL: rollback to cached on-disk JSON */
+	uint64_t	rollback_seqid;
+	struct luks2_hdr_index index;
+	struct luks2_area_map area_map;
+	struct luks2_hdr_disk_cache *disk_cache; /* shared between cloned contexts */
+	struct device	*disk_cache_device; /* NULL: on-disk state of disk_cache unknown */
+	bool		write_deferred;	/* batch update, caller writes header */
 };
 
 struct luks2_keyslot_params {
@@ -166,6 +209,8 @@ int LUKS2_hdr_version_unlocked(struct crypt_device *cd,
 	const char *backup_file);
 
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair);
+int LUKS2_hdr_read_buffer(struct crypt_device *cd, struct luks2_hdr *hdr,
+			  const void *buffer, size_t buffer_size, uint64_t device_size);
 int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_write_force(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_rollback(struct crypt_device *cd, struct luks2_hdr *hdr);
@@ -183,6 +228,8 @@ int LUKS2_hdr_labels(struct crypt_device *cd,
 	int commit);
 
 void LUKS2_hdr_free(struct crypt_device *cd, struct luks2_hdr *hdr);
+void LUKS2_hdr_release_copies(struct luks2_hdr *hdr);
+int LUKS2_hdr_clone(struct crypt_device *cd, struct luks2_hdr *dst, struct luks2_hdr *src);
 
 int LUKS2_hdr_backup(struct crypt_device *cd,
 		     struct luks2_hdr *hdr,
@@ -214,6 +261,12 @@ int LUKS2_keyslot_open_all_segments(struct crypt_device *cd,
 	size_t password_len,
 	struct volume_key **vks);
 
+int LUKS2_keyslot_store_prepare(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params);
+
 int LUKS2_keyslot_store(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -222,11 +275,24 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 	const struct volume_key *vk,
 	const struct luks2_keyslot_params *params);
 
+int LUKS2_keyslots_store(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	unsigned int count,
+	const struct volume_key *vk);
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
 	int wipe_area_only);
 
+int LUKS2_keyslots_wipe(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	int count);
+
 crypt_keyslot_priority LUKS2_keyslot_priority_get(struct luks2_hdr *hdr, int keyslot);
 
 int LUKS2_keyslot_priority_set(struct crypt_device *cd,
@@ -235,6 +301,21 @@ int LUKS2_keyslot_priority_set(struct crypt_device *cd,
 	crypt_keyslot_priority priority,
 	int commit);
 
+bool LUKS2_keyslot_telemetry_enabled(struct luks2_hdr *hdr);
+
+int LUKS2_keyslot_telemetry_enable(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	bool enable);
+
+int LUKS2_keyslot_telemetry_get(struct luks2_hdr *hdr,
+	int keyslot,
+	uint32_t *time_ms,
+	uint64_t *unlocks);
+
+int LUKS2_keyslot_telemetry_record(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot);
+
 int LUKS2_keyslot_swap(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -302,6 +383,26 @@ int LUKS2_token_keyring_get(struct luks2_hdr *hdr,
 int LUKS2_token_keyring_json(char *buffer, size_t buffer_size,
 	const struct crypt_token_params_luks2_keyring *keyring_params);
 
+int LUKS2_token_escrow_create(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int keyslot,
+	const struct volume_key *vk,
+	const struct crypt_token_params_luks2_escrow *params);
+
+int LUKS2_token_unlock_key_cached(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	const char *type,
+	const char *pin,
+	size_t pin_size,
+	int segment,
+	void *usrptr,
+	char **cached_buffer,
+	size_t *cached_buffer_size,
+	char **cached_uuid,
+	struct volume_key **vk);
+
 int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
@@ -390,6 +491,8 @@ int LUKS2_generate_hdr(
 	uint64_t keyslots_size);
 
 int LUKS2_check_metadata_area_size(uint64_t metadata_size);
+int LUKS2_hdr_check_block_alignment(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_segments_compact(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_check_keyslots_area_size(uint64_t keyslots_size);
 
 int LUKS2_wipe_header_areas(struct crypt_device *cd,
@@ -439,6 +542,7 @@ int LUKS2_volume_key_load_in_keyring_by_keyslot(struct crypt_device *cd,
 		struct luks2_hdr *hdr, struct volume_key *vk, int keyslot);
 int LUKS2_volume_key_load_in_keyring_by_digest(struct crypt_device *cd,
 		struct volume_key *vk, int digest);
+int LUKS2_volume_keys_load_in_keyring(struct crypt_device *cd, struct volume_key *vks);
 
 int LUKS2_luks1_to_luks2(struct crypt_device *cd,
 			 struct luks_phdr *hdr1,
@@ -462,6 +566,9 @@ void LUKS2_reencrypt_free(struct crypt_device *cd,
 
 crypt_reencrypt_info LUKS2_reencrypt_status(struct luks2_hdr *hdr);
 
+crypt_reencrypt_info LUKS2_reencrypt_get_params_by_context(struct luks2_reencrypt *rh,
+	struct crypt_params_reencrypt *params);
+
 crypt_reencrypt_info LUKS2_reencrypt_get_params(struct luks2_hdr *hdr,
 	struct crypt_params_reencrypt *params);
 
@@ -381,6 +381,7 @@ void LUKS2_digests_erase_unused(struct crypt_device *cd,
 		if (digest_unused(val)) {
 			log_dbg(cd, "Erasing unused digest %d.", atoi(key));
 			json_object_object_del(jobj_digests, key);
+			LUKS2_hdr_index_invalidate();
 		}
 	}
 }
@@ -453,3 +454,20 @@ int LUKS2_volume_key_load_in_keyring_by_digest(struct crypt_device *cd,
 	free(desc);
 	return r;
 }
+
+int LUKS2_volume_keys_load_in_keyring(struct crypt_device *cd, struct volume_key *vks)
+{
+	struct volume_key *vk;
+	char *desc;
+	int r;
+
+	for (vk = vks; vk; vk = crypt_volume_key_next(vk)) {
+		desc = get_key_description_by_digest(cd, crypt_volume_key_get_id(vk));
+		r = crypt_volume_key_set_description(vk, desc);
+		free(desc);
+		if (r)
+			return r;
+	}
+
+	return crypt_volume_keys_load_in_keyring(cd, vks);
+}
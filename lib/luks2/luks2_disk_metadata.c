@@ -53,6 +53,61 @@ static json_object *parse_json_len(struct crypt_device *cd, const char *json_are
 	return jobj;
 }
 
+/*
+ * Structural pre-pass over JSON area. Finds the end of the top level
+ * object (string content and escapes are skipped) without building any
+ * json-c object, so damaged area is rejected before the heap tree is
+ * materialized and the tokener gets the exact data length.
+ */
+static int json_area_scan(struct crypt_device *cd, const char *json_area,
+			  uint64_t max_length, int *json_len)
+{
+	bool in_string = false, escape = false;
+	int depth = 0;
+	uint64_t i;
+	char c;
+
+	/* INT32_MAX is internal (json-c) json_tokener_parse_ex() limit */
+	if (!json_area || max_length > INT32_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < max_length; i++) {
+		c = json_area[i];
+
+		if (c == '\0')
+			break;
+
+		if (in_string) {
+			if (escape)
+				escape = false;
+			else if (c == '\\')
+				escape = true;
+			else if (c == '"')
+				in_string = false;
+			continue;
+		}
+
+		if (c == '"')
+			in_string = true;
+		else if (c == '{' || c == '[') {
+			if (++depth > JSON_TOKENER_DEFAULT_DEPTH) {
+				log_dbg(cd, "ERROR: JSON data nesting is too deep.");
+				return -EINVAL;
+			}
+		} else if (c == '}' || c == ']') {
+			if (--depth < 0)
+				break;
+			if (!depth) {
+				*json_len = i + 1;
+				return 0;
+			}
+		}
+	}
+
+	log_dbg(cd, "ERROR: JSON area does not contain complete json object.");
+	return -EINVAL;
+}
+
 static void log_dbg_checksum(struct crypt_device *cd,
 			     const uint8_t *csum, const char *csum_alg, const char *info)
 {
@@ -232,32 +287,95 @@ static int hdr_disk_sanity_check_pre(struct crypt_device *cd,
 	return 0;
 }
 
+/*
+ * Both header copies of the common metadata sizes (16 and 32 KiB) are read
+ * from device in one I/O, parsing then uses only the in-memory copy.
+ */
+#define LUKS2_HDR_PREFETCH_LEN (4 * LUKS2_HDR_16K_LEN)
+
+struct hdr_prefetch {
+	char *buf;
+	size_t len;
+};
+
+static void hdr_prefetch_read(struct crypt_device *cd, struct device *device,
+			      struct hdr_prefetch *pf)
+{
+	ssize_t r;
+	int devfd;
+
+	pf->buf = NULL;
+	pf->len = 0;
+
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0)
+		return;
+
+	pf->buf = malloc(LUKS2_HDR_PREFETCH_LEN);
+	if (!pf->buf)
+		return;
+
+	r = device_read_probe(cd, device, devfd, pf->buf, LUKS2_HDR_PREFETCH_LEN, 0);
+	if (r != LUKS2_HDR_PREFETCH_LEN) {
+		/* e.g. too small device, fallback to per-header reads */
+		log_dbg(cd, "LUKS2 header prefetch failed, reading headers separately.");
+		free(pf->buf);
+		pf->buf = NULL;
+		return;
+	}
+
+	pf->len = LUKS2_HDR_PREFETCH_LEN;
+}
+
+/*
+ * Read part of header area, from prefetched buffer if it covers the range.
+ */
+static int hdr_read_blockwise(struct crypt_device *cd, struct device *device,
+			      const struct hdr_prefetch *pf, int *devfd,
+			      void *buf, size_t length, uint64_t offset)
+{
+	if (pf && offset <= pf->len && length <= pf->len - offset) {
+		memcpy(buf, pf->buf + offset, length);
+		return 0;
+	}
+
+	/* in-memory header parsing, nothing to read beyond the buffer */
+	if (!device)
+		return -EIO;
+
+	if (*devfd < 0) {
+		*devfd = device_open_locked(cd, device, O_RDONLY);
+		if (*devfd < 0)
+			return *devfd == -1 ? -EIO : *devfd;
+	}
+
+	if (device_read_probe(cd, device, *devfd, buf, length, offset) != (ssize_t)length)
+		return -EIO;
+
+	return 0;
+}
+
 /*
  * Read LUKS2 header from disk at specific offset.
  */
 static int hdr_read_disk(struct crypt_device *cd,
-			 struct device *device, struct luks2_hdr_disk *hdr_disk,
+			 struct device *device, const struct hdr_prefetch *pf,
+			 struct luks2_hdr_disk *hdr_disk,
 			 char **json_area, uint64_t offset, int secondary)
 {
 	size_t hdr_json_size = 0;
-	int devfd, r;
+	int devfd = -1, r;
 
 	log_dbg(cd, "Trying to read %s LUKS2 header at offset 0x%" PRIx64 ".",
 		secondary ? "secondary" : "primary", offset);
 
-	devfd = device_open_locked(cd, device, O_RDONLY);
-	if (devfd < 0)
-		return devfd == -1 ? -EIO : devfd;
-
 	/*
 	 * Read binary header and run sanity check before reading
 	 * JSON area and validating checksum.
 	 */
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), hdr_disk,
-				 LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN) {
-		return -EIO;
-	}
+	r = hdr_read_blockwise(cd, device, pf, &devfd, hdr_disk, LUKS2_HDR_BIN_LEN, offset);
+	if (r < 0)
+		return r;
 
 	/*
 	 * hdr_json_size is validated if this call succeeds
@@ -273,12 +391,12 @@ static int hdr_read_disk(struct crypt_device *cd,
 	if (!*json_area)
 		return -ENOMEM;
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				 device_alignment(device), *json_area, hdr_json_size,
-				 offset + LUKS2_HDR_BIN_LEN) != (ssize_t)hdr_json_size) {
+	r = hdr_read_blockwise(cd, device, pf, &devfd, *json_area, hdr_json_size,
+			       offset + LUKS2_HDR_BIN_LEN);
+	if (r < 0) {
 		free(*json_area);
 		*json_area = NULL;
-		return -EIO;
+		return r;
 	}
 
 	/*
@@ -296,12 +414,184 @@ static int hdr_read_disk(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Last header state known to be on disk (both copies with the same JSON area).
+ * Binary header is stored as generated for primary copy, without checksum.
+ * After failed write, the header device is unset (on-disk state is unknown),
+ * but the JSON area can still be used as in-memory rollback state.
+ * The cache is immutable once shared by cloned contexts (refcount > 1),
+ * update then allocates a new one.
+ */
+struct luks2_hdr_disk_cache {
+	unsigned int refcount;
+	uint64_t seqid;
+	size_t hdr_size;
+	bool json_exact; /* JSON area is serialized in-memory jobj (not repaired) */
+	struct luks2_hdr_disk hdr_disk;
+	uint8_t salt2[LUKS2_SALT_L];
+	char json_area[];
+};
+
+/* Granularity of partial JSON area update */
+#define LUKS2_HDR_WRITE_BLOCK 4096
+
+void LUKS2_disk_hdr_cache_free(struct luks2_hdr *hdr)
+{
+	struct luks2_hdr_disk_cache *c = hdr->disk_cache;
+
+	if (c && !__atomic_sub_fetch(&c->refcount, 1, __ATOMIC_ACQ_REL))
+		free(c);
+	hdr->disk_cache = NULL;
+	hdr->disk_cache_device = NULL;
+}
+
+/*
+ * Share cached on-disk state of src header, the same state is on device
+ * (the header device of dst context).
+ */
+void LUKS2_disk_hdr_cache_share(struct luks2_hdr *dst, struct luks2_hdr *src, struct device *device)
+{
+	struct luks2_hdr_disk_cache *c = src->disk_cache;
+
+	LUKS2_disk_hdr_cache_free(dst);
+	if (!c)
+		return;
+
+	__atomic_add_fetch(&c->refcount, 1, __ATOMIC_RELAXED);
+	dst->disk_cache = c;
+	dst->disk_cache_device = src->disk_cache_device ? device : NULL;
+}
+
+/*
+ * Returns true if JSON area of state with sequence id seqid is cached
+ * (and matches in-memory json object of that state).
+ */
+bool LUKS2_disk_hdr_cache_has_json(struct luks2_hdr *hdr, uint64_t seqid)
+{
+	struct luks2_hdr_disk_cache *c = hdr->disk_cache;
+
+	return c && c->seqid == seqid && c->json_exact;
+}
+
+/*
+ * Parse cached JSON area of state with sequence id seqid.
+ */
+json_object *LUKS2_disk_hdr_cache_json(struct crypt_device *cd, struct luks2_hdr *hdr, uint64_t seqid)
+{
+	struct luks2_hdr_disk_cache *c = hdr->disk_cache;
+	int json_len;
+
+	if (!LUKS2_disk_hdr_cache_has_json(hdr, seqid))
+		return NULL;
+
+	return parse_json_len(cd, c->json_area, c->hdr_size - LUKS2_HDR_BIN_LEN, &json_len);
+}
+
+/*
+ * Returns true if the JSON text is the same as cached (validated) JSON area
+ * of the current in-memory header state.
+ */
+bool LUKS2_disk_hdr_cache_json_equal(struct luks2_hdr *hdr, const char *json)
+{
+	struct luks2_hdr_disk_cache *c = hdr->disk_cache;
+	size_t json_len;
+
+	if (!c || !c->json_exact || c->seqid != hdr->seqid || c->hdr_size != hdr->hdr_size)
+		return false;
+
+	json_len = strlen(json);
+
+	return json_len < (c->hdr_size - LUKS2_HDR_BIN_LEN) &&
+	       !memcmp(c->json_area, json, json_len) && !c->json_area[json_len];
+}
+
+static void hdr_cache_update(struct crypt_device *cd, struct luks2_hdr *hdr,
+			     struct device *device, const char *json_area, bool json_exact)
+{
+	struct luks2_hdr_disk_cache *c = hdr->disk_cache;
+	size_t json_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
+
+	if (c && (c->hdr_size != hdr->hdr_size || crypt_memory_lean(cd) ||
+		  __atomic_load_n(&c->refcount, __ATOMIC_ACQUIRE) > 1)) {
+		LUKS2_disk_hdr_cache_free(hdr);
+		c = NULL;
+	}
+
+	if (crypt_memory_lean(cd))
+		return;
+
+	if (!c) {
+		c = malloc(sizeof(*c) + json_len);
+		if (!c)
+			return;
+		c->refcount = 1;
+		hdr->disk_cache = c;
+	}
+
+	hdr->disk_cache_device = device;
+	c->seqid = hdr->seqid;
+	c->hdr_size = hdr->hdr_size;
+	c->json_exact = json_exact;
+	hdr_to_disk(hdr, &c->hdr_disk, 0, 0);
+	memcpy(c->salt2, hdr->salt2, LUKS2_SALT_L);
+	memcpy(c->json_area, json_area, json_len);
+}
+
+/*
+ * Compare header copy on disk with the new state (before seqid increase) and
+ * find JSON area range that differs. Whole area is dirty if the copy cannot be
+ * read or is corrupted. Must be called with write lock held.
+ */
+static void hdr_disk_dirty(struct crypt_device *cd, struct device *device,
+			   struct luks2_hdr *hdr, const char *json_area, int secondary,
+			   bool *bin_dirty, size_t *dirty_offset, size_t *dirty_len)
+{
+	struct luks2_hdr_disk hdr_disk, hdr_disk_new;
+	char *json_disk = NULL;
+	uint64_t offset = secondary ? hdr->hdr_size : 0;
+	size_t first, last, json_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
+
+	*bin_dirty = true;
+	*dirty_offset = 0;
+	*dirty_len = json_len;
+
+	if (hdr_read_disk(cd, device, NULL, &hdr_disk, &json_disk, offset, secondary) ||
+	    be64_to_cpu(hdr_disk.hdr_size) != hdr->hdr_size) {
+		log_dbg(cd, "LUKS2 header at offset %" PRIu64 " will be fully rewritten.", offset);
+		free(json_disk);
+		return;
+	}
+
+	hdr_to_disk(hdr, &hdr_disk_new, secondary, offset);
+	*bin_dirty = memcmp(&hdr_disk, &hdr_disk_new, LUKS2_HDR_BIN_LEN);
+
+	for (first = 0; first < json_len && json_area[first] == json_disk[first]; first++);
+
+	if (first == json_len) {
+		*dirty_offset = *dirty_len = 0;
+		free(json_disk);
+		return;
+	}
+
+	for (last = json_len - 1; last > first && json_area[last] == json_disk[last]; last--);
+	free(json_disk);
+
+	*dirty_offset = first - first % LUKS2_HDR_WRITE_BLOCK;
+	*dirty_len = MIN(json_len, last - last % LUKS2_HDR_WRITE_BLOCK + LUKS2_HDR_WRITE_BLOCK) - *dirty_offset;
+
+	log_dbg(cd, "LUKS2 JSON area update of %zu bytes at offset %zu (header offset %" PRIu64 ").",
+		*dirty_len, *dirty_offset, offset);
+}
+
 /*
  * Write LUKS2 header to disk at specific offset.
+ * Only json_len bytes of JSON area at json_offset are written, the rest
+ * must already be on disk. Checksum is always calculated over whole area.
  */
 static int hdr_write_disk(struct crypt_device *cd,
 			  struct device *device, struct luks2_hdr *hdr,
-			  const char *json_area, int secondary)
+			  const char *json_area, int secondary,
+			  size_t json_offset, size_t json_len)
 {
 	struct luks2_hdr_disk hdr_disk;
 	uint64_t offset = secondary ? hdr->hdr_size : 0;
@@ -322,7 +612,7 @@ static int hdr_write_disk(struct crypt_device *cd,
 	/*
 	 * Write header without checksum but with proper seqid.
 	 */
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
+	if (write_lseek_blockwise_dsync(devfd, device_block_size(cd, device),
 				  device_alignment(device), (char *)&hdr_disk,
 				  LUKS2_HDR_BIN_LEN, offset) < (ssize_t)LUKS2_HDR_BIN_LEN) {
 		return -EIO;
@@ -331,10 +621,10 @@ static int hdr_write_disk(struct crypt_device *cd,
 	/*
 	 * Write json area.
 	 */
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
+	if (json_len && write_lseek_blockwise_dsync(devfd, device_block_size(cd, device),
 				  device_alignment(device),
-				  CONST_CAST(char*)json_area, hdr_json_len,
-				  LUKS2_HDR_BIN_LEN + offset) < (ssize_t)hdr_json_len) {
+				  CONST_CAST(char*)json_area + json_offset, json_len,
+				  LUKS2_HDR_BIN_LEN + offset + json_offset) < (ssize_t)json_len) {
 		return -EIO;
 	}
 
@@ -348,19 +638,25 @@ static int hdr_write_disk(struct crypt_device *cd,
 	}
 	log_dbg_checksum(cd, hdr_disk.csum, hdr_disk.checksum_alg, "in-memory");
 
-	if (write_lseek_blockwise(devfd, device_block_size(cd, device),
+	/* every write is stable on return, no whole device sync */
+	if (write_lseek_blockwise_dsync(devfd, device_block_size(cd, device),
 				  device_alignment(device), (char *)&hdr_disk,
 				  LUKS2_HDR_BIN_LEN, offset) < (ssize_t)LUKS2_HDR_BIN_LEN)
 		r = -EIO;
 
-	device_sync(cd, device);
 	return r;
 }
 
+/*
+ * Optimistic concurrency check of in-memory header against on-disk state.
+ * Only the first device block (binary header of the primary area) is read,
+ * directly into aligned buffer, so no bounce buffer or lseek is needed.
+ */
 static int LUKS2_check_sequence_id(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device)
 {
-	int devfd;
-	struct luks2_hdr_disk dhdr;
+	struct luks2_hdr_disk *dhdr;
+	size_t bsize, alignment;
+	int devfd, r;
 
 	if (!hdr)
 		return -EINVAL;
@@ -370,17 +666,29 @@ static int LUKS2_check_sequence_id(struct crypt_device *cd, struct luks2_hdr *hd
 		return devfd == -1 ? -EINVAL : devfd;
 
 	/* we need only first 512 bytes, see luks2_hdr_disk structure */
-	if ((read_lseek_blockwise(devfd, device_block_size(cd, device),
-	     device_alignment(device), &dhdr, 512, 0) != 512))
+	bsize = device_block_size(cd, device);
+	alignment = device_alignment(device);
+	if (bsize < 512)
+		bsize = 512;
+
+	if (posix_memalign((void *)&dhdr, alignment, bsize))
+		return -ENOMEM;
+
+	if (read_blockwise_offset(devfd, bsize, alignment, dhdr, bsize, 0) != (ssize_t)bsize) {
+		free(dhdr);
 		return -EIO;
+	}
 
 	/* there's nothing to check if there's no LUKS2 header */
-	if ((be16_to_cpu(dhdr.version) != 2) ||
-	    memcmp(dhdr.magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L) ||
-	    strcmp(dhdr.uuid, hdr->uuid))
-		return 0;
+	if ((be16_to_cpu(dhdr->version) != 2) ||
+	    memcmp(dhdr->magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L) ||
+	    strncmp(dhdr->uuid, hdr->uuid, LUKS2_UUID_L))
+		r = 0;
+	else
+		r = hdr->seqid != be64_to_cpu(dhdr->seqid);
 
-	return hdr->seqid != be64_to_cpu(dhdr.seqid);
+	free(dhdr);
+	return r;
 }
 
 int LUKS2_device_write_lock(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device)
@@ -392,7 +700,11 @@ int LUKS2_device_write_lock(struct crypt_device *cd, struct luks2_hdr *hdr, stru
 		return r;
 	}
 
-	/* run sequence id check only on first write lock (r == 1) and w/o LUKS2 reencryption in-progress */
+	/*
+	 * Run sequence id check only on first write lock (r == 1) and w/o LUKS2 reencryption
+	 * in-progress. Nested write lock means the on-disk header was already verified
+	 * and the lock is held for the whole operation, so nothing could change it.
+	 */
 	if (r == 1 && !crypt_get_luks2_reencrypt(cd)) {
 		log_dbg(cd, "Checking context sequence id matches value stored on disk.");
 		if (LUKS2_check_sequence_id(cd, hdr, device)) {
@@ -409,12 +721,13 @@ int LUKS2_device_write_lock(struct crypt_device *cd, struct luks2_hdr *hdr, stru
  * Convert in-memory LUKS2 header and write it to disk.
  * This will increase sequence id, write both header copies and calculate checksum.
  */
-int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
+static int disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
 {
 	char *json_area;
 	const char *json_text;
-	size_t json_area_len;
-	int r;
+	size_t json_area_len, json_offset[2], json_len[2];
+	bool bin_dirty[2];
+	int i, r;
 
 	if (hdr->version != 2) {
 		log_dbg(cd, "Unsupported LUKS2 header version (%u).", hdr->version);
@@ -459,22 +772,62 @@ int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct
 		return r;
 	}
 
+	/*
+	 * Both copies on disk are compared with the new state under the lock.
+	 * Only changed part of JSON area of each copy is written (a corrupted
+	 * copy is rewritten fully), unchanged header is not written at all.
+	 * Forced writes always write full areas.
+	 */
+	for (i = 0; i < 2; i++) {
+		bin_dirty[i] = true;
+		json_offset[i] = 0;
+		json_len[i] = json_area_len;
+		if (seqid_check)
+			hdr_disk_dirty(cd, device, hdr, json_area, i,
+				       &bin_dirty[i], &json_offset[i], &json_len[i]);
+	}
+
+	if (!bin_dirty[0] && !bin_dirty[1] && !json_len[0] && !json_len[1]) {
+		log_dbg(cd, "LUKS2 header is not changed, skipping write.");
+		hdr_cache_update(cd, hdr, device, json_area, true);
+		device_write_unlock(cd, device);
+		free(json_area);
+		return 0;
+	}
+
 	/* Increase sequence id before writing it to disk. */
 	hdr->seqid++;
 
 	/* Write primary and secondary header */
-	r = hdr_write_disk(cd, device, hdr, json_area, 0);
+	r = hdr_write_disk(cd, device, hdr, json_area, 0, json_offset[0], json_len[0]);
 	if (!r)
-		r = hdr_write_disk(cd, device, hdr, json_area, 1);
+		r = hdr_write_disk(cd, device, hdr, json_area, 1, json_offset[1], json_len[1]);
 
-	if (r)
+	if (r) {
 		log_dbg(cd, "LUKS2 header write failed (%d).", r);
+		/* On-disk state is not known now, keep JSON area for rollback only */
+		hdr->disk_cache_device = NULL;
+	} else
+		hdr_cache_update(cd, hdr, device, json_area, true);
 
 	device_write_unlock(cd, device);
 
 	free(json_area);
 	return r;
 }
+
+int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device, bool seqid_check)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_HEADER_WRITE, "luks2");
+	r = disk_hdr_write(cd, hdr, device, seqid_check);
+	crypt_trace_end(cd, &trace, r ? 0 : 2 * hdr->hdr_size, r);
+
+	return r;
+}
+
 static int validate_json_area(struct crypt_device *cd, const char *json_area,
 			      uint64_t json_len, uint64_t max_length)
 {
@@ -509,7 +862,8 @@ static int validate_json_area(struct crypt_device *cd, const char *json_area,
 	return 0;
 }
 
-static int validate_luks2_json_object(struct crypt_device *cd, json_object *jobj_hdr, uint64_t length)
+static int validate_luks2_json_object(struct crypt_device *cd, json_object *jobj_hdr, uint64_t length,
+				      bool *repaired)
 {
 	int r;
 
@@ -525,6 +879,8 @@ static int validate_luks2_json_object(struct crypt_device *cd, json_object *jobj
 		log_dbg(cd, "Repairing JSON metadata.");
 		/* try to correct known glitches */
 		LUKS2_hdr_repair(cd, jobj_hdr);
+		if (repaired)
+			*repaired = true;
 
 		/* run validation again */
 		r = LUKS2_hdr_validate(cd, jobj_hdr, length);
@@ -537,20 +893,31 @@ static int validate_luks2_json_object(struct crypt_device *cd, json_object *jobj
 }
 
 static json_object *parse_and_validate_json(struct crypt_device *cd,
-					    const char *json_area, uint64_t max_length)
+					    const char *json_area, uint64_t max_length,
+					    bool *repaired)
 {
-	int json_len, r;
-	json_object *jobj = parse_json_len(cd, json_area, max_length, &json_len);
+	int json_len, parsed_len, r;
+	json_object *jobj;
+
+	/* Reject wrong JSON area layout before json-c allocates the tree */
+	r = json_area_scan(cd, json_area, max_length, &json_len);
+	if (!r)
+		r = validate_json_area(cd, json_area, json_len, max_length);
+	if (r)
+		return NULL;
 
+	jobj = parse_json_len(cd, json_area, json_len, &parsed_len);
 	if (!jobj)
 		return NULL;
 
 	/* successful parse_json_len must not return offset <= 0 */
-	assert(json_len > 0);
+	assert(parsed_len > 0);
 
-	r = validate_json_area(cd, json_area, json_len, max_length);
-	if (!r)
-		r = validate_luks2_json_object(cd, jobj, max_length);
+	if (parsed_len != json_len) {
+		log_dbg(cd, "ERROR: Parsed json data length mismatch (%d != %d).", parsed_len, json_len);
+		r = -EINVAL;
+	} else
+		r = validate_luks2_json_object(cd, jobj, max_length, repaired);
 
 	if (r) {
 		json_object_put(jobj);
@@ -560,7 +927,26 @@ static json_object *parse_and_validate_json(struct crypt_device *cd,
 	return jobj;
 }
 
-static int detect_device_signatures(struct crypt_device *cd, const char *path)
+/*
+ * Both headers passed checksum check, if the secondary JSON area is
+ * identical to already validated primary one, it need not be parsed again.
+ */
+static bool hdr_json_same(const struct luks2_hdr_disk *hdr_disk1, const char *json_area1,
+			  json_object *jobj_hdr1,
+			  const struct luks2_hdr_disk *hdr_disk2, const char *json_area2)
+{
+	if (!jobj_hdr1)
+		return false;
+
+	if (hdr_disk1->seqid != hdr_disk2->seqid ||
+	    hdr_disk1->hdr_size != hdr_disk2->hdr_size)
+		return false;
+
+	return !memcmp(json_area1, json_area2, be64_to_cpu(hdr_disk1->hdr_size) - LUKS2_HDR_BIN_LEN);
+}
+
+/* Only LUKS2 header area is probed, it is the only area recovery writes to */
+static int detect_device_signatures(struct crypt_device *cd, const char *path, uint64_t hdr_size)
 {
 	blk_probe_status prb_state;
 	int r;
@@ -571,7 +957,7 @@ static int detect_device_signatures(struct crypt_device *cd, const char *path)
 		return 0;
 	}
 
-	if ((r = blk_init_by_path(&h, path))) {
+	if ((r = blk_init_by_path_area(&h, path, 0, hdr_size))) {
 		log_dbg(cd, "Failed to initialize blkid_handle by path.");
 		return -EINVAL;
 	}
@@ -610,14 +996,20 @@ static int detect_device_signatures(struct crypt_device *cd, const char *path)
 /*
  * Read and convert on-disk LUKS2 header to in-memory representation..
  * Try to do recovery if on-disk state is not consistent.
+ *
+ * If mem is set, header is parsed only from the memory buffer (device is NULL,
+ * mem_size is the device size), no recovery nor blkid probe is possible.
  */
-int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
-			struct device *device, int do_recovery, int do_blkprobe)
+static int disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
+			 struct device *device, const struct hdr_prefetch *mem,
+			 uint64_t mem_size, int do_recovery, int do_blkprobe)
 {
 	enum { HDR_OK, HDR_OBSOLETE, HDR_FAIL, HDR_FAIL_IO } state_hdr1, state_hdr2;
 	struct luks2_hdr_disk hdr_disk1, hdr_disk2;
 	char *json_area1 = NULL, *json_area2 = NULL;
 	json_object *jobj_hdr1 = NULL, *jobj_hdr2 = NULL;
+	struct hdr_prefetch pf;
+	bool hdr2_same = false, hdr1_repaired = false;
 	unsigned int i;
 	int r;
 	uint64_t hdr_size;
@@ -629,13 +1021,19 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		log_dbg(cd, "Disabling header auto-recovery due to locking being disabled.");
 	}
 
+	if (mem)
+		pf = *mem;
+	else
+		hdr_prefetch_read(cd, device, &pf);
+
 	/*
 	 * Read primary LUKS2 header (offset 0).
 	 */
 	state_hdr1 = HDR_FAIL;
-	r = hdr_read_disk(cd, device, &hdr_disk1, &json_area1, 0, 0);
+	r = hdr_read_disk(cd, device, &pf, &hdr_disk1, &json_area1, 0, 0);
 	if (r == 0) {
-		jobj_hdr1 = parse_and_validate_json(cd, json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
+		jobj_hdr1 = parse_and_validate_json(cd, json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN,
+						    &hdr1_repaired);
 		state_hdr1 = jobj_hdr1 ? HDR_OK : HDR_OBSOLETE;
 	} else if (r == -EIO)
 		state_hdr1 = HDR_FAIL_IO;
@@ -645,9 +1043,15 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 	 */
 	state_hdr2 = HDR_FAIL;
 	if (state_hdr1 != HDR_FAIL && state_hdr1 != HDR_FAIL_IO) {
-		r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1);
-		if (r == 0) {
-			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
+		r = hdr_read_disk(cd, device, &pf, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1);
+		if (r == 0 && hdr_json_same(&hdr_disk1, json_area1, jobj_hdr1, &hdr_disk2, json_area2)) {
+			log_dbg(cd, "Secondary LUKS2 header JSON matches primary header.");
+			jobj_hdr2 = json_object_get(jobj_hdr1);
+			state_hdr2 = HDR_OK;
+			hdr2_same = true;
+		} else if (r == 0) {
+			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN,
+							    NULL);
 			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
 		} else if (r == -EIO)
 			state_hdr2 = HDR_FAIL_IO;
@@ -656,15 +1060,19 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		 * No header size, check all known offsets.
 		 */
 		for (r = -EINVAL,i = 0; r < 0 && i < ARRAY_SIZE(hdr2_offsets); i++)
-			r = hdr_read_disk(cd, device, &hdr_disk2, &json_area2, hdr2_offsets[i], 1);
+			r = hdr_read_disk(cd, device, &pf, &hdr_disk2, &json_area2, hdr2_offsets[i], 1);
 
 		if (r == 0) {
-			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
+			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN,
+							    NULL);
 			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
 		} else if (r == -EIO)
 			state_hdr2 = HDR_FAIL_IO;
 	}
 
+	if (!mem)
+		free(pf.buf);
+
 	/*
 	 * Check sequence id if both headers are read correctly.
 	 */
@@ -685,7 +1093,10 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		goto err;
 	}
 
-	r = device_check_size(cd, device, hdr_size, 0);
+	if (mem)
+		r = hdr_size > mem_size ? -EINVAL : 0;
+	else
+		r = device_check_size(cd, device, hdr_size, 0);
 	if (r)
 		goto err;
 
@@ -695,7 +1106,7 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 	if (state_hdr1 == HDR_OK && state_hdr2 != HDR_OK) {
 		log_dbg(cd, "Secondary LUKS2 header requires recovery.");
 
-		if (do_blkprobe && (r = detect_device_signatures(cd, device_path(device)))) {
+		if (do_blkprobe && (r = detect_device_signatures(cd, device_path(device), hdr_size))) {
 			log_err(cd, _("Device contains ambiguous signatures, cannot auto-recover LUKS2.\n"
 				      "Please run \"cryptsetup repair\" for recovery."));
 			goto err;
@@ -708,7 +1119,8 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg(cd, "Cannot generate header salt.");
 			else {
 				hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
-				r = hdr_write_disk(cd, device, hdr, json_area1, 1);
+				r = hdr_write_disk(cd, device, hdr, json_area1, 1,
+						   0, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
 			}
 			if (r)
 				log_dbg(cd, "Secondary LUKS2 header recovery failed.");
@@ -716,7 +1128,7 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 	} else if (state_hdr1 != HDR_OK && state_hdr2 == HDR_OK) {
 		log_dbg(cd, "Primary LUKS2 header requires recovery.");
 
-		if (do_blkprobe && (r = detect_device_signatures(cd, device_path(device)))) {
+		if (do_blkprobe && (r = detect_device_signatures(cd, device_path(device), hdr_size))) {
 			log_err(cd, _("Device contains ambiguous signatures, cannot auto-recover LUKS2.\n"
 				      "Please run \"cryptsetup repair\" for recovery."));
 			goto err;
@@ -729,18 +1141,14 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg(cd, "Cannot generate header salt.");
 			else {
 				hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
-				r = hdr_write_disk(cd, device, hdr, json_area2, 0);
+				r = hdr_write_disk(cd, device, hdr, json_area2, 0,
+						   0, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 			}
 			if (r)
 				log_dbg(cd, "Primary LUKS2 header recovery failed.");
 		}
 	}
 
-	free(json_area1);
-	json_area1 = NULL;
-	free(json_area2);
-	json_area2 = NULL;
-
 	/* wrong lock for write mode during recovery attempt */
 	if (r == -EAGAIN)
 		goto err;
@@ -758,6 +1166,13 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		json_object_put(jobj_hdr1);
 	}
 
+	/* Both copies are the same on disk, later write can update only changes. */
+	if (state_hdr1 == HDR_OK && hdr2_same && device)
+		hdr_cache_update(cd, hdr, device, json_area1, !hdr1_repaired);
+
+	free(json_area1);
+	free(json_area2);
+
 	/*
 	 * FIXME: should this fail? At least one header was read correctly.
 	 * r = (state_hdr1 == HDR_FAIL_IO || state_hdr2 == HDR_FAIL_IO) ? -EIO : -EINVAL;
@@ -774,6 +1189,43 @@ err:
 	return r;
 }
 
+int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
+			struct device *device, int do_recovery, int do_blkprobe)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_HEADER_READ, "luks2");
+	r = disk_hdr_read(cd, hdr, device, NULL, 0, do_recovery, do_blkprobe);
+	crypt_trace_end(cd, &trace, r ? 0 : 2 * hdr->hdr_size, r);
+
+	return r;
+}
+
+/*
+ * Test only (fuzzing) entry point, parse and validate both LUKS2 header
+ * copies directly from memory buffer. There is no device access, locking,
+ * blkid probing nor recovery, device_size is the size of (virtual) device.
+ */
+int LUKS2_hdr_read_buffer(struct crypt_device *cd, struct luks2_hdr *hdr,
+			  const void *buffer, size_t buffer_size, uint64_t device_size)
+{
+	struct hdr_prefetch mem = {
+		.buf = CONST_CAST(char *)buffer,
+		.len = buffer_size,
+	};
+	int r;
+
+	if (!hdr || !buffer || !buffer_size)
+		return -EINVAL;
+
+	r = disk_hdr_read(cd, hdr, NULL, &mem, device_size ?: buffer_size, 0, 0);
+	if (!r)
+		LUKS2_hdr_index_build(hdr);
+
+	return r;
+}
+
 int LUKS2_hdr_version_unlocked(struct crypt_device *cd, const char *backup_file)
 {
 	struct {
@@ -796,8 +1248,7 @@ int LUKS2_hdr_version_unlocked(struct crypt_device *cd, const char *backup_file)
 		flags |= O_DIRECT;
 
 	devfd = open(device_path(device), flags);
-	if (devfd != -1 && (read_lseek_blockwise(devfd, device_block_size(cd, device),
-	     device_alignment(device), &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
+	if (devfd != -1 && (device_read_probe(cd, device, devfd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
 	    !memcmp(hdr.magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L))
 		r = (int)be16_to_cpu(hdr.version);
 
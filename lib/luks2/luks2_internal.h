@@ -41,6 +41,11 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 			struct device *device, int do_recovery, int do_blkprobe);
 int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr,
 			 struct device *device, bool seqid_check);
+void LUKS2_disk_hdr_cache_free(struct luks2_hdr *hdr);
+void LUKS2_disk_hdr_cache_share(struct luks2_hdr *dst, struct luks2_hdr *src, struct device *device);
+bool LUKS2_disk_hdr_cache_has_json(struct luks2_hdr *hdr, uint64_t seqid);
+json_object *LUKS2_disk_hdr_cache_json(struct crypt_device *cd, struct luks2_hdr *hdr, uint64_t seqid);
+bool LUKS2_disk_hdr_cache_json_equal(struct luks2_hdr *hdr, const char *json);
 int LUKS2_device_write_lock(struct crypt_device *cd,
 	struct luks2_hdr *hdr, struct device *device);
 
@@ -66,6 +71,10 @@ int json_object_object_add_by_uint_by_ref(json_object *jobj, unsigned key, json_
 void json_object_object_del_by_uint(json_object *jobj, unsigned key);
 int json_object_copy(json_object *jobj_src, json_object **jobj_dst);
 
+void LUKS2_hdr_index_invalidate(void);
+unsigned int LUKS2_hdr_index_generation(void);
+void LUKS2_hdr_index_build(struct luks2_hdr *hdr);
+
 void JSON_DBG(struct crypt_device *cd, json_object *jobj, const char *desc);
 
 /*
@@ -126,6 +135,23 @@ int placeholder_keyslot_alloc(struct crypt_device *cd,
 	uint64_t area_offset,
 	uint64_t area_length);
 
+/*
+ * Key derivation in parallel keyslot trial (noop otherwise),
+ * begin can return -ECANCELED if other keyslot was already unlocked.
+ */
+int LUKS2_keyslot_kdf_begin(uint32_t memory_kb);
+void LUKS2_keyslot_kdf_end(uint32_t memory_kb);
+
+/* Copy keyslot area content prefetched before unlock, -ENOENT if not available */
+int LUKS2_keyslot_prefetched(uint64_t offset, char *dst, size_t length);
+
+struct volume_key *LUKS2_keyslot_batch_key(json_object *jobj_keyslot);
+int LUKS2_keyslot_luks2_derive_key(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	const char *password, size_t passwordLen,
+	struct volume_key **derived_key);
+uint32_t LUKS2_keyslot_luks2_kdf_memory(json_object *jobj_keyslot);
+
 /* validate all keyslot implementations in hdr json */
 int LUKS2_keyslots_validate(struct crypt_device *cd, json_object *hdr_jobj);
 
@@ -192,6 +218,27 @@ int keyring_validate(struct crypt_device *cd, const char *json);
 
 void keyring_buffer_free(void *buffer, size_t buffer_size);
 
+int escrow_open(struct crypt_device *cd,
+	int token,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr);
+
+void escrow_dump(struct crypt_device *cd, const char *json);
+
+int escrow_validate(struct crypt_device *cd, const char *json);
+
+void escrow_buffer_free(void *buffer, size_t buffer_size);
+
+int LUKS2_token_escrow_volume_key(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int segment,
+	crypt_keyslot_priority priority,
+	const char *buffer,
+	size_t buffer_len,
+	struct volume_key **vk);
+
 struct crypt_token_handler_v2 {
 	const char *name;
 	crypt_token_open_func open;
@@ -207,6 +254,28 @@ struct crypt_token_handler_v2 {
 	void *dlhandle;
 };
 
+/* Asynchronous external token handler, v2 with optional async open symbols */
+struct crypt_token_handler_v3 {
+	const char *name;
+	crypt_token_open_func open;
+	crypt_token_buffer_free_func buffer_free;
+	crypt_token_validate_func validate;
+	crypt_token_dump_func dump;
+
+	/* here ends v1. Do not touch anything above */
+
+	crypt_token_open_pin_func open_pin;
+	crypt_token_version_func version;
+
+	void *dlhandle;
+
+	/* here ends v2. Do not touch anything above */
+
+	crypt_token_open_start_func open_start;
+	crypt_token_open_poll_func open_poll;
+	crypt_token_open_finish_func open_finish;
+};
+
 /*
  * Initial sequence of structure members in union 'u' must be always
  * identical. Version 4 must fully contain version 3 which must
@@ -219,13 +288,18 @@ struct crypt_token_handler_internal {
 	union {
 		crypt_token_handler v1; /* deprecated public structure */
 		struct crypt_token_handler_v2 v2; /* internal helper v2 structure */
+		struct crypt_token_handler_v3 v3; /* internal helper v3 structure */
 	} u;
+	unsigned int users; /* handler references, protected by handlers lock */
+	bool parallel_open; /* open functions can run concurrently (CRYPT_TOKEN_CAP_PARALLEL_OPEN) */
 };
 
 int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			size_t keylength, uint64_t *area_offset, uint64_t *area_length);
 int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			    uint64_t *area_offset, uint64_t *area_length);
+void LUKS2_area_map_add(struct luks2_hdr *hdr, uint64_t offset, uint64_t length);
+void LUKS2_area_map_remove(struct luks2_hdr *hdr, int keyslot);
 
 uint64_t LUKS2_hdr_and_areas_size_jobj(json_object *jobj);
 
@@ -22,11 +22,6 @@
 #include "luks2_internal.h"
 #include <uuid/uuid.h>
 
-struct area {
-	uint64_t offset;
-	uint64_t length;
-};
-
 static size_t get_area_size(size_t keylength)
 {
 	/* for now it is AF_split_sectors */
@@ -43,61 +38,125 @@ static size_t get_max_offset(struct luks2_hdr *hdr)
 	return LUKS2_hdr_and_areas_size(hdr);
 }
 
-int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
-			uint64_t *area_offset, uint64_t *area_length)
+static bool area_map_valid(struct luks2_hdr *hdr)
 {
-	struct area areas[LUKS2_KEYSLOTS_MAX], sorted_areas[LUKS2_KEYSLOTS_MAX+1] = {};
-	int i, j, k, area_i;
-	size_t valid_offset, offset, length;
+	return hdr->jobj && hdr->area_map.jobj == hdr->jobj &&
+	       hdr->area_map.generation == LUKS2_hdr_index_generation();
+}
 
-	/* fill area offset + length table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		if (!LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length))
-			continue;
-		areas[i].length = 0;
-		areas[i].offset = 0;
+static void area_map_insert(struct luks2_area_map *map, uint64_t offset, uint64_t length)
+{
+	unsigned int i = map->count;
+
+	while (i && map->areas[i - 1].offset > offset) {
+		map->areas[i] = map->areas[i - 1];
+		i--;
 	}
+	map->areas[i].offset = offset;
+	map->areas[i].length = length;
+	map->count++;
+
+	if (i < map->hint)
+		map->hint = i;
+}
 
-	/* sort table */
-	k = 0; /* index in sorted table */
+static struct luks2_area_map *area_map_get(struct luks2_hdr *hdr)
+{
+	struct luks2_area_map *map = &hdr->area_map;
+	json_object *jobj_keyslot;
+	uint64_t offset, length;
+	int i;
+
+	if (area_map_valid(hdr))
+		return map;
+
+	map->count = map->hint = 0;
+	map->hint_length = 0;
 	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		offset = get_max_offset(hdr) ?: UINT64_MAX;
-		area_i = -1;
-		/* search for the smallest offset in table */
-		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
-			if (areas[j].offset && areas[j].offset <= offset) {
-				area_i = j;
-				offset = areas[j].offset;
-			}
-
-		if (area_i >= 0) {
-			sorted_areas[k].length = areas[area_i].length;
-			sorted_areas[k].offset = areas[area_i].offset;
-			areas[area_i].length = 0;
-			areas[area_i].offset = 0;
-			k++;
-		}
+		jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, i);
+		if (jobj_keyslot && !LUKS2_keyslot_jobj_area(jobj_keyslot, &offset, &length) &&
+		    offset && length)
+			area_map_insert(map, offset, length);
+	}
+
+	map->jobj = hdr->jobj;
+	map->generation = LUKS2_hdr_index_generation();
+
+	return map;
+}
+
+/*
+ * Must be called before the keyslot is added (removed) from JSON,
+ * the map then expects exactly one header index invalidation.
+ */
+void LUKS2_area_map_add(struct luks2_hdr *hdr, uint64_t offset, uint64_t length)
+{
+	struct luks2_area_map *map = &hdr->area_map;
+
+	if (!area_map_valid(hdr))
+		return;
+
+	if (map->count < LUKS2_KEYSLOTS_MAX && offset && length) {
+		area_map_insert(map, offset, length);
+		map->generation++;
+	} else
+		map->jobj = NULL;
+}
+
+void LUKS2_area_map_remove(struct luks2_hdr *hdr, int keyslot)
+{
+	struct luks2_area_map *map = &hdr->area_map;
+	uint64_t offset, length;
+	unsigned int i;
+
+	if (!area_map_valid(hdr))
+		return;
+
+	if (LUKS2_keyslot_jobj_area(LUKS2_get_keyslot_jobj(hdr, keyslot), &offset, &length) ||
+	    !offset || !length) {
+		map->generation++;
+		return;
 	}
 
-	sorted_areas[LUKS2_KEYSLOTS_MAX].offset = get_max_offset(hdr);
-	sorted_areas[LUKS2_KEYSLOTS_MAX].length = 1;
+	for (i = 0; i < map->count; i++)
+		if (map->areas[i].offset == offset)
+			break;
+
+	if (i == map->count) {
+		map->jobj = NULL;
+		return;
+	}
+
+	memmove(&map->areas[i], &map->areas[i + 1], (map->count - i - 1) * sizeof(map->areas[0]));
+	map->count--;
+	/* freed area can be reused by any allocation */
+	map->hint = 0;
+	map->hint_length = 0;
+	map->generation++;
+}
+
+int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
+			uint64_t *area_offset, uint64_t *area_length)
+{
+	struct luks2_area_map *map = area_map_get(hdr);
+	size_t valid_offset, offset, length, next_offset;
+	unsigned int i;
 
 	/* search for the gap we can use */
 	length = valid_offset = 0;
 	offset = get_min_offset(hdr);
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX+1; i++) {
-		/* skip empty */
-		if (sorted_areas[i].offset == 0 || sorted_areas[i].length == 0)
-			continue;
+	for (i = 0; i <= map->count; i++) {
+		next_offset = i < map->count ? map->areas[i].offset : get_max_offset(hdr);
 
 		/* found bigger gap than the last one */
-		if ((offset < sorted_areas[i].offset) && (sorted_areas[i].offset - offset) > length) {
-			length = sorted_areas[i].offset - offset;
+		if ((offset < next_offset) && (next_offset - offset) > length) {
+			length = next_offset - offset;
 			valid_offset = offset;
 		}
 
 		/* move beyond allocated area */
-		offset = sorted_areas[i].offset + sorted_areas[i].length;
+		if (i < map->count)
+			offset = map->areas[i].offset + map->areas[i].length;
 	}
 
 	/* this search 'algorithm' does not work with unaligned areas */
@@ -120,53 +179,31 @@ int LUKS2_find_area_max_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			size_t keylength, uint64_t *area_offset, uint64_t *area_length)
 {
-	struct area areas[LUKS2_KEYSLOTS_MAX], sorted_areas[LUKS2_KEYSLOTS_MAX] = {};
-	int i, j, k, area_i;
+	struct luks2_area_map *map = area_map_get(hdr);
+	unsigned int i = 0;
 	size_t offset, length;
 
-	/* fill area offset + length table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		if (!LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length))
-			continue;
-		areas[i].length = 0;
-		areas[i].offset = 0;
-	}
-
-	/* sort table */
-	k = 0; /* index in sorted table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		offset = get_max_offset(hdr) ?: UINT64_MAX;
-		area_i = -1;
-		/* search for the smallest offset in table */
-		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
-			if (areas[j].offset && areas[j].offset <= offset) {
-				area_i = j;
-				offset = areas[j].offset;
-			}
-
-		if (area_i >= 0) {
-			sorted_areas[k].length = areas[area_i].length;
-			sorted_areas[k].offset = areas[area_i].offset;
-			areas[area_i].length = 0;
-			areas[area_i].offset = 0;
-			k++;
-		}
-	}
-
-	/* search for the gap we can use */
 	offset = get_min_offset(hdr);
 	length = get_area_size(keylength);
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		/* skip empty */
-		if (sorted_areas[i].offset == 0 || sorted_areas[i].length == 0)
-			continue;
 
+	/* gaps before hint are too small for allocation of the same (or larger) size */
+	if (map->hint && length >= map->hint_length) {
+		i = map->hint;
+		offset = map->areas[i - 1].offset + map->areas[i - 1].length;
+	}
+
+	for (; i < map->count; i++) {
 		/* enough space before the used area */
-		if ((offset < sorted_areas[i].offset) && ((offset + length) <= sorted_areas[i].offset))
+		if ((offset < map->areas[i].offset) && ((offset + length) <= map->areas[i].offset))
 			break;
 
 		/* both offset and length are already aligned to 4096 bytes */
-		offset = sorted_areas[i].offset + sorted_areas[i].length;
+		offset = map->areas[i].offset + map->areas[i].length;
+	}
+
+	if (!map->hint || length <= map->hint_length) {
+		map->hint = i;
+		map->hint_length = length;
 	}
 
 	if ((offset + length) > get_max_offset(hdr)) {
@@ -184,6 +221,44 @@ int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 	return 0;
 }
 
+/*
+ * Count metadata areas not aligned to metadata device block size.
+ * Every write to such area needs read-modify-write cycle (e.g. on 4Kn devices).
+ */
+int LUKS2_hdr_check_block_alignment(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	uint64_t offset, length;
+	size_t bsize = device_block_size(cd, crypt_metadata_device(cd));
+	int i, misaligned = 0;
+
+	if (!bsize)
+		return -EINVAL;
+
+	if (hdr->hdr_size % bsize) {
+		log_dbg(cd, "LUKS2 metadata area size %zu is not aligned to %zu bytes.",
+			hdr->hdr_size, bsize);
+		misaligned++;
+	}
+
+	if (LUKS2_keyslots_size(hdr) % bsize) {
+		log_dbg(cd, "LUKS2 keyslots area size %" PRIu64 " is not aligned to %zu bytes.",
+			LUKS2_keyslots_size(hdr), bsize);
+		misaligned++;
+	}
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+		if (LUKS2_keyslot_area(hdr, i, &offset, &length))
+			continue;
+		if ((offset % bsize) || (length % bsize)) {
+			log_dbg(cd, "Keyslot %d area [%" PRIu64 ", %" PRIu64 "] is not aligned to %zu bytes.",
+				i, offset, length, bsize);
+			misaligned++;
+		}
+	}
+
+	return misaligned;
+}
+
 int LUKS2_check_metadata_area_size(uint64_t metadata_size)
 {
 	/* see LUKS2_HDR2_OFFSETS */
@@ -220,6 +295,7 @@ int LUKS2_generate_hdr(
 	uuid_t partitionUuid;
 	int r, digest;
 	uint64_t mdev_size;
+	size_t bsize;
 
 	if (!metadata_size)
 		metadata_size = LUKS2_HDR_16K_LEN;
@@ -234,8 +310,14 @@ int LUKS2_generate_hdr(
 	if (!keyslots_size && data_offset)
 		keyslots_size = data_offset - get_min_offset(hdr);
 
-	/* keyslots size has to be 4 KiB aligned */
-	keyslots_size -= (keyslots_size % 4096);
+	/*
+	 * keyslots size has to be 4 KiB aligned, use metadata device block size
+	 * if bigger so keyslot area writes never need read-modify-write cycle.
+	 */
+	bsize = device_block_size(cd, crypt_metadata_device(cd));
+	if (bsize < 4096 || NOTPOW2(bsize))
+		bsize = 4096;
+	keyslots_size -= (keyslots_size % bsize);
 
 	if (keyslots_size > LUKS2_MAX_KEYSLOTS_SIZE)
 		keyslots_size = LUKS2_MAX_KEYSLOTS_SIZE;
@@ -249,11 +331,13 @@ int LUKS2_generate_hdr(
 		    device_fallocate(crypt_metadata_device(cd), keyslots_size + get_min_offset(hdr)) &&
 		    (get_min_offset(hdr) <= mdev_size))
 			keyslots_size = mdev_size - get_min_offset(hdr);
+		keyslots_size -= (keyslots_size % bsize);
 	}
 
 	/* Decrease keyslots_size if we have smaller data_offset */
 	if (data_offset && (keyslots_size + get_min_offset(hdr)) > data_offset) {
 		keyslots_size = data_offset - get_min_offset(hdr);
+		keyslots_size -= (keyslots_size % bsize);
 		log_dbg(cd, "Decreasing keyslot area size to %" PRIu64
 			" bytes due to the requested data offset %"
 			PRIu64 " bytes.", keyslots_size, data_offset);
@@ -370,6 +454,7 @@ int LUKS2_generate_hdr(
 	return 0;
 err:
 	json_object_put(hdr->jobj);
+	LUKS2_hdr_index_invalidate();
 	hdr->jobj = NULL;
 	return r;
 }
@@ -103,6 +103,72 @@ struct json_object *LUKS2_array_remove(struct json_object *array, const char *nu
 /*
  * JSON struct access helpers
  */
+/*
+ * Header index generation, changed by every add or delete of keyslot,
+ * token, digest or segment object in any header (or by header release).
+ * Header jobj is shared by parallel keyslot unlock, so lookups only read
+ * the index and it is rebuilt after load and write (single-threaded).
+ */
+static unsigned int hdr_index_generation = 1;
+
+void LUKS2_hdr_index_invalidate(void)
+{
+	__atomic_add_fetch(&hdr_index_generation, 1, __ATOMIC_RELAXED);
+}
+
+unsigned int LUKS2_hdr_index_generation(void)
+{
+	return __atomic_load_n(&hdr_index_generation, __ATOMIC_RELAXED);
+}
+
+static bool hdr_index_valid(const struct luks2_hdr *hdr)
+{
+	return hdr->jobj && hdr->index.jobj == hdr->jobj &&
+	       hdr->index.generation == __atomic_load_n(&hdr_index_generation, __ATOMIC_RELAXED);
+}
+
+static void hdr_index_fill(json_object *jobj_hdr, const char *section,
+			   void **entries, unsigned int max)
+{
+	json_object *jobj_section;
+	char num[16];
+	unsigned long id;
+	char *end;
+
+	memset(entries, 0, max * sizeof(*entries));
+
+	if (!json_object_object_get_ex(jobj_hdr, section, &jobj_section) ||
+	    !json_object_is_type(jobj_section, json_type_object))
+		return;
+
+	json_object_object_foreach(jobj_section, key, val) {
+		errno = 0;
+		id = strtoul(key, &end, 10);
+		if (errno || *end || id >= max)
+			continue;
+		/* only canonical names are found by numeric lookup */
+		if (snprintf(num, sizeof(num), "%lu", id) < 1 || strcmp(num, key))
+			continue;
+		entries[id] = val;
+	}
+}
+
+void LUKS2_hdr_index_build(struct luks2_hdr *hdr)
+{
+	struct luks2_hdr_index *idx = &hdr->index;
+
+	idx->jobj = NULL;
+	if (!hdr->jobj)
+		return;
+
+	idx->generation = __atomic_load_n(&hdr_index_generation, __ATOMIC_RELAXED);
+	hdr_index_fill(hdr->jobj, "keyslots", idx->keyslots, LUKS2_KEYSLOTS_MAX);
+	hdr_index_fill(hdr->jobj, "tokens", idx->tokens, LUKS2_TOKENS_MAX);
+	hdr_index_fill(hdr->jobj, "digests", idx->digests, LUKS2_DIGEST_MAX);
+	hdr_index_fill(hdr->jobj, "segments", idx->segments, LUKS2_SEGMENT_MAX);
+	idx->jobj = hdr->jobj;
+}
+
 json_object *LUKS2_get_keyslot_jobj(struct luks2_hdr *hdr, int keyslot)
 {
 	json_object *jobj1, *jobj2;
@@ -111,6 +177,9 @@ json_object *LUKS2_get_keyslot_jobj(struct luks2_hdr *hdr, int keyslot)
 	if (!hdr || keyslot < 0)
 		return NULL;
 
+	if (keyslot < LUKS2_KEYSLOTS_MAX && hdr_index_valid(hdr))
+		return hdr->index.keyslots[keyslot];
+
 	if (snprintf(keyslot_name, sizeof(keyslot_name), "%u", keyslot) < 1)
 		return NULL;
 
@@ -141,6 +210,9 @@ json_object *LUKS2_get_token_jobj(struct luks2_hdr *hdr, int token)
 	if (!hdr || token < 0)
 		return NULL;
 
+	if (token < LUKS2_TOKENS_MAX && hdr_index_valid(hdr))
+		return hdr->index.tokens[token];
+
 	jobj1 = LUKS2_get_tokens_jobj(hdr);
 	if (!jobj1)
 		return NULL;
@@ -160,6 +232,9 @@ json_object *LUKS2_get_digest_jobj(struct luks2_hdr *hdr, int digest)
 	if (!hdr || digest < 0)
 		return NULL;
 
+	if (digest < LUKS2_DIGEST_MAX && hdr_index_valid(hdr))
+		return hdr->index.digests[digest];
+
 	if (snprintf(digest_name, sizeof(digest_name), "%u", digest) < 1)
 		return NULL;
 
@@ -188,6 +263,9 @@ json_object *LUKS2_get_segment_jobj(struct luks2_hdr *hdr, int segment)
 	if (segment == CRYPT_DEFAULT_SEGMENT)
 		segment = LUKS2_get_default_segment(hdr);
 
+	if (segment >= 0 && segment < LUKS2_SEGMENT_MAX && hdr_index_valid(hdr))
+		return hdr->index.segments[segment];
+
 	return json_segments_get_segment(json_get_segments_jobj(hdr->jobj), segment);
 }
 
@@ -377,8 +455,21 @@ static bool segment_has_digest(const char *segment_name, json_object *jobj_diges
 }
 
 
+static int interval_cmp(const void *a, const void *b)
+{
+	const struct interval *i1 = a, *i2 = b;
+
+	if (i1->offset < i2->offset)
+		return -1;
+	return i1->offset > i2->offset ? 1 : 0;
+}
+
+/*
+ * Intervals are sorted (array is reordered), overlap is then detected
+ * against the interval with the highest end offset seen so far.
+ */
 static bool validate_intervals(struct crypt_device *cd,
-			       int length, const struct interval *ix,
+			       int length, struct interval *ix,
 			       uint64_t metadata_size, uint64_t keyslots_area_end)
 {
 	int j, i = 0;
@@ -406,24 +497,21 @@ static bool validate_intervals(struct crypt_device *cd,
 			return false;
 		}
 
-		for (j = 0; j < length; j++) {
-			if (i == j)
-				continue;
+		i++;
+	}
 
-			if (ix[j].offset > (UINT64_MAX - ix[j].length)) {
-				log_dbg(cd, "Interval offset+length overflow.");
-				return false;
-			}
+	qsort(ix, length, sizeof(*ix), interval_cmp);
 
-			if ((ix[i].offset >= ix[j].offset) && (ix[i].offset < (ix[j].offset + ix[j].length))) {
-				log_dbg(cd, "Overlapping areas [%" PRIu64 ",%" PRIu64 "] and [%" PRIu64 ",%" PRIu64 "].",
-					ix[i].offset, ix[i].offset + ix[i].length,
-					ix[j].offset, ix[j].offset + ix[j].length);
-				return false;
-			}
+	for (i = 1, j = 0; i < length; i++) {
+		if (ix[i].offset < (ix[j].offset + ix[j].length)) {
+			log_dbg(cd, "Overlapping areas [%" PRIu64 ",%" PRIu64 "] and [%" PRIu64 ",%" PRIu64 "].",
+				ix[i].offset, ix[i].offset + ix[i].length,
+				ix[j].offset, ix[j].offset + ix[j].length);
+			return false;
 		}
 
-		i++;
+		if ((ix[i].offset + ix[i].length) > (ix[j].offset + ix[j].length))
+			j = i;
 	}
 
 	return true;
@@ -1004,6 +1092,11 @@ static int hdr_validate_config(struct crypt_device *cd, json_object *hdr_jobj)
 		return 1;
 	}
 
+	/* Keyslot telemetry is optional, its content is not validated */
+	if (json_object_object_get_ex(jobj_config, "telemetry", &jobj) &&
+	    !json_contains(cd, jobj_config, "section", "Config", "telemetry", json_type_object))
+		return 1;
+
 	/* Flags array is optional */
 	if (json_object_object_get_ex(jobj_config, "flags", &jobj)) {
 		if (!json_contains(cd, jobj_config, "section", "Config", "flags", json_type_array))
@@ -1119,8 +1212,10 @@ static bool hdr_json_free(json_object **jobj)
 {
 	assert(jobj);
 
-	if (json_object_put(*jobj))
+	if (json_object_put(*jobj)) {
 		*jobj = NULL;
+		LUKS2_hdr_index_invalidate();
+	}
 
 	return (*jobj == NULL);
 }
@@ -1139,6 +1234,15 @@ static int hdr_update_copy_for_rollback(struct crypt_device *cd, struct luks2_hd
 		return -EINVAL;
 	}
 
+	/*
+	 * If the JSON area of this state is cached, it is parsed only
+	 * when rollback is really needed. Memory lean context reads
+	 * the header from disk again on rollback.
+	 */
+	hdr->rollback_seqid = hdr->seqid;
+	if (crypt_memory_lean(cd) || LUKS2_disk_hdr_cache_has_json(hdr, hdr->seqid))
+		return 0;
+
 	return json_object_copy(hdr->jobj, jobj_copy) ? -ENOMEM : 0;
 }
 
@@ -1176,13 +1280,26 @@ int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr, int repair)
 	if (!r && (r = hdr_update_copy_for_rollback(cd, hdr)))
 		log_dbg(cd, "Failed to update rollback LUKS2 metadata.");
 
+	if (!r)
+		LUKS2_hdr_index_build(hdr);
+
 	return r;
 }
 
 static int hdr_cleanup_and_validate(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
+	const char *json;
+
 	LUKS2_digests_erase_unused(cd, hdr);
 
+	/* State read from or written to disk was already validated */
+	json = json_object_to_json_string_ext(hdr->jobj,
+		JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
+	if (json && LUKS2_disk_hdr_cache_json_equal(hdr, json)) {
+		log_dbg(cd, "LUKS2 metadata not changed, skipping validation.");
+		return 0;
+	}
+
 	return LUKS2_hdr_validate(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN);
 }
 
@@ -1198,6 +1315,9 @@ int LUKS2_hdr_write_force(struct crypt_device *cd, struct luks2_hdr *hdr)
 	if (!r && (r = hdr_update_copy_for_rollback(cd, hdr)))
 		log_dbg(cd, "Failed to update rollback LUKS2 metadata.");
 
+	if (!r)
+		LUKS2_hdr_index_build(hdr);
+
 	return r;
 }
 
@@ -1208,30 +1328,91 @@ int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr)
 	if (hdr_cleanup_and_validate(cd, hdr))
 		return -EINVAL;
 
+	if (hdr->write_deferred) {
+		log_dbg(cd, "LUKS2 header write deferred.");
+		return 0;
+	}
+
 	r = LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd), true);
 
 	if (!r && (r = hdr_update_copy_for_rollback(cd, hdr)))
 		log_dbg(cd, "Failed to update rollback LUKS2 metadata.");
 
+	if (!r)
+		LUKS2_hdr_index_build(hdr);
+
 	return r;
 }
 
-int LUKS2_hdr_rollback(struct crypt_device *cd, struct luks2_hdr *hdr)
+/*
+ * No rollback copy (memory lean context), use the on-disk state.
+ * A failed write may have already stored the next seqid, anything
+ * else means the header was changed by someone else.
+ */
+static json_object *hdr_rollback_reread(struct crypt_device *cd, struct luks2_hdr *hdr,
+	uint64_t *seqid, size_t *hdr_size)
 {
-	json_object **jobj_copy;
+	struct luks2_hdr hdr_disk = {};
+	json_object *jobj;
+
+	if (LUKS2_hdr_read(cd, &hdr_disk, 0))
+		return NULL;
+
+	if (hdr_disk.seqid != hdr->rollback_seqid && hdr_disk.seqid != hdr->rollback_seqid + 1) {
+		log_dbg(cd, "LUKS2 header on disk changed (seqid %" PRIu64 ", expected %" PRIu64 ").",
+			hdr_disk.seqid, hdr->rollback_seqid);
+		LUKS2_hdr_free(cd, &hdr_disk);
+		return NULL;
+	}
+
+	*seqid = hdr_disk.seqid;
+	*hdr_size = hdr_disk.hdr_size;
+	jobj = hdr_disk.jobj;
+	hdr_disk.jobj = NULL;
+	LUKS2_hdr_free(cd, &hdr_disk);
 
-	assert(hdr->jobj_rollback);
+	return jobj;
+}
+
+int LUKS2_hdr_rollback(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	json_object **jobj_copy, *jobj_cached = NULL;
+	uint64_t seqid = 0;
+	size_t hdr_size = 0;
 
 	log_dbg(cd, "Rolling back in-memory LUKS2 json metadata.");
 
+	if (!hdr->jobj_rollback) {
+		jobj_cached = LUKS2_disk_hdr_cache_json(cd, hdr, hdr->rollback_seqid);
+		if (!jobj_cached && crypt_memory_lean(cd))
+			jobj_cached = hdr_rollback_reread(cd, hdr, &seqid, &hdr_size);
+		if (!jobj_cached) {
+			log_dbg(cd, "LUKS2 rollback metadata not available.");
+			return -EINVAL;
+		}
+	}
+
 	jobj_copy = (json_object **)&hdr->jobj;
 
 	if (!hdr_json_free(jobj_copy)) {
 		log_dbg(cd, "LUKS2 header still in use");
+		json_object_put(jobj_cached);
 		return -EINVAL;
 	}
 
-	return json_object_copy(hdr->jobj_rollback, jobj_copy) ? -ENOMEM : 0;
+	if (jobj_cached)
+		*jobj_copy = jobj_cached;
+	else if (json_object_copy(hdr->jobj_rollback, jobj_copy))
+		return -ENOMEM;
+
+	/* on-disk state was reread, binary header fields must match it */
+	if (hdr_size) {
+		hdr->seqid = hdr->rollback_seqid = seqid;
+		hdr->hdr_size = hdr_size;
+	}
+
+	LUKS2_hdr_index_build(hdr);
+	return 0;
 }
 
 int LUKS2_hdr_uuid(struct crypt_device *cd, struct luks2_hdr *hdr, const char *uuid)
@@ -1281,6 +1462,58 @@ void LUKS2_hdr_free(struct crypt_device *cd, struct luks2_hdr *hdr)
 
 	if (!hdr_json_free(jobj))
 		log_dbg(cd, "LUKS2 rollback metadata copy still in use");
+
+	LUKS2_disk_hdr_cache_free(hdr);
+}
+
+/*
+ * Drop rollback copy and cached on-disk state (memory lean context),
+ * rollback then reads the header from disk.
+ */
+void LUKS2_hdr_release_copies(struct luks2_hdr *hdr)
+{
+	json_object_put(hdr->jobj_rollback);
+	hdr->jobj_rollback = NULL;
+	LUKS2_disk_hdr_cache_free(hdr);
+}
+
+/*
+ * Initialize header of a cloned context from header of the source context
+ * (the same on-disk state). Parsed JSON is copied (json objects are mutable),
+ * cached on-disk state is shared and replaced on the next update.
+ */
+int LUKS2_hdr_clone(struct crypt_device *cd, struct luks2_hdr *dst, struct luks2_hdr *src)
+{
+	json_object *jobj = NULL;
+	int r;
+
+	assert(src->jobj);
+
+	if (src->write_deferred || src->seqid != src->rollback_seqid)
+		return -EBUSY;
+
+	if (json_object_copy(src->jobj, &jobj))
+		return -ENOMEM;
+
+	*dst = *src;
+	dst->jobj = jobj;
+	dst->jobj_rollback = NULL;
+	dst->disk_cache = NULL;
+	dst->disk_cache_device = NULL;
+	memset(&dst->index, 0, sizeof(dst->index));
+	memset(&dst->area_map, 0, sizeof(dst->area_map));
+
+	if (!crypt_memory_lean(cd))
+		LUKS2_disk_hdr_cache_share(dst, src, crypt_metadata_device(cd));
+
+	r = hdr_update_copy_for_rollback(cd, dst);
+	if (r) {
+		LUKS2_hdr_free(cd, dst);
+		return r;
+	}
+
+	LUKS2_hdr_index_build(dst);
+	return 0;
 }
 
 static uint64_t LUKS2_keyslots_size_jobj(json_object *jobj)
@@ -1322,13 +1555,18 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 	hdr_size = LUKS2_hdr_and_areas_size(hdr);
 	buffer_size = size_round_up(hdr_size, crypt_getpagesize());
 
-	buffer = malloc(buffer_size);
-	if (!buffer)
-		return -ENOMEM;
-
 	log_dbg(cd, "Storing backup of header (%zu bytes).", hdr_size);
 	log_dbg(cd, "Output backup file size: %zu bytes.", buffer_size);
 
+	fd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
+	if (fd == -1) {
+		if (errno == EEXIST)
+			log_err(cd, _("Requested header backup file %s already exists."), backup_file);
+		else
+			log_err(cd, _("Cannot create header backup file %s."), backup_file);
+		return -EINVAL;
+	}
+
 	r = device_read_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
@@ -1344,32 +1582,39 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 		goto out;
 	}
 
-	if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-			   device_alignment(device), buffer, hdr_size, 0) < hdr_size) {
-		device_read_unlock(cd, device);
-		r = -EIO;
-		goto out;
+	/* Copy inside kernel if possible, padding to page size is left sparse */
+	ret = copy_file_offset(devfd, fd, hdr_size, 0);
+	if (ret == -ENOTSUP) {
+		log_dbg(cd, "In-kernel copy not supported, using buffered backup.");
+		/* Aligned buffer avoids bounce buffer for direct-io */
+		if (posix_memalign((void *)&buffer, device_alignment(device), buffer_size)) {
+			device_read_unlock(cd, device);
+			r = -ENOMEM;
+			goto out;
+		}
+		memset(buffer, 0, buffer_size);
+		ret = read_lseek_blockwise(devfd, device_block_size(cd, device),
+				device_alignment(device), buffer, hdr_size, 0);
+		if (ret == hdr_size)
+			ret = write_buffer(fd, buffer, buffer_size);
+		else
+			ret = -EIO;
 	}
-
 	device_read_unlock(cd, device);
 
-	fd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
-	if (fd == -1) {
-		if (errno == EEXIST)
-			log_err(cd, _("Requested header backup file %s already exists."), backup_file);
-		else
-			log_err(cd, _("Cannot create header backup file %s."), backup_file);
-		r = -EINVAL;
-		goto out;
-	}
-	ret = write_buffer(fd, buffer, buffer_size);
-	close(fd);
-	if (ret < buffer_size) {
+	if (ret < 0) {
+		log_err(cd, _("Cannot write header backup file %s."), backup_file);
+		r = -EIO;
+	} else if (ftruncate(fd, buffer_size)) {
 		log_err(cd, _("Cannot write header backup file %s."), backup_file);
 		r = -EIO;
 	} else
 		r = 0;
 out:
+	close(fd);
+	/* Do not leave incomplete backup file */
+	if (r)
+		unlink(backup_file);
 	crypt_safe_memzero(buffer, buffer_size);
 	free(buffer);
 	return r;
@@ -1414,9 +1659,10 @@ int LUKS2_hdr_restore(struct crypt_device *cd, struct luks2_hdr *hdr,
 		goto out;
 	}
 
+	/* Aligned buffer is written to device in one request (no bounce buffer) */
 	buffer_size = LUKS2_hdr_and_areas_size(&hdr_file);
-	buffer = malloc(buffer_size);
-	if (!buffer) {
+	if (posix_memalign((void *)&buffer, device_alignment(device), buffer_size)) {
+		buffer = NULL;
 		r = -ENOMEM;
 		goto out;
 	}
@@ -1517,6 +1763,7 @@ out:
 	crypt_safe_memzero(&tmp_hdr, sizeof(tmp_hdr));
 	crypt_safe_memzero(buffer, buffer_size);
 	free(buffer);
+	/* One final sync, no-op if device write was already durable (direct-io with O_DSYNC) */
 	device_sync(cd, device);
 	return r;
 }
@@ -1534,6 +1781,7 @@ static const struct  {
 	{ CRYPT_ACTIVATE_NO_JOURNAL,             "no-journal" },
 	{ CRYPT_ACTIVATE_NO_READ_WORKQUEUE,      "no-read-workqueue" },
 	{ CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE,     "no-write-workqueue" },
+	{ CRYPT_ACTIVATE_HIGH_PRIORITY,          "high-priority" },
 	{ 0, NULL }
 };
 
@@ -1996,6 +2244,8 @@ static void hdr_dump_keyslots(struct crypt_device *cd, json_object *hdr_jobj)
 	char slot[16];
 	json_object *keyslots_jobj, *digests_jobj, *jobj2, *jobj3, *val;
 	const char *tmps;
+	uint64_t unlocks;
+	uint32_t time_ms;
 	int i, j, r;
 
 	log_std(cd, "Keyslots:\n");
@@ -2019,6 +2269,9 @@ static void hdr_dump_keyslots(struct crypt_device *cd, json_object *hdr_jobj)
 
 		log_std(cd, "\tPriority:   %s\n", get_priority_desc(val));
 
+		if (!LUKS2_keyslot_telemetry_get(crypt_get_hdr(cd, CRYPT_LUKS2), j, &time_ms, &unlocks))
+			log_std(cd, "\tUnlocks:    %" PRIu64 " (last %u ms)\n", unlocks, time_ms);
+
 		LUKS2_keyslot_dump(cd, j);
 
 		json_object_object_get_ex(hdr_jobj, "digests", &digests_jobj);
@@ -2506,6 +2759,8 @@ int LUKS2_assembly_multisegment_dmd(struct crypt_device *cd,
 		s++;
 	}
 
+	dm_targets_compact(cd, dmd);
+
 	return r;
 err:
 	dm_targets_free(cd, dmd);
@@ -2639,6 +2894,26 @@ int LUKS2_activate(struct crypt_device *cd,
 		dmd.segment.size = dmdi.segment.size;
 
 		r = create_or_reload_device_with_integrity(cd, name, CRYPT_LUKS2, &dmd, &dmdi);
+	} else if (dmd.flags & CRYPT_ACTIVATE_INLINE_CRYPT) {
+		/*
+		 * Inline encryption hardware is used only on request and if the device
+		 * can handle the cipher, any failure falls back to software dm-crypt.
+		 */
+		if (dmd.flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+			log_err(cd, _("Inline encryption cannot use volume key in kernel keyring."));
+			r = -EINVAL;
+		} else {
+			r = -ENOTSUP;
+			if (!(dmd.flags & CRYPT_ACTIVATE_REFRESH) && dm_crypt_inline_supported(cd, &dmd)) {
+				r = create_or_reload_device(cd, name, CRYPT_LUKS2, &dmd);
+				if (r < 0)
+					log_dbg(cd, "Inline encryption activation failed (%d), using dm-crypt.", r);
+			}
+			if (r < 0) {
+				dmd.flags &= ~CRYPT_ACTIVATE_INLINE_CRYPT;
+				r = create_or_reload_device(cd, name, CRYPT_LUKS2, &dmd);
+			}
+		}
 	} else
 		r = create_or_reload_device(cd, name, CRYPT_LUKS2, &dmd);
 
@@ -2850,6 +3125,7 @@ void json_object_object_del_by_uint(json_object *jobj, unsigned key)
 	if (snprintf(key_name, sizeof(key_name), "%u", key) < 1)
 		return;
 	json_object_object_del(jobj, key_name);
+	LUKS2_hdr_index_invalidate();
 }
 
 int json_object_object_add_by_uint(json_object *jobj, unsigned key, json_object *jobj_val)
@@ -2859,6 +3135,8 @@ int json_object_object_add_by_uint(json_object *jobj, unsigned key, json_object
 	if (snprintf(key_name, sizeof(key_name), "%u", key) < 1)
 		return -EINVAL;
 
+	LUKS2_hdr_index_invalidate();
+
 #if HAVE_DECL_JSON_OBJECT_OBJECT_ADD_EX
 	return json_object_object_add_ex(jobj, key_name, jobj_val, 0) ? -ENOMEM : 0;
 #else
@@ -19,7 +19,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
+#include <time.h>
+
 #include "luks2_internal.h"
+#include "utils_threadpool.h"
 
 /* Internal implementations */
 extern const keyslot_handler luks2_keyslot;
@@ -325,6 +329,22 @@ int LUKS2_keyslot_area(struct luks2_hdr *hdr,
 	return LUKS2_keyslot_jobj_area(jobj_keyslot, offset, length);
 }
 
+/* Duration of the last successful keyslot open in the current thread */
+static __thread uint32_t _open_time_ms;
+
+/* Keyslot opened by LUKS2_keyslot_open() in the current thread (not from cache) */
+static __thread int _open_keyslot = -1;
+
+static uint64_t keyslot_time_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static int _open_and_verify(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	const keyslot_handler *h,
@@ -334,6 +354,7 @@ static int _open_and_verify(struct crypt_device *cd,
 	struct volume_key **vk)
 {
 	int r, key_size = LUKS2_get_keyslot_stored_key_size(hdr, keyslot);
+	uint64_t start, time_ms;
 
 	if (key_size < 0)
 		return -EINVAL;
@@ -342,6 +363,7 @@ static int _open_and_verify(struct crypt_device *cd,
 	if (!*vk)
 		return -ENOMEM;
 
+	start = keyslot_time_ms();
 	r = h->open(cd, keyslot, password, password_len, (*vk)->key, (*vk)->keylength);
 	if (r < 0)
 		log_dbg(cd, "Keyslot %d (%s) open failed with %d.", keyslot, h->name, r);
@@ -351,6 +373,9 @@ static int _open_and_verify(struct crypt_device *cd,
 	if (r < 0) {
 		crypt_free_volume_key(*vk);
 		*vk = NULL;
+	} else {
+		time_ms = keyslot_time_ms() - start;
+		_open_time_ms = time_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)time_ms;
 	}
 
 	crypt_volume_key_set_id(*vk, r);
@@ -418,57 +443,248 @@ static int LUKS2_open_and_verify(struct crypt_device *cd,
 	return _open_and_verify(cd, hdr, h, keyslot, password, password_len, vk);
 }
 
-static int LUKS2_keyslot_open_priority_digest(struct crypt_device *cd,
+/*
+ * Keyslot areas of all keyslots in one priority class are read with one
+ * I/O (areas are allocated close to each other in keyslots area) before
+ * any key derivation runs, keyslot content is then decrypted from memory.
+ * This avoids device latency (e.g. detached header on network storage)
+ * after every tried keyslot.
+ */
+struct luks2_keyslot_prefetch {
+	uint64_t offset;
+	uint64_t length;
+	char *buf;
+};
+
+/* prefetched areas for the current thread, NULL if there are none */
+static __thread struct luks2_keyslot_prefetch *_prefetch;
+
+int LUKS2_keyslot_prefetched(uint64_t offset, char *dst, size_t length)
+{
+	struct luks2_keyslot_prefetch *pf = _prefetch;
+
+	if (!pf || offset < pf->offset ||
+	    offset + length > pf->offset + pf->length)
+		return -ENOENT;
+
+	memcpy(dst, pf->buf + (offset - pf->offset), length);
+	return 0;
+}
+
+static void LUKS2_keyslot_prefetch_read(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	crypt_keyslot_priority priority,
-	const char *password,
-	size_t password_len,
-	int digest,
-	struct volume_key **vk)
+	struct luks2_keyslot_prefetch *pf)
 {
+	struct device *device = crypt_metadata_device(cd);
 	json_object *jobj_keyslots, *jobj;
 	crypt_keyslot_priority slot_priority;
-	int keyslot, r = -ENOENT;
+	uint64_t offset, length, start = UINT64_MAX, end = 0;
+	unsigned int count = 0;
+	int devfd, r;
 
 	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
 
 	json_object_object_foreach(jobj_keyslots, slot, val) {
+		UNUSED(slot);
 		if (!json_object_object_get_ex(val, "priority", &jobj))
 			slot_priority = CRYPT_SLOT_PRIORITY_NORMAL;
 		else
 			slot_priority = json_object_get_int(jobj);
 
-		keyslot = atoi(slot);
-		if (slot_priority != priority) {
-			log_dbg(cd, "Keyslot %d priority %d != %d (required), skipped.",
-				keyslot, slot_priority, priority);
+		if (slot_priority != priority ||
+		    !json_object_object_get_ex(val, "type", &jobj) ||
+		    strcmp(json_object_get_string(jobj), "luks2") ||
+		    LUKS2_keyslot_jobj_area(val, &offset, &length))
 			continue;
-		}
 
-		r = LUKS2_open_and_verify_by_digest(cd, hdr, keyslot, digest, password, password_len, vk);
+		if (offset < start)
+			start = offset;
+		if (offset + length > end)
+			end = offset + length;
+		count++;
+	}
 
-		/* Do not retry for errors that are no -EPERM or -ENOENT,
-		   former meaning password wrong, latter key slot unusable for segment */
-		if ((r != -EPERM) && (r != -ENOENT))
-			break;
+	/* Nothing to save with only one keyslot area */
+	if (count < 2 || end - start > LUKS2_MAX_KEYSLOTS_SIZE)
+		return;
+
+	pf->buf = malloc(end - start);
+	if (!pf->buf)
+		return;
+
+	r = device_read_lock(cd, device);
+	if (r) {
+		free(pf->buf);
+		pf->buf = NULL;
+		return;
 	}
 
-	return r;
+	devfd = device_open_locked(cd, device, O_RDONLY);
+	if (devfd < 0 || read_lseek_blockwise(devfd, device_block_size(cd, device),
+			device_alignment(device), pf->buf, end - start, start) < 0)
+		r = -EIO;
+
+	device_read_unlock(cd, device);
+
+	if (r) {
+		log_dbg(cd, "Keyslot areas prefetch failed, reading keyslots separately.");
+		free(pf->buf);
+		pf->buf = NULL;
+		return;
+	}
+
+	log_dbg(cd, "Prefetched %u keyslot areas [0x%04" PRIx64 "-0x%04" PRIx64 "].",
+		count, start, end);
+	pf->offset = start;
+	pf->length = end - start;
+	_prefetch = pf;
 }
 
-static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
+static void LUKS2_keyslot_prefetch_free(struct luks2_keyslot_prefetch *pf)
+{
+	if (_prefetch == pf)
+		_prefetch = NULL;
+	free(pf->buf);
+	pf->buf = NULL;
+}
+
+/*
+ * Parallel keyslot trial for one priority class.
+ *
+ * Every keyslot is tried in a separate job with the trial lock held,
+ * so keyslot validation, metadata access and keyslot area I/O stay
+ * serialized. Only the key derivation runs unlocked (between
+ * LUKS2_keyslot_kdf_begin/end), concurrently running memory-hard KDF
+ * is limited by shared memory budget. The first keyslot that verifies
+ * wins, other keyslots are then skipped and running KDF is aborted.
+ */
+struct luks2_keyslot_trial {
+	struct crypt_device *cd;
+	struct luks2_hdr *hdr;
+	const char *password;
+	size_t password_len;
+	int segment;
+	int digest;
+	struct luks2_keyslot_prefetch *pf;
+
+	pthread_mutex_t lock;
+	pthread_cond_t memory_cond;
+	uint64_t memory_budget_kb;
+	uint64_t memory_used_kb;
+
+	int keyslots[LUKS2_KEYSLOTS_MAX];
+	int r[LUKS2_KEYSLOTS_MAX];
+	struct volume_key *vk;
+	int keyslot;
+	uint32_t time_ms;
+};
+
+/* trial of the current thread, NULL if not running in parallel trial */
+static __thread struct luks2_keyslot_trial *_trial;
+
+/* PBKDF abort hook, other keyslot already unlocked the volume key */
+static int LUKS2_keyslot_kdf_abort(void *usrptr)
+{
+	struct luks2_keyslot_trial *t = usrptr;
+	bool unlocked;
+
+	pthread_mutex_lock(&t->lock);
+	unlocked = t->keyslot >= 0;
+	pthread_mutex_unlock(&t->lock);
+
+	return unlocked;
+}
+
+int LUKS2_keyslot_kdf_begin(uint32_t memory_kb)
+{
+	struct luks2_keyslot_trial *t = _trial;
+
+	if (!t)
+		return 0;
+
+	while (t->keyslot < 0 && t->memory_used_kb &&
+	       t->memory_used_kb + memory_kb > t->memory_budget_kb)
+		pthread_cond_wait(&t->memory_cond, &t->lock);
+
+	/* other keyslot already unlocked the volume key */
+	if (t->keyslot >= 0)
+		return -ECANCELED;
+
+	t->memory_used_kb += memory_kb;
+	pthread_mutex_unlock(&t->lock);
+
+	crypt_pbkdf_set_abort(LUKS2_keyslot_kdf_abort, t);
+
+	return 0;
+}
+
+void LUKS2_keyslot_kdf_end(uint32_t memory_kb)
+{
+	struct luks2_keyslot_trial *t = _trial;
+
+	if (!t)
+		return;
+
+	crypt_pbkdf_set_abort(NULL, NULL);
+	pthread_mutex_lock(&t->lock);
+	t->memory_used_kb -= memory_kb;
+	pthread_cond_broadcast(&t->memory_cond);
+}
+
+static int LUKS2_keyslot_trial_job(void *arg, unsigned int job)
+{
+	struct luks2_keyslot_trial *t = arg;
+	struct luks2_keyslot_prefetch *pf = _prefetch;
+	struct volume_key *vk = NULL;
+	int r;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->keyslot >= 0) {
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+
+	_trial = t;
+	_prefetch = t->pf;
+	if (t->digest >= 0)
+		r = LUKS2_open_and_verify_by_digest(t->cd, t->hdr, t->keyslots[job], t->digest,
+						    t->password, t->password_len, &vk);
+	else
+		r = LUKS2_open_and_verify(t->cd, t->hdr, t->keyslots[job], t->segment,
+					  t->password, t->password_len, &vk);
+	_prefetch = pf;
+	_trial = NULL;
+
+	if (r >= 0 && t->keyslot < 0) {
+		t->keyslot = r;
+		t->vk = vk;
+		t->time_ms = _open_time_ms;
+		pthread_cond_broadcast(&t->memory_cond);
+	} else
+		crypt_free_volume_key(vk);
+	t->r[job] = r;
+	pthread_mutex_unlock(&t->lock);
+
+	return 0;
+}
+
+/*
+ * Keyslots of one priority class in trial order. With keyslot telemetry
+ * enabled, keyslots with more successful unlocks are tried first.
+ */
+static int LUKS2_keyslots_by_priority(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	crypt_keyslot_priority priority,
-	const char *password,
-	size_t password_len,
-	int segment,
-	struct volume_key **vk)
+	int *keyslots)
 {
 	json_object *jobj_keyslots, *jobj;
 	crypt_keyslot_priority slot_priority;
-	int keyslot, r = -ENOENT;
+	uint64_t unlocks[LUKS2_KEYSLOTS_MAX], u;
+	int i, keyslot, hint, count = 0;
 
 	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
+	hint = crypt_keyslot_hint(cd);
 
 	json_object_object_foreach(jobj_keyslots, slot, val) {
 		if (!json_object_object_get_ex(val, "priority", &jobj))
@@ -483,7 +699,163 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 			continue;
 		}
 
-		r = LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
+		if (count >= LUKS2_KEYSLOTS_MAX)
+			break;
+
+		/* hinted keyslot goes first regardless of telemetry */
+		if (keyslot == hint)
+			u = UINT64_MAX;
+		else if (LUKS2_keyslot_telemetry_get(hdr, keyslot, NULL, &u))
+			u = 0;
+
+		/* stable insertion, the original order is kept without telemetry */
+		for (i = count; i > 0 && unlocks[i - 1] < u; i--) {
+			keyslots[i] = keyslots[i - 1];
+			unlocks[i] = unlocks[i - 1];
+		}
+		keyslots[i] = keyslot;
+		unlocks[i] = u;
+		count++;
+	}
+
+	return count;
+}
+
+/* serialized memory-hard KDF (OOM workaround) cannot run in parallel */
+static bool parallel_trial(struct crypt_device *cd)
+{
+	return crypt_parallel_unlock_enabled() && !crypt_serialize_lock_enabled(cd);
+}
+
+static int LUKS2_keyslot_open_priority_parallel(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	crypt_keyslot_priority priority,
+	const char *password,
+	size_t password_len,
+	int segment,
+	int digest,
+	struct volume_key **vk)
+{
+	struct crypt_threadpool *tp = NULL;
+	struct luks2_keyslot_trial t = {
+		.cd = cd,
+		.hdr = hdr,
+		.password = password,
+		.password_len = password_len,
+		.segment = segment,
+		.digest = digest,
+		.pf = _prefetch,
+		.keyslot = -1,
+	};
+	unsigned int i, count, threads;
+	int r = -ENOENT;
+
+	count = LUKS2_keyslots_by_priority(cd, hdr, priority, t.keyslots);
+	if (!count)
+		return -ENOENT;
+
+	for (i = 0; i < count; i++)
+		t.r[i] = -ENOENT;
+
+	/* Half of physical memory for concurrently running memory-hard KDF */
+	t.memory_budget_kb = crypt_getphysmemory_kb() / 2;
+
+	threads = crypt_get_threads(cd);
+	if (threads > count)
+		threads = count;
+
+	if (pthread_mutex_init(&t.lock, NULL))
+		return -ENOMEM;
+	if (pthread_cond_init(&t.memory_cond, NULL)) {
+		pthread_mutex_destroy(&t.lock);
+		return -ENOMEM;
+	}
+
+	log_dbg(cd, "Trying %u keyslots with priority %d in parallel.", count, priority);
+
+	r = crypt_threadpool_init(cd, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, count, LUKS2_keyslot_trial_job, &t);
+	crypt_threadpool_destroy(tp);
+	pthread_cond_destroy(&t.memory_cond);
+	pthread_mutex_destroy(&t.lock);
+	if (r < 0)
+		return r;
+
+	if (t.keyslot >= 0) {
+		*vk = t.vk;
+		_open_time_ms = t.time_ms;
+		return t.keyslot;
+	}
+
+	/* The same error semantics as in serial trial, in keyslot order */
+	for (i = 0, r = -ENOENT; i < count; i++) {
+		r = t.r[i];
+		if ((r != -EPERM) && (r != -ENOENT))
+			break;
+	}
+
+	return r;
+}
+
+static int LUKS2_keyslot_open_priority_digest(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	crypt_keyslot_priority priority,
+	const char *password,
+	size_t password_len,
+	int digest,
+	struct volume_key **vk)
+{
+	struct luks2_keyslot_prefetch pf = {};
+	int keyslots[LUKS2_KEYSLOTS_MAX];
+	int i, count, r = -ENOENT;
+
+	LUKS2_keyslot_prefetch_read(cd, hdr, priority, &pf);
+
+	if (parallel_trial(cd)) {
+		r = LUKS2_keyslot_open_priority_parallel(cd, hdr, priority,
+			password, password_len, -1, digest, vk);
+		goto out;
+	}
+
+	count = LUKS2_keyslots_by_priority(cd, hdr, priority, keyslots);
+	for (i = 0; i < count; i++) {
+		r = LUKS2_open_and_verify_by_digest(cd, hdr, keyslots[i], digest, password, password_len, vk);
+
+		/* Do not retry for errors that are no -EPERM or -ENOENT,
+		   former meaning password wrong, latter key slot unusable for segment */
+		if ((r != -EPERM) && (r != -ENOENT))
+			break;
+	}
+
+out:
+	LUKS2_keyslot_prefetch_free(&pf);
+	return r;
+}
+
+static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	crypt_keyslot_priority priority,
+	const char *password,
+	size_t password_len,
+	int segment,
+	struct volume_key **vk)
+{
+	struct luks2_keyslot_prefetch pf = {};
+	int keyslots[LUKS2_KEYSLOTS_MAX];
+	int i, count, r = -ENOENT;
+
+	LUKS2_keyslot_prefetch_read(cd, hdr, priority, &pf);
+
+	if (parallel_trial(cd)) {
+		r = LUKS2_keyslot_open_priority_parallel(cd, hdr, priority,
+			password, password_len, segment, -1, vk);
+		goto out;
+	}
+
+	count = LUKS2_keyslots_by_priority(cd, hdr, priority, keyslots);
+	for (i = 0; i < count; i++) {
+		r = LUKS2_open_and_verify(cd, hdr, keyslots[i], segment, password, password_len, vk);
 
 		/* Do not retry for errors that are no -EPERM or -ENOENT,
 		   former meaning password wrong, latter key slot unusable for segment */
@@ -491,6 +863,8 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 			break;
 	}
 
+out:
+	LUKS2_keyslot_prefetch_free(&pf);
 	return r;
 }
 
@@ -575,9 +949,29 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 	struct volume_key **vk)
 {
 	struct luks2_hdr *hdr;
-	int r_prio, r = -EINVAL;
+	int digest = CRYPT_ANY_DIGEST, r_prio, r_digest, r = -EINVAL;
 
 	hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
+	_open_keyslot = -1;
+
+	if (crypt_vk_cache_enabled()) {
+		if (segment != CRYPT_ANY_SEGMENT)
+			digest = LUKS2_digest_by_segment(hdr, segment);
+		r = crypt_vk_cache_get(cd, hdr->uuid, hdr->seqid, digest, keyslot,
+				       password, password_len, vk);
+		/* never trust cached key without digest check against current header */
+		if (r >= 0) {
+			r_digest = LUKS2_digest_verify(cd, hdr, *vk, r);
+			if (r_digest < 0) {
+				log_dbg(cd, "Cached volume key for keyslot %d does not match digest.", r);
+				crypt_free_volume_key(*vk);
+				*vk = NULL;
+			} else
+				crypt_volume_key_set_id(*vk, r_digest);
+		}
+		if ((r >= 0 && *vk) || r == -ENOMEM)
+			return r;
+	}
 
 	if (keyslot == CRYPT_ANY_SLOT) {
 		r_prio = LUKS2_keyslot_open_priority(cd, hdr, CRYPT_SLOT_PRIORITY_PREFER,
@@ -595,12 +989,20 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 	} else
 		r = LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
 
+	if (r >= 0)
+		_open_keyslot = r;
+
+	if (r >= 0 && keyslot == CRYPT_ANY_SLOT)
+		crypt_keyslot_hint_update(cd, r);
+
 	if (r < 0) {
 		if (r == -ENOMEM)
 			log_err(cd, _("Not enough available memory to open a keyslot."));
 		else if (r != -EPERM && r != -ENOENT)
 			log_err(cd, _("Keyslot open failed."));
-	}
+	} else if (crypt_vk_cache_enabled())
+		crypt_vk_cache_put(cd, hdr->uuid, hdr->seqid, digest, r,
+				   password, password_len, *vk);
 
 	return r;
 }
@@ -627,11 +1029,10 @@ int LUKS2_keyslot_reencrypt_store(struct crypt_device *cd,
 			buffer, buffer_length);
 }
 
-int LUKS2_keyslot_store(struct crypt_device *cd,
+/* Allocates or updates keyslot json, keyslot area is not written */
+int LUKS2_keyslot_store_prepare(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
-	const char *password,
-	size_t password_len,
 	const struct volume_key *vk,
 	const struct luks2_keyslot_params *params)
 {
@@ -670,68 +1071,276 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 	if (LUKS2_hdr_validate(cd, hdr->jobj, hdr->hdr_size - LUKS2_HDR_BIN_LEN))
 		return -EINVAL;
 
+	return 0;
+}
+
+int LUKS2_keyslot_store(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	const char *password,
+	size_t password_len,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params)
+{
+	const keyslot_handler *h;
+	int r;
+
+	r = LUKS2_keyslot_store_prepare(cd, hdr, keyslot, vk, params);
+	if (r < 0)
+		return r;
+
+	if (!(h = LUKS2_keyslot_handler(cd, keyslot)))
+		return -EINVAL;
+
 	return h->store(cd, keyslot, password, password_len,
 			vk->key, vk->keylength);
 }
 
-int LUKS2_keyslot_wipe(struct crypt_device *cd,
+/*
+ * Batch store of prepared keyslots. Keyslot keys (memory-hard PBKDF) are
+ * derived in parallel within total memory limit, keyslot areas are then
+ * written serially by keyslot handler that takes derived keys from batch.
+ */
+struct luks2_keyslot_batch {
+	struct crypt_device *cd;
+
+	pthread_mutex_t lock;
+	pthread_cond_t memory_cond;
+	uint64_t memory_budget_kb;
+	uint64_t memory_used_kb;
+
+	unsigned int count;
+	json_object *jobj[LUKS2_KEYSLOTS_MAX];
+	const char *password[LUKS2_KEYSLOTS_MAX];
+	size_t password_len[LUKS2_KEYSLOTS_MAX];
+	struct volume_key *derived[LUKS2_KEYSLOTS_MAX];
+};
+
+/* batch of the current thread, NULL if not storing keyslots in batch */
+static __thread struct luks2_keyslot_batch *_batch;
+
+struct volume_key *LUKS2_keyslot_batch_key(json_object *jobj_keyslot)
+{
+	struct luks2_keyslot_batch *b = _batch;
+	struct volume_key *vk;
+	unsigned int i;
+
+	if (!b)
+		return NULL;
+
+	for (i = 0; i < b->count; i++)
+		if (b->jobj[i] == jobj_keyslot && b->derived[i]) {
+			vk = b->derived[i];
+			b->derived[i] = NULL;
+			return vk;
+		}
+
+	return NULL;
+}
+
+static int LUKS2_keyslot_batch_job(void *arg, unsigned int job)
+{
+	struct luks2_keyslot_batch *b = arg;
+	struct volume_key *derived = NULL;
+	uint32_t memory_kb = LUKS2_keyslot_luks2_kdf_memory(b->jobj[job]);
+	int r;
+
+	/* at least one PBKDF always runs, even if over the budget */
+	pthread_mutex_lock(&b->lock);
+	while (b->memory_used_kb && b->memory_used_kb + memory_kb > b->memory_budget_kb)
+		pthread_cond_wait(&b->memory_cond, &b->lock);
+	b->memory_used_kb += memory_kb;
+	pthread_mutex_unlock(&b->lock);
+
+	r = LUKS2_keyslot_luks2_derive_key(b->cd, b->jobj[job], b->password[job],
+					   b->password_len[job], &derived);
+
+	pthread_mutex_lock(&b->lock);
+	b->memory_used_kb -= memory_kb;
+	b->derived[job] = derived;
+	pthread_cond_broadcast(&b->memory_cond);
+	pthread_mutex_unlock(&b->lock);
+
+	return r;
+}
+
+static int LUKS2_keyslots_derive(struct luks2_keyslot_batch *b)
+{
+	struct crypt_threadpool *tp = NULL;
+	unsigned int threads;
+	int r;
+
+	threads = crypt_get_threads(b->cd);
+	if (threads > b->count)
+		threads = b->count;
+	if (threads < 2)
+		return 0;
+
+	b->memory_budget_kb = crypt_get_pbkdf_memory_limit(b->cd);
+
+	if (pthread_mutex_init(&b->lock, NULL))
+		return -ENOMEM;
+	if (pthread_cond_init(&b->memory_cond, NULL)) {
+		pthread_mutex_destroy(&b->lock);
+		return -ENOMEM;
+	}
+
+	log_dbg(b->cd, "Deriving %u keyslot keys in parallel, memory limit %" PRIu64 " kB.",
+		b->count, b->memory_budget_kb);
+
+	r = crypt_threadpool_init(b->cd, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, b->count, LUKS2_keyslot_batch_job, b);
+	crypt_threadpool_destroy(tp);
+	pthread_cond_destroy(&b->memory_cond);
+	pthread_mutex_destroy(&b->lock);
+
+	return r;
+}
+
+int LUKS2_keyslots_store(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
-	int keyslot,
+	const int *keyslots,
+	const char * const *passwords,
+	const size_t *password_lens,
+	unsigned int count,
+	const struct volume_key *vk)
+{
+	const keyslot_handler *h;
+	struct luks2_keyslot_batch *b;
+	unsigned int i;
+	int r = 0;
+
+	if (!count || count > LUKS2_KEYSLOTS_MAX)
+		return -EINVAL;
+
+	b = crypt_zalloc(sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+
+	b->cd = cd;
+	b->count = count;
+	for (i = 0; i < count; i++) {
+		if (!(h = LUKS2_keyslot_handler(cd, keyslots[i])) || strcmp(h->name, "luks2") ||
+		    !(b->jobj[i] = LUKS2_get_keyslot_jobj(hdr, keyslots[i]))) {
+			r = -EINVAL;
+			goto out;
+		}
+		b->password[i] = passwords[i];
+		b->password_len[i] = password_lens[i];
+	}
+
+	r = LUKS2_keyslots_derive(b);
+	if (r < 0)
+		goto out;
+
+	_batch = b;
+	for (i = 0; i < count && r >= 0; i++) {
+		h = LUKS2_keyslot_handler(cd, keyslots[i]);
+		r = h->store(cd, keyslots[i], passwords[i], password_lens[i],
+			     vk->key, vk->keylength);
+	}
+	_batch = NULL;
+out:
+	for (i = 0; i < count; i++)
+		crypt_free_volume_key(b->derived[i]);
+	free(b);
+
+	return r < 0 ? r : 0;
+}
+
+/*
+ * Keyslot telemetry (optional, not security relevant) in config section:
+ *
+ * "telemetry": {
+ *   "0": { "time_ms": 850, "unlocks": "12" }
+ * }
+ *
+ * Keyslot entry is updated after every successful keyslot open.
+ */
+static json_object *LUKS2_telemetry_jobj(struct luks2_hdr *hdr)
+{
+	json_object *jobj_config, *jobj_telemetry;
+
+	if (!json_object_object_get_ex(hdr->jobj, "config", &jobj_config) ||
+	    !json_object_object_get_ex(jobj_config, "telemetry", &jobj_telemetry))
+		return NULL;
+
+	return jobj_telemetry;
+}
+
+static int keyslots_wipe(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	int count,
 	int wipe_area_only)
 {
 	struct device *device = crypt_metadata_device(cd);
+	struct crypt_wipe_range ranges[LUKS2_KEYSLOTS_MAX];
+	unsigned int ranges_count = 0;
 	uint64_t area_offset, area_length;
-	int r;
-	json_object *jobj_keyslot, *jobj_keyslots;
+	int i, r;
+	json_object *jobj_keyslots, *jobj_telemetry;
 	const keyslot_handler *h;
 
-	h = LUKS2_keyslot_handler(cd, keyslot);
+	if (count < 0 || count > LUKS2_KEYSLOTS_MAX)
+		return -EINVAL;
 
 	if (!json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots))
 		return -EINVAL;
 
-	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
-	if (!jobj_keyslot)
-		return -ENOENT;
-
-	if (wipe_area_only)
-		log_dbg(cd, "Wiping keyslot %d area only.", keyslot);
+	for (i = 0; i < count; i++) {
+		if (!LUKS2_get_keyslot_jobj(hdr, keyslots[i]))
+			return -ENOENT;
+		if (wipe_area_only)
+			log_dbg(cd, "Wiping keyslot %d area only.", keyslots[i]);
+	}
 
 	r = LUKS2_device_write_lock(cd, hdr, device);
 	if (r)
 		return r;
 
-	/* secure deletion of possible key material in keyslot area */
-	r = crypt_keyslot_area(cd, keyslot, &area_offset, &area_length);
-	if (r && r != -ENOENT)
-		goto out;
-
-	if (!r) {
-		r = crypt_wipe_device(cd, device, CRYPT_WIPE_SPECIAL, area_offset,
-			      area_length, area_length, NULL, NULL);
-		if (r) {
-			if (r == -EACCES) {
-				log_err(cd, _("Cannot write to device %s, permission denied."),
-					device_path(device));
-				r = -EINVAL;
-			} else
-				log_err(cd, _("Cannot wipe device %s."), device_path(device));
+	/* secure deletion of possible key material in keyslot areas, synced once */
+	for (i = 0; i < count; i++) {
+		r = crypt_keyslot_area(cd, keyslots[i], &area_offset, &area_length);
+		if (r == -ENOENT)
+			continue;
+		if (r)
 			goto out;
-		}
+
+		ranges[ranges_count].offset = area_offset;
+		ranges[ranges_count++].length = area_length;
+	}
+
+	r = crypt_wipe_device_ranges(cd, device, CRYPT_WIPE_SPECIAL, ranges, ranges_count);
+	if (r) {
+		if (r == -EACCES) {
+			log_err(cd, _("Cannot write to device %s, permission denied."),
+				device_path(device));
+			r = -EINVAL;
+		} else
+			log_err(cd, _("Cannot wipe device %s."), device_path(device));
+		goto out;
 	}
 
 	if (wipe_area_only)
 		goto out;
 
 	/* Slot specific wipe */
-	if (h) {
-		r = h->wipe(cd, keyslot);
-		if (r < 0)
-			goto out;
-	} else
-		log_dbg(cd, "Wiping keyslot %d without specific-slot handler loaded.", keyslot);
-
-	json_object_object_del_by_uint(jobj_keyslots, keyslot);
+	for (i = 0; i < count; i++) {
+		h = LUKS2_keyslot_handler(cd, keyslots[i]);
+		if (h) {
+			r = h->wipe(cd, keyslots[i]);
+			if (r < 0)
+				goto out;
+		} else
+			log_dbg(cd, "Wiping keyslot %d without specific-slot handler loaded.", keyslots[i]);
+
+		LUKS2_area_map_remove(hdr, keyslots[i]);
+		json_object_object_del_by_uint(jobj_keyslots, keyslots[i]);
+		if ((jobj_telemetry = LUKS2_telemetry_jobj(hdr)))
+			json_object_object_del_by_uint(jobj_telemetry, keyslots[i]);
+	}
 
 	r = LUKS2_hdr_write(cd, hdr);
 out:
@@ -739,6 +1348,22 @@ out:
 	return r;
 }
 
+int LUKS2_keyslot_wipe(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int wipe_area_only)
+{
+	return keyslots_wipe(cd, hdr, &keyslot, 1, wipe_area_only);
+}
+
+int LUKS2_keyslots_wipe(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	int count)
+{
+	return keyslots_wipe(cd, hdr, keyslots, count, 0);
+}
+
 int LUKS2_keyslot_dump(struct crypt_device *cd, int keyslot)
 {
 	const keyslot_handler *h;
@@ -780,6 +1405,105 @@ int LUKS2_keyslot_priority_set(struct crypt_device *cd, struct luks2_hdr *hdr,
 	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
 }
 
+bool LUKS2_keyslot_telemetry_enabled(struct luks2_hdr *hdr)
+{
+	return LUKS2_telemetry_jobj(hdr) != NULL;
+}
+
+int LUKS2_keyslot_telemetry_enable(struct crypt_device *cd, struct luks2_hdr *hdr, bool enable)
+{
+	json_object *jobj_config, *jobj_telemetry;
+
+	if (!json_object_object_get_ex(hdr->jobj, "config", &jobj_config))
+		return -EINVAL;
+
+	if (enable == LUKS2_keyslot_telemetry_enabled(hdr))
+		return 0;
+
+	if (enable) {
+		jobj_telemetry = json_object_new_object();
+		if (!jobj_telemetry)
+			return -ENOMEM;
+		json_object_object_add(jobj_config, "telemetry", jobj_telemetry);
+	} else
+		json_object_object_del(jobj_config, "telemetry");
+
+	return LUKS2_hdr_write(cd, hdr);
+}
+
+int LUKS2_keyslot_telemetry_get(struct luks2_hdr *hdr, int keyslot,
+				uint32_t *time_ms, uint64_t *unlocks)
+{
+	json_object *jobj_telemetry, *jobj_keyslot, *jobj;
+	char num[16];
+
+	jobj_telemetry = LUKS2_telemetry_jobj(hdr);
+	if (!jobj_telemetry || snprintf(num, sizeof(num), "%d", keyslot) < 0 ||
+	    !json_object_object_get_ex(jobj_telemetry, num, &jobj_keyslot))
+		return -ENOENT;
+
+	if (time_ms)
+		*time_ms = json_object_object_get_ex(jobj_keyslot, "time_ms", &jobj) ?
+			   crypt_jobj_get_uint32(jobj) : 0;
+	if (unlocks)
+		*unlocks = json_object_object_get_ex(jobj_keyslot, "unlocks", &jobj) ?
+			   crypt_jobj_get_uint64(jobj) : 0;
+
+	return 0;
+}
+
+/*
+ * Called after successful activation, keyslot must be opened by the last
+ * LUKS2_keyslot_open() in this thread. Failed metadata write must not fail
+ * the activation and only the telemetry update is reverted in memory.
+ */
+int LUKS2_keyslot_telemetry_record(struct crypt_device *cd, struct luks2_hdr *hdr,
+				   int keyslot)
+{
+	json_object *jobj_telemetry, *jobj_keyslot, *jobj_old = NULL;
+	uint64_t unlocks = 0;
+	char num[16];
+	int r;
+
+	if (keyslot < 0 || keyslot != _open_keyslot)
+		return 0;
+	_open_keyslot = -1;
+
+	jobj_telemetry = LUKS2_telemetry_jobj(hdr);
+	if (!jobj_telemetry)
+		return 0;
+
+	if (snprintf(num, sizeof(num), "%d", keyslot) < 0)
+		return -EINVAL;
+
+	(void)LUKS2_keyslot_telemetry_get(hdr, keyslot, NULL, &unlocks);
+
+	jobj_keyslot = json_object_new_object();
+	if (!jobj_keyslot)
+		return -ENOMEM;
+	json_object_object_add(jobj_keyslot, "time_ms", json_object_new_int64(_open_time_ms));
+	json_object_object_add(jobj_keyslot, "unlocks", crypt_jobj_new_uint64(unlocks + 1));
+
+	if (json_object_object_get_ex(jobj_telemetry, num, &jobj_old))
+		json_object_get(jobj_old);
+	json_object_object_add(jobj_telemetry, num, jobj_keyslot);
+
+	log_dbg(cd, "Keyslot %d opened in %u ms, %" PRIu64 " successful unlocks.",
+		keyslot, _open_time_ms, unlocks + 1);
+
+	r = LUKS2_hdr_write(cd, hdr);
+	if (r) {
+		log_dbg(cd, "Cannot store keyslot %d telemetry.", keyslot);
+		if (jobj_old)
+			json_object_object_add(jobj_telemetry, num, jobj_old);
+		else
+			json_object_object_del(jobj_telemetry, num);
+	} else
+		json_object_put(jobj_old);
+
+	return r;
+}
+
 int placeholder_keyslot_alloc(struct crypt_device *cd,
 	int keyslot,
 	uint64_t area_offset,
@@ -825,6 +1549,7 @@ int placeholder_keyslot_alloc(struct crypt_device *cd,
 	json_object_object_add(jobj_area, "size", crypt_jobj_new_uint64(area_length));
 	json_object_object_add(jobj_keyslot, "area", jobj_area);
 
+	LUKS2_area_map_add(hdr, area_offset, area_length);
 	if (json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot)) {
 		json_object_put(jobj_keyslot);
 		return -EINVAL;
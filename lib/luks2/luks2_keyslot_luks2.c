@@ -65,14 +65,12 @@ static int luks2_encrypt_to_storage(char *src, size_t srcLength,
 
 	devfd = device_open_locked(cd, device, O_RDWR);
 	if (devfd >= 0) {
-		if (write_lseek_blockwise(devfd, device_block_size(cd, device),
-					  device_alignment(device), src,
-					  srcLength, sector * SECTOR_SIZE) < 0)
+		if (write_lseek_blockwise_dsync(devfd, device_block_size(cd, device),
+						device_alignment(device), src,
+						srcLength, sector * SECTOR_SIZE) < 0)
 			r = -EIO;
 		else
 			r = 0;
-
-		device_sync(cd, device);
 	} else
 		r = -EIO;
 
@@ -111,6 +109,13 @@ static int luks2_decrypt_from_storage(char *dst, size_t dstLength,
 		return r;
 	}
 
+	/* Keyslot area already read with all other candidate keyslots */
+	if (!LUKS2_keyslot_prefetched((uint64_t)sector * SECTOR_SIZE, dst, dstLength)) {
+		r = crypt_storage_decrypt(s, 0, dstLength, dst);
+		crypt_storage_destroy(s);
+		return r;
+	}
+
 	r = device_read_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
@@ -198,19 +203,111 @@ static int luks2_keyslot_get_pbkdf_params(json_object *jobj_keyslot,
 	return 0;
 }
 
+static void luks2_keyslot_kdf_memory_flags(struct crypt_device *cd)
+{
+	uint32_t flags = crypt_get_pbkdf(cd)->flags, argon2_flags = 0;
+
+	if (flags & CRYPT_PBKDF_LOCK_MEMORY)
+		argon2_flags |= CRYPT_ARGON2_MEMORY_LOCK;
+	if (flags & CRYPT_PBKDF_CPU_AFFINITY)
+		argon2_flags |= CRYPT_ARGON2_CPU_AFFINITY;
+
+	crypt_argon2_set_memory_flags(argon2_flags);
+}
+
+static void luks2_keyslot_kdf_memory_dbg(struct crypt_device *cd,
+					 const struct crypt_pbkdf_type *pbkdf)
+{
+	const char *type;
+	bool locked;
+
+	crypt_argon2_set_memory_flags(0);
+
+	if (!strcmp(pbkdf->type, CRYPT_KDF_PBKDF2))
+		return;
+
+	type = crypt_argon2_memory_type(&locked);
+	if (type)
+		log_dbg(cd, "Argon2 memory allocated using %s%s.", type,
+			locked ? " (locked)" : "");
+}
+
+int LUKS2_keyslot_luks2_derive_key(struct crypt_device *cd,
+	json_object *jobj_keyslot,
+	const char *password, size_t passwordLen,
+	struct volume_key **derived_key)
+{
+	struct crypt_pbkdf_type pbkdf;
+	struct crypt_trace trace;
+	json_object *jobj2, *jobj_area;
+	size_t keyslot_key_len;
+	char *salt = NULL;
+	int r;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "area", &jobj_area) ||
+	    !json_object_object_get_ex(jobj_area, "key_size", &jobj2))
+		return -EINVAL;
+	keyslot_key_len = json_object_get_int(jobj2);
+
+	r = luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, &salt);
+	if (r < 0)
+		return r;
+
+	/*
+	 * Allocate derived key storage.
+	 */
+	*derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
+	if (!*derived_key) {
+		free(salt);
+		return -ENOMEM;
+	}
+
+	log_dbg(cd, "Running keyslot key derivation.");
+	luks2_keyslot_kdf_memory_flags(cd);
+	crypt_trace_begin(&trace, CRYPT_TRACE_KDF, pbkdf.type);
+	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
+			salt, LUKS_SALTSIZE,
+			(*derived_key)->key, (*derived_key)->keylength,
+			pbkdf.iterations, pbkdf.max_memory_kb,
+			pbkdf.parallel_threads);
+	crypt_trace_end(cd, &trace, (uint64_t)pbkdf.max_memory_kb * 1024, r);
+	luks2_keyslot_kdf_memory_dbg(cd, &pbkdf);
+	free(salt);
+	if (r < 0) {
+		if ((crypt_backend_flags() & CRYPT_BACKEND_PBKDF2_INT) &&
+		     pbkdf.iterations > INT_MAX)
+			log_err(cd, _("PBKDF2 iteration value overflow."));
+		crypt_free_volume_key(*derived_key);
+		*derived_key = NULL;
+	}
+
+	return r;
+}
+
+/* Memory required by keyslot PBKDF in kB, 0 for PBKDF2 */
+uint32_t LUKS2_keyslot_luks2_kdf_memory(json_object *jobj_keyslot)
+{
+	json_object *jobj_kdf, *jobj2;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "kdf", &jobj_kdf) ||
+	    !json_object_object_get_ex(jobj_kdf, "memory", &jobj2))
+		return 0;
+
+	return json_object_get_int(jobj2);
+}
+
 static int luks2_keyslot_set_key(struct crypt_device *cd,
 	json_object *jobj_keyslot,
 	const char *password, size_t passwordLen,
 	const char *volume_key, size_t volume_key_len)
 {
 	struct volume_key *derived_key;
-	char *salt = NULL, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
 	char *AfKey = NULL;
 	const char *af_hash = NULL;
-	size_t AFEKSize, keyslot_key_len;
+	size_t AFEKSize, write_size, bsize;
 	json_object *jobj2, *jobj_kdf, *jobj_af, *jobj_area;
-	uint64_t area_offset;
-	struct crypt_pbkdf_type pbkdf;
+	uint64_t area_offset, area_length;
 	int r;
 
 	if (!json_object_object_get_ex(jobj_keyslot, "kdf", &jobj_kdf) ||
@@ -228,53 +325,43 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 		return -EINVAL;
 	area_offset = crypt_jobj_get_uint64(jobj2);
 
+	if (!json_object_object_get_ex(jobj_area, "size", &jobj2))
+		return -EINVAL;
+	area_length = crypt_jobj_get_uint64(jobj2);
+
 	if (!json_object_object_get_ex(jobj_area, "encryption", &jobj2))
 		return -EINVAL;
 	r = crypt_parse_name_and_mode(json_object_get_string(jobj2), cipher, NULL, cipher_mode);
 	if (r < 0)
 		return r;
 
-	if (!json_object_object_get_ex(jobj_area, "key_size", &jobj2))
-		return -EINVAL;
-	keyslot_key_len = json_object_get_int(jobj2);
-
 	if (!json_object_object_get_ex(jobj_af, "hash", &jobj2))
 		return -EINVAL;
 	af_hash = json_object_get_string(jobj2);
 
-	r = luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, &salt);
-	if (r < 0)
-		return r;
-
 	/*
-	 * Allocate derived key storage.
+	 * Calculate keyslot content (or use key derived in batch store),
+	 * split and store it to keyslot area.
 	 */
-	derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
+	derived_key = LUKS2_keyslot_batch_key(jobj_keyslot);
 	if (!derived_key) {
-		free(salt);
-		return -ENOMEM;
-	}
-	/*
-	 * Calculate keyslot content, split and store it to keyslot area.
-	 */
-	log_dbg(cd, "Running keyslot key derivation.");
-	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
-			salt, LUKS_SALTSIZE,
-			derived_key->key, derived_key->keylength,
-			pbkdf.iterations, pbkdf.max_memory_kb,
-			pbkdf.parallel_threads);
-	free(salt);
-	if (r < 0) {
-		if ((crypt_backend_flags() & CRYPT_BACKEND_PBKDF2_INT) &&
-		     pbkdf.iterations > INT_MAX)
-			log_err(cd, _("PBKDF2 iteration value overflow."));
-		crypt_free_volume_key(derived_key);
-		return r;
+		r = LUKS2_keyslot_luks2_derive_key(cd, jobj_keyslot, password, passwordLen, &derived_key);
+		if (r < 0)
+			return r;
 	}
 
 	// FIXME: verity key_size to AFEKSize
 	AFEKSize = AF_split_sectors(volume_key_len, LUKS_STRIPES) * SECTOR_SIZE;
-	AfKey = crypt_safe_alloc(AFEKSize);
+
+	/* Pad write to device block size to avoid read-modify-write of the last block */
+	bsize = device_block_size(cd, crypt_metadata_device(cd));
+	if (bsize > SECTOR_SIZE && !(area_offset % bsize) &&
+	    size_round_up(AFEKSize, bsize) <= area_length)
+		write_size = size_round_up(AFEKSize, bsize);
+	else
+		write_size = AFEKSize;
+
+	AfKey = crypt_safe_alloc(write_size);
 	if (!AfKey) {
 		crypt_free_volume_key(derived_key);
 		return -ENOMEM;
@@ -289,7 +376,7 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 	if (r == 0) {
 		log_dbg(cd, "Updating keyslot area [0x%04" PRIx64 "].", area_offset);
 		/* FIXME: sector_offset should be size_t, fix LUKS_encrypt... accordingly */
-		r = luks2_encrypt_to_storage(AfKey, AFEKSize, cipher, cipher_mode,
+		r = luks2_encrypt_to_storage(AfKey, write_size, cipher, cipher_mode,
 				    derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
 	}
 
@@ -308,6 +395,7 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 {
 	struct volume_key *derived_key = NULL;
 	struct crypt_pbkdf_type pbkdf, *cd_pbkdf;
+	struct crypt_trace trace;
 	char *AfKey = NULL;
 	size_t AFEKSize;
 	const char *af_hash = NULL;
@@ -316,7 +404,7 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 	uint64_t area_offset;
 	size_t keyslot_key_len;
 	bool try_serialize_lock = false;
-	int r;
+	int r, gate = -1;
 
 	if (!json_object_object_get_ex(jobj_keyslot, "af", &jobj_af) ||
 	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
@@ -380,13 +468,29 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 
 	/*
 	 * Calculate derived key, decrypt keyslot content and merge it.
+	 * In parallel keyslot trial only key derivation runs concurrently.
 	 */
 	log_dbg(cd, "Running keyslot key derivation.");
-	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
-			salt, LUKS_SALTSIZE,
-			derived_key->key, derived_key->keylength,
-			pbkdf.iterations, pbkdf.max_memory_kb,
-			pbkdf.parallel_threads);
+	r = LUKS2_keyslot_kdf_begin(pbkdf.max_memory_kb);
+	/* Host-wide admission of memory-hard KDF, unless already serialized */
+	if (!r && pbkdf.max_memory_kb && !crypt_serialize_lock_enabled(cd)) {
+		r = crypt_memory_gate_acquire(cd, pbkdf.max_memory_kb, &gate);
+		if (r < 0)
+			LUKS2_keyslot_kdf_end(pbkdf.max_memory_kb);
+	}
+	if (!r) {
+		luks2_keyslot_kdf_memory_flags(cd);
+		crypt_trace_begin(&trace, CRYPT_TRACE_KDF, pbkdf.type);
+		r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
+				salt, LUKS_SALTSIZE,
+				derived_key->key, derived_key->keylength,
+				pbkdf.iterations, pbkdf.max_memory_kb,
+				pbkdf.parallel_threads);
+		crypt_trace_end(cd, &trace, (uint64_t)pbkdf.max_memory_kb * 1024, r);
+		luks2_keyslot_kdf_memory_dbg(cd, &pbkdf);
+		crypt_memory_gate_release(cd, gate);
+		LUKS2_keyslot_kdf_end(pbkdf.max_memory_kb);
+	}
 
 	if (try_serialize_lock)
 		crypt_serialize_unlock(cd);
@@ -553,6 +657,7 @@ static int luks2_keyslot_alloc(struct crypt_device *cd,
 	json_object_object_add(jobj_area, "size", crypt_jobj_new_uint64(area_length));
 	json_object_object_add(jobj_keyslot, "area", jobj_area);
 
+	LUKS2_area_map_add(hdr, area_offset, area_length);
 	r = json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot);
 	if (r) {
 		json_object_put(jobj_keyslot);
@@ -566,8 +671,10 @@ static int luks2_keyslot_alloc(struct crypt_device *cd,
 		r = -ENOSPC;
 	}
 
-	if (r)
+	if (r) {
+		LUKS2_area_map_remove(hdr, keyslot);
 		json_object_object_del_by_uint(jobj_keyslots, keyslot);
+	}
 
 	return r;
 err:
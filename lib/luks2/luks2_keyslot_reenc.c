@@ -145,6 +145,7 @@ static int reenc_keyslot_alloc(struct crypt_device *cd,
 	else
 		json_object_object_add(jobj_keyslot, "direction", json_object_new_string("backward"));
 
+	LUKS2_area_map_add(hdr, area_offset, area_length);
 	r = json_object_object_add_by_uint(jobj_keyslots, keyslot, jobj_keyslot);
 	if (r) {
 		json_object_put(jobj_keyslot);
@@ -153,6 +154,7 @@ static int reenc_keyslot_alloc(struct crypt_device *cd,
 
 	if (LUKS2_check_json_size(cd, hdr)) {
 		log_dbg(cd, "New keyslot too large to fit in free metadata space.");
+		LUKS2_area_map_remove(hdr, keyslot);
 		json_object_object_del_by_uint(jobj_keyslots, keyslot);
 		return -ENOSPC;
 	}
@@ -19,8 +19,86 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
 #include "luks2_internal.h"
 #include "utils_device_locking.h"
+#include "utils_threadpool.h"
+
+/* adaptive hotzone: metadata commit should take 1/4 to 1/1 of this fraction of step time */
+#define REENC_ADAPTIVE_COMMIT_RATIO 10
+/* adaptive hotzone: the smallest hotzone is 1/64 of maximal length */
+#define REENC_ADAPTIVE_MIN_SHIFT 6
+
+#define REENC_IOPRIO_WHO_PROCESS 1
+
+/* checksum resilience: amount of data hashed in one parallel job */
+#define REENC_CSUM_JOB_SIZE (1024 * 1024)
+
+/* read back verification: unit of sampling and of one read */
+#define REENC_VERIFY_BLOCK (1024 * 1024)
+
+/* data shift move: size of one read (write) in double buffered copy */
+#define REENC_MOVE_CHUNK (8 * 1024 * 1024)
+
+/*
+ * Prefetch of the next hotzone (pipelined offline reencryption).
+ *
+ * The next hotzone is read and decrypted in a worker thread while
+ * the current hotzone is written and committed. It uses its own storage
+ * wrapper (with private device fd) and buffers. The copy of data as read
+ * is kept for journal hotzone protection, for checksum protection
+ * the checksums of data as read are calculated directly in the worker.
+ * All metadata updates stay in the main thread in the original order.
+ */
+struct reenc_prefetch {
+	struct crypt_threadpool *tp;
+	struct crypt_storage_wrapper *cw;
+	struct crypt_hash *ch;
+	void *buffer;
+	void *raw;
+	void *checksums;
+	size_t checksums_len;
+	size_t csum_block_size;
+	size_t csum_hash_size;
+	uint64_t offset;
+	uint64_t length;
+	ssize_t read;
+	int r;
+	int csum_r;
+	bool running;
+};
+
+/*
+ * Read back verification of finished hotzones (offline reencryption).
+ *
+ * Plaintext of the hotzone is copied before encryption, once the hotzone
+ * is written and synced, a worker thread reads it back (or sampled blocks
+ * of it) through its own new segment storage wrapper, decrypts it with
+ * the new key and compares the result. The check runs while the next
+ * hotzone is processed, the result is collected before the next check
+ * starts (two plaintext copies alternate).
+ */
+struct reenc_verify {
+	struct crypt_threadpool *tp;
+	struct crypt_storage_wrapper *cw;
+	void *expected[2];
+	void *buffer;
+	size_t buffer_len;
+	unsigned int next;
+	uint32_t percent;
+	uint64_t offset[2];
+	uint64_t length[2];
+	uint64_t failed_offset;
+	uint64_t verified;
+	int r;
+	bool prepared;
+	bool running;
+};
 
 struct luks2_reencrypt {
 	/* reencryption window attributes */
@@ -60,12 +138,71 @@ struct luks2_reencrypt {
 	void *reenc_buffer;
 	ssize_t read;
 
+	uint32_t pipeline_depth;
+	struct reenc_prefetch *pf;
+
+	/* read back verification */
+	uint32_t verify_percent;
+	struct reenc_verify *verify;
+
+	/* parallel checksum calculation */
+	struct crypt_threadpool *tp;
+
+	/* hotzone length limits, set for adaptive size or latency target */
+	size_t alignment;
+	uint64_t min_length;
+	uint64_t max_length;
+	uint64_t step_usec;
+	uint64_t commit_usec;
+	bool adaptive;
+
+	/* timing of the last step phases */
+	uint64_t read_usec;
+	uint64_t crypt_usec;
+	uint64_t write_usec;
+
+	/* postponed metadata commit of finished hotzones */
+	uint32_t commit_steps;
+	uint32_t commit_ms;
+	uint32_t uncommitted_steps;
+	uint64_t last_commit_usec;
+	bool commit_pending;
+
+	/* throttling */
+	uint32_t max_rate_mbs;
+	uint32_t ioprio;
+	uint32_t max_latency_ms;
+	uint64_t throttle_usec;
+	uint64_t throttle_progress;
+	int dev_major, dev_minor;
+	uint64_t dev_ios, dev_ticks;
+
+	/* areas used by upper layer (sorted, merged), hotzones outside are skipped */
+	struct crypt_reencrypt_range *used_ranges;
+	size_t used_ranges_count;
+	bool used_ranges_set;
+
+	/* discard instead of wipe of unused areas on teardown */
+	bool discard_unused;
+
+	/* online reencryption, device stack is refreshed once per batch of hotzones */
+	uint32_t online_batch_steps;
+	uint64_t batch_start;
+	uint64_t batch_end;
+	bool batch_open;
+
 	struct crypt_storage_wrapper *cw1;
 	struct crypt_storage_wrapper *cw2;
 
 	uint32_t wflags1;
 	uint32_t wflags2;
 
+	/* typed status snapshot taken on load, answers crypt_reencrypt_status() */
+	crypt_reencrypt_info status;
+	struct crypt_params_reencrypt status_params;
+	char status_resilience[32];
+	char status_hash[LUKS2_CHECKSUM_ALG_L];
+
 	struct crypt_lock_handle *reenc_lock;
 };
 #if USE_LUKS2_REENCRYPTION
@@ -838,11 +975,62 @@ void LUKS2_reencrypt_protection_erase(struct reenc_protection *rp)
 	}
 }
 
+static void reencrypt_prefetch_destroy(struct reenc_prefetch *pf)
+{
+	if (!pf)
+		return;
+
+	if (pf->running)
+		crypt_threadpool_wait(pf->tp);
+	crypt_threadpool_destroy(pf->tp);
+	crypt_storage_wrapper_destroy(pf->cw);
+	if (pf->ch)
+		crypt_hash_destroy(pf->ch);
+	if (pf->checksums) {
+		crypt_safe_memzero(pf->checksums, pf->checksums_len);
+		free(pf->checksums);
+	}
+	free(pf->buffer);
+	free(pf->raw);
+	free(pf);
+}
+
+static void reencrypt_verify_destroy(struct reenc_verify *v)
+{
+	if (!v)
+		return;
+
+	if (v->running)
+		crypt_threadpool_wait(v->tp);
+	crypt_threadpool_destroy(v->tp);
+	crypt_storage_wrapper_destroy(v->cw);
+	if (v->expected[0]) {
+		crypt_safe_memzero(v->expected[0], v->buffer_len);
+		free(v->expected[0]);
+	}
+	if (v->expected[1]) {
+		crypt_safe_memzero(v->expected[1], v->buffer_len);
+		free(v->expected[1]);
+	}
+	if (v->buffer) {
+		crypt_safe_memzero(v->buffer, REENC_VERIFY_BLOCK);
+		free(v->buffer);
+	}
+	free(v);
+}
+
 void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 {
 	if (!rh)
 		return;
 
+	reencrypt_prefetch_destroy(rh->pf);
+	rh->pf = NULL;
+	reencrypt_verify_destroy(rh->verify);
+	rh->verify = NULL;
+	crypt_threadpool_destroy(rh->tp);
+	rh->tp = NULL;
+
 	LUKS2_reencrypt_protection_erase(&rh->rp);
 	LUKS2_reencrypt_protection_erase(&rh->rp_moved_segment);
 
@@ -859,6 +1047,8 @@ void LUKS2_reencrypt_free(struct crypt_device *cd, struct luks2_reencrypt *rh)
 
 	free(rh->reenc_buffer);
 	rh->reenc_buffer = NULL;
+	free(rh->used_ranges);
+	rh->used_ranges = NULL;
 	crypt_storage_wrapper_destroy(rh->cw1);
 	rh->cw1 = NULL;
 	crypt_storage_wrapper_destroy(rh->cw2);
@@ -963,22 +1153,70 @@ static void _load_backup_segments(struct luks2_hdr *hdr,
 		rh->jobj_segment_moved = NULL;
 }
 
-static int reencrypt_offset_backward_moved(struct luks2_hdr *hdr, json_object *jobj_segments,
-					   uint64_t *reencrypt_length, uint64_t data_shift, uint64_t *offset)
+/* Segments summary collected in single pass, used to locate reencryption offset */
+struct reenc_segments_info {
+	int count;		/* active (not backup) segments */
+	int in_reencrypt;	/* segment in reencryption or -1 */
+	int last_crypt;		/* last active crypt segment or -1 */
+	bool moved;		/* backup-moved-segment present */
+	uint64_t in_reencrypt_offset;
+	uint64_t last_crypt_offset;
+	uint64_t first_size;	/* size of the first segment */
+	uint64_t linear_length;	/* all active linear segments length */
+};
+
+static void reencrypt_segments_scan(struct luks2_hdr *hdr, struct reenc_segments_info *si)
 {
-	uint64_t tmp, linear_length = 0;
-	int sg, segs = json_segments_count(jobj_segments);
+	json_object *jobj_segments, *jobj_flags;
+	const char *type;
+	int sg;
 
-	/* find reencrypt offset with data shift */
-	for (sg = 0; sg < segs; sg++)
-		if (LUKS2_segment_is_type(hdr, sg, "linear"))
-			linear_length += LUKS2_segment_size(hdr, sg, 0);
+	memset(si, 0, sizeof(*si));
+	si->in_reencrypt = si->last_crypt = -1;
+
+	if (!json_object_object_get_ex(hdr->jobj, "segments", &jobj_segments))
+		return;
+
+	json_object_object_foreach(jobj_segments, slot, val) {
+		sg = atoi(slot);
+		if (!json_object_object_get_ex(val, "flags", &jobj_flags))
+			jobj_flags = NULL;
+
+		if (json_segment_is_backup(val)) {
+			if (jobj_flags && LUKS2_array_jobj(jobj_flags, "backup-moved-segment"))
+				si->moved = true;
+			continue;
+		}
+
+		si->count++;
+		if (!sg)
+			si->first_size = json_segment_get_size(val, 0);
+
+		if (si->in_reencrypt < 0 && jobj_flags &&
+		    LUKS2_array_jobj(jobj_flags, "in-reencryption")) {
+			si->in_reencrypt = sg;
+			si->in_reencrypt_offset = json_segment_get_offset(val, 0);
+		}
+
+		type = json_segment_type(val) ?: "";
+		if (!strcmp(type, "crypt") && sg > si->last_crypt) {
+			si->last_crypt = sg;
+			si->last_crypt_offset = json_segment_get_offset(val, 0);
+		} else if (!strcmp(type, "linear"))
+			si->linear_length += json_segment_get_size(val, 0);
+	}
+}
+
+static int reencrypt_offset_backward_moved(const struct reenc_segments_info *si,
+					   uint64_t *reencrypt_length, uint64_t data_shift, uint64_t *offset)
+{
+	uint64_t tmp;
 
 	/* all active linear segments length */
-	if (linear_length && segs > 1) {
-		if (linear_length < data_shift)
+	if (si->linear_length && si->count > 1) {
+		if (si->linear_length < data_shift)
 			return -EINVAL;
-		tmp = linear_length - data_shift;
+		tmp = si->linear_length - data_shift;
 		if (tmp && tmp < data_shift) {
 			*offset = data_shift;
 			*reencrypt_length = tmp;
@@ -987,7 +1225,7 @@ static int reencrypt_offset_backward_moved(struct luks2_hdr *hdr, json_object *j
 		return 0;
 	}
 
-	if (segs == 1) {
+	if (si->count == 1) {
 		*offset = 0;
 		return 0;
 	}
@@ -997,31 +1235,26 @@ static int reencrypt_offset_backward_moved(struct luks2_hdr *hdr, json_object *j
 	return -EINVAL;
 }
 
-static int reencrypt_offset_forward_moved(struct luks2_hdr *hdr,
-	json_object *jobj_segments,
+static int reencrypt_offset_forward_moved(const struct reenc_segments_info *si,
 	uint64_t data_shift,
 	uint64_t *offset)
 {
-	int last_crypt = LUKS2_last_segment_by_type(hdr, "crypt");
-
 	/* if last crypt segment exists and it's first one, just return offset = 0 */
-	if (last_crypt <= 0) {
+	if (si->last_crypt <= 0) {
 		*offset = 0;
 		return 0;
 	}
 
-	*offset = LUKS2_segment_offset(hdr, last_crypt, 0) - data_shift;
+	*offset = si->last_crypt_offset - data_shift;
 	return 0;
 }
 
-static int _offset_forward(json_object *jobj_segments, uint64_t *offset)
+static int _offset_forward(const struct reenc_segments_info *si, uint64_t *offset)
 {
-	int segs = json_segments_count(jobj_segments);
-
-	if (segs == 1)
+	if (si->count == 1)
 		*offset = 0;
-	else if (segs == 2) {
-		*offset = json_segment_get_size(json_segments_get_segment(jobj_segments, 0), 0);
+	else if (si->count == 2) {
+		*offset = si->first_size;
 		if (!*offset)
 			return -EINVAL;
 	} else
@@ -1030,20 +1263,16 @@ static int _offset_forward(json_object *jobj_segments, uint64_t *offset)
 	return 0;
 }
 
-static int _offset_backward(json_object *jobj_segments, uint64_t device_size, uint64_t *length, uint64_t *offset)
+static int _offset_backward(const struct reenc_segments_info *si, uint64_t device_size, uint64_t *length, uint64_t *offset)
 {
-	int segs = json_segments_count(jobj_segments);
-	uint64_t tmp;
-
-	if (segs == 1) {
+	if (si->count == 1) {
 		if (device_size < *length)
 			*length = device_size;
 		*offset = device_size - *length;
-	} else if (segs == 2) {
-		tmp = json_segment_get_size(json_segments_get_segment(jobj_segments, 0), 0);
-		if (tmp < *length)
-			*length = tmp;
-		*offset =  tmp - *length;
+	} else if (si->count == 2) {
+		if (si->first_size < *length)
+			*length = si->first_size;
+		*offset = si->first_size - *length;
 	} else
 		return -EINVAL;
 
@@ -1058,35 +1287,33 @@ static int reencrypt_offset(struct luks2_hdr *hdr,
 		uint64_t *reencrypt_length,
 		uint64_t *offset)
 {
-	int r, sg;
-	json_object *jobj_segments;
+	int r;
+	struct reenc_segments_info si;
 	uint64_t data_shift = reencrypt_data_shift(hdr);
 
 	if (!offset)
 		return -EINVAL;
 
+	reencrypt_segments_scan(hdr, &si);
+
 	/* if there's segment in reencryption return directly offset of it */
-	json_object_object_get_ex(hdr->jobj, "segments", &jobj_segments);
-	sg = json_segments_segment_in_reencrypt(jobj_segments);
-	if (sg >= 0) {
-		*offset = LUKS2_segment_offset(hdr, sg, 0) - (reencrypt_get_data_offset_new(hdr));
+	if (si.in_reencrypt >= 0) {
+		*offset = si.in_reencrypt_offset - (reencrypt_get_data_offset_new(hdr));
 		return 0;
 	}
 
 	if (di == CRYPT_REENCRYPT_FORWARD) {
-		if (reencrypt_mode(hdr) == CRYPT_REENCRYPT_DECRYPT &&
-		    LUKS2_get_segment_id_by_flag(hdr, "backup-moved-segment") >= 0) {
-			r = reencrypt_offset_forward_moved(hdr, jobj_segments, data_shift, offset);
+		if (reencrypt_mode(hdr) == CRYPT_REENCRYPT_DECRYPT && si.moved) {
+			r = reencrypt_offset_forward_moved(&si, data_shift, offset);
 			if (!r && *offset > device_size)
 				*offset = device_size;
 			return r;
 		}
-		return _offset_forward(jobj_segments, offset);
+		return _offset_forward(&si, offset);
 	} else if (di == CRYPT_REENCRYPT_BACKWARD) {
-		if (reencrypt_mode(hdr) == CRYPT_REENCRYPT_ENCRYPT &&
-		    LUKS2_get_segment_id_by_flag(hdr, "backup-moved-segment") >= 0)
-			return reencrypt_offset_backward_moved(hdr, jobj_segments, reencrypt_length, data_shift, offset);
-		return _offset_backward(jobj_segments, device_size, reencrypt_length, offset);
+		if (reencrypt_mode(hdr) == CRYPT_REENCRYPT_ENCRYPT && si.moved)
+			return reencrypt_offset_backward_moved(&si, reencrypt_length, data_shift, offset);
+		return _offset_backward(&si, device_size, reencrypt_length, offset);
 	}
 
 	return -EINVAL;
@@ -1142,6 +1369,84 @@ static uint64_t reencrypt_length(struct crypt_device *cd,
 	return length;
 }
 
+static uint64_t reencrypt_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Initial hotzone length (allocated buffer) is the upper limit. The first hotzone
+ * is not changed, its offset is already calculated for this length.
+ */
+static void reencrypt_adaptive_init(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	if (rh->rp.type == REENC_PROTECTION_DATASHIFT || !rh->alignment) {
+		log_dbg(cd, "Adaptive hotzone size not supported in this mode.");
+		return;
+	}
+
+	rh->max_length = rh->length;
+	rh->min_length = rh->max_length >> REENC_ADAPTIVE_MIN_SHIFT;
+	rh->min_length -= rh->min_length % rh->alignment;
+	if (rh->min_length < rh->alignment)
+		rh->min_length = rh->alignment;
+
+	log_dbg(cd, "Adaptive hotzone size in range %" PRIu64 " - %" PRIu64 " bytes.",
+		rh->min_length, rh->max_length);
+}
+
+/*
+ * Grow hotzone if metadata commit takes more than 1/REENC_ADAPTIVE_COMMIT_RATIO
+ * of step time, shrink it if commit overhead is negligible (less than 1/4 of that).
+ * Must be called before reencrypt_context_update() calculates next hotzone.
+ */
+static void reencrypt_adaptive_update(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t length = rh->length;
+
+	/* shortened (last) hotzone says nothing about throughput */
+	if (!rh->adaptive || !rh->max_length || !rh->step_usec || (uint64_t)rh->read != rh->length)
+		return;
+
+	if (rh->commit_usec * REENC_ADAPTIVE_COMMIT_RATIO > rh->step_usec)
+		length = length > rh->max_length / 2 ? rh->max_length : length * 2;
+	else if (rh->commit_usec * REENC_ADAPTIVE_COMMIT_RATIO * 4 < rh->step_usec)
+		length = length / 2 < rh->min_length ? rh->min_length : length / 2;
+
+	length -= length % rh->alignment;
+	if (!length || length == rh->length)
+		return;
+
+	log_dbg(cd, "Hotzone size changed to %" PRIu64 " bytes (commit %" PRIu64 " of %" PRIu64 " us).",
+		length, rh->commit_usec, rh->step_usec);
+	rh->length = length;
+}
+
+/*
+ * On striped devices (optimal_io_size is the full stripe) hotzone covers whole
+ * stripes, so all stripe members are accessed in parallel and RAID parity
+ * is not updated by partial stripe writes.
+ */
+static uint64_t reencrypt_length_stripe_aligned(struct crypt_device *cd,
+	uint64_t length, size_t alignment)
+{
+	struct stat st;
+	uint64_t stripe = 0;
+
+	if (stat(device_path(crypt_data_device(cd)), &st) < 0 || !S_ISBLK(st.st_mode) ||
+	    !crypt_dev_queue_limit(major(st.st_rdev), minor(st.st_rdev), "optimal_io_size", &stripe) ||
+	    !stripe || stripe % alignment || length <= stripe || !(length % stripe))
+		return length;
+
+	log_dbg(cd, "Aligning hotzone to full stripe size %" PRIu64 " bytes.", stripe);
+	return length - length % stripe;
+}
+
 static int reencrypt_context_init(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	struct luks2_reencrypt *rh,
@@ -1192,12 +1497,16 @@ static int reencrypt_context_init(struct crypt_device *cd,
 	} else
 		rh->fixed_length = false;
 
+	rh->alignment = alignment;
 	rh->length = reencrypt_length(cd, &rh->rp, area_length, max_hotzone_size << SECTOR_SHIFT, alignment);
 	if (!rh->length) {
 		log_dbg(cd, "Invalid reencryption length.");
 		return -EINVAL;
 	}
 
+	if (rh->rp.type != REENC_PROTECTION_DATASHIFT)
+		rh->length = reencrypt_length_stripe_aligned(cd, rh->length, alignment);
+
 	if (reencrypt_offset(hdr, rh->direction, device_size, &rh->length, &rh->offset)) {
 		log_dbg(cd, "Failed to get reencryption offset.");
 		return -EINVAL;
@@ -1250,6 +1559,23 @@ static size_t reencrypt_buffer_length(struct luks2_reencrypt *rh)
 	return rh->length;
 }
 
+/*
+ * Touch the whole hotzone buffer before reencryption starts. Pages are
+ * allocated in advance (on the NUMA node of the reencryption thread with
+ * default first-touch policy) and large buffers may use transparent huge pages.
+ */
+static void reencrypt_buffer_prefault(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	size_t length = reencrypt_buffer_length(rh);
+
+#ifdef MADV_HUGEPAGE
+	if (madvise(rh->reenc_buffer, length, MADV_HUGEPAGE))
+		log_dbg(cd, "Transparent huge pages not available for hotzone buffer.");
+#endif
+	memset(rh->reenc_buffer, 0, length);
+	log_dbg(cd, "Prefaulted hotzone buffer of %zu bytes.", length);
+}
+
 static int reencrypt_load_clean(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	uint64_t device_size,
@@ -1374,11 +1700,16 @@ static int reencrypt_load_crashed(struct crypt_device *cd,
 static int reencrypt_init_storage_wrappers(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
 		struct luks2_reencrypt *rh,
-		struct volume_key *vks)
+		struct volume_key *vks,
+		bool direct_io)
 {
 	int r;
 	struct volume_key *vk;
-	uint32_t wrapper_flags = (getuid() || geteuid()) ? 0 : DISABLE_KCAPI;
+	uint32_t wrapper_flags = PARALLEL_CRYPT | ASYNC_IO | DROP_CACHE |
+				 ((getuid() || geteuid()) ? 0 : DISABLE_KCAPI);
+
+	if (direct_io)
+		wrapper_flags |= DIRECT_IO;
 
 	vk = crypt_volume_key_by_id(vks, rh->digest_old);
 	r = crypt_storage_wrapper_init(cd, &rh->cw1, crypt_data_device(cd),
@@ -1477,6 +1808,57 @@ static int reencrypt_update_flag(struct crypt_device *cd, uint8_t version,
 	return LUKS2_config_set_requirements(cd, hdr, reqs, commit);
 }
 
+struct reenc_csum_batch {
+	const struct reenc_protection *rp;
+	const char *data;
+	char *checksums;
+	size_t blocks;
+	size_t job_blocks;
+};
+
+static int reencrypt_checksum_job(void *arg, unsigned int job)
+{
+	struct reenc_csum_batch *b = arg;
+	struct crypt_hash *ch;
+	size_t start = (size_t)job * b->job_blocks, n = b->job_blocks;
+	size_t block_size = b->rp->p.csum.block_size, hash_size = b->rp->p.csum.hash_size;
+	int r;
+
+	if (n > b->blocks - start)
+		n = b->blocks - start;
+
+	/* hash context cannot be shared between threads */
+	if (crypt_hash_init(&ch, b->rp->p.csum.hash))
+		return -EINVAL;
+
+	r = crypt_hash_many(ch, NULL, 0, NULL, 0, b->data + start * block_size, block_size,
+			    n, b->checksums + start * hash_size, hash_size, hash_size);
+
+	crypt_hash_destroy(ch);
+	return r ? -EINVAL : 0;
+}
+
+/* Calculate checksums of blocks, in parallel if thread pool is available */
+static int reencrypt_checksums(struct crypt_threadpool *tp,
+	const struct reenc_protection *rp,
+	const void *data, size_t blocks, void *checksums)
+{
+	struct reenc_csum_batch b = {
+		.rp = rp,
+		.data = data,
+		.checksums = checksums,
+		.blocks = blocks,
+		.job_blocks = REENC_CSUM_JOB_SIZE / rp->p.csum.block_size ?: 1,
+	};
+
+	if (crypt_threadpool_threads(tp) < 2 || blocks <= b.job_blocks)
+		return crypt_hash_many(rp->p.csum.ch, NULL, 0, NULL, 0, data, rp->p.csum.block_size,
+				       blocks, checksums, rp->p.csum.hash_size, rp->p.csum.hash_size) ? -EINVAL : 0;
+
+	return crypt_threadpool_run(tp, (blocks + b.job_blocks - 1) / b.job_blocks,
+				    reencrypt_checksum_job, &b);
+}
+
 static int reencrypt_hotzone_protect_ready(struct crypt_device *cd,
 	struct reenc_protection *rp)
 {
@@ -1504,9 +1886,10 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 	struct volume_key *vks)
 {
 	struct volume_key *vk_old, *vk_new;
-	size_t count, s;
+	size_t count, s, e;
 	ssize_t read, w;
 	struct reenc_protection *rp;
+	struct crypt_threadpool *tp = NULL;
 	int devfd, r, new_sector_size, old_sector_size, rseg;
 	uint64_t area_offset, area_length, area_length_read, crash_iv_offset,
 		 data_offset = crypt_get_data_offset(cd) << SECTOR_SHIFT;
@@ -1551,7 +1934,7 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 
 	r = crypt_storage_wrapper_init(cd, &cw2, crypt_data_device(cd),
 			data_offset + rh->offset, crash_iv_offset, new_sector_size,
-			reencrypt_segment_cipher_new(hdr), vk_new, 0);
+			reencrypt_segment_cipher_new(hdr), vk_new, PARALLEL_CRYPT | ASYNC_IO);
 	if (r) {
 		log_err(cd, _("Failed to initialize new segment storage wrapper."));
 		return r;
@@ -1573,7 +1956,7 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 
 		r = crypt_storage_wrapper_init(cd, &cw1, crypt_data_device(cd),
 				data_offset + rh->offset, crash_iv_offset, old_sector_size,
-				reencrypt_segment_cipher_old(hdr), vk_old, 0);
+				reencrypt_segment_cipher_old(hdr), vk_old, PARALLEL_CRYPT);
 		if (r) {
 			log_err(cd, _("Failed to initialize old segment storage wrapper."));
 			goto out;
@@ -1587,7 +1970,7 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 			goto out;
 		}
 
-		checksum_tmp = malloc(rp->p.csum.hash_size);
+		checksum_tmp = malloc(area_length_read);
 		if (!checksum_tmp) {
 			r = -ENOMEM;
 			goto out;
@@ -1614,30 +1997,35 @@ static int reencrypt_recover_segment(struct crypt_device *cd,
 			goto out;
 		}
 
-		for (s = 0; s < count; s++) {
-			if (crypt_hash_write(rp->p.csum.ch, data_buffer + (s * rp->p.csum.block_size), rp->p.csum.block_size)) {
-				log_dbg(cd, "Failed to write hash.");
-				r = EINVAL;
-				goto out;
+		if (crypt_get_threads(cd) > 1 && crypt_threadpool_init(cd, &tp, crypt_get_threads(cd)))
+			log_dbg(cd, "Failed to initialize thread pool, checksums will be calculated serially.");
+
+		if (reencrypt_checksums(tp, rp, data_buffer, count, checksum_tmp)) {
+			log_dbg(cd, "Failed to hash hotzone sectors.");
+			r = -EINVAL;
+			goto out;
+		}
+
+		/* Blocks matching old data checksum need recovery, process continuous runs at once. */
+		for (s = 0; s < count; s = e) {
+			for (e = s; e < count; e++)
+				if (memcmp(checksum_tmp + (e * rp->p.csum.hash_size), (char *)rp->p.csum.checksums + (e * rp->p.csum.hash_size), rp->p.csum.hash_size))
+					break;
+			if (e == s) {
+				e++;
+				continue;
 			}
-			if (crypt_hash_final(rp->p.csum.ch, checksum_tmp, rp->p.csum.hash_size)) {
-				log_dbg(cd, "Failed to finalize hash.");
-				r = EINVAL;
+			log_dbg(cd, "Sectors %zu-%zu (size %zu, offset %zu) need recovery", s, e - 1, rp->p.csum.block_size, s * rp->p.csum.block_size);
+			if (crypt_storage_wrapper_decrypt(cw1, s * rp->p.csum.block_size, data_buffer + (s * rp->p.csum.block_size), (e - s) * rp->p.csum.block_size)) {
+				log_err(cd, _("Failed to decrypt sector %zu."), s);
+				r = -EINVAL;
 				goto out;
 			}
-			if (!memcmp(checksum_tmp, (char *)rp->p.csum.checksums + (s * rp->p.csum.hash_size), rp->p.csum.hash_size)) {
-				log_dbg(cd, "Sector %zu (size %zu, offset %zu) needs recovery", s, rp->p.csum.block_size, s * rp->p.csum.block_size);
-				if (crypt_storage_wrapper_decrypt(cw1, s * rp->p.csum.block_size, data_buffer + (s * rp->p.csum.block_size), rp->p.csum.block_size)) {
-					log_err(cd, _("Failed to decrypt sector %zu."), s);
-					r = -EINVAL;
-					goto out;
-				}
-				w = crypt_storage_wrapper_encrypt_write(cw2, s * rp->p.csum.block_size, data_buffer + (s * rp->p.csum.block_size), rp->p.csum.block_size);
-				if (w < 0 || (size_t)w != rp->p.csum.block_size) {
-					log_err(cd, _("Failed to recover sector %zu."), s);
-					r = -EINVAL;
-					goto out;
-				}
+			w = crypt_storage_wrapper_encrypt_write(cw2, s * rp->p.csum.block_size, data_buffer + (s * rp->p.csum.block_size), (e - s) * rp->p.csum.block_size);
+			if (w < 0 || (size_t)w != (e - s) * rp->p.csum.block_size) {
+				log_err(cd, _("Failed to recover sector %zu."), s);
+				r = -EINVAL;
+				goto out;
 			}
 		}
 
@@ -1734,6 +2122,7 @@ out:
 	free(checksum_tmp);
 	crypt_storage_wrapper_destroy(cw1);
 	crypt_storage_wrapper_destroy(cw2);
+	crypt_threadpool_destroy(tp);
 
 	return r;
 }
@@ -2201,6 +2590,8 @@ static int reencrypt_replace_device(struct crypt_device *cd, const char *target,
 
 	dmd_source.flags |= flags;
 	dmd_source.uuid = crypt_get_uuid(cd);
+	/* overlay device is used only for reencryption */
+	dmd_source.io_profile = DM_IO_PROFILE_SEQUENTIAL;
 
 	if (exists) {
 		if (dmd_target.size != dmd_source.size) {
@@ -2273,7 +2664,8 @@ static int reencrypt_activate_hotzone_device(struct crypt_device *cd, const char
 	struct crypt_dm_active_device dmd = {
 		.flags = flags,
 		.uuid = crypt_get_uuid(cd),
-		.size = device_size >> SECTOR_SHIFT
+		.size = device_size >> SECTOR_SHIFT,
+		.io_profile = DM_IO_PROFILE_SEQUENTIAL
 	};
 
 	log_dbg(cd, "Activating hotzone device %s.", name);
@@ -2404,6 +2796,117 @@ static int reencrypt_refresh_overlay_devices(struct crypt_device *cd,
 	return REENC_OK;
 }
 
+struct reenc_move {
+	struct crypt_storage_wrapper *cw;
+	void *buffer;
+	uint64_t offset;
+	size_t length;
+	ssize_t read;
+};
+
+static int reencrypt_move_read_job(void *arg, unsigned int job __attribute__((unused)))
+{
+	struct reenc_move *m = arg;
+
+	m->read = crypt_storage_wrapper_read(m->cw, m->offset, m->buffer, m->length);
+	return 0;
+}
+
+/*
+ * Source and destination areas of the moved segment never overlap,
+ * the next chunk is read in a worker thread while the current one
+ * is written. Both wrappers use own fd and io_uring (if available),
+ * so every chunk is split to several requests in flight.
+ * Returns -ENOTSUP if the pipelined copy cannot be set up.
+ */
+static int reencrypt_move_data_pipelined(struct crypt_device *cd,
+	uint64_t read_offset,
+	uint64_t offset,
+	uint64_t length)
+{
+	struct crypt_storage_wrapper *cw_write = NULL;
+	struct crypt_threadpool *tp = NULL;
+	struct reenc_move m[2] = {};
+	size_t chunk = length < REENC_MOVE_CHUNK ? length : REENC_MOVE_CHUNK,
+	       alignment = device_alignment(crypt_data_device(cd));
+	uint64_t done = 0, next;
+	unsigned int i;
+	bool running = false;
+	ssize_t ret;
+	int r = -ENOTSUP;
+
+	if (crypt_storage_wrapper_init(cd, &m[0].cw, crypt_data_device(cd), 0, 0, SECTOR_SIZE,
+				       "cipher_null-ecb", NULL, OPEN_PRIVATE | OPEN_READONLY | ASYNC_IO | DROP_CACHE) ||
+	    crypt_storage_wrapper_init(cd, &cw_write, crypt_data_device(cd), 0, 0, SECTOR_SIZE,
+				       "cipher_null-ecb", NULL, OPEN_PRIVATE | ASYNC_IO | DROP_CACHE) ||
+	    posix_memalign(&m[0].buffer, alignment, chunk) ||
+	    posix_memalign(&m[1].buffer, alignment, chunk) ||
+	    crypt_threadpool_init(cd, &tp, 2))
+		goto out;
+	m[1].cw = m[0].cw;
+
+	log_dbg(cd, "Moving %" PRIu64 " bytes from offset %" PRIu64 " to offset %" PRIu64
+		" in %zu bytes chunks.", length, read_offset, offset, chunk);
+
+	m[0].offset = read_offset;
+	m[0].length = chunk;
+	r = crypt_threadpool_start(tp, 1, reencrypt_move_read_job, &m[0]);
+	running = !r;
+
+	for (i = 0; !r && done < length; i ^= 1) {
+		crypt_threadpool_wait(tp);
+		running = false;
+
+		if (m[i].read < 0 || (size_t)m[i].read != m[i].length) {
+			log_dbg(cd, "Failed to read data at offset %" PRIu64 " (size: %zu)",
+				m[i].offset, m[i].length);
+			r = -EIO;
+			break;
+		}
+
+		next = done + m[i].length;
+		if (next < length) {
+			m[i ^ 1].offset = read_offset + next;
+			m[i ^ 1].length = length - next < chunk ? length - next : chunk;
+			r = crypt_threadpool_start(tp, 1, reencrypt_move_read_job, &m[i ^ 1]);
+			if (r)
+				break;
+			running = true;
+		}
+
+		ret = crypt_storage_wrapper_write(cw_write, offset + done, m[i].buffer, m[i].length);
+		if (ret < 0 || (size_t)ret != m[i].length) {
+			log_dbg(cd, "Failed to write data at offset %" PRIu64 " (size: %zu)",
+				offset + done, m[i].length);
+			r = -EIO;
+			break;
+		}
+		crypt_storage_wrapper_drop_cache(m[i].cw, m[i].offset, m[i].length);
+
+		done = next;
+	}
+
+	if (running)
+		crypt_threadpool_wait(tp);
+
+	/* moved data must be on disk before metadata points to them */
+	if (!r && crypt_storage_wrapper_datasync(cw_write))
+		r = -EIO;
+	if (!r)
+		crypt_storage_wrapper_drop_cache(cw_write, offset, length);
+out:
+	crypt_threadpool_destroy(tp);
+	for (i = 0; i < 2; i++) {
+		if (m[i].buffer) {
+			crypt_safe_memzero(m[i].buffer, chunk);
+			free(m[i].buffer);
+		}
+	}
+	crypt_storage_wrapper_destroy(m[0].cw);
+	crypt_storage_wrapper_destroy(cw_write);
+	return r;
+}
+
 static int reencrypt_move_data(struct crypt_device *cd,
 	int devfd,
 	uint64_t data_shift,
@@ -2421,6 +2924,12 @@ static int reencrypt_move_data(struct crypt_device *cd,
 	if (!buffer_len || buffer_len > data_shift)
 		return -EINVAL;
 
+	r = reencrypt_move_data_pipelined(cd, read_offset, offset, buffer_len);
+	if (r != -ENOTSUP)
+		return r;
+
+	log_dbg(cd, "Pipelined data move not available, using single buffer.");
+
 	if (posix_memalign(&buffer, device_alignment(crypt_data_device(cd)), buffer_len))
 		return -ENOMEM;
 
@@ -2907,6 +3416,8 @@ static int reencrypt_decrypt_with_datashift_init(struct crypt_device *cd,
 		}
 		r = LUKS2_assembly_multisegment_dmd(cd, hdr, *vks, jobj_segments_old, &dmd_source);
 		if (!r) {
+			/* table loaded without target compaction */
+			dm_targets_compact(cd, &dmd_target);
 			r = crypt_compare_dm_devices(cd, &dmd_source, &dmd_target);
 			if (r)
 				log_err(cd, _("Mismatching parameters on device %s."), name);
@@ -3144,6 +3655,8 @@ static int reencrypt_init(struct crypt_device *cd,
 
 		r = LUKS2_assembly_multisegment_dmd(cd, hdr, *vks, LUKS2_get_segments_jobj(hdr), &dmd_source);
 		if (!r) {
+			/* table loaded without target compaction */
+			dm_targets_compact(cd, &dmd_target);
 			r = crypt_compare_dm_devices(cd, &dmd_source, &dmd_target);
 			if (r)
 				log_err(cd, _("Mismatching parameters on device %s."), name);
@@ -3177,13 +3690,17 @@ out:
 	return r;
 }
 
+/*
+ * If checksummed is set, checksums of the hotzone are already calculated
+ * in rp->p.csum.checksums (by prefetch).
+ */
 static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
 	struct luks2_hdr *hdr, int reencrypt_keyslot,
-	const struct reenc_protection *rp,
-	const void *buffer, size_t buffer_len)
+	const struct reenc_protection *rp, struct crypt_threadpool *tp,
+	const void *buffer, size_t buffer_len, bool checksummed)
 {
 	const void *pbuffer;
-	size_t data_offset, len;
+	size_t blocks, len;
 	int r;
 
 	assert(hdr);
@@ -3195,16 +3712,12 @@ static int reencrypt_hotzone_protect_final(struct crypt_device *cd,
 	if (rp->type == REENC_PROTECTION_CHECKSUM) {
 		log_dbg(cd, "Checksums hotzone resilience.");
 
-		for (data_offset = 0, len = 0; data_offset < buffer_len; data_offset += rp->p.csum.block_size, len += rp->p.csum.hash_size) {
-			if (crypt_hash_write(rp->p.csum.ch, (const char *)buffer + data_offset, rp->p.csum.block_size)) {
-				log_dbg(cd, "Failed to hash sector at offset %zu.", data_offset);
-				return -EINVAL;
-			}
-			if (crypt_hash_final(rp->p.csum.ch, (char *)rp->p.csum.checksums + len, rp->p.csum.hash_size)) {
-				log_dbg(cd, "Failed to finalize hash.");
-				return -EINVAL;
-			}
+		blocks = buffer_len / rp->p.csum.block_size;
+		if (!checksummed && reencrypt_checksums(tp, rp, buffer, blocks, rp->p.csum.checksums)) {
+			log_dbg(cd, "Failed to hash hotzone sectors.");
+			return -EINVAL;
 		}
+		len = blocks * rp->p.csum.hash_size;
 		pbuffer = rp->p.csum.checksums;
 	} else if (rp->type == REENC_PROTECTION_JOURNAL) {
 		log_dbg(cd, "Journal hotzone resilience.");
@@ -3269,6 +3782,26 @@ static int reencrypt_context_update(struct crypt_device *cd,
 	return 0;
 }
 
+static void reencrypt_status_snapshot(struct luks2_hdr *hdr, struct luks2_reencrypt *rh)
+{
+	struct crypt_params_reencrypt *p = &rh->status_params;
+
+	rh->status = LUKS2_reencrypt_get_params(hdr, p);
+
+	/* strings point to json, header object can be replaced later */
+	if (p->resilience && strlen(p->resilience) < sizeof(rh->status_resilience)) {
+		strcpy(rh->status_resilience, p->resilience);
+		p->resilience = rh->status_resilience;
+	} else
+		p->resilience = NULL;
+
+	if (p->hash && strlen(p->hash) < sizeof(rh->status_hash)) {
+		strcpy(rh->status_hash, p->hash);
+		p->hash = rh->status_hash;
+	} else
+		p->hash = NULL;
+}
+
 static int reencrypt_load(struct crypt_device *cd, struct luks2_hdr *hdr,
 		uint64_t device_size,
 		uint64_t max_hotzone_size,
@@ -3302,6 +3835,7 @@ static int reencrypt_load(struct crypt_device *cd, struct luks2_hdr *hdr,
 		return r;
 	}
 
+	reencrypt_status_snapshot(hdr, tmp);
 	*rh = tmp;
 
 	return 0;
@@ -3427,6 +3961,7 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 	struct crypt_lock_handle *reencrypt_lock;
 	struct luks2_reencrypt *rh;
 	const struct volume_key *vk;
+	const struct crypt_params_reencrypt_tuning *tuning;
 	size_t alignment;
 	uint32_t old_sector_size, new_sector_size, sector_size;
 	struct crypt_dm_active_device dmd_target, dmd_source = {
@@ -3435,7 +3970,7 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 	};
 	uint64_t minimal_size, device_size, mapping_size = 0, required_size = 0,
 		 max_hotzone_size = 0;
-	bool dynamic;
+	bool dynamic, throughput = params && (params->flags & CRYPT_REENCRYPT_OFFLINE_THROUGHPUT);
 	uint32_t flags = 0;
 
 	assert(cd);
@@ -3460,6 +3995,10 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 		max_hotzone_size = params->max_hotzone_size;
 	}
 
+	/* still limited by resilience type and available memory */
+	if (throughput && !max_hotzone_size)
+		max_hotzone_size = LUKS2_THROUGHPUT_REENCRYPTION_LENGTH >> SECTOR_SHIFT;
+
 	rh = crypt_get_luks2_reencrypt(cd);
 	if (rh) {
 		LUKS2_reencrypt_free(cd, rh);
@@ -3529,6 +4068,8 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 
 		r = LUKS2_assembly_multisegment_dmd(cd, hdr, *vks, LUKS2_get_segments_jobj(hdr), &dmd_source);
 		if (!r) {
+			/* table loaded without target compaction */
+			dm_targets_compact(cd, &dmd_target);
 			r = crypt_compare_dm_devices(cd, &dmd_source, &dmd_target);
 			if (r)
 				log_err(cd, _("Mismatching parameters on device %s."), name);
@@ -3593,10 +4134,13 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 	 * 3) one or more dm-crypt based wrapper activation
 	 * 4) next excl open gets skipped due to 3) device from 2) remains undetected.
 	 */
-	r = reencrypt_init_storage_wrappers(cd, hdr, rh, *vks);
+	r = reencrypt_init_storage_wrappers(cd, hdr, rh, *vks, throughput);
 	if (r)
 		goto err;
 
+	if (throughput)
+		reencrypt_buffer_prefault(cd, rh);
+
 	/* If one of wrappers is based on dmcrypt fallback it already blocked mount */
 	if (!name && crypt_storage_wrapper_get_type(rh->cw1) != DMCRYPT &&
 	    crypt_storage_wrapper_get_type(rh->cw2) != DMCRYPT) {
@@ -3608,6 +4152,26 @@ static int reencrypt_load_by_passphrase(struct crypt_device *cd,
 	}
 
 	rh->flags = flags;
+	tuning = crypt_get_reencrypt_tuning(cd);
+	rh->pipeline_depth = tuning->pipeline_depth;
+	rh->verify_percent = tuning->verify_percent;
+	rh->commit_steps = tuning->commit_steps;
+	rh->commit_ms = tuning->commit_ms;
+	rh->max_rate_mbs = tuning->max_rate_mbs;
+	rh->ioprio = tuning->ioprio;
+	rh->max_latency_ms = tuning->max_latency_ms;
+	if (rh->online && rh->rp.type != REENC_PROTECTION_DATASHIFT &&
+	    tuning->online_batch_steps > 1)
+		rh->online_batch_steps = tuning->online_batch_steps;
+	if (params)
+		rh->discard_unused = params->flags & CRYPT_REENCRYPT_DISCARD_UNUSED;
+	/* batch area is calculated from fixed hotzone size */
+	if (rh->online_batch_steps)
+		log_dbg(cd, "Refreshing device stack once per %u hotzones.", rh->online_batch_steps);
+	else if (params && (params->flags & CRYPT_REENCRYPT_ADAPTIVE_HOTZONE)) {
+		reencrypt_adaptive_init(cd, rh);
+		rh->adaptive = rh->max_length > 0;
+	}
 
 	MOVE_REF(rh->vks, *vks);
 	MOVE_REF(rh->reenc_lock, reencrypt_lock);
@@ -3773,6 +4337,11 @@ static int reencrypt_init_by_passphrase(struct crypt_device *cd,
 	uint32_t flags = params ? params->flags : 0;
 	struct luks2_hdr *hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
+	if (name && (flags & CRYPT_REENCRYPT_OFFLINE_THROUGHPUT)) {
+		log_err(cd, _("Throughput mode is supported only for offline reencryption."));
+		return -EINVAL;
+	}
+
 	/* short-circuit in reencryption metadata update and finish immediately. */
 	if (flags & CRYPT_REENCRYPT_REPAIR_NEEDED)
 		return reencrypt_repair_by_passphrase(cd, hdr, keyslot_old, keyslot_new, passphrase, passphrase_size);
@@ -3885,36 +4454,570 @@ int crypt_reencrypt_init_by_passphrase(struct crypt_device *cd,
 }
 
 #if USE_LUKS2_REENCRYPTION
-static reenc_status_t reencrypt_step(struct crypt_device *cd,
+static int reencrypt_prefetch_init(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
-		struct luks2_reencrypt *rh,
-		uint64_t device_size,
-		bool online)
+		struct luks2_reencrypt *rh)
 {
+	struct reenc_prefetch *pf;
+	size_t alignment = device_alignment(crypt_data_device(cd));
 	int r;
-	struct reenc_protection *rp;
 
-	assert(hdr);
-	assert(rh);
+	if (rh->pipeline_depth < 2)
+		return 0;
 
-	rp = &rh->rp;
+	/*
+	 * Online reencryption cannot read ahead of the hotzone (data may change)
+	 * and data shift moves data across hotzone boundaries.
+	 */
+	if (rh->online || rh->rp.type == REENC_PROTECTION_DATASHIFT ||
+	    crypt_storage_wrapper_get_type(rh->cw1) == DMCRYPT) {
+		log_dbg(cd, "Pipelined reencryption not supported in this mode.");
+		return 0;
+	}
 
-	/* in memory only */
-	r = reencrypt_make_segments(cd, hdr, rh, device_size);
+	pf = crypt_zalloc(sizeof(*pf));
+	if (!pf)
+		return -ENOMEM;
+
+	r = crypt_storage_wrapper_init(cd, &pf->cw, crypt_data_device(cd),
+			reencrypt_get_data_offset_old(hdr),
+			crypt_get_iv_offset(cd),
+			reencrypt_get_sector_size_old(hdr),
+			reencrypt_segment_cipher_old(hdr),
+			crypt_volume_key_by_id(rh->vks, rh->digest_old),
+			rh->wflags1 | OPEN_PRIVATE);
 	if (r)
-		return REENC_ERR;
+		goto err;
 
-	r = reencrypt_assign_segments(cd, hdr, rh, 1, 0);
-	if (r) {
-		log_err(cd, _("Failed to set device segments for next reencryption hotzone."));
-		return REENC_ERR;
+	r = -ENOMEM;
+	if (posix_memalign(&pf->buffer, alignment, reencrypt_buffer_length(rh)))
+		goto err;
+
+	if (rh->rp.type == REENC_PROTECTION_JOURNAL &&
+	    posix_memalign(&pf->raw, alignment, reencrypt_buffer_length(rh)))
+		goto err;
+
+	if (rh->rp.type == REENC_PROTECTION_CHECKSUM) {
+		pf->checksums_len = rh->rp.p.csum.checksums_len;
+		if (posix_memalign(&pf->checksums, device_alignment(crypt_metadata_device(cd)),
+				   pf->checksums_len))
+			goto err;
+		r = crypt_hash_init(&pf->ch, rh->rp.p.csum.hash);
+		if (r)
+			goto err;
+		pf->csum_block_size = rh->rp.p.csum.block_size;
+		pf->csum_hash_size = rh->rp.p.csum.hash_size;
+		r = -ENOMEM;
 	}
 
-	log_dbg(cd, "Reencrypting chunk starting at offset: %" PRIu64 ", size :%" PRIu64 ".", rh->offset, rh->length);
-	log_dbg(cd, "data_offset: %" PRIu64, crypt_get_data_offset(cd) << SECTOR_SHIFT);
+	/* caller thread and one worker thread */
+	r = crypt_threadpool_init(cd, &pf->tp, 2);
+	if (r)
+		goto err;
 
-	if (!rh->offset && rp->type == REENC_PROTECTION_DATASHIFT && rh->jobj_segment_moved) {
-		crypt_storage_wrapper_destroy(rh->cw1);
+	log_dbg(cd, "Using pipelined reencryption with hotzone prefetch.");
+	rh->pf = pf;
+	return 0;
+err:
+	reencrypt_prefetch_destroy(pf);
+	return r;
+}
+
+static int reencrypt_prefetch_job(void *arg, unsigned int job __attribute__((unused)))
+{
+	struct reenc_prefetch *pf = arg;
+
+	pf->r = 0;
+	pf->read = crypt_storage_wrapper_read(pf->cw, pf->offset, pf->buffer, pf->length);
+	if (pf->read < 0)
+		return 0;
+
+	if (pf->raw)
+		memcpy(pf->raw, pf->buffer, pf->read);
+
+	if (pf->ch)
+		pf->csum_r = crypt_hash_many(pf->ch, NULL, 0, NULL, 0, pf->buffer, pf->csum_block_size,
+					     pf->read / pf->csum_block_size, pf->checksums,
+					     pf->csum_hash_size, pf->csum_hash_size) ? -EINVAL : 0;
+
+	pf->r = crypt_storage_wrapper_decrypt(pf->cw, pf->offset, pf->buffer, pf->read);
+	return 0;
+}
+
+/* The same as reencrypt_context_update() for modes supporting prefetch */
+static bool reencrypt_next_hotzone(const struct luks2_reencrypt *rh,
+		uint64_t *offset, uint64_t *length)
+{
+	uint64_t read = (uint64_t)rh->read;
+
+	if (rh->progress + read >= rh->device_size)
+		return false;
+
+	if (rh->direction == CRYPT_REENCRYPT_BACKWARD) {
+		*length = rh->offset < rh->length ? rh->offset : rh->length;
+		*offset = rh->offset - *length;
+	} else {
+		*offset = rh->offset + read;
+		if (*offset > rh->device_size)
+			return false;
+		*length = rh->device_size - *offset < rh->length ?
+			  rh->device_size - *offset : rh->length;
+	}
+
+	return *length > 0;
+}
+
+/* Returns true if the area does not intersect any range used by upper layer */
+static bool reencrypt_area_unused(const struct luks2_reencrypt *rh,
+		uint64_t offset, uint64_t length)
+{
+	size_t lo = 0, hi = rh->used_ranges_count, mid;
+
+	if (!rh->used_ranges_set || !length)
+		return false;
+
+	/* first range ending after offset */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rh->used_ranges[mid].offset + rh->used_ranges[mid].length <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo == rh->used_ranges_count || rh->used_ranges[lo].offset >= offset + length;
+}
+
+static void reencrypt_prefetch_start(struct crypt_device *cd,
+		struct luks2_reencrypt *rh)
+{
+	struct reenc_prefetch *pf = rh->pf;
+
+	if (!pf || !reencrypt_next_hotzone(rh, &pf->offset, &pf->length) ||
+	    reencrypt_area_unused(rh, pf->offset, pf->length))
+		return;
+
+	log_dbg(cd, "Prefetching hotzone at offset %" PRIu64 ", size %" PRIu64 ".",
+		pf->offset, pf->length);
+
+	pf->running = !crypt_threadpool_start(pf->tp, 1, reencrypt_prefetch_job, pf);
+}
+
+/* Returns true if the current hotzone was prefetched */
+static bool reencrypt_prefetch_finish(struct crypt_device *cd,
+		struct luks2_reencrypt *rh)
+{
+	struct reenc_prefetch *pf = rh->pf;
+
+	if (!pf || !pf->running)
+		return false;
+
+	crypt_threadpool_wait(pf->tp);
+	pf->running = false;
+
+	if (pf->offset != rh->offset || pf->length != rh->length) {
+		log_dbg(cd, "Dropping prefetched hotzone at offset %" PRIu64 ".", pf->offset);
+		return false;
+	}
+
+	return true;
+}
+
+static int reencrypt_verify_init(struct crypt_device *cd,
+		struct luks2_hdr *hdr,
+		struct luks2_reencrypt *rh)
+{
+	struct reenc_verify *v;
+	size_t alignment = device_alignment(crypt_data_device(cd));
+	int r;
+
+	if (!rh->verify_percent)
+		return 0;
+
+	/*
+	 * Online device can be written by upper layer after the hotzone is finished,
+	 * data shift moves data across hotzone boundaries.
+	 */
+	if (rh->online || rh->rp.type == REENC_PROTECTION_DATASHIFT ||
+	    crypt_storage_wrapper_get_type(rh->cw2) == DMCRYPT) {
+		log_dbg(cd, "Read back verification not supported in this mode.");
+		return 0;
+	}
+
+	v = crypt_zalloc(sizeof(*v));
+	if (!v)
+		return -ENOMEM;
+
+	r = crypt_storage_wrapper_init(cd, &v->cw, crypt_data_device(cd),
+			reencrypt_get_data_offset_new(hdr),
+			crypt_get_iv_offset(cd),
+			reencrypt_get_sector_size_new(hdr),
+			reencrypt_segment_cipher_new(hdr),
+			crypt_volume_key_by_id(rh->vks, rh->digest_new),
+			rh->wflags2 | OPEN_PRIVATE | OPEN_READONLY | DISABLE_DMCRYPT);
+	if (r)
+		goto err;
+
+	r = -ENOMEM;
+	v->buffer_len = reencrypt_buffer_length(rh);
+	if (posix_memalign(&v->expected[0], alignment, v->buffer_len) ||
+	    posix_memalign(&v->expected[1], alignment, v->buffer_len) ||
+	    posix_memalign(&v->buffer, alignment, REENC_VERIFY_BLOCK))
+		goto err;
+
+	/* caller thread and one worker thread */
+	r = crypt_threadpool_init(cd, &v->tp, 2);
+	if (r)
+		goto err;
+
+	v->percent = rh->verify_percent;
+	log_dbg(cd, "Verifying %u%% of every reencrypted hotzone.", v->percent);
+	rh->verify = v;
+	return 0;
+err:
+	reencrypt_verify_destroy(v);
+	return r;
+}
+
+static int reencrypt_verify_job(void *arg, unsigned int job __attribute__((unused)))
+{
+	struct reenc_verify *v = arg;
+	unsigned int i = v->next ^ 1;
+	const char *expected = v->expected[i];
+	uint64_t block, blocks, offset, length;
+	ssize_t read;
+
+	v->r = 0;
+	blocks = (v->length[i] + REENC_VERIFY_BLOCK - 1) / REENC_VERIFY_BLOCK;
+
+	for (block = 0; block < blocks; block++) {
+		/* evenly spread sample, the first block is always checked */
+		if ((block * v->percent) % 100 >= v->percent)
+			continue;
+
+		offset = block * REENC_VERIFY_BLOCK;
+		length = v->length[i] - offset < REENC_VERIFY_BLOCK ? v->length[i] - offset : REENC_VERIFY_BLOCK;
+
+		read = crypt_storage_wrapper_read_decrypt(v->cw, v->offset[i] + offset, v->buffer, length);
+		crypt_storage_wrapper_drop_cache(v->cw, v->offset[i] + offset, length);
+		if (read < 0 || (uint64_t)read != length)
+			v->r = -EIO;
+		else if (memcmp(v->buffer, expected + offset, length))
+			v->r = -EINVAL;
+
+		if (v->r) {
+			v->failed_offset = v->offset[i] + offset;
+			break;
+		}
+		v->verified += length;
+	}
+
+	return 0;
+}
+
+/* Keep plaintext of the current hotzone, must be called before encryption */
+static void reencrypt_verify_prepare(struct luks2_reencrypt *rh)
+{
+	struct reenc_verify *v = rh->verify;
+
+	if (!v || rh->read <= 0 || (size_t)rh->read > v->buffer_len)
+		return;
+
+	memcpy(v->expected[v->next], rh->reenc_buffer, rh->read);
+	v->offset[v->next] = rh->offset;
+	v->length[v->next] = rh->read;
+	v->prepared = true;
+}
+
+/* Collect result of the running check */
+static int reencrypt_verify_finish(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	struct reenc_verify *v = rh->verify;
+
+	if (!v || !v->running)
+		return 0;
+
+	crypt_threadpool_wait(v->tp);
+	v->running = false;
+
+	if (v->r == -EIO)
+		log_err(cd, _("Failed to read back reencrypted area starting at %" PRIu64 "."),
+			v->failed_offset);
+	else if (v->r)
+		log_err(cd, _("Verification of reencrypted area starting at %" PRIu64 " failed."),
+			v->failed_offset);
+
+	return v->r;
+}
+
+/* Start check of the finished hotzone, must be called after data sync */
+static int reencrypt_verify_start(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	struct reenc_verify *v = rh->verify;
+	int r;
+
+	if (!v || !v->prepared)
+		return 0;
+
+	r = reencrypt_verify_finish(cd, rh);
+	if (r)
+		return r;
+
+	v->prepared = false;
+	v->next ^= 1;
+	v->running = !crypt_threadpool_start(v->tp, 1, reencrypt_verify_job, v);
+	if (!v->running)
+		log_dbg(cd, "Failed to start read back verification of hotzone at offset %" PRIu64 ".",
+			v->offset[v->next ^ 1]);
+
+	return 0;
+}
+
+/*
+ * Metadata commit after finished hotzone. Only "none" resilience can postpone it.
+ * Other types must commit every hotzone: the next hotzone overwrites the protection
+ * area (journal or checksums) before its metadata are written, so an uncommitted
+ * finished hotzone would be recovered with protection data of another hotzone.
+ */
+static bool reencrypt_commit_finished(struct luks2_reencrypt *rh, const struct reenc_protection *rp)
+{
+	if (rp->type != REENC_PROTECTION_NONE)
+		return true;
+
+	if (!rh->commit_steps && !rh->commit_ms)
+		return false;
+
+	rh->uncommitted_steps++;
+
+	if (rh->commit_steps && rh->uncommitted_steps >= rh->commit_steps)
+		return true;
+
+	if (rh->commit_ms && reencrypt_usec() - rh->last_commit_usec >= (uint64_t)rh->commit_ms * 1000)
+		return true;
+
+	return false;
+}
+
+static void reencrypt_throttle_init(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	struct stat st;
+
+	rh->throttle_usec = reencrypt_usec();
+	rh->throttle_progress = rh->progress;
+
+	if (!rh->max_latency_ms)
+		return;
+
+	if (stat(device_path(crypt_data_device(cd)), &st) < 0 || !S_ISBLK(st.st_mode) ||
+	    !crypt_dev_io_stats(major(st.st_rdev), minor(st.st_rdev), &rh->dev_ios, &rh->dev_ticks)) {
+		log_dbg(cd, "Cannot read data device I/O statistics, latency target ignored.");
+		rh->max_latency_ms = 0;
+		return;
+	}
+
+	rh->dev_major = major(st.st_rdev);
+	rh->dev_minor = minor(st.st_rdev);
+
+	/* shrinking hotzone uses the same limits as adaptive size (it never grows back) */
+	if (!rh->max_length && !rh->online_batch_steps)
+		reencrypt_adaptive_init(cd, rh);
+}
+
+static void reencrypt_sleep_usec(uint64_t usec)
+{
+	struct timespec ts = {
+		.tv_sec = usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/* Called after every step, before reencrypt_context_update() calculates next hotzone. */
+static void reencrypt_throttle(struct crypt_device *cd, struct luks2_reencrypt *rh)
+{
+	uint64_t ios, ticks, latency, expected, elapsed;
+
+	if (rh->max_latency_ms &&
+	    crypt_dev_io_stats(rh->dev_major, rh->dev_minor, &ios, &ticks) &&
+	    ios > rh->dev_ios) {
+		latency = (ticks - rh->dev_ticks) / (ios - rh->dev_ios);
+		if (latency > rh->max_latency_ms) {
+			if (rh->max_length && rh->length / 2 >= rh->min_length)
+				rh->length = (rh->length / 2) - (rh->length / 2) % rh->alignment;
+			log_dbg(cd, "Device latency %" PRIu64 " ms over target, hotzone size %" PRIu64 ", pausing.",
+				latency, rh->length);
+			/* let foreground I/O drain for the time of last step */
+			reencrypt_sleep_usec(rh->step_usec);
+		}
+		/* statistics include also the sleep period */
+		crypt_dev_io_stats(rh->dev_major, rh->dev_minor, &rh->dev_ios, &rh->dev_ticks);
+	}
+
+	if (!rh->max_rate_mbs)
+		return;
+
+	expected = (rh->progress - rh->throttle_progress) * 1000000 / ((uint64_t)rh->max_rate_mbs << 20);
+	elapsed = reencrypt_usec() - rh->throttle_usec;
+	if (expected > elapsed)
+		reencrypt_sleep_usec(expected - elapsed);
+}
+
+static int reencrypt_ioprio_set(struct crypt_device *cd, uint32_t ioprio)
+{
+	int r;
+
+	r = syscall(SYS_ioprio_get, REENC_IOPRIO_WHO_PROCESS, 0);
+	if (r < 0 || syscall(SYS_ioprio_set, REENC_IOPRIO_WHO_PROCESS, 0, ioprio) < 0) {
+		log_dbg(cd, "Cannot set I/O priority %u.", ioprio);
+		return -1;
+	}
+
+	return r;
+}
+
+/*
+ * Hotzone not used by upper layer (filesystem) is neither read nor written,
+ * only segments are updated. Metadata are written with the next processed
+ * hotzone (its commit implies the skipped one), or on teardown.
+ */
+static reenc_status_t reencrypt_step_skip(struct crypt_device *cd,
+		struct luks2_hdr *hdr,
+		struct luks2_reencrypt *rh)
+{
+	log_dbg(cd, "Skipping unused hotzone at offset %" PRIu64 ", size %" PRIu64 ".",
+		rh->offset, rh->length);
+
+	/* drop data prefetched by older hotzone size, if any */
+	reencrypt_prefetch_finish(cd, rh);
+
+	rh->read = rh->length;
+	if (reencrypt_assign_segments(cd, hdr, rh, 0, 0)) {
+		log_err(cd, _("Failed to update metadata after current reencryption hotzone completed."));
+		return REENC_ERR;
+	}
+
+	rh->commit_pending = true;
+	/* no throughput sample for adaptive hotzone and rate limit */
+	rh->step_usec = 0;
+	rh->throttle_progress += rh->length;
+
+	return REENC_OK;
+}
+
+/*
+ * Online reencryption with batched device stack refresh. Overlay device maps
+ * the whole batch area (online_batch_steps hotzones) through the hotzone device,
+ * which stays suspended until the last hotzone of the batch is finished.
+ * Segments in memory are set to the batch area only to build overlay table.
+ */
+static reenc_status_t reencrypt_online_batch_open(struct crypt_device *cd,
+		struct luks2_hdr *hdr,
+		struct luks2_reencrypt *rh,
+		uint64_t device_size)
+{
+	uint64_t offset = rh->offset, length = rh->length, batch;
+	reenc_status_t rs;
+
+	if (!rh->online_batch_steps)
+		return reencrypt_refresh_overlay_devices(cd, hdr, rh->overlay_name, rh->hotzone_name,
+							 rh->vks, rh->device_size, rh->flags);
+
+	batch = length * rh->online_batch_steps;
+	if (rh->direction == CRYPT_REENCRYPT_FORWARD) {
+		rh->batch_start = offset;
+		rh->batch_end = device_size - offset < batch ? device_size : offset + batch;
+	} else {
+		rh->batch_end = offset + length;
+		rh->batch_start = rh->batch_end < batch ? 0 : rh->batch_end - batch;
+	}
+
+	log_dbg(cd, "Opening online reencryption batch %" PRIu64 " - %" PRIu64 ".",
+		rh->batch_start, rh->batch_end);
+
+	json_object_put(rh->jobj_segs_post);
+	rh->jobj_segs_post = NULL;
+	rh->offset = rh->batch_start;
+	rh->length = rh->batch_end - rh->batch_start;
+	if (reencrypt_make_segments(cd, hdr, rh, device_size) ||
+	    reencrypt_assign_segments(cd, hdr, rh, 1, 0))
+		rs = REENC_ERR;
+	else
+		rs = reencrypt_refresh_overlay_devices(cd, hdr, rh->overlay_name, rh->hotzone_name,
+						       rh->vks, rh->device_size, rh->flags);
+
+	json_object_put(rh->jobj_segs_post);
+	rh->jobj_segs_post = NULL;
+	rh->offset = offset;
+	rh->length = length;
+	if (rs != REENC_OK)
+		return rs;
+
+	if (reencrypt_make_segments(cd, hdr, rh, device_size) ||
+	    reencrypt_assign_segments(cd, hdr, rh, 1, 0)) {
+		log_err(cd, _("Failed to set device segments for next reencryption hotzone."));
+		return REENC_ERR;
+	}
+
+	rh->batch_open = true;
+	return REENC_OK;
+}
+
+/* Returns true if hotzone device should be resumed after the finished hotzone */
+static bool reencrypt_online_batch_close(struct luks2_reencrypt *rh)
+{
+	if (!rh->online_batch_steps)
+		return true;
+
+	if (rh->direction == CRYPT_REENCRYPT_FORWARD ?
+	    rh->offset + (uint64_t)rh->read < rh->batch_end : rh->offset > rh->batch_start)
+		return false;
+
+	rh->batch_open = false;
+	return true;
+}
+
+static reenc_status_t reencrypt_step(struct crypt_device *cd,
+		struct luks2_hdr *hdr,
+		struct luks2_reencrypt *rh,
+		uint64_t device_size,
+		bool online)
+{
+	int r, decrypt_r = 0;
+	struct reenc_protection *rp;
+	void *swap_buffer, *raw_buffer;
+	bool prefetched, checksummed = false;
+	uint64_t step_start, t;
+	ssize_t written;
+	bool commit;
+
+	assert(hdr);
+	assert(rh);
+
+	rp = &rh->rp;
+	rh->step_usec = rh->read_usec = rh->crypt_usec = rh->write_usec = 0;
+	step_start = reencrypt_usec();
+
+	/* in memory only */
+	r = reencrypt_make_segments(cd, hdr, rh, device_size);
+	if (r)
+		return REENC_ERR;
+
+	r = reencrypt_assign_segments(cd, hdr, rh, 1, 0);
+	if (r) {
+		log_err(cd, _("Failed to set device segments for next reencryption hotzone."));
+		return REENC_ERR;
+	}
+	rh->commit_usec = reencrypt_usec() - step_start;
+
+	if (!online && reencrypt_area_unused(rh, rh->offset, rh->length))
+		return reencrypt_step_skip(cd, hdr, rh);
+
+	log_dbg(cd, "Reencrypting chunk starting at offset: %" PRIu64 ", size :%" PRIu64 ".", rh->offset, rh->length);
+	log_dbg(cd, "data_offset: %" PRIu64, crypt_get_data_offset(cd) << SECTOR_SHIFT);
+
+	if (!rh->offset && rp->type == REENC_PROTECTION_DATASHIFT && rh->jobj_segment_moved) {
+		crypt_storage_wrapper_destroy(rh->cw1);
 		log_dbg(cd, "Reinitializing old segment storage wrapper for moved segment.");
 		r = crypt_storage_wrapper_init(cd, &rh->cw1, crypt_data_device(cd),
 				LUKS2_reencrypt_get_data_offset_moved(hdr),
@@ -3940,14 +5043,40 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 		return REENC_ROLLBACK;
 	}
 
-	if (online) {
-		r = reencrypt_refresh_overlay_devices(cd, hdr, rh->overlay_name, rh->hotzone_name, rh->vks, rh->device_size, rh->flags);
+	if (online && !rh->batch_open) {
+		r = reencrypt_online_batch_open(cd, hdr, rh, device_size);
 		/* Teardown overlay devices with dm-error. None bio shall pass! */
 		if (r != REENC_OK)
 			return r;
 	}
 
-	rh->read = crypt_storage_wrapper_read(rh->cw1, rh->offset, rh->reenc_buffer, rh->length);
+	t = reencrypt_usec();
+	prefetched = reencrypt_prefetch_finish(cd, rh);
+	if (prefetched) {
+		/* data already read and decrypted, keep buffer with raw data for protection */
+		swap_buffer = rh->reenc_buffer;
+		rh->reenc_buffer = rh->pf->buffer;
+		rh->pf->buffer = swap_buffer;
+		rh->read = rh->pf->read;
+		decrypt_r = rh->pf->r;
+		raw_buffer = rh->pf->raw ? rh->pf->raw : rh->reenc_buffer;
+		/* raw data are not kept for checksum resilience, only checksums */
+		if (rh->pf->ch && rh->read > 0) {
+			if (rh->pf->csum_r) {
+				log_err(cd, _("Failed to write reencryption resilience metadata."));
+				return REENC_ROLLBACK;
+			}
+			swap_buffer = rp->p.csum.checksums;
+			rp->p.csum.checksums = rh->pf->checksums;
+			rh->pf->checksums = swap_buffer;
+			checksummed = true;
+		}
+	} else {
+		rh->read = crypt_storage_wrapper_read(rh->cw1, rh->offset, rh->reenc_buffer, rh->length);
+		raw_buffer = rh->reenc_buffer;
+	}
+	rh->read_usec = reencrypt_usec() - t;
+
 	if (rh->read < 0) {
 		/* severity normal */
 		log_err(cd, _("Failed to read hotzone area starting at %" PRIu64 "."), rh->offset);
@@ -3955,39 +5084,87 @@ static reenc_status_t reencrypt_step(struct crypt_device *cd,
 	}
 
 	/* metadata commit point */
-	r = reencrypt_hotzone_protect_final(cd, hdr, rh->reenc_keyslot, rp, rh->reenc_buffer, rh->read);
+	t = reencrypt_usec();
+	r = reencrypt_hotzone_protect_final(cd, hdr, rh->reenc_keyslot, rp, rh->tp,
+					    raw_buffer, rh->read, checksummed);
+	rh->commit_usec += reencrypt_usec() - t;
 	if (r < 0) {
 		/* severity normal */
 		log_err(cd, _("Failed to write reencryption resilience metadata."));
 		return REENC_ROLLBACK;
 	}
 
-	r = crypt_storage_wrapper_decrypt(rh->cw1, rh->offset, rh->reenc_buffer, rh->read);
+	/* next hotzone is read while this one is written and committed */
+	reencrypt_prefetch_start(cd, rh);
+
+	t = reencrypt_usec();
+	if (prefetched)
+		r = decrypt_r;
+	else
+		r = crypt_storage_wrapper_decrypt(rh->cw1, rh->offset, rh->reenc_buffer, rh->read);
 	if (r) {
 		/* severity normal */
 		log_err(cd, _("Decryption failed."));
 		return REENC_ROLLBACK;
 	}
-	if (rh->read != crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read)) {
+
+	reencrypt_verify_prepare(rh);
+
+	/* with dm-crypt wrapper encryption is done by the kernel during write */
+	if (crypt_storage_wrapper_get_type(rh->cw2) != DMCRYPT &&
+	    crypt_storage_wrapper_encrypt(rh->cw2, rh->offset, rh->reenc_buffer, rh->read)) {
+		/* severity normal */
+		log_err(cd, _("Encryption failed."));
+		return REENC_ROLLBACK;
+	}
+	rh->crypt_usec = reencrypt_usec() - t;
+
+	t = reencrypt_usec();
+	if (crypt_storage_wrapper_get_type(rh->cw2) == DMCRYPT)
+		written = crypt_storage_wrapper_encrypt_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read);
+	else
+		written = crypt_storage_wrapper_write(rh->cw2, rh->offset, rh->reenc_buffer, rh->read);
+	if (rh->read != written) {
 		/* severity fatal */
 		log_err(cd, _("Failed to write hotzone area starting at %" PRIu64 "."), rh->offset);
 		return REENC_FATAL;
 	}
 
-	if (rp->type != REENC_PROTECTION_NONE && crypt_storage_wrapper_datasync(rh->cw2)) {
+	commit = reencrypt_commit_finished(rh, rp);
+
+	if ((rp->type != REENC_PROTECTION_NONE || commit) && crypt_storage_wrapper_datasync(rh->cw2)) {
 		log_err(cd, _("Failed to sync data."));
 		return REENC_FATAL;
 	}
 
+	/* the hotzone is not going to be accessed again (verify reads from disk) */
+	crypt_storage_wrapper_drop_cache(rh->cw1, rh->offset, rh->read);
+	crypt_storage_wrapper_drop_cache(rh->cw2, rh->offset, rh->read);
+	rh->write_usec = reencrypt_usec() - t;
+
 	/* metadata commit safe point */
-	r = reencrypt_assign_segments(cd, hdr, rh, 0, rp->type != REENC_PROTECTION_NONE);
+	t = reencrypt_usec();
+	r = reencrypt_assign_segments(cd, hdr, rh, 0, commit);
 	if (r) {
 		/* severity fatal */
 		log_err(cd, _("Failed to update metadata after current reencryption hotzone completed."));
 		return REENC_FATAL;
 	}
+	rh->commit_usec += reencrypt_usec() - t;
+
+	if (commit) {
+		rh->uncommitted_steps = 0;
+		rh->last_commit_usec = reencrypt_usec();
+	}
+	rh->commit_pending = !commit;
+
+	/* finished hotzone is read back while the next one is processed */
+	if (reencrypt_verify_start(cd, rh))
+		return REENC_ERR;
+
+	rh->step_usec = reencrypt_usec() - step_start;
 
-	if (online) {
+	if (online && reencrypt_online_batch_close(rh)) {
 		/* severity normal */
 		log_dbg(cd, "Resuming device %s", rh->hotzone_name);
 		r = dm_resume_device(cd, rh->hotzone_name, DM_RESUME_PRIVATE);
@@ -4025,6 +5202,25 @@ static int reencrypt_erase_backup_segments(struct crypt_device *cd,
 	return 0;
 }
 
+static int reencrypt_wipe_area(struct crypt_device *cd, struct luks2_reencrypt *rh,
+		uint64_t offset, uint64_t length)
+{
+	int r;
+
+	if (rh->discard_unused) {
+		log_dbg(cd, "Discarding %" PRIu64 " bytes of data at offset %" PRIu64,
+			length, offset);
+		r = crypt_discard_device(cd, crypt_data_device(cd), offset, length);
+		if (r != -ENOTSUP)
+			return r;
+	}
+
+	log_dbg(cd, "Wiping %" PRIu64 " bytes of data at offset %" PRIu64,
+		length, offset);
+	return crypt_wipe_device(cd, crypt_data_device(cd), CRYPT_WIPE_RANDOM,
+				 offset, length, 1024 * 1024, NULL, NULL);
+}
+
 static int reencrypt_wipe_unused_device_area(struct crypt_device *cd, struct luks2_reencrypt *rh)
 {
 	uint64_t offset, length, dev_size;
@@ -4036,10 +5232,8 @@ static int reencrypt_wipe_unused_device_area(struct crypt_device *cd, struct luk
 	if (rh->jobj_segment_moved && rh->mode == CRYPT_REENCRYPT_ENCRYPT) {
 		offset = json_segment_get_offset(rh->jobj_segment_moved, 0);
 		length = json_segment_get_size(rh->jobj_segment_moved, 0);
-		log_dbg(cd, "Wiping %" PRIu64 " bytes of backup segment data at offset %" PRIu64,
-			length, offset);
-		r = crypt_wipe_device(cd, crypt_data_device(cd), CRYPT_WIPE_RANDOM,
-				offset, length, 1024 * 1024, NULL, NULL);
+		log_dbg(cd, "Removing backup segment data.");
+		r = reencrypt_wipe_area(cd, rh, offset, length);
 	}
 
 	if (r < 0)
@@ -4055,10 +5249,7 @@ static int reencrypt_wipe_unused_device_area(struct crypt_device *cd, struct luk
 
 		offset = dev_size - data_shift_value(&rh->rp);
 		length = data_shift_value(&rh->rp);
-		log_dbg(cd, "Wiping %" PRIu64 " bytes of data at offset %" PRIu64,
-			length, offset);
-		r = crypt_wipe_device(cd, crypt_data_device(cd), CRYPT_WIPE_RANDOM,
-				offset, length, 1024 * 1024, NULL, NULL);
+		r = reencrypt_wipe_area(cd, rh, offset, length);
 	}
 
 	return r;
@@ -4070,7 +5261,7 @@ static int reencrypt_teardown_ok(struct crypt_device *cd, struct luks2_hdr *hdr,
 	uint32_t dmt_flags;
 	bool finished = !(rh->device_size > rh->progress);
 
-	if (rh->rp.type == REENC_PROTECTION_NONE &&
+	if ((rh->rp.type == REENC_PROTECTION_NONE || rh->commit_pending) &&
 	    LUKS2_hdr_write(cd, hdr)) {
 		log_err(cd, _("Failed to write LUKS2 metadata."));
 		return -EINVAL;
@@ -4174,8 +5365,11 @@ int crypt_reencrypt_run(
 	crypt_reencrypt_info ri;
 	struct luks2_hdr *hdr;
 	struct luks2_reencrypt *rh;
+	struct crypt_trace trace;
 	reenc_status_t rs;
+	uint64_t step_length;
 	bool quit = false;
+	int ioprio = -1;
 
 	if (onlyLUKS2mask(cd, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
 		return -EINVAL;
@@ -4205,11 +5399,42 @@ int crypt_reencrypt_run(
 
 	rs = REENC_OK;
 
+	/*
+	 * I/O priority is per thread, worker threads inherit it on creation.
+	 * Set it before prefetch and verify workers are started.
+	 */
+	if (rh->ioprio)
+		ioprio = reencrypt_ioprio_set(cd, rh->ioprio);
+
+	if (reencrypt_prefetch_init(cd, hdr, rh))
+		log_dbg(cd, "Failed to initialize hotzone prefetch, continuing without it.");
+
+	r = reencrypt_verify_init(cd, hdr, rh);
+	if (r) {
+		log_err(cd, _("Failed to initialize read back verification."));
+		reencrypt_prefetch_destroy(rh->pf);
+		rh->pf = NULL;
+		if (ioprio >= 0)
+			reencrypt_ioprio_set(cd, ioprio);
+		return r;
+	}
+
+	if (rh->rp.type == REENC_PROTECTION_CHECKSUM && crypt_get_threads(cd) > 1 &&
+	    crypt_threadpool_init(cd, &rh->tp, crypt_get_threads(cd)))
+		log_dbg(cd, "Failed to initialize thread pool, checksums will be calculated serially.");
+
+	rh->last_commit_usec = reencrypt_usec();
+	reencrypt_throttle_init(cd, rh);
+
 	if (progress && progress(rh->device_size, rh->progress, usrptr))
 		quit = true;
 
-	while (!quit && (rh->device_size > rh->progress)) {
+	/* hotzone device is suspended inside open batch, it must be finished */
+	while ((!quit || rh->batch_open) && (rh->device_size > rh->progress)) {
+		step_length = rh->length;
+		crypt_trace_begin(&trace, CRYPT_TRACE_REENCRYPT_STEP, crypt_reencrypt_mode_to_str(rh->mode));
 		rs = reencrypt_step(cd, hdr, rh, rh->device_size, rh->online);
+		crypt_trace_end(cd, &trace, step_length, rs == REENC_OK ? 0 : -EIO);
 		if (rs != REENC_OK)
 			break;
 
@@ -4217,6 +5442,10 @@ int crypt_reencrypt_run(
 		if (progress && progress(rh->device_size, rh->progress, usrptr))
 			quit = true;
 
+		reencrypt_adaptive_update(cd, rh);
+		if (!quit)
+			reencrypt_throttle(cd, rh);
+
 		r = reencrypt_context_update(cd, rh);
 		if (r) {
 			log_err(cd, _("Failed to update reencryption context."));
@@ -4228,6 +5457,22 @@ int crypt_reencrypt_run(
 		log_dbg(cd, "Next reencryption chunk size will be %" PRIu64 " sectors).", rh->length);
 	}
 
+	reencrypt_prefetch_destroy(rh->pf);
+	rh->pf = NULL;
+	crypt_threadpool_destroy(rh->tp);
+	rh->tp = NULL;
+
+	/* the last finished hotzone */
+	if (reencrypt_verify_finish(cd, rh) && rs == REENC_OK)
+		rs = REENC_ERR;
+	if (rh->verify)
+		log_dbg(cd, "Verified %" PRIu64 " bytes of reencrypted data.", rh->verify->verified);
+	reencrypt_verify_destroy(rh->verify);
+	rh->verify = NULL;
+
+	if (ioprio >= 0)
+		reencrypt_ioprio_set(cd, ioprio);
+
 	r = reencrypt_teardown(cd, hdr, rh, rs, quit, progress, usrptr);
 	return r;
 #else
@@ -4242,6 +5487,115 @@ int crypt_reencrypt(
 {
 	return crypt_reencrypt_run(cd, progress, NULL);
 }
+
+int crypt_reencrypt_step_stats(struct crypt_device *cd,
+	struct crypt_reencrypt_step_stats *stats)
+{
+#if USE_LUKS2_REENCRYPTION
+	struct luks2_reencrypt *rh;
+
+	if (!cd || !stats)
+		return -EINVAL;
+
+	rh = crypt_get_luks2_reencrypt(cd);
+	if (!rh)
+		return -EINVAL;
+
+	if (!rh->step_usec)
+		return -ENOENT;
+
+	stats->offset = rh->offset;
+	stats->length = rh->read > 0 ? (uint64_t)rh->read : 0;
+	stats->read_us = rh->read_usec;
+	stats->crypt_us = rh->crypt_usec;
+	stats->write_us = rh->write_usec;
+	stats->commit_us = rh->commit_usec;
+	stats->step_us = rh->step_usec;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+#if USE_LUKS2_REENCRYPTION
+static int reencrypt_range_cmp(const void *a, const void *b)
+{
+	const struct crypt_reencrypt_range *ra = a, *rb = b;
+
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+	return 0;
+}
+#endif
+
+int crypt_reencrypt_set_used_ranges(struct crypt_device *cd,
+	const struct crypt_reencrypt_range *ranges,
+	size_t count)
+{
+#if USE_LUKS2_REENCRYPTION
+	struct luks2_reencrypt *rh;
+	struct crypt_reencrypt_range *r = NULL;
+	size_t i, n = 0;
+
+	if (!cd || (count && !ranges))
+		return -EINVAL;
+
+	rh = crypt_get_luks2_reencrypt(cd);
+	if (!rh) {
+		log_err(cd, _("Missing or invalid reencrypt context."));
+		return -EINVAL;
+	}
+
+	if (!ranges) {
+		free(rh->used_ranges);
+		rh->used_ranges = NULL;
+		rh->used_ranges_count = 0;
+		rh->used_ranges_set = false;
+		return 0;
+	}
+
+	/* data are moved across hotzones, online device can be written any time */
+	if (rh->online || rh->rp.type == REENC_PROTECTION_DATASHIFT) {
+		log_err(cd, _("Skipping of unused areas is supported only for offline reencryption without data shift."));
+		return -ENOTSUP;
+	}
+
+	if (count) {
+		r = malloc(count * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+		memcpy(r, ranges, count * sizeof(*r));
+		qsort(r, count, sizeof(*r), reencrypt_range_cmp);
+
+		for (i = 0; i < count; i++) {
+			if (r[i].offset + r[i].length < r[i].offset) {
+				free(r);
+				return -EINVAL;
+			}
+			if (!r[i].length)
+				continue;
+			if (n && r[i].offset <= r[n - 1].offset + r[n - 1].length) {
+				if (r[i].offset + r[i].length > r[n - 1].offset + r[n - 1].length)
+					r[n - 1].length = r[i].offset + r[i].length - r[n - 1].offset;
+				continue;
+			}
+			r[n++] = r[i];
+		}
+	}
+
+	free(rh->used_ranges);
+	rh->used_ranges = r;
+	rh->used_ranges_count = n;
+	rh->used_ranges_set = true;
+
+	log_dbg(cd, "Using map of %zu used data areas, unused hotzones will be skipped.", n);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
 #if USE_LUKS2_REENCRYPTION
 static int reencrypt_recovery(struct crypt_device *cd,
 		struct luks2_hdr *hdr,
@@ -4346,7 +5700,7 @@ int LUKS2_reencrypt_locked_recovery_by_passphrase(struct crypt_device *cd,
 	uint64_t minimal_size, device_size;
 	int keyslot, r = -EINVAL;
 	struct luks2_hdr *hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
-	struct volume_key *vk = NULL, *_vks = NULL;
+	struct volume_key *_vks = NULL;
 
 	log_dbg(cd, "Entering reencryption crash recovery.");
 
@@ -4359,14 +5713,10 @@ int LUKS2_reencrypt_locked_recovery_by_passphrase(struct crypt_device *cd,
 		goto out;
 	keyslot = r;
 
-	if (crypt_use_keyring_for_vk(cd))
-		vk = _vks;
-
-	while (vk) {
-		r = LUKS2_volume_key_load_in_keyring_by_digest(cd, vk, crypt_volume_key_get_id(vk));
+	if (crypt_use_keyring_for_vk(cd)) {
+		r = LUKS2_volume_keys_load_in_keyring(cd, _vks);
 		if (r < 0)
 			goto out;
-		vk = crypt_volume_key_next(vk);
 	}
 
 	if (LUKS2_reencrypt_check_device_size(cd, hdr, minimal_size, &device_size, true, false))
@@ -4384,6 +5734,26 @@ out:
 	return r < 0 ? r : keyslot;
 }
 #endif
+/*
+ * Status of reencryption initialized in the context, no metadata lookup.
+ * Returns CRYPT_REENCRYPT_INVALID if there is no loaded reencryption.
+ */
+crypt_reencrypt_info LUKS2_reencrypt_get_params_by_context(struct luks2_reencrypt *rh,
+	struct crypt_params_reencrypt *params)
+{
+#if USE_LUKS2_REENCRYPTION
+	if (!rh)
+		return CRYPT_REENCRYPT_INVALID;
+
+	if (params)
+		*params = rh->status_params;
+
+	return rh->status;
+#else
+	return CRYPT_REENCRYPT_INVALID;
+#endif
+}
+
 crypt_reencrypt_info LUKS2_reencrypt_get_params(struct luks2_hdr *hdr,
 	struct crypt_params_reencrypt *params)
 {
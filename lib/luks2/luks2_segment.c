@@ -379,6 +379,7 @@ int LUKS2_segments_set(struct crypt_device *cd, struct luks2_hdr *hdr,
 		       json_object *jobj_segments, int commit)
 {
 	json_object_object_add(hdr->jobj, "segments", jobj_segments);
+	LUKS2_hdr_index_invalidate();
 
 	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
 }
@@ -424,3 +425,127 @@ bool json_segment_cmp(json_object *jobj_segment_1, json_object *jobj_segment_2)
 
 	return true;
 }
+
+static bool json_segment_size_is_dynamic(json_object *jobj_segment)
+{
+	json_object *jobj;
+
+	return json_object_object_get_ex(jobj_segment, "size", &jobj) &&
+	       !strcmp(json_object_get_string(jobj), "dynamic");
+}
+
+/* Segment s2 directly continues s1 with identical parameters */
+static bool json_segments_mergeable(struct luks2_hdr *hdr,
+	json_object *jobj_s1, int s1, json_object *jobj_s2, int s2)
+{
+	const char *type = json_segment_type(jobj_s1);
+	uint64_t size = json_segment_get_size(jobj_s1, 0);
+
+	if (!type || !json_segment_type(jobj_s2) || strcmp(type, json_segment_type(jobj_s2)) ||
+	    json_segment_get_flags(jobj_s1) || json_segment_get_flags(jobj_s2) ||
+	    json_object_object_get_ex(jobj_s1, "integrity", NULL) ||
+	    json_object_object_get_ex(jobj_s2, "integrity", NULL) ||
+	    json_segment_size_is_dynamic(jobj_s1) ||
+	    json_segment_get_offset(jobj_s1, 0) + size != json_segment_get_offset(jobj_s2, 0) ||
+	    LUKS2_digest_by_segment(hdr, s1) != LUKS2_digest_by_segment(hdr, s2))
+		return false;
+
+	if (!strcmp(type, "linear"))
+		return true;
+
+	if (strcmp(type, "crypt") ||
+	    strcmp(json_segment_get_cipher(jobj_s1), json_segment_get_cipher(jobj_s2)) ||
+	    json_segment_get_sector_size(jobj_s1) != json_segment_get_sector_size(jobj_s2))
+		return false;
+
+	return json_segment_get_iv_offset(jobj_s1) + (size >> SECTOR_SHIFT) ==
+	       json_segment_get_iv_offset(jobj_s2);
+}
+
+/*
+ * Merge adjacent segments left after finished reencryption (or created
+ * by other tools) so the device is mapped with as few dm targets as possible.
+ * Returns number of merged segments or negative errno.
+ */
+int LUKS2_segments_compact(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	json_object *jobj_segments, *jobj_new, *jobj_cur = NULL, *jobj_next;
+	int digests[LUKS2_SEGMENT_MAX], r, s, count, cur = 0, merged = 0;
+	uint64_t len;
+
+	if (LUKS2_reencrypt_status(hdr) != CRYPT_REENCRYPT_NONE)
+		return 0;
+
+	jobj_segments = LUKS2_get_segments_jobj(hdr);
+	count = json_segments_count(jobj_segments);
+	if (count < 2 || count > (int)ARRAY_SIZE(digests))
+		return 0;
+
+	/* only active segments are merged, segments are sorted by offset */
+	for (s = 0; s < count - 1; s++)
+		if (json_segments_mergeable(hdr, json_segments_get_segment(jobj_segments, s), s,
+					    json_segments_get_segment(jobj_segments, s + 1), s + 1))
+			break;
+	if (s == count - 1)
+		return 0;
+
+	jobj_new = json_object_new_object();
+	if (!jobj_new)
+		return -ENOMEM;
+
+	for (s = 0; s < count; s++) {
+		jobj_next = json_segments_get_segment(jobj_segments, s);
+		if (!jobj_next) {
+			r = -EINVAL;
+			goto err;
+		}
+
+		if (jobj_cur && json_segments_mergeable(hdr, jobj_cur, s - 1, jobj_next, s)) {
+			len = json_segment_get_size(jobj_cur, 0) + json_segment_get_size(jobj_next, 0);
+			if (!strcmp(json_segment_type(jobj_next), "linear"))
+				jobj_cur = json_segment_create_linear(json_segment_get_offset(jobj_cur, 0),
+						json_segment_size_is_dynamic(jobj_next) ? NULL : &len, 0);
+			else
+				jobj_cur = json_segment_create_crypt(json_segment_get_offset(jobj_cur, 0),
+						json_segment_get_iv_offset(jobj_cur),
+						json_segment_size_is_dynamic(jobj_next) ? NULL : &len,
+						json_segment_get_cipher(jobj_cur),
+						json_segment_get_sector_size(jobj_cur), 0);
+			if (!jobj_cur) {
+				r = -ENOMEM;
+				goto err;
+			}
+			json_object_object_add_by_uint(jobj_new, cur - 1, jobj_cur);
+			/* merged segment must be re-read from the new object on next pass */
+			jobj_cur = json_segments_get_segment(jobj_new, cur - 1);
+			merged++;
+			continue;
+		}
+
+		digests[cur] = LUKS2_digest_by_segment(hdr, s);
+		json_object_object_add_by_uint(jobj_new, cur, json_object_get(jobj_next));
+		jobj_cur = jobj_next;
+		cur++;
+	}
+
+	r = LUKS2_digest_segment_assign(cd, hdr, CRYPT_ANY_SEGMENT, CRYPT_ANY_DIGEST, 0, 0);
+	if (r < 0)
+		goto err;
+
+	LUKS2_segments_set(cd, hdr, jobj_new, 0);
+
+	for (s = 0; s < cur; s++) {
+		if (digests[s] < 0)
+			continue;
+		r = LUKS2_digest_segment_assign(cd, hdr, s, digests[s], 1, 0);
+		if (r < 0)
+			return r;
+	}
+
+	log_dbg(cd, "Merged %d adjacent LUKS2 segments.", merged);
+
+	return merged;
+err:
+	json_object_put(jobj_new);
+	return r;
+}
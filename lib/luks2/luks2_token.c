@@ -21,8 +21,12 @@
 
 #include <ctype.h>
 #include <dlfcn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "luks2_internal.h"
+#include "utils_threadpool.h"
 
 #if USE_EXTERNAL_TOKENS
 static bool external_tokens_enabled = true;
@@ -40,10 +44,32 @@ static struct crypt_token_handler_internal token_handlers[LUKS2_TOKENS_MAX] = {
 			  .buffer_free = keyring_buffer_free,
 			  .validate = keyring_validate,
 			  .dump = keyring_dump }
-	       }
+	       },
+	  .parallel_open = true
+	},
+	/* volume key escrow builtin token */
+	{
+	  .version = 1,
+	  .u = {
+		  .v1 = { .name = LUKS2_TOKEN_ESCROW,
+			  .open = escrow_open,
+			  .buffer_free = escrow_buffer_free,
+			  .validate = escrow_validate,
+			  .dump = escrow_dump }
+	       },
+	  .parallel_open = true
 	}
 };
 
+/*
+ * Protects token_handlers lookup, registration and external handler loading.
+ * Loaded external handlers are shared by all contexts in the process, every
+ * lookup takes a reference that keeps the plugin loaded until released
+ * by LUKS2_token_handler_put(). Unused plugins are unloaded only on explicit
+ * crypt_token_external_flush() or on library unload.
+ */
+static pthread_mutex_t token_handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void crypt_token_external_disable(void)
 {
 	external_tokens_enabled = false;
@@ -114,6 +140,23 @@ static bool token_validate_v2(struct crypt_device *cd, const struct crypt_token_
 	return true;
 }
 
+/* Async open is optional, but all three symbols must be provided. */
+static bool token_validate_v3(struct crypt_device *cd, const struct crypt_token_handler_internal *h)
+{
+	const struct crypt_token_handler_v3 *token = &h->u.v3;
+
+	if (!token->open_start && !token->open_poll && !token->open_finish)
+		return false;
+
+	if (!token->open_start || !token->open_poll || !token->open_finish) {
+		log_dbg(cd, "Token handler %s provides incomplete asynchronous open interface, ignoring it.",
+			token->name);
+		return false;
+	}
+
+	return true;
+}
+
 static bool external_token_name_valid(const char *name)
 {
 	if (!*name || strlen(name) > LUKS2_TOKEN_NAME_MAX)
@@ -133,7 +176,8 @@ static int
 crypt_token_load_external(struct crypt_device *cd, const char *name, struct crypt_token_handler_internal *ret)
 {
 #if USE_EXTERNAL_TOKENS
-	struct crypt_token_handler_v2 *token;
+	struct crypt_token_handler_v3 *token;
+	crypt_token_capabilities_func capabilities;
 	void *h;
 	char buf[PATH_MAX];
 	int r;
@@ -149,7 +193,7 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 		return -EINVAL;
 	}
 
-	token = &ret->u.v2;
+	token = &ret->u.v3;
 
 	r = snprintf(buf, sizeof(buf), "%s/libcryptsetup-token-%s.so", crypt_token_external_path(), name);
 	if (r < 0 || (size_t)r >= sizeof(buf))
@@ -173,6 +217,9 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 	token->dump = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_DUMP, CRYPT_TOKEN_ABI_VERSION1);
 	token->open_pin = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_PIN, CRYPT_TOKEN_ABI_VERSION1);
 	token->version = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_VERSION, CRYPT_TOKEN_ABI_VERSION1);
+	token->open_start = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_START, CRYPT_TOKEN_ABI_VERSION2);
+	token->open_poll = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_POLL, CRYPT_TOKEN_ABI_VERSION2);
+	token->open_finish = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_OPEN_FINISH, CRYPT_TOKEN_ABI_VERSION2);
 
 	if (!token_validate_v2(cd, ret)) {
 		free(CONST_CAST(void *)token->name);
@@ -186,11 +233,23 @@ crypt_token_load_external(struct crypt_device *cd, const char *name, struct cryp
 	if (r < 0 || (size_t)r >= sizeof(buf))
 		*buf = '\0';
 
-	log_dbg(cd, "Token handler %s-%s loaded successfully.", token->name, buf);
-
 	token->dlhandle = h;
 	ret->version = 2;
 
+	capabilities = token_dlvsym(cd, h, CRYPT_TOKEN_ABI_CAPABILITIES, CRYPT_TOKEN_ABI_VERSION2);
+	ret->parallel_open = capabilities && (capabilities() & CRYPT_TOKEN_CAP_PARALLEL_OPEN);
+
+	if (token_validate_v3(cd, ret))
+		ret->version = 3;
+	else {
+		token->open_start = NULL;
+		token->open_poll = NULL;
+		token->open_finish = NULL;
+	}
+
+	log_dbg(cd, "Token handler %s-%s (ABI v%u%s) loaded successfully.", token->name, buf, ret->version,
+		ret->parallel_open ? ", parallel open" : "");
+
 	return 0;
 #else
 	return -ENOTSUP;
@@ -211,19 +270,25 @@ static int crypt_token_find_free(struct crypt_device *cd, const char *name, int
 		return -EINVAL;
 	}
 
-	for (i = 0; i < LUKS2_TOKENS_MAX && token_handlers[i].u.v1.name; i++) {
+	if (index)
+		*index = -1;
+
+	/* Flushed external handlers may leave holes in table */
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		if (!token_handlers[i].u.v1.name) {
+			if (index && *index < 0)
+				*index = i;
+			continue;
+		}
 		if (!strcmp(token_handlers[i].u.v1.name, name)) {
 			log_dbg(cd, "Keyslot handler %s is already registered.", name);
 			return -EINVAL;
 		}
 	}
 
-	if (i == LUKS2_TOKENS_MAX)
+	if (index && *index < 0)
 		return -EINVAL;
 
-	if (index)
-		*index = i;
-
 	return 0;
 }
 
@@ -234,13 +299,15 @@ int crypt_token_register(const crypt_token_handler *handler)
 	if (!token_validate_v1(NULL, handler))
 		return -EINVAL;
 
+	pthread_mutex_lock(&token_handlers_lock);
 	r = crypt_token_find_free(NULL, handler->name, &i);
-	if (r < 0)
-		return r;
+	if (!r) {
+		token_handlers[i].version = 1;
+		token_handlers[i].u.v1 = *handler;
+	}
+	pthread_mutex_unlock(&token_handlers_lock);
 
-	token_handlers[i].version = 1;
-	token_handlers[i].u.v1 = *handler;
-	return 0;
+	return r;
 }
 
 void crypt_token_unload_external_all(struct crypt_device *cd)
@@ -248,6 +315,7 @@ void crypt_token_unload_external_all(struct crypt_device *cd)
 #if USE_EXTERNAL_TOKENS
 	int i;
 
+	pthread_mutex_lock(&token_handlers_lock);
 	for (i = LUKS2_TOKENS_MAX - 1; i >= 0; i--) {
 		if (token_handlers[i].version < 2)
 			continue;
@@ -259,28 +327,88 @@ void crypt_token_unload_external_all(struct crypt_device *cd)
 		if (dlclose(CONST_CAST(void *)token_handlers[i].u.v2.dlhandle))
 			log_dbg(cd, "%s", dlerror());
 	}
+	pthread_mutex_unlock(&token_handlers_lock);
 #endif
 }
 
 static const void
 *LUKS2_token_handler_type(struct crypt_device *cd, const char *type)
+{
+	const void *h = NULL;
+	int i, free_slot = -1;
+
+	pthread_mutex_lock(&token_handlers_lock);
+
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		if (!token_handlers[i].u.v1.name) {
+			if (free_slot < 0)
+				free_slot = i;
+		} else if (!strcmp(token_handlers[i].u.v1.name, type)) {
+			free_slot = i;
+			goto out;
+		}
+	}
+
+	if (free_slot < 0 || is_builtin_candidate(type))
+		goto out;
+
+	/* Loaded with lock held, other threads must not see partial handler. */
+	(void)crypt_token_load_external(cd, type, &token_handlers[free_slot]);
+out:
+	if (free_slot >= 0 && token_handlers[free_slot].u.v1.name) {
+		token_handlers[free_slot].users++;
+		h = &token_handlers[free_slot].u;
+	}
+	pthread_mutex_unlock(&token_handlers_lock);
+	return h;
+}
+
+static void LUKS2_token_handler_put(const void *h)
 {
 	int i;
 
-	for (i = 0; i < LUKS2_TOKENS_MAX && token_handlers[i].u.v1.name; i++)
-		if (!strcmp(token_handlers[i].u.v1.name, type))
-			return &token_handlers[i].u;
+	if (!h)
+		return;
 
-	if (i >= LUKS2_TOKENS_MAX)
-		return NULL;
+	pthread_mutex_lock(&token_handlers_lock);
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++)
+		if (h == &token_handlers[i].u) {
+			assert(token_handlers[i].users);
+			token_handlers[i].users--;
+			break;
+		}
+	pthread_mutex_unlock(&token_handlers_lock);
+}
 
-	if (is_builtin_candidate(type))
-		return NULL;
+int crypt_token_external_flush(void)
+{
+	int r = 0;
+#if USE_EXTERNAL_TOKENS
+	int i;
 
-	if (crypt_token_load_external(cd, type, &token_handlers[i]))
-		return NULL;
+	pthread_mutex_lock(&token_handlers_lock);
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		if (token_handlers[i].version < 2)
+			continue;
+
+		if (token_handlers[i].users) {
+			log_dbg(NULL, "Token handler %s is in use.", token_handlers[i].u.v2.name);
+			r = -EBUSY;
+			continue;
+		}
 
-	return &token_handlers[i].u;
+		log_dbg(NULL, "Unloading %s token handler.", token_handlers[i].u.v2.name);
+
+		free(CONST_CAST(void *)token_handlers[i].u.v2.name);
+
+		if (dlclose(CONST_CAST(void *)token_handlers[i].u.v2.dlhandle))
+			log_dbg(NULL, "%s", dlerror());
+
+		memset(&token_handlers[i], 0, sizeof(token_handlers[i]));
+	}
+	pthread_mutex_unlock(&token_handlers_lock);
+#endif
+	return r;
 }
 
 static const void
@@ -341,6 +469,8 @@ int LUKS2_token_create(struct crypt_device *cd,
 	if (snprintf(num, sizeof(num), "%d", token) < 0)
 		return -EINVAL;
 
+	LUKS2_hdr_index_invalidate();
+
 	/* Remove token */
 	if (!json)
 		json_object_object_del(jobj_tokens, num);
@@ -370,8 +500,10 @@ int LUKS2_token_create(struct crypt_device *cd,
 		if (h && h->validate && h->validate(cd, json)) {
 			json_object_put(jobj);
 			log_dbg(cd, "Token type %s validation failed.", h->name);
+			LUKS2_token_handler_put(h);
 			return -EINVAL;
 		}
+		LUKS2_token_handler_put(h);
 
 		json_object_object_add(jobj_tokens, num, jobj);
 		if (LUKS2_check_json_size(cd, hdr)) {
@@ -405,9 +537,11 @@ crypt_token_info LUKS2_token_status(struct crypt_device *cd,
 	json_object_object_get_ex(jobj_token, "type", &jobj_type);
 	tmp = json_object_get_string(jobj_type);
 
+	/* Handler name matches type, returned string must not depend on loaded plugin. */
 	if ((th = LUKS2_token_handler_type(cd, tmp))) {
+		LUKS2_token_handler_put(th);
 		if (type)
-			*type = th->name;
+			*type = tmp;
 		return is_builtin_candidate(tmp) ? CRYPT_TOKEN_INTERNAL : CRYPT_TOKEN_EXTERNAL;
 	}
 
@@ -478,19 +612,16 @@ static int translate_errno(struct crypt_device *cd, int ret_val, const char *typ
 	return ret_val;
 }
 
-static int token_open(struct crypt_device *cd,
+/* Checks token is usable and returns referenced handler for it */
+static int token_prepare(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
 	json_object *jobj_token,
 	const char *type,
 	int segment,
 	crypt_keyslot_priority priority,
-	const char *pin,
-	size_t pin_size,
-	char **buffer,
-	size_t *buffer_len,
-	void *usrptr,
-	bool requires_keyslot)
+	bool requires_keyslot,
+	const struct crypt_token_handler_v2 **handler)
 {
 	const struct crypt_token_handler_v2 *h;
 	json_object *jobj_type;
@@ -520,21 +651,67 @@ static int token_open(struct crypt_device *cd,
 
 	if (h->validate && h->validate(cd, token_json_to_string(jobj_token))) {
 		log_dbg(cd, "Token %d (%s) validation failed.", token, h->name);
+		LUKS2_token_handler_put(h);
 		return -ENOENT;
 	}
 
+	*handler = h;
+	return 0;
+}
+
+static int token_open_handler(struct crypt_device *cd,
+	const struct crypt_token_handler_v2 *h,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr)
+{
+	struct crypt_trace trace;
+	int r;
+
+	crypt_trace_begin(&trace, CRYPT_TRACE_TOKEN, h->name);
 	if (pin && !h->open_pin)
 		r = -ENOENT;
 	else if (pin)
 		r = translate_errno(cd, h->open_pin(cd, token, pin, pin_size, buffer, buffer_len, usrptr), h->name);
 	else
 		r = translate_errno(cd, h->open(cd, token, buffer, buffer_len, usrptr), h->name);
+	crypt_trace_end(cd, &trace, r < 0 ? 0 : *buffer_len, r < 0 ? r : 0);
 	if (r < 0)
 		log_dbg(cd, "Token %d (%s) open failed with %d.", token, h->name, r);
 
 	return r;
 }
 
+static int token_open(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	json_object *jobj_token,
+	const char *type,
+	int segment,
+	crypt_keyslot_priority priority,
+	const char *pin,
+	size_t pin_size,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr,
+	bool requires_keyslot)
+{
+	const struct crypt_token_handler_v2 *h;
+	int r;
+
+	r = token_prepare(cd, hdr, token, jobj_token, type, segment, priority, requires_keyslot, &h);
+	if (r < 0)
+		return r;
+
+	r = token_open_handler(cd, h, token, pin, pin_size, buffer, buffer_len, usrptr);
+
+	LUKS2_token_handler_put(h);
+	return r;
+}
+
 static void LUKS2_token_buffer_free(struct crypt_device *cd,
 		int token,
 		void *buffer,
@@ -548,6 +725,7 @@ static void LUKS2_token_buffer_free(struct crypt_device *cd,
 		crypt_safe_memzero(buffer, buffer_len);
 		free(buffer);
 	}
+	LUKS2_token_handler_put(h);
 }
 
 static bool break_loop_retval(int r)
@@ -590,6 +768,11 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	if (!json_object_object_get_ex(jobj_token, "type", &jobj_type))
 		return -EINVAL;
 
+	/* Escrow token provides volume key directly, keyslot stays untouched */
+	if (!strcmp(json_object_get_string(jobj_type), LUKS2_TOKEN_ESCROW))
+		return LUKS2_token_escrow_volume_key(cd, hdr, token, segment, priority,
+						     buffer, buffer_len, vk);
+
 	json_object_object_get_ex(jobj_token, "keyslots", &jobj_token_keyslots);
 	if (!jobj_token_keyslots)
 		return -EINVAL;
@@ -620,6 +803,14 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	return num;
 }
 
+static bool token_is_escrow(json_object *jobj_token)
+{
+	json_object *jobj_type;
+
+	return json_object_object_get_ex(jobj_token, "type", &jobj_type) &&
+	       !strcmp(json_object_get_string(jobj_type), LUKS2_TOKEN_ESCROW);
+}
+
 static bool token_is_blocked(int token, uint32_t *block_list)
 {
 	/* it is safe now, but have assert in case LUKS2_TOKENS_MAX grows */
@@ -636,6 +827,344 @@ static void token_block(int token, uint32_t *block_list)
 	*block_list |= (UINT32_C(1) << token);
 }
 
+/*
+ * Tokens of the same priority class opened concurrently. Only token handlers
+ * run in worker threads, token provided passphrases are verified by caller
+ * in order of completion, so the first working one wins.
+ */
+struct token_trial {
+	struct crypt_device *cd;
+	struct luks2_hdr *hdr;
+	const char *type;
+	int segment;
+	crypt_keyslot_priority priority;
+	const char *pin;
+	size_t pin_size;
+	void *usrptr;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+
+	unsigned int count;
+	int tokens[LUKS2_TOKENS_MAX];
+	json_object *jobj[LUKS2_TOKENS_MAX];
+	char *buffer[LUKS2_TOKENS_MAX];
+	size_t buffer_size[LUKS2_TOKENS_MAX];
+	int r[LUKS2_TOKENS_MAX];
+	bool done[LUKS2_TOKENS_MAX];
+	bool processed[LUKS2_TOKENS_MAX];
+};
+
+static int token_trial_job(void *arg, unsigned int job)
+{
+	struct token_trial *t = arg;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	int r;
+
+	r = token_open(t->cd, t->hdr, t->tokens[job], t->jobj[job], t->type, t->segment,
+		       t->priority, t->pin, t->pin_size, &buffer, &buffer_size, t->usrptr, true);
+
+	pthread_mutex_lock(&t->lock);
+	t->r[job] = r;
+	t->buffer[job] = r ? NULL : buffer;
+	t->buffer_size[job] = r ? 0 : buffer_size;
+	t->done[job] = true;
+	pthread_cond_broadcast(&t->done_cond);
+	pthread_mutex_unlock(&t->lock);
+
+	return 0;
+}
+
+/* Returns next finished token trial in trial order or -1 if all were processed */
+static int token_trial_next(struct token_trial *t)
+{
+	unsigned int i, pending;
+	int job = -1;
+
+	pthread_mutex_lock(&t->lock);
+	do {
+		for (i = 0, pending = 0; i < t->count; i++) {
+			if (t->processed[i])
+				continue;
+			if (t->done[i]) {
+				job = i;
+				t->processed[i] = true;
+				break;
+			}
+			pending++;
+		}
+		if (job < 0 && pending)
+			pthread_cond_wait(&t->done_cond, &t->lock);
+	} while (job < 0 && pending);
+	pthread_mutex_unlock(&t->lock);
+
+	return job;
+}
+
+/* Handler references point to the union in token_handlers table. */
+static bool token_handler_parallel(const void *h)
+{
+	const struct crypt_token_handler_internal *th;
+
+	th = (const void *)((const char *)h - offsetof(struct crypt_token_handler_internal, u));
+
+	return th->parallel_open;
+}
+
+/*
+ * Parallel trial is opt-in, tied to parallel keyslot unlock switch, and
+ * used only if all tried token handlers declare thread safe open.
+ */
+static bool parallel_token_trial(struct crypt_device *cd, json_object *jobj_tokens,
+				 const char *type, uint32_t *block_list)
+{
+	const void *h;
+	json_object *jobj_type;
+	unsigned int count = 0;
+	bool parallel;
+
+	if (!crypt_parallel_unlock_enabled() || crypt_get_threads(cd) < 2)
+		return false;
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		if (token_is_blocked(atoi(slot), block_list))
+			continue;
+		if (type && (!json_object_object_get_ex(val, "type", &jobj_type) ||
+			     strcmp(type, json_object_get_string(jobj_type))))
+			continue;
+		if (!(h = LUKS2_token_handler(cd, atoi(slot))))
+			return false;
+		parallel = token_handler_parallel(h);
+		LUKS2_token_handler_put(h);
+		if (!parallel)
+			return false;
+		count++;
+	}
+
+	return count > 1;
+}
+
+static int token_open_priority_parallel(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	json_object *jobj_tokens,
+	const char *type,
+	int segment,
+	crypt_keyslot_priority priority,
+	const char *pin,
+	size_t pin_size,
+	void *usrptr,
+	int *stored_retval,
+	uint32_t *block_list,
+	struct volume_key **vk)
+{
+	struct crypt_threadpool *tp = NULL;
+	struct token_trial *t;
+	unsigned int i, threads;
+	int job, token, r;
+
+	t = crypt_zalloc(sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	*t = (struct token_trial) {
+		.cd = cd,
+		.hdr = hdr,
+		.type = type,
+		.segment = segment,
+		.priority = priority,
+		.pin = pin,
+		.pin_size = pin_size,
+		.usrptr = usrptr,
+	};
+
+	json_object_object_foreach(jobj_tokens, slot, val) {
+		token = atoi(slot);
+		if (token_is_blocked(token, block_list) || t->count == LUKS2_TOKENS_MAX)
+			continue;
+		t->tokens[t->count] = token;
+		t->jobj[t->count++] = val;
+	}
+
+	if (pthread_mutex_init(&t->lock, NULL)) {
+		free(t);
+		return -ENOMEM;
+	}
+	if (pthread_cond_init(&t->done_cond, NULL)) {
+		pthread_mutex_destroy(&t->lock);
+		free(t);
+		return -ENOMEM;
+	}
+
+	/* Caller thread only verifies passphrases, token handlers run in workers. */
+	threads = crypt_get_threads(cd);
+	if (threads > t->count)
+		threads = t->count;
+
+	log_dbg(cd, "Trying %u tokens with priority %d in parallel.", t->count, priority);
+
+	r = crypt_threadpool_init(cd, &tp, threads + 1);
+	if (!r)
+		r = crypt_threadpool_start(tp, t->count, token_trial_job, t);
+	if (r < 0)
+		goto out;
+
+	r = *stored_retval;
+	while ((job = token_trial_next(t)) >= 0) {
+		token = t->tokens[job];
+		r = t->r[job];
+		if (!r) {
+			r = LUKS2_keyslot_open_by_token(cd, hdr, token, segment, priority,
+							t->buffer[job], t->buffer_size[job], vk);
+			LUKS2_token_buffer_free(cd, token, t->buffer[job], t->buffer_size[job]);
+			t->buffer[job] = NULL;
+		}
+
+		if (r == -ENOANO)
+			token_block(token, block_list);
+
+		if (break_loop_retval(r)) {
+			/* Tokens not yet started are skipped, others are ignored. */
+			crypt_threadpool_cancel(tp);
+			break;
+		}
+
+		update_return_errno(r, stored_retval);
+		r = *stored_retval;
+	}
+
+	(void)crypt_threadpool_wait(tp);
+
+	for (i = 0; i < t->count; i++)
+		if (t->buffer[i])
+			LUKS2_token_buffer_free(cd, t->tokens[i], t->buffer[i], t->buffer_size[i]);
+out:
+	crypt_threadpool_destroy(tp);
+	pthread_cond_destroy(&t->done_cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+
+	return r;
+}
+
+/*
+ * Asynchronous (ABI v3) token handlers of the same priority class are started
+ * together and multiplexed by poll() in the calling thread, so slow hardware
+ * or network round trips overlap. Synchronous handlers run in between
+ * in header order, results are verified in order of completion.
+ */
+#define TOKEN_ASYNC_POLL_MS 100
+
+struct token_async {
+	int token;
+	const struct crypt_token_handler_v3 *h;
+	struct crypt_trace trace;
+	void *ctx;
+	int fd;
+	bool pending;
+};
+
+/* Handler references point to the union in token_handlers table. */
+static const struct crypt_token_handler_v3 *token_handler_async(const void *h)
+{
+	const struct crypt_token_handler_internal *th;
+
+	th = (const void *)((const char *)h - offsetof(struct crypt_token_handler_internal, u));
+
+	return th->version >= 3 ? &th->u.v3 : NULL;
+}
+
+static uint64_t token_now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return UINT64_MAX;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Takes over handler reference, released on failure */
+static int token_open_start(struct crypt_device *cd,
+	const struct crypt_token_handler_v3 *h,
+	int token,
+	const char *pin,
+	size_t pin_size,
+	void *usrptr,
+	struct token_async *a)
+{
+	int r;
+
+	*a = (struct token_async) { .token = token, .h = h, .fd = -1 };
+
+	crypt_trace_begin(&a->trace, CRYPT_TRACE_TOKEN, h->name);
+	r = translate_errno(cd, h->open_start(cd, token, pin, pin_size, usrptr, &a->ctx), h->name);
+	if (r < 0) {
+		crypt_trace_end(cd, &a->trace, 0, r);
+		log_dbg(cd, "Token %d (%s) open start failed with %d.", token, h->name, r);
+		LUKS2_token_handler_put(h);
+		return r;
+	}
+
+	log_dbg(cd, "Token %d (%s) open started.", token, h->name);
+	a->pending = true;
+
+	return 0;
+}
+
+/* Collects result or cancels still pending operation, releases handler reference */
+static int token_open_finish(struct crypt_device *cd,
+	struct token_async *a,
+	char **buffer,
+	size_t *buffer_len)
+{
+	int r;
+
+	r = translate_errno(cd, a->h->open_finish(cd, a->ctx, buffer, buffer_len), a->h->name);
+	crypt_trace_end(cd, &a->trace, r < 0 ? 0 : *buffer_len, r < 0 ? r : 0);
+	if (r < 0)
+		log_dbg(cd, "Token %d (%s) open failed with %d.", a->token, a->h->name, r);
+
+	LUKS2_token_handler_put(a->h);
+	a->ctx = NULL;
+	a->pending = false;
+
+	return r;
+}
+
+static void token_open_cancel(struct crypt_device *cd, struct token_async *a)
+{
+	char *buffer = NULL;
+	size_t buffer_len = 0;
+
+	/* Operation may have completed meanwhile */
+	if (!token_open_finish(cd, a, &buffer, &buffer_len))
+		LUKS2_token_buffer_free(cd, a->token, buffer, buffer_len);
+}
+
+static int token_open_keyslot(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int segment,
+	crypt_keyslot_priority priority,
+	int r,
+	char *buffer,
+	size_t buffer_size,
+	uint32_t *block_list,
+	struct volume_key **vk)
+{
+	if (!r) {
+		r = LUKS2_keyslot_open_by_token(cd, hdr, token, segment, priority,
+						buffer, buffer_size, vk);
+		LUKS2_token_buffer_free(cd, token, buffer, buffer_size);
+	}
+
+	if (r == -ENOANO)
+		token_block(token, block_list);
+
+	return r;
+}
+
 static int token_open_priority(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	json_object *jobj_tokens,
@@ -649,34 +1178,128 @@ static int token_open_priority(struct crypt_device *cd,
 	uint32_t *block_list,
 	struct volume_key **vk)
 {
+	const struct crypt_token_handler_v2 *h, *sync_h[LUKS2_TOKENS_MAX];
+	struct token_async a[LUKS2_TOKENS_MAX];
+	struct pollfd pfd[LUKS2_TOKENS_MAX];
+	int sync_token[LUKS2_TOKENS_MAX];
+	unsigned int i, count = 0, sync_count = 0, nfds, pending;
+	uint64_t deadline = 0, now;
 	char *buffer;
 	size_t buffer_size;
-	int token, r;
+	int token, timeout, r;
 
 	assert(stored_retval);
 	assert(block_list);
 
+	if (parallel_token_trial(cd, jobj_tokens, type, block_list))
+		return token_open_priority_parallel(cd, hdr, jobj_tokens, type, segment, priority,
+						    pin, pin_size, usrptr, stored_retval, block_list, vk);
+
+	if (crypt_get_token_timeout(cd))
+		deadline = token_now_ms() + crypt_get_token_timeout(cd);
+
+	/* Start asynchronous handlers first so they progress while synchronous ones block. */
 	json_object_object_foreach(jobj_tokens, slot, val) {
 		token = atoi(slot);
 		if (token_is_blocked(token, block_list))
 			continue;
-		r = token_open(cd, hdr, token, val, type, segment, priority, pin, pin_size, &buffer, &buffer_size, usrptr, true);
+		r = token_prepare(cd, hdr, token, val, type, segment, priority, true, &h);
+		if (!r && !token_handler_async(h)) {
+			sync_token[sync_count] = token;
+			sync_h[sync_count++] = h;
+			continue;
+		}
 		if (!r) {
-			r = LUKS2_keyslot_open_by_token(cd, hdr, token, segment, priority,
-							buffer, buffer_size, vk);
-			LUKS2_token_buffer_free(cd, token, buffer, buffer_size);
+			r = token_open_start(cd, token_handler_async(h), token, pin, pin_size, usrptr, &a[count]);
+			if (!r) {
+				count++;
+				continue;
+			}
 		}
 
 		if (r == -ENOANO)
 			token_block(token, block_list);
 
 		if (break_loop_retval(r))
-			return r;
+			goto out;
 
 		update_return_errno(r, stored_retval);
 	}
 
-	return *stored_retval;
+	for (i = 0; i < sync_count; i++) {
+		r = token_open_handler(cd, sync_h[i], sync_token[i], pin, pin_size, &buffer, &buffer_size, usrptr);
+		LUKS2_token_handler_put(sync_h[i]);
+		sync_h[i] = NULL;
+
+		r = token_open_keyslot(cd, hdr, sync_token[i], segment, priority, r,
+				       buffer, buffer_size, block_list, vk);
+		if (break_loop_retval(r))
+			goto out;
+
+		update_return_errno(r, stored_retval);
+	}
+
+	if (count)
+		log_dbg(cd, "Waiting for %u asynchronous tokens with priority %d.", count, priority);
+
+	while (count) {
+		for (i = 0, nfds = 0, pending = 0; i < count; i++) {
+			if (!a[i].pending)
+				continue;
+
+			if (a[i].h->open_poll(cd, a[i].ctx, &a[i].fd) == -EINPROGRESS) {
+				if (a[i].fd >= 0)
+					pfd[nfds++] = (struct pollfd) { .fd = a[i].fd, .events = POLLIN };
+				pending++;
+				continue;
+			}
+
+			r = token_open_finish(cd, &a[i], &buffer, &buffer_size);
+			r = token_open_keyslot(cd, hdr, a[i].token, segment, priority, r,
+					       buffer, buffer_size, block_list, vk);
+			if (break_loop_retval(r))
+				goto out;
+
+			update_return_errno(r, stored_retval);
+		}
+
+		if (!pending)
+			break;
+
+		/* Handlers without descriptor are polled periodically. */
+		timeout = nfds < pending ? TOKEN_ASYNC_POLL_MS : -1;
+		if (deadline) {
+			now = token_now_ms();
+			if (now >= deadline) {
+				for (i = 0; i < count; i++) {
+					if (!a[i].pending)
+						continue;
+					log_dbg(cd, "Token %d (%s) timed out.", a[i].token, a[i].h->name);
+					token_open_cancel(cd, &a[i]);
+					/* Unreachable in time is the same as missing hardware. */
+					update_return_errno(-EAGAIN, stored_retval);
+				}
+				break;
+			}
+			if (timeout < 0 || deadline - now < (uint64_t)timeout)
+				timeout = deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+		}
+
+		if (poll(pfd, nfds, timeout) < 0 && errno != EINTR) {
+			r = -errno;
+			goto out;
+		}
+	}
+
+	r = *stored_retval;
+out:
+	for (i = 0; i < count; i++)
+		if (a[i].pending)
+			token_open_cancel(cd, &a[i]);
+	for (i = 0; i < sync_count; i++)
+		LUKS2_token_handler_put(sync_h[i]);
+
+	return r;
 }
 
 static int token_open_any(struct crypt_device *cd, struct luks2_hdr *hdr, const char *type, int segment,
@@ -782,7 +1405,8 @@ int LUKS2_token_open_and_activate(struct crypt_device *cd,
 	if (!crypt_use_keyring_for_vk(cd))
 		use_keyring = false;
 	else
-		use_keyring = ((name && !crypt_is_cipher_null(crypt_get_cipher(cd))) ||
+		use_keyring = ((name && !crypt_is_cipher_null(crypt_get_cipher(cd)) &&
+				!(flags & CRYPT_ACTIVATE_INLINE_CRYPT)) ||
 			       (flags & CRYPT_ACTIVATE_KEYRING_KEY));
 
 	if (use_keyring) {
@@ -790,8 +1414,11 @@ int LUKS2_token_open_and_activate(struct crypt_device *cd,
 			flags |= CRYPT_ACTIVATE_KEYRING_KEY;
 	}
 
-	if (r >= 0 && name)
+	if (r >= 0 && name) {
 		r = LUKS2_activate(cd, name, vk, flags);
+		if (!r)
+			(void)LUKS2_keyslot_telemetry_record(cd, hdr, keyslot);
+	}
 
 	if (r < 0)
 		crypt_drop_keyring_key(cd, vk);
@@ -812,6 +1439,7 @@ void LUKS2_token_dump(struct crypt_device *cd, int token)
 			h->dump(cd, json_object_to_json_string_ext(jobj_token,
 				JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE));
 	}
+	LUKS2_token_handler_put(h);
 }
 
 int LUKS2_token_json_get(struct luks2_hdr *hdr, int token, const char **json)
@@ -975,6 +1603,79 @@ int LUKS2_token_assignment_copy(struct crypt_device *cd,
 	return commit ? LUKS2_hdr_write(cd, hdr) : 0;
 }
 
+/*
+ * Unlock by specific token, token provided buffer is kept in safe memory
+ * so that following unlocks with the same buffer do not call token
+ * handler again. Buffer is kept only if it opened a keyslot and it is
+ * reused only for header with the same UUID. Escrow token buffer
+ * (volume key) is never kept.
+ */
+int LUKS2_token_unlock_key_cached(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	const char *type,
+	const char *pin,
+	size_t pin_size,
+	int segment,
+	void *usrptr,
+	char **cached_buffer,
+	size_t *cached_buffer_size,
+	char **cached_uuid,
+	struct volume_key **vk)
+{
+	char *buffer;
+	size_t buffer_size;
+	json_object *jobj_token;
+	int r;
+
+	assert(cached_buffer);
+	assert(cached_buffer_size);
+	assert(cached_uuid);
+	assert(vk);
+
+	if (segment == CRYPT_DEFAULT_SEGMENT)
+		segment = LUKS2_get_default_segment(hdr);
+
+	if (segment < 0 && segment != CRYPT_ANY_SEGMENT)
+		return -EINVAL;
+
+	if (token < 0 || token >= LUKS2_TOKENS_MAX)
+		return -EINVAL;
+
+	if (!(jobj_token = LUKS2_get_token_jobj(hdr, token)))
+		return -ENOENT;
+
+	if (*cached_buffer && *cached_uuid && !strcmp(*cached_uuid, hdr->uuid)) {
+		log_dbg(cd, "Reusing cached buffer of token %d.", token);
+		return LUKS2_keyslot_open_by_token(cd, hdr, token, segment, CRYPT_SLOT_PRIORITY_IGNORE,
+						   *cached_buffer, *cached_buffer_size, vk);
+	}
+
+	r = token_open(cd, hdr, token, jobj_token, type, segment, CRYPT_SLOT_PRIORITY_IGNORE,
+		       pin, pin_size, &buffer, &buffer_size, usrptr, true);
+	if (r)
+		return r;
+
+	r = LUKS2_keyslot_open_by_token(cd, hdr, token, segment, CRYPT_SLOT_PRIORITY_IGNORE,
+					buffer, buffer_size, vk);
+
+	/* buffer may be already used as passphrase, never replace it */
+	if (r >= 0 && !*cached_buffer && !token_is_escrow(jobj_token) &&
+	    (*cached_uuid = strdup(hdr->uuid))) {
+		if ((*cached_buffer = crypt_safe_alloc(buffer_size))) {
+			memcpy(*cached_buffer, buffer, buffer_size);
+			*cached_buffer_size = buffer_size;
+		} else {
+			free(*cached_uuid);
+			*cached_uuid = NULL;
+		}
+	}
+
+	LUKS2_token_buffer_free(cd, token, buffer, buffer_size);
+
+	return r;
+}
+
 int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int token,
@@ -994,7 +1695,8 @@ int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 		return -EINVAL;
 
 	if (token >= 0 && token < LUKS2_TOKENS_MAX) {
-		if ((jobj_token = LUKS2_get_token_jobj(hdr, token)))
+		/* escrow token buffer is volume key, never passphrase */
+		if ((jobj_token = LUKS2_get_token_jobj(hdr, token)) && !token_is_escrow(jobj_token))
 			r = token_open(cd, hdr, token, jobj_token, type, CRYPT_ANY_SEGMENT, CRYPT_SLOT_PRIORITY_IGNORE,
 				       pin, pin_size, &buffer, &buffer_size, usrptr, false);
 	} else if (token == CRYPT_ANY_TOKEN) {
@@ -1004,6 +1706,8 @@ int LUKS2_token_unlock_passphrase(struct crypt_device *cd,
 			usrptr = NULL;
 
 		json_object_object_foreach(jobj_tokens, slot, val) {
+			if (token_is_escrow(val))
+				continue;
 			token = atoi(slot);
 			r = token_open(cd, hdr, token, val, type, CRYPT_ANY_SEGMENT, CRYPT_SLOT_PRIORITY_IGNORE,
 				       pin, pin_size, &buffer, &buffer_size, usrptr, false);
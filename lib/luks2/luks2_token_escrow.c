@@ -0,0 +1,401 @@
+/*
+ * LUKS - Linux Unified Key Setup v2, volume key escrow token
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "luks2_internal.h"
+
+/*
+ * Escrow token keeps the volume key wrapped by a host key (user key
+ * in kernel keyring, e.g. unsealed from TPM at boot):
+ *
+ *   kek     = HMAC-SHA256(host key, salt || "wrap")
+ *   mac key = HMAC-SHA256(host key, salt || "auth")
+ *   wrapped = AES-256-CBC(kek, zero IV, volume key)
+ *   tag     = HMAC-SHA256(mac key, digest || wrapped)
+ *
+ * Every token has its own random salt, so kek is never reused.
+ * Digest is the stored value of LUKS2 digest of assigned keyslots,
+ * the tag then no longer matches once the volume key is changed.
+ * Unlock runs no PBKDF, the tag replaces PBKDF2 digest verification.
+ */
+#define ESCROW_HASH "sha256"
+#define ESCROW_KEY_SIZE 32
+#define ESCROW_SALT_SIZE 32
+#define ESCROW_BLOCK_SIZE 16
+
+static int escrow_kdf(const char *host_key, size_t host_key_len,
+	const char *salt, const char *label, char *key)
+{
+	struct crypt_hmac *hmac;
+	int r;
+
+	r = crypt_hmac_init(&hmac, ESCROW_HASH, host_key, host_key_len);
+	if (r)
+		return r;
+
+	r = crypt_hmac_write(hmac, salt, ESCROW_SALT_SIZE);
+	if (!r)
+		r = crypt_hmac_write(hmac, label, strlen(label));
+	if (!r)
+		r = crypt_hmac_final(hmac, key, ESCROW_KEY_SIZE);
+
+	crypt_hmac_destroy(hmac);
+	return r;
+}
+
+static int escrow_tag(const char *mac_key, const char *digest,
+	const char *wrapped, size_t wrapped_len, char *tag)
+{
+	struct crypt_hmac *hmac;
+	int r;
+
+	r = crypt_hmac_init(&hmac, ESCROW_HASH, mac_key, ESCROW_KEY_SIZE);
+	if (r)
+		return r;
+
+	r = crypt_hmac_write(hmac, digest, strlen(digest));
+	if (!r)
+		r = crypt_hmac_write(hmac, wrapped, wrapped_len);
+	if (!r)
+		r = crypt_hmac_final(hmac, tag, ESCROW_KEY_SIZE);
+
+	crypt_hmac_destroy(hmac);
+	return r;
+}
+
+static int escrow_crypt(const char *kek, const char *in, char *out, size_t len, bool encrypt)
+{
+	struct crypt_cipher *cipher;
+	char iv[ESCROW_BLOCK_SIZE] = {};
+	int r;
+
+	r = crypt_cipher_init(&cipher, "aes", "cbc", kek, ESCROW_KEY_SIZE);
+	if (r)
+		return r;
+
+	if (encrypt)
+		r = crypt_cipher_encrypt(cipher, in, out, len, iv, sizeof(iv));
+	else
+		r = crypt_cipher_decrypt(cipher, in, out, len, iv, sizeof(iv));
+
+	crypt_cipher_destroy(cipher);
+	return r;
+}
+
+static const char *escrow_digest_value(struct luks2_hdr *hdr, int digest)
+{
+	json_object *jobj_digest, *jobj;
+
+	if (digest < 0 || !(jobj_digest = LUKS2_get_digest_jobj(hdr, digest)) ||
+	    !json_object_object_get_ex(jobj_digest, "digest", &jobj))
+		return NULL;
+
+	return json_object_get_string(jobj);
+}
+
+/* Stored value of the digest shared by all keyslots assigned to token */
+static const char *escrow_digest(struct luks2_hdr *hdr, json_object *jobj_token)
+{
+	json_object *jobj_keyslots, *jobj;
+	int i, digest = -ENOENT, d;
+
+	if (!json_object_object_get_ex(jobj_token, "keyslots", &jobj_keyslots))
+		return NULL;
+
+	for (i = 0; i < (int) json_object_array_length(jobj_keyslots); i++) {
+		jobj = json_object_array_get_idx(jobj_keyslots, i);
+		d = LUKS2_digest_by_keyslot(hdr, atoi(json_object_get_string(jobj)));
+		if (d < 0 || (digest >= 0 && d != digest))
+			return NULL;
+		digest = d;
+	}
+
+	return escrow_digest_value(hdr, digest);
+}
+
+static int escrow_decode(json_object *jobj_token, const char *field, char **buf, size_t *buf_len)
+{
+	json_object *jobj;
+
+	if (!json_object_object_get_ex(jobj_token, field, &jobj))
+		return -EINVAL;
+
+	return crypt_base64_decode(buf, buf_len, json_object_get_string(jobj),
+				   json_object_get_string_len(jobj));
+}
+
+int escrow_open(struct crypt_device *cd,
+	int token,
+	char **buffer,
+	size_t *buffer_len,
+	void *usrptr __attribute__((unused)))
+{
+	json_object *jobj_token, *jobj_key;
+	char *host_key = NULL, *salt = NULL, *wrapped = NULL, *tag = NULL, *vk = NULL;
+	char kek[ESCROW_KEY_SIZE], mac_key[ESCROW_KEY_SIZE], check[ESCROW_KEY_SIZE];
+	size_t host_key_len = 0, salt_len, wrapped_len = 0, tag_len;
+	const char *digest;
+	struct luks2_hdr *hdr;
+	int r;
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_token = LUKS2_get_token_jobj(hdr, token);
+	if (!jobj_token)
+		return -EINVAL;
+
+	digest = escrow_digest(hdr, jobj_token);
+	if (!digest) {
+		log_dbg(cd, "Escrow token %d has no usable keyslot digest.", token);
+		return -ENOENT;
+	}
+
+	json_object_object_get_ex(jobj_token, "key_description", &jobj_key);
+
+	r = keyring_get_passphrase(json_object_get_string(jobj_key), &host_key, &host_key_len);
+	if (r == -ENOTSUP) {
+		log_dbg(cd, "Kernel keyring features disabled.");
+		return -ENOENT;
+	} else if (r < 0) {
+		log_dbg(cd, "Escrow host key is not available (error %d).", r);
+		return -EPERM;
+	}
+
+	r = -EINVAL;
+	if (escrow_decode(jobj_token, "salt", &salt, &salt_len) || salt_len != ESCROW_SALT_SIZE ||
+	    escrow_decode(jobj_token, "wrapped_key", &wrapped, &wrapped_len) ||
+	    !wrapped_len || wrapped_len % ESCROW_BLOCK_SIZE ||
+	    escrow_decode(jobj_token, "tag", &tag, &tag_len) || tag_len != ESCROW_KEY_SIZE)
+		goto out;
+
+	if (escrow_kdf(host_key, host_key_len, salt, "wrap", kek) ||
+	    escrow_kdf(host_key, host_key_len, salt, "auth", mac_key) ||
+	    escrow_tag(mac_key, digest, wrapped, wrapped_len, check))
+		goto out;
+
+	/* Wrong host key or stale token (volume key changed) */
+	if (crypt_backend_memeq(check, tag, ESCROW_KEY_SIZE)) {
+		log_dbg(cd, "Escrow token %d authentication failed.", token);
+		r = -EPERM;
+		goto out;
+	}
+
+	r = -ENOMEM;
+	vk = crypt_safe_alloc(wrapped_len);
+	if (!vk)
+		goto out;
+
+	r = escrow_crypt(kek, wrapped, vk, wrapped_len, false);
+	if (r) {
+		crypt_safe_free(vk);
+		goto out;
+	}
+
+	*buffer = vk;
+	*buffer_len = wrapped_len;
+out:
+	crypt_safe_memzero(kek, sizeof(kek));
+	crypt_safe_memzero(mac_key, sizeof(mac_key));
+	crypt_safe_free(host_key);
+	free(salt);
+	free(wrapped);
+	free(tag);
+	return r;
+}
+
+int escrow_validate(struct crypt_device *cd __attribute__((unused)),
+	const char *json)
+{
+	enum json_tokener_error jerr;
+	json_object *jobj_token, *jobj;
+	const char *fields[] = { "key_description", "salt", "wrapped_key", "tag" };
+	unsigned int i;
+	int r = 1;
+
+	jobj_token = json_tokener_parse_verbose(json, &jerr);
+	if (!jobj_token) {
+		log_dbg(cd, "Escrow token JSON parse failed.");
+		return r;
+	}
+
+	if (json_object_object_length(jobj_token) != 6) {
+		log_dbg(cd, "Escrow token is expected to have exactly 6 fields.");
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		if (!json_object_object_get_ex(jobj_token, fields[i], &jobj) ||
+		    !json_object_is_type(jobj, json_type_string) ||
+		    !json_object_get_string_len(jobj)) {
+			log_dbg(cd, "Missing or invalid %s field.", fields[i]);
+			goto out;
+		}
+	}
+
+	r = 0;
+out:
+	json_object_put(jobj_token);
+	return r;
+}
+
+void escrow_dump(struct crypt_device *cd, const char *json)
+{
+	enum json_tokener_error jerr;
+	json_object *jobj_token, *jobj_key;
+
+	jobj_token = json_tokener_parse_verbose(json, &jerr);
+	if (!jobj_token)
+		return;
+
+	if (json_object_object_get_ex(jobj_token, "key_description", &jobj_key))
+		log_std(cd, "\tHost key:   %s\n", json_object_get_string(jobj_key));
+
+	json_object_put(jobj_token);
+}
+
+void escrow_buffer_free(void *buffer, size_t buffer_len __attribute__((unused)))
+{
+	crypt_safe_free(buffer);
+}
+
+/* Token provided buffer is the volume key itself, no keyslot is opened */
+int LUKS2_token_escrow_volume_key(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int segment,
+	crypt_keyslot_priority priority,
+	const char *buffer,
+	size_t buffer_len,
+	struct volume_key **vk)
+{
+	json_object *jobj_token, *jobj_keyslots, *jobj;
+	crypt_keyslot_priority keyslot_priority;
+	int i, keyslot, r = -ENOENT;
+
+	jobj_token = LUKS2_get_token_jobj(hdr, token);
+	if (!jobj_token || !json_object_object_get_ex(jobj_token, "keyslots", &jobj_keyslots))
+		return -EINVAL;
+
+	for (i = 0; i < (int) json_object_array_length(jobj_keyslots); i++) {
+		jobj = json_object_array_get_idx(jobj_keyslots, i);
+		keyslot = atoi(json_object_get_string(jobj));
+		keyslot_priority = LUKS2_keyslot_priority_get(hdr, keyslot);
+		if (keyslot_priority == CRYPT_SLOT_PRIORITY_INVALID)
+			return -EINVAL;
+		if (keyslot_priority < priority)
+			continue;
+
+		r = LUKS2_keyslot_for_segment(hdr, keyslot, segment);
+		if (r == -ENOENT)
+			continue;
+		if (r < 0)
+			return r;
+
+		*vk = crypt_alloc_volume_key(buffer_len, buffer);
+		if (!*vk)
+			return -ENOMEM;
+		crypt_volume_key_set_id(*vk, LUKS2_digest_by_keyslot(hdr, keyslot));
+
+		log_dbg(cd, "Volume key unwrapped by escrow token %d (keyslot %d).", token, keyslot);
+		return keyslot;
+	}
+
+	return r;
+}
+
+int LUKS2_token_escrow_create(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int keyslot,
+	const struct volume_key *vk,
+	const struct crypt_token_params_luks2_escrow *params)
+{
+	char *host_key = NULL, *wrapped = NULL, *salt_b64 = NULL, *wrapped_b64 = NULL, *tag_b64 = NULL;
+	char kek[ESCROW_KEY_SIZE], mac_key[ESCROW_KEY_SIZE], tag[ESCROW_KEY_SIZE], salt[ESCROW_SALT_SIZE];
+	size_t host_key_len = 0, json_len;
+	const char *digest;
+	char *json = NULL;
+	int r;
+
+	if (!vk->keylength || vk->keylength % ESCROW_BLOCK_SIZE) {
+		log_dbg(cd, "Volume key size %zu cannot be wrapped.", vk->keylength);
+		return -ENOTSUP;
+	}
+
+	digest = escrow_digest_value(hdr, LUKS2_digest_by_keyslot(hdr, keyslot));
+	if (!digest)
+		return -EINVAL;
+
+	r = keyring_get_passphrase(params->key_description, &host_key, &host_key_len);
+	if (r < 0) {
+		log_dbg(cd, "Escrow host key %s is not available (error %d).", params->key_description, r);
+		return r == -ENOTSUP ? r : -ENOENT;
+	}
+
+	r = crypt_random_get(cd, salt, sizeof(salt), CRYPT_RND_SALT);
+	if (r)
+		goto out;
+
+	r = -ENOMEM;
+	wrapped = crypt_safe_alloc(vk->keylength);
+	if (!wrapped)
+		goto out;
+
+	r = escrow_kdf(host_key, host_key_len, salt, "wrap", kek);
+	if (!r)
+		r = escrow_kdf(host_key, host_key_len, salt, "auth", mac_key);
+	if (!r)
+		r = escrow_crypt(kek, vk->key, wrapped, vk->keylength, true);
+	if (!r)
+		r = escrow_tag(mac_key, digest, wrapped, vk->keylength, tag);
+	if (!r)
+		r = crypt_base64_encode(&salt_b64, NULL, salt, sizeof(salt));
+	if (!r)
+		r = crypt_base64_encode(&wrapped_b64, NULL, wrapped, vk->keylength);
+	if (!r)
+		r = crypt_base64_encode(&tag_b64, NULL, tag, sizeof(tag));
+	if (r)
+		goto out;
+
+	json_len = strlen(params->key_description) + strlen(salt_b64) +
+		   strlen(wrapped_b64) + strlen(tag_b64) + 256;
+	r = -ENOMEM;
+	json = malloc(json_len);
+	if (!json)
+		goto out;
+
+	r = snprintf(json, json_len, "{ \"type\": \"%s\", \"keyslots\":[\"%d\"],"
+		     "\"key_description\":\"%s\",\"salt\":\"%s\",\"wrapped_key\":\"%s\",\"tag\":\"%s\"}",
+		     LUKS2_TOKEN_ESCROW, keyslot, params->key_description, salt_b64, wrapped_b64, tag_b64);
+	if (r < 0 || (size_t)r >= json_len) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = LUKS2_token_create(cd, hdr, token, json, 1);
+out:
+	crypt_safe_memzero(kek, sizeof(kek));
+	crypt_safe_memzero(mac_key, sizeof(mac_key));
+	crypt_safe_free(host_key);
+	crypt_safe_free(wrapped);
+	free(salt_b64);
+	free(wrapped_b64);
+	free(tag_b64);
+	free(json);
+	return r;
+}
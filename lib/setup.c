@@ -25,8 +25,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 
 #include "libcryptsetup.h"
 #include "luks1/luks.h"
@@ -40,6 +49,10 @@
 #include "utils_device_locking.h"
 #include "internal.h"
 #include "keyslot_context.h"
+#include "utils_threadpool.h"
+#include "utils_bufpool.h"
+#include "utils_workqueue.h"
+#include "utils_io.h"
 
 #define CRYPT_CD_UNRESTRICTED	(1 << 0)
 #define CRYPT_CD_QUIET		(1 << 1)
@@ -58,6 +71,44 @@ struct crypt_device {
 	/* global context scope settings */
 	unsigned key_in_keyring:1;
 
+	/* LUKS type of active device with postponed header load (lazy init by name) */
+	char *deferred_type;
+
+	/* maximal number of threads for parallel processing, 0 is auto */
+	unsigned int threads;
+	/* CRYPT_AFFINITY_* placement of worker threads and I/O buffers */
+	uint32_t affinity;
+	/* application executor replacing internal worker threads */
+	crypt_executor_run_fn executor;
+	void *executor_usrptr;
+
+	/* asynchronous token handlers timeout in ms, 0 is no timeout */
+	uint32_t token_timeout_ms;
+
+	/* performance tuning of next reencryption */
+	struct crypt_params_reencrypt_tuning reenc_tuning;
+
+	/* total memory for concurrent PBKDF in kB, 0 is auto */
+	uint64_t pbkdf_memory_limit_kb;
+
+	/* persistent PBKDF benchmark cache file */
+	char *pbkdf_cache;
+
+	/* cached aligned I/O buffers */
+	struct crypt_bufpool *bufpool;
+
+	/* no buffer pool, rollback copy nor cached on-disk state of metadata */
+	bool memory_lean;
+
+	/* keyslot tried first if no keyslot is specified */
+	int keyslot_hint;
+	char *keyslot_hint_cache;
+	int keyslot_hint_source;
+
+	/* verity hash tree staging (CRYPT_VERITY_CREATE_STAGED) */
+	char *verity_stage_device;
+	uint64_t verity_stage_memory;
+
 	uint64_t data_offset;
 	uint64_t metadata_size; /* Used in LUKS2 format */
 	uint64_t keyslots_size; /* Used in LUKS2 format */
@@ -134,16 +185,28 @@ struct crypt_device {
 	void *log_usrptr;
 	int (*confirm)(const char *msg, void *usrptr);
 	void *confirm_usrptr;
+	void (*trace)(struct crypt_device *cd, const struct crypt_trace_span *span, void *usrptr);
+	void *trace_usrptr;
 };
 
 /* Just to suppress redundant messages about crypto backend */
 static int _crypto_logged = 0;
 
+/* Serializes RNG and crypto backend initialization between threads */
+static pthread_mutex_t _crypto_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Log helper */
 static void (*_default_log)(int level, const char *msg, void *usrptr) = NULL;
 static void *_default_log_usrptr = NULL;
 static int _debug_level = 0;
 
+/* Trace helper */
+static void (*_default_trace)(struct crypt_device *cd, const struct crypt_trace_span *span, void *usrptr) = NULL;
+static void *_default_trace_usrptr = NULL;
+
+/* Process-wide statistics, updated with relaxed atomics */
+static uint64_t _stats[CRYPT_STAT_MAX];
+
 /* Library can do metadata locking  */
 static int _metadata_locking = 1;
 
@@ -153,6 +216,9 @@ static int _kernel_keyring_supported;
 /* Library allowed to use kernel keyring for loading VK in kernel crypto layer */
 static int _vk_via_keyring = 1;
 
+/* Library tries keyslots in parallel */
+static int _parallel_unlock = 0;
+
 void crypt_set_debug_level(int level)
 {
 	_debug_level = level;
@@ -180,6 +246,94 @@ void crypt_log(struct crypt_device *cd, int level, const char *msg)
 		fprintf(level == CRYPT_LOG_ERROR ? stderr : stdout, "%s", msg);
 }
 
+static uint64_t trace_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void crypt_trace_begin(struct crypt_trace *t, crypt_trace_type type, const char *name)
+{
+	t->type = type;
+	t->name = name;
+	t->start_us = trace_usec();
+}
+
+void crypt_stat_add(crypt_stat_type type, uint64_t value)
+{
+	if (type < CRYPT_STAT_MAX)
+		__atomic_add_fetch(&_stats[type], value, __ATOMIC_RELAXED);
+}
+
+/* Every finished span updates counters, even if no trace callback is set */
+static void trace_stats(crypt_trace_type type, uint64_t duration_us, uint64_t bytes)
+{
+	switch (type) {
+	case CRYPT_TRACE_KDF:
+		crypt_stat_add(CRYPT_STAT_KDF, 1);
+		crypt_stat_add(CRYPT_STAT_KDF_US, duration_us);
+		break;
+	case CRYPT_TRACE_HEADER_READ:
+		crypt_stat_add(CRYPT_STAT_HEADER_READ, 1);
+		crypt_stat_add(CRYPT_STAT_HEADER_READ_BYTES, bytes);
+		break;
+	case CRYPT_TRACE_HEADER_WRITE:
+		crypt_stat_add(CRYPT_STAT_HEADER_WRITE, 1);
+		crypt_stat_add(CRYPT_STAT_HEADER_WRITE_BYTES, bytes);
+		break;
+	case CRYPT_TRACE_DM_IOCTL:
+		crypt_stat_add(CRYPT_STAT_DM_IOCTL, 1);
+		break;
+	case CRYPT_TRACE_UDEV_WAIT:
+		crypt_stat_add(CRYPT_STAT_UDEV_WAIT, 1);
+		crypt_stat_add(CRYPT_STAT_UDEV_WAIT_US, duration_us);
+		break;
+	default:
+		break;
+	}
+}
+
+void crypt_trace_end(struct crypt_device *cd, struct crypt_trace *t, uint64_t bytes, int result)
+{
+	void (*trace)(struct crypt_device *cd, const struct crypt_trace_span *span, void *usrptr);
+	struct crypt_trace_span span;
+	uint64_t duration_us;
+	void *usrptr;
+
+	duration_us = trace_usec() - t->start_us;
+	trace_stats(t->type, duration_us, bytes);
+
+	if (cd && cd->trace) {
+		trace = cd->trace;
+		usrptr = cd->trace_usrptr;
+	} else {
+		trace = _default_trace;
+		usrptr = _default_trace_usrptr;
+	}
+
+#if !HAVE_SYS_SDT_H
+	if (!trace)
+		return;
+#endif
+	span.type = t->type;
+	span.name = t->name ?: "";
+	span.start_us = t->start_us;
+	span.duration_us = duration_us;
+	span.bytes = bytes;
+	span.result = result;
+
+#if HAVE_SYS_SDT_H
+	DTRACE_PROBE5(libcryptsetup, span, span.type, span.name, span.duration_us,
+		      span.bytes, span.result);
+#endif
+	if (trace)
+		trace(cd, &span, usrptr);
+}
+
 __attribute__((format(printf, 3, 4)))
 void crypt_logf(struct crypt_device *cd, int level, const char *format, ...)
 {
@@ -228,8 +382,11 @@ int init_crypto(struct crypt_device *ctx)
 	struct utsname uts;
 	int r;
 
+	pthread_mutex_lock(&_crypto_init_lock);
+
 	r = crypt_random_init(ctx);
 	if (r < 0) {
+		pthread_mutex_unlock(&_crypto_init_lock);
 		log_err(ctx, _("Cannot initialize crypto RNG backend."));
 		return r;
 	}
@@ -247,6 +404,8 @@ int init_crypto(struct crypt_device *ctx)
 		_crypto_logged = 1;
 	}
 
+	pthread_mutex_unlock(&_crypto_init_lock);
+
 	return r;
 }
 
@@ -335,11 +494,24 @@ static int isFVAULT2(const char *type)
 	return (type && !strcmp(CRYPT_FVAULT2, type));
 }
 
+static int crypt_load_deferred(struct crypt_device *cd);
+
+/*
+ * Device type for operations that need on-disk metadata.
+ * Loads LUKS header postponed by CRYPT_INIT_METADATA_LAZY first.
+ */
+static const char *metadata_type(struct crypt_device *cd)
+{
+	crypt_load_deferred(cd);
+
+	return cd ? cd->type : NULL;
+}
+
 static int _onlyLUKS(struct crypt_device *cd, uint32_t cdflags)
 {
 	int r = 0;
 
-	if (cd && !cd->type) {
+	if (cd && !metadata_type(cd)) {
 		if (!(cdflags & CRYPT_CD_QUIET))
 			log_err(cd, _("Cannot determine device type. Incompatible activation of device?"));
 		r = -EINVAL;
@@ -366,7 +538,7 @@ static int _onlyLUKS2(struct crypt_device *cd, uint32_t cdflags, uint32_t mask)
 {
 	int r = 0;
 
-	if (cd && !cd->type) {
+	if (cd && !metadata_type(cd)) {
 		if (!(cdflags & CRYPT_CD_QUIET))
 			log_err(cd, _("Cannot determine device type. Incompatible activation of device?"));
 		r = -EINVAL;
@@ -566,6 +738,66 @@ void crypt_set_log_callback(struct crypt_device *cd,
 	}
 }
 
+void crypt_set_trace_callback(struct crypt_device *cd,
+	void (*trace)(struct crypt_device *cd, const struct crypt_trace_span *span, void *usrptr),
+	void *usrptr)
+{
+	if (!cd) {
+		_default_trace = trace;
+		_default_trace_usrptr = usrptr;
+	} else {
+		cd->trace = trace;
+		cd->trace_usrptr = usrptr;
+	}
+}
+
+static uint64_t stat_get(crypt_stat_type type, bool reset)
+{
+	if (reset)
+		return __atomic_exchange_n(&_stats[type], 0, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&_stats[type], __ATOMIC_RELAXED);
+}
+
+static void stats_get(struct crypt_stats *stats, bool reset)
+{
+	stats->kdf_count = stat_get(CRYPT_STAT_KDF, reset);
+	stats->kdf_us = stat_get(CRYPT_STAT_KDF_US, reset);
+	stats->dm_ioctls = stat_get(CRYPT_STAT_DM_IOCTL, reset);
+	stats->udev_waits = stat_get(CRYPT_STAT_UDEV_WAIT, reset);
+	stats->udev_wait_us = stat_get(CRYPT_STAT_UDEV_WAIT_US, reset);
+	stats->metadata_reads = stat_get(CRYPT_STAT_HEADER_READ, reset);
+	stats->metadata_read_bytes = stat_get(CRYPT_STAT_HEADER_READ_BYTES, reset);
+	stats->metadata_writes = stat_get(CRYPT_STAT_HEADER_WRITE, reset);
+	stats->metadata_write_bytes = stat_get(CRYPT_STAT_HEADER_WRITE_BYTES, reset);
+	stats->storage_read_bytes = stat_get(CRYPT_STAT_STORAGE_READ_BYTES, reset);
+	stats->storage_write_bytes = stat_get(CRYPT_STAT_STORAGE_WRITE_BYTES, reset);
+	stats->temporary_devices = stat_get(CRYPT_STAT_TEMP_DEVICE, reset);
+	blockwise_stats(&stats->io_read_bytes, &stats->io_write_bytes, reset);
+}
+
+int crypt_get_stats(struct crypt_stats *stats)
+{
+	struct crypt_stats s;
+
+	/* older callers pass shorter structure, only known fields are filled */
+	if (!stats || stats->size < offsetof(struct crypt_stats, kdf_count) ||
+	    stats->size > sizeof(s))
+		return -EINVAL;
+
+	stats_get(&s, false);
+	s.size = stats->size;
+	memcpy(stats, &s, s.size);
+	return 0;
+}
+
+void crypt_reset_stats(void)
+{
+	struct crypt_stats stats;
+
+	stats_get(&stats, true);
+}
+
 void crypt_set_confirm_callback(struct crypt_device *cd,
 	int (*confirm)(const char *msg, void *usrptr),
 	void *usrptr)
@@ -598,6 +830,7 @@ int crypt_init(struct crypt_device **cd, const char *device)
 		return -ENOMEM;
 
 	memset(h, 0, sizeof(*h));
+	h->keyslot_hint = CRYPT_ANY_SLOT;
 
 	r = device_alloc(NULL, &h->device, device);
 	if (r < 0) {
@@ -700,6 +933,125 @@ int crypt_init_data_device(struct crypt_device **cd, const char *device, const c
 	return r;
 }
 
+int crypt_init_by_buffer(struct crypt_device **cd,
+	const void *buffer,
+	size_t buffer_size,
+	uint64_t device_size)
+{
+	struct crypt_device *h = NULL;
+	int r;
+
+	if (!cd || !buffer || !buffer_size)
+		return -EINVAL;
+
+	log_dbg(NULL, "Allocating context for memory device (%zu bytes).", buffer_size);
+
+	if (!(h = malloc(sizeof(struct crypt_device))))
+		return -ENOMEM;
+
+	memset(h, 0, sizeof(*h));
+	h->keyslot_hint = CRYPT_ANY_SLOT;
+
+	r = device_alloc_memory(NULL, &h->device, buffer, buffer_size, device_size);
+	if (r < 0) {
+		free(h);
+		return r;
+	}
+
+	dm_backend_init(NULL);
+
+	h->rng_type = crypt_random_default_key_rng();
+
+	*cd = h;
+	return 0;
+}
+
+/*
+ * The clone has the same devices, settings and loaded LUKS header as the source
+ * context but it does not read the header again. Volume keys and reencryption
+ * context are not cloned.
+ */
+int crypt_context_clone(struct crypt_device **cd_clone, struct crypt_device *cd)
+{
+	struct crypt_device *h = NULL;
+	int r;
+
+	if (!cd_clone || !cd || !cd->device || !cd->type ||
+	    (!isLUKS1(cd->type) && !isLUKS2(cd->type)))
+		return -EINVAL;
+
+	if (isLUKS2(cd->type) && cd->u.luks2.rh)
+		return -EBUSY;
+
+	log_dbg(cd, "Cloning context for crypt device %s.", mdata_device_path(cd));
+
+	r = crypt_init_data_device(&h, mdata_device_path(cd), data_device_path(cd));
+	if (r < 0)
+		return r;
+
+	h->rng_type = cd->rng_type;
+	h->compatibility = cd->compatibility;
+	h->key_in_keyring = cd->key_in_keyring;
+	h->threads = cd->threads;
+	h->affinity = cd->affinity;
+	h->executor = cd->executor;
+	h->executor_usrptr = cd->executor_usrptr;
+	h->token_timeout_ms = cd->token_timeout_ms;
+	h->reenc_tuning = cd->reenc_tuning;
+	h->pbkdf_memory_limit_kb = cd->pbkdf_memory_limit_kb;
+	h->data_offset = cd->data_offset;
+	h->metadata_size = cd->metadata_size;
+	h->keyslots_size = cd->keyslots_size;
+	h->memory_hard_pbkdf_lock_enabled = cd->memory_hard_pbkdf_lock_enabled;
+	h->memory_lean = cd->memory_lean;
+	h->keyslot_hint = cd->keyslot_hint;
+	h->verity_stage_memory = cd->verity_stage_memory;
+	h->log = cd->log;
+	h->log_usrptr = cd->log_usrptr;
+	h->confirm = cd->confirm;
+	h->confirm_usrptr = cd->confirm_usrptr;
+	h->trace = cd->trace;
+	h->trace_usrptr = cd->trace_usrptr;
+
+	r = -ENOMEM;
+	if (!(h->type = strdup(cd->type)) ||
+	    (cd->pbkdf_cache && !(h->pbkdf_cache = strdup(cd->pbkdf_cache))) ||
+	    (cd->keyslot_hint_cache && !(h->keyslot_hint_cache = strdup(cd->keyslot_hint_cache))) ||
+	    (cd->verity_stage_device && !(h->verity_stage_device = strdup(cd->verity_stage_device))))
+		goto err;
+
+	if (isLUKS2(cd->type)) {
+		if (cd->u.luks2.keyslot_cipher &&
+		    !(h->u.luks2.keyslot_cipher = strdup(cd->u.luks2.keyslot_cipher)))
+			goto err;
+		h->u.luks2.keyslot_key_size = cd->u.luks2.keyslot_key_size;
+		memcpy(h->u.luks2.cipher, cd->u.luks2.cipher, sizeof(h->u.luks2.cipher));
+		memcpy(h->u.luks2.cipher_mode, cd->u.luks2.cipher_mode, sizeof(h->u.luks2.cipher_mode));
+		r = LUKS2_hdr_clone(h, &h->u.luks2.hdr, &cd->u.luks2.hdr);
+		if (r < 0) {
+			/* nothing to free in header */
+			free(h->type);
+			h->type = NULL;
+			goto err;
+		}
+	} else {
+		if (cd->u.luks1.cipher_spec &&
+		    !(h->u.luks1.cipher_spec = strdup(cd->u.luks1.cipher_spec)))
+			goto err;
+		memcpy(&h->u.luks1.hdr, &cd->u.luks1.hdr, sizeof(h->u.luks1.hdr));
+	}
+
+	r = init_pbkdf_type(h, &cd->pbkdf, cd->type);
+	if (r < 0)
+		goto err;
+
+	*cd_clone = h;
+	return 0;
+err:
+	crypt_free(h);
+	return r;
+}
+
 static void crypt_free_type(struct crypt_device *cd, const char *force_type)
 {
 	const char *type = force_type ?: cd->type;
@@ -1090,26 +1442,12 @@ out:
 	return r;
 }
 
-int crypt_load(struct crypt_device *cd,
-	       const char *requested_type,
-	       void *params)
+static int _crypt_load_type(struct crypt_device *cd,
+			    const char *requested_type,
+			    void *params)
 {
 	int r;
 
-	if (!cd)
-		return -EINVAL;
-
-	log_dbg(cd, "Trying to load %s crypt type from device %s.",
-		requested_type ?: "any", mdata_device_path(cd) ?: "(none)");
-
-	if (!crypt_metadata_device(cd))
-		return -EINVAL;
-
-	crypt_reset_null_type(cd);
-	cd->data_offset = 0;
-	cd->metadata_size = 0;
-	cd->keyslots_size = 0;
-
 	if (!requested_type || isLUKS1(requested_type) || isLUKS2(requested_type)) {
 		if (cd->type && !isLUKS1(cd->type) && !isLUKS2(cd->type)) {
 			log_dbg(cd, "Context is already initialized to type %s", cd->type);
@@ -1153,6 +1491,143 @@ int crypt_load(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_load(struct crypt_device *cd,
+	       const char *requested_type,
+	       void *params)
+{
+	int r;
+
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Trying to load %s crypt type from device %s.",
+		requested_type ?: "any", mdata_device_path(cd) ?: "(none)");
+
+	if (!crypt_metadata_device(cd))
+		return -EINVAL;
+
+	crypt_reset_null_type(cd);
+	cd->data_offset = 0;
+	cd->metadata_size = 0;
+	cd->keyslots_size = 0;
+
+	/* all format parsers share one read of the metadata areas */
+	device_probe_begin(crypt_metadata_device(cd));
+	r = _crypt_load_type(cd, requested_type, params);
+	device_probe_end(crypt_metadata_device(cd));
+
+	return r;
+}
+
+/*
+ * Bulk LUKS binary header scan, only the primary binary header is read
+ * without any device context or metadata validation.
+ */
+#define HEADER_SCAN_SIZE 4096
+
+static void header_scan_string(char *dst, const char *src, size_t len)
+{
+	memcpy(dst, src, len);
+	dst[len - 1] = '\0';
+}
+
+static int header_scan_one(struct crypt_header_summary *h)
+{
+	const struct luks2_hdr_disk *hdr2;
+	const struct luks_phdr *hdr1;
+	void *buf = NULL;
+	ssize_t len;
+	int fd, r = 0;
+
+	if (!h->device)
+		return -EINVAL;
+
+	/* Not all filesystems support direct-io, use page cache then */
+	fd = open(h->device, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(h->device, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (posix_memalign(&buf, HEADER_SCAN_SIZE, HEADER_SCAN_SIZE)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	len = pread(fd, buf, HEADER_SCAN_SIZE, 0);
+	if (len < 0)
+		r = -errno;
+	else if (len != HEADER_SCAN_SIZE)
+		r = -EINVAL;
+	close(fd);
+
+	hdr1 = buf;
+	hdr2 = buf;
+
+	if (!r && memcmp(hdr2->magic, LUKS2_MAGIC_1ST, LUKS2_MAGIC_L))
+		r = -EINVAL;
+
+	if (!r) {
+		h->version = be16_to_cpu(hdr2->version);
+		if (h->version == 1)
+			header_scan_string(h->uuid, hdr1->uuid, UUID_STRING_L);
+		else if (h->version == 2 && !be64_to_cpu(hdr2->hdr_offset)) {
+			h->seqid = be64_to_cpu(hdr2->seqid);
+			h->hdr_size = be64_to_cpu(hdr2->hdr_size);
+			header_scan_string(h->uuid, hdr2->uuid, LUKS2_UUID_L);
+			header_scan_string(h->label, hdr2->label, LUKS2_LABEL_L);
+			header_scan_string(h->subsystem, hdr2->subsystem, LUKS2_LABEL_L);
+		} else
+			r = -EINVAL;
+	}
+
+	free(buf);
+	return r;
+}
+
+static int header_scan_job(void *arg, unsigned int job)
+{
+	struct crypt_header_summary *h = (struct crypt_header_summary *)arg + job;
+
+	h->result = header_scan_one(h);
+	if (h->result < 0)
+		log_dbg(NULL, "LUKS header scan of %s failed with %d.", h->device ?: "(none)", h->result);
+
+	return 0;
+}
+
+int crypt_header_scan_batch(struct crypt_header_summary *headers,
+	size_t count,
+	unsigned int threads)
+{
+	struct crypt_threadpool *tp = NULL;
+	const char *device;
+	size_t i;
+	int r;
+
+	if (!headers || !count || count > UINT_MAX || threads > CRYPT_MAX_THREADS)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		device = headers[i].device;
+		headers[i] = (struct crypt_header_summary) { .device = device, .result = -EINVAL };
+	}
+
+	if (!threads)
+		threads = crypt_get_threads(NULL);
+	if (threads > count)
+		threads = count;
+
+	log_dbg(NULL, "Scanning %zu LUKS headers using %u threads.", count, threads);
+
+	r = crypt_threadpool_init(NULL, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, count, header_scan_job, headers);
+	crypt_threadpool_destroy(tp);
+
+	return r;
+}
+
 /*
  * crypt_init() helpers
  */
@@ -1217,7 +1692,53 @@ static const char *LUKS_UUID(struct crypt_device *cd)
 	return NULL;
 }
 
-static int _init_by_name_crypt(struct crypt_device *cd, const char *name)
+/*
+ * Load LUKS header postponed by CRYPT_INIT_METADATA_LAZY init by name.
+ * If the header does not match active device, context stays without header.
+ */
+static int crypt_load_deferred(struct crypt_device *cd)
+{
+	struct crypt_dm_active_device dmd;
+	char *name;
+	int r;
+
+	if (!cd || cd->type || !cd->deferred_type || !cd->u.none.active_name)
+		return 0;
+
+	log_dbg(cd, "Loading postponed %s header for active device %s.",
+		cd->deferred_type, cd->u.none.active_name);
+
+	r = dm_query_device(cd, cd->u.none.active_name, DM_ACTIVE_UUID, &dmd);
+	if (r < 0)
+		return r;
+
+	name = cd->u.none.active_name;
+	cd->u.none.active_name = NULL;
+	crypt_set_null_type(cd);
+	MOVE_REF(cd->type, cd->deferred_type);
+
+	r = _crypt_load_luks(cd, cd->type, true, false);
+	if (r < 0) {
+		log_dbg(cd, "LUKS device header does not match active device.");
+		crypt_set_null_type(cd);
+		device_close(cd, cd->metadata_device);
+		device_close(cd, cd->device);
+	} else if ((r = crypt_uuid_cmp(dmd.uuid, LUKS_UUID(cd))) < 0) {
+		log_dbg(cd, "LUKS device header uuid: %s mismatches DM returned uuid %s",
+			LUKS_UUID(cd), dmd.uuid);
+		crypt_free_type(cd, NULL);
+	}
+
+	if (r < 0)
+		cd->u.none.active_name = name;
+	else
+		free(name);
+
+	free(CONST_CAST(void*)dmd.uuid);
+	return r;
+}
+
+static int _init_by_name_crypt(struct crypt_device *cd, const char *name, bool lazy)
 {
 	bool found = false;
 	char **dep, *cipher_spec = NULL, cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
@@ -1338,7 +1859,11 @@ static int _init_by_name_crypt(struct crypt_device *cd, const char *name)
 			key_nums++;
 		cd->u.loopaes.key_size = tgt->u.crypt.vk->keylength / key_nums;
 	} else if (isLUKS1(cd->type) || isLUKS2(cd->type)) {
-		if (crypt_metadata_device(cd)) {
+		if (lazy && crypt_metadata_device(cd)) {
+			log_dbg(cd, "Postponing LUKS header load for active device %s.", name);
+			MOVE_REF(cd->deferred_type, cd->type);
+			r = 0;
+		} else if (crypt_metadata_device(cd)) {
 			r = _crypt_load_luks(cd, cd->type, true, false);
 			if (r < 0) {
 				log_dbg(cd, "LUKS device header does not match active device.");
@@ -1485,16 +2010,17 @@ out:
 	return r;
 }
 
-int crypt_init_by_name_and_header(struct crypt_device **cd,
-				  const char *name,
-				  const char *header_device)
+int crypt_init_by_name_flags(struct crypt_device **cd,
+			     const char *name,
+			     const char *header_device,
+			     uint32_t flags)
 {
 	crypt_status_info ci;
 	struct crypt_dm_active_device dmd;
 	struct dm_target *tgt = &dmd.segment;
 	int r;
 
-	if (!cd || !name)
+	if (!cd || !name || (flags & ~CRYPT_INIT_METADATA_LAZY))
 		return -EINVAL;
 
 	log_dbg(NULL, "Allocating crypt device context by device %s.", name);
@@ -1565,7 +2091,7 @@ int crypt_init_by_name_and_header(struct crypt_device **cd,
 	/* Try to initialize basic parameters from active device */
 
 	if (tgt->type == DM_CRYPT || tgt->type == DM_LINEAR)
-		r = _init_by_name_crypt(*cd, name);
+		r = _init_by_name_crypt(*cd, name, flags & CRYPT_INIT_METADATA_LAZY);
 	else if (tgt->type == DM_VERITY)
 		r = _init_by_name_verity(*cd, name);
 	else if (tgt->type == DM_INTEGRITY)
@@ -1577,6 +2103,12 @@ out:
 	} else if (!(*cd)->type) {
 		/* For anonymous device (no header found) remember initialized name */
 		(*cd)->u.none.active_name = strdup(name);
+		if (!(*cd)->u.none.active_name) {
+			r = -ENOMEM;
+			crypt_free(*cd);
+			*cd = NULL;
+		} else if ((*cd)->deferred_type)
+			(void)_init_by_name_crypt_none(*cd);
 	}
 
 	free(CONST_CAST(void*)dmd.uuid);
@@ -1584,9 +2116,16 @@ out:
 	return r;
 }
 
+int crypt_init_by_name_and_header(struct crypt_device **cd,
+				  const char *name,
+				  const char *header_device)
+{
+	return crypt_init_by_name_flags(cd, name, header_device, 0);
+}
+
 int crypt_init_by_name(struct crypt_device **cd, const char *name)
 {
-	return crypt_init_by_name_and_header(cd, name, NULL);
+	return crypt_init_by_name_flags(cd, name, NULL, 0);
 }
 
 /*
@@ -1795,7 +2334,8 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 			       const char *volume_key,
 			       size_t volume_key_size,
 			       struct crypt_params_luks2 *params,
-			       bool sector_size_autodetect)
+			       bool sector_size_autodetect,
+			       int integrity_inline)
 {
 	int r, integrity_key_size = 0;
 	unsigned long required_alignment = DEFAULT_DISK_ALIGNMENT;
@@ -1961,6 +2501,25 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
+	if (integrity_inline > 0 && !crypt_get_integrity_tag_size(cd)) {
+		log_err(cd, _("Integrity inline mode requires authenticated encryption."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (integrity_inline && crypt_get_integrity_tag_size(cd)) {
+		if (INTEGRITY_inline_supported(cd, params ? params->integrity_params : NULL,
+					       crypt_get_integrity_tag_size(cd), &sector_size,
+					       integrity_inline < 0))
+			integrity_inline = 1;
+		else if (integrity_inline > 0) {
+			r = -ENOTSUP;
+			goto out;
+		} else
+			integrity_inline = 0;
+		log_dbg(cd, "Integrity inline mode %s.", integrity_inline ? "used" : "not used");
+	}
+
 	if (cd->metadata_size && (cd->metadata_size != LUKS2_metadata_size(&cd->u.luks2.hdr)))
 		log_std(cd, _("WARNING: LUKS2 metadata size changed to %" PRIu64 " bytes.\n"),
 			LUKS2_metadata_size(&cd->u.luks2.hdr));
@@ -2016,7 +2575,8 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 			goto out;
 		}
 
-		r = INTEGRITY_format(cd, params ? params->integrity_params : NULL, NULL, NULL);
+		r = INTEGRITY_format(cd, params ? params->integrity_params : NULL, NULL, NULL,
+				     integrity_inline > 0);
 		if (r)
 			log_err(cd, _("Cannot format integrity for device %s."),
 				data_device_path(cd));
@@ -2097,12 +2657,35 @@ static int _crypt_format_loopaes(struct crypt_device *cd,
 	return 0;
 }
 
+static int _verity_check_fec_area(struct crypt_device *cd,
+				  struct crypt_params_verity *params,
+				  struct device *fec_device)
+{
+	uint64_t hash_blocks_size = VERITY_hash_blocks(cd, params) * params->hash_block_size;
+
+	if (device_is_identical(crypt_metadata_device(cd), fec_device) > 0 &&
+	    (params->hash_area_offset + hash_blocks_size) > params->fec_area_offset) {
+		log_err(cd, _("Hash area overlaps with FEC area."));
+		return -EINVAL;
+	}
+
+	if (device_is_identical(crypt_data_device(cd), fec_device) > 0 &&
+	    (cd->u.verity.hdr.data_size * params->data_block_size) > params->fec_area_offset) {
+		log_err(cd, _("Data area overlaps with FEC area."));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Data are read from stream_fd (if not negative), data size is known only after hashing */
 static int _crypt_format_verity(struct crypt_device *cd,
 				 const char *uuid,
-				 struct crypt_params_verity *params)
+				 struct crypt_params_verity *params,
+				 int stream_fd)
 {
 	int r = 0, hash_size;
-	uint64_t data_device_size, hash_blocks_size;
+	uint64_t data_device_size, max_blocks = 0;
 	struct device *fec_device = NULL;
 	char *fec_device_path = NULL, *hash_name = NULL, *root_hash = NULL, *salt = NULL;
 
@@ -2114,7 +2697,8 @@ static int _crypt_format_verity(struct crypt_device *cd,
 	if (!params)
 		return -EINVAL;
 
-	if (!params->data_device && !cd->metadata_device)
+	/* Data stream can be only hashed, without data device */
+	if (!params->data_device && !cd->metadata_device && stream_fd < 0)
 		return -EINVAL;
 
 	if (params->hash_type > VERITY_MAX_HASH_TYPE) {
@@ -2147,7 +2731,16 @@ static int _crypt_format_verity(struct crypt_device *cd,
 			return r;
 	}
 
-	if (!params->data_size) {
+	if (stream_fd >= 0) {
+		if (params->fec_device && !params->data_device) {
+			log_err(cd, _("FEC requires data device for data stream."));
+			return -EINVAL;
+		}
+		cd->u.verity.hdr.data_size = 0;
+		if (params->data_device &&
+		    device_is_identical(crypt_metadata_device(cd), crypt_data_device(cd)) > 0)
+			max_blocks = params->hash_area_offset / params->data_block_size;
+	} else if (!params->data_size) {
 		r = device_size(cd->device, &data_device_size);
 		if (r < 0)
 			return r;
@@ -2156,7 +2749,7 @@ static int _crypt_format_verity(struct crypt_device *cd,
 	} else
 		cd->u.verity.hdr.data_size = params->data_size;
 
-	if (device_is_identical(crypt_metadata_device(cd), crypt_data_device(cd)) > 0 &&
+	if (stream_fd < 0 && device_is_identical(crypt_metadata_device(cd), crypt_data_device(cd)) > 0 &&
 	   (cd->u.verity.hdr.data_size * params->data_block_size) > params->hash_area_offset) {
 		log_err(cd, _("Data area overlaps with hash area."));
 		return -EINVAL;
@@ -2180,19 +2773,11 @@ static int _crypt_format_verity(struct crypt_device *cd,
 			goto out;
 		}
 
-		hash_blocks_size = VERITY_hash_blocks(cd, params) * params->hash_block_size;
-		if (device_is_identical(crypt_metadata_device(cd), fec_device) > 0 &&
-		    (params->hash_area_offset + hash_blocks_size) > params->fec_area_offset) {
-			log_err(cd, _("Hash area overlaps with FEC area."));
-			r = -EINVAL;
-			goto out;
-		}
-
-		if (device_is_identical(crypt_data_device(cd), fec_device) > 0 &&
-		    (cd->u.verity.hdr.data_size * params->data_block_size) > params->fec_area_offset) {
-			log_err(cd, _("Data area overlaps with FEC area."));
-			r = -EINVAL;
-			goto out;
+		/* Areas of data stream are checked when its size is known */
+		if (stream_fd < 0) {
+			r = _verity_check_fec_area(cd, params, fec_device);
+			if (r)
+				goto out;
 		}
 	}
 
@@ -2228,11 +2813,37 @@ static int _crypt_format_verity(struct crypt_device *cd,
 	if (r)
 		goto out;
 
+	if ((params->flags & (CRYPT_VERITY_CREATE_HASH | CRYPT_VERITY_CREATE_STAGED)) ==
+	    (CRYPT_VERITY_CREATE_HASH | CRYPT_VERITY_CREATE_STAGED)) {
+		if (stream_fd >= 0 || params->fec_device) {
+			log_err(cd, _("Staged hash creation is not supported with FEC or data stream."));
+			r = -ENOTSUP;
+			goto out;
+		}
+		if (!cd->verity_stage_device &&
+		    VERITY_hash_blocks(cd, &cd->u.verity.hdr) * params->hash_block_size >
+		    (cd->verity_stage_memory ?: VERITY_STAGE_MEMORY_DEFAULT)) {
+			log_err(cd, _("Hash tree does not fit in memory limit, use scratch device."));
+			r = -ENOMEM;
+			goto out;
+		}
+	}
+
 	if (params->flags & CRYPT_VERITY_CREATE_HASH) {
-		r = VERITY_create(cd, &cd->u.verity.hdr,
-				  cd->u.verity.root_hash, cd->u.verity.root_hash_size);
-		if (!r && params->fec_device)
-			r = VERITY_FEC_process(cd, &cd->u.verity.hdr, cd->u.verity.fec_device, 0, NULL);
+		if (stream_fd >= 0) {
+			r = VERITY_create_stream(cd, &cd->u.verity.hdr, stream_fd,
+						 params->data_device ? crypt_data_device(cd) : NULL,
+						 max_blocks, root_hash, cd->u.verity.root_hash_size);
+			if (!r && fec_device)
+				r = _verity_check_fec_area(cd, &cd->u.verity.hdr, fec_device);
+			if (!r && fec_device)
+				r = VERITY_FEC_process(cd, &cd->u.verity.hdr, fec_device, 0, NULL);
+		} else if (params->fec_device)
+			r = VERITY_create_fec(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+					      cd->u.verity.root_hash, cd->u.verity.root_hash_size);
+		else
+			r = VERITY_create(cd, &cd->u.verity.hdr,
+					  cd->u.verity.root_hash, cd->u.verity.root_hash_size);
 		if (r)
 			goto out;
 	}
@@ -2264,10 +2875,11 @@ out:
 
 static int _crypt_format_integrity(struct crypt_device *cd,
 				   const char *uuid,
-				   struct crypt_params_integrity *params)
+				   struct crypt_params_integrity *params,
+				   int integrity_inline)
 {
 	int r;
-	uint32_t integrity_tag_size;
+	uint32_t integrity_tag_size, sector_size;
 	char *integrity = NULL, *journal_integrity = NULL, *journal_crypt = NULL;
 	struct volume_key *journal_crypt_key = NULL, *journal_mac_key = NULL;
 
@@ -2279,6 +2891,20 @@ static int _crypt_format_integrity(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
+	/* Inline mode with unset sector size uses device metadata interval */
+	sector_size = params->sector_size;
+	if (integrity_inline) {
+		integrity_tag_size = params->tag_size ?: (uint32_t)INTEGRITY_hash_tag_size(params->integrity);
+		if (INTEGRITY_inline_supported(cd, params, integrity_tag_size,
+					       &sector_size, integrity_inline < 0))
+			integrity_inline = 1;
+		else if (integrity_inline > 0)
+			return -ENOTSUP;
+		else
+			integrity_inline = 0;
+		log_dbg(cd, "Integrity inline mode %s.", integrity_inline ? "used" : "not used");
+	}
+
 	r = device_check_access(cd, crypt_metadata_device(cd), DEV_EXCL);
 	if (r < 0)
 		return r;
@@ -2339,13 +2965,14 @@ static int _crypt_format_integrity(struct crypt_device *cd,
 	cd->u.integrity.params.journal_commit_time = params->journal_commit_time;
 	cd->u.integrity.params.interleave_sectors = params->interleave_sectors;
 	cd->u.integrity.params.buffer_sectors = params->buffer_sectors;
-	cd->u.integrity.params.sector_size = params->sector_size;
+	cd->u.integrity.params.sector_size = sector_size;
 	cd->u.integrity.params.tag_size = integrity_tag_size;
 	cd->u.integrity.params.integrity = integrity;
 	cd->u.integrity.params.journal_integrity = journal_integrity;
 	cd->u.integrity.params.journal_crypt = journal_crypt;
 
-	r = INTEGRITY_format(cd, params, cd->u.integrity.journal_crypt_key, cd->u.integrity.journal_mac_key);
+	r = INTEGRITY_format(cd, params, cd->u.integrity.journal_crypt_key, cd->u.integrity.journal_mac_key,
+			     integrity_inline > 0);
 	if (r)
 		log_err(cd, _("Cannot format integrity for device %s."),
 			mdata_device_path(cd));
@@ -2369,7 +2996,8 @@ static int _crypt_format(struct crypt_device *cd,
 	const char *volume_key,
 	size_t volume_key_size,
 	void *params,
-	bool sector_size_autodetect)
+	bool sector_size_autodetect,
+	int integrity_inline)
 {
 	int r;
 
@@ -2397,13 +3025,14 @@ static int _crypt_format(struct crypt_device *cd,
 					uuid, volume_key, volume_key_size, params);
 	else if (isLUKS2(type))
 		r = _crypt_format_luks2(cd, cipher, cipher_mode,
-					uuid, volume_key, volume_key_size, params, sector_size_autodetect);
+					uuid, volume_key, volume_key_size, params, sector_size_autodetect,
+					integrity_inline);
 	else if (isLOOPAES(type))
 		r = _crypt_format_loopaes(cd, cipher, uuid, volume_key_size, params);
 	else if (isVERITY(type))
-		r = _crypt_format_verity(cd, uuid, params);
+		r = _crypt_format_verity(cd, uuid, params, -1);
 	else if (isINTEGRITY(type))
-		r = _crypt_format_integrity(cd, uuid, params);
+		r = _crypt_format_integrity(cd, uuid, params, integrity_inline);
 	else {
 		log_err(cd, _("Unknown crypt device type %s requested."), type);
 		r = -EINVAL;
@@ -2429,7 +3058,8 @@ CRYPT_SYMBOL_EXPORT_NEW(int, crypt_format, 2, 4,
 	size_t volume_key_size,
 	void *params)
 {
-	return _crypt_format(cd, type, cipher, cipher_mode, uuid, volume_key, volume_key_size, params, true);
+	/* Inline integrity mode is selected automatically if supported */
+	return _crypt_format(cd, type, cipher, cipher_mode, uuid, volume_key, volume_key_size, params, true, -1);
 }
 
 
@@ -2444,7 +3074,22 @@ CRYPT_SYMBOL_EXPORT_OLD(int, crypt_format, 2, 0,
 	size_t volume_key_size,
 	void *params)
 {
-	return _crypt_format(cd, type, cipher, cipher_mode, uuid, volume_key, volume_key_size, params, false);
+	return _crypt_format(cd, type, cipher, cipher_mode, uuid, volume_key, volume_key_size, params, false, 0);
+}
+
+int crypt_format_inline(struct crypt_device *cd,
+	const char *type,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *uuid,
+	const char *volume_key,
+	size_t volume_key_size,
+	void *params)
+{
+	if (!type || (!isINTEGRITY(type) && !isLUKS2(type)))
+		return -EINVAL;
+
+	return _crypt_format(cd, type, cipher, cipher_mode, uuid, volume_key, volume_key_size, params, true, 1);
 }
 
 int crypt_repair(struct crypt_device *cd,
@@ -2472,8 +3117,25 @@ int crypt_repair(struct crypt_device *cd,
 
 	/* cd->type and header must be set in context */
 	r = crypt_check_data_device_size(cd);
-	if (r < 0)
+	if (r < 0) {
 		crypt_set_null_type(cd);
+		return r;
+	}
+
+	if (isLUKS2(cd->type)) {
+		r = LUKS2_segments_compact(cd, &cd->u.luks2.hdr);
+		if (r > 0) {
+			log_verbose(cd, _("Merging adjacent LUKS2 data segments.\n"));
+			r = LUKS2_hdr_write(cd, &cd->u.luks2.hdr);
+		}
+		if (r < 0)
+			return r;
+		r = 0;
+	}
+
+	if (isLUKS2(cd->type) && LUKS2_hdr_check_block_alignment(cd, &cd->u.luks2.hdr) > 0)
+		log_std(cd, _("WARNING: LUKS2 metadata areas are not aligned to device block size, "
+			      "metadata updates will be slower.\n"));
 
 	return r;
 }
@@ -2871,6 +3533,7 @@ static int _reload_device_with_integrity(struct crypt_device *cd,
 	tdmd.flags = sdmd->flags;
 	tdmd.size = sdmd->size;
 
+	sdmdi->io_profile = DM_IO_PROFILE_STACKED;
 	if ((r = dm_reload_device(cd, iname, sdmdi, 0, 0))) {
 		log_err(cd, _("Failed to reload device %s."), iname);
 		goto out;
@@ -2936,6 +3599,53 @@ out:
 	return r;
 }
 
+/*
+ * Only the length of active dm-crypt table is changed, the rest of the table
+ * (including volume key or its keyring reference) is reused as is. The device
+ * is suspended only for the table swap in resume.
+ */
+static int _resize_active_table(struct crypt_device *cd, const char *name,
+				struct crypt_dm_active_device *dmdq, uint64_t new_size)
+{
+	struct dm_target *tgt = &dmdq->segment;
+	int r;
+
+	r = device_block_adjust(cd, tgt->data_device, DEV_OK,
+			tgt->u.crypt.offset, &new_size, &dmdq->flags);
+	if (r)
+		return r;
+
+	if (MISALIGNED(new_size, tgt->u.crypt.sector_size >> SECTOR_SHIFT)) {
+		log_err(cd, _("Device size is not aligned to requested sector size."));
+		return -EINVAL;
+	}
+
+	if (MISALIGNED(new_size, device_block_size(cd, tgt->data_device) >> SECTOR_SHIFT)) {
+		log_err(cd, _("Device size is not aligned to device logical block size."));
+		return -EINVAL;
+	}
+
+	if (new_size == dmdq->size) {
+		log_dbg(cd, "Device has already requested size %" PRIu64
+			" sectors.", dmdq->size);
+		return 0;
+	}
+
+	if (isLUKS2(cd->type)) {
+		r = LUKS2_unmet_requirements(cd, &cd->u.luks2.hdr, 0, 0);
+		if (r)
+			return r;
+	}
+
+	log_dbg(cd, "Reloading active table of %s with new length %" PRIu64 " sectors.",
+		name, new_size);
+
+	dmdq->size = tgt->size = new_size;
+	dmdq->flags |= CRYPT_ACTIVATE_REFRESH;
+
+	return dm_reload_device(cd, name, dmdq, 0, 1);
+}
+
 int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 {
 	struct crypt_dm_active_device dmdq, dmd = {};
@@ -2950,6 +3660,8 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 	 *	  explicit size stored in metadata (length != "dynamic")
 	 */
 
+	crypt_load_deferred(cd);
+
 	/* Device context type must be initialized */
 	if (!cd || !cd->type || !name)
 		return -EINVAL;
@@ -2961,7 +3673,8 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 
 	log_dbg(cd, "Resizing device %s to %" PRIu64 " sectors.", name, new_size);
 
-	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY |
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE | DM_ACTIVE_CRYPT_CIPHER |
+			    DM_ACTIVE_UUID | DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_CRYPT_KEY |
 			    DM_ACTIVE_INTEGRITY_PARAMS | DM_ACTIVE_JOURNAL_CRYPT_KEY |
 			    DM_ACTIVE_JOURNAL_MAC_KEY, &dmdq);
 	if (r < 0) {
@@ -2975,11 +3688,15 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 	}
 
 	if ((dmdq.flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_key_in_keyring(cd)) {
-		r = -EPERM;
-		goto out;
-	}
-
-	if (crypt_key_in_keyring(cd)) {
+		/* Key referenced by active table is still in kernel keyring, reuse it. */
+		if (tgt->type != DM_CRYPT || !tgt->u.crypt.vk->key_description ||
+		    keyring_key_exists(LOGON_KEY, tgt->u.crypt.vk->key_description) <= 0) {
+			r = -EPERM;
+			goto out;
+		}
+		log_dbg(cd, "Reusing kernel keyring key %s of active device.",
+			tgt->u.crypt.vk->key_description);
+	} else if (crypt_key_in_keyring(cd)) {
 		if (!isLUKS2(cd->type)) {
 			r = -EINVAL;
 			goto out;
@@ -3000,6 +3717,11 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 			log_err(cd, _("Cannot resize loop device."));
 	}
 
+	if (tgt->type == DM_CRYPT && !tgt->u.crypt.tag_size && dmdq.uuid &&
+	    !crypt_uuid_cmp(dmdq.uuid, crypt_get_uuid(cd))) {
+		r = _resize_active_table(cd, name, &dmdq, new_size);
+		goto out;
+	}
 
 	/*
 	 * Integrity device metadata are maintained by the kernel. We need to
@@ -3106,6 +3828,7 @@ int crypt_resize(struct crypt_device *cd, const char *name, uint64_t new_size)
 out:
 	dm_targets_free(cd, &dmd);
 	dm_targets_free(cd, &dmdq);
+	free(CONST_CAST(void*)dmdq.uuid);
 
 	return r;
 }
@@ -3182,6 +3905,8 @@ int crypt_header_backup(struct crypt_device *cd,
 	if (!backup_file)
 		return -EINVAL;
 
+	crypt_load_deferred(cd);
+
 	/* Load with repair */
 	r = _crypt_load_luks(cd, requested_type, false, false);
 	if (r < 0)
@@ -3200,6 +3925,52 @@ int crypt_header_backup(struct crypt_device *cd,
 	return r;
 }
 
+static int header_backup_job(void *arg, unsigned int job)
+{
+	struct crypt_header_backup_request *b = (struct crypt_header_backup_request *)arg + job;
+
+	b->result = crypt_header_backup(b->cd, b->requested_type, b->backup_file);
+
+	return 0;
+}
+
+int crypt_header_backup_batch(struct crypt_header_backup_request *backups,
+	size_t count)
+{
+	struct crypt_threadpool *tp = NULL;
+	unsigned int threads;
+	size_t i;
+	int r;
+
+	if (!backups || !count || count > UINT_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!backups[i].cd)
+			return -EINVAL;
+		backups[i].result = -EINVAL;
+	}
+
+	threads = crypt_get_threads(backups[0].cd);
+	if (threads > count)
+		threads = count;
+
+	log_dbg(backups[0].cd, "Backing up %zu headers using %u threads.", count, threads);
+
+	r = crypt_threadpool_init(backups[0].cd, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, count, header_backup_job, backups);
+	crypt_threadpool_destroy(tp);
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < count; i++)
+		if (backups[i].result < 0)
+			return backups[i].result;
+
+	return 0;
+}
+
 int crypt_header_restore(struct crypt_device *cd,
 			 const char *requested_type,
 			 const char *backup_file)
@@ -3281,12 +4052,17 @@ void crypt_free(struct crypt_device *cd)
 	crypt_free_volume_key(cd->volume_key);
 
 	crypt_free_type(cd, NULL);
+	free(cd->deferred_type);
 
 	device_free(cd, cd->device);
 	device_free(cd, cd->metadata_device);
 
 	free(CONST_CAST(void*)cd->pbkdf.type);
 	free(CONST_CAST(void*)cd->pbkdf.hash);
+	free(cd->pbkdf_cache);
+	free(cd->keyslot_hint_cache);
+	free(cd->verity_stage_device);
+	crypt_bufpool_destroy(cd->bufpool);
 
 	/* Some structures can contain keys (TCRYPT), wipe it */
 	crypt_safe_memzero(cd, sizeof(*cd));
@@ -3376,6 +4152,98 @@ out:
 	return r;
 }
 
+static int kernel_keyring_support(void);
+
+static char *crypt_get_suspend_key_description(struct crypt_device *cd)
+{
+	char *desc;
+
+	if (!crypt_get_uuid(cd))
+		return NULL;
+
+	if (asprintf(&desc, "cryptsetup:%s-suspend", crypt_get_uuid(cd)) < 0)
+		return NULL;
+
+	return desc;
+}
+
+int crypt_suspend_cache_key(struct crypt_device *cd,
+			    const char *name,
+			    unsigned int timeout)
+{
+	struct crypt_dm_active_device dmd;
+	struct dm_target *tgt = &dmd.segment;
+	char *desc = NULL;
+	uint32_t dmc_flags;
+	int r;
+
+	if (!cd || !name || !timeout)
+		return -EINVAL;
+
+	log_dbg(cd, "Suspending volume %s with cached volume key (timeout %u s).", name, timeout);
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	if (!kernel_keyring_support()) {
+		log_err(cd, _("Kernel keyring is not supported by the kernel."));
+		return -ENOTSUP;
+	}
+
+	/* resume reinstates the key by its keyring description */
+	if (dm_flags(cd, DM_CRYPT, &dmc_flags) || !(dmc_flags & DM_KERNEL_KEYRING_SUPPORTED)) {
+		log_err(cd, _("Kernel keyring is not supported by dm-crypt."));
+		return -ENOTSUP;
+	}
+
+	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEY | DM_ACTIVE_CRYPT_KEYSIZE, &dmd);
+	if (r < 0) {
+		log_err(cd, _("Volume %s is not active."), name);
+		return r;
+	}
+
+	if (!single_segment(&dmd) || tgt->type != DM_CRYPT ||
+	    crypt_is_cipher_null(crypt_get_cipher_spec(cd))) {
+		log_err(cd, _("This operation is not supported for this device type."));
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	if (dmd.flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		log_err(cd, _("Volume key of device %s is in kernel keyring and cannot be cached."), name);
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	r = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, tgt->u.crypt.vk);
+	if (r < 0) {
+		log_err(cd, _("Volume key does not match the volume."));
+		goto out;
+	}
+
+	desc = crypt_get_suspend_key_description(cd);
+	if (!desc) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = keyring_add_key_in_user_keyring_timeout(LOGON_KEY, desc, tgt->u.crypt.vk->key,
+						    tgt->u.crypt.vk->keylength, timeout);
+	if (r) {
+		log_dbg(cd, "keyring_add_key_in_user_keyring_timeout failed (error %d)", r);
+		log_err(cd, _("Failed to load key in kernel keyring."));
+		goto out;
+	}
+
+	r = crypt_suspend(cd, name);
+	if (r < 0)
+		keyring_revoke_and_unlink_key(LOGON_KEY, desc);
+out:
+	free(desc);
+	dm_targets_free(cd, &dmd);
+	return r;
+}
+
 /* key must be properly verified */
 static int resume_by_volume_key(struct crypt_device *cd,
 		struct volume_key *vk,
@@ -3616,6 +4484,62 @@ int crypt_resume_by_token_pin(struct crypt_device *cd, const char *name,
 	return r < 0 ? r : keyslot;
 }
 
+int crypt_resume_by_cached_key(struct crypt_device *cd, const char *name)
+{
+	struct volume_key *vk = NULL;
+	char *desc;
+	int r;
+
+	if (!name)
+		return -EINVAL;
+
+	log_dbg(cd, "Resuming volume %s by cached volume key.", name);
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	r = dm_status_suspended(cd, name);
+	if (r < 0)
+		return r;
+
+	if (!r) {
+		log_err(cd, _("Volume %s is not suspended."), name);
+		return -EINVAL;
+	}
+
+	desc = crypt_get_suspend_key_description(cd);
+	if (!desc)
+		return -ENOMEM;
+
+	if (keyring_key_exists(LOGON_KEY, desc) <= 0) {
+		log_dbg(cd, "No cached volume key %s in kernel keyring.", desc);
+		r = -ENOENT;
+		goto out;
+	}
+
+	/* key payload is referenced by description only, it was verified on suspend */
+	vk = crypt_alloc_volume_key(crypt_get_volume_key_size(cd), NULL);
+	if (!vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_volume_key_set_description(vk, desc);
+	if (!r)
+		r = dm_resume_and_reinstate_key(cd, name, vk);
+
+	if (r == -ENOTSUP)
+		log_err(cd, _("Resume is not supported for device %s."), name);
+	else if (r)
+		log_err(cd, _("Error during resuming device %s."), name);
+	else
+		keyring_revoke_and_unlink_key(LOGON_KEY, desc);
+out:
+	crypt_free_volume_key(vk);
+	free(desc);
+	return r;
+}
+
 /*
  * Keyslot manipulation
  */
@@ -3863,15 +4787,46 @@ int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot)
 	return LUKS2_keyslot_wipe(cd, &cd->u.luks2.hdr, keyslot, 0);
 }
 
-static int _check_header_data_overlap(struct crypt_device *cd, const char *name)
+int crypt_keyslots_destroy(struct crypt_device *cd, const int *keyslots, size_t count)
 {
-	if (!name || !isLUKS(cd->type))
-		return 0;
+	crypt_keyslot_info ki;
+	size_t i;
+	int r;
 
-	if (device_is_identical(crypt_data_device(cd), crypt_metadata_device(cd)) <= 0)
-		return 0;
+	if (!keyslots || !count)
+		return -EINVAL;
 
-	/* FIXME: check real header size */
+	if ((r = _onlyLUKS(cd, CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	if (isLUKS1(cd->type) || count > LUKS2_KEYSLOTS_MAX) {
+		for (i = 0; i < count; i++)
+			if ((r = crypt_keyslot_destroy(cd, keyslots[i])))
+				return r;
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		log_dbg(cd, "Destroying keyslot %d.", keyslots[i]);
+		ki = crypt_keyslot_status(cd, keyslots[i]);
+		if (ki == CRYPT_SLOT_INVALID) {
+			log_err(cd, _("Key slot %d is invalid."), keyslots[i]);
+			return -EINVAL;
+		}
+	}
+
+	return LUKS2_keyslots_wipe(cd, &cd->u.luks2.hdr, keyslots, (int)count);
+}
+
+static int _check_header_data_overlap(struct crypt_device *cd, const char *name)
+{
+	if (!name || !isLUKS(cd->type))
+		return 0;
+
+	if (device_is_identical(crypt_data_device(cd), crypt_metadata_device(cd)) <= 0)
+		return 0;
+
+	/* FIXME: check real header size */
 	if (crypt_get_data_offset(cd) == 0) {
 		log_err(cd, _("Device header overlaps with data area."));
 		return -EINVAL;
@@ -3927,6 +4882,7 @@ static int _create_device_with_integrity(struct crypt_device *cd,
 
 	device_check = dmd->flags & CRYPT_ACTIVATE_SHARED ? DEV_OK : DEV_EXCL;
 
+	dmdi->io_profile = DM_IO_PROFILE_STACKED;
 	r = INTEGRITY_activate_dmd_device(cd, iname, CRYPT_INTEGRITY, dmdi, 0);
 	if (r)
 		return r;
@@ -3953,12 +4909,13 @@ static int kernel_keyring_support(void)
 {
 	static unsigned _checked = 0;
 
-	if (!_checked) {
-		_kernel_keyring_supported = keyring_check();
-		_checked = 1;
+	/* Check is idempotent, concurrent callers may only repeat it. */
+	if (!__atomic_load_n(&_checked, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&_kernel_keyring_supported, keyring_check(), __ATOMIC_RELAXED);
+		__atomic_store_n(&_checked, 1, __ATOMIC_RELEASE);
 	}
 
-	return _kernel_keyring_supported;
+	return __atomic_load_n(&_kernel_keyring_supported, __ATOMIC_RELAXED);
 }
 
 static int dmcrypt_keyring_bug(void)
@@ -4072,7 +5029,8 @@ static int _open_and_activate(struct crypt_device *cd,
 	if (!crypt_use_keyring_for_vk(cd))
 		use_keyring = false;
 	else
-		use_keyring = ((name && !crypt_is_cipher_null(crypt_get_cipher(cd))) ||
+		use_keyring = ((name && !crypt_is_cipher_null(crypt_get_cipher(cd)) &&
+				!(flags & CRYPT_ACTIVATE_INLINE_CRYPT)) ||
 			       (flags & CRYPT_ACTIVATE_KEYRING_KEY));
 
 	if (use_keyring) {
@@ -4083,8 +5041,11 @@ static int _open_and_activate(struct crypt_device *cd,
 		flags |= CRYPT_ACTIVATE_KEYRING_KEY;
 	}
 
-	if (name)
+	if (name) {
 		r = LUKS2_activate(cd, name, vk, flags);
+		if (!r)
+			(void)LUKS2_keyslot_telemetry_record(cd, &cd->u.luks2.hdr, keyslot);
+	}
 out:
 	if (r < 0)
 		crypt_drop_keyring_key(cd, vk);
@@ -4096,17 +5057,7 @@ out:
 #if USE_LUKS2_REENCRYPTION
 static int load_all_keys(struct crypt_device *cd, struct luks2_hdr *hdr, struct volume_key *vks)
 {
-	int r;
-	struct volume_key *vk = vks;
-
-	while (vk) {
-		r = LUKS2_volume_key_load_in_keyring_by_digest(cd, vk, crypt_volume_key_get_id(vk));
-		if (r < 0)
-			return r;
-		vk = crypt_volume_key_next(vk);
-	}
-
-	return 0;
+	return LUKS2_volume_keys_load_in_keyring(cd, vks);
 }
 
 static int _open_all_keys(struct crypt_device *cd,
@@ -4404,6 +5355,8 @@ static int _activate_check_status(struct crypt_device *cd, const char *name, uns
 {
 	int r;
 
+	crypt_load_deferred(cd);
+
 	if (!name)
 		return 0;
 
@@ -4448,6 +5401,338 @@ int crypt_activate_by_passphrase(struct crypt_device *cd,
 	return _activate_by_passphrase(cd, name, keyslot, passphrase, passphrase_size, flags);
 }
 
+struct activation_batch {
+	struct crypt_activation *a;
+	struct {
+		char *vk;
+		size_t vk_size;
+		bool parallel;
+	} *e;
+};
+
+static bool activation_parallel(struct crypt_activation *a)
+{
+	if (isLUKS1(a->cd->type))
+		return true;
+
+	return isLUKS2(a->cd->type) &&
+	       LUKS2_reencrypt_status(&a->cd->u.luks2.hdr) == CRYPT_REENCRYPT_NONE;
+}
+
+/* Maximal memory-hard PBKDF cost of the keyslots that can be tried */
+static uint32_t activation_memory_kb(struct crypt_activation *a)
+{
+	struct crypt_pbkdf_type pbkdf;
+	uint32_t memory_kb = 0;
+	int i, max;
+
+	if (!isLUKS2(a->cd->type))
+		return 0;
+
+	max = crypt_keyslot_max(CRYPT_LUKS2);
+	for (i = 0; i < max; i++) {
+		if (a->keyslot != CRYPT_ANY_SLOT && a->keyslot != i)
+			continue;
+		if (crypt_keyslot_get_pbkdf(a->cd, i, &pbkdf) < 0)
+			continue;
+		if (pbkdf.max_memory_kb > memory_kb)
+			memory_kb = pbkdf.max_memory_kb;
+	}
+
+	return memory_kb;
+}
+
+static int activation_batch_job(void *arg, unsigned int job)
+{
+	struct activation_batch *b = arg;
+	struct crypt_activation *a = &b->a[job];
+
+	if (!b->e[job].parallel)
+		return 0;
+
+	a->result = crypt_volume_key_get(a->cd, a->keyslot, b->e[job].vk, &b->e[job].vk_size,
+					 a->passphrase, a->passphrase_size);
+	return 0;
+}
+
+int crypt_activate_by_passphrase_batch(struct crypt_activation *activations,
+	size_t count)
+{
+	struct activation_batch b = { .a = activations };
+	struct crypt_threadpool *tp = NULL;
+	struct crypt_activation *a;
+	uint64_t memory_kb = 0, budget_kb;
+	uint32_t entry_memory_kb;
+	unsigned int threads, parallel = 0;
+	bool serialize = false;
+	size_t i;
+	int r, key_len;
+
+	if (!activations || !count || count > UINT_MAX)
+		return -EINVAL;
+
+	b.e = calloc(count, sizeof(*b.e));
+	if (!b.e)
+		return -ENOMEM;
+
+	/* Validation and status checks (serial, libdevmapper context is global) */
+	for (i = 0; i < count; i++) {
+		a = &activations[i];
+		a->result = -EINVAL;
+		if (!a->cd || !a->passphrase || (!a->name && (a->flags & CRYPT_ACTIVATE_REFRESH)))
+			continue;
+
+		log_dbg(a->cd, "%s volume %s [keyslot %d] using passphrase in batch.",
+			a->name ? "Activating" : "Checking", a->name ?: "passphrase",
+			a->keyslot);
+
+		a->result = _activate_check_status(a->cd, a->name, a->flags & CRYPT_ACTIVATE_REFRESH);
+		if (a->result < 0)
+			continue;
+
+		if (!activation_parallel(a)) {
+			a->result = 0;
+			continue;
+		}
+
+		if (isLUKS2(a->cd->type) && a->keyslot != CRYPT_ANY_SLOT)
+			key_len = LUKS2_get_keyslot_stored_key_size(&a->cd->u.luks2.hdr, a->keyslot);
+		else
+			key_len = crypt_get_volume_key_size(a->cd);
+		if (key_len <= 0) {
+			a->result = -EINVAL;
+			continue;
+		}
+
+		b.e[i].vk = crypt_safe_alloc(key_len);
+		if (!b.e[i].vk) {
+			a->result = -ENOMEM;
+			continue;
+		}
+		b.e[i].vk_size = key_len;
+		b.e[i].parallel = true;
+		a->result = 0;
+		parallel++;
+
+		entry_memory_kb = activation_memory_kb(a);
+		if (entry_memory_kb > memory_kb)
+			memory_kb = entry_memory_kb;
+		if (crypt_serialize_lock_enabled(a->cd))
+			serialize = true;
+	}
+
+	/* Unlock volume keys, half of physical memory for memory-hard KDF */
+	threads = serialize ? 1 : crypt_get_threads(activations[0].cd);
+	if (threads > parallel)
+		threads = parallel;
+	budget_kb = crypt_getphysmemory_kb() / 2;
+	if (memory_kb && threads > budget_kb / memory_kb)
+		threads = budget_kb > memory_kb ? budget_kb / memory_kb : 1;
+
+	if (parallel) {
+		log_dbg(activations[0].cd, "Unlocking %u volume keys using %u threads.", parallel, threads);
+		r = crypt_threadpool_init(activations[0].cd, &tp, threads);
+		if (!r)
+			r = crypt_threadpool_run(tp, count, activation_batch_job, &b);
+		crypt_threadpool_destroy(tp);
+		if (r < 0) {
+			for (i = 0; i < count; i++)
+				if (b.e[i].parallel)
+					activations[i].result = r;
+		}
+	}
+
+	/* Create devices, udev is synchronized once for all of them */
+	dm_udev_batch_begin();
+	for (i = 0; i < count; i++) {
+		a = &activations[i];
+		if (a->result < 0)
+			continue;
+
+		if (!b.e[i].parallel) {
+			a->result = _activate_by_passphrase(a->cd, a->name, a->keyslot,
+					a->passphrase, a->passphrase_size, a->flags);
+			continue;
+		}
+
+		r = crypt_activate_by_volume_key(a->cd, a->name, b.e[i].vk, b.e[i].vk_size, a->flags);
+		if (r < 0)
+			a->result = r;
+	}
+	dm_udev_batch_end();
+
+	for (i = 0, r = 0; i < count; i++) {
+		crypt_safe_free(b.e[i].vk);
+		if (!r && activations[i].result < 0)
+			r = activations[i].result;
+	}
+	free(b.e);
+
+	return r;
+}
+
+/* Per thread, activation functions must be settled by the same thread. */
+static __thread bool _udev_deferred = false;
+
+int crypt_udev_defer(int enable)
+{
+	if (enable && !_udev_deferred)
+		dm_udev_batch_begin();
+	else if (!enable && _udev_deferred)
+		dm_udev_batch_end();
+
+	_udev_deferred = enable ? true : false;
+	return 0;
+}
+
+int crypt_udev_settle(int wait)
+{
+	return dm_udev_batch_settle(wait);
+}
+
+struct crypt_activation_request {
+	struct crypt_device *cd;
+	char *name;
+	int keyslot;
+	struct crypt_keyslot_context *kc;
+	uint32_t flags;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+	int result;
+	int fd;		/* eventfd, readable when request is completed */
+};
+
+static int _activate_by_keyslot_context(struct crypt_device *cd, const char *name,
+	int keyslot, struct crypt_keyslot_context *kc, uint32_t flags)
+{
+	switch (kc->type) {
+	case CRYPT_KC_TYPE_PASSPHRASE:
+		return crypt_activate_by_passphrase(cd, name, keyslot,
+				kc->u.p.passphrase, kc->u.p.passphrase_size, flags);
+	case CRYPT_KC_TYPE_KEYFILE:
+		return crypt_activate_by_keyfile_device_offset(cd, name, keyslot,
+				kc->u.kf.keyfile, kc->u.kf.keyfile_size, kc->u.kf.keyfile_offset, flags);
+	case CRYPT_KC_TYPE_TOKEN:
+		return crypt_activate_by_token_pin(cd, name, kc->u.t.type, kc->u.t.id,
+				kc->u.t.pin, kc->u.t.pin_size, kc->u.t.usrptr, flags);
+	case CRYPT_KC_TYPE_KEY:
+		return crypt_activate_by_volume_key(cd, name,
+				kc->u.k.volume_key, kc->u.k.volume_key_size, flags);
+	}
+
+	return -EINVAL;
+}
+
+static void activation_request_work(void *arg)
+{
+	struct crypt_activation_request *req = arg;
+	uint64_t event = 1;
+	int r;
+
+	r = _activate_by_keyslot_context(req->cd, req->name, req->keyslot, req->kc, req->flags);
+
+	/* Request cannot be freed before lock is released */
+	pthread_mutex_lock(&req->lock);
+	req->result = r;
+	req->done = true;
+	if (write(req->fd, &event, sizeof(event)) != sizeof(event))
+		log_dbg(req->cd, "Cannot signal activation request completion.");
+	pthread_cond_broadcast(&req->cond);
+	pthread_mutex_unlock(&req->lock);
+}
+
+int crypt_activate_by_keyslot_context_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	struct crypt_keyslot_context *kc,
+	uint32_t flags,
+	struct crypt_activation_request **req)
+{
+	struct crypt_activation_request *h;
+	int r;
+
+	if (!cd || !kc || !req || (!name && (flags & CRYPT_ACTIVATE_REFRESH)))
+		return -EINVAL;
+
+	log_dbg(cd, "Submitting %s of volume %s [keyslot %d] using keyslot context %s.",
+		name ? "activation" : "check", name ?: "passphrase", keyslot,
+		keyslot_context_type_string(kc));
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	h->cd = cd;
+	h->keyslot = keyslot;
+	h->kc = kc;
+	h->flags = flags;
+	h->fd = -1;
+	if (name && !(h->name = strdup(name))) {
+		free(h);
+		return -ENOMEM;
+	}
+
+	h->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (h->fd < 0) {
+		free(h->name);
+		free(h);
+		return -errno;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->cond, NULL);
+
+	r = crypt_work_submit(activation_request_work, h);
+	if (r < 0) {
+		log_dbg(cd, "Cannot submit activation request.");
+		h->done = true;
+		crypt_activation_request_free(h);
+		return r;
+	}
+
+	*req = h;
+	return 0;
+}
+
+int crypt_activation_request_get_fd(struct crypt_activation_request *req)
+{
+	return req ? req->fd : -EINVAL;
+}
+
+int crypt_activation_request_result(struct crypt_activation_request *req)
+{
+	int r;
+
+	if (!req)
+		return -EINVAL;
+
+	pthread_mutex_lock(&req->lock);
+	r = req->done ? req->result : -EINPROGRESS;
+	pthread_mutex_unlock(&req->lock);
+
+	return r;
+}
+
+void crypt_activation_request_free(struct crypt_activation_request *req)
+{
+	if (!req)
+		return;
+
+	/* Device handle and keyslot context are in use until completion */
+	pthread_mutex_lock(&req->lock);
+	while (!req->done)
+		pthread_cond_wait(&req->cond, &req->lock);
+	pthread_mutex_unlock(&req->lock);
+
+	pthread_cond_destroy(&req->cond);
+	pthread_mutex_destroy(&req->lock);
+	close(req->fd);
+	free(req->name);
+	free(req);
+}
+
 int crypt_activate_by_keyfile_device_offset(struct crypt_device *cd,
 	const char *name,
 	int keyslot,
@@ -4594,7 +5879,8 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
 		if (!crypt_use_keyring_for_vk(cd))
 			use_keyring = false;
 		else
-			use_keyring = (name && !crypt_is_cipher_null(crypt_get_cipher(cd))) ||
+			use_keyring = (name && !crypt_is_cipher_null(crypt_get_cipher(cd)) &&
+				       !(flags & CRYPT_ACTIVATE_INLINE_CRYPT)) ||
 				      (flags & CRYPT_ACTIVATE_KEYRING_KEY);
 
 		if (!r && use_keyring) {
@@ -4642,31 +5928,27 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
 	return r;
 }
 
-int crypt_activate_by_signed_key(struct crypt_device *cd,
+/* Signature (if any) is already loaded in thread keyring under signature_description */
+static int _activate_by_signed_key(struct crypt_device *cd,
 	const char *name,
 	const char *volume_key,
 	size_t volume_key_size,
-	const char *signature,
-	size_t signature_size,
+	const char *signature_description,
 	uint32_t flags)
 {
-	char description[512];
 	int r;
 
-	if (!cd || !isVERITY(cd->type))
-		return -EINVAL;
-
-	if (!volume_key || !volume_key_size || (!name && signature)) {
+	if (!volume_key || !volume_key_size || (!name && signature_description)) {
 		log_err(cd, _("Incorrect root hash specified for verity device."));
 		return -EINVAL;
 	}
 
 	if (name)
-		log_dbg(cd, "Activating volume %s by %skey.", name, signature ? "signed " : "");
+		log_dbg(cd, "Activating volume %s by %skey.", name, signature_description ? "signed " : "");
 	else
 		log_dbg(cd, "Checking volume by key.");
 
-	if (cd->u.verity.hdr.flags & CRYPT_VERITY_ROOT_HASH_SIGNATURE && !signature) {
+	if (cd->u.verity.hdr.flags & CRYPT_VERITY_ROOT_HASH_SIGNATURE && !signature_description) {
 		log_err(cd, _("Root hash signature required."));
 		return -EINVAL;
 	}
@@ -4675,31 +5957,12 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
-	if (signature && !kernel_keyring_support()) {
-		log_err(cd, _("Kernel keyring missing: required for passing signature to kernel."));
-		return -EINVAL;
-	}
-
 	/* volume_key == root hash */
 	free(CONST_CAST(void*)cd->u.verity.root_hash);
 	cd->u.verity.root_hash = NULL;
 
-	if (signature) {
-		r = snprintf(description, sizeof(description)-1, "cryptsetup:%s%s%s",
-			     crypt_get_uuid(cd) ?: "", crypt_get_uuid(cd) ? "-" : "", name);
-		if (r < 0)
-			return -EINVAL;
-
-		log_dbg(cd, "Adding signature into keyring %s", description);
-		r = keyring_add_key_in_thread_keyring(USER_KEY, description, signature, signature_size);
-		if (r) {
-			log_err(cd, _("Failed to load key in kernel keyring."));
-			return r;
-		}
-	}
-
 	r = VERITY_activate(cd, name, volume_key, volume_key_size,
-			    signature ? description : NULL,
+			    signature_description,
 			    cd->u.verity.fec_device,
 			    &cd->u.verity.hdr, flags | CRYPT_ACTIVATE_READONLY);
 
@@ -4710,69 +5973,256 @@ int crypt_activate_by_signed_key(struct crypt_device *cd,
 			memcpy(CONST_CAST(void*)cd->u.verity.root_hash, volume_key, volume_key_size);
 	}
 
-	if (signature)
-		crypt_drop_keyring_key_by_description(cd, description, USER_KEY);
-
 	return r;
 }
 
-int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t flags)
+static int verity_signature_load(struct crypt_device *cd, const char *description,
+	const char *signature, size_t signature_size)
 {
-	struct crypt_device *fake_cd = NULL;
-	struct luks2_hdr *hdr2 = NULL;
-	struct crypt_dm_active_device dmd = {};
 	int r;
-	uint32_t get_flags = DM_ACTIVE_DEVICE | DM_ACTIVE_UUID | DM_ACTIVE_HOLDERS;
 
-	if (!name)
+	if (!kernel_keyring_support()) {
+		log_err(cd, _("Kernel keyring missing: required for passing signature to kernel."));
 		return -EINVAL;
+	}
 
-	if ((flags & CRYPT_DEACTIVATE_DEFERRED) && (flags & CRYPT_DEACTIVATE_DEFERRED_CANCEL))
+	log_dbg(cd, "Adding signature into keyring %s", description);
+	r = keyring_add_key_in_thread_keyring(USER_KEY, description, signature, signature_size);
+	if (r)
+		log_err(cd, _("Failed to load key in kernel keyring."));
+
+	return r;
+}
+
+int crypt_activate_by_signed_key(struct crypt_device *cd,
+	const char *name,
+	const char *volume_key,
+	size_t volume_key_size,
+	const char *signature,
+	size_t signature_size,
+	uint32_t flags)
+{
+	char description[512];
+	int r;
+
+	if (!cd || !isVERITY(cd->type))
 		return -EINVAL;
 
-	log_dbg(cd, "Deactivating volume %s.", name);
+	if (!signature)
+		return _activate_by_signed_key(cd, name, volume_key, volume_key_size, NULL, flags);
 
-	if (!cd) {
-		r = crypt_init_by_name(&fake_cd, name);
-		if (r < 0)
-			return r;
-		cd = fake_cd;
+	if (!name) {
+		log_err(cd, _("Incorrect root hash specified for verity device."));
+		return -EINVAL;
 	}
 
-	/* skip holders detection and early abort when some flags raised */
-	if (flags & (CRYPT_DEACTIVATE_FORCE | CRYPT_DEACTIVATE_DEFERRED | CRYPT_DEACTIVATE_DEFERRED_CANCEL))
-		get_flags &= ~DM_ACTIVE_HOLDERS;
+	r = snprintf(description, sizeof(description)-1, "cryptsetup:%s%s%s",
+		     crypt_get_uuid(cd) ?: "", crypt_get_uuid(cd) ? "-" : "", name);
+	if (r < 0)
+		return -EINVAL;
 
-	switch (crypt_status(cd, name)) {
-		case CRYPT_ACTIVE:
-		case CRYPT_BUSY:
-			if (flags & CRYPT_DEACTIVATE_DEFERRED_CANCEL) {
-				r = dm_cancel_deferred_removal(name);
-				if (r < 0)
-					log_err(cd, _("Could not cancel deferred remove from device %s."), name);
-				break;
-			}
+	r = verity_signature_load(cd, description, signature, signature_size);
+	if (r)
+		return r;
 
-			r = dm_query_device(cd, name, get_flags, &dmd);
-			if (r >= 0) {
-				if (dmd.holders) {
-					log_err(cd, _("Device %s is still in use."), name);
-					r = -EBUSY;
-					break;
-				}
-			}
+	r = _activate_by_signed_key(cd, name, volume_key, volume_key_size, description, flags);
 
-			if (isLUKS2(cd->type))
-				hdr2 = crypt_get_hdr(cd, CRYPT_LUKS2);
+	crypt_drop_keyring_key_by_description(cd, description, USER_KEY);
 
-			if ((dmd.uuid && !strncmp(CRYPT_LUKS2, dmd.uuid, sizeof(CRYPT_LUKS2)-1)) || hdr2)
-				r = LUKS2_deactivate(cd, name, hdr2, &dmd, flags);
-			else if (isTCRYPT(cd->type))
-				r = TCRYPT_deactivate(cd, name, flags);
-			else
-				r = dm_remove_device(cd, name, flags);
-			if (r < 0 && crypt_status(cd, name) == CRYPT_BUSY) {
-				log_err(cd, _("Device %s is still in use."), name);
+	return r;
+}
+
+/*
+ * The same image (root hash and signature) is often activated many times,
+ * the signature is then loaded in keyring only once (keyed by root hash)
+ * and referenced by all device tables.
+ */
+static int verity_batch_signature(struct crypt_verity_activation *activations, size_t i,
+	char descriptions[][512], bool *loaded)
+{
+	struct crypt_verity_activation *a = &activations[i];
+	char *hex;
+	size_t j;
+	int r;
+
+	for (j = 0; j < i; j++) {
+		if (!loaded[j] || activations[j].root_hash_size != a->root_hash_size ||
+		    activations[j].signature_size != a->signature_size ||
+		    memcmp(activations[j].root_hash, a->root_hash, a->root_hash_size) ||
+		    memcmp(activations[j].signature, a->signature, a->signature_size))
+			continue;
+		log_dbg(a->cd, "Reusing signature in keyring %s.", descriptions[j]);
+		memcpy(descriptions[i], descriptions[j], sizeof(descriptions[i]));
+		return 0;
+	}
+
+	hex = crypt_bytes_to_hex(a->root_hash_size, a->root_hash);
+	if (!hex)
+		return -ENOMEM;
+	r = snprintf(descriptions[i], sizeof(descriptions[i]) - 1, "cryptsetup:verity:%s:%zu", hex, i);
+	crypt_safe_free(hex);
+	if (r < 0 || (size_t)r >= sizeof(descriptions[i]) - 1)
+		return -EINVAL;
+
+	r = verity_signature_load(a->cd, descriptions[i], a->signature, a->signature_size);
+	if (!r)
+		loaded[i] = true;
+
+	return r;
+}
+
+int crypt_activate_by_signed_key_batch(struct crypt_verity_activation *activations,
+	size_t count)
+{
+	struct crypt_verity_activation *a;
+	char (*descriptions)[512];
+	bool *loaded;
+	size_t i;
+	int r;
+
+	if (!activations || !count)
+		return -EINVAL;
+
+	descriptions = calloc(count, sizeof(*descriptions));
+	loaded = calloc(count, sizeof(*loaded));
+	if (!descriptions || !loaded) {
+		free(descriptions);
+		free(loaded);
+		return -ENOMEM;
+	}
+
+	/* Create devices, udev is synchronized once for all of them */
+	dm_udev_batch_begin();
+	for (i = 0; i < count; i++) {
+		a = &activations[i];
+		a->result = -EINVAL;
+		if (!a->cd || !isVERITY(a->cd->type) || !a->name || !a->root_hash)
+			continue;
+
+		if (a->signature) {
+			a->result = verity_batch_signature(activations, i, descriptions, loaded);
+			if (a->result < 0)
+				continue;
+		}
+
+		a->result = _activate_by_signed_key(a->cd, a->name, a->root_hash, a->root_hash_size,
+						    a->signature ? descriptions[i] : NULL, a->flags);
+	}
+	dm_udev_batch_end();
+
+	for (i = 0, r = 0; i < count; i++) {
+		if (loaded[i])
+			crypt_drop_keyring_key_by_description(activations[i].cd, descriptions[i], USER_KEY);
+		if (!r && activations[i].result < 0)
+			r = activations[i].result;
+	}
+
+	free(descriptions);
+	free(loaded);
+
+	return r;
+}
+
+static int verity_load_job(void *arg, unsigned int job)
+{
+	struct crypt_verity_load *l = (struct crypt_verity_load *)arg + job;
+
+	if (l->cd)
+		l->result = crypt_load(l->cd, CRYPT_VERITY, l->params);
+
+	return 0;
+}
+
+int crypt_load_verity_batch(struct crypt_verity_load *loads, size_t count)
+{
+	struct crypt_threadpool *tp = NULL;
+	unsigned int threads;
+	size_t i;
+	int r;
+
+	if (!loads || !count || count > UINT_MAX || !loads[0].cd)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		loads[i].result = -EINVAL;
+
+	threads = crypt_get_threads(loads[0].cd);
+	if (threads > count)
+		threads = count;
+
+	/* Superblock reads are independent, contexts share only DM capability cache */
+	log_dbg(loads[0].cd, "Loading %zu VERITY superblocks using %u threads.", count, threads);
+	r = crypt_threadpool_init(loads[0].cd, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, count, verity_load_job, loads);
+	crypt_threadpool_destroy(tp);
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < count; i++)
+		if (loads[i].result < 0)
+			return loads[i].result;
+
+	return 0;
+}
+
+int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t flags)
+{
+	struct crypt_device *fake_cd = NULL;
+	struct luks2_hdr *hdr2 = NULL;
+	struct crypt_dm_active_device dmd = {};
+	int r;
+	uint32_t get_flags = DM_ACTIVE_DEVICE | DM_ACTIVE_UUID | DM_ACTIVE_HOLDERS;
+
+	if (!name)
+		return -EINVAL;
+
+	if ((flags & CRYPT_DEACTIVATE_DEFERRED) && (flags & CRYPT_DEACTIVATE_DEFERRED_CANCEL))
+		return -EINVAL;
+
+	log_dbg(cd, "Deactivating volume %s.", name);
+
+	if (!cd) {
+		r = crypt_init_by_name(&fake_cd, name);
+		if (r < 0)
+			return r;
+		cd = fake_cd;
+	}
+
+	/* skip holders detection and early abort when some flags raised */
+	if (flags & (CRYPT_DEACTIVATE_FORCE | CRYPT_DEACTIVATE_DEFERRED | CRYPT_DEACTIVATE_DEFERRED_CANCEL))
+		get_flags &= ~DM_ACTIVE_HOLDERS;
+
+	switch (crypt_status(cd, name)) {
+		case CRYPT_ACTIVE:
+		case CRYPT_BUSY:
+			if (flags & CRYPT_DEACTIVATE_DEFERRED_CANCEL) {
+				r = dm_cancel_deferred_removal(name);
+				if (r < 0)
+					log_err(cd, _("Could not cancel deferred remove from device %s."), name);
+				break;
+			}
+
+			r = dm_query_device(cd, name, get_flags, &dmd);
+			if (r >= 0) {
+				if (dmd.holders) {
+					log_err(cd, _("Device %s is still in use."), name);
+					r = -EBUSY;
+					break;
+				}
+			}
+
+			if (isLUKS2(cd->type))
+				hdr2 = crypt_get_hdr(cd, CRYPT_LUKS2);
+
+			if ((dmd.uuid && !strncmp(CRYPT_LUKS2, dmd.uuid, sizeof(CRYPT_LUKS2)-1)) || hdr2)
+				r = LUKS2_deactivate(cd, name, hdr2, &dmd, flags);
+			else if (isTCRYPT(cd->type))
+				r = TCRYPT_deactivate(cd, name, flags);
+			else
+				r = dm_remove_device(cd, name, flags);
+			if (r < 0 && crypt_status(cd, name) == CRYPT_BUSY) {
+				log_err(cd, _("Device %s is still in use."), name);
 				r = -EBUSY;
 			}
 			break;
@@ -4797,6 +6247,72 @@ int crypt_deactivate(struct crypt_device *cd, const char *name)
 	return crypt_deactivate_by_name(cd, name, 0);
 }
 
+/* Device is ready for removal if no other device is stacked over it */
+static bool deactivation_ready(struct crypt_deactivation *d)
+{
+	int major, minor;
+
+	if (!d->name || dm_device_devno(d->cd, d->name, &major, &minor) < 0)
+		return true;
+
+	return crypt_dev_holders(major, minor) <= 0;
+}
+
+int crypt_deactivate_by_name_batch(struct crypt_deactivation *deactivations,
+	size_t count)
+{
+	struct crypt_deactivation *d;
+	size_t i, pending, level = 0;
+	bool *done, *ready;
+	int r;
+
+	if (!deactivations || !count)
+		return -EINVAL;
+
+	done = calloc(count, 2 * sizeof(*done));
+	if (!done)
+		return -ENOMEM;
+	ready = done + count;
+
+	for (i = 0; i < count; i++)
+		deactivations[i].result = -EINVAL;
+	pending = count;
+
+	while (pending) {
+		/* Holders are checked for the whole level before anything is removed */
+		for (i = 0, r = 0; i < count; i++) {
+			ready[i] = !done[i] && deactivation_ready(&deactivations[i]);
+			if (ready[i])
+				r++;
+		}
+
+		/* The rest is held by other (not requested) devices, fails as busy */
+		if (!r)
+			for (i = 0; i < count; i++)
+				ready[i] = !done[i];
+
+		log_dbg(deactivations[0].cd, "Deactivating %d devices in level %zu.", r ?: (int)pending, level++);
+
+		dm_udev_batch_begin();
+		for (i = 0; i < count; i++) {
+			if (!ready[i])
+				continue;
+			d = &deactivations[i];
+			d->result = crypt_deactivate_by_name(d->cd, d->name, d->flags);
+			done[i] = true;
+			pending--;
+		}
+		dm_udev_batch_end();
+	}
+
+	for (i = 0, r = 0; i < count; i++)
+		if (!r && deactivations[i].result < 0)
+			r = deactivations[i].result;
+	free(done);
+
+	return r;
+}
+
 int crypt_get_active_device(struct crypt_device *cd, const char *name,
 			    struct crypt_active_device *cad)
 {
@@ -4814,7 +6330,8 @@ int crypt_get_active_device(struct crypt_device *cd, const char *name,
 		return r;
 
 	/* For LUKS2 with integrity we need flags from underlying dm-integrity */
-	if (isLUKS2(cd->type) && crypt_get_integrity_tag_size(cd) && single_segment(&dmd)) {
+	if ((isLUKS2(cd->type) || isLUKS2(cd->deferred_type)) && single_segment(&dmd) &&
+	    tgt->type == DM_CRYPT && tgt->u.crypt.tag_size) {
 		namei = device_dm_name(tgt->data_device);
 		if (namei && dm_query_device(cd, namei, 0, &dmdi) >= 0)
 			dmd.flags |= dmdi.flags;
@@ -4872,6 +6389,203 @@ uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd, const char
 	return failures;
 }
 
+int crypt_get_active_stats(struct crypt_device *cd, const char *name,
+			   struct crypt_active_stats *stats)
+{
+	struct crypt_active_stats s = {};
+	struct crypt_dm_active_device dmd;
+	uint64_t stat[CRYPT_DEV_STAT_FIELDS];
+	const char *iname = NULL;
+	int major, minor, r;
+
+	/* older callers pass shorter structure, only known fields are filled */
+	if (!name || !stats || stats->size < offsetof(struct crypt_active_stats, read_ios) ||
+	    stats->size > sizeof(s))
+		return -EINVAL;
+
+	r = dm_device_devno(cd, name, &major, &minor);
+	if (r < 0)
+		return r;
+
+	if (!crypt_dev_stat(major, minor, stat)) {
+		log_dbg(cd, "Cannot read I/O statistics of device %s.", name);
+		return -ENOTSUP;
+	}
+
+	s.size			= stats->size;
+	s.read_ios		= stat[0];
+	s.read_sectors		= stat[2];
+	s.read_ticks_ms		= stat[3];
+	s.write_ios		= stat[4];
+	s.write_sectors		= stat[6];
+	s.write_ticks_ms	= stat[7];
+	s.in_flight		= stat[8];
+	s.io_ticks_ms		= stat[9];
+
+	/* Integrity failures are counted by dm-integrity, also under dm-crypt. */
+	if (dm_query_device(cd, name, DM_ACTIVE_DEVICE, &dmd) >= 0) {
+		if (single_segment(&dmd) && dmd.segment.type == DM_INTEGRITY)
+			(void)dm_status_integrity_failures(cd, name, &s.integrity_failures);
+		else if (single_segment(&dmd) && dmd.segment.type == DM_CRYPT &&
+			 dmd.segment.u.crypt.tag_size && (iname = device_dm_name(dmd.segment.data_device)))
+			(void)dm_status_integrity_failures(cd, iname, &s.integrity_failures);
+
+		dm_targets_free(cd, &dmd);
+	}
+
+	memcpy(stats, &s, s.size);
+	return 0;
+}
+
+int crypt_get_active_integrity_recalc(struct crypt_device *cd, const char *name,
+				      uint64_t *recalc_sector, uint64_t *data_sectors)
+{
+	struct crypt_dm_active_device dmd;
+	const char *iname = NULL;
+	uint64_t sector = 0, sectors = 0;
+	int r;
+
+	if (!name)
+		return -EINVAL;
+
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE, &dmd);
+	if (r < 0)
+		return r;
+
+	if (single_segment(&dmd) && dmd.segment.type == DM_INTEGRITY)
+		r = dm_status_integrity_recalc(cd, name, &sector, &sectors);
+	else if (single_segment(&dmd) && dmd.segment.type == DM_CRYPT &&
+		 dmd.segment.u.crypt.tag_size && (iname = device_dm_name(dmd.segment.data_device)))
+		r = dm_status_integrity_recalc(cd, iname, &sector, &sectors);
+	else
+		r = -ENOTSUP;
+
+	dm_targets_free(cd, &dmd);
+
+	if (r < 0)
+		return r;
+
+	if (recalc_sector)
+		*recalc_sector = sector;
+	if (data_sectors)
+		*data_sectors = sectors;
+
+	return 0;
+}
+
+struct status_all_ctx {
+	uint32_t flags;
+	int (*callback)(const struct crypt_active_device_status *status, void *usrptr);
+	void *usrptr;
+};
+
+static int _status_all_device(struct crypt_device *cd, const char *name, int major, int minor,
+			      int busy, struct crypt_dm_active_device *dmd, void *arg)
+{
+	struct status_all_ctx *ctx = arg;
+	struct crypt_active_device_status st = {};
+	struct dm_target *tgt = &dmd->segment;
+	uint64_t stat[CRYPT_DEV_STAT_FIELDS];
+	char type[32];
+	const char *dash;
+
+	/* DM UUID is <type>-[<uuid>-]<name>, skip internal helper devices */
+	dash = strchr(dmd->uuid, '-');
+	if (!dash || (size_t)(dash - dmd->uuid) >= sizeof(type))
+		return 0;
+	memcpy(type, dmd->uuid, dash - dmd->uuid);
+	type[dash - dmd->uuid] = '\0';
+	if (!strcmp(type, CRYPT_SUBDEV) || !strcmp(type, "TEMP"))
+		return 0;
+
+	st.name = name;
+	st.type = type;
+	st.uuid = dmd->uuid;
+	st.size = dmd->size;
+	st.flags = dmd->flags;
+	st.busy = busy;
+
+	for (; tgt; tgt = tgt->next) {
+		st.segments++;
+		if (st.target)
+			continue;
+
+		switch (tgt->type) {
+		case DM_CRYPT:
+			st.target = "crypt";
+			st.cipher = tgt->u.crypt.cipher;
+			st.integrity = tgt->u.crypt.integrity;
+			st.offset = tgt->u.crypt.offset;
+			st.iv_offset = tgt->u.crypt.iv_offset;
+			st.sector_size = tgt->u.crypt.sector_size;
+			st.tag_size = tgt->u.crypt.tag_size;
+			if (tgt->u.crypt.vk) {
+				st.volume_key_size = tgt->u.crypt.vk->keylength;
+				if ((ctx->flags & CRYPT_STATUS_ALL_VOLUME_KEY) &&
+				    !(dmd->flags & CRYPT_ACTIVATE_KEYRING_KEY))
+					st.volume_key = tgt->u.crypt.vk->key;
+			}
+			break;
+		case DM_VERITY:
+			st.target = "verity";
+			st.sector_size = tgt->u.verity.vp ? tgt->u.verity.vp->data_block_size : 0;
+			break;
+		case DM_INTEGRITY:
+			st.target = "integrity";
+			st.integrity = tgt->u.integrity.integrity;
+			st.offset = tgt->u.integrity.offset;
+			st.sector_size = tgt->u.integrity.sector_size;
+			st.tag_size = tgt->u.integrity.tag_size;
+			break;
+		default:
+			continue;
+		}
+
+		st.device = device_path(tgt->data_device);
+	}
+
+	/* only linear, zero or error segments */
+	if (!st.target)
+		return 0;
+
+	st.stats.size = sizeof(st.stats);
+	if ((ctx->flags & CRYPT_STATUS_ALL_STATS) && crypt_dev_stat(major, minor, stat)) {
+		st.stats.read_ios	= stat[0];
+		st.stats.read_sectors	= stat[2];
+		st.stats.read_ticks_ms	= stat[3];
+		st.stats.write_ios	= stat[4];
+		st.stats.write_sectors	= stat[6];
+		st.stats.write_ticks_ms	= stat[7];
+		st.stats.in_flight	= stat[8];
+		st.stats.io_ticks_ms	= stat[9];
+	}
+
+	return ctx->callback(&st, ctx->usrptr);
+}
+
+int crypt_status_all(struct crypt_device *cd, uint32_t flags,
+	int (*callback)(const struct crypt_active_device_status *status, void *usrptr),
+	void *usrptr)
+{
+	struct status_all_ctx ctx = {
+		.flags = flags,
+		.callback = callback,
+		.usrptr = usrptr
+	};
+	uint32_t dmflags = DM_ACTIVE_DEVICE | DM_ACTIVE_CRYPT_CIPHER |
+			   DM_ACTIVE_CRYPT_KEYSIZE | DM_ACTIVE_INTEGRITY_PARAMS |
+			   DM_ACTIVE_VERITY_PARAMS;
+
+	if (!callback)
+		return -EINVAL;
+
+	/* Key material is read from kernel only if requested */
+	if (flags & CRYPT_STATUS_ALL_VOLUME_KEY)
+		dmflags |= DM_ACTIVE_CRYPT_KEY;
+
+	return dm_query_all_devices(cd, dmflags, _status_all_device, &ctx);
+}
+
 /*
  * Volume key handling
  */
@@ -4908,6 +6622,8 @@ int crypt_volume_key_get_by_keyslot_context(struct crypt_device *cd,
 	const char *passphrase = NULL;
 	struct volume_key *vk = NULL;
 
+	crypt_load_deferred(cd);
+
 	if (!cd || !volume_key || !volume_key_size ||
 	    (!kc && !isLUKS(cd->type) && !isTCRYPT(cd->type) && !isVERITY(cd->type)))
 		return -EINVAL;
@@ -5065,41 +6781,392 @@ uint32_t crypt_get_compatibility(struct crypt_device *cd)
 }
 
 /*
- * Reporting
+ * Parallel processing
  */
-crypt_status_info crypt_status(struct crypt_device *cd, const char *name)
+int crypt_set_threads(struct crypt_device *cd, unsigned int threads)
 {
-	int r;
+	if (!cd || threads > CRYPT_MAX_THREADS)
+		return -EINVAL;
 
-	if (!name)
-		return CRYPT_INVALID;
+	log_dbg(cd, "Parallel processing threads set to %u.", threads);
+	cd->threads = threads;
 
-	if (!cd)
-		dm_backend_init(cd);
+	return 0;
+}
 
-	r = dm_status_device(cd, name);
+int crypt_set_thread_affinity(struct crypt_device *cd, uint32_t flags)
+{
+	if (!cd || (flags & ~CRYPT_AFFINITY_DEVICE_NUMA))
+		return -EINVAL;
 
-	if (!cd)
-		dm_backend_exit(cd);
+	log_dbg(cd, "Parallel processing affinity set to 0x%" PRIx32 ".", flags);
+	cd->affinity = flags;
 
-	if (r < 0 && r != -ENODEV)
-		return CRYPT_INVALID;
+	return 0;
+}
 
-	if (r == 0)
-		return CRYPT_ACTIVE;
+int crypt_set_executor(struct crypt_device *cd, crypt_executor_run_fn run, void *usrptr)
+{
+	if (!cd)
+		return -EINVAL;
 
-	if (r > 0)
-		return CRYPT_BUSY;
+	log_dbg(cd, "Parallel processing %s application executor.", run ? "uses" : "does not use");
+	cd->executor = run;
+	cd->executor_usrptr = run ? usrptr : NULL;
 
-	return CRYPT_INACTIVE;
+	return 0;
 }
 
-static int _luks_dump(struct crypt_device *cd)
+int crypt_token_set_timeout(struct crypt_device *cd, uint32_t timeout_ms)
 {
-	int i;
+	if (!cd)
+		return -EINVAL;
 
-	log_std(cd, "LUKS header information for %s\n\n", mdata_device_path(cd));
-	log_std(cd, "Version:       \t%" PRIu16 "\n", cd->u.luks1.hdr.version);
+	log_dbg(cd, "Asynchronous token timeout set to %" PRIu32 " ms.", timeout_ms);
+	cd->token_timeout_ms = timeout_ms;
+
+	return 0;
+}
+
+/* internal only */
+uint32_t crypt_get_token_timeout(struct crypt_device *cd)
+{
+	return cd ? cd->token_timeout_ms : 0;
+}
+
+int crypt_reencrypt_set_tuning(struct crypt_device *cd,
+		const struct crypt_params_reencrypt_tuning *tuning)
+{
+	struct crypt_params_reencrypt_tuning t = {};
+
+	if (!cd)
+		return -EINVAL;
+
+	if (tuning) {
+		/* older callers pass shorter structure, missing fields stay 0 */
+		if (tuning->size < offsetof(struct crypt_params_reencrypt_tuning, pipeline_depth) ||
+		    tuning->size > sizeof(t))
+			return -EINVAL;
+		memcpy(&t, tuning, tuning->size);
+		if (t.verify_percent > 100)
+			return -EINVAL;
+	}
+
+	t.size = sizeof(t);
+	cd->reenc_tuning = t;
+
+	return 0;
+}
+
+/* internal only */
+const struct crypt_params_reencrypt_tuning *crypt_get_reencrypt_tuning(struct crypt_device *cd)
+{
+	return &cd->reenc_tuning;
+}
+
+int crypt_set_pbkdf_memory_limit(struct crypt_device *cd, uint64_t memory_kb)
+{
+	int r;
+
+	if (!cd)
+		return -EINVAL;
+
+	r = verify_pbkdf_memory_limit(cd, memory_kb, NULL);
+	if (r < 0)
+		return r;
+
+	log_dbg(cd, "Concurrent PBKDF memory limit set to %" PRIu64 " kB.", memory_kb);
+	cd->pbkdf_memory_limit_kb = memory_kb;
+
+	return 0;
+}
+
+/* internal only */
+uint64_t crypt_get_pbkdf_memory_limit(struct crypt_device *cd)
+{
+	uint64_t limit_kb = 0;
+
+	if (verify_pbkdf_memory_limit(cd, cd ? cd->pbkdf_memory_limit_kb : 0, &limit_kb) < 0)
+		(void)verify_pbkdf_memory_limit(cd, 0, &limit_kb);
+
+	return limit_kb;
+}
+
+int crypt_refresh_dm_features(struct crypt_device *cd)
+{
+	return dm_refresh_versions(cd);
+}
+
+/* Pool is allocated on first use, NULL return means uncached buffers. */
+struct crypt_bufpool *crypt_get_bufpool(struct crypt_device *cd)
+{
+	if (cd->memory_lean)
+		return NULL;
+
+	if (!cd->bufpool && crypt_bufpool_init(&cd->bufpool))
+		log_dbg(cd, "Cannot initialize buffer pool.");
+
+	return cd->bufpool;
+}
+
+unsigned int crypt_get_threads(struct crypt_device *cd)
+{
+	unsigned int threads = cd ? cd->threads : 0;
+
+	if (!threads) {
+		threads = crypt_cpusonline();
+		if (threads > CRYPT_DEFAULT_MAX_THREADS)
+			threads = CRYPT_DEFAULT_MAX_THREADS;
+	}
+
+	return threads ?: 1;
+}
+
+/* internal only */
+void crypt_get_executor(struct crypt_device *cd, crypt_executor_run_fn *run, void **usrptr)
+{
+	*run = cd ? cd->executor : NULL;
+	*usrptr = cd ? cd->executor_usrptr : NULL;
+}
+
+/* internal only, NUMA node for worker threads and buffers, -1 if none */
+int crypt_get_numa_node(struct crypt_device *cd)
+{
+	struct device *device;
+
+	if (!cd || !(cd->affinity & CRYPT_AFFINITY_DEVICE_NUMA))
+		return -1;
+
+	device = crypt_data_device(cd) ?: crypt_metadata_device(cd);
+
+	return device_numa_node(device);
+}
+
+int crypt_set_pbkdf_cache(struct crypt_device *cd, const char *path)
+{
+	char *p = NULL;
+
+	if (!cd)
+		return -EINVAL;
+
+	if (path && !(p = strdup(path)))
+		return -ENOMEM;
+
+	log_dbg(cd, "PBKDF benchmark cache set to %s.", path ?: "none");
+	free(cd->pbkdf_cache);
+	cd->pbkdf_cache = p;
+
+	return 0;
+}
+
+const char *crypt_get_pbkdf_cache(struct crypt_device *cd)
+{
+	return cd ? cd->pbkdf_cache : NULL;
+}
+
+int crypt_set_memory_lean(struct crypt_device *cd, int enable)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg(cd, "Memory lean context %sabled.", enable ? "en" : "dis");
+	cd->memory_lean = enable ? true : false;
+	if (!cd->memory_lean)
+		return 0;
+
+	crypt_bufpool_destroy(cd->bufpool);
+	cd->bufpool = NULL;
+
+	if (isLUKS2(cd->type))
+		LUKS2_hdr_release_copies(&cd->u.luks2.hdr);
+
+	return 0;
+}
+
+/* internal only */
+bool crypt_memory_lean(struct crypt_device *cd)
+{
+	return cd && cd->memory_lean;
+}
+
+int crypt_set_keyslot_hint(struct crypt_device *cd, int keyslot)
+{
+	if (!cd || keyslot < CRYPT_ANY_SLOT)
+		return -EINVAL;
+
+	log_dbg(cd, "Keyslot trial hint set to %d.", keyslot);
+	cd->keyslot_hint = keyslot;
+
+	return 0;
+}
+
+int crypt_set_keyslot_hint_cache(struct crypt_device *cd, const char *path)
+{
+	char *p = NULL;
+
+	if (!cd)
+		return -EINVAL;
+
+	if (path && !(p = strdup(path)))
+		return -ENOMEM;
+
+	log_dbg(cd, "Keyslot hint cache directory set to %s.", path ?: "none");
+	free(cd->keyslot_hint_cache);
+	cd->keyslot_hint_cache = p;
+
+	return 0;
+}
+
+/* internal only */
+void crypt_keyslot_hint_source(struct crypt_device *cd, int kc_type)
+{
+	if (cd)
+		cd->keyslot_hint_source = kc_type;
+}
+
+/* One file per header UUID and passphrase source, it contains only keyslot number. */
+static char *keyslot_hint_path(struct crypt_device *cd)
+{
+	const char *uuid = crypt_get_uuid(cd);
+	char *path;
+
+	if (!cd->keyslot_hint_cache || !uuid || !*uuid)
+		return NULL;
+
+	if (asprintf(&path, "%s/keyslot-hint.%s.%s", cd->keyslot_hint_cache, uuid,
+		     cd->keyslot_hint_source == CRYPT_KC_TYPE_KEYFILE ? "keyfile" : "passphrase") < 0)
+		return NULL;
+
+	return path;
+}
+
+static int keyslot_hint_read(struct crypt_device *cd, const char *path)
+{
+	struct stat st;
+	char buf[16];
+	ssize_t len;
+	int fd, keyslot = CRYPT_ANY_SLOT;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return CRYPT_ANY_SLOT;
+
+	/* Hint only reorders the trial but do not follow a file others can modify. */
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		log_dbg(cd, "Ignoring keyslot hint cache %s.", path);
+		goto out;
+	}
+
+	len = read_buffer(fd, buf, sizeof(buf) - 1);
+	if (len > 0) {
+		buf[len] = '\0';
+		if (sscanf(buf, "%d", &keyslot) != 1 || keyslot < 0)
+			keyslot = CRYPT_ANY_SLOT;
+	}
+out:
+	close(fd);
+	return keyslot;
+}
+
+/* internal only */
+int crypt_keyslot_hint(struct crypt_device *cd)
+{
+	char *path;
+	int keyslot;
+
+	if (!cd)
+		return CRYPT_ANY_SLOT;
+
+	if (cd->keyslot_hint >= 0)
+		return cd->keyslot_hint;
+
+	if (!(path = keyslot_hint_path(cd)))
+		return CRYPT_ANY_SLOT;
+
+	keyslot = keyslot_hint_read(cd, path);
+	free(path);
+
+	if (keyslot >= 0)
+		log_dbg(cd, "Trying keyslot %d first (cached hint).", keyslot);
+
+	return keyslot;
+}
+
+/* internal only, store keyslot that opened the volume for the next trial */
+void crypt_keyslot_hint_update(struct crypt_device *cd, int keyslot)
+{
+	char *path, *tmp = NULL, buf[16];
+	int fd, r;
+
+	if (!cd || keyslot < 0 || !(path = keyslot_hint_path(cd)))
+		return;
+
+	/* do not rewrite the file on every unlock */
+	if (keyslot_hint_read(cd, path) == keyslot)
+		goto out;
+
+	r = snprintf(buf, sizeof(buf), "%d\n", keyslot);
+	if (r < 0 || (size_t)r >= sizeof(buf) || asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		log_dbg(cd, "Cannot create keyslot hint cache %s.", path);
+		goto out;
+	}
+
+	r = write_buffer(fd, buf, strlen(buf)) < 0 ? -EIO : 0;
+	if (close(fd) && !r)
+		r = -EIO;
+
+	if (r || rename(tmp, path)) {
+		log_dbg(cd, "Cannot write keyslot hint cache %s.", path);
+		unlink(tmp);
+	}
+out:
+	free(tmp);
+	free(path);
+}
+
+/*
+ * Reporting
+ */
+crypt_status_info crypt_status(struct crypt_device *cd, const char *name)
+{
+	int r;
+
+	if (!name)
+		return CRYPT_INVALID;
+
+	if (!cd)
+		dm_backend_init(cd);
+
+	r = dm_status_device(cd, name);
+
+	if (!cd)
+		dm_backend_exit(cd);
+
+	if (r < 0 && r != -ENODEV)
+		return CRYPT_INVALID;
+
+	if (r == 0)
+		return CRYPT_ACTIVE;
+
+	if (r > 0)
+		return CRYPT_BUSY;
+
+	return CRYPT_INACTIVE;
+}
+
+static int _luks_dump(struct crypt_device *cd)
+{
+	int i;
+
+	log_std(cd, "LUKS header information for %s\n\n", mdata_device_path(cd));
+	log_std(cd, "Version:       \t%" PRIu16 "\n", cd->u.luks1.hdr.version);
 	log_std(cd, "Cipher name:   \t%s\n", cd->u.luks1.hdr.cipherName);
 	log_std(cd, "Cipher mode:   \t%s\n", cd->u.luks1.hdr.cipherMode);
 	log_std(cd, "Hash spec:     \t%s\n", cd->u.luks1.hdr.hashSpec);
@@ -5143,6 +7210,9 @@ int crypt_dump(struct crypt_device *cd)
 {
 	if (!cd)
 		return -EINVAL;
+
+	crypt_load_deferred(cd);
+
 	if (isLUKS1(cd->type))
 		return _luks_dump(cd);
 	else if (isLUKS2(cd->type))
@@ -5168,6 +7238,9 @@ int crypt_dump_json(struct crypt_device *cd, const char **json, uint32_t flags)
 {
 	if (!cd || flags)
 		return -EINVAL;
+
+	crypt_load_deferred(cd);
+
 	if (isLUKS2(cd->type))
 		return LUKS2_hdr_dump_json(cd, &cd->u.luks2.hdr, json);
 
@@ -5335,6 +7408,8 @@ const char *crypt_get_uuid(struct crypt_device *cd)
 	if (!cd)
 		return NULL;
 
+	crypt_load_deferred(cd);
+
 	if (isLUKS1(cd->type))
 		return cd->u.luks1.hdr.uuid;
 
@@ -5424,7 +7499,7 @@ int crypt_get_volume_key_size(struct crypt_device *cd)
 
 int crypt_keyslot_get_key_size(struct crypt_device *cd, int keyslot)
 {
-	if (!cd || !isLUKS(cd->type))
+	if (!cd || !isLUKS(metadata_type(cd)))
 		return -EINVAL;
 
 	if (keyslot < 0 || keyslot >= crypt_keyslot_max(cd->type))
@@ -5445,7 +7520,7 @@ int crypt_keyslot_set_encryption(struct crypt_device *cd,
 {
 	char *tmp;
 
-	if (!cd || !cipher || !key_size || !isLUKS2(cd->type))
+	if (!cd || !cipher || !key_size || !isLUKS2(metadata_type(cd)))
 		return -EINVAL;
 
 	if (LUKS2_keyslot_cipher_incompatible(cd, cipher))
@@ -5465,7 +7540,7 @@ const char *crypt_keyslot_get_encryption(struct crypt_device *cd, int keyslot, s
 {
 	const char *cipher;
 
-	if (!cd || !isLUKS(cd->type) || !key_size)
+	if (!cd || !isLUKS(metadata_type(cd)) || !key_size)
 		return NULL;
 
 	if (isLUKS1(cd->type)) {
@@ -5503,7 +7578,7 @@ int crypt_keyslot_get_pbkdf(struct crypt_device *cd, int keyslot, struct crypt_p
 	if (!cd || !pbkdf || keyslot == CRYPT_ANY_SLOT)
 		return -EINVAL;
 
-	if (isLUKS1(cd->type))
+	if (isLUKS1(metadata_type(cd)))
 		return LUKS_keyslot_pbkdf(&cd->u.luks1.hdr, keyslot, pbkdf);
 	else if (isLUKS2(cd->type))
 		return LUKS2_keyslot_pbkdf(&cd->u.luks2.hdr, keyslot, pbkdf);
@@ -5557,6 +7632,8 @@ int crypt_get_metadata_size(struct crypt_device *cd,
 	if (!cd)
 		return -EINVAL;
 
+	crypt_load_deferred(cd);
+
 	if (!cd->type) {
 		msize = cd->metadata_size;
 		ksize = cd->keyslots_size;
@@ -5582,6 +7659,8 @@ uint64_t crypt_get_data_offset(struct crypt_device *cd)
 	if (!cd)
 		return 0;
 
+	crypt_load_deferred(cd);
+
 	if (isPLAIN(cd->type))
 		return cd->u.plain.hdr.offset;
 
@@ -5693,9 +7772,41 @@ int crypt_keyslot_set_priority(struct crypt_device *cd, int keyslot, crypt_keysl
 	return LUKS2_keyslot_priority_set(cd, &cd->u.luks2.hdr, keyslot, priority, 1);
 }
 
+int crypt_keyslot_set_telemetry(struct crypt_device *cd, int enable)
+{
+	int r;
+
+	log_dbg(cd, "%s keyslot telemetry.", enable ? "Enabling" : "Disabling");
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	return LUKS2_keyslot_telemetry_enable(cd, &cd->u.luks2.hdr, enable);
+}
+
+int crypt_keyslot_get_telemetry(struct crypt_device *cd, int keyslot,
+	struct crypt_keyslot_telemetry *telemetry)
+{
+	int r;
+
+	if (!telemetry || keyslot < 0 || keyslot >= crypt_keyslot_max(CRYPT_LUKS2))
+		return -EINVAL;
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	memset(telemetry, 0, sizeof(*telemetry));
+
+	return LUKS2_keyslot_telemetry_get(&cd->u.luks2.hdr, keyslot,
+					   &telemetry->time_ms, &telemetry->unlocks);
+}
+
 const char *crypt_get_type(struct crypt_device *cd)
 {
-	return cd ? cd->type : NULL;
+	if (!cd)
+		return NULL;
+
+	return cd->type ?: cd->deferred_type;
 }
 
 const char *crypt_get_default_type(void)
@@ -5726,23 +7837,199 @@ int crypt_get_verity_info(struct crypt_device *cd,
 	return 0;
 }
 
-int crypt_get_integrity_info(struct crypt_device *cd,
-	struct crypt_params_integrity *ip)
+int crypt_format_verity_stream(struct crypt_device *cd,
+	const char *uuid,
+	struct crypt_params_verity *params,
+	int data_fd)
 {
-	if (!cd || !ip)
-		return -EINVAL;
+	int r;
 
-	if (isINTEGRITY(cd->type)) {
-		ip->journal_size = cd->u.integrity.params.journal_size;
-		ip->journal_watermark = cd->u.integrity.params.journal_watermark;
-		ip->journal_commit_time = cd->u.integrity.params.journal_commit_time;
-		ip->interleave_sectors = cd->u.integrity.params.interleave_sectors;
-		ip->tag_size = cd->u.integrity.params.tag_size;
-		ip->sector_size = cd->u.integrity.params.sector_size;
-		ip->buffer_sectors = cd->u.integrity.params.buffer_sectors;
+	if (!cd || !params || data_fd < 0 || params->data_size ||
+	    !(params->flags & CRYPT_VERITY_CREATE_HASH))
+		return -EINVAL;
 
-		ip->integrity = cd->u.integrity.params.integrity;
-		ip->integrity_key_size = crypt_get_integrity_key_size(cd);
+	if (cd->type) {
+		log_dbg(cd, "Context already formatted as %s.", cd->type);
+		return -EINVAL;
+	}
+
+	log_dbg(cd, "Formatting device %s as type %s from data stream.",
+		mdata_device_path(cd) ?: "(none)", CRYPT_VERITY);
+
+	crypt_reset_null_type(cd);
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	r = _crypt_format_verity(cd, uuid, params, data_fd);
+	if (r < 0)
+		crypt_set_null_type(cd);
+
+	return r;
+}
+
+int crypt_verity_update(struct crypt_device *cd,
+	const struct crypt_verity_block_range *ranges,
+	size_t ranges_count,
+	char *root_hash,
+	size_t root_hash_size)
+{
+	char *new_root_hash;
+	int r;
+
+	if (!cd || !isVERITY(cd->type) || (!ranges && ranges_count) || !root_hash)
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size) {
+		log_err(cd, _("Incorrect root hash specified for verity device."));
+		return -EINVAL;
+	}
+
+	r = VERITY_update(cd, &cd->u.verity.hdr, ranges, ranges_count,
+			  root_hash, root_hash_size);
+	if (r < 0)
+		return r;
+
+	if (cd->u.verity.fec_device) {
+		log_dbg(cd, "Recalculating FEC area.");
+		r = VERITY_FEC_process(cd, &cd->u.verity.hdr, cd->u.verity.fec_device, 0, NULL);
+		if (r < 0)
+			return r;
+	}
+
+	if (!cd->u.verity.root_hash) {
+		new_root_hash = malloc(root_hash_size);
+		if (!new_root_hash)
+			return -ENOMEM;
+		cd->u.verity.root_hash = new_root_hash;
+	}
+	memcpy(CONST_CAST(void*)cd->u.verity.root_hash, root_hash, root_hash_size);
+
+	return 0;
+}
+
+int crypt_verity_repair(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint64_t *repaired)
+{
+	struct crypt_verity_block_range *ranges = NULL;
+	size_t ranges_count = 0;
+	uint64_t blocks = 0;
+	int r;
+
+	if (!cd || !isVERITY(cd->type) || !root_hash)
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size) {
+		log_err(cd, _("Incorrect root hash specified for verity device."));
+		return -EINVAL;
+	}
+
+	if (!cd->u.verity.fec_device) {
+		log_err(cd, _("Repair of verity device requires FEC device."));
+		return -EINVAL;
+	}
+
+	r = VERITY_verify_corrupted(cd, &cd->u.verity.hdr, root_hash, root_hash_size,
+				    &ranges, &ranges_count);
+	if (r == -EPERM || r == -EFAULT) {
+		log_dbg(cd, "Repairing %zu corrupted block ranges.", ranges_count);
+		r = VERITY_FEC_repair(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+				      ranges, ranges_count, &blocks);
+		free(ranges);
+		if (!r) {
+			log_dbg(cd, "Repaired %" PRIu64 " blocks, verifying device again.", blocks);
+			r = VERITY_verify(cd, &cd->u.verity.hdr, root_hash, root_hash_size);
+		}
+	}
+
+	if (repaired)
+		*repaired = blocks;
+
+	return r;
+}
+
+int crypt_verity_verify_sample(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint32_t percent,
+	uint64_t seed,
+	uint64_t *verified_blocks)
+{
+	if (!cd || !isVERITY(cd->type) || !root_hash || !percent || percent > 100)
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size) {
+		log_err(cd, _("Incorrect root hash specified for verity device."));
+		return -EINVAL;
+	}
+
+	return VERITY_verify_sample(cd, &cd->u.verity.hdr, root_hash, root_hash_size,
+				    percent, seed, verified_blocks);
+}
+
+int crypt_set_verity_stage(struct crypt_device *cd,
+	const char *scratch_device,
+	uint64_t memory_limit)
+{
+	char *p = NULL;
+
+	if (!cd)
+		return -EINVAL;
+
+	if (scratch_device && !(p = strdup(scratch_device)))
+		return -ENOMEM;
+
+	log_dbg(cd, "Verity hash tree staging in %s (memory limit %" PRIu64 ").",
+		scratch_device ?: "memory", memory_limit);
+	free(cd->verity_stage_device);
+	cd->verity_stage_device = p;
+	cd->verity_stage_memory = memory_limit;
+
+	return 0;
+}
+
+/* internal only */
+const char *crypt_get_verity_stage(struct crypt_device *cd)
+{
+	return cd ? cd->verity_stage_device : NULL;
+}
+
+int crypt_integrity_tune(struct crypt_device *cd,
+	crypt_integrity_tune_mode mode,
+	struct crypt_params_integrity *params,
+	struct crypt_integrity_tune *tune)
+{
+	if (!cd || !params || !tune)
+		return -EINVAL;
+
+	if (!crypt_data_device(cd))
+		return -EINVAL;
+
+	memset(tune, 0, sizeof(*tune));
+
+	return INTEGRITY_tune(cd, crypt_data_device(cd), mode, params, tune);
+}
+
+int crypt_get_integrity_info(struct crypt_device *cd,
+	struct crypt_params_integrity *ip)
+{
+	if (!cd || !ip)
+		return -EINVAL;
+
+	if (isINTEGRITY(metadata_type(cd))) {
+		ip->journal_size = cd->u.integrity.params.journal_size;
+		ip->journal_watermark = cd->u.integrity.params.journal_watermark;
+		ip->journal_commit_time = cd->u.integrity.params.journal_commit_time;
+		ip->interleave_sectors = cd->u.integrity.params.interleave_sectors;
+		ip->tag_size = cd->u.integrity.params.tag_size;
+		ip->sector_size = cd->u.integrity.params.sector_size;
+		ip->buffer_sectors = cd->u.integrity.params.buffer_sectors;
+
+		ip->integrity = cd->u.integrity.params.integrity;
+		ip->integrity_key_size = crypt_get_integrity_key_size(cd);
 
 		ip->journal_integrity = cd->u.integrity.params.journal_integrity;
 		ip->journal_integrity_key_size = cd->u.integrity.params.journal_integrity_key_size;
@@ -5921,6 +8208,45 @@ int crypt_token_json_set(struct crypt_device *cd, int token, const char *json)
 	return LUKS2_token_create(cd, &cd->u.luks2.hdr, token, json, 1);
 }
 
+int crypt_token_json_set_batch(struct crypt_device *cd,
+	struct crypt_token_update *updates,
+	size_t count)
+{
+	size_t i, failed = count;
+	int r;
+
+	if (!updates || !count)
+		return -EINVAL;
+
+	log_dbg(cd, "Updating JSON for %zu tokens.", count);
+
+	if ((r = onlyLUKS2(cd)))
+		goto out;
+
+	/* every token is validated on its own, header is validated and written once */
+	for (i = 0; i < count; i++) {
+		r = updates[i].result = LUKS2_token_create(cd, &cd->u.luks2.hdr,
+			updates[i].token, updates[i].json, 0);
+		if (r < 0) {
+			failed = i;
+			break;
+		}
+	}
+
+	if (r >= 0)
+		r = LUKS2_hdr_write(cd, &cd->u.luks2.hdr);
+
+	if (r < 0)
+		_luks2_rollback(cd);
+out:
+	/* nothing is written if any update fails */
+	for (i = 0; r < 0 && i < count; i++)
+		if (i != failed)
+			updates[i].result = r;
+
+	return r < 0 ? r : 0;
+}
+
 crypt_token_info crypt_token_status(struct crypt_device *cd, int token, const char **type)
 {
 	if (_onlyLUKS2(cd, CRYPT_CD_QUIET | CRYPT_CD_UNRESTRICTED, 0))
@@ -5997,6 +8323,34 @@ int crypt_token_luks2_keyring_set(struct crypt_device *cd,
 	return LUKS2_token_create(cd, &cd->u.luks2.hdr, token, json, 1);
 }
 
+int crypt_token_luks2_escrow_set(struct crypt_device *cd,
+	int token,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	const struct crypt_token_params_luks2_escrow *params)
+{
+	struct volume_key *vk = NULL;
+	int r;
+
+	if (!passphrase || !params || !params->key_description)
+		return -EINVAL;
+
+	log_dbg(cd, "Creating new LUKS2 escrow token (%d) for keyslot %d.", token, keyslot);
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	r = LUKS2_keyslot_open(cd, keyslot, CRYPT_DEFAULT_SEGMENT, passphrase, passphrase_size, &vk);
+	if (r < 0)
+		return r;
+
+	r = LUKS2_token_escrow_create(cd, &cd->u.luks2.hdr, token, r, vk, params);
+	crypt_free_volume_key(vk);
+
+	return r;
+}
+
 int crypt_token_assign_keyslot(struct crypt_device *cd, int token, int keyslot)
 {
 	int r;
@@ -6042,110 +8396,316 @@ int crypt_metadata_locking(struct crypt_device *cd __attribute__((unused)), int
 	return 0;
 }
 
-int crypt_persistent_flags_set(struct crypt_device *cd, crypt_flags_type type, uint32_t flags)
+/* Cipher throughput (MiB/s per CPU) fast enough to process I/O inline */
+#define PERF_INLINE_CIPHER_MBS	1000.0
+
+int crypt_perf_flags_suggest(struct crypt_device *cd, uint32_t *flags)
 {
-	int r;
+	struct device *device;
+	double enc_mbs = 0, dec_mbs = 0;
+	uint32_t dmt_flags = 0;
+	int rotational, hw_queues, is_dm;
+	unsigned cpus;
 
-	if ((r = onlyLUKS2(cd)))
-		return r;
+	if (!cd || !flags)
+		return -EINVAL;
 
-	if (type == CRYPT_FLAGS_ACTIVATION)
-		return LUKS2_config_set_flags(cd, &cd->u.luks2.hdr, flags);
+	*flags = 0;
 
-	if (type == CRYPT_FLAGS_REQUIREMENTS)
-		return LUKS2_config_set_requirements(cd, &cd->u.luks2.hdr, flags, true);
+	if (!crypt_get_cipher(cd) || !crypt_get_cipher_mode(cd) || !crypt_get_volume_key_size(cd))
+		return -EINVAL;
 
-	return -EINVAL;
-}
+	if (!(device = crypt_data_device(cd)))
+		return -EINVAL;
 
-int crypt_persistent_flags_get(struct crypt_device *cd, crypt_flags_type type, uint32_t *flags)
-{
-	int r;
+	if (dm_flags(cd, DM_CRYPT, &dmt_flags))
+		return -ENOTSUP;
 
-	if (!flags)
-		return -EINVAL;
+	rotational = device_is_rotational(device);
+	hw_queues = device_hw_queues(device, &is_dm);
+	cpus = crypt_cpusonline();
 
-	if ((r = _onlyLUKS2(cd, CRYPT_CD_UNRESTRICTED, 0)))
-		return r;
+	log_dbg(cd, "Performance profile: %srotational%s device, %d hw queues, %u CPUs.",
+		rotational ? "" : "non-", is_dm ? " dm" : "", hw_queues, cpus);
 
-	if (type == CRYPT_FLAGS_ACTIVATION)
-		return LUKS2_config_get_flags(cd, &cd->u.luks2.hdr, flags);
+	/* Rotational devices benefit from sorted writes in dm-crypt write thread. */
+	if (rotational)
+		return 0;
 
-	if (type == CRYPT_FLAGS_REQUIREMENTS)
-		return LUKS2_config_get_requirements(cd, &cd->u.luks2.hdr, flags);
+	if (crypt_benchmark(cd, crypt_get_cipher(cd), crypt_get_cipher_mode(cd),
+			    crypt_get_volume_key_size(cd), 16, 1024 * 1024, &enc_mbs, &dec_mbs) < 0)
+		enc_mbs = dec_mbs = 0;
+	log_dbg(cd, "Performance profile: cipher %s-%s %.1f MiB/s encryption, %.1f MiB/s decryption.",
+		crypt_get_cipher(cd), crypt_get_cipher_mode(cd), enc_mbs, dec_mbs);
 
-	return -EINVAL;
-}
+	/*
+	 * Fast cipher on fast device, queueing to workqueues costs more
+	 * than processing in the I/O submitting context.
+	 */
+	if (enc_mbs >= PERF_INLINE_CIPHER_MBS && dec_mbs >= PERF_INLINE_CIPHER_MBS &&
+	    (dmt_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED)) {
+		*flags |= CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+		return 0;
+	}
 
-static int update_volume_key_segment_digest(struct crypt_device *cd, struct luks2_hdr *hdr, int digest, int commit)
-{
-	int r;
+	/* With one CPU there is nothing to spread encryption to. */
+	if (cpus == 1 && (dmt_flags & DM_SAME_CPU_CRYPT_SUPPORTED))
+		*flags |= CRYPT_ACTIVATE_SAME_CPU_CRYPT;
 
-	/* Remove any assignments in memory */
-	r = LUKS2_digest_segment_assign(cd, hdr, CRYPT_DEFAULT_SEGMENT, CRYPT_ANY_DIGEST, 0, 0);
-	if (r)
-		return r;
+	/* Multiqueue device with queue per CPU does not need write sorting thread. */
+	if (hw_queues > 0 && (unsigned)hw_queues >= cpus &&
+	    (dmt_flags & DM_SUBMIT_FROM_CRYPT_CPUS_SUPPORTED))
+		*flags |= CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS;
 
-	/* Assign it to the specific digest */
-	return LUKS2_digest_segment_assign(cd, hdr, CRYPT_DEFAULT_SEGMENT, digest, 1, commit);
+	return 0;
 }
 
-static int verify_and_update_segment_digest(struct crypt_device *cd,
-		struct luks2_hdr *hdr, int keyslot, struct crypt_keyslot_context *kc)
-{
-	int digest, r;
-	struct volume_key *vk = NULL;
+#define RETUNE_CRYPT_FLAGS	(CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS | \
+				 CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE | \
+				 CRYPT_ACTIVATE_HIGH_PRIORITY)
+#define RETUNE_INTEGRITY_FLAGS	(CRYPT_ACTIVATE_NO_JOURNAL | CRYPT_ACTIVATE_RECALCULATE | \
+				 CRYPT_ACTIVATE_RECALCULATE_RESET)
 
-	assert(kc);
-	assert(kc->get_luks2_key);
-	assert(keyslot >= 0);
+static int _retune_dm_device(struct crypt_device *cd, const char *name,
+			     dm_target_type type, uint32_t flags, uint32_t mask)
+{
+	struct crypt_dm_active_device dmd;
+	int r;
 
-	r = kc->get_luks2_key(cd, kc, keyslot, CRYPT_ANY_SEGMENT, &vk);
-	if (r < 0)
-		return r;
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE | DM_ACTIVE_CRYPT_CIPHER |
+				  DM_ACTIVE_UUID | DM_ACTIVE_CRYPT_KEYSIZE |
+				  DM_ACTIVE_CRYPT_KEY | DM_ACTIVE_INTEGRITY_PARAMS |
+				  DM_ACTIVE_JOURNAL_CRYPT_KEY | DM_ACTIVE_JOURNAL_MAC_KEY, &dmd);
+	if (r < 0) {
+		log_err(cd, _("Device %s is not active."), name);
+		return -EINVAL;
+	}
 
-	/* check volume_key (param) digest matches keyslot digest */
-	r = LUKS2_digest_verify(cd, hdr, vk, keyslot);
-	if (r < 0)
+	if (!single_segment(&dmd) || dmd.segment.type != type) {
+		log_err(cd, _("Unsupported parameters on device %s."), name);
+		r = -ENOTSUP;
 		goto out;
-	digest = r;
+	}
 
-	/* nothing to do, volume key in keyslot is already assigned to default segment */
-	r = LUKS2_digest_verify_by_segment(cd, hdr, CRYPT_DEFAULT_SEGMENT, vk);
-	if (r >= 0)
+	if ((dmd.flags & mask) == (flags & mask)) {
+		log_dbg(cd, "Device %s already uses requested flags.", name);
 		goto out;
+	}
 
-	/* FIXME: check new volume key is usable with current default segment */
-
-	r = update_volume_key_segment_digest(cd, &cd->u.luks2.hdr, digest, 1);
-	if (r)
-		log_err(cd, _("Failed to assign keyslot %u as the new volume key."), keyslot);
+	/* Only the new table is prepared in advance, table swap is in resume. */
+	dmd.flags = (dmd.flags & ~mask) | (flags & mask);
+	r = dm_reload_device(cd, name, &dmd, 0, 1);
 out:
-	crypt_free_volume_key(vk);
+	dm_targets_free(cd, &dmd);
+	free(CONST_CAST(void*)dmd.uuid);
 
-	return r < 0 ? r : keyslot;
+	return r;
 }
 
-static int luks2_keyslot_add_by_verified_volume_key(struct crypt_device *cd,
-	int keyslot_new,
-	const char *new_passphrase,
-	size_t new_passphrase_size,
-	struct volume_key *vk)
+int crypt_retune(struct crypt_device *cd, const char *name, uint32_t flags, uint32_t mask)
 {
+	struct crypt_dm_active_device dmd;
+	const char *iname = NULL;
+	char *iname_copy = NULL;
+	dm_target_type type;
+	uint32_t dmt_flags;
 	int r;
-	struct luks2_keyslot_params params;
 
-	assert(cd);
-	assert(keyslot_new >= 0);
-	assert(new_passphrase);
-	assert(vk);
-	assert(crypt_volume_key_get_id(vk) >= 0);
+	if (!name || (mask & ~(RETUNE_CRYPT_FLAGS | RETUNE_INTEGRITY_FLAGS)))
+		return -EINVAL;
 
-	r = LUKS2_keyslot_params_default(cd, &cd->u.luks2.hdr, &params);
-	if (r < 0) {
-		log_err(cd, _("Failed to initialize default LUKS2 keyslot parameters."));
-		return r;
-	}
+	log_dbg(cd, "Retuning device %s, flags 0x%x, mask 0x%x.", name, flags, mask);
+
+	if ((mask & flags & CRYPT_ACTIVATE_RECALCULATE) &&
+	    (dm_flags(cd, DM_INTEGRITY, &dmt_flags) || !(dmt_flags & DM_INTEGRITY_RECALC_SUPPORTED))) {
+		log_err(cd, _("Requested automatic recalculation of integrity tags is not supported."));
+		return -ENOTSUP;
+	}
+
+	if ((mask & flags & CRYPT_ACTIVATE_RECALCULATE_RESET) &&
+	    (dm_flags(cd, DM_INTEGRITY, &dmt_flags) || !(dmt_flags & DM_INTEGRITY_RESET_RECALC_SUPPORTED))) {
+		log_err(cd, _("Requested automatic recalculation of integrity tags is not supported."));
+		return -ENOTSUP;
+	}
+
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE, &dmd);
+	if (r < 0) {
+		log_err(cd, _("Device %s is not active."), name);
+		return -EINVAL;
+	}
+
+	type = single_segment(&dmd) ? dmd.segment.type : DM_UNKNOWN;
+	if (type == DM_CRYPT && dmd.segment.u.crypt.tag_size &&
+	    (iname = device_dm_name(dmd.segment.data_device)) && !(iname_copy = strdup(iname)))
+		r = -ENOMEM;
+	dm_targets_free(cd, &dmd);
+	if (r < 0)
+		return r;
+
+	if (type == DM_INTEGRITY && !(mask & RETUNE_CRYPT_FLAGS))
+		return _retune_dm_device(cd, name, DM_INTEGRITY, flags, mask);
+
+	if (type != DM_CRYPT || ((mask & RETUNE_INTEGRITY_FLAGS) && !iname_copy)) {
+		log_err(cd, _("Unsupported parameters on device %s."), name);
+		free(iname_copy);
+		return -ENOTSUP;
+	}
+
+	if (iname_copy && (mask & RETUNE_INTEGRITY_FLAGS))
+		r = _retune_dm_device(cd, iname_copy, DM_INTEGRITY, flags, mask & RETUNE_INTEGRITY_FLAGS);
+	free(iname_copy);
+
+	if (!r && (mask & RETUNE_CRYPT_FLAGS))
+		r = _retune_dm_device(cd, name, DM_CRYPT, flags, mask & RETUNE_CRYPT_FLAGS);
+
+	return r;
+}
+
+int crypt_set_cpumask(struct crypt_device *cd, const char *name, const char *cpumask)
+{
+	struct crypt_dm_active_device dmd;
+	int major, minor, r;
+
+	if (!name || !cpumask || !*cpumask ||
+	    strspn(cpumask, "0123456789abcdefABCDEF,") != strlen(cpumask))
+		return -EINVAL;
+
+	r = dm_query_device(cd, name, 0, &dmd);
+	if (r < 0) {
+		log_err(cd, _("Device %s is not active."), name);
+		return -EINVAL;
+	}
+
+	r = (single_segment(&dmd) && dmd.segment.type == DM_CRYPT &&
+	     !(dmd.flags & CRYPT_ACTIVATE_INLINE_CRYPT)) ? 0 : -ENOTSUP;
+	dm_targets_free(cd, &dmd);
+	if (r < 0) {
+		log_err(cd, _("Unsupported parameters on device %s."), name);
+		return r;
+	}
+
+	r = dm_device_devno(cd, name, &major, &minor);
+	if (r < 0)
+		return r;
+
+	log_dbg(cd, "Setting dm-crypt workqueue CPU mask %s for device %s.", cpumask, name);
+
+	r = crypt_dev_workqueue_cpumask(major, minor, cpumask);
+	if (r < 0) {
+		log_err(cd, _("Cannot set CPU mask %s for device %s."), cpumask, name);
+		return -EINVAL;
+	} else if (!r) {
+		log_err(cd, _("Kernel does not expose dm-crypt workqueue for device %s."), name);
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+int crypt_persistent_flags_set(struct crypt_device *cd, crypt_flags_type type, uint32_t flags)
+{
+	int r;
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	if (type == CRYPT_FLAGS_ACTIVATION)
+		return LUKS2_config_set_flags(cd, &cd->u.luks2.hdr, flags);
+
+	if (type == CRYPT_FLAGS_REQUIREMENTS)
+		return LUKS2_config_set_requirements(cd, &cd->u.luks2.hdr, flags, true);
+
+	return -EINVAL;
+}
+
+int crypt_persistent_flags_get(struct crypt_device *cd, crypt_flags_type type, uint32_t *flags)
+{
+	int r;
+
+	if (!flags)
+		return -EINVAL;
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_UNRESTRICTED, 0)))
+		return r;
+
+	if (type == CRYPT_FLAGS_ACTIVATION)
+		return LUKS2_config_get_flags(cd, &cd->u.luks2.hdr, flags);
+
+	if (type == CRYPT_FLAGS_REQUIREMENTS)
+		return LUKS2_config_get_requirements(cd, &cd->u.luks2.hdr, flags);
+
+	return -EINVAL;
+}
+
+static int update_volume_key_segment_digest(struct crypt_device *cd, struct luks2_hdr *hdr, int digest, int commit)
+{
+	int r;
+
+	/* Remove any assignments in memory */
+	r = LUKS2_digest_segment_assign(cd, hdr, CRYPT_DEFAULT_SEGMENT, CRYPT_ANY_DIGEST, 0, 0);
+	if (r)
+		return r;
+
+	/* Assign it to the specific digest */
+	return LUKS2_digest_segment_assign(cd, hdr, CRYPT_DEFAULT_SEGMENT, digest, 1, commit);
+}
+
+static int verify_and_update_segment_digest(struct crypt_device *cd,
+		struct luks2_hdr *hdr, int keyslot, struct crypt_keyslot_context *kc)
+{
+	int digest, r;
+	struct volume_key *vk = NULL;
+
+	assert(kc);
+	assert(kc->get_luks2_key);
+	assert(keyslot >= 0);
+
+	r = kc->get_luks2_key(cd, kc, keyslot, CRYPT_ANY_SEGMENT, &vk);
+	if (r < 0)
+		return r;
+
+	/* check volume_key (param) digest matches keyslot digest */
+	r = LUKS2_digest_verify(cd, hdr, vk, keyslot);
+	if (r < 0)
+		goto out;
+	digest = r;
+
+	/* nothing to do, volume key in keyslot is already assigned to default segment */
+	r = LUKS2_digest_verify_by_segment(cd, hdr, CRYPT_DEFAULT_SEGMENT, vk);
+	if (r >= 0)
+		goto out;
+
+	/* FIXME: check new volume key is usable with current default segment */
+
+	r = update_volume_key_segment_digest(cd, &cd->u.luks2.hdr, digest, 1);
+	if (r)
+		log_err(cd, _("Failed to assign keyslot %u as the new volume key."), keyslot);
+out:
+	crypt_free_volume_key(vk);
+
+	return r < 0 ? r : keyslot;
+}
+
+static int luks2_keyslot_add_by_verified_volume_key(struct crypt_device *cd,
+	int keyslot_new,
+	const char *new_passphrase,
+	size_t new_passphrase_size,
+	struct volume_key *vk)
+{
+	int r;
+	struct luks2_keyslot_params params;
+
+	assert(cd);
+	assert(keyslot_new >= 0);
+	assert(new_passphrase);
+	assert(vk);
+	assert(crypt_volume_key_get_id(vk) >= 0);
+
+	r = LUKS2_keyslot_params_default(cd, &cd->u.luks2.hdr, &params);
+	if (r < 0) {
+		log_err(cd, _("Failed to initialize default LUKS2 keyslot parameters."));
+		return r;
+	}
 
 	r = LUKS2_digest_assign(cd, &cd->u.luks2.hdr, keyslot_new, crypt_volume_key_get_id(vk), 1, 0);
 	if (r < 0) {
@@ -6210,6 +8770,38 @@ static int luks1_keyslot_add_by_volume_key(struct crypt_device *cd,
 	return r < 0 ? r : keyslot_new;
 }
 
+/* Finds or creates LUKS2 digest for volume key according to flags, sets vk id */
+static int luks2_volume_key_digest(struct crypt_device *cd,
+	struct volume_key *vk,
+	uint32_t *flags)
+{
+	int digest;
+
+	digest = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
+	if (digest >= 0) /* if key matches volume key digest tear down new vk flag */
+		*flags &= ~CRYPT_VOLUME_KEY_SET;
+	else {
+		/* if key matches any existing digest, do not create new digest */
+		if ((*flags & CRYPT_VOLUME_KEY_DIGEST_REUSE))
+			digest = LUKS2_digest_any_matching(cd, &cd->u.luks2.hdr, vk);
+
+		/* no segment flag or new vk flag requires new key digest */
+		if (*flags & (CRYPT_VOLUME_KEY_NO_SEGMENT | CRYPT_VOLUME_KEY_SET)) {
+			if (digest < 0 || !(*flags & CRYPT_VOLUME_KEY_DIGEST_REUSE))
+				digest = LUKS2_digest_create(cd, "pbkdf2", &cd->u.luks2.hdr, vk);
+		}
+	}
+
+	if (digest < 0) {
+		log_err(cd, _("Volume key does not match the volume."));
+		return digest;
+	}
+
+	crypt_volume_key_set_id(vk, digest);
+
+	return digest;
+}
+
 static int keyslot_add_by_key(struct crypt_device *cd,
 	bool is_luks1,
 	int keyslot_new,
@@ -6232,28 +8824,9 @@ static int keyslot_add_by_key(struct crypt_device *cd,
 	if (is_luks1)
 		return -EINVAL;
 
-	digest = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
-	if (digest >= 0) /* if key matches volume key digest tear down new vk flag */
-		flags &= ~CRYPT_VOLUME_KEY_SET;
-	else {
-		/* if key matches any existing digest, do not create new digest */
-		if ((flags & CRYPT_VOLUME_KEY_DIGEST_REUSE))
-			digest = LUKS2_digest_any_matching(cd, &cd->u.luks2.hdr, vk);
-
-		/* no segment flag or new vk flag requires new key digest */
-		if (flags & (CRYPT_VOLUME_KEY_NO_SEGMENT | CRYPT_VOLUME_KEY_SET)) {
-			if (digest < 0 || !(flags & CRYPT_VOLUME_KEY_DIGEST_REUSE))
-				digest = LUKS2_digest_create(cd, "pbkdf2", &cd->u.luks2.hdr, vk);
-		}
-	}
-
-	r = digest;
-	if (r < 0) {
-		log_err(cd, _("Volume key does not match the volume."));
+	r = digest = luks2_volume_key_digest(cd, vk, &flags);
+	if (r < 0)
 		return r;
-	}
-
-	crypt_volume_key_set_id(vk, digest);
 
 	if (flags & CRYPT_VOLUME_KEY_SET) {
 		r = update_volume_key_segment_digest(cd, &cd->u.luks2.hdr, digest, 0);
@@ -6310,42 +8883,17 @@ int crypt_keyslot_add_by_key(struct crypt_device *cd,
 	return r;
 }
 
-int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
+/* Unlocks volume key for adding new keyslots, the same for single and batch add */
+static int keyslot_add_volume_key(struct crypt_device *cd,
 	int keyslot_existing,
 	struct crypt_keyslot_context *kc,
-	int keyslot_new,
-	struct crypt_keyslot_context *new_kc,
-	uint32_t flags)
+	uint32_t flags,
+	struct volume_key **r_vk)
 {
 	bool is_luks1;
 	int active_slots, r;
-	const char *new_passphrase;
-	size_t new_passphrase_size;
 	struct volume_key *vk = NULL;
 
-	if (!kc || ((flags & CRYPT_VOLUME_KEY_NO_SEGMENT) &&
-		    (flags & CRYPT_VOLUME_KEY_SET)))
-		return -EINVAL;
-
-	r = flags ? onlyLUKS2(cd) : onlyLUKS(cd);
-	if (r)
-		return r;
-
-	if ((flags & CRYPT_VOLUME_KEY_SET) && crypt_keyslot_status(cd, keyslot_existing) > CRYPT_SLOT_INACTIVE)
-		return verify_and_update_segment_digest(cd, &cd->u.luks2.hdr, keyslot_existing, kc);
-
-	if (!new_kc || !new_kc->get_passphrase)
-		return -EINVAL;
-
-	log_dbg(cd, "Adding new keyslot %d by %s%s, volume key provided by %s (%d).",
-		keyslot_new, keyslot_context_type_string(new_kc),
-		(flags & CRYPT_VOLUME_KEY_NO_SEGMENT) ? " unassigned to a crypt segment" : "",
-		keyslot_context_type_string(kc), keyslot_existing);
-
-	r = keyslot_verify_or_find_empty(cd, &keyslot_new);
-	if (r < 0)
-		return r;
-
 	is_luks1 = isLUKS1(cd->type);
 	if (is_luks1)
 		active_slots = LUKS_keyslot_active_count(&cd->u.luks1.hdr);
@@ -6382,6 +8930,21 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
+	*r_vk = vk;
+	return 0;
+}
+
+static int keyslot_add_by_context_volume_key(struct crypt_device *cd,
+	int keyslot_new,
+	struct crypt_keyslot_context *new_kc,
+	struct volume_key *vk,
+	uint32_t flags)
+{
+	bool is_luks1 = isLUKS1(cd->type);
+	const char *new_passphrase;
+	size_t new_passphrase_size;
+	int r;
+
 	r = new_kc->get_passphrase(cd, new_kc, &new_passphrase, &new_passphrase_size);
 	/* If new keyslot context is token just assign it to new keyslot */
 	if (r >= 0 && new_kc->type == CRYPT_KC_TYPE_TOKEN && !is_luks1)
@@ -6389,6 +8952,48 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
 	if (r >= 0)
 		r = keyslot_add_by_key(cd, is_luks1, keyslot_new, new_passphrase, new_passphrase_size, vk, flags);
 
+	return r;
+}
+
+int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
+	int keyslot_existing,
+	struct crypt_keyslot_context *kc,
+	int keyslot_new,
+	struct crypt_keyslot_context *new_kc,
+	uint32_t flags)
+{
+	int r;
+	struct volume_key *vk = NULL;
+
+	if (!kc || ((flags & CRYPT_VOLUME_KEY_NO_SEGMENT) &&
+		    (flags & CRYPT_VOLUME_KEY_SET)))
+		return -EINVAL;
+
+	r = flags ? onlyLUKS2(cd) : onlyLUKS(cd);
+	if (r)
+		return r;
+
+	if ((flags & CRYPT_VOLUME_KEY_SET) && crypt_keyslot_status(cd, keyslot_existing) > CRYPT_SLOT_INACTIVE)
+		return verify_and_update_segment_digest(cd, &cd->u.luks2.hdr, keyslot_existing, kc);
+
+	if (!new_kc || !new_kc->get_passphrase)
+		return -EINVAL;
+
+	log_dbg(cd, "Adding new keyslot %d by %s%s, volume key provided by %s (%d).",
+		keyslot_new, keyslot_context_type_string(new_kc),
+		(flags & CRYPT_VOLUME_KEY_NO_SEGMENT) ? " unassigned to a crypt segment" : "",
+		keyslot_context_type_string(kc), keyslot_existing);
+
+	r = keyslot_verify_or_find_empty(cd, &keyslot_new);
+	if (r < 0)
+		return r;
+
+	r = keyslot_add_volume_key(cd, keyslot_existing, kc, flags, &vk);
+	if (r < 0)
+		return r;
+
+	r = keyslot_add_by_context_volume_key(cd, keyslot_new, new_kc, vk, flags);
+
 	crypt_free_volume_key(vk);
 
 	if (r < 0) {
@@ -6399,6 +9004,315 @@ int crypt_keyslot_add_by_keyslot_context(struct crypt_device *cd,
 	return keyslot_new;
 }
 
+/*
+ * Keyslot metadata are prepared one by one, keyslot keys are then derived
+ * in parallel (bounded by PBKDF memory limit) and LUKS2 metadata is written
+ * only once, after all keyslot areas are stored.
+ */
+static int luks2_keyslots_add_by_volume_key(struct crypt_device *cd,
+	int *keyslots_new,
+	struct crypt_keyslot_context **new_kcs,
+	size_t count,
+	struct volume_key *vk,
+	uint32_t flags)
+{
+	struct luks2_hdr *hdr = &cd->u.luks2.hdr;
+	struct luks2_keyslot_params params;
+	const char *passwords[LUKS2_KEYSLOTS_MAX];
+	size_t password_lens[LUKS2_KEYSLOTS_MAX];
+	int digest, r;
+	size_t i;
+
+	/* digest (also new unbound key digest) is verified or created only once */
+	r = digest = luks2_volume_key_digest(cd, vk, &flags);
+	if (r < 0)
+		return r;
+
+	r = LUKS2_keyslot_params_default(cd, hdr, &params);
+	if (r < 0) {
+		log_err(cd, _("Failed to initialize default LUKS2 keyslot parameters."));
+		return r;
+	}
+
+	hdr->write_deferred = true;
+
+	for (i = 0; i < count && r >= 0; i++) {
+		r = keyslot_verify_or_find_empty(cd, &keyslots_new[i]);
+		if (r < 0)
+			break;
+
+		log_dbg(cd, "Adding new keyslot %d by %s%s.", keyslots_new[i],
+			keyslot_context_type_string(new_kcs[i]),
+			(flags & CRYPT_VOLUME_KEY_NO_SEGMENT) ? " unassigned to a crypt segment" : "");
+
+		r = new_kcs[i]->get_passphrase(cd, new_kcs[i], &passwords[i], &password_lens[i]);
+		if (r >= 0 && new_kcs[i]->type == CRYPT_KC_TYPE_TOKEN)
+			r = LUKS2_token_assign(cd, hdr, keyslots_new[i], new_kcs[i]->u.t.id, 1, 0);
+		if (r >= 0) {
+			r = LUKS2_digest_assign(cd, hdr, keyslots_new[i], digest, 1, 0);
+			if (r < 0)
+				log_err(cd, _("Failed to assign keyslot %d to digest."), keyslots_new[i]);
+		}
+		if (r >= 0)
+			r = LUKS2_keyslot_store_prepare(cd, hdr, keyslots_new[i], vk, &params);
+	}
+
+	if (r >= 0)
+		r = LUKS2_keyslots_store(cd, hdr, keyslots_new, passwords, password_lens, count, vk);
+
+	hdr->write_deferred = false;
+
+	if (r >= 0)
+		r = LUKS2_hdr_write(cd, hdr);
+
+	return r;
+}
+
+int crypt_keyslots_add_by_keyslot_context(struct crypt_device *cd,
+	int keyslot_existing,
+	struct crypt_keyslot_context *kc,
+	int *keyslots_new,
+	struct crypt_keyslot_context **new_kcs,
+	size_t count,
+	uint32_t flags)
+{
+	struct volume_key *vk = NULL;
+	size_t i;
+	int r;
+
+	if (!kc || !keyslots_new || !new_kcs || !count || (flags & CRYPT_VOLUME_KEY_SET))
+		return -EINVAL;
+
+	r = flags ? onlyLUKS2(cd) : onlyLUKS(cd);
+	if (r)
+		return r;
+
+	if (count > (size_t)crypt_keyslot_max(cd->type))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!new_kcs[i] || !new_kcs[i]->get_passphrase)
+			return -EINVAL;
+		/* free keyslots are searched later, one by one */
+		if (keyslots_new[i] != CRYPT_ANY_SLOT &&
+		    (r = keyslot_verify_or_find_empty(cd, &keyslots_new[i])) < 0)
+			return r;
+	}
+
+	log_dbg(cd, "Adding %zu new keyslots, volume key provided by %s (%d).",
+		count, keyslot_context_type_string(kc), keyslot_existing);
+
+	/* Existing keyslot is unlocked only once for all new keyslots */
+	r = keyslot_add_volume_key(cd, keyslot_existing, kc, flags, &vk);
+	if (r < 0)
+		return r;
+
+	if (isLUKS1(cd->type)) {
+		for (i = 0; i < count && r >= 0; i++) {
+			r = keyslot_verify_or_find_empty(cd, &keyslots_new[i]);
+			if (r >= 0)
+				r = keyslot_add_by_context_volume_key(cd, keyslots_new[i], new_kcs[i], vk, flags);
+		}
+	} else
+		r = luks2_keyslots_add_by_volume_key(cd, keyslots_new, new_kcs, count, vk, flags);
+
+	crypt_free_volume_key(vk);
+
+	if (r < 0) {
+		_luks2_rollback(cd);
+		return r;
+	}
+
+	return 0;
+}
+
+/* PBKDF benchmarked on current host, shared by keyslots with the same KDF */
+struct keyslot_cost {
+	char type[16];
+	char hash[32];
+	size_t key_size;
+	uint32_t memory_kb;
+	uint32_t parallel_threads;
+	struct crypt_pbkdf_type bench;
+};
+
+/*
+ * Estimate keyslot unlock time on this host. PBKDF cost is linear in iterations
+ * and (for Argon2) in memory, the benchmark for the same KDF and parallel cost
+ * is interpolated to keyslot parameters.
+ */
+static int keyslot_unlock_time_estimate(struct crypt_device *cd, struct luks2_hdr *hdr,
+	int keyslot, const struct crypt_pbkdf_type *ks,
+	struct keyslot_cost *costs, int *costs_count, uint32_t *r_time_ms)
+{
+	struct keyslot_cost *c = NULL;
+	double ms;
+	int i, key_size, r;
+
+	key_size = LUKS2_get_keyslot_stored_key_size(hdr, keyslot);
+	if (key_size < 0 || !ks->iterations)
+		return -EINVAL;
+
+	for (i = 0; i < *costs_count && !c; i++)
+		if (!strcmp(costs[i].type, ks->type) && !strcmp(costs[i].hash, ks->hash ?: "") &&
+		    costs[i].key_size == (size_t)key_size && costs[i].memory_kb == ks->max_memory_kb &&
+		    costs[i].parallel_threads == ks->parallel_threads)
+			c = &costs[i];
+
+	if (!c) {
+		if (*costs_count >= LUKS2_KEYSLOTS_MAX)
+			return -EINVAL;
+		c = &costs[(*costs_count)++];
+		memset(c, 0, sizeof(*c));
+		if (snprintf(c->type, sizeof(c->type), "%s", ks->type) >= (int)sizeof(c->type) ||
+		    snprintf(c->hash, sizeof(c->hash), "%s", ks->hash ?: "") >= (int)sizeof(c->hash)) {
+			(*costs_count)--;
+			return -EINVAL;
+		}
+		c->key_size = key_size;
+		c->memory_kb = ks->max_memory_kb;
+		c->parallel_threads = ks->parallel_threads;
+
+		c->bench.type = c->type;
+		c->bench.hash = *c->hash ? c->hash : NULL;
+		c->bench.time_ms = crypt_get_pbkdf(cd)->time_ms ?: DEFAULT_LUKS2_ITER_TIME;
+		c->bench.max_memory_kb = ks->max_memory_kb;
+		c->bench.parallel_threads = ks->parallel_threads;
+
+		r = crypt_benchmark_pbkdf_internal(cd, &c->bench, key_size);
+		if (r < 0) {
+			(*costs_count)--;
+			return r;
+		}
+	}
+
+	if (!c->bench.iterations)
+		return -EINVAL;
+
+	ms = (double)c->bench.time_ms * ks->iterations / c->bench.iterations;
+	if (strcmp(ks->type, CRYPT_KDF_PBKDF2) && c->bench.max_memory_kb)
+		ms = ms * ks->max_memory_kb / c->bench.max_memory_kb;
+
+	*r_time_ms = ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+	log_dbg(cd, "Keyslot %d estimated unlock time is %u ms.", keyslot, *r_time_ms);
+
+	return 0;
+}
+
+int crypt_keyslots_rebalance_by_keyslot_context(struct crypt_device *cd,
+	struct crypt_keyslot_context **kcs,
+	size_t count,
+	uint32_t min_time_ms,
+	uint32_t max_time_ms)
+{
+	struct keyslot_cost costs[LUKS2_KEYSLOTS_MAX];
+	struct luks2_keyslot_params params;
+	struct crypt_pbkdf_type pbkdf;
+	struct volume_key *vk;
+	struct luks2_hdr *hdr;
+	const char *passphrase;
+	size_t i, passphrase_size;
+	int keyslot, keyslot_new, digest, costs_count = 0, rebalanced = 0, r;
+	uint32_t time_ms;
+
+	if (!kcs || !count || min_time_ms > max_time_ms)
+		return -EINVAL;
+
+	r = onlyLUKS2(cd);
+	if (r)
+		return r;
+
+	for (i = 0; i < count; i++)
+		if (!kcs[i] || !kcs[i]->get_luks2_key || !kcs[i]->get_passphrase)
+			return -EINVAL;
+
+	hdr = &cd->u.luks2.hdr;
+
+	r = LUKS2_keyslot_params_default(cd, hdr, &params);
+	if (r < 0) {
+		log_err(cd, _("Failed to initialize default LUKS2 keyslot parameters."));
+		return r;
+	}
+
+	log_dbg(cd, "Rebalancing keyslots outside of %u - %u ms unlock time.", min_time_ms, max_time_ms);
+
+	for (keyslot = 0; keyslot < LUKS2_KEYSLOTS_MAX && r >= 0; keyslot++) {
+		if (LUKS2_keyslot_info(hdr, keyslot) < CRYPT_SLOT_ACTIVE)
+			continue;
+
+		/* Keyslots without PBKDF (reencryption) are not rewrapped */
+		if (LUKS2_keyslot_pbkdf(hdr, keyslot, &pbkdf) < 0 || !pbkdf.type)
+			continue;
+
+		r = keyslot_unlock_time_estimate(cd, hdr, keyslot, &pbkdf, costs, &costs_count, &time_ms);
+		if (r < 0)
+			break;
+
+		if (time_ms >= min_time_ms && time_ms <= max_time_ms)
+			continue;
+
+		/* Only keyslots unlocked by provided contexts can be rewrapped */
+		for (i = 0, vk = NULL; i < count && !vk; i++) {
+			r = kcs[i]->get_luks2_key(cd, kcs[i], keyslot, CRYPT_ANY_SEGMENT, &vk);
+			if (r == -EPERM || r == -ENOENT)
+				r = 0;
+			else if (r < 0)
+				break;
+		}
+		if (r < 0)
+			break;
+
+		if (!vk) {
+			log_dbg(cd, "Keyslot %d not unlocked by any context, skipping.", keyslot);
+			continue;
+		}
+
+		/*
+		 * The same way as passphrase change: new keyslot is stored and committed
+		 * to a free keyslot first, then swapped with and the old one destroyed.
+		 * The passphrase opens at least one committed keyslot at any time.
+		 */
+		keyslot_new = LUKS2_keyslot_find_empty(cd, hdr, vk->keylength);
+		if (keyslot_new < 0) {
+			log_dbg(cd, "No free keyslot to rewrap keyslot %d, skipping.", keyslot);
+			crypt_free_volume_key(vk);
+			r = 0;
+			continue;
+		}
+
+		log_dbg(cd, "Keyslot %d is going to be rewrapped through keyslot %d.", keyslot, keyslot_new);
+
+		digest = LUKS2_digest_by_keyslot(hdr, keyslot);
+		r = digest < 0 ? -EINVAL : 0;
+		if (r >= 0)
+			r = kcs[i - 1]->get_passphrase(cd, kcs[i - 1], &passphrase, &passphrase_size);
+		if (r >= 0)
+			r = LUKS2_digest_assign(cd, hdr, keyslot_new, digest, 1, 0);
+		if (r >= 0)
+			r = LUKS2_token_assignment_copy(cd, hdr, keyslot, keyslot_new, 0);
+		if (r >= 0)
+			r = LUKS2_keyslot_store(cd, hdr, keyslot_new, passphrase, passphrase_size, vk, &params);
+		crypt_free_volume_key(vk);
+		/* written with the old keyslot destroy */
+		if (r >= 0)
+			r = LUKS2_keyslot_priority_set(cd, hdr, keyslot_new,
+						       LUKS2_keyslot_priority_get(hdr, keyslot), 0);
+		if (r >= 0)
+			r = LUKS2_keyslot_swap(cd, hdr, keyslot, keyslot_new);
+		if (r >= 0)
+			r = LUKS2_keyslot_wipe(cd, hdr, keyslot_new, 0);
+		if (r >= 0)
+			rebalanced++;
+	}
+
+	if (r < 0) {
+		_luks2_rollback(cd);
+		return r;
+	}
+
+	return rebalanced;
+}
+
 /*
  * Keyring handling
  */
@@ -6425,32 +9339,87 @@ int crypt_volume_key_keyring(struct crypt_device *cd __attribute__((unused)), in
 	return 0;
 }
 
-/* internal only */
-int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key *vk)
+int crypt_volume_key_cache(struct crypt_device *cd __attribute__((unused)), unsigned int timeout)
 {
+	crypt_vk_cache_set_timeout(timeout);
+	return 0;
+}
+
+int crypt_parallel_unlock(struct crypt_device *cd __attribute__((unused)), int enable)
+{
+	_parallel_unlock = enable ? 1 : 0;
+	return 0;
+}
+
+int crypt_parallel_unlock_enabled(void)
+{
+	return _parallel_unlock;
+}
+
+static int volume_keys_load_in_keyring(struct crypt_device *cd, struct volume_key *vks, unsigned int count)
+{
+	struct keyring_key *keys;
+	struct volume_key *vk;
+	unsigned int i;
 	int r;
-	const char *type_name = key_type_name(LOGON_KEY);
 
-	if (!vk || !cd || !type_name)
-		return -EINVAL;
+	for (i = 0, vk = vks; i < count; i++, vk = crypt_volume_key_next(vk)) {
+		if (!vk->key_description) {
+			log_dbg(cd, "Invalid key description");
+			return -EINVAL;
+		}
+	}
 
-	if (!vk->key_description) {
-		log_dbg(cd, "Invalid key description");
-		return -EINVAL;
+	keys = malloc(count * sizeof(*keys));
+	if (!keys)
+		return -ENOMEM;
+
+	for (i = 0, vk = vks; i < count; i++, vk = crypt_volume_key_next(vk)) {
+		keys[i].key_desc = vk->key_description;
+		keys[i].key = vk->key;
+		keys[i].key_size = vk->keylength;
 	}
 
-	log_dbg(cd, "Loading key (%zu bytes, type %s) in thread keyring.", vk->keylength, type_name);
+	log_dbg(cd, "Loading %u key(s) (type %s) in thread keyring.", count, key_type_name(LOGON_KEY));
 
-	r = keyring_add_key_in_thread_keyring(LOGON_KEY, vk->key_description, vk->key, vk->keylength);
+	r = keyring_add_keys_in_thread_keyring(LOGON_KEY, keys, count);
 	if (r) {
-		log_dbg(cd, "keyring_add_key_in_thread_keyring failed (error %d)", r);
+		log_dbg(cd, "keyring_add_keys_in_thread_keyring failed (error %d)", r);
 		log_err(cd, _("Failed to load key in kernel keyring."));
-	} else
+	} else {
+		for (i = 0, vk = vks; i < count; i++, vk = crypt_volume_key_next(vk))
+			vk->key_serial = keys[i].kid;
 		crypt_set_key_in_keyring(cd, 1);
+	}
 
+	free(keys);
 	return r;
 }
 
+/* internal only */
+int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key *vk)
+{
+	if (!vk || !cd || !key_type_name(LOGON_KEY))
+		return -EINVAL;
+
+	return volume_keys_load_in_keyring(cd, vk, 1);
+}
+
+/* internal only */
+int crypt_volume_keys_load_in_keyring(struct crypt_device *cd, struct volume_key *vks)
+{
+	struct volume_key *vk;
+	unsigned int count = 0;
+
+	if (!vks || !cd || !key_type_name(LOGON_KEY))
+		return -EINVAL;
+
+	for (vk = vks; vk; vk = crypt_volume_key_next(vk))
+		count++;
+
+	return volume_keys_load_in_keyring(cd, vks, count);
+}
+
 /* internal only */
 int crypt_key_in_keyring(struct crypt_device *cd)
 {
@@ -6488,8 +9457,19 @@ void crypt_drop_keyring_key(struct crypt_device *cd, struct volume_key *vks)
 {
 	struct volume_key *vk = vks;
 
+	int r;
+
 	while (vk) {
-		crypt_drop_keyring_key_by_description(cd, vk->key_description, LOGON_KEY);
+		/* key uploaded by us, no need to search keyrings for it */
+		if (vk->key_serial > 0) {
+			log_dbg(cd, "Revoking and unlinking keyring key %d.", vk->key_serial);
+			r = keyring_revoke_and_unlink_key_id(vk->key_serial);
+			if (r)
+				log_dbg(cd, "keyring_revoke_and_unlink_key_id failed (error %d)", r);
+			vk->key_serial = 0;
+			crypt_set_key_in_keyring(cd, 0);
+		} else
+			crypt_drop_keyring_key_by_description(cd, vk->key_description, LOGON_KEY);
 		vk = crypt_volume_key_next(vk);
 	}
 }
@@ -6561,12 +9541,19 @@ void crypt_serialize_unlock(struct crypt_device *cd)
 	cd->pbkdf_memory_hard_lock = NULL;
 }
 
+bool crypt_serialize_lock_enabled(struct crypt_device *cd)
+{
+	return cd && cd->memory_hard_pbkdf_lock_enabled;
+}
+
 crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 		struct crypt_params_reencrypt *params)
 {
 	if (params)
 		memset(params, 0, sizeof(*params));
 
+	crypt_load_deferred(cd);
+
 	if (!cd || !isLUKS(cd->type))
 		return CRYPT_REENCRYPT_INVALID;
 
@@ -6576,12 +9563,17 @@ crypt_reencrypt_info crypt_reencrypt_status(struct crypt_device *cd,
 	if (_onlyLUKS2(cd, CRYPT_CD_QUIET, CRYPT_REQUIREMENT_ONLINE_REENCRYPT))
 		return CRYPT_REENCRYPT_INVALID;
 
+	/* initialized reencryption keeps typed status, no segments walk */
+	if (crypt_get_luks2_reencrypt(cd))
+		return LUKS2_reencrypt_get_params_by_context(crypt_get_luks2_reencrypt(cd), params);
+
 	return LUKS2_reencrypt_get_params(&cd->u.luks2.hdr, params);
 }
 
 static void __attribute__((destructor)) libcryptsetup_exit(void)
 {
 	crypt_token_unload_external_all(NULL);
+	crypt_vk_cache_destroy();
 
 	crypt_backend_destroy();
 	crypt_random_exit();
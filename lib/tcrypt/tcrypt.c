@@ -27,6 +27,7 @@
 #include "libcryptsetup.h"
 #include "tcrypt.h"
 #include "internal.h"
+#include "utils_threadpool.h"
 
 /* TCRYPT PBKDF variants */
 static const struct {
@@ -270,7 +271,7 @@ static void TCRYPT_swab_le(char *buf)
 }
 
 static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
-				   const char *key, char *buf)
+				   const char *key, char *buf, size_t len)
 {
 	int bs = alg->iv_size;
 	char iv[8], iv_old[8];
@@ -285,7 +286,7 @@ static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
 		return r;
 
 	memcpy(iv, &key[alg->iv_offset], alg->iv_size);
-	for (i = 0; i < TCRYPT_HDR_LEN; i += bs) {
+	for (i = 0; i < (int)len; i += bs) {
 		memcpy(iv_old, &buf[i], bs);
 		TCRYPT_swab_le(&buf[i]);
 		r = crypt_cipher_decrypt(cipher, &buf[i], &buf[i],
@@ -304,11 +305,11 @@ static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
 	return r;
 }
 
-static void TCRYPT_remove_whitening(char *buf, const char *key)
+static void TCRYPT_remove_whitening(char *buf, const char *key, size_t len)
 {
-	int j;
+	size_t j;
 
-	for (j = 0; j < TCRYPT_HDR_LEN; j++)
+	for (j = 0; j < len; j++)
 		buf[j] ^= key[j % 8];
 }
 
@@ -333,7 +334,7 @@ static void TCRYPT_copy_key(struct tcrypt_alg *alg, const char *mode,
 }
 
 static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
-				   const char *key,struct tcrypt_phdr *hdr)
+				   const char *key, struct tcrypt_phdr *hdr, size_t len)
 {
 	char backend_key[TCRYPT_HDR_KEY_LEN];
 	char iv[TCRYPT_HDR_IV_LEN] = {};
@@ -352,9 +353,9 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
 	if (!strncmp(mode, "lrw", 3))
 		iv[alg->iv_size - 1] = 1;
 	else if (!strncmp(mode, "cbc", 3)) {
-		TCRYPT_remove_whitening(buf, &key[8]);
+		TCRYPT_remove_whitening(buf, &key[8], len);
 		if (!strcmp(alg->name, "blowfish_le"))
-			return decrypt_blowfish_le_cbc(alg, key, buf);
+			return decrypt_blowfish_le_cbc(alg, key, buf, len);
 		memcpy(iv, &key[alg->iv_offset], alg->iv_size);
 	}
 
@@ -362,7 +363,7 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
 	r = crypt_cipher_init(&cipher, alg->name, mode_name,
 			      backend_key, alg->key_size);
 	if (!r) {
-		r = crypt_cipher_decrypt(cipher, buf, buf, TCRYPT_HDR_LEN,
+		r = crypt_cipher_decrypt(cipher, buf, buf, len,
 					 iv, alg->iv_size);
 		crypt_cipher_destroy(cipher);
 	}
@@ -377,7 +378,7 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
  * Backend doesn't provide this, so implement it here directly using ECB.
  */
 static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
-				const char *key, struct tcrypt_phdr *hdr)
+				const char *key, struct tcrypt_phdr *hdr, size_t len)
 {
 	struct crypt_cipher *cipher[3];
 	unsigned int bs = ciphers->cipher[0].iv_size;
@@ -388,7 +389,7 @@ static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
 	assert(ciphers->chain_count <= 3);
 	assert(bs <= 16);
 
-	TCRYPT_remove_whitening(buf, &key[8]);
+	TCRYPT_remove_whitening(buf, &key[8], len);
 
 	memcpy(iv, &key[ciphers->cipher[0].iv_offset], bs);
 
@@ -404,7 +405,7 @@ static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
 	}
 
 	/* Implements CBC with chained ciphers in loop inside */
-	for (i = 0; i < TCRYPT_HDR_LEN; i += bs) {
+	for (i = 0; i < len; i += bs) {
 		memcpy(iv_old, &buf[i], bs);
 		for (j = ciphers->chain_count; j > 0; j--) {
 			r = crypt_cipher_decrypt(cipher[j - 1], &buf[i], &buf[i],
@@ -426,11 +427,43 @@ out:
 	return r;
 }
 
+/*
+ * Decrypt len bytes of header with cipher chain. All supported modes
+ * (XTS, LRW, CBC) decrypt the first blocks independently of the rest
+ * of the header, so a short probe is enough for the magic check.
+ */
+static int TCRYPT_decrypt_chain(struct tcrypt_algs *ciphers, const char *key,
+				struct tcrypt_phdr *hdr, size_t len)
+{
+	int j, r = -EINVAL;
+
+	if (!strncmp(ciphers->mode, "cbci", 4))
+		return TCRYPT_decrypt_cbci(ciphers, key, hdr, len);
+
+	for (j = ciphers->chain_count - 1; j >= 0 ; j--) {
+		if (!ciphers->cipher[j].name)
+			continue;
+		r = TCRYPT_decrypt_hdr_one(&ciphers->cipher[j], ciphers->mode,
+					   key, hdr, len);
+		if (r < 0)
+			break;
+	}
+
+	return r;
+}
+
+static bool TCRYPT_hdr_magic(struct tcrypt_phdr *hdr, struct crypt_params_tcrypt *params)
+{
+	return !strncmp(hdr->d.magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN) ||
+	       ((params->flags & CRYPT_TCRYPT_VERA_MODES) &&
+		!strncmp(hdr->d.magic, VCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN));
+}
+
 static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 			       const char *key, struct crypt_params_tcrypt *params)
 {
 	struct tcrypt_phdr hdr2;
-	int i, j, r = -EINVAL;
+	int i, r = -EINVAL;
 
 	for (i = 0; tcrypt_cipher[i].chain_count; i++) {
 		if (params->cipher && !strstr(tcrypt_cipher[i].long_name, params->cipher))
@@ -440,17 +473,17 @@ static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 		log_dbg(cd, "TCRYPT:  trying cipher %s-%s",
 			tcrypt_cipher[i].long_name, tcrypt_cipher[i].mode);
 
-		memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
+		/* Check magic in the first decrypted blocks only */
+		memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_PROBE_LEN);
+		r = TCRYPT_decrypt_chain(&tcrypt_cipher[i], key, &hdr2, TCRYPT_HDR_PROBE_LEN);
+		if (!r && !TCRYPT_hdr_magic(&hdr2, params)) {
+			r = -EPERM;
+			continue;
+		}
 
-		if (!strncmp(tcrypt_cipher[i].mode, "cbci", 4))
-			r = TCRYPT_decrypt_cbci(&tcrypt_cipher[i], key, &hdr2);
-		else for (j = tcrypt_cipher[i].chain_count - 1; j >= 0 ; j--) {
-			if (!tcrypt_cipher[i].cipher[j].name)
-				continue;
-			r = TCRYPT_decrypt_hdr_one(&tcrypt_cipher[i].cipher[j],
-					    tcrypt_cipher[i].mode, key, &hdr2);
-			if (r < 0)
-				break;
+		if (!r) {
+			memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
+			r = TCRYPT_decrypt_chain(&tcrypt_cipher[i], key, &hdr2, TCRYPT_HDR_LEN);
 		}
 
 		if (r < 0) {
@@ -526,15 +559,167 @@ out:
 	return r;
 }
 
+/* Returns false if the KDF variant is not used for the params */
+static bool TCRYPT_kdf_iterations(struct crypt_params_tcrypt *params,
+				  unsigned int i, unsigned int *iterations)
+{
+	if (params->hash_name && strcmp(params->hash_name, tcrypt_kdf[i].hash))
+		return false;
+	if (!(params->flags & CRYPT_TCRYPT_LEGACY_MODES) && tcrypt_kdf[i].legacy)
+		return false;
+	if (!(params->flags & CRYPT_TCRYPT_VERA_MODES) && tcrypt_kdf[i].veracrypt)
+		return false;
+	if ((params->flags & CRYPT_TCRYPT_VERA_MODES) && params->veracrypt_pim) {
+		/* Do not try TrueCrypt modes if we have PIM value */
+		if (!tcrypt_kdf[i].veracrypt)
+			return false;
+		/* adjust iterations to given PIM cmdline parameter */
+		*iterations = tcrypt_kdf[i].veracrypt_pim_const +
+			    (tcrypt_kdf[i].veracrypt_pim_mult * params->veracrypt_pim);
+	} else
+		*iterations = tcrypt_kdf[i].iterations;
+
+	return true;
+}
+
+/* Header keys of all KDF variants derived in advance */
+struct tcrypt_kdf_keys {
+	const char *pwd;
+	size_t pwd_len;
+	const char *salt;
+	unsigned int count;
+	unsigned int kdf[ARRAY_SIZE(tcrypt_kdf)];
+	unsigned int iterations[ARRAY_SIZE(tcrypt_kdf)];
+	int r[ARRAY_SIZE(tcrypt_kdf)];
+	char *keys;
+};
+
+static int TCRYPT_derive_key_job(void *arg, unsigned int job)
+{
+	struct tcrypt_kdf_keys *kk = arg;
+	unsigned int i = kk->kdf[job];
+
+	kk->r[i] = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
+			       kk->pwd, kk->pwd_len,
+			       kk->salt, TCRYPT_HDR_SALT_LEN,
+			       kk->keys + i * TCRYPT_HDR_KEY_LEN, TCRYPT_HDR_KEY_LEN,
+			       kk->iterations[job], 0, 0);
+	return 0;
+}
+
+/*
+ * Derive header keys of all candidate KDF variants concurrently, header
+ * decryption is then tried in the original order, so the first matching
+ * variant wins as in serial search.
+ */
+static int TCRYPT_derive_keys(struct crypt_device *cd,
+			      struct crypt_params_tcrypt *params,
+			      struct tcrypt_kdf_keys *kk)
+{
+	struct crypt_threadpool *tp = NULL;
+	unsigned int i, threads;
+	int r;
+
+	for (i = 0; tcrypt_kdf[i].name; i++)
+		if (TCRYPT_kdf_iterations(params, i, &kk->iterations[kk->count]))
+			kk->kdf[kk->count++] = i;
+
+	threads = crypt_get_threads(cd);
+	if (threads > kk->count)
+		threads = kk->count;
+	if (threads < 2)
+		return -ENOTSUP;
+
+	kk->keys = crypt_safe_alloc(ARRAY_SIZE(tcrypt_kdf) * TCRYPT_HDR_KEY_LEN);
+	if (!kk->keys)
+		return -ENOMEM;
+
+	log_dbg(cd, "TCRYPT: deriving %u header keys in parallel.", kk->count);
+
+	r = crypt_threadpool_init(cd, &tp, threads);
+	if (!r)
+		r = crypt_threadpool_run(tp, kk->count, TCRYPT_derive_key_job, kk);
+	crypt_threadpool_destroy(tp);
+
+	if (r < 0) {
+		crypt_safe_free(kk->keys);
+		kk->keys = NULL;
+	}
+
+	return r;
+}
+
+/* Try derived header key with all known KDFs on one candidate header */
+static int TCRYPT_try_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
+			  struct crypt_params_tcrypt *params, struct tcrypt_kdf_keys *kk,
+			  char *key, unsigned int *kdf)
+{
+	unsigned int i, skipped = 0, iterations;
+	int r = -EPERM;
+
+	for (i = 0; tcrypt_kdf[i].name; i++) {
+		if (!TCRYPT_kdf_iterations(params, i, &iterations))
+			continue;
+		/* Derive header key */
+		log_dbg(cd, "TCRYPT: trying KDF: %s-%s-%d%s.",
+			tcrypt_kdf[i].name, tcrypt_kdf[i].hash, tcrypt_kdf[i].iterations,
+			params->veracrypt_pim && tcrypt_kdf[i].veracrypt ? "-PIM" : "");
+		if (kk->keys) {
+			r = kk->r[i];
+			memcpy(key, kk->keys + i * TCRYPT_HDR_KEY_LEN, TCRYPT_HDR_KEY_LEN);
+		} else
+			r = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
+					kk->pwd, kk->pwd_len,
+					hdr->salt, TCRYPT_HDR_SALT_LEN,
+					key, TCRYPT_HDR_KEY_LEN,
+					iterations, 0, 0);
+		if (r < 0) {
+			log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
+				      tcrypt_kdf[i].hash);
+			skipped++;
+			r = -EPERM;
+			continue;
+		}
+
+		/* Decrypt header */
+		r = TCRYPT_decrypt_hdr(cd, hdr, key, params);
+		if (r == -ENOENT) {
+			skipped++;
+			r = -EPERM;
+			continue;
+		}
+		if (r != -EPERM)
+			break;
+	}
+
+	if ((r < 0 && skipped && skipped == i) || r == -ENOTSUP) {
+		log_err(cd, _("Required kernel crypto interface not available."));
+#ifdef ENABLE_AF_ALG
+		log_err(cd, _("Ensure you have algif_skcipher kernel module loaded."));
+#endif
+		r = -ENOTSUP;
+	}
+
+	*kdf = i;
+	return r;
+}
+
+/*
+ * All candidate headers are already read, the keyfile pool is computed once
+ * and header keys derived for one salt are reused for every candidate with
+ * the same salt (KDF input is only the passphrase pool and the salt).
+ */
 static int TCRYPT_init_hdr(struct crypt_device *cd,
-			   struct tcrypt_phdr *hdr,
-			   struct crypt_params_tcrypt *params)
+			   struct tcrypt_phdr *hdrs, unsigned int count,
+			   struct crypt_params_tcrypt *params,
+			   struct tcrypt_phdr *hdr)
 {
+	struct tcrypt_kdf_keys kk = {};
 	unsigned char pwd[VCRYPT_KEY_POOL_LEN] = {};
 	size_t passphrase_size, max_passphrase_size;
 	char *key;
-	unsigned int i, skipped = 0, iterations;
-	int r = -EPERM, keyfiles_pool_length;
+	unsigned int c, i, kdf = 0;
+	int r = -EPERM, r_derive = -EINVAL, keyfiles_pool_length;
 
 	if (posix_memalign((void*)&key, crypt_getpagesize(), TCRYPT_HDR_KEY_LEN))
 		return -ENOMEM;
@@ -571,65 +756,36 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	for (i = 0; i < params->passphrase_size; i++)
 		pwd[i] += params->passphrase[i];
 
-	for (i = 0; tcrypt_kdf[i].name; i++) {
-		if (params->hash_name && strcmp(params->hash_name, tcrypt_kdf[i].hash))
-			continue;
-		if (!(params->flags & CRYPT_TCRYPT_LEGACY_MODES) && tcrypt_kdf[i].legacy)
-			continue;
-		if (!(params->flags & CRYPT_TCRYPT_VERA_MODES) && tcrypt_kdf[i].veracrypt)
-			continue;
-		if ((params->flags & CRYPT_TCRYPT_VERA_MODES) && params->veracrypt_pim) {
-			/* Do not try TrueCrypt modes if we have PIM value */
-			if (!tcrypt_kdf[i].veracrypt)
-				continue;
-			/* adjust iterations to given PIM cmdline parameter */
-			iterations = tcrypt_kdf[i].veracrypt_pim_const +
-				    (tcrypt_kdf[i].veracrypt_pim_mult * params->veracrypt_pim);
-		} else
-			iterations = tcrypt_kdf[i].iterations;
-		/* Derive header key */
-		log_dbg(cd, "TCRYPT: trying KDF: %s-%s-%d%s.",
-			tcrypt_kdf[i].name, tcrypt_kdf[i].hash, tcrypt_kdf[i].iterations,
-			params->veracrypt_pim && tcrypt_kdf[i].veracrypt ? "-PIM" : "");
-		r = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
-				(char*)pwd, passphrase_size,
-				hdr->salt, TCRYPT_HDR_SALT_LEN,
-				key, TCRYPT_HDR_KEY_LEN,
-				iterations, 0, 0);
-		if (r < 0) {
-			log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
-				      tcrypt_kdf[i].hash);
-			skipped++;
-			r = -EPERM;
-			continue;
-		}
-
-		/* Decrypt header */
-		r = TCRYPT_decrypt_hdr(cd, hdr, key, params);
-		if (r == -ENOENT) {
-			skipped++;
-			r = -EPERM;
-			continue;
-		}
-		if (r != -EPERM)
+	kk.pwd = (char*)pwd;
+	kk.pwd_len = passphrase_size;
+
+	for (c = 0; c < count; c++) {
+		/* Decryption of candidate is in-place, compare salt with its own copy */
+		if (!kk.salt || memcmp(kk.salt, hdrs[c].salt, TCRYPT_HDR_SALT_LEN)) {
+			crypt_safe_free(kk.keys);
+			kk.keys = NULL;
+			kk.count = 0;
+			kk.salt = hdrs[c].salt;
+			r_derive = TCRYPT_derive_keys(cd, params, &kk);
+			if (r_derive < 0)
+				log_dbg(cd, "TCRYPT: deriving header keys serially.");
+		} else if (kk.keys)
+			log_dbg(cd, "TCRYPT: reusing header keys derived for the same salt.");
+
+		r = TCRYPT_try_hdr(cd, &hdrs[c], params, &kk, key, &kdf);
+		if (r >= 0)
 			break;
 	}
 
-	if ((r < 0 && skipped && skipped == i) || r == -ENOTSUP) {
-		log_err(cd, _("Required kernel crypto interface not available."));
-#ifdef ENABLE_AF_ALG
-		log_err(cd, _("Ensure you have algif_skcipher kernel module loaded."));
-#endif
-		r = -ENOTSUP;
-	}
 	if (r < 0)
 		goto out;
 
-	r = TCRYPT_hdr_from_disk(cd, hdr, params, i, r);
+	memcpy(hdr, &hdrs[c], sizeof(*hdr));
+	r = TCRYPT_hdr_from_disk(cd, hdr, params, kdf, r);
 	if (!r) {
 		log_dbg(cd, "TCRYPT: Magic: %s, Header version: %d, req. %d, sector %d"
 			", mk_offset %" PRIu64 ", hidden_size %" PRIu64
-			", volume size %" PRIu64, tcrypt_kdf[i].veracrypt ?
+			", volume size %" PRIu64, tcrypt_kdf[kdf].veracrypt ?
 			VCRYPT_HDR_MAGIC : TCRYPT_HDR_MAGIC,
 			(int)hdr->d.version, (int)hdr->d.version_tc, (int)hdr->d.sector_size,
 			hdr->d.mk_offset, hdr->d.hidden_volume_size, hdr->d.volume_size);
@@ -637,6 +793,7 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 			params->cipher, params->mode, params->key_size);
 	}
 out:
+	crypt_safe_free(kk.keys);
 	crypt_safe_memzero(pwd, TCRYPT_KEY_POOL_LEN);
 	if (key)
 		crypt_safe_memzero(key, TCRYPT_HDR_KEY_LEN);
@@ -644,12 +801,18 @@ out:
 	return r;
 }
 
+/* At most two header locations are probed (hidden volume header) */
+#define TCRYPT_HDR_CANDIDATES 2
+
 int TCRYPT_read_phdr(struct crypt_device *cd,
 		     struct tcrypt_phdr *hdr,
 		     struct crypt_params_tcrypt *params)
 {
 	struct device *base_device = NULL, *device = crypt_metadata_device(cd);
+	struct tcrypt_phdr hdrs[TCRYPT_HDR_CANDIDATES];
+	off_t offsets[TCRYPT_HDR_CANDIDATES];
 	ssize_t hdr_size = sizeof(struct tcrypt_phdr);
+	unsigned int i, count = 0, read = 0;
 	char *base_device_path;
 	int devfd, r;
 
@@ -680,38 +843,31 @@ int TCRYPT_read_phdr(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
-	r = -EIO;
-	if (params->flags & CRYPT_TCRYPT_SYSTEM_HEADER) {
-		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-			device_alignment(device), hdr, hdr_size,
-			TCRYPT_HDR_SYSTEM_OFFSET) == hdr_size) {
-			r = TCRYPT_init_hdr(cd, hdr, params);
-		}
-	} else if (params->flags & CRYPT_TCRYPT_HIDDEN_HEADER) {
-		if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER) {
-			if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				device_alignment(device), hdr, hdr_size,
-				TCRYPT_HDR_HIDDEN_OFFSET_BCK) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
-		} else {
-			if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-				device_alignment(device), hdr, hdr_size,
-				TCRYPT_HDR_HIDDEN_OFFSET) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
-			if (r && read_lseek_blockwise(devfd, device_block_size(cd, device),
-				device_alignment(device), hdr, hdr_size,
-				TCRYPT_HDR_HIDDEN_OFFSET_OLD) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
+	if (params->flags & CRYPT_TCRYPT_SYSTEM_HEADER)
+		offsets[count++] = TCRYPT_HDR_SYSTEM_OFFSET;
+	else if (params->flags & CRYPT_TCRYPT_HIDDEN_HEADER) {
+		if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER)
+			offsets[count++] = TCRYPT_HDR_HIDDEN_OFFSET_BCK;
+		else {
+			offsets[count++] = TCRYPT_HDR_HIDDEN_OFFSET;
+			offsets[count++] = TCRYPT_HDR_HIDDEN_OFFSET_OLD;
 		}
-	} else if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER) {
-		if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-			device_alignment(device), hdr, hdr_size,
-			TCRYPT_HDR_OFFSET_BCK) == hdr_size)
-			r = TCRYPT_init_hdr(cd, hdr, params);
-	} else if (read_lseek_blockwise(devfd, device_block_size(cd, device),
-			device_alignment(device), hdr, hdr_size, 0) == hdr_size)
-		r = TCRYPT_init_hdr(cd, hdr, params);
+	} else if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER)
+		offsets[count++] = TCRYPT_HDR_OFFSET_BCK;
+	else
+		offsets[count++] = 0;
+
+	/* Read all candidate locations before any (expensive) key derivation */
+	for (i = 0; i < count; i++)
+		if (device_read_probe(cd, base_device ?: device, devfd, &hdrs[read], hdr_size,
+				      offsets[i]) == hdr_size)
+			read++;
+
+	r = -EIO;
+	if (read)
+		r = TCRYPT_init_hdr(cd, hdrs, read, params, hdr);
 
+	crypt_safe_memzero(hdrs, sizeof(hdrs));
 	device_free(cd, base_device);
 	if (r < 0)
 		memset(hdr, 0, sizeof (*hdr));
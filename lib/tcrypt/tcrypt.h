@@ -27,6 +27,7 @@
 #define TCRYPT_HDR_SALT_LEN 64
 #define TCRYPT_HDR_IV_LEN   16
 #define TCRYPT_HDR_LEN     448
+#define TCRYPT_HDR_PROBE_LEN 16
 #define TCRYPT_HDR_KEY_LEN 192
 #define TCRYPT_HDR_MAGIC "TRUE"
 #define VCRYPT_HDR_MAGIC "VERA"
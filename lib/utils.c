@@ -23,6 +23,9 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -36,16 +39,169 @@ size_t crypt_getpagesize(void)
 	return r <= 0 ? DEFAULT_MEM_ALIGNMENT : (size_t)r;
 }
 
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* Path of the process cgroup v2 (unified hierarchy), relative to CGROUP_ROOT */
+static bool cgroup_path(char *path, size_t size)
+{
+	char buf[4096], *p, *end;
+	ssize_t len;
+	int fd;
+
+	if ((fd = open("/proc/self/cgroup", O_RDONLY)) < 0)
+		return false;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 1)
+		return false;
+	buf[len] = 0;
+
+	if (!strncmp(buf, "0::", 3))
+		p = buf + 3;
+	else if ((p = strstr(buf, "\n0::")))
+		p += 4;
+	else
+		return false;
+
+	if ((end = strchr(p, '\n')))
+		*end = 0;
+
+	/* root cgroup is represented by empty path */
+	if (!strcmp(p, "/"))
+		*p = 0;
+
+	return snprintf(path, size, "%s", p) < (int)size;
+}
+
+static bool cgroup_read(const char *cgroup, const char *file, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	if (snprintf(path, sizeof(path), CGROUP_ROOT "%s/%s", cgroup, file) >= (int)sizeof(path))
+		return false;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return false;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 1)
+		return false;
+	buf[len] = 0;
+
+	return true;
+}
+
+/* Strip last cgroup path component, false if already at root */
+static bool cgroup_parent(char *cgroup)
+{
+	char *p = strrchr(cgroup, '/');
+
+	if (!p)
+		return false;
+
+	*p = 0;
+	return true;
+}
+
+/*
+ * Effective CPU limit from cgroup v2 cpu.max quota (rounded up) of the
+ * process cgroup and all its ancestors, 0 if not limited.
+ */
+static unsigned cgroup_cpu_limit(void)
+{
+	char cgroup[PATH_MAX], buf[64];
+	uint64_t quota, period;
+	unsigned cpus, limit = 0;
+
+	if (!cgroup_path(cgroup, sizeof(cgroup)))
+		return 0;
+
+	do {
+		if (cgroup_read(cgroup, "cpu.max", buf, sizeof(buf)) &&
+		    sscanf(buf, "%" PRIu64 " %" PRIu64, &quota, &period) == 2 && period) {
+			cpus = (unsigned)((quota + period - 1) / period) ?: 1;
+			if (!limit || cpus < limit)
+				limit = cpus;
+		}
+	} while (cgroup_parent(cgroup));
+
+	return limit;
+}
+
+/*
+ * Effective memory limit (and free memory below that limit) from cgroup v2
+ * memory.max and memory.current of the process cgroup and all its ancestors.
+ */
+static bool cgroup_memory_limit(uint64_t *limit_kb, uint64_t *free_kb)
+{
+	char cgroup[PATH_MAX], buf[64];
+	uint64_t max, current, limit = UINT64_MAX, free = UINT64_MAX;
+
+	if (!cgroup_path(cgroup, sizeof(cgroup)))
+		return false;
+
+	do {
+		if (!cgroup_read(cgroup, "memory.max", buf, sizeof(buf)) ||
+		    sscanf(buf, "%" PRIu64, &max) != 1)
+			continue;
+
+		max /= 1024;
+		if (max < limit)
+			limit = max;
+
+		if (cgroup_read(cgroup, "memory.current", buf, sizeof(buf)) &&
+		    sscanf(buf, "%" PRIu64, &current) == 1) {
+			current /= 1024;
+			current = current < max ? max - current : 0;
+			if (current < free)
+				free = current;
+		}
+	} while (cgroup_parent(cgroup));
+
+	if (limit == UINT64_MAX)
+		return false;
+
+	if (limit_kb)
+		*limit_kb = limit;
+	if (free_kb)
+		*free_kb = free == UINT64_MAX ? limit : free;
+
+	return true;
+}
+
+/*
+ * Usable CPUs, limited by the process affinity mask (cpuset)
+ * and by cgroup v2 CPU bandwidth quota.
+ */
 unsigned crypt_cpusonline(void)
 {
 	long r = sysconf(_SC_NPROCESSORS_ONLN);
-	return r < 0 ? 1 : r;
+	unsigned cpus = r < 0 ? 1 : r, limit;
+#ifdef CPU_COUNT
+	cpu_set_t set;
+
+	if (!sched_getaffinity(0, sizeof(set), &set)) {
+		limit = CPU_COUNT(&set);
+		if (limit && limit < cpus)
+			cpus = limit;
+	}
+#endif
+	limit = cgroup_cpu_limit();
+	if (limit && limit < cpus)
+		cpus = limit;
+
+	return cpus;
 }
 
+/* Physical memory, limited by cgroup v2 memory.max */
 uint64_t crypt_getphysmemory_kb(void)
 {
 	long pagesize, phys_pages;
-	uint64_t phys_memory_kb;
+	uint64_t phys_memory_kb, limit_kb;
 
 	pagesize = sysconf(_SC_PAGESIZE);
 	phys_pages = sysconf(_SC_PHYS_PAGES);
@@ -56,13 +212,17 @@ uint64_t crypt_getphysmemory_kb(void)
 	phys_memory_kb = pagesize / 1024;
 	phys_memory_kb *= phys_pages;
 
+	if (cgroup_memory_limit(&limit_kb, NULL) && limit_kb < phys_memory_kb)
+		phys_memory_kb = limit_kb;
+
 	return phys_memory_kb;
 }
 
+/* Free physical memory, limited by free space below cgroup v2 memory.max */
 uint64_t crypt_getphysmemoryfree_kb(void)
 {
 	long pagesize, phys_pages;
-	uint64_t phys_memoryfree_kb;
+	uint64_t phys_memoryfree_kb, free_kb;
 
 	pagesize = sysconf(_SC_PAGESIZE);
 	phys_pages = sysconf(_SC_AVPHYS_PAGES);
@@ -73,6 +233,9 @@ uint64_t crypt_getphysmemoryfree_kb(void)
 	phys_memoryfree_kb = pagesize / 1024;
 	phys_memoryfree_kb *= phys_pages;
 
+	if (cgroup_memory_limit(NULL, &free_kb) && free_kb < phys_memoryfree_kb)
+		phys_memoryfree_kb = free_kb;
+
 	return phys_memoryfree_kb;
 }
 
@@ -137,6 +300,45 @@ void crypt_process_priority(struct crypt_device *cd, int *priority, bool raise)
 
 /* Keyfile processing */
 
+#if HAVE_SPLICE
+/*
+ * Discard data from pipe inside kernel, it is never copied to userspace.
+ * Returns 1 on EOF, 0 if done or if the rest must be read (splice not possible).
+ */
+static int keyfile_splice(int fd, uint64_t *bytes)
+{
+	ssize_t bytes_r;
+	int devnull, r = 0;
+
+	devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (devnull < 0)
+		return 0;
+
+	while (*bytes > 0) {
+		bytes_r = splice(fd, NULL, devnull, NULL,
+				 *bytes > (1024 * 1024) ? (1024 * 1024) : (size_t)*bytes,
+				 SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (bytes_r < 0) {
+			if (errno == EINTR)
+				continue;
+			/* e.g. input is not a pipe, fallback to read */
+			break;
+		}
+
+		if (bytes_r == 0) {
+			/* EOF */
+			r = 1;
+			break;
+		}
+
+		*bytes -= bytes_r;
+	}
+
+	close(devnull);
+	return r;
+}
+#endif
+
 /*
  * A simple call to lseek(3) might not be possible for some inputs (e.g.
  * reading from a pipe), so this function instead reads of up to BUFSIZ bytes
@@ -157,6 +359,11 @@ static int keyfile_seek(int fd, uint64_t bytes)
 	if (r < 0 && errno != ESPIPE)
 		return -1;
 
+#if HAVE_SPLICE
+	if (keyfile_splice(fd, &bytes))
+		return -1;
+#endif
+
 	while (bytes > 0) {
 		/* figure out how much to read */
 		next_read = bytes > sizeof(tmp) ? sizeof(tmp) : (size_t)bytes;
@@ -189,7 +396,7 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 {
 	int fd, regular_file, char_to_read = 0, char_read = 0, unlimited_read = 0;
 	int r = -EINVAL, newline;
-	char *pass = NULL;
+	char *pass = NULL, *eol;
 	size_t buflen, i;
 	uint64_t file_read_size;
 	struct stat st;
@@ -236,11 +443,14 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			}
 			file_read_size -= keyfile_offset;
 
-			/* known keyfile size, alloc it in one step */
+			/*
+			 * Known keyfile size, alloc it in one step
+			 * (one more byte so that EOF is read without realloc).
+			 */
 			if (file_read_size >= (uint64_t)key_size)
 				buflen = key_size;
 			else if (file_read_size)
-				buflen = file_read_size;
+				buflen = file_read_size + unlimited_read;
 		}
 	}
 
@@ -250,8 +460,8 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 		goto out;
 	}
 
-	/* Discard keyfile_offset bytes on input */
-	if (keyfile_offset && keyfile_seek(fd, keyfile_offset) < 0) {
+	/* Discard keyfile_offset bytes on input, regular file is read by offset */
+	if (!regular_file && keyfile_offset && keyfile_seek(fd, keyfile_offset) < 0) {
 		log_err(cd, _("Cannot seek to requested keyfile offset."));
 		goto out;
 	}
@@ -267,11 +477,12 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			}
 		}
 
-		if (flags & CRYPT_KEYFILE_STOP_EOL) {
+		if ((flags & CRYPT_KEYFILE_STOP_EOL) && !regular_file) {
 			/* If we should stop on newline, we must read the input
 			 * one character at the time. Otherwise we might end up
 			 * having read some bytes after the newline, which we
-			 * promised not to do.
+			 * promised not to do. Regular file is not shared,
+			 * it can be read in one step and searched for newline.
 			 */
 			char_to_read = 1;
 		} else {
@@ -279,7 +490,10 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			char_to_read = key_size < buflen ?
 				key_size - i : buflen - i;
 		}
-		char_read = read_buffer(fd, &pass[i], char_to_read);
+		if (regular_file)
+			char_read = read_buffer_offset(fd, &pass[i], char_to_read, (off_t)(keyfile_offset + i));
+		else
+			char_read = read_buffer(fd, &pass[i], char_to_read);
 		if (char_read < 0) {
 			log_err(cd, _("Error reading passphrase."));
 			r = -EPIPE;
@@ -289,9 +503,11 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 		if (char_read == 0)
 			break;
 		/* Stop on newline only if not requested read from keyfile */
-		if ((flags & CRYPT_KEYFILE_STOP_EOL) && pass[i] == '\n') {
+		if ((flags & CRYPT_KEYFILE_STOP_EOL) &&
+		    (eol = memchr(&pass[i], '\n', char_read))) {
 			newline = 1;
-			pass[i] = '\0';
+			crypt_safe_memzero(eol, char_read - (eol - &pass[i]));
+			i = eol - pass;
 			break;
 		}
 	}
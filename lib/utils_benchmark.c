@@ -19,10 +19,21 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "internal.h"
+#include "integrity/integrity.h"
+#include "utils_threadpool.h"
+#include "utils_bufpool.h"
+
+/* Maximal number of per-request times stored per thread for percentiles */
+#define BENCHMARK_MAX_SAMPLES 65536
 
 int crypt_benchmark(struct crypt_device *cd,
 	const char *cipher,
@@ -45,7 +56,8 @@ int crypt_benchmark(struct crypt_device *cd,
 		return r;
 
 	r = -ENOMEM;
-	if (posix_memalign(&buffer, crypt_getpagesize(), buffer_size))
+	buffer = crypt_buffer_get(cd, buffer_size, crypt_getpagesize(), 0);
+	if (!buffer)
 		goto out;
 	memset(buffer, 0, buffer_size);
 
@@ -82,13 +94,637 @@ int crypt_benchmark(struct crypt_device *cd,
 		log_dbg(cd, "Cannot initialize cipher %s, mode %s, key size %zu, IV size %zu.",
 			cipher, cipher_mode, volume_key_size, iv_size);
 out:
-	free(buffer);
+	crypt_buffer_put(cd, buffer, buffer_size, 0);
 	free(key);
 	free(iv);
 
 	return r;
 }
 
+struct benchmark_thread {
+	char *buffer;
+	double *op_ms;
+	size_t ops;
+	double ms;
+};
+
+struct benchmark_run {
+	const char *cipher;
+	const char *mode;
+	const char *key;
+	size_t key_size;
+	const char *iv;
+	size_t iv_size;
+	const char *iv_name;
+	const char *integrity;
+	size_t auth_key_size;
+	size_t tag_size;
+	size_t sector_size;
+	size_t buffer_size;
+	double time_ms;
+	int encrypt;
+	struct benchmark_thread *t;
+};
+
+static int benchmark_job(void *arg, unsigned int job)
+{
+	struct benchmark_run *run = arg;
+	struct benchmark_thread *t = &run->t[job];
+
+	if (run->integrity)
+		return crypt_aead_perf_sectors_kernel(run->cipher, run->mode, run->integrity,
+				run->buffer_size, run->sector_size, run->key, run->key_size,
+				run->auth_key_size, run->iv_size, run->tag_size, run->encrypt,
+				run->time_ms, t->op_ms, BENCHMARK_MAX_SAMPLES, &t->ops, &t->ms);
+
+	return crypt_cipher_perf_sectors_kernel(run->cipher, run->mode, t->buffer, run->buffer_size,
+			run->sector_size, run->key, run->key_size, run->iv, run->iv_size,
+			run->iv_name, run->encrypt, run->time_ms, t->op_ms, BENCHMARK_MAX_SAMPLES,
+			&t->ops, &t->ms);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Median and 99th percentile of per-request times stored by all threads */
+static int benchmark_percentiles(struct benchmark_thread *t, unsigned int threads,
+				 double *p50_us, double *p99_us)
+{
+	double *samples;
+	size_t i, n, count = 0;
+	unsigned int j;
+
+	for (j = 0; j < threads; j++)
+		count += t[j].ops < BENCHMARK_MAX_SAMPLES ? t[j].ops : BENCHMARK_MAX_SAMPLES;
+
+	samples = malloc(count * sizeof(*samples));
+	if (!samples)
+		return -ENOMEM;
+
+	for (j = 0, i = 0; j < threads; j++) {
+		n = t[j].ops < BENCHMARK_MAX_SAMPLES ? t[j].ops : BENCHMARK_MAX_SAMPLES;
+		memcpy(&samples[i], t[j].op_ms, n * sizeof(*samples));
+		i += n;
+	}
+
+	qsort(samples, count, sizeof(*samples), cmp_double);
+
+	*p50_us = samples[(count - 1) * 50 / 100] * 1000.;
+	*p99_us = samples[(count - 1) * 99 / 100] * 1000.;
+
+	free(samples);
+	return 0;
+}
+
+static int benchmark_measure(struct crypt_threadpool *tp, struct benchmark_run *run,
+			     unsigned int threads, double *mbs, double *p50_us, double *p99_us)
+{
+	double speed = 0.0;
+	unsigned int j;
+	int r;
+
+	r = crypt_threadpool_run(tp, threads, benchmark_job, run);
+	if (r < 0)
+		return r;
+
+	for (j = 0; j < threads; j++) {
+		if (!run->t[j].ops)
+			return -ERANGE;
+		speed += (double)run->t[j].ops * run->buffer_size / (1024 * 1024) / (run->t[j].ms / 1000.);
+	}
+
+	r = benchmark_percentiles(run->t, threads, p50_us, p99_us);
+	if (!r)
+		*mbs = speed;
+
+	return r;
+}
+
+/* Measure both directions of prepared run in threads, buffers are allocated here */
+static int benchmark_threads(struct crypt_device *cd, struct benchmark_run *run,
+			     unsigned int threads, struct crypt_benchmark_result *result)
+{
+	struct crypt_threadpool *tp = NULL;
+	struct benchmark_thread *t;
+	unsigned int i;
+	int r = -ENOMEM;
+
+	t = calloc(threads, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	for (i = 0; i < threads; i++) {
+		/* AEAD run allocates its own sector records */
+		if (!run->integrity) {
+			if (posix_memalign((void **)&t[i].buffer, crypt_getpagesize(), run->buffer_size))
+				goto out;
+			memset(t[i].buffer, 0, run->buffer_size);
+		}
+		t[i].op_ms = malloc(BENCHMARK_MAX_SAMPLES * sizeof(*t[i].op_ms));
+		if (!t[i].op_ms)
+			goto out;
+	}
+
+	r = crypt_threadpool_init(cd, &tp, threads);
+	if (r < 0)
+		goto out;
+
+	if (crypt_threadpool_threads(tp) < threads) {
+		log_dbg(cd, "Cannot start %u benchmark threads.", threads);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	run->t = t;
+	run->encrypt = 1;
+	r = benchmark_measure(tp, run, threads, &result->encryption_mbs,
+			      &result->encryption_p50_us, &result->encryption_p99_us);
+	if (!r) {
+		run->encrypt = 0;
+		r = benchmark_measure(tp, run, threads, &result->decryption_mbs,
+				      &result->decryption_p50_us, &result->decryption_p99_us);
+	}
+	run->t = NULL;
+out:
+	crypt_threadpool_destroy(tp);
+	for (i = 0; i < threads; i++) {
+		free(t[i].buffer);
+		free(t[i].op_ms);
+	}
+	free(t);
+
+	return r;
+}
+
+int crypt_benchmark_cipher(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t iv_size,
+	const struct crypt_params_benchmark *params,
+	struct crypt_benchmark_result *result)
+{
+	struct benchmark_run run = {};
+	char *iv = NULL, *key = NULL, mode[MAX_CIPHER_LEN], *c;
+	unsigned int threads;
+	int r;
+
+	if (!cipher || !cipher_mode || !volume_key_size || !result)
+		return -EINVAL;
+
+	threads = params && params->threads ? params->threads : 1;
+	run.sector_size = params && params->sector_size ? params->sector_size : SECTOR_SIZE;
+	run.buffer_size = params && params->buffer_size ? params->buffer_size : 65536;
+	run.time_ms = params && params->time_ms ? params->time_ms : 1000;
+
+	if (threads > CRYPT_MAX_THREADS || run.sector_size < SECTOR_SIZE ||
+	    run.sector_size > MAX_SECTOR_SIZE || NOTPOW2(run.sector_size) ||
+	    run.buffer_size % run.sector_size)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	r = crypt_cipher_ivsize(cipher, cipher_mode);
+	if (r >= 0 && iv_size != (size_t)r) {
+		log_dbg(cd, "IV length for benchmark adjusted to %i bytes (requested %zu).", r, iv_size);
+		iv_size = r;
+	}
+
+	r = -ENOMEM;
+	if (iv_size) {
+		iv = malloc(iv_size);
+		if (!iv)
+			goto out;
+		crypt_random_get(cd, iv, iv_size, CRYPT_RND_NORMAL);
+	}
+
+	key = malloc(volume_key_size);
+	if (!key)
+		goto out;
+
+	crypt_random_get(cd, key, volume_key_size, CRYPT_RND_NORMAL);
+
+	strncpy(mode, cipher_mode, sizeof(mode)-1);
+	mode[sizeof(mode)-1] = '\0';
+	/* IV generator is emulated per sector */
+	if ((c  = strchr(mode, '-'))) {
+		*c = '\0';
+		run.iv_name = c + 1;
+	}
+
+	run.cipher = cipher;
+	run.mode = mode;
+	run.key = key;
+	run.key_size = volume_key_size;
+	run.iv = iv;
+	run.iv_size = iv_size;
+
+	log_dbg(cd, "Running %s-%s benchmark, IV %s, %u threads, sector size %zu, request size %zu.",
+		cipher, mode, run.iv_name ?: "fixed", threads, run.sector_size, run.buffer_size);
+
+	r = benchmark_threads(cd, &run, threads, result);
+
+	if (r == -ERANGE)
+		log_dbg(cd, "Measured cipher runtime is too low.");
+	else if (r)
+		log_dbg(cd, "Cannot initialize cipher %s, mode %s, key size %zu, IV size %zu.",
+			cipher, cipher_mode, volume_key_size, iv_size);
+out:
+	free(key);
+	free(iv);
+
+	return r;
+}
+
+/* IV size of kernel AEAD transformation dm-crypt uses for the mode */
+static int benchmark_aead_iv_size(const char *cipher, const char *mode, const char *integrity)
+{
+	if (!strcmp(integrity, "poly1305") || !strcmp(mode, "gcm"))
+		return 12;
+	if (!strcmp(mode, "ccm"))
+		return 8;
+	if (!*mode && !strcmp(cipher, "aegis256"))
+		return 32;
+	if (!*mode && !strcmp(cipher, "aegis128"))
+		return 16;
+	if (!*mode)
+		return -EINVAL;
+
+	/* authenc() uses IV of the underlying cipher */
+	return crypt_cipher_ivsize(cipher, mode);
+}
+
+int crypt_benchmark_aead(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *integrity,
+	size_t volume_key_size,
+	const struct crypt_params_benchmark *params,
+	struct crypt_benchmark_aead_result *result)
+{
+	struct crypt_benchmark_result res = {};
+	struct benchmark_run run = {};
+	char *key = NULL, mode[MAX_CIPHER_LEN], *c;
+	int r, auth_key_size, auth_tag_size, tag_size, iv_size;
+	unsigned int threads;
+	double data_ratio;
+
+	if (!cipher || !cipher_mode || !integrity || !strcmp(integrity, "none") ||
+	    !volume_key_size || !result)
+		return -EINVAL;
+
+	threads = params && params->threads ? params->threads : 1;
+	run.sector_size = params && params->sector_size ? params->sector_size : SECTOR_SIZE;
+	run.buffer_size = params && params->buffer_size ? params->buffer_size : 65536;
+	run.time_ms = params && params->time_ms ? params->time_ms : 1000;
+
+	if (threads > CRYPT_MAX_THREADS || run.sector_size < SECTOR_SIZE ||
+	    run.sector_size > MAX_SECTOR_SIZE || NOTPOW2(run.sector_size) ||
+	    run.buffer_size % run.sector_size)
+		return -EINVAL;
+
+	auth_key_size = INTEGRITY_key_size(integrity);
+	auth_tag_size = INTEGRITY_tag_size(integrity, cipher, NULL);
+	tag_size = INTEGRITY_tag_size(integrity, cipher, cipher_mode);
+	if (auth_key_size < 0 || (size_t)auth_key_size >= volume_key_size ||
+	    auth_tag_size <= 0 || tag_size < auth_tag_size)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	strncpy(mode, cipher_mode, sizeof(mode)-1);
+	mode[sizeof(mode)-1] = '\0';
+	/* IV is stored in tag (random) or generated, AEAD itself works without IV generator */
+	if ((c = strchr(mode, '-')))
+		*c = '\0';
+	else if (!strcmp(mode, "random"))
+		*mode = '\0';
+
+	iv_size = benchmark_aead_iv_size(cipher, mode, integrity);
+	if (iv_size <= 0)
+		return -EINVAL;
+
+	key = malloc(volume_key_size);
+	if (!key)
+		return -ENOMEM;
+	crypt_random_get(cd, key, volume_key_size, CRYPT_RND_NORMAL);
+
+	run.cipher = cipher;
+	run.mode = mode;
+	run.integrity = integrity;
+	run.key = key;
+	run.key_size = volume_key_size;
+	run.auth_key_size = auth_key_size;
+	run.iv_size = iv_size;
+	run.tag_size = auth_tag_size;
+
+	log_dbg(cd, "Running %s-%s (%s) AEAD benchmark, %u threads, sector size %zu, "
+		"request size %zu, tag size %i.", cipher, cipher_mode, integrity, threads,
+		run.sector_size, run.buffer_size, tag_size);
+
+	r = benchmark_threads(cd, &run, threads, &res);
+
+	if (r == -ERANGE)
+		log_dbg(cd, "Measured cipher runtime is too low.");
+	else if (r)
+		log_dbg(cd, "Cannot initialize AEAD cipher %s, mode %s, integrity %s, key size %zu.",
+			cipher, cipher_mode, integrity, volume_key_size);
+
+	free(key);
+	if (r)
+		return r;
+
+	/* dm-integrity stores tag_size bytes of metadata for every sector of data */
+	data_ratio = (double)run.sector_size / (run.sector_size + tag_size);
+
+	result->encryption_mbs = res.encryption_mbs;
+	result->decryption_mbs = res.decryption_mbs;
+	result->encryption_p99_us = res.encryption_p99_us;
+	result->decryption_p99_us = res.decryption_p99_us;
+	result->tag_size = tag_size;
+	result->write_mbs = res.encryption_mbs * data_ratio;
+	result->read_mbs = res.decryption_mbs * data_ratio;
+
+	return 0;
+}
+
+/* dm-crypt options that can be compared in stack benchmark */
+#define BENCHMARK_STACK_FLAGS (CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS | \
+			       CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE | \
+			       CRYPT_ACTIVATE_HIGH_PRIORITY | CRYPT_ACTIVATE_IV_LARGE_SECTORS)
+
+struct benchmark_io_run {
+	char path[PATH_MAX];
+	size_t block_size;
+	uint64_t blocks;
+	double time_ms;
+	unsigned int jobs;
+	bool random;
+	bool write;
+	struct benchmark_thread *t;
+};
+
+static double benchmark_now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+/* One synchronous direct I/O stream, queue depth is the number of parallel jobs */
+static int benchmark_io_job(void *arg, unsigned int job)
+{
+	struct benchmark_io_run *run = arg;
+	struct benchmark_thread *t = &run->t[job];
+	uint64_t block, seed = job + 1;
+	double start, op_start, now;
+	ssize_t len;
+	int fd, r = 0;
+
+	fd = open(run->path, (run->write ? O_WRONLY : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	/* Sequential streams start in different parts of the device */
+	block = run->blocks * job / run->jobs;
+	t->ops = 0;
+	start = now = benchmark_now_ms();
+	while (now - start < run->time_ms) {
+		if (run->random) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			block = seed % run->blocks;
+		} else if (block >= run->blocks)
+			block = 0;
+
+		op_start = now;
+		if (run->write)
+			len = pwrite(fd, t->buffer, run->block_size, block * run->block_size);
+		else
+			len = pread(fd, t->buffer, run->block_size, block * run->block_size);
+		if (len != (ssize_t)run->block_size) {
+			r = len < 0 ? -errno : -EIO;
+			break;
+		}
+		now = benchmark_now_ms();
+
+		if (t->ops < BENCHMARK_MAX_SAMPLES)
+			t->op_ms[t->ops] = now - op_start;
+		t->ops++;
+		block++;
+	}
+	t->ms = now - start;
+
+	close(fd);
+	return r;
+}
+
+static int benchmark_io_measure(struct crypt_threadpool *tp, struct benchmark_io_run *run,
+				double *iops, double *mbs, double *p50_us, double *p99_us)
+{
+	double ops_s = 0.0;
+	unsigned int j;
+	int r;
+
+	r = crypt_threadpool_run(tp, run->jobs, benchmark_io_job, run);
+	if (r < 0)
+		return r;
+
+	for (j = 0; j < run->jobs; j++) {
+		if (!run->t[j].ops || run->t[j].ms <= 0.0)
+			return -ERANGE;
+		ops_s += run->t[j].ops / (run->t[j].ms / 1000.);
+	}
+
+	r = benchmark_percentiles(run->t, run->jobs, p50_us, p99_us);
+	if (!r) {
+		*iops = ops_s;
+		*mbs = ops_s * run->block_size / (1024 * 1024);
+	}
+
+	return r;
+}
+
+static int benchmark_io(struct crypt_device *cd, struct benchmark_io_run *run,
+			struct crypt_benchmark_stack_result *result)
+{
+	struct crypt_threadpool *tp = NULL;
+	struct benchmark_thread *t;
+	unsigned int i;
+	int r = -ENOMEM;
+
+	t = calloc(run->jobs, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	for (i = 0; i < run->jobs; i++) {
+		if (posix_memalign((void **)&t[i].buffer, crypt_getpagesize(), run->block_size))
+			goto out;
+		memset(t[i].buffer, 0, run->block_size);
+		t[i].op_ms = malloc(BENCHMARK_MAX_SAMPLES * sizeof(*t[i].op_ms));
+		if (!t[i].op_ms)
+			goto out;
+	}
+
+	r = crypt_threadpool_init(cd, &tp, run->jobs);
+	if (r < 0)
+		goto out;
+
+	if (crypt_threadpool_threads(tp) < run->jobs) {
+		log_dbg(cd, "Cannot start %u benchmark threads.", run->jobs);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	run->t = t;
+	run->write = true;
+	r = benchmark_io_measure(tp, run, &result->write_iops, &result->write_mbs,
+				 &result->write_p50_us, &result->write_p99_us);
+	if (!r) {
+		run->write = false;
+		r = benchmark_io_measure(tp, run, &result->read_iops, &result->read_mbs,
+					 &result->read_p50_us, &result->read_p99_us);
+	}
+	run->t = NULL;
+out:
+	crypt_threadpool_destroy(tp);
+	for (i = 0; i < run->jobs; i++) {
+		free(t[i].buffer);
+		free(t[i].op_ms);
+	}
+	free(t);
+
+	return r;
+}
+
+int crypt_benchmark_stack(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	const struct crypt_params_benchmark_stack *params,
+	struct crypt_benchmark_stack_result *result)
+{
+	struct crypt_dm_active_device dmd_zero = {
+		.flags = CRYPT_ACTIVATE_PRIVATE,
+	}, dmd_crypt = {
+		.flags = CRYPT_ACTIVATE_PRIVATE,
+	};
+	struct benchmark_io_run run = {};
+	struct device *zero_device = NULL;
+	struct volume_key *vk = NULL;
+	char zero_name[64], crypt_name[64], zero_path[PATH_MAX], cipher_spec[2 * MAX_CIPHER_LEN];
+	bool zero_active = false, crypt_active = false;
+	uint32_t sector_size;
+	uint64_t size;
+	int r;
+
+	if (!result || !cipher != !cipher_mode || (cipher && !volume_key_size))
+		return -EINVAL;
+
+	size = params && params->size ? params->size : (UINT64_C(1) << 30);
+	sector_size = params && params->sector_size ? params->sector_size : SECTOR_SIZE;
+	run.block_size = params && params->block_size ? params->block_size : 4096;
+	run.jobs = params && params->queue_depth ? params->queue_depth : 1;
+	run.time_ms = params && params->time_ms ? params->time_ms : 1000;
+	run.random = params && params->random;
+
+	if (run.jobs > CRYPT_MAX_THREADS || sector_size < SECTOR_SIZE ||
+	    sector_size > MAX_SECTOR_SIZE || NOTPOW2(sector_size) ||
+	    run.block_size % sector_size || MISALIGNED(size, sector_size) ||
+	    (params && (params->flags & ~BENCHMARK_STACK_FLAGS)))
+		return -EINVAL;
+
+	run.blocks = size / run.block_size;
+	if (run.blocks < run.jobs)
+		return -EINVAL;
+
+	if (snprintf(zero_name, sizeof(zero_name), "temporary-cryptsetup-bench-%d", getpid()) < 0 ||
+	    snprintf(crypt_name, sizeof(crypt_name), "temporary-cryptsetup-bench-%d-crypt", getpid()) < 0 ||
+	    snprintf(zero_path, sizeof(zero_path), "%s/%s", dm_get_dir(), zero_name) < 0)
+		return -ENOMEM;
+
+	if (cipher && snprintf(cipher_spec, sizeof(cipher_spec), "%s-%s", cipher, cipher_mode) >= (int)sizeof(cipher_spec))
+		return -EINVAL;
+
+	if (!cd)
+		dm_backend_init(cd);
+
+	/* dm-zero discards writes and reads zeroes, only the DM stack is measured */
+	dmd_zero.size = size / SECTOR_SIZE;
+	r = dm_zero_target_set(&dmd_zero.segment, 0, dmd_zero.size);
+	if (!r)
+		r = dm_create_device(cd, zero_name, "TEMP", &dmd_zero);
+	if (r < 0) {
+		log_dbg(cd, "Cannot create temporary dm-zero device.");
+		goto out;
+	}
+	zero_active = true;
+	strcpy(run.path, zero_path);
+
+	if (cipher) {
+		r = device_alloc(cd, &zero_device, zero_path);
+		if (r < 0)
+			goto out;
+
+		vk = crypt_generate_volume_key(cd, volume_key_size);
+		if (!vk) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		dmd_crypt.size = dmd_zero.size;
+		dmd_crypt.flags |= params ? params->flags : 0;
+		r = dm_crypt_target_set(&dmd_crypt.segment, 0, dmd_crypt.size, zero_device, vk,
+					cipher_spec, 0, 0, NULL, 0, sector_size);
+		if (!r)
+			r = dm_create_device(cd, crypt_name, "TEMP", &dmd_crypt);
+		if (r < 0) {
+			log_dbg(cd, "Cannot create temporary dm-crypt device %s.", cipher_spec);
+			goto out;
+		}
+		crypt_active = true;
+
+		if (snprintf(run.path, sizeof(run.path), "%s/%s", dm_get_dir(), crypt_name) < 0) {
+			r = -ENOMEM;
+			goto out;
+		}
+	}
+
+	log_dbg(cd, "Running %s stack benchmark, %s %zu-byte requests, queue depth %u, sector size %u.",
+		cipher ? cipher_spec : "dm-zero", run.random ? "random" : "sequential",
+		run.block_size, run.jobs, sector_size);
+
+	r = benchmark_io(cd, &run, result);
+	if (r == -ERANGE)
+		log_dbg(cd, "Measured I/O runtime is too low.");
+out:
+	if (crypt_active)
+		dm_remove_device(cd, crypt_name, CRYPT_DEACTIVATE_FORCE);
+	if (zero_active)
+		dm_remove_device(cd, zero_name, CRYPT_DEACTIVATE_FORCE);
+	dm_targets_free(cd, &dmd_crypt);
+	dm_targets_free(cd, &dmd_zero);
+	device_free(cd, zero_device);
+	crypt_free_volume_key(vk);
+
+	if (!cd)
+		dm_backend_exit(cd);
+
+	return r;
+}
+
 int crypt_benchmark_pbkdf(struct crypt_device *cd,
 	struct crypt_pbkdf_type *pbkdf,
 	const char *password,
@@ -132,6 +768,218 @@ struct benchmark_usrptr {
 	struct crypt_pbkdf_type *pbkdf;
 };
 
+/*
+ * Persistent PBKDF benchmark cache, text file with one line per entry:
+ * <type> <hash> <time_ms> <max_memory_kb> <parallel_threads> <key_size> <machine id>
+ * followed by benchmarked <iterations> <memory_kb> <threads>.
+ */
+#define PBKDF_CACHE_MAX_SIZE (64 * 1024)
+#define PBKDF_CACHE_KEY_LEN 256
+
+/* Hash of CPU model, number of online CPUs and crypto backend version */
+static int pbkdf_cache_machine_id(char *id, size_t id_len)
+{
+	struct crypt_hash *h;
+	char line[256], model[256] = "unknown";
+	unsigned char digest[32];
+	FILE *f;
+	size_t i;
+	int r;
+
+	f = fopen("/proc/cpuinfo", "re");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (!strncmp(line, "model name", 10) || !strncmp(line, "CPU part", 8)) {
+				strncpy(model, line, sizeof(model) - 1);
+				break;
+			}
+		fclose(f);
+	}
+
+	if (snprintf(line, sizeof(line), "%u %s", crypt_cpusonline(), crypt_backend_version()) < 0)
+		return -EINVAL;
+
+	if (crypt_hash_init(&h, "sha256"))
+		return -EINVAL;
+	r = crypt_hash_write(h, model, strlen(model));
+	if (!r)
+		r = crypt_hash_write(h, line, strlen(line));
+	if (!r)
+		r = crypt_hash_final(h, (char *)digest, sizeof(digest));
+	crypt_hash_destroy(h);
+	if (r)
+		return -EINVAL;
+
+	for (i = 0; i < 8 && (2 * i + 2) < id_len; i++)
+		sprintf(&id[2 * i], "%02x", digest[i]);
+
+	return 0;
+}
+
+static int pbkdf_cache_key(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+			   char *key, size_t key_len)
+{
+	char id[17] = {};
+	int r;
+
+	if (pbkdf_cache_machine_id(id, sizeof(id)))
+		return -EINVAL;
+
+	r = snprintf(key, key_len, "%s %s %u %u %u %zu %s", pbkdf->type, pbkdf->hash ?: "-",
+		     pbkdf->time_ms, pbkdf->max_memory_kb, pbkdf->parallel_threads,
+		     volume_key_size, id);
+
+	return (r < 0 || (size_t)r >= key_len) ? -EINVAL : 0;
+}
+
+static char *pbkdf_cache_read(struct crypt_device *cd, const char *path)
+{
+	struct stat st;
+	char *buf = NULL;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	/* Cache content decides KDF cost, do not trust a file others can modify. */
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) || st.st_size > PBKDF_CACHE_MAX_SIZE) {
+		log_dbg(cd, "Ignoring PBKDF benchmark cache %s.", path);
+		goto out;
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		goto out;
+
+	len = read_buffer(fd, buf, st.st_size);
+	if (len < 0) {
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	buf[len] = '\0';
+out:
+	close(fd);
+	return buf;
+}
+
+static int pbkdf_cache_lookup(struct crypt_device *cd, const char *key,
+			      struct crypt_pbkdf_type *pbkdf)
+{
+	struct crypt_pbkdf_limits l;
+	char *buf, *line, *save = NULL;
+	size_t key_len = strlen(key);
+	uint32_t iterations, memory, threads;
+	int r = -ENOENT;
+
+	if (crypt_pbkdf_get_limits(pbkdf->type, &l))
+		return -EINVAL;
+
+	buf = pbkdf_cache_read(cd, crypt_get_pbkdf_cache(cd));
+	if (!buf)
+		return -ENOENT;
+
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (strncmp(line, key, key_len) || line[key_len] != ' ')
+			continue;
+		if (sscanf(&line[key_len], " %u %u %u", &iterations, &memory, &threads) != 3)
+			continue;
+		/* never go above requested costs or below limits */
+		if (iterations < l.min_iterations || memory > pbkdf->max_memory_kb ||
+		    threads > pbkdf->parallel_threads)
+			continue;
+		if (strcmp(pbkdf->type, CRYPT_KDF_PBKDF2) && (memory < l.min_memory || threads < l.min_parallel))
+			continue;
+
+		log_dbg(cd, "Using cached PBKDF benchmark values.");
+		pbkdf->iterations = iterations;
+		pbkdf->max_memory_kb = memory;
+		pbkdf->parallel_threads = threads;
+		r = 0;
+		break;
+	}
+
+	free(buf);
+	return r;
+}
+
+static void pbkdf_cache_store(struct crypt_device *cd, const char *key,
+			      const struct crypt_pbkdf_type *pbkdf)
+{
+	const char *path = crypt_get_pbkdf_cache(cd);
+	char *buf, *line, *save = NULL, *tmp = NULL, entry[PBKDF_CACHE_KEY_LEN + 48];
+	size_t key_len = strlen(key);
+	int fd, r;
+
+	r = snprintf(entry, sizeof(entry), "%s %u %u %u\n", key, pbkdf->iterations,
+		     pbkdf->max_memory_kb, pbkdf->parallel_threads);
+	if (r < 0 || (size_t)r >= sizeof(entry))
+		return;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		log_dbg(cd, "Cannot create PBKDF benchmark cache %s.", path);
+		free(tmp);
+		return;
+	}
+
+	/* Copy other entries, replaced entry is written at the end */
+	buf = pbkdf_cache_read(cd, path);
+	for (line = buf ? strtok_r(buf, "\n", &save) : NULL; line && r >= 0;
+	     line = strtok_r(NULL, "\n", &save)) {
+		if (!strncmp(line, key, key_len) && line[key_len] == ' ')
+			continue;
+		if (write_buffer(fd, line, strlen(line)) < 0 || write_buffer(fd, "\n", 1) < 0)
+			r = -EIO;
+	}
+	free(buf);
+
+	if (r >= 0 && write_buffer(fd, entry, strlen(entry)) < 0)
+		r = -EIO;
+	if (close(fd) && r >= 0)
+		r = -EIO;
+
+	if (r < 0 || rename(tmp, path)) {
+		log_dbg(cd, "Cannot write PBKDF benchmark cache %s.", path);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+static int benchmark_pbkdf_cached(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	int (*progress)(uint32_t time_ms, void *usrptr),
+	void *usrptr)
+{
+	char key[PBKDF_CACHE_KEY_LEN];
+	bool cache;
+	int r;
+
+	/* key must describe requested (not benchmarked) costs */
+	cache = crypt_get_pbkdf_cache(cd) && !pbkdf_cache_key(pbkdf, volume_key_size, key, sizeof(key));
+	if (cache && !pbkdf_cache_lookup(cd, key, pbkdf))
+		return 0;
+
+	r = crypt_benchmark_pbkdf(cd, pbkdf, password, password_size, salt, salt_size,
+				  volume_key_size, progress, usrptr);
+	if (!r && cache)
+		pbkdf_cache_store(cd, key, pbkdf);
+
+	return r;
+}
+
 static int benchmark_callback(uint32_t time_ms, void *usrptr)
 {
 	struct benchmark_usrptr *u = usrptr;
@@ -187,7 +1035,7 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 		pbkdf->parallel_threads = 0; /* N/A in PBKDF2 */
 		pbkdf->max_memory_kb = 0; /* N/A in PBKDF2 */
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foobarfo", 8, "01234567890abcdef", 16,
+		r = benchmark_pbkdf_cached(cd, pbkdf, "foobarfo", 8, "01234567890abcdef", 16,
 					volume_key_size, &benchmark_callback, &u);
 		pbkdf->time_ms = ms_tmp;
 		if (r < 0) {
@@ -207,7 +1055,7 @@ int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 			return 0;
 		}
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foobarfo", 8,
+		r = benchmark_pbkdf_cached(cd, pbkdf, "foobarfo", 8,
 			"0123456789abcdef0123456789abcdef", 32,
 			volume_key_size, &benchmark_callback, &u);
 		if (r < 0)
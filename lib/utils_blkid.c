@@ -19,6 +19,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,8 +37,12 @@
 #endif
 struct blkid_handle {
 	int fd;
+	bool fd_owned;
 	blkid_probe pr;
 };
+
+/* Most superblocks and partition tables live in the first MiB */
+#define BLK_PREFETCH_MAX (1024 * 1024)
 #ifndef HAVE_BLKID_WIPE
 static size_t crypt_getpagesize(void)
 {
@@ -81,6 +86,15 @@ void blk_set_chains_for_superblocks(struct blkid_handle *h)
 #endif
 }
 
+void blk_set_chains_for_area_end(struct blkid_handle *h)
+{
+#ifdef HAVE_BLKID
+	/* partition tables are valid only at the device start */
+	blkid_probe_enable_partitions(h->pr, 0);
+	blk_set_chains_for_superblocks(h);
+#endif
+}
+
 void blk_set_chains_for_fast_detection(struct blkid_handle *h)
 {
 #ifdef HAVE_BLKID
@@ -99,6 +113,7 @@ int blk_init_by_path(struct blkid_handle **h, const char *path)
 		return -ENOMEM;
 
 	tmp->fd = -1;
+	tmp->fd_owned = false;
 
 	tmp->pr = blkid_new_probe_from_filename(path);
 	if (!tmp->pr) {
@@ -134,6 +149,7 @@ int blk_init_by_fd(struct blkid_handle **h, int fd)
 	}
 
 	tmp->fd = fd;
+	tmp->fd_owned = false;
 
 	*h = tmp;
 
@@ -142,6 +158,70 @@ int blk_init_by_fd(struct blkid_handle **h, int fd)
 	return r;
 }
 
+int blk_init_by_path_area(struct blkid_handle **h, const char *path,
+			  uint64_t offset, uint64_t size)
+{
+	int r = -ENOTSUP;
+#ifdef HAVE_BLKID
+	struct blkid_handle *tmp;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -EINVAL;
+
+	r = blk_init_by_fd(&tmp, fd);
+	if (r < 0) {
+		close(fd);
+		return r;
+	}
+	tmp->fd_owned = true;
+
+	r = blk_set_area(tmp, offset, size);
+	if (r < 0) {
+		blk_free(tmp);
+		return r;
+	}
+
+	*h = tmp;
+#endif
+	return r;
+}
+
+int blk_set_area(struct blkid_handle *h, uint64_t offset, uint64_t size)
+{
+#ifdef HAVE_BLKID
+	if (h->fd < 0 || offset > INT64_MAX || size > INT64_MAX)
+		return -EINVAL;
+
+	blkid_reset_probe(h->pr);
+	if (blkid_probe_set_device(h->pr, h->fd, (blkid_loff_t)offset, (blkid_loff_t)size))
+		return -EINVAL;
+
+	/*
+	 * Probes read many small blocks at different offsets,
+	 * prefetch the area start in one request instead.
+	 */
+	(void)posix_fadvise(h->fd, (off_t)offset,
+			    (!size || size > BLK_PREFETCH_MAX) ? BLK_PREFETCH_MAX : (off_t)size,
+			    POSIX_FADV_WILLNEED);
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+uint64_t blk_get_device_size(struct blkid_handle *h)
+{
+	uint64_t size = 0;
+#ifdef HAVE_BLKID
+	blkid_loff_t s = blkid_probe_get_size(h->pr);
+	if (s > 0)
+		size = s;
+#endif
+	return size;
+}
+
 #ifdef HAVE_BLKID
 static int blk_superblocks_luks(struct blkid_handle *h, bool enable)
 {
@@ -251,6 +331,9 @@ void blk_free(struct blkid_handle *h)
 	if (h->pr)
 		blkid_free_probe(h->pr);
 
+	if (h->fd_owned && h->fd >= 0)
+		close(h->fd);
+
 	free(h);
 #endif
 }
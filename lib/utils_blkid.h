@@ -21,6 +21,7 @@
 #ifndef _UTILS_BLKID_H
 #define _UTILS_BLKID_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 struct blkid_handle;
@@ -37,6 +38,17 @@ void blk_free(struct blkid_handle *h);
  */
 int blk_init_by_fd(struct blkid_handle **h, int fd);
 
+/*
+ * Probe only [offset, offset + size) area of device (size 0 means up to
+ * the device end), start of the area is prefetched in one read request.
+ */
+int blk_init_by_path_area(struct blkid_handle **h, const char *path,
+			  uint64_t offset, uint64_t size);
+
+int blk_set_area(struct blkid_handle *h, uint64_t offset, uint64_t size);
+
+uint64_t blk_get_device_size(struct blkid_handle *h);
+
 void blk_set_chains_for_wipes(struct blkid_handle *h);
 
 void blk_set_chains_for_full_print(struct blkid_handle *h);
@@ -45,6 +57,8 @@ void blk_set_chains_for_superblocks(struct blkid_handle *h);
 
 void blk_set_chains_for_fast_detection(struct blkid_handle *h);
 
+void blk_set_chains_for_area_end(struct blkid_handle *h);
+
 int blk_superblocks_filter_luks(struct blkid_handle *h);
 int blk_superblocks_only_luks(struct blkid_handle *h);
 
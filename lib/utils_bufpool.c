@@ -0,0 +1,237 @@
+/*
+ * Aligned buffer pool for I/O paths
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_mbind
+#include <linux/mempolicy.h>
+#endif
+
+#include "internal.h"
+#include "utils_bufpool.h"
+
+/*
+ * Released buffers are kept in a small per-context cache, so repeated
+ * operations with the same buffer sizes (wipe, reencryption, benchmark
+ * in long-lived processes) do not hit allocator and page faults again.
+ * Sizes are rounded up to power of two (size class), large buffers
+ * are never cached.
+ */
+#define BUFPOOL_SLOTS		8
+#define BUFPOOL_MAX_CACHED	(64 * 1024 * 1024)
+
+struct bufpool_entry {
+	void *buf;
+	size_t size;
+	bool locked;
+};
+
+struct crypt_bufpool {
+	pthread_mutex_t lock;
+	struct bufpool_entry entries[BUFPOOL_SLOTS];
+	unsigned int count;
+	size_t cached;
+};
+
+static size_t size_class(size_t size)
+{
+	size_t class = crypt_getpagesize();
+
+	while (class < size && class <= (SIZE_MAX >> 1))
+		class <<= 1;
+
+	return class < size ? size : class;
+}
+
+/* real alignment of the buffer address */
+static size_t buffer_alignment(const void *buf)
+{
+	uintptr_t addr = (uintptr_t)buf;
+
+	return (size_t)(addr & -addr);
+}
+
+static void buffer_free(void *buf, size_t size, bool locked)
+{
+	if (locked) {
+		crypt_safe_memzero(buf, size);
+		munlock(buf, size);
+	}
+	free(buf);
+}
+
+int crypt_bufpool_init(struct crypt_bufpool **bp)
+{
+	struct crypt_bufpool *p;
+
+	if (!bp)
+		return -EINVAL;
+
+	p = crypt_zalloc(sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&p->lock, NULL)) {
+		free(p);
+		return -ENOMEM;
+	}
+
+	*bp = p;
+	return 0;
+}
+
+void crypt_bufpool_destroy(struct crypt_bufpool *bp)
+{
+	unsigned int i;
+
+	if (!bp)
+		return;
+
+	for (i = 0; i < bp->count; i++)
+		buffer_free(bp->entries[i].buf, bp->entries[i].size, bp->entries[i].locked);
+
+	pthread_mutex_destroy(&bp->lock);
+	free(bp);
+}
+
+static void *bufpool_take(struct crypt_bufpool *bp, size_t size, size_t alignment, bool locked)
+{
+	struct bufpool_entry *e;
+	void *buf = NULL;
+	unsigned int i;
+
+	if (!bp)
+		return NULL;
+
+	pthread_mutex_lock(&bp->lock);
+	for (i = 0; i < bp->count; i++) {
+		e = &bp->entries[i];
+		if (e->size != size || e->locked != locked ||
+		    buffer_alignment(e->buf) < alignment)
+			continue;
+
+		buf = e->buf;
+		bp->cached -= e->size;
+		*e = bp->entries[--bp->count];
+		break;
+	}
+	pthread_mutex_unlock(&bp->lock);
+
+	return buf;
+}
+
+static bool bufpool_store(struct crypt_bufpool *bp, void *buf, size_t size, bool locked)
+{
+	bool r = false;
+
+	if (!bp || size > BUFPOOL_MAX_CACHED)
+		return false;
+
+	pthread_mutex_lock(&bp->lock);
+	if (bp->count < BUFPOOL_SLOTS && bp->cached + size <= BUFPOOL_MAX_CACHED) {
+		bp->entries[bp->count++] = (struct bufpool_entry) {
+			.buf = buf,
+			.size = size,
+			.locked = locked,
+		};
+		bp->cached += size;
+		r = true;
+	}
+	pthread_mutex_unlock(&bp->lock);
+
+	return r;
+}
+
+/*
+ * Prefer memory of the device NUMA node (see crypt_set_thread_affinity).
+ * Must be called before the buffer is touched, failure is not fatal.
+ */
+static void buffer_bind_numa(struct crypt_device *cd, void *buf, size_t size)
+{
+#ifdef __NR_mbind
+	unsigned long nodemask[1024 / (8 * sizeof(unsigned long))] = {};
+	int node = crypt_get_numa_node(cd);
+
+	if (node < 0 || (size_t)node >= 8 * sizeof(nodemask))
+		return;
+
+	nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+	if (syscall(__NR_mbind, buf, size, MPOL_PREFERRED, nodemask,
+		    8 * sizeof(nodemask), 0))
+		log_dbg(cd, "Cannot bind buffer to NUMA node %d.", node);
+#endif
+}
+
+void *crypt_buffer_get(struct crypt_device *cd, size_t size, size_t alignment,
+		       uint32_t flags)
+{
+	struct crypt_bufpool *bp = cd ? crypt_get_bufpool(cd) : NULL;
+	size_t class = size_class(size);
+	bool locked = flags & CRYPT_BUF_SENSITIVE;
+	void *buf;
+
+	if (!size)
+		return NULL;
+
+	if (alignment < crypt_getpagesize())
+		alignment = crypt_getpagesize();
+
+	/* locked buffers are cached separately */
+	buf = bufpool_take(bp, class, alignment, locked);
+	if (buf)
+		return buf;
+
+	if (posix_memalign(&buf, alignment, class))
+		return NULL;
+
+	if (cd)
+		buffer_bind_numa(cd, buf, class);
+
+	if (locked && mlock(buf, class))
+		log_dbg(cd, "Cannot lock buffer in memory.");
+
+	return buf;
+}
+
+void crypt_buffer_put(struct crypt_device *cd, void *buf, size_t size,
+		      uint32_t flags)
+{
+	struct crypt_bufpool *bp;
+	size_t class;
+	bool locked = flags & CRYPT_BUF_SENSITIVE;
+
+	if (!buf)
+		return;
+
+	bp = cd ? crypt_get_bufpool(cd) : NULL;
+	class = size_class(size);
+
+	if (locked)
+		crypt_safe_memzero(buf, class);
+
+	if (!bufpool_store(bp, buf, class, locked))
+		buffer_free(buf, class, locked);
+}
@@ -0,0 +1,47 @@
+/*
+ * Aligned buffer pool for I/O paths
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTILS_BUFPOOL_H
+#define _UTILS_BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct crypt_device;
+struct crypt_bufpool;
+
+/* Buffer is locked in memory and wiped when returned to the pool */
+#define CRYPT_BUF_SENSITIVE (UINT32_C(1) << 0)
+
+int crypt_bufpool_init(struct crypt_bufpool **bp);
+void crypt_bufpool_destroy(struct crypt_bufpool *bp);
+
+/*
+ * Get buffer of at least size bytes, aligned at least to alignment
+ * (and page size). Buffer content is undefined.
+ * Buffer must be returned by crypt_buffer_put() with the same size and flags.
+ * Without context (cd is NULL) buffers are not cached.
+ */
+void *crypt_buffer_get(struct crypt_device *cd, size_t size, size_t alignment,
+		       uint32_t flags);
+void crypt_buffer_put(struct crypt_device *cd, void *buf, size_t size,
+		      uint32_t flags);
+
+#endif
@@ -21,13 +21,16 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <unistd.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
@@ -38,12 +41,26 @@
 #include "internal.h"
 #include "utils_device_locking.h"
 
+/* Leading and trailing areas of the device cached while probing metadata */
+#define DEVICE_PROBE_HEAD_SIZE (1024 * 1024)
+#define DEVICE_PROBE_TAIL_SIZE (128 * 1024)
+
+struct device_probe_area {
+	char *buf;
+	uint64_t offset;
+	size_t size;
+	bool done;
+};
+
 struct device {
 	char *path;
 
 	char *file_path;
 	int loop_fd;
 
+	/* anonymous memory file backing in-memory device */
+	int mem_fd;
+
 	int ro_dev_fd;
 	int dev_fd;
 	int dev_fd_excl;
@@ -52,11 +69,19 @@ struct device {
 
 	unsigned int o_direct:1;
 	unsigned int init_done:1; /* path is bdev or loop already initialized */
+	/* cached fd verified against currently held metadata lock */
+	unsigned int ro_fd_verified:1;
+	unsigned int dev_fd_verified:1;
 
 	/* cached values */
 	size_t alignment;
 	size_t block_size;
 	size_t loop_block_size;
+
+	/* metadata probe cache, valid only inside device_probe_begin/end */
+	unsigned int probe_refs;
+	struct device_probe_area probe_head;
+	struct device_probe_area probe_tail;
 };
 
 static size_t device_fs_block_size_fd(int fd)
@@ -165,6 +190,143 @@ static int device_read_test(int devfd)
 	return r;
 }
 
+/*
+ * Probing results of block devices cached for the process lifetime,
+ * direct mapped by device number.
+ */
+#define DEVICE_CACHE_ENTRIES 256
+#define LOOP_DEV_MAJOR 7
+
+struct device_cache_entry {
+	dev_t rdev;
+	size_t alignment;
+	size_t block_size;
+	int rotational; /* -1 not probed yet */
+	int numa_node; /* -2 not probed yet */
+	unsigned int o_direct:1;
+	unsigned int valid:1;
+};
+
+static struct device_cache_entry device_cache[DEVICE_CACHE_ENTRIES];
+static pthread_mutex_t device_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct device_cache_entry *device_cache_slot(dev_t rdev)
+{
+	uint64_t h = (uint64_t)rdev * 0x9e3779b97f4a7c15ULL;
+
+	return &device_cache[(h >> 32) % DEVICE_CACHE_ENTRIES];
+}
+
+/*
+ * Device-mapper and loop devices are created and removed dynamically,
+ * the same device number is reused for a different device. Never cache them.
+ */
+static bool device_cache_allowed(dev_t rdev)
+{
+	return major(rdev) != LOOP_DEV_MAJOR && !dm_is_dm_device(major(rdev));
+}
+
+static bool device_cache_get(dev_t rdev, struct device_cache_entry *entry)
+{
+	struct device_cache_entry *e = device_cache_slot(rdev);
+	bool found;
+
+	pthread_mutex_lock(&device_cache_lock);
+	found = e->valid && e->rdev == rdev;
+	if (found)
+		*entry = *e;
+	pthread_mutex_unlock(&device_cache_lock);
+
+	return found;
+}
+
+static void device_cache_set(dev_t rdev, bool o_direct, size_t alignment, size_t block_size)
+{
+	struct device_cache_entry *e = device_cache_slot(rdev);
+
+	if (!device_cache_allowed(rdev))
+		return;
+
+	pthread_mutex_lock(&device_cache_lock);
+	if (!e->valid || e->rdev != rdev) {
+		e->rotational = -1;
+		e->numa_node = -2;
+	}
+	e->rdev = rdev;
+	e->o_direct = o_direct;
+	e->alignment = alignment;
+	e->block_size = block_size;
+	e->valid = 1;
+	pthread_mutex_unlock(&device_cache_lock);
+}
+
+static void device_cache_invalidate(dev_t rdev)
+{
+	struct device_cache_entry *e = device_cache_slot(rdev);
+
+	pthread_mutex_lock(&device_cache_lock);
+	if (e->rdev == rdev)
+		e->valid = 0;
+	pthread_mutex_unlock(&device_cache_lock);
+}
+
+/* Allow only increase (loop device) */
+static void device_ready_sizes(struct device *device, size_t alignment, size_t block_size)
+{
+	if (alignment > device->alignment)
+		device->alignment = alignment;
+
+	if (block_size > device->block_size)
+		device->block_size = block_size;
+}
+
+/*
+ * Keep probing fd for later device_open(). Not for device-mapper devices,
+ * an open fd would block their removal (reencryption, integrity hotzone).
+ */
+static void device_ready_keep_fd(struct device *device, int devfd, const struct stat *st)
+{
+	if (device->ro_dev_fd < 0 && !dm_is_dm_device(major(st->st_rdev)))
+		device->ro_dev_fd = devfd;
+	else
+		close(devfd);
+}
+
+/*
+ * Block device probed earlier, only open it the same way and keep the fd
+ * for later use. Fails if the device cannot be opened (or is not the same
+ * block device anymore or its logical block size changed), the full probe
+ * is then done again.
+ */
+static int device_ready_cached(struct crypt_device *cd, struct device *device,
+			       const struct stat *st)
+{
+	struct device_cache_entry e;
+	struct stat fst;
+	int devfd;
+
+	if (!device_cache_allowed(st->st_rdev) || !device_cache_get(st->st_rdev, &e))
+		return -ENOENT;
+
+	devfd = open(device_path(device), O_RDONLY | (e.o_direct ? O_DIRECT : 0));
+	if (devfd < 0 || fstat(devfd, &fst) < 0 || !S_ISBLK(fst.st_mode) ||
+	    fst.st_rdev != st->st_rdev || device_block_size_fd(devfd, NULL) != e.block_size) {
+		if (devfd >= 0)
+			close(devfd);
+		device_cache_invalidate(st->st_rdev);
+		return -ENOENT;
+	}
+
+	log_dbg(cd, "Using cached parameters of device %s%s.", device_path(device),
+		e.o_direct ? " (direct-io)" : "");
+
+	device->o_direct = e.o_direct;
+	device_ready_sizes(device, e.alignment, e.block_size);
+	device_ready_keep_fd(device, devfd, &fst);
+
+	return 0;
+}
+
 /*
  * The direct-io is always preferred. The header is usually mapped to the same
  * device and can be accessed when the rest of device is mapped to data device.
@@ -172,16 +334,21 @@ static int device_read_test(int devfd)
  * (But proper alignment should prevent this in the first place.)
  * The read test is needed to detect broken configurations (seen with remote
  * block devices) that allow open with direct-io but then fails on read.
+ * Results for block devices are cached and the probing fd is kept open.
  */
 static int device_ready(struct crypt_device *cd, struct device *device)
 {
 	int devfd = -1, r = 0;
 	struct stat st;
-	size_t tmp_size;
+	size_t alignment, block_size;
 
 	if (!device)
 		return -EINVAL;
 
+	if (device->o_direct && !stat(device_path(device), &st) && S_ISBLK(st.st_mode) &&
+	    !device_ready_cached(cd, device, &st))
+		return 0;
+
 	if (device->o_direct) {
 		log_dbg(cd, "Trying to open and read device %s with direct-io.",
 			device_path(device));
@@ -220,17 +387,21 @@ static int device_ready(struct crypt_device *cd, struct device *device)
 		return r;
 	}
 
-	/* Allow only increase (loop device) */
-	tmp_size = device_alignment_fd(devfd);
-	if (tmp_size > device->alignment)
-		device->alignment = tmp_size;
+	alignment = device_alignment_fd(devfd);
+	block_size = device_block_size_fd(devfd, NULL);
+	device_ready_sizes(device, alignment, block_size);
+
+	if (r) {
+		close(devfd);
+		return r;
+	}
+
+	device_cache_set(st.st_rdev, device->o_direct, alignment, block_size);
 
-	tmp_size = device_block_size_fd(devfd, NULL);
-	if (tmp_size > device->block_size)
-		device->block_size = tmp_size;
+	/* the same open mode as in device_open_internal() */
+	device_ready_keep_fd(device, devfd, &st);
 
-	close(devfd);
-	return r;
+	return 0;
 }
 
 static int _open_locked(struct crypt_device *cd, struct device *device, int flags)
@@ -282,6 +453,8 @@ void device_sync(struct crypt_device *cd, struct device *device)
  * 	-EINVAL : invalid lock fd state
  * 	-1	: all other errors
  */
+static void device_probe_invalidate(struct device *device);
+
 static int device_open_internal(struct crypt_device *cd, struct device *device, int flags)
 {
 	int access, devfd;
@@ -293,12 +466,39 @@ static int device_open_internal(struct crypt_device *cd, struct device *device,
 	if (access == O_WRONLY)
 		access = O_RDWR;
 
+	/* metadata can change, do not use probe cache anymore */
+	if (access == O_RDWR)
+		device_probe_invalidate(device);
+
+	if (access == O_RDWR && device_locked(device->lh) && device_locked_readonly(device->lh)) {
+		log_dbg(cd, "Cannot open locked device %s in write mode. Read lock held.", device_path(device));
+		return -EAGAIN;
+	}
+
+	/*
+	 * Cached fd opened before the lock was taken must refer to the locked
+	 * resource, otherwise it is replaced by a new one.
+	 */
 	if (access == O_RDONLY && device->ro_dev_fd >= 0) {
-		log_dbg(cd, "Reusing open r%c fd on device %s", 'o', device_path(device));
-		return device->ro_dev_fd;
+		if (!device_locked(device->lh) || device->ro_fd_verified ||
+		    !device_locked_verify(cd, device->ro_dev_fd, device->lh)) {
+			device->ro_fd_verified = device_locked(device->lh);
+			log_dbg(cd, "Reusing open r%c fd on device %s", 'o', device_path(device));
+			return device->ro_dev_fd;
+		}
+		log_dbg(cd, "Cached read only fd of %s does not match lock, reopening.", device_path(device));
+		close(device->ro_dev_fd);
+		device->ro_dev_fd = -1;
 	} else if (access == O_RDWR && device->dev_fd >= 0) {
-		log_dbg(cd, "Reusing open r%c fd on device %s", 'w', device_path(device));
-		return device->dev_fd;
+		if (!device_locked(device->lh) || device->dev_fd_verified ||
+		    !device_locked_verify(cd, device->dev_fd, device->lh)) {
+			device->dev_fd_verified = device_locked(device->lh);
+			log_dbg(cd, "Reusing open r%c fd on device %s", 'w', device_path(device));
+			return device->dev_fd;
+		}
+		log_dbg(cd, "Cached read write fd of %s does not match lock, reopening.", device_path(device));
+		close(device->dev_fd);
+		device->dev_fd = -1;
 	}
 
 	if (device_locked(device->lh))
@@ -313,10 +513,13 @@ static int device_open_internal(struct crypt_device *cd, struct device *device,
 		return devfd;
 	}
 
-	if (access == O_RDONLY)
+	if (access == O_RDONLY) {
 		device->ro_dev_fd = devfd;
-	else
+		device->ro_fd_verified = device_locked(device->lh);
+	} else {
 		device->dev_fd = devfd;
+		device->dev_fd_verified = device_locked(device->lh);
+	}
 
 	return devfd;
 }
@@ -408,6 +611,7 @@ int device_alloc_no_check(struct device **device, const char *path)
 		return -ENOMEM;
 	}
 	dev->loop_fd = -1;
+	dev->mem_fd = -1;
 	dev->ro_dev_fd = -1;
 	dev->dev_fd = -1;
 	dev->dev_fd_excl = -1;
@@ -443,6 +647,56 @@ int device_alloc(struct crypt_device *cd, struct device **device, const char *pa
 	return 0;
 }
 
+/*
+ * Memory backed device. Buffer is copied to anonymous memory file and the
+ * device is accessed through its /proc/self/fd path, so all file based code
+ * (including metadata locking) works without temporary files or loop devices.
+ */
+int device_alloc_memory(struct crypt_device *cd, struct device **device,
+			const void *buffer, size_t buffer_size, uint64_t device_size)
+{
+#if HAVE_MEMFD_CREATE
+	char path[PATH_MAX];
+	int fd, r;
+
+	if (!device || !buffer || !buffer_size || (device_size && device_size < buffer_size) ||
+	    device_size > INT64_MAX)
+		return -EINVAL;
+
+	fd = memfd_create("cryptsetup-device", MFD_CLOEXEC);
+	if (fd < 0) {
+		log_dbg(cd, "Cannot create memory file.");
+		return -errno;
+	}
+
+	if (ftruncate(fd, device_size ?: buffer_size) ||
+	    write_buffer(fd, buffer, buffer_size) != (ssize_t)buffer_size) {
+		log_dbg(cd, "Cannot copy %zu bytes to memory file.", buffer_size);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	r = snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if (r < 0 || (size_t)r >= sizeof(path)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	r = device_alloc(cd, device, path);
+	if (r < 0) {
+		close(fd);
+		return r;
+	}
+
+	log_dbg(cd, "Allocated memory device %s (%zu bytes).", path, buffer_size);
+	(*device)->mem_fd = fd;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
 void device_free(struct crypt_device *cd, struct device *device)
 {
 	if (!device)
@@ -460,8 +714,16 @@ void device_free(struct crypt_device *cd, struct device *device)
 		close(device->loop_fd);
 	}
 
+	/* All other fds must be closed before, memory is released with the last one */
+	if (device->mem_fd != -1) {
+		log_dbg(cd, "Released memory device %s.", device->path);
+		close(device->mem_fd);
+	}
+
 	assert(!device_locked(device->lh));
 
+	free(device->probe_head.buf);
+	free(device->probe_tail.buf);
 	free(device->file_path);
 	free(device->path);
 	free(device);
@@ -677,6 +939,126 @@ out:
 	return r;
 }
 
+/*
+ * Metadata probe cache. All format parsers reading headers between
+ * device_probe_begin() and device_probe_end() share one aligned read
+ * of the leading and trailing area of the device.
+ * Opening the device for write or taking a metadata lock drops already
+ * cached areas, so locked reads never use data read without the lock.
+ */
+void device_probe_begin(struct device *device)
+{
+	if (device)
+		device->probe_refs++;
+}
+
+static void device_probe_area_free(struct device_probe_area *area)
+{
+	free(area->buf);
+	memset(area, 0, sizeof(*area));
+}
+
+static void device_probe_invalidate(struct device *device)
+{
+	device_probe_area_free(&device->probe_head);
+	device_probe_area_free(&device->probe_tail);
+}
+
+void device_probe_end(struct device *device)
+{
+	if (!device || !device->probe_refs || --device->probe_refs)
+		return;
+
+	device_probe_invalidate(device);
+}
+
+static int device_probe_area_load(struct crypt_device *cd, struct device *device,
+				  int devfd, struct device_probe_area *area, bool tail)
+{
+	size_t bsize = device_block_size(cd, device), size;
+	off_t dev_size;
+
+	if (area->done)
+		return area->buf ? 0 : -ENOENT;
+	area->done = true;
+
+	if (!bsize)
+		return -ENOENT;
+
+	dev_size = lseek(devfd, 0, SEEK_END);
+	if (dev_size < 0)
+		return -ENOENT;
+
+	size = tail ? DEVICE_PROBE_TAIL_SIZE : DEVICE_PROBE_HEAD_SIZE;
+	if ((uint64_t)dev_size < size)
+		size = dev_size;
+	size -= size % bsize;
+	if (!size)
+		return -ENOENT;
+
+	if (posix_memalign((void *)&area->buf, crypt_getpagesize(), size))
+		return -ENOMEM;
+
+	area->offset = tail ? (uint64_t)dev_size - size : 0;
+	if (area->offset % bsize ||
+	    read_blockwise_offset(devfd, bsize, device_alignment(device),
+				  area->buf, size, area->offset) != (ssize_t)size) {
+		log_dbg(cd, "Cannot read probe area of device %s.", device_path(device));
+		free(area->buf);
+		area->buf = NULL;
+		return -ENOENT;
+	}
+
+	area->size = size;
+	log_dbg(cd, "Cached %zu bytes of device %s at offset %" PRIu64 " for metadata probing.",
+		size, device_path(device), area->offset);
+	return 0;
+}
+
+static bool device_probe_area_read(struct crypt_device *cd, struct device *device,
+				   int devfd, struct device_probe_area *area, bool tail,
+				   void *buf, size_t length, uint64_t offset)
+{
+	if (device_probe_area_load(cd, device, devfd, area, tail))
+		return false;
+
+	if (offset < area->offset || offset - area->offset > area->size ||
+	    length > area->size - (offset - area->offset))
+		return false;
+
+	memcpy(buf, area->buf + (offset - area->offset), length);
+	return true;
+}
+
+/*
+ * Read metadata as read_lseek_blockwise() (negative offset is relative
+ * to end of the device), from probe cache if active and covers the range.
+ */
+ssize_t device_read_probe(struct crypt_device *cd, struct device *device, int devfd,
+			  void *buf, size_t length, off_t offset)
+{
+	off_t dev_size, pos;
+
+	if (device && device->probe_refs && (dev_size = lseek(devfd, 0, SEEK_END)) >= 0) {
+		pos = offset < 0 ? dev_size + offset : offset;
+
+		if (pos >= 0 && pos < DEVICE_PROBE_HEAD_SIZE &&
+		    device_probe_area_read(cd, device, devfd, &device->probe_head, false,
+					   buf, length, pos))
+			return length;
+
+		/* tail area is loaded only for reads inside it (backup headers) */
+		if (pos >= DEVICE_PROBE_HEAD_SIZE && pos < dev_size &&
+		    dev_size - pos <= DEVICE_PROBE_TAIL_SIZE &&
+		    device_probe_area_read(cd, device, devfd, &device->probe_tail, true,
+					   buf, length, pos))
+			return length;
+	}
+
+	return read_lseek_blockwise(devfd, device_block_size(cd, device),
+				    device_alignment(device), buf, length, offset);
+}
+
 /* For a file, allocate the required space */
 int device_fallocate(struct device *device, uint64_t size)
 {
@@ -829,6 +1211,12 @@ static int device_internal_prepare(struct crypt_device *cd, struct device *devic
 	if (device->init_done)
 		return 0;
 
+	if (device->mem_fd >= 0) {
+		log_err(cd, _("Cannot use memory backed device %s for device-mapper mapping."),
+			device_path(device));
+		return -ENOTSUP;
+	}
+
 	if (getuid() || geteuid()) {
 		log_err(cd, _("Cannot use a loopback device, "
 			      "running as non-root user."));
@@ -929,8 +1317,13 @@ size_t size_round_up(size_t size, size_t block)
 
 void device_disable_direct_io(struct device *device)
 {
-	if (device)
-		device->o_direct = 0;
+	if (!device || !device->o_direct)
+		return;
+
+	device->o_direct = 0;
+
+	/* cached fds (e.g. kept from probing) were opened with direct-io */
+	device_close(NULL, device);
 }
 
 int device_direct_io(const struct device *device)
@@ -971,7 +1364,9 @@ int device_is_identical(struct device *device1, struct device *device2)
 
 int device_is_rotational(struct device *device)
 {
+	struct device_cache_entry *e;
 	struct stat st;
+	int r;
 
 	if (!device)
 		return -EINVAL;
@@ -982,7 +1377,113 @@ int device_is_rotational(struct device *device)
 	if (!S_ISBLK(st.st_mode))
 		return 0;
 
-	return crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+	e = device_cache_slot(st.st_rdev);
+	pthread_mutex_lock(&device_cache_lock);
+	r = e->valid && e->rdev == st.st_rdev ? e->rotational : -1;
+	pthread_mutex_unlock(&device_cache_lock);
+	if (r >= 0)
+		return r;
+
+	r = crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+
+	pthread_mutex_lock(&device_cache_lock);
+	if (e->valid && e->rdev == st.st_rdev)
+		e->rotational = r;
+	pthread_mutex_unlock(&device_cache_lock);
+
+	return r;
+}
+
+/* NUMA node the block device is attached to, -1 if unknown */
+int device_numa_node(struct device *device)
+{
+	struct device_cache_entry *e;
+	struct stat st;
+	int r;
+
+	if (!device || stat(device_path(device), &st) < 0 || !S_ISBLK(st.st_mode))
+		return -1;
+
+	e = device_cache_slot(st.st_rdev);
+	pthread_mutex_lock(&device_cache_lock);
+	r = e->valid && e->rdev == st.st_rdev ? e->numa_node : -2;
+	pthread_mutex_unlock(&device_cache_lock);
+	if (r >= -1)
+		return r;
+
+	r = crypt_dev_numa_node(major(st.st_rdev), minor(st.st_rdev));
+
+	pthread_mutex_lock(&device_cache_lock);
+	if (e->valid && e->rdev == st.st_rdev)
+		e->numa_node = r;
+	pthread_mutex_unlock(&device_cache_lock);
+
+	return r;
+}
+
+int device_hw_queues(struct device *device, int *is_dm)
+{
+	struct stat st;
+
+	if (is_dm)
+		*is_dm = 0;
+
+	if (!device)
+		return -EINVAL;
+
+	if (stat(device_path(device), &st) < 0)
+		return -EINVAL;
+
+	if (!S_ISBLK(st.st_mode))
+		return 0;
+
+	if (is_dm)
+		*is_dm = crypt_dev_is_dm(major(st.st_rdev), minor(st.st_rdev));
+
+	return crypt_dev_hw_queues(major(st.st_rdev), minor(st.st_rdev));
+}
+
+/*
+ * Per-sector metadata bytes usable for dm-integrity inline mode tags,
+ * -ENOTSUP if device does not expose such metadata.
+ */
+int device_integrity_metadata(struct device *device, uint32_t *metadata_bytes, uint32_t *interval_bytes)
+{
+	struct stat st;
+
+	if (!device || !metadata_bytes || !interval_bytes)
+		return -EINVAL;
+
+	if (stat(device_path(device), &st) < 0)
+		return -EINVAL;
+
+	if (!S_ISBLK(st.st_mode) ||
+	    !crypt_dev_integrity_metadata(major(st.st_rdev), minor(st.st_rdev), metadata_bytes, interval_bytes))
+		return -ENOTSUP;
+
+	return 0;
+}
+
+/*
+ * Inline encryption engine of the device supports blk-crypto mode with
+ * data unit size, -ENOTSUP otherwise.
+ */
+int device_inline_crypto(struct device *device, const char *mode,
+			 uint32_t data_unit_size, uint32_t *max_dun_bits)
+{
+	struct stat st;
+
+	if (!device || !mode || !max_dun_bits)
+		return -EINVAL;
+
+	if (stat(device_path(device), &st) < 0)
+		return -EINVAL;
+
+	if (!S_ISBLK(st.st_mode) ||
+	    !crypt_dev_inline_crypto(major(st.st_rdev), minor(st.st_rdev), mode, data_unit_size, max_dun_bits))
+		return -ENOTSUP;
+
+	return 0;
 }
 
 size_t device_alignment(struct device *device)
@@ -1016,7 +1517,14 @@ struct crypt_lock_handle *device_get_lock_handle(struct device *device)
 
 int device_read_lock(struct crypt_device *cd, struct device *device)
 {
-	if (!device || !crypt_metadata_locking_enabled())
+	if (!device)
+		return 0;
+
+	/* probe data read before the lock was taken can be stale */
+	if (!device_locked(device->lh))
+		device_probe_invalidate(device);
+
+	if (!crypt_metadata_locking_enabled())
 		return 0;
 
 	if (device_read_lock_internal(cd, device))
@@ -1027,7 +1535,14 @@ int device_read_lock(struct crypt_device *cd, struct device *device)
 
 int device_write_lock(struct crypt_device *cd, struct device *device)
 {
-	if (!device || !crypt_metadata_locking_enabled())
+	if (!device)
+		return 0;
+
+	/* probe data read before (or under read lock retried as write lock) can be stale */
+	if (!device_locked(device->lh))
+		device_probe_invalidate(device);
+
+	if (!crypt_metadata_locking_enabled())
 		return 0;
 
 	assert(!device_locked(device->lh) || !device_locked_readonly(device->lh));
@@ -1043,6 +1558,8 @@ void device_read_unlock(struct crypt_device *cd, struct device *device)
 	assert(device_locked(device->lh));
 
 	device_unlock_internal(cd, device);
+	if (!device_locked(device->lh))
+		device->ro_fd_verified = device->dev_fd_verified = 0;
 }
 
 void device_write_unlock(struct crypt_device *cd, struct device *device)
@@ -1053,6 +1570,8 @@ void device_write_unlock(struct crypt_device *cd, struct device *device)
 	assert(device_locked(device->lh) && !device_locked_readonly(device->lh));
 
 	device_unlock_internal(cd, device);
+	if (!device_locked(device->lh))
+		device->ro_fd_verified = device->dev_fd_verified = 0;
 }
 
 bool device_is_locked(struct device *device)
@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <linux/limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,6 +52,8 @@ enum lock_mode {
 	DEV_LOCK_NAME
 };
 
+struct shared_read_lock;
+
 struct crypt_lock_handle {
 	unsigned refcnt;
 	int flock_fd;
@@ -64,8 +67,23 @@ struct crypt_lock_handle {
 		char *name;
 	} name;
 	} u;
+	struct shared_read_lock *shared;
 };
 
+/*
+ * Read locks of block devices are shared by all contexts in the process,
+ * the flock on resource file is held while any context holds the lock.
+ * Other processes see the same as if every context locked separately.
+ */
+struct shared_read_lock {
+	struct crypt_lock_handle h; /* flock holder */
+	unsigned users;
+	struct shared_read_lock *next;
+};
+
+static struct shared_read_lock *shared_read_locks = NULL;
+static pthread_mutex_t shared_read_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int resource_by_name(char *res, size_t res_size, const char *name, bool fullpath)
 {
 	int r;
@@ -306,6 +324,7 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 
 	if (!(h = malloc(sizeof(*h))))
 		return -ENOMEM;
+	h->shared = NULL;
 
 	do {
 		r = device ? acquire_lock_handle(cd, device, h) : acquire_lock_handle_by_name(cd, resource, h);
@@ -344,6 +363,119 @@ static int acquire_and_verify(struct crypt_device *cd, struct device *device, co
 	return 0;
 }
 
+static void unlock_internal(struct crypt_device *cd, struct crypt_lock_handle *h);
+
+/* Must be called with shared_read_locks_mutex held */
+static struct shared_read_lock *shared_read_lock_find(dev_t devno)
+{
+	struct shared_read_lock *s;
+
+	for (s = shared_read_locks; s; s = s->next)
+		if (s->h.u.bdev.devno == devno)
+			return s;
+
+	return NULL;
+}
+
+/*
+ * Take read lock of block device from in-process table, the resource file
+ * is flocked only by the first user. Returns -ENOENT if device is not
+ * a block device, regular locking is used then.
+ */
+static int shared_read_lock(struct crypt_device *cd, struct device *device,
+			    struct crypt_lock_handle **lock)
+{
+	struct crypt_lock_handle *h, *acquired = NULL;
+	struct shared_read_lock *s;
+	struct stat st;
+	int r;
+
+	if (stat(device_path(device), &st) || !S_ISBLK(st.st_mode))
+		return -ENOENT;
+
+	if (!(h = malloc(sizeof(*h))))
+		return -ENOMEM;
+
+	pthread_mutex_lock(&shared_read_locks_mutex);
+	if ((s = shared_read_lock_find(st.st_rdev)))
+		s->users++;
+	pthread_mutex_unlock(&shared_read_locks_mutex);
+
+	if (!s) {
+		/* flock can block, do not hold the table mutex */
+		r = acquire_and_verify(cd, device, NULL, LOCK_SH, &acquired);
+		if (r < 0) {
+			free(h);
+			return r;
+		}
+		acquired->type = DEV_LOCK_READ;
+		acquired->refcnt = 1;
+
+		/* device node changed meanwhile, use private lock */
+		if (acquired->mode != DEV_LOCK_BDEV || acquired->u.bdev.devno != st.st_rdev) {
+			free(h);
+			*lock = acquired;
+			return 0;
+		}
+
+		pthread_mutex_lock(&shared_read_locks_mutex);
+		if ((s = shared_read_lock_find(st.st_rdev)))
+			s->users++;
+		else if ((s = malloc(sizeof(*s)))) {
+			s->h = *acquired;
+			s->users = 1;
+			s->next = shared_read_locks;
+			shared_read_locks = s;
+			free(acquired);
+			acquired = NULL;
+		}
+		pthread_mutex_unlock(&shared_read_locks_mutex);
+
+		if (!s) {
+			free(h);
+			*lock = acquired;
+			return 0;
+		}
+
+		/* other context was faster, drop our own flock */
+		if (acquired)
+			unlock_internal(cd, acquired);
+	} else
+		log_dbg(cd, "Device %s READ lock shared with other context.", device_path(device));
+
+	*h = s->h;
+	h->shared = s;
+	*lock = h;
+
+	return 0;
+}
+
+static void shared_read_unlock(struct crypt_device *cd, struct crypt_lock_handle *h)
+{
+	struct shared_read_lock **p, *s = h->shared;
+	bool last;
+
+	free(h);
+
+	pthread_mutex_lock(&shared_read_locks_mutex);
+	last = !--s->users;
+	if (last)
+		for (p = &shared_read_locks; *p; p = &(*p)->next)
+			if (*p == s) {
+				*p = s->next;
+				break;
+			}
+	pthread_mutex_unlock(&shared_read_locks_mutex);
+
+	if (!last)
+		return;
+
+	if (flock(s->h.flock_fd, LOCK_UN))
+		log_dbg(cd, "flock on fd %d failed.", s->h.flock_fd);
+	release_lock_handle(cd, &s->h);
+	free(s);
+}
+
 int device_read_lock_internal(struct crypt_device *cd, struct device *device)
 {
 	int r;
@@ -362,7 +494,9 @@ int device_read_lock_internal(struct crypt_device *cd, struct device *device)
 
 	log_dbg(cd, "Acquiring read lock for device %s.", device_path(device));
 
-	r = acquire_and_verify(cd, device, NULL, LOCK_SH, &h);
+	r = shared_read_lock(cd, device, &h);
+	if (r == -ENOENT)
+		r = acquire_and_verify(cd, device, NULL, LOCK_SH, &h);
 	if (r < 0)
 		return r;
 
@@ -455,12 +589,135 @@ int crypt_write_lock(struct crypt_device *cd, const char *resource, bool blockin
 
 static void unlock_internal(struct crypt_device *cd, struct crypt_lock_handle *h)
 {
+	if (h->shared) {
+		shared_read_unlock(cd, h);
+		return;
+	}
+
 	if (flock(h->flock_fd, LOCK_UN))
 		log_dbg(cd, "flock on fd %d failed.", h->flock_fd);
 	release_lock_handle(cd, h);
 	free(h);
 }
 
+/*
+ * Host-wide memory gate for memory-hard PBKDF.
+ *
+ * Memory budget (half of physical memory, the same in every process) is split
+ * into units, every unit is one byte of the gate resource file. A unit is held
+ * by OFD byte-range write lock, so the kernel releases it if the process dies.
+ * Units are taken under exclusive admission flock, a waiting process never
+ * competes with others for a partial set of units.
+ */
+#define MEMORY_GATE_RESOURCE "LN_memory-hard-gate"
+#define MEMORY_GATE_UNITS_MAX 1024
+#define MEMORY_GATE_UNIT_MIN_KB (32*1024)
+
+#ifdef F_OFD_SETLK
+static int memory_gate_lock_unit(int fd, unsigned unit, bool blocking)
+{
+	struct flock fl = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = unit,
+		.l_len = 1,
+	};
+	int r;
+
+	do {
+		r = fcntl(fd, blocking ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+	} while (r < 0 && errno == EINTR);
+
+	return r < 0 ? -errno : 0;
+}
+
+int crypt_memory_gate_acquire(struct crypt_device *cd, uint32_t memory_kb, int *gate)
+{
+	uint8_t held[MEMORY_GATE_UNITS_MAX] = {};
+	uint64_t budget_kb, unit_kb;
+	unsigned i, units, need, taken = 0;
+	int busy, fd, r = 0;
+
+	*gate = -1;
+
+	if (!crypt_metadata_locking_enabled() || !memory_kb)
+		return 0;
+
+	budget_kb = crypt_getphysmemory_kb() / 2;
+	unit_kb = (budget_kb + MEMORY_GATE_UNITS_MAX - 1) / MEMORY_GATE_UNITS_MAX;
+	if (unit_kb < MEMORY_GATE_UNIT_MIN_KB)
+		unit_kb = MEMORY_GATE_UNIT_MIN_KB;
+
+	units = budget_kb / unit_kb ?: 1;
+	need = (memory_kb + unit_kb - 1) / unit_kb;
+	if (need > units)
+		need = units;
+
+	fd = open_resource(cd, MEMORY_GATE_RESOURCE);
+	if (fd < 0) {
+		log_dbg(cd, "Memory-hard PBKDF gate not available (%d).", fd);
+		return 0;
+	}
+
+	log_dbg(cd, "Acquiring %u of %u memory-hard PBKDF gate units (%" PRIu64 " kB each).",
+		need, units, unit_kb);
+
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	while (taken < need) {
+		for (i = 0, busy = -1; i < units && taken < need; i++) {
+			if (held[i])
+				continue;
+			if (!memory_gate_lock_unit(fd, i, false)) {
+				held[i] = 1;
+				taken++;
+			} else if (busy < 0)
+				busy = i;
+		}
+
+		/* Wait for the first busy unit, other processes only release units now */
+		if (taken < need && busy >= 0) {
+			r = memory_gate_lock_unit(fd, busy, true);
+			if (r < 0)
+				break;
+			held[busy] = 1;
+			taken++;
+		}
+	}
+
+	flock(fd, LOCK_UN);
+
+	if (r < 0) {
+		log_dbg(cd, "Failed to acquire memory-hard PBKDF gate (%d).", r);
+		close(fd);
+		return r;
+	}
+
+	*gate = fd;
+	return 0;
+}
+#else
+int crypt_memory_gate_acquire(struct crypt_device *cd __attribute__((unused)),
+			      uint32_t memory_kb __attribute__((unused)), int *gate)
+{
+	*gate = -1;
+	return 0;
+}
+#endif
+
+/* Closing the gate resource drops all held units */
+void crypt_memory_gate_release(struct crypt_device *cd, int gate)
+{
+	if (gate < 0)
+		return;
+
+	log_dbg(cd, "Releasing memory-hard PBKDF gate units.");
+	close(gate);
+}
+
 void crypt_unlock_internal(struct crypt_device *cd, struct crypt_lock_handle *h)
 {
 	if (!h)
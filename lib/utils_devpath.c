@@ -28,6 +28,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #ifdef HAVE_SYS_SYSMACROS_H
@@ -121,54 +122,163 @@ static char *lookup_dev_old(int major, int minor)
 }
 
 /*
- * Returns string pointing to device in /dev according to "major:minor" dev_id
+ * Process wide cache of resolved devices, direct mapped by dev_t.
+ * Every hit is validated by stat(), so stale entries (renamed or
+ * removed nodes) are just resolved again.
  */
-char *crypt_lookup_dev(const char *dev_id)
+#define DEVPATH_CACHE_SIZE 256
+
+static struct {
+	dev_t dev;
+	char *path;
+} _devpath_cache[DEVPATH_CACHE_SIZE];
+static pthread_mutex_t _devpath_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned _devpath_cache_slot(dev_t dev)
+{
+	return (unsigned)((major(dev) * 31 + minor(dev)) % DEVPATH_CACHE_SIZE);
+}
+
+static char *_devpath_cache_get(dev_t dev)
+{
+	unsigned slot = _devpath_cache_slot(dev);
+	char *path = NULL;
+
+	pthread_mutex_lock(&_devpath_cache_lock);
+	if (_devpath_cache[slot].path && _devpath_cache[slot].dev == dev)
+		path = strdup(_devpath_cache[slot].path);
+	pthread_mutex_unlock(&_devpath_cache_lock);
+
+	return path;
+}
+
+static void _devpath_cache_set(dev_t dev, const char *path)
+{
+	unsigned slot = _devpath_cache_slot(dev);
+	char *tmp = path ? strdup(path) : NULL;
+
+	pthread_mutex_lock(&_devpath_cache_lock);
+	free(_devpath_cache[slot].path);
+	_devpath_cache[slot].path = tmp;
+	_devpath_cache[slot].dev = dev;
+	pthread_mutex_unlock(&_devpath_cache_lock);
+}
+
+static int _devpath_valid(const char *path, dev_t dev)
 {
-	int major, minor;
-	char link[PATH_MAX], path[PATH_MAX], *devname, *devpath = NULL;
 	struct stat st;
-	ssize_t len;
 
-	if (sscanf(dev_id, "%d:%d", &major, &minor) != 2)
-		return NULL;
+	return path && !stat(path, &st) && S_ISBLK(st.st_mode) && st.st_rdev == dev;
+}
 
-	if (snprintf(path, sizeof(path), "/sys/dev/block/%s", dev_id) < 0)
-		return NULL;
+/* Read first "key" prefixed value from sysfs uevent or udev database file. */
+static char *_read_keyed_line(const char *file, const char *key, int skip)
+{
+	char line[PATH_MAX];
+	size_t key_len = strlen(key);
+	char *result = NULL;
+	FILE *f;
 
-	len = readlink(path, link, sizeof(link) - 1);
-	if (len < 0) {
-		/* Without /sys use old scan */
-		if (stat("/sys/dev/block", &st) < 0)
-			return lookup_dev_old(major, minor);
+	if (!(f = fopen(file, "re")))
 		return NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, key_len) || skip-- > 0)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		result = strdup(line + key_len);
+		break;
 	}
 
-	link[len] = '\0';
-	devname = strrchr(link, '/');
-	if (!devname)
+	fclose(f);
+	return result;
+}
+
+/* Kernel node name, /sys/dev/block/MAJ:MIN/uevent DEVNAME (can contain subdirectory) */
+static char *_lookup_dev_sysfs(int major, int minor)
+{
+	char path[PATH_MAX], *devname, *devpath = NULL;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/uevent", major, minor) < 0)
+		return NULL;
+
+	if (!(devname = _read_keyed_line(path, "DEVNAME=", 0)))
 		return NULL;
-	devname++;
 
 	if (dm_is_dm_kernel_name(devname))
 		devpath = dm_device_path("/dev/mapper/", major, minor);
 	else if (snprintf(path, sizeof(path), "/dev/%s", devname) > 0)
 		devpath = strdup(path);
 
-	/*
-	 * Check that path is correct.
-	 */
-	if (devpath && ((stat(devpath, &st) < 0) ||
-	    !S_ISBLK(st.st_mode) ||
-	    (st.st_rdev != makedev(major, minor)))) {
-		free(devpath);
-		/* Should never happen unless user mangles with dev nodes. */
-		return lookup_dev_old(major, minor);
+	free(devname);
+	return devpath;
+}
+
+/* Symlinks recorded by udev in /run/udev/data/bMAJ:MIN */
+static char *_lookup_dev_udev(int major, int minor)
+{
+	char data[PATH_MAX], path[PATH_MAX], *link, *devpath = NULL;
+	dev_t dev = makedev(major, minor);
+	int i;
+
+	if (snprintf(data, sizeof(data), "/run/udev/data/b%d:%d", major, minor) < 0)
+		return NULL;
+
+	for (i = 0; !devpath && (link = _read_keyed_line(data, "S:", i)); i++) {
+		if (snprintf(path, sizeof(path), "/dev/%s", link) > 0 && _devpath_valid(path, dev))
+			devpath = strdup(path);
+		free(link);
 	}
 
 	return devpath;
 }
 
+/*
+ * Returns string pointing to device in /dev according to "major:minor" dev_id
+ */
+char *crypt_lookup_dev(const char *dev_id)
+{
+	int major, minor;
+	char path[PATH_MAX], *devpath;
+	struct stat st;
+	dev_t dev;
+
+	if (sscanf(dev_id, "%d:%d", &major, &minor) != 2)
+		return NULL;
+	dev = makedev(major, minor);
+
+	devpath = _devpath_cache_get(dev);
+	if (_devpath_valid(devpath, dev))
+		return devpath;
+	free(devpath);
+
+	/* Without /sys use old scan */
+	if (stat("/sys/dev/block", &st) < 0) {
+		devpath = lookup_dev_old(major, minor);
+		goto out;
+	}
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d", major, minor) < 0 ||
+	    lstat(path, &st) < 0)
+		return NULL;
+
+	devpath = _lookup_dev_sysfs(major, minor);
+	if (_devpath_valid(devpath, dev))
+		goto out;
+	free(devpath);
+
+	devpath = _lookup_dev_udev(major, minor);
+	if (devpath)
+		goto out;
+
+	/* Should never happen unless user mangles with dev nodes. */
+	devpath = lookup_dev_old(major, minor);
+out:
+	if (devpath)
+		_devpath_cache_set(dev, devpath);
+	return devpath;
+}
+
 static int _read_uint64(const char *sysfs_path, uint64_t *value)
 {
 	char tmp[64] = {0};
@@ -220,6 +330,315 @@ int crypt_dev_is_rotational(int major, int minor)
 	return val ? 1 : 0;
 }
 
+static int _read_int(const char *sysfs_path, int *value)
+{
+	char tmp[64] = {0};
+	int fd, r;
+
+	if ((fd = open(sysfs_path, O_RDONLY)) < 0)
+		return 0;
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+
+	if (r <= 0)
+		return 0;
+
+	return sscanf(tmp, "%d", value) == 1;
+}
+
+/*
+ * NUMA node of the device controller, partition uses node of its disk.
+ * Returns -1 if unknown (no NUMA, device-mapper or virtual device).
+ */
+int crypt_dev_numa_node(int major, int minor)
+{
+	char path[PATH_MAX];
+	int node;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/device/numa_node", major, minor) < 0)
+		return -1;
+
+	if (_read_int(path, &node))
+		return node < 0 ? -1 : node;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/../device/numa_node", major, minor) < 0)
+		return -1;
+
+	if (_read_int(path, &node))
+		return node < 0 ? -1 : node;
+
+	return -1;
+}
+
+static int _sysfs_count_entries(const char *path)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int count = 0;
+
+	if (!(dir = opendir(path)))
+		return -1;
+
+	while ((entry = readdir(dir)))
+		if (entry->d_name[0] != '.')
+			count++;
+	closedir(dir);
+
+	return count;
+}
+
+/*
+ * Number of blk-mq hardware queues, partition uses queues of its disk.
+ * Returns 0 for bio based (device-mapper...) or unknown devices.
+ */
+int crypt_dev_hw_queues(int major, int minor)
+{
+	char path[PATH_MAX];
+	int r;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/mq", major, minor) < 0)
+		return 0;
+
+	if ((r = _sysfs_count_entries(path)) >= 0)
+		return r;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/../mq", major, minor) < 0)
+		return 0;
+
+	return (r = _sysfs_count_entries(path)) > 0 ? r : 0;
+}
+
+/* Queue limit attribute, partition uses queue of its disk. */
+int crypt_dev_queue_limit(int major, int minor, const char *attr, uint64_t *value)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "queue/%s", attr) < 0)
+		return 0;
+
+	if (_sysfs_get_uint64(major, minor, value, path))
+		return 1;
+
+	if (snprintf(path, sizeof(path), "../queue/%s", attr) < 0)
+		return 0;
+
+	return _sysfs_get_uint64(major, minor, value, path);
+}
+
+/*
+ * Per-sector metadata space of device with "nop" integrity profile (metadata
+ * without protection information, opaque to the block layer) and its interval.
+ * Partition uses integrity profile of its disk. Returns 1 if available.
+ */
+int crypt_dev_integrity_metadata(int major, int minor, uint32_t *metadata_bytes, uint32_t *interval_bytes)
+{
+	static const char *prefixes[] = { "", "../" };
+	char path[PATH_MAX], format[32];
+	uint64_t tag_size, interval;
+	unsigned i;
+	int fd, r;
+
+	for (i = 0; i < ARRAY_SIZE(prefixes); i++) {
+		if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/%sintegrity/format",
+			     major, minor, prefixes[i]) < 0)
+			return 0;
+
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+		memset(format, 0, sizeof(format));
+		r = read(fd, format, sizeof(format) - 1);
+		close(fd);
+
+		if (r <= 0 || strncmp(format, "nop", 3) || (format[3] && format[3] != '\n'))
+			return 0;
+
+		if (snprintf(path, sizeof(path), "%sintegrity/tag_size", prefixes[i]) < 0 ||
+		    !_sysfs_get_uint64(major, minor, &tag_size, path) || !tag_size || tag_size > UINT16_MAX)
+			return 0;
+
+		if (snprintf(path, sizeof(path), "%sintegrity/protection_interval_bytes", prefixes[i]) < 0 ||
+		    !_sysfs_get_uint64(major, minor, &interval, path) || !interval || interval > UINT32_MAX)
+			return 0;
+
+		*metadata_bytes = (uint32_t)tag_size;
+		*interval_bytes = (uint32_t)interval;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Inline encryption (blk-crypto) capability of device queue. Supported data
+ * unit sizes of crypto mode are a bitmask in queue/crypto/modes/<mode>.
+ * Partition uses queue of its disk. Returns 1 if the mode is supported
+ * for the data unit size, maximal DUN (IV) width is returned in bits.
+ */
+int crypt_dev_inline_crypto(int major, int minor, const char *mode,
+			    uint32_t data_unit_size, uint32_t *max_dun_bits)
+{
+	static const char *prefixes[] = { "", "../" };
+	char path[PATH_MAX], tmp[64];
+	unsigned long long mask;
+	uint64_t dun_bits;
+	unsigned i;
+	int fd, r;
+
+	for (i = 0; i < ARRAY_SIZE(prefixes); i++) {
+		if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/%squeue/crypto/modes/%s",
+			     major, minor, prefixes[i], mode) < 0)
+			return 0;
+
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+		memset(tmp, 0, sizeof(tmp));
+		r = read(fd, tmp, sizeof(tmp) - 1);
+		close(fd);
+
+		if (r <= 0 || sscanf(tmp, "%llx", &mask) != 1 || !(mask & data_unit_size))
+			return 0;
+
+		if (snprintf(path, sizeof(path), "%squeue/crypto/max_dun_bits", prefixes[i]) < 0 ||
+		    !_sysfs_get_uint64(major, minor, &dun_bits, path) || !dun_bits || dun_bits > 64)
+			return 0;
+
+		*max_dun_bits = (uint32_t)dun_bits;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Set queue attribute of the device, returns 1 on success. */
+int crypt_dev_queue_set(int major, int minor, const char *attr, uint64_t value)
+{
+	char path[PATH_MAX], tmp[32];
+	int fd, len, r;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/queue/%s",
+		     major, minor, attr) < 0)
+		return 0;
+
+	len = snprintf(tmp, sizeof(tmp), "%" PRIu64, value);
+	if (len < 0 || (size_t)len >= sizeof(tmp))
+		return 0;
+
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return 0;
+	r = write(fd, tmp, len);
+	close(fd);
+
+	return r == len;
+}
+
+/*
+ * Set CPU mask of dm-crypt encryption workqueues of the device
+ * (unbound workqueues named kcryptd-<major>:<minor>-<id> in sysfs).
+ * Returns number of updated workqueues, 0 if none found, -1 on write error.
+ */
+int crypt_dev_workqueue_cpumask(int major, int minor, const char *cpumask)
+{
+	char path[PATH_MAX], prefix[32];
+	struct dirent *entry;
+	DIR *dir;
+	size_t prefix_len, len = strlen(cpumask);
+	int fd, r = 0;
+
+	if (snprintf(prefix, sizeof(prefix), "kcryptd-%d:%d-", major, minor) < 0)
+		return -1;
+	prefix_len = strlen(prefix);
+
+	if (!(dir = opendir("/sys/bus/workqueue/devices")))
+		return 0;
+
+	while (r >= 0 && (entry = readdir(dir))) {
+		if (strncmp(entry->d_name, prefix, prefix_len))
+			continue;
+
+		if (snprintf(path, sizeof(path), "/sys/bus/workqueue/devices/%s/cpumask",
+			     entry->d_name) < 0) {
+			r = -1;
+			break;
+		}
+
+		if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+			r = -1;
+			break;
+		}
+		r = write(fd, cpumask, len) == (ssize_t)len ? r + 1 : -1;
+		close(fd);
+	}
+	closedir(dir);
+
+	return r;
+}
+
+/* Number of devices stacked over the device, -1 if unknown */
+int crypt_dev_holders(int major, int minor)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/holders", major, minor) < 0)
+		return -1;
+
+	return _sysfs_count_entries(path);
+}
+
+int crypt_dev_is_dm(int major, int minor)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/dm", major, minor) < 0)
+		return 0;
+
+	return stat(path, &st) < 0 ? 0 : 1;
+}
+
+/*
+ * Block device stat fields (see kernel Documentation/block/stat.rst),
+ * read/write I/Os, merges, sectors, ticks, then in_flight, io_ticks.
+ */
+int crypt_dev_stat(int major, int minor, uint64_t stat[CRYPT_DEV_STAT_FIELDS])
+{
+	char path[PATH_MAX], tmp[512] = {0};
+	int fd, r;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/stat", major, minor) < 0)
+		return 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+
+	if (r <= 0)
+		return 0;
+
+	if (sscanf(tmp, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		   " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		   " %" PRIu64 " %" PRIu64,
+		   &stat[0], &stat[1], &stat[2], &stat[3], &stat[4],
+		   &stat[5], &stat[6], &stat[7], &stat[8], &stat[9]) != CRYPT_DEV_STAT_FIELDS)
+		return 0;
+
+	return 1;
+}
+
+/* Completed I/Os and time spent on them (in ms) from block device stat */
+int crypt_dev_io_stats(int major, int minor, uint64_t *ios, uint64_t *ticks_ms)
+{
+	uint64_t stat[CRYPT_DEV_STAT_FIELDS];
+
+	if (!crypt_dev_stat(major, minor, stat))
+		return 0;
+
+	*ios = stat[0] + stat[4];
+	*ticks_ms = stat[3] + stat[7];
+
+	return 1;
+}
+
 int crypt_dev_is_partition(const char *dev_path)
 {
 	uint64_t val;
@@ -76,11 +76,15 @@ static inline uint32_t act2dmflags(uint32_t act_flags)
 #define DM_INTEGRITY_FIX_HMAC_SUPPORTED (1 << 26) /* hmac covers also superblock */
 #define DM_INTEGRITY_RESET_RECALC_SUPPORTED (1 << 27) /* dm-integrity automatic recalculation supported */
 #define DM_VERITY_TASKLETS_SUPPORTED (1 << 28) /* dm-verity tasklets supported */
+#define DM_INTEGRITY_INLINE_MODE_SUPPORTED (1 << 29) /* dm-integrity inline mode (tags in device metadata) supported */
+#define DM_INLINE_CRYPT_SUPPORTED (1 << 30) /* dm-default-key (inline encryption through blk-crypto) available */
+#define DM_CRYPT_HIGH_PRIORITY_SUPPORTED (1U << 31) /* dm-crypt high_priority workqueues */
 
 typedef enum { DM_CRYPT = 0, DM_VERITY, DM_INTEGRITY, DM_LINEAR, DM_ERROR, DM_ZERO, DM_UNKNOWN } dm_target_type;
 enum tdirection { TARGET_EMPTY = 0, TARGET_SET, TARGET_QUERY };
 
 int dm_flags(struct crypt_device *cd, dm_target_type target, uint32_t *flags);
+int dm_refresh_versions(struct crypt_device *cd);
 
 #define DM_ACTIVE_DEVICE	(1 << 0)
 #define DM_ACTIVE_UUID		(1 << 1)
@@ -172,10 +176,19 @@ struct dm_target {
 	struct dm_target *next;
 };
 
+/* I/O profile of helper devices, queue settings are applied best effort */
+enum dm_io_profile {
+	DM_IO_PROFILE_DEFAULT = 0,	/* read-ahead copied from data device */
+	DM_IO_PROFILE_SEQUENTIAL,	/* large sequential I/O (reencryption helpers) */
+	DM_IO_PROFILE_STACKED,		/* only accessed through top-level device */
+	DM_IO_PROFILE_MINIMAL		/* small short-lived I/O (temporary keystore) */
+};
+
 struct crypt_dm_active_device {
 	uint64_t size;		/* active device size */
 	uint32_t flags;		/* activation flags */
 	const char *uuid;
+	enum dm_io_profile io_profile; /* on create or reload only */
 
 	unsigned holders:1;	/* device holders detected (on query only) */
 
@@ -192,11 +205,13 @@ void dm_backend_exit(struct crypt_device *cd);
 
 int dm_targets_allocate(struct dm_target *first, unsigned count);
 void dm_targets_free(struct crypt_device *cd, struct crypt_dm_active_device *dmd);
+int dm_targets_compact(struct crypt_device *cd, struct crypt_dm_active_device *dmd);
 
 int dm_crypt_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct volume_key *vk, const char *cipher,
 	uint64_t iv_offset, uint64_t data_offset, const char *integrity,
 	uint32_t tag_size, uint32_t sector_size);
+bool dm_crypt_inline_supported(struct crypt_device *cd, const struct crypt_dm_active_device *dmd);
 int dm_verity_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_size,
 	struct device *data_device, struct device *hash_device, struct device *fec_device,
 	const char *root_hash, uint32_t root_hash_size, const char* root_hash_sig_key_desc,
@@ -215,14 +230,30 @@ int dm_zero_target_set(struct dm_target *tgt, uint64_t seg_offset, uint64_t seg_
 int dm_remove_device(struct crypt_device *cd, const char *name, uint32_t flags);
 int dm_status_device(struct crypt_device *cd, const char *name);
 int dm_status_suspended(struct crypt_device *cd, const char *name);
+int dm_device_devno(struct crypt_device *cd, const char *name, int *major, int *minor);
 int dm_status_verity_ok(struct crypt_device *cd, const char *name);
 int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint64_t *count);
+int dm_status_integrity_recalc(struct crypt_device *cd, const char *name,
+			       uint64_t *recalc_sector, uint64_t *data_sectors);
 int dm_query_device(struct crypt_device *cd, const char *name,
 		    uint32_t get_flags, struct crypt_dm_active_device *dmd);
+int dm_query_all_devices(struct crypt_device *cd, uint32_t get_flags,
+			 int (*fn)(struct crypt_device *cd, const char *name, int major, int minor,
+				   int busy, struct crypt_dm_active_device *dmd, void *arg),
+			 void *arg);
 int dm_device_deps(struct crypt_device *cd, const char *name, const char *prefix,
 		   char **names, size_t names_length);
 int dm_create_device(struct crypt_device *cd, const char *name,
 		     const char *type, struct crypt_dm_active_device *dmd);
+/*
+ * Between begin and end, non-private dm-crypt and dm-verity devices created or removed
+ * by this thread share one udev cookie and the outermost end waits for
+ * all of them at once. Settle waits (or only checks if wait is 0, then
+ * returns -EAGAIN while udev is still processing) without ending batch.
+ */
+void dm_udev_batch_begin(void);
+int dm_udev_batch_settle(int wait);
+void dm_udev_batch_end(void);
 int dm_reload_device(struct crypt_device *cd, const char *name,
 		     struct crypt_dm_active_device *dmd, uint32_t dmflags, unsigned resume);
 int dm_suspend_device(struct crypt_device *cd, const char *name, uint32_t dmflags);
@@ -22,10 +22,13 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "utils_io.h"
 
@@ -96,113 +99,226 @@ ssize_t write_buffer_intr(int fd, const void *buf, size_t length, volatile int *
 	return _write_buffer(fd, buf, length, quit);
 }
 
-ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
-			void *orig_buf, size_t length)
+/* Positioned write, does not move file offset (usable from more threads) */
+ssize_t write_buffer_offset(int fd, const void *buf, size_t length, off_t offset)
 {
-	void *hangover_buf = NULL, *buf = NULL;
-	size_t hangover, solid;
-	ssize_t r, ret = -1;
+	size_t write_size = 0;
+	ssize_t w;
+
+	if (fd < 0 || !buf || !length || offset < 0)
+		return -EINVAL;
+
+	do {
+		w = pwrite(fd, buf, length - write_size, offset + (off_t)write_size);
+		if (w < 0 && errno != EINTR)
+			return w;
+		if (w > 0) {
+			write_size += (size_t) w;
+			buf = (const uint8_t*)buf + w;
+		}
+		if (w == 0)
+			return (ssize_t)write_size;
+	} while (write_size != length);
+
+	return (ssize_t)write_size;
+}
+
+/*
+ * Positioned write that is stable on return. RWF_DSYNC persists only the
+ * written range (FUA where the device supports it) instead of flushing
+ * the whole device like fsync. Kernels without RWF_DSYNC use fdatasync.
+ */
+static ssize_t write_buffer_offset_dsync(int fd, const void *buf, size_t length, off_t offset)
+{
+	ssize_t w;
+#ifdef RWF_DSYNC
+	struct iovec iov;
+	size_t write_size = 0;
+
+	if (fd < 0 || !buf || !length || offset < 0)
+		return -EINVAL;
+
+	do {
+		iov.iov_base = (void *)((uintptr_t)buf + write_size);
+		iov.iov_len = length - write_size;
+		w = pwritev2(fd, &iov, 1, offset + (off_t)write_size, RWF_DSYNC);
+		if (w < 0 && !write_size && (errno == EOPNOTSUPP || errno == ENOSYS))
+			goto fallback;
+		if (w < 0 && errno != EINTR)
+			return w;
+		if (w > 0)
+			write_size += (size_t)w;
+		if (w == 0)
+			return (ssize_t)write_size;
+	} while (write_size != length);
 
-	if (fd == -1 || !orig_buf || !bsize || !alignment)
+	return (ssize_t)write_size;
+fallback:
+#endif
+	w = write_buffer_offset(fd, buf, length, offset);
+	if (w > 0 && fdatasync(fd) < 0)
 		return -1;
 
-	hangover = length % bsize;
-	solid = length - hangover;
+	return w;
+}
 
-	if ((size_t)orig_buf & (alignment - 1)) {
-		if (posix_memalign(&buf, alignment, length))
-			return -1;
-		memcpy(buf, orig_buf, length);
-	} else
-		buf = orig_buf;
-
-	if (solid) {
-		r = write_buffer(fd, buf, solid);
-		if (r < 0 || r != (ssize_t)solid)
-			goto out;
-	}
+/* Positioned read, does not move file offset (usable from more threads) */
+ssize_t read_buffer_offset(int fd, void *buf, size_t length, off_t offset)
+{
+	size_t read_size = 0;
+	ssize_t r;
 
-	if (hangover) {
-		if (posix_memalign(&hangover_buf, alignment, bsize))
-			goto out;
-		memset(hangover_buf, 0, bsize);
+	if (fd < 0 || !buf || offset < 0)
+		return -EINVAL;
 
-		r = read_buffer(fd, hangover_buf, bsize);
-		if (r < 0)
-			goto out;
+	do {
+		r = pread(fd, buf, length - read_size, offset + (off_t)read_size);
+		if (r == -1 && errno != EINTR)
+			return r;
+		if (r > 0) {
+			read_size += (size_t)r;
+			buf = (uint8_t*)buf + r;
+		}
+		if (r == 0)
+			return (ssize_t)read_size;
+	} while (read_size != length);
+
+	return (ssize_t)length;
+}
 
-		if (lseek(fd, -(off_t)r, SEEK_CUR) < 0)
-			goto out;
+/*
+ * Unaligned parts of a request are bounced through an on-stack buffer,
+ * so no allocation is needed for the usual block sizes and alignments.
+ * Misaligned user buffers are processed in IO_BOUNCE_SIZE chunks.
+ */
+#define IO_BOUNCE_SIZE  16384
+#define IO_BOUNCE_ALIGN 4096
 
-		memcpy(hangover_buf, (char*)buf + solid, hangover);
+/* Bytes transferred by blockwise functions, see blockwise_stats() */
+static uint64_t blockwise_read_bytes = 0;
+static uint64_t blockwise_write_bytes = 0;
+
+static ssize_t blockwise_account(ssize_t r, bool write)
+{
+	if (r > 0)
+		__atomic_add_fetch(write ? &blockwise_write_bytes : &blockwise_read_bytes,
+				   (uint64_t)r, __ATOMIC_RELAXED);
+	return r;
+}
 
-		r = write_buffer(fd, hangover_buf, bsize);
-		if (r < 0 || r < (ssize_t)hangover)
-			goto out;
+void blockwise_stats(uint64_t *read_bytes, uint64_t *write_bytes, bool reset)
+{
+	if (reset) {
+		*read_bytes = __atomic_exchange_n(&blockwise_read_bytes, 0, __ATOMIC_RELAXED);
+		*write_bytes = __atomic_exchange_n(&blockwise_write_bytes, 0, __ATOMIC_RELAXED);
+	} else {
+		*read_bytes = __atomic_load_n(&blockwise_read_bytes, __ATOMIC_RELAXED);
+		*write_bytes = __atomic_load_n(&blockwise_write_bytes, __ATOMIC_RELAXED);
 	}
-	ret = length;
-out:
-	free(hangover_buf);
-	if (buf != orig_buf)
-		free(buf);
-	return ret;
 }
 
-ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
-		       void *orig_buf, size_t length)
+static ssize_t _write_offset(int fd, const void *buf, size_t length, off_t offset, bool dsync)
+{
+	return dsync ? write_buffer_offset_dsync(fd, buf, length, offset) :
+		       write_buffer_offset(fd, buf, length, offset);
+}
+
+static ssize_t _blockwise_offset(int fd, size_t bsize, size_t alignment,
+				 void *buf, size_t length, off_t offset, bool write, bool dsync)
 {
-	void *hangover_buf = NULL, *buf = NULL;
-	size_t hangover, solid;
+	uint8_t stack_buf[IO_BOUNCE_SIZE + IO_BOUNCE_ALIGN];
+	uint8_t *bounce, *heap_buf = NULL;
+	size_t front, done, n, span, bounce_size;
+	off_t pos;
 	ssize_t r, ret = -1;
 
-	if (fd == -1 || !orig_buf || !bsize || !alignment)
+	if (fd < 0 || !buf || !bsize || !alignment || offset < 0)
 		return -1;
 
-	hangover = length % bsize;
-	solid = length - hangover;
+	if (!length)
+		return 0;
 
-	if ((size_t)orig_buf & (alignment - 1)) {
-		if (posix_memalign(&buf, alignment, length))
-			return -1;
-	} else
-		buf = orig_buf;
+	front = offset % bsize;
 
-	r = read_buffer(fd, buf, solid);
-	if (r < 0 || r != (ssize_t)solid)
-		goto out;
+	/* Aligned request goes directly to the device */
+	if (!front && !(length % bsize) && !((size_t)buf & (alignment - 1))) {
+		if (write)
+			r = _write_offset(fd, buf, length, offset, dsync);
+		else
+			r = read_buffer_offset(fd, buf, length, offset);
+		return r == (ssize_t)length ? blockwise_account(r, write) : -1;
+	}
 
-	if (hangover) {
-		if (posix_memalign(&hangover_buf, alignment, bsize))
-			goto out;
-		r = read_buffer(fd, hangover_buf, bsize);
-		if (r <  0 || r < (ssize_t)hangover)
-			goto out;
+	if (bsize <= IO_BOUNCE_SIZE && alignment <= IO_BOUNCE_ALIGN) {
+		bounce = (uint8_t *)(((uintptr_t)stack_buf + alignment - 1) & ~((uintptr_t)alignment - 1));
+		bounce_size = IO_BOUNCE_SIZE - IO_BOUNCE_SIZE % bsize;
+	} else {
+		if (posix_memalign((void *)&heap_buf, alignment, bsize))
+			return -1;
+		bounce = heap_buf;
+		bounce_size = bsize;
+	}
 
-		memcpy((char *)buf + solid, hangover_buf, hangover);
+	for (done = 0, pos = offset - front; done < length; done += n, pos += span) {
+		n = bounce_size - front;
+		if (n > length - done)
+			n = length - done;
+
+		span = front + n;
+		if (span % bsize)
+			span += bsize - span % bsize;
+
+		if (write) {
+			/* read-modify-write of partially written blocks */
+			if (front || span != front + n) {
+				memset(bounce, 0, span);
+				if (read_buffer_offset(fd, bounce, span, pos) < 0)
+					goto out;
+			}
+			memcpy(bounce + front, (uint8_t *)buf + done, n);
+
+			r = _write_offset(fd, bounce, span, pos, dsync);
+			if (r < 0 || r < (ssize_t)(front + n))
+				goto out;
+		} else {
+			r = read_buffer_offset(fd, bounce, span, pos);
+			if (r < 0 || r < (ssize_t)(front + n))
+				goto out;
+
+			memcpy((uint8_t *)buf + done, bounce + front, n);
+		}
+		front = 0;
 	}
-	ret = length;
+	ret = blockwise_account(length, write);
 out:
-	free(hangover_buf);
-	if (buf != orig_buf) {
-		if (ret != -1)
-			memcpy(orig_buf, buf, length);
-		free(buf);
-	}
+	if (heap_buf)
+		free(heap_buf);
+	else
+		memset(stack_buf, 0, sizeof(stack_buf));
 	return ret;
 }
 
+ssize_t write_blockwise_offset(int fd, size_t bsize, size_t alignment,
+			       void *buf, size_t length, off_t offset)
+{
+	return _blockwise_offset(fd, bsize, alignment, buf, length, offset, true, false);
+}
+
+ssize_t read_blockwise_offset(int fd, size_t bsize, size_t alignment,
+			      void *buf, size_t length, off_t offset)
+{
+	return _blockwise_offset(fd, bsize, alignment, buf, length, offset, false, false);
+}
+
 /*
- * Combines llseek with blockwise write. write_blockwise can already deal with short writes
- * but we also need a function to deal with short writes at the start. But this information
- * is implicitly included in the read/write offset, which can not be set to non-aligned
- * boundaries. Hence, we combine llseek with write.
+ * Variants below keep the file offset semantics of the original implementation
+ * (offset is left at the end of the last accessed block) for sequential users.
  */
-ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
-			      void *buf, size_t length, off_t offset)
+static ssize_t _blockwise_lseek(int fd, size_t bsize, size_t alignment,
+				void *buf, size_t length, off_t offset, bool write, bool dsync)
 {
-	void *frontPadBuf = NULL;
-	size_t frontHang, innerCount = 0;
-	ssize_t r, ret = -1;
+	off_t end;
+	ssize_t r;
 
 	if (fd == -1 || !buf || !bsize || !alignment)
 		return -1;
@@ -213,87 +329,121 @@ ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 	if (offset < 0)
 		return -1;
 
-	frontHang = offset % bsize;
-
-	if (lseek(fd, offset - frontHang, SEEK_SET) < 0)
-		return -1;
-
-	if (frontHang && length) {
-		if (posix_memalign(&frontPadBuf, alignment, bsize))
-			return -1;
+	r = _blockwise_offset(fd, bsize, alignment, buf, length, offset, write, dsync);
+	if (r < 0)
+		return r;
 
-		innerCount = bsize - frontHang;
-		if (innerCount > length)
-			innerCount = length;
+	end = offset + (off_t)length;
+	if (end % bsize)
+		end += bsize - end % bsize;
 
-		r = read_buffer(fd, frontPadBuf, bsize);
-		if (r < 0 || r < (ssize_t)(frontHang + innerCount))
-			goto out;
+	if (lseek(fd, end, SEEK_SET) < 0)
+		return -1;
 
-		memcpy((char*)frontPadBuf + frontHang, buf, innerCount);
+	return r;
+}
 
-		if (lseek(fd, offset - frontHang, SEEK_SET) < 0)
-			goto out;
+ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
+			void *orig_buf, size_t length)
+{
+	off_t offset;
 
-		r = write_buffer(fd, frontPadBuf, bsize);
-		if (r < 0 || r != (ssize_t)bsize)
-			goto out;
+	if (fd == -1)
+		return -1;
 
-		buf = (char*)buf + innerCount;
-		length -= innerCount;
-	}
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return -1;
 
-	ret = length ? write_blockwise(fd, bsize, alignment, buf, length) : 0;
-	if (ret >= 0)
-		ret += innerCount;
-out:
-	free(frontPadBuf);
-	return ret;
+	return _blockwise_lseek(fd, bsize, alignment, orig_buf, length, offset, true, false);
 }
 
-ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
-			     void *buf, size_t length, off_t offset)
+ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
+		       void *orig_buf, size_t length)
 {
-	void *frontPadBuf = NULL;
-	size_t frontHang, innerCount = 0;
-	ssize_t r, ret = -1;
+	off_t offset;
 
-	if (fd == -1 || !buf || bsize <= 0)
+	if (fd == -1)
 		return -1;
 
-	if (offset < 0)
-		offset = lseek(fd, offset, SEEK_END);
-
+	offset = lseek(fd, 0, SEEK_CUR);
 	if (offset < 0)
 		return -1;
 
-	frontHang = offset % bsize;
+	return _blockwise_lseek(fd, bsize, alignment, orig_buf, length, offset, false, false);
+}
 
-	if (lseek(fd, offset - frontHang, SEEK_SET) < 0)
-		return -1;
+/*
+ * Blockwise write at (possibly unaligned) offset. Negative offset is relative
+ * to the end of the device. Unaligned head and tail blocks are handled by
+ * read-modify-write using positioned I/O.
+ */
+ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
+			      void *buf, size_t length, off_t offset)
+{
+	return _blockwise_lseek(fd, bsize, alignment, buf, length, offset, true, false);
+}
 
-	if (frontHang && length) {
-		if (posix_memalign(&frontPadBuf, alignment, bsize))
-			return -1;
+/* Same as above, but every block is stable on return (no device sync needed) */
+ssize_t write_lseek_blockwise_dsync(int fd, size_t bsize, size_t alignment,
+				    void *buf, size_t length, off_t offset)
+{
+	return _blockwise_lseek(fd, bsize, alignment, buf, length, offset, true, true);
+}
+
+ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
+			     void *buf, size_t length, off_t offset)
+{
+	return _blockwise_lseek(fd, bsize, alignment, buf, length, offset, false, false);
+}
 
-		innerCount = bsize - frontHang;
-		if (innerCount > length)
-			innerCount = length;
+/*
+ * Copy length bytes from offset of fd_in to the beginning of (empty) fd_out
+ * inside kernel, data is never copied to userspace. Regular files can share
+ * extents (copy_file_range), block devices are spliced (sendfile).
+ * Returns -ENOTSUP if nothing was copied and read/write fallback should be used.
+ */
+ssize_t copy_file_offset(int fd_in, int fd_out, size_t length, off_t offset)
+{
+	off_t in_off;
+	size_t done = 0;
+	ssize_t r;
 
-		r = read_buffer(fd, frontPadBuf, bsize);
-		if (r < 0 || r < (ssize_t)(frontHang + innerCount))
-			goto out;
+	if (fd_in < 0 || fd_out < 0 || !length || offset < 0)
+		return -EINVAL;
 
-		memcpy(buf, (char*)frontPadBuf + frontHang, innerCount);
+#if HAVE_COPY_FILE_RANGE
+	off_t out_off = 0;
+
+	in_off = offset;
+	while (done < length) {
+		r = copy_file_range(fd_in, &in_off, fd_out, &out_off, length - done, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		done += (size_t)r;
+	}
 
-		buf = (char*)buf + innerCount;
-		length -= innerCount;
+	if (done)
+		return done == length ? (ssize_t)done : -EIO;
+#endif
+	/* sendfile writes at fd_out file offset */
+	if (lseek(fd_out, 0, SEEK_SET) < 0)
+		return -EIO;
+
+	in_off = offset;
+	while (done < length) {
+		r = sendfile(fd_out, fd_in, &in_off, length - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		done += (size_t)r;
 	}
 
-	ret = read_blockwise(fd, bsize, alignment, buf, length);
-	if (ret >= 0)
-		ret += innerCount;
-out:
-	free(frontPadBuf);
-	return ret;
+	if (!done)
+		return -ENOTSUP;
+
+	return done == length ? (ssize_t)done : -EIO;
 }
@@ -24,20 +24,33 @@
 #ifndef _CRYPTSETUP_UTILS_IO_H
 #define _CRYPTSETUP_UTILS_IO_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 ssize_t read_buffer(int fd, void *buf, size_t length);
 ssize_t read_buffer_intr(int fd, void *buf, size_t length, volatile int *quit);
 ssize_t write_buffer(int fd, const void *buf, size_t length);
 ssize_t write_buffer_intr(int fd, const void *buf, size_t length, volatile int *quit);
+ssize_t write_buffer_offset(int fd, const void *buf, size_t length, off_t offset);
+ssize_t read_buffer_offset(int fd, void *buf, size_t length, off_t offset);
 ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
 			void *orig_buf, size_t length);
 ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
 		       void *orig_buf, size_t length);
+ssize_t write_blockwise_offset(int fd, size_t bsize, size_t alignment,
+			       void *buf, size_t length, off_t offset);
+ssize_t read_blockwise_offset(int fd, size_t bsize, size_t alignment,
+			      void *buf, size_t length, off_t offset);
 ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 			      void *buf, size_t length, off_t offset);
+ssize_t write_lseek_blockwise_dsync(int fd, size_t bsize, size_t alignment,
+				    void *buf, size_t length, off_t offset);
 ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 			     void *buf, size_t length, off_t offset);
+ssize_t copy_file_offset(int fd_in, int fd_out, size_t length, off_t offset);
+
+void blockwise_stats(uint64_t *read_bytes, uint64_t *write_bytes, bool reset);
 
 #endif
@@ -82,6 +82,18 @@ static long keyctl_unlink(key_serial_t key, key_serial_t keyring)
 {
 	return syscall(__NR_keyctl, KEYCTL_UNLINK, key, keyring);
 }
+
+/* keyctl_get_keyring_ID */
+static key_serial_t keyctl_get_keyring_id(key_serial_t keyring, int create)
+{
+	return syscall(__NR_keyctl, KEYCTL_GET_KEYRING_ID, keyring, create);
+}
+
+/* keyctl_set_timeout */
+static long keyctl_set_timeout(key_serial_t key, unsigned int timeout)
+{
+	return syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, key, timeout);
+}
 #endif
 
 int keyring_check(void)
@@ -113,6 +125,47 @@ int keyring_add_key_in_thread_keyring(key_type_t ktype, const char *key_desc, co
 #endif
 }
 
+int keyring_add_keys_in_thread_keyring(key_type_t ktype, struct keyring_key *keys, unsigned int count)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t keyring, kid;
+	const char *type_name = key_type_name(ktype);
+	unsigned int i;
+	int r;
+
+	if (!type_name || !keys)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		keys[i].kid = 0;
+		if (!keys[i].key_desc)
+			return -EINVAL;
+	}
+
+	/* resolve (and create) thread keyring once for the whole batch */
+	keyring = keyctl_get_keyring_id(KEY_SPEC_THREAD_KEYRING, 1);
+	if (keyring < 0)
+		return -errno;
+
+	for (i = 0; i < count; i++) {
+		kid = add_key(type_name, keys[i].key_desc, keys[i].key, keys[i].key_size, keyring);
+		if (kid < 0) {
+			r = -errno;
+			while (i--) {
+				keyring_revoke_and_unlink_key_id(keys[i].kid);
+				keys[i].kid = 0;
+			}
+			return r;
+		}
+		keys[i].kid = kid;
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
 /* currently used in client utilities only */
 int keyring_add_key_in_user_keyring(key_type_t ktype, const char *key_desc, const void *key, size_t key_size)
 {
@@ -133,6 +186,35 @@ int keyring_add_key_in_user_keyring(key_type_t ktype, const char *key_desc, cons
 #endif
 }
 
+/* key expires (and is removed by kernel) after timeout seconds */
+int keyring_add_key_in_user_keyring_timeout(key_type_t ktype, const char *key_desc,
+					    const void *key, size_t key_size, unsigned int timeout)
+{
+#ifdef KERNEL_KEYRING
+	const char *type_name = key_type_name(ktype);
+	key_serial_t kid;
+	int r;
+
+	if (!type_name || !key_desc || !timeout)
+		return -EINVAL;
+
+	kid = add_key(type_name, key_desc, key, key_size, KEY_SPEC_USER_KEYRING);
+	if (kid < 0)
+		return -errno;
+
+	if (keyctl_set_timeout(kid, timeout)) {
+		r = -errno;
+		keyctl_revoke(kid);
+		keyctl_unlink(kid, KEY_SPEC_USER_KEYRING);
+		return r;
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
 /* alias for the same code */
 int keyring_get_key(const char *key_desc,
 		    char **key,
@@ -186,20 +268,29 @@ int keyring_get_passphrase(const char *key_desc,
 #endif
 }
 
-static int keyring_revoke_and_unlink_key_type(const char *type_name, const char *key_desc)
+int keyring_key_exists(key_type_t ktype, const char *key_desc)
 {
 #ifdef KERNEL_KEYRING
 	key_serial_t kid;
 
-	if (!type_name || !key_desc)
+	if (!key_desc)
 		return -EINVAL;
 
 	do
-		kid = request_key(type_name, key_desc, NULL, 0);
+		kid = request_key(key_type_name(ktype), key_desc, NULL, 0);
 	while (kid < 0 && errno == EINTR);
 
-	if (kid < 0)
-		return 0;
+	return kid < 0 ? 0 : 1;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int keyring_revoke_and_unlink_key_id(int32_t kid)
+{
+#ifdef KERNEL_KEYRING
+	if (kid <= 0)
+		return -EINVAL;
 
 	if (keyctl_revoke(kid))
 		return -errno;
@@ -219,6 +310,27 @@ static int keyring_revoke_and_unlink_key_type(const char *type_name, const char
 #endif
 }
 
+static int keyring_revoke_and_unlink_key_type(const char *type_name, const char *key_desc)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+
+	if (!type_name || !key_desc)
+		return -EINVAL;
+
+	do
+		kid = request_key(type_name, key_desc, NULL, 0);
+	while (kid < 0 && errno == EINTR);
+
+	if (kid < 0)
+		return 0;
+
+	return keyring_revoke_and_unlink_key_id(kid);
+#else
+	return -ENOTSUP;
+#endif
+}
+
 const char *key_type_name(key_type_t type)
 {
 #ifdef KERNEL_KEYRING
@@ -23,9 +23,17 @@
 #define _UTILS_KEYRING
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum { LOGON_KEY = 0, USER_KEY } key_type_t;
 
+struct keyring_key {
+	const char *key_desc;
+	const void *key;
+	size_t key_size;
+	int32_t kid; /* set on successful upload */
+};
+
 const char *key_type_name(key_type_t ktype);
 
 int keyring_check(void);
@@ -44,12 +52,28 @@ int keyring_add_key_in_thread_keyring(
 	const void *key,
 	size_t key_size);
 
+int keyring_add_keys_in_thread_keyring(
+	key_type_t ktype,
+	struct keyring_key *keys,
+	unsigned int count);
+
 int keyring_add_key_in_user_keyring(
 	key_type_t ktype,
 	const char *key_desc,
 	const void *key,
 	size_t key_size);
 
+int keyring_add_key_in_user_keyring_timeout(
+	key_type_t ktype,
+	const char *key_desc,
+	const void *key,
+	size_t key_size,
+	unsigned int timeout);
+
 int keyring_revoke_and_unlink_key(key_type_t ktype, const char *key_desc);
 
+int keyring_revoke_and_unlink_key_id(int32_t kid);
+
+int keyring_key_exists(key_type_t ktype, const char *key_desc);
+
 #endif
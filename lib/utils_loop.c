@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #ifdef HAVE_SYS_SYSMACROS_H
@@ -51,10 +52,27 @@
 #define LOOP_SET_CAPACITY 0x4C07
 #endif
 
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
 #ifndef LOOP_SET_BLOCK_SIZE
 #define LOOP_SET_BLOCK_SIZE 0x4C09
 #endif
 
+/* Free loop device lookup races with other threads, limit retries */
+#define LOOP_ATTACH_RETRIES 64
+
+/*
+ * Threads of one process (parallel activation) would get the same free
+ * device from loop-control and then race for it, serialize attach here.
+ */
+static pthread_mutex_t _loop_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #ifndef LOOP_CONFIGURE
 #define LOOP_CONFIGURE 0x4C0A
 struct loop_config {
@@ -115,45 +133,27 @@ static char *crypt_loop_get_device(void)
 	return strdup(dev);
 }
 
-int crypt_loop_attach(char **loop, const char *file, int offset,
-		      int autoclear, int *readonly, size_t blocksize)
+static int _loop_attach(char **loop, int file_fd, struct loop_config *config, int readonly)
 {
-	struct loop_config config = {0};
-	char *lo_file_name;
-	int loop_fd = -1, file_fd = -1, r = 1;
+	int loop_fd = -1, r = 1, retries = LOOP_ATTACH_RETRIES;
+	int direct_io = config->info.lo_flags & LO_FLAGS_DIRECT_IO;
 	int fallback = 0;
 
-	*loop = NULL;
-
-	file_fd = open(file, (*readonly ? O_RDONLY : O_RDWR) | O_EXCL);
-	if (file_fd < 0 && (errno == EROFS || errno == EACCES) && !*readonly) {
-		*readonly = 1;
-		file_fd = open(file, O_RDONLY | O_EXCL);
-	}
-	if (file_fd < 0)
-		goto out;
-
-	config.fd = file_fd;
-
-	lo_file_name = (char*)config.info.lo_file_name;
-	lo_file_name[LO_NAME_SIZE-1] = '\0';
-	strncpy(lo_file_name, file, LO_NAME_SIZE-1);
-	config.info.lo_offset = offset;
-	if (autoclear)
-		config.info.lo_flags |= LO_FLAGS_AUTOCLEAR;
-	if (blocksize > SECTOR_SIZE)
-		config.block_size = blocksize;
-
 	while (loop_fd < 0) {
+		if (!retries--)
+			goto out;
 		*loop = crypt_loop_get_device();
 		if (!*loop)
 			goto out;
 
-		loop_fd = open(*loop, *readonly ? O_RDONLY : O_RDWR);
+		loop_fd = open(*loop, readonly ? O_RDONLY : O_RDWR);
 		if (loop_fd < 0)
 			goto out;
-		if (ioctl(loop_fd, LOOP_CONFIGURE, &config) < 0) {
-			if (errno == EINVAL || errno == ENOTTY) {
+		if (ioctl(loop_fd, LOOP_CONFIGURE, config) < 0) {
+			/* some kernels reject direct I/O not possible for backing file */
+			if (errno == EINVAL && (config->info.lo_flags & LO_FLAGS_DIRECT_IO)) {
+				config->info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+			} else if (errno == EINVAL || errno == ENOTTY) {
 				free(*loop);
 				*loop = NULL;
 
@@ -163,8 +163,7 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 				/* kernel doesn't support LOOP_CONFIGURE */
 				fallback = 1;
 				break;
-			}
-			if (errno != EBUSY)
+			} else if (errno != EBUSY)
 				goto out;
 			free(*loop);
 			*loop = NULL;
@@ -175,12 +174,15 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 	}
 
 	if (fallback) {
+		retries = LOOP_ATTACH_RETRIES;
 		while (loop_fd < 0) {
+			if (!retries--)
+				goto out;
 			*loop = crypt_loop_get_device();
 			if (!*loop)
 				goto out;
 
-			loop_fd = open(*loop, *readonly ? O_RDONLY : O_RDWR);
+			loop_fd = open(*loop, readonly ? O_RDONLY : O_RDWR);
 			if (loop_fd < 0)
 				goto out;
 			if (ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0) {
@@ -194,36 +196,103 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 			}
 		}
 
-		if (blocksize > SECTOR_SIZE)
-			(void)ioctl(loop_fd, LOOP_SET_BLOCK_SIZE, (unsigned long)blocksize);
+		if (config->block_size)
+			(void)ioctl(loop_fd, LOOP_SET_BLOCK_SIZE, (unsigned long)config->block_size);
 
-		if (ioctl(loop_fd, LOOP_SET_STATUS64, &config.info) < 0) {
+		/* direct I/O flag cannot be set by status ioctl */
+		config->info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+		if (ioctl(loop_fd, LOOP_SET_STATUS64, &config->info) < 0) {
 			(void)ioctl(loop_fd, LOOP_CLR_FD, 0);
 			goto out;
 		}
+
+		if (direct_io)
+			(void)ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1UL);
+	}
+
+	r = 0;
+out:
+	if (r && loop_fd >= 0) {
+		close(loop_fd);
+		loop_fd = -1;
+	}
+	return loop_fd;
+}
+
+/*
+ * Direct I/O avoids double caching of data (backing file and crypt device),
+ * it requires offset aligned to block size and backing file supporting O_DIRECT.
+ */
+static int loop_direct_io_possible(int file_fd, int offset, size_t blocksize)
+{
+	int flags;
+
+	if (blocksize < SECTOR_SIZE)
+		blocksize = SECTOR_SIZE;
+
+	if (offset % blocksize)
+		return 0;
+
+	flags = fcntl(file_fd, F_GETFL);
+	if (flags < 0 || fcntl(file_fd, F_SETFL, flags | O_DIRECT) < 0)
+		return 0;
+
+	(void)fcntl(file_fd, F_SETFL, flags);
+	return 1;
+}
+
+int crypt_loop_attach(char **loop, const char *file, int offset,
+		      int autoclear, int *readonly, size_t blocksize)
+{
+	struct loop_config config = {0};
+	char *lo_file_name;
+	int loop_fd = -1, file_fd = -1;
+
+	*loop = NULL;
+
+	file_fd = open(file, (*readonly ? O_RDONLY : O_RDWR) | O_EXCL);
+	if (file_fd < 0 && (errno == EROFS || errno == EACCES) && !*readonly) {
+		*readonly = 1;
+		file_fd = open(file, O_RDONLY | O_EXCL);
 	}
+	if (file_fd < 0)
+		goto out;
+
+	config.fd = file_fd;
+
+	lo_file_name = (char*)config.info.lo_file_name;
+	lo_file_name[LO_NAME_SIZE-1] = '\0';
+	strncpy(lo_file_name, file, LO_NAME_SIZE-1);
+	config.info.lo_offset = offset;
+	if (autoclear)
+		config.info.lo_flags |= LO_FLAGS_AUTOCLEAR;
+	if (blocksize > SECTOR_SIZE)
+		config.block_size = blocksize;
+	if (loop_direct_io_possible(file_fd, offset, blocksize))
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+
+	pthread_mutex_lock(&_loop_attach_lock);
+	loop_fd = _loop_attach(loop, file_fd, &config, *readonly);
+	pthread_mutex_unlock(&_loop_attach_lock);
 
 	/* Verify that autoclear is really set */
-	if (autoclear) {
+	if (loop_fd >= 0 && autoclear) {
 		memset(&config.info, 0, sizeof(config.info));
 		if (ioctl(loop_fd, LOOP_GET_STATUS64, &config.info) < 0 ||
 		   !(config.info.lo_flags & LO_FLAGS_AUTOCLEAR)) {
-		(void)ioctl(loop_fd, LOOP_CLR_FD, 0);
-			goto out;
+			(void)ioctl(loop_fd, LOOP_CLR_FD, 0);
+			close(loop_fd);
+			loop_fd = -1;
 		}
 	}
-
-	r = 0;
 out:
-	if (r && loop_fd >= 0)
-		close(loop_fd);
 	if (file_fd >= 0)
 		close(file_fd);
-	if (r && *loop) {
+	if (loop_fd < 0 && *loop) {
 		free(*loop);
 		*loop = NULL;
 	}
-	return r ? -1 : loop_fd;
+	return loop_fd < 0 ? -1 : loop_fd;
 }
 
 int crypt_loop_detach(const char *loop)
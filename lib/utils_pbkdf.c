@@ -87,6 +87,24 @@ static uint32_t adjusted_phys_memory(void)
 	return memory_kb;
 }
 
+/* Total memory for memory-hard KDF running concurrently */
+int verify_pbkdf_memory_limit(struct crypt_device *cd, uint64_t memory_kb,
+			      uint64_t *limit_kb)
+{
+	uint32_t phys_memory_kb = adjusted_phys_memory();
+
+	if (memory_kb > phys_memory_kb) {
+		log_err(cd, _("Requested PBKDF memory limit %" PRIu64 " kB exceeds usable memory %" PRIu32 " kB."),
+			memory_kb, phys_memory_kb);
+		return -EINVAL;
+	}
+
+	if (limit_kb)
+		*limit_kb = memory_kb ?: phys_memory_kb;
+
+	return 0;
+}
+
 /*
  * PBKDF configuration interface
  */
@@ -19,19 +19,129 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include "libcryptsetup.h"
 
 struct safe_allocation {
 	size_t size;
 	bool locked;
+	uint8_t slab_class;
+	uint32_t front; /* padding before header of page aligned allocation */
 	char data[0] __attribute__((aligned(8)));
 };
 #define OVERHEAD offsetof(struct safe_allocation, data)
 
+/*
+ * Small allocations are served from size-classed slabs, these are
+ * mmapped and locked once and never returned, free chunks are wiped
+ * and kept in per class free list (link is stored in wiped data area).
+ */
+#define SLAB_SIZE	(64 * 1024)
+#define SLAB_MIN_CHUNK	64
+#define SLAB_CLASSES	7 /* 64 - 4096 bytes chunks */
+#define SLAB_NONE	0xff
+
+static struct {
+	pthread_mutex_t lock;
+	struct safe_allocation *free_list[SLAB_CLASSES];
+	uint64_t slab_bytes;
+	uint64_t locked_bytes;
+	uint64_t used_bytes;
+	uint64_t allocations;
+} safe_mem = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint8_t slab_class(size_t size)
+{
+	uint8_t c;
+
+	for (c = 0; c < SLAB_CLASSES; c++)
+		if (size + OVERHEAD <= ((size_t)SLAB_MIN_CHUNK << c))
+			return c;
+
+	return SLAB_NONE;
+}
+
+static size_t slab_chunk_size(uint8_t c)
+{
+	return (size_t)SLAB_MIN_CHUNK << c;
+}
+
+/* Must be called with safe_mem.lock held */
+static int slab_refill(uint8_t c)
+{
+	struct safe_allocation *alloc;
+	size_t chunk = slab_chunk_size(c), offset;
+	bool locked;
+	char *base;
+
+	base = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return -ENOMEM;
+
+	/* Ignore failure if it is over limit. */
+	locked = !mlock(base, SLAB_SIZE);
+#ifdef MADV_DONTDUMP
+	(void)madvise(base, SLAB_SIZE, MADV_DONTDUMP);
+#endif
+
+	/* anonymous mapping is already zeroed */
+	for (offset = 0; offset + chunk <= SLAB_SIZE; offset += chunk) {
+		alloc = (struct safe_allocation *)(base + offset);
+		alloc->locked = locked;
+		alloc->slab_class = c;
+		memcpy(alloc->data, &safe_mem.free_list[c], sizeof(alloc));
+		safe_mem.free_list[c] = alloc;
+	}
+
+	safe_mem.slab_bytes += SLAB_SIZE;
+	if (locked)
+		safe_mem.locked_bytes += SLAB_SIZE;
+
+	return 0;
+}
+
+static struct safe_allocation *slab_alloc(size_t size)
+{
+	struct safe_allocation *alloc = NULL;
+	uint8_t c = slab_class(size);
+
+	if (c == SLAB_NONE)
+		return NULL;
+
+	pthread_mutex_lock(&safe_mem.lock);
+	if (safe_mem.free_list[c] || !slab_refill(c)) {
+		alloc = safe_mem.free_list[c];
+		memcpy(&safe_mem.free_list[c], alloc->data, sizeof(alloc));
+		crypt_safe_memzero(alloc->data, sizeof(alloc));
+		alloc->size = size;
+		safe_mem.used_bytes += size;
+		safe_mem.allocations++;
+	}
+	pthread_mutex_unlock(&safe_mem.lock);
+
+	return alloc;
+}
+
+/* Data are already wiped */
+static void slab_free(struct safe_allocation *alloc)
+{
+	pthread_mutex_lock(&safe_mem.lock);
+	safe_mem.used_bytes -= alloc->size;
+	safe_mem.allocations--;
+	alloc->size = 0;
+	memcpy(alloc->data, &safe_mem.free_list[alloc->slab_class], sizeof(alloc));
+	safe_mem.free_list[alloc->slab_class] = alloc;
+	pthread_mutex_unlock(&safe_mem.lock);
+}
+
 /*
  * Replacement for memset(s, 0, n) on stack that can be optimized out
  * Also used in safe allocations for explicit memory wipe.
@@ -55,21 +165,44 @@ void crypt_safe_memzero(void *data, size_t size)
 void *crypt_safe_alloc(size_t size)
 {
 	struct safe_allocation *alloc;
+	long page;
+	void *base;
 
 	if (!size || size > (SIZE_MAX - OVERHEAD))
 		return NULL;
 
-	alloc = malloc(size + OVERHEAD);
-	if (!alloc)
+	alloc = slab_alloc(size);
+	if (alloc)
+		return &alloc->data;
+
+	/*
+	 * Data of large allocations (keyslot AF buffers) are page aligned,
+	 * direct I/O then reads or writes them without bounce buffer copies.
+	 */
+	page = sysconf(_SC_PAGESIZE);
+	if (page < 0 || (size_t)page < OVERHEAD || size > (SIZE_MAX - (size_t)page))
 		return NULL;
 
-	crypt_safe_memzero(alloc, size + OVERHEAD);
+	if (posix_memalign(&base, page, size + page))
+		return NULL;
+
+	crypt_safe_memzero(base, size + page);
+	alloc = (struct safe_allocation *)((char *)base + page - OVERHEAD);
 	alloc->size = size;
+	alloc->slab_class = SLAB_NONE;
+	alloc->front = page - OVERHEAD;
 
 	/* Ignore failure if it is over limit. */
-	if (!mlock(alloc, size + OVERHEAD))
+	if (!mlock(base, size + page))
 		alloc->locked = true;
 
+	pthread_mutex_lock(&safe_mem.lock);
+	safe_mem.used_bytes += size;
+	safe_mem.allocations++;
+	if (alloc->locked)
+		safe_mem.locked_bytes += size + page;
+	pthread_mutex_unlock(&safe_mem.lock);
+
 	/* coverity[leaked_storage] */
 	return &alloc->data;
 }
@@ -78,7 +211,8 @@ void crypt_safe_free(void *data)
 {
 	struct safe_allocation *alloc;
 	volatile size_t *s;
-	void *p;
+	size_t total;
+	void *p, *base;
 
 	if (!data)
 		return;
@@ -88,14 +222,29 @@ void crypt_safe_free(void *data)
 
 	crypt_safe_memzero(data, alloc->size);
 
+	if (alloc->slab_class != SLAB_NONE) {
+		slab_free(alloc);
+		return;
+	}
+
+	base = (char *)alloc - alloc->front;
+	total = alloc->front + OVERHEAD + alloc->size;
+
+	pthread_mutex_lock(&safe_mem.lock);
+	safe_mem.used_bytes -= alloc->size;
+	safe_mem.allocations--;
+	if (alloc->locked)
+		safe_mem.locked_bytes -= total;
+	pthread_mutex_unlock(&safe_mem.lock);
+
 	if (alloc->locked) {
-		munlock(alloc, alloc->size + OVERHEAD);
+		munlock(base, total);
 		alloc->locked = false;
 	}
 
 	s = (volatile size_t *)&alloc->size;
 	*s = 0x55aa55aa;
-	free(alloc);
+	free(base);
 }
 
 void *crypt_safe_realloc(void *data, size_t size)
@@ -104,6 +253,21 @@ void *crypt_safe_realloc(void *data, size_t size)
 	void *new_data;
 	void *p;
 
+	/* Slab chunk is large enough, just update size (tail is always wiped) */
+	if (data && size) {
+		alloc = (struct safe_allocation *)((char *)data - OVERHEAD);
+		if (alloc->slab_class != SLAB_NONE &&
+		    size + OVERHEAD <= slab_chunk_size(alloc->slab_class)) {
+			if (size < alloc->size)
+				crypt_safe_memzero((char *)data + size, alloc->size - size);
+			pthread_mutex_lock(&safe_mem.lock);
+			safe_mem.used_bytes = safe_mem.used_bytes - alloc->size + size;
+			pthread_mutex_unlock(&safe_mem.lock);
+			alloc->size = size;
+			return data;
+		}
+	}
+
 	new_data = crypt_safe_alloc(size);
 
 	if (new_data && data) {
@@ -120,3 +284,18 @@ void *crypt_safe_realloc(void *data, size_t size)
 	crypt_safe_free(data);
 	return new_data;
 }
+
+int crypt_safe_memory_stats(struct crypt_safe_memory_stats *stats)
+{
+	if (!stats)
+		return -EINVAL;
+
+	pthread_mutex_lock(&safe_mem.lock);
+	stats->locked_bytes = safe_mem.locked_bytes;
+	stats->slab_bytes = safe_mem.slab_bytes;
+	stats->used_bytes = safe_mem.used_bytes;
+	stats->allocations = safe_mem.allocations;
+	pthread_mutex_unlock(&safe_mem.lock);
+
+	return 0;
+}
@@ -25,22 +25,52 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+# include <sys/sysmacros.h>     /* for major, minor */
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "utils_storage_wrappers.h"
+#include "utils_threadpool.h"
 #include "internal.h"
 
+/* Buffers smaller than this are always processed by the caller thread */
+#define PARALLEL_CRYPT_MIN (1024 * 1024)
+
+/* io_uring queue depth and size of one request */
+#define ASYNC_IO_DEPTH 32
+#define ASYNC_IO_CHUNK (256 * 1024)
+/* limits for request size taken from striped device (RAID chunk) */
+#define ASYNC_IO_CHUNK_MIN (64 * 1024)
+#define ASYNC_IO_CHUNK_MAX (4 * 1024 * 1024)
+
 struct crypt_storage_wrapper {
 	crypt_storage_wrapper_type type;
 	int dev_fd;
+	bool private_fd;
+	bool drop_cache;
 	int block_size;
 	size_t mem_alignment;
 	uint64_t data_offset;
+#ifdef HAVE_LIBURING
+	struct io_uring *ring;
+	size_t io_chunk;
+#endif
 	union {
 	struct {
 		struct crypt_storage *s;
 		uint64_t iv_start;
+		/* parallel processing, every job has its own cipher and IV context */
+		struct crypt_threadpool *tp;
+		struct crypt_storage **ts;
+		unsigned int jobs;
 	} cb;
 	struct {
 		int dmcrypt_fd;
@@ -49,6 +79,276 @@ struct crypt_storage_wrapper {
 	} u;
 };
 
+static void crypt_storage_parallel_destroy(struct crypt_storage_wrapper *w)
+{
+	unsigned int i;
+
+	crypt_threadpool_destroy(w->u.cb.tp);
+	w->u.cb.tp = NULL;
+
+	/* job 0 uses the main context */
+	for (i = 1; w->u.cb.ts && i < w->u.cb.jobs; i++)
+		crypt_storage_destroy(w->u.cb.ts[i]);
+	free(w->u.cb.ts);
+	w->u.cb.ts = NULL;
+	w->u.cb.jobs = 0;
+}
+
+/* Failure is not fatal, the wrapper then processes all data in caller thread */
+static void crypt_storage_parallel_init(struct crypt_device *cd,
+		struct crypt_storage_wrapper *w,
+		int sector_size,
+		const char *cipher,
+		const char *cipher_mode,
+		const struct volume_key *vk,
+		uint32_t flags)
+{
+	unsigned int threads = crypt_get_threads(cd);
+
+	if (threads < 2)
+		return;
+
+	w->u.cb.ts = calloc(threads, sizeof(*w->u.cb.ts));
+	if (!w->u.cb.ts)
+		return;
+
+	w->u.cb.ts[0] = w->u.cb.s;
+	for (w->u.cb.jobs = 1; w->u.cb.jobs < threads; w->u.cb.jobs++)
+		if (crypt_storage_init(&w->u.cb.ts[w->u.cb.jobs], sector_size, cipher, cipher_mode,
+				       vk->key, vk->keylength, flags & LARGE_IV))
+			break;
+
+	if (w->u.cb.jobs < 2 || crypt_threadpool_init(cd, &w->u.cb.tp, w->u.cb.jobs)) {
+		crypt_storage_parallel_destroy(w);
+		return;
+	}
+
+	log_dbg(cd, "Using %u threads for userspace block cipher.", crypt_threadpool_threads(w->u.cb.tp));
+}
+
+struct crypt_storage_job {
+	struct crypt_storage_wrapper *cw;
+	uint64_t iv_offset;
+	uint64_t length;
+	uint64_t slice;
+	char *buffer;
+	bool encrypt;
+};
+
+static int crypt_storage_job_run(void *arg, unsigned int job)
+{
+	struct crypt_storage_job *j = arg;
+	struct crypt_storage *s = j->cw->u.cb.ts[job];
+	uint64_t start = job * j->slice, length;
+
+	if (start >= j->length)
+		return 0;
+
+	length = j->length - start < j->slice ? j->length - start : j->slice;
+
+	if (j->encrypt)
+		return crypt_storage_encrypt(s, j->iv_offset + (start >> SECTOR_SHIFT),
+					     length, j->buffer + start);
+	return crypt_storage_decrypt(s, j->iv_offset + (start >> SECTOR_SHIFT),
+				     length, j->buffer + start);
+}
+
+/*
+ * Large buffers are split into slices aligned to encryption sector size,
+ * slices are processed in parallel with per-job cipher contexts.
+ */
+static int crypt_storage_crypt(struct crypt_storage_wrapper *cw,
+		uint64_t iv_offset, uint64_t length, char *buffer, bool encrypt)
+{
+	struct crypt_storage_job j = {
+		.cw = cw,
+		.iv_offset = iv_offset,
+		.length = length,
+		.buffer = buffer,
+		.encrypt = encrypt,
+	};
+
+	if (!cw->u.cb.tp || length < PARALLEL_CRYPT_MIN) {
+		if (encrypt)
+			return crypt_storage_encrypt(cw->u.cb.s, iv_offset, length, buffer);
+		return crypt_storage_decrypt(cw->u.cb.s, iv_offset, length, buffer);
+	}
+
+	/* slice must also keep IV offset aligned, use 4096 (max sector size) */
+	j.slice = (length / cw->u.cb.jobs + 4095) & ~(uint64_t)4095;
+
+	return crypt_threadpool_run(cw->u.cb.tp, cw->u.cb.jobs, crypt_storage_job_run, &j);
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * For striped devices (MD RAID, striped LVs) minimum_io_size is the chunk
+ * size, requests are then split on chunk boundaries so every request goes
+ * to one stripe member and all members are busy in parallel.
+ */
+static size_t crypt_storage_async_chunk(struct crypt_device *cd, int fd)
+{
+	uint64_t min_io = 0, opt_io = 0;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode) ||
+	    !crypt_dev_queue_limit(major(st.st_rdev), minor(st.st_rdev), "minimum_io_size", &min_io) ||
+	    !crypt_dev_queue_limit(major(st.st_rdev), minor(st.st_rdev), "optimal_io_size", &opt_io))
+		return ASYNC_IO_CHUNK;
+
+	if (min_io < ASYNC_IO_CHUNK_MIN || min_io > ASYNC_IO_CHUNK_MAX ||
+	    opt_io <= min_io || opt_io % min_io)
+		return ASYNC_IO_CHUNK;
+
+	log_dbg(cd, "Striped device, using %" PRIu64 " bytes requests (stripe %" PRIu64 " bytes).",
+		min_io, opt_io);
+	return min_io;
+}
+
+/* Failure is not fatal, the wrapper then uses synchronous I/O */
+static void crypt_storage_async_init(struct crypt_device *cd,
+		struct crypt_storage_wrapper *w)
+{
+	int r;
+
+	w->ring = malloc(sizeof(*w->ring));
+	if (!w->ring)
+		return;
+
+	r = io_uring_queue_init(ASYNC_IO_DEPTH, w->ring, 0);
+	if (r < 0) {
+		log_dbg(cd, "Cannot initialize io_uring (%d), using synchronous I/O.", r);
+		free(w->ring);
+		w->ring = NULL;
+		return;
+	}
+
+	w->io_chunk = crypt_storage_async_chunk(cd, w->dev_fd);
+	log_dbg(cd, "Using io_uring with queue depth %d.", ASYNC_IO_DEPTH);
+}
+
+static void crypt_storage_async_destroy(struct crypt_storage_wrapper *w)
+{
+	if (!w->ring)
+		return;
+
+	io_uring_queue_exit(w->ring);
+	free(w->ring);
+	w->ring = NULL;
+}
+
+/* Request starting at buffer position pos ends on the next io_chunk device boundary */
+static size_t crypt_storage_async_len(const struct crypt_storage_wrapper *cw,
+		size_t pos, size_t length, off_t offset)
+{
+	size_t chunk = cw->io_chunk - (size_t)((offset + pos) % cw->io_chunk);
+
+	return length - pos < chunk ? length - pos : chunk;
+}
+
+/*
+ * Buffer is split to io_chunk requests, up to ASYNC_IO_DEPTH
+ * requests are in flight. Short transfer stops submitting of next chunks.
+ * The function never returns while any request still uses the buffer.
+ * Returns number of bytes transferred from the buffer start or negative errno.
+ */
+static ssize_t crypt_storage_async_rw(struct crypt_storage_wrapper *cw, int fd,
+		bool write, char *buffer, size_t length, off_t offset)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	size_t pos = 0, start, chunk, end = length;
+	unsigned int queued = 0, inflight = 0;
+	ssize_t r = 0;
+	int i;
+
+	for (;;) {
+		while (r >= 0 && pos < end && queued + inflight < ASYNC_IO_DEPTH &&
+		       (sqe = io_uring_get_sqe(cw->ring))) {
+			chunk = crypt_storage_async_len(cw, pos, length, offset);
+			if (write)
+				io_uring_prep_write(sqe, fd, buffer + pos, chunk, offset + pos);
+			else
+				io_uring_prep_read(sqe, fd, buffer + pos, chunk, offset + pos);
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)pos);
+			pos += chunk;
+			queued++;
+		}
+
+		if (!queued && !inflight)
+			break;
+
+		/* Failed call submitted nothing, queued requests stay in the ring */
+		i = io_uring_submit_and_wait(cw->ring, 1);
+		if (i == -EINTR)
+			continue;
+		if (i < 0) {
+			r = i;
+			break;
+		}
+		queued -= i;
+		inflight += i;
+
+		while (!io_uring_peek_cqe(cw->ring, &cqe)) {
+			start = (uintptr_t)io_uring_cqe_get_data(cqe);
+			chunk = crypt_storage_async_len(cw, start, length, offset);
+			if (cqe->res < 0) {
+				if (r >= 0)
+					r = cqe->res;
+			} else if ((size_t)cqe->res < chunk && start + cqe->res < end)
+				end = start + cqe->res;
+			io_uring_cqe_seen(cw->ring, cqe);
+			inflight--;
+		}
+	}
+
+	/* Submitted requests still access the buffer, reap all of them */
+	while (inflight) {
+		i = io_uring_wait_cqe(cw->ring, &cqe);
+		if (i == -EINTR)
+			continue;
+		if (i < 0)
+			break;
+		io_uring_cqe_seen(cw->ring, cqe);
+		inflight--;
+	}
+
+	/* Stale requests must not be submitted or reaped by the next call */
+	if (queued || inflight) {
+		log_dbg(NULL, "io_uring failed (%zd), using synchronous I/O.", r);
+		crypt_storage_async_destroy(cw);
+	}
+
+	return r < 0 ? r : (ssize_t)end;
+}
+#endif
+
+/* offset is absolute on fd */
+static ssize_t crypt_storage_rw(struct crypt_storage_wrapper *cw, int fd,
+		bool write, void *buffer, size_t length, off_t offset)
+{
+	ssize_t r;
+
+#ifdef HAVE_LIBURING
+	/* io_uring path needs the same alignment as direct-io, no bounce buffer */
+	if (cw->ring && !((uintptr_t)buffer & (cw->mem_alignment - 1)) &&
+	    !(length % cw->block_size) && !(offset % cw->block_size))
+		r = crypt_storage_async_rw(cw, fd, write, buffer, length, offset);
+	else
+#endif
+	if (write)
+		r = write_blockwise_offset(fd, cw->block_size, cw->mem_alignment,
+					   buffer, length, offset);
+	else
+		r = read_blockwise_offset(fd, cw->block_size, cw->mem_alignment,
+					  buffer, length, offset);
+
+	if (r > 0)
+		crypt_stat_add(write ? CRYPT_STAT_STORAGE_WRITE_BYTES : CRYPT_STAT_STORAGE_READ_BYTES, r);
+
+	return r;
+}
+
 static int crypt_storage_backend_init(struct crypt_device *cd,
 		struct crypt_storage_wrapper *w,
 		uint64_t iv_start,
@@ -76,6 +376,9 @@ static int crypt_storage_backend_init(struct crypt_device *cd,
 	w->u.cb.s = s;
 	w->u.cb.iv_start = iv_start;
 
+	if (flags & PARALLEL_CRYPT)
+		crypt_storage_parallel_init(cd, w, sector_size, cipher, cipher_mode, vk, flags);
+
 	return 0;
 }
 
@@ -131,6 +434,7 @@ static int crypt_storage_dmcrypt_init(
 	if (r)
 		return r;
 
+	dmd.io_profile = DM_IO_PROFILE_MINIMAL;
 	r = dm_create_device(cd, cw->u.dm.name, "TEMP", &dmd);
 	if (r < 0) {
 		if (r != -EACCES && r != -ENOTSUP)
@@ -193,12 +497,43 @@ int crypt_storage_wrapper_init(struct crypt_device *cd,
 		goto err;
 	}
 
-	w->dev_fd = device_open(cd, device, open_flags);
+	/* Shared device fd has shared file offset, do not reuse it */
+	if (flags & DIRECT_IO) {
+		w->private_fd = true;
+		w->dev_fd = open(device_path(device), open_flags | O_DIRECT);
+		if (w->dev_fd < 0)
+			log_err(cd, _("Device %s does not support direct-io."), device_path(device));
+	} else if (flags & OPEN_PRIVATE) {
+		w->private_fd = true;
+		w->dev_fd = open(device_path(device), open_flags |
+				 (device_direct_io(device) ? O_DIRECT : 0));
+	} else
+		w->dev_fd = device_open(cd, device, open_flags);
 	if (w->dev_fd < 0) {
 		r = -EINVAL;
 		goto err;
 	}
 
+	/*
+	 * Buffered I/O (device without direct-io support) would pass all data
+	 * through page cache and evict working set of other processes.
+	 * Read-ahead window is enlarged for own fd only, shared fd is used
+	 * for metadata access as well.
+	 */
+	if ((flags & DROP_CACHE) && !(fcntl(w->dev_fd, F_GETFL) & O_DIRECT)) {
+		w->drop_cache = true;
+		if (w->private_fd) {
+			(void)posix_fadvise(w->dev_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			(void)posix_fadvise(w->dev_fd, 0, 0, POSIX_FADV_NOREUSE);
+		}
+		log_dbg(cd, "Buffered I/O, processed data will be dropped from page cache.");
+	}
+
+#ifdef HAVE_LIBURING
+	if (flags & ASYNC_IO)
+		crypt_storage_async_init(cd, w);
+#endif
+
 	if (crypt_is_cipher_null(_cipher)) {
 		log_dbg(cd, "Requested cipher_null, switching to noop wrapper.");
 		w->type = NONE;
@@ -241,11 +576,7 @@ err:
 ssize_t crypt_storage_wrapper_read(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
-	return read_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
+	return crypt_storage_rw(cw, cw->dev_fd, false, buffer, buffer_length,
 			cw->data_offset + offset);
 }
 
@@ -256,26 +587,18 @@ ssize_t crypt_storage_wrapper_read_decrypt(struct crypt_storage_wrapper *cw,
 	ssize_t read;
 
 	if (cw->type == DMCRYPT)
-		return read_lseek_blockwise(cw->u.dm.dmcrypt_fd,
-				cw->block_size,
-				cw->mem_alignment,
-				buffer,
-				buffer_length,
-				offset);
-
-	read = read_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
+		return crypt_storage_rw(cw, cw->u.dm.dmcrypt_fd, false,
+				buffer, buffer_length, offset);
+
+	read = crypt_storage_rw(cw, cw->dev_fd, false, buffer, buffer_length,
 			cw->data_offset + offset);
 	if (cw->type == NONE || read < 0)
 		return read;
 
-	r = crypt_storage_decrypt(cw->u.cb.s,
+	r = crypt_storage_crypt(cw,
 			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
 			read,
-			buffer);
+			buffer, false);
 	if (r)
 		return -EINVAL;
 
@@ -299,10 +622,10 @@ ssize_t crypt_storage_wrapper_decrypt(struct crypt_storage_wrapper *cw,
 		return 0;
 	}
 
-	r = crypt_storage_decrypt(cw->u.cb.s,
+	r = crypt_storage_crypt(cw,
 			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
 			buffer_length,
-			buffer);
+			buffer, false);
 	if (r)
 		return r;
 
@@ -312,11 +635,7 @@ ssize_t crypt_storage_wrapper_decrypt(struct crypt_storage_wrapper *cw,
 ssize_t crypt_storage_wrapper_write(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
-	return write_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
+	return crypt_storage_rw(cw, cw->dev_fd, true, buffer, buffer_length,
 			cw->data_offset + offset);
 }
 
@@ -324,24 +643,16 @@ ssize_t crypt_storage_wrapper_encrypt_write(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length)
 {
 	if (cw->type == DMCRYPT)
-		return write_lseek_blockwise(cw->u.dm.dmcrypt_fd,
-				cw->block_size,
-				cw->mem_alignment,
-				buffer,
-				buffer_length,
-				offset);
+		return crypt_storage_rw(cw, cw->u.dm.dmcrypt_fd, true,
+				buffer, buffer_length, offset);
 
 	if (cw->type == USPACE &&
-	    crypt_storage_encrypt(cw->u.cb.s,
+	    crypt_storage_crypt(cw,
 		    cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
-		    buffer_length, buffer))
+		    buffer_length, buffer, true))
 		return -EINVAL;
 
-	return write_lseek_blockwise(cw->dev_fd,
-			cw->block_size,
-			cw->mem_alignment,
-			buffer,
-			buffer_length,
+	return crypt_storage_rw(cw, cw->dev_fd, true, buffer, buffer_length,
 			cw->data_offset + offset);
 }
 
@@ -354,10 +665,10 @@ ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 	if (cw->type == DMCRYPT)
 		return -ENOTSUP;
 
-	if (crypt_storage_encrypt(cw->u.cb.s,
+	if (crypt_storage_crypt(cw,
 			cw->u.cb.iv_start + (offset >> SECTOR_SHIFT),
 			buffer_length,
-			buffer))
+			buffer, true))
 		return -EINVAL;
 
 	return 0;
@@ -368,12 +679,19 @@ void crypt_storage_wrapper_destroy(struct crypt_storage_wrapper *cw)
 	if (!cw)
 		return;
 
-	if (cw->type == USPACE)
+	if (cw->type == USPACE) {
+		crypt_storage_parallel_destroy(cw);
 		crypt_storage_destroy(cw->u.cb.s);
+	}
 	if (cw->type == DMCRYPT) {
 		close(cw->u.dm.dmcrypt_fd);
 		dm_remove_device(NULL, cw->u.dm.name, CRYPT_DEACTIVATE_FORCE);
 	}
+	if (cw->private_fd && cw->dev_fd >= 0)
+		close(cw->dev_fd);
+#ifdef HAVE_LIBURING
+	crypt_storage_async_destroy(cw);
+#endif
 
 	free(cw);
 }
@@ -388,6 +706,22 @@ int crypt_storage_wrapper_datasync(const struct crypt_storage_wrapper *cw)
 		return fdatasync(cw->dev_fd);
 }
 
+/*
+ * Drop page cache of already processed area (offset is relative to data_offset).
+ * Dirty pages are only scheduled for writeback, call it after datasync.
+ * No-op for direct-io wrapper or if DROP_CACHE was not requested.
+ */
+int crypt_storage_wrapper_drop_cache(const struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length)
+{
+	if (!cw)
+		return -EINVAL;
+	if (!cw->drop_cache || !length)
+		return 0;
+
+	return -posix_fadvise(cw->dev_fd, cw->data_offset + offset, length, POSIX_FADV_DONTNEED);
+}
+
 crypt_storage_wrapper_type crypt_storage_wrapper_get_type(const struct crypt_storage_wrapper *cw)
 {
 	return cw ? cw->type : NONE;
@@ -35,6 +35,11 @@ struct crypt_device;
 #define DISABLE_DMCRYPT	(1 << 2)
 #define OPEN_READONLY	(1 << 3)
 #define LARGE_IV	(1 << 4)
+#define OPEN_PRIVATE	(1 << 5) /* own device fd, wrapper can be used in other thread */
+#define PARALLEL_CRYPT	(1 << 6) /* process large buffers in userspace crypto in parallel */
+#define ASYNC_IO	(1 << 7) /* use io_uring with several requests in flight (if available) */
+#define DIRECT_IO	(1 << 8) /* own device fd always opened with direct-io, fail if not supported */
+#define DROP_CACHE	(1 << 9) /* without direct-io processed data can be dropped from page cache */
 
 typedef enum {
 	NONE = 0,
@@ -70,6 +75,8 @@ ssize_t crypt_storage_wrapper_encrypt(struct crypt_storage_wrapper *cw,
 		off_t offset, void *buffer, size_t buffer_length);
 
 int crypt_storage_wrapper_datasync(const struct crypt_storage_wrapper *cw);
+int crypt_storage_wrapper_drop_cache(const struct crypt_storage_wrapper *cw,
+		off_t offset, size_t length);
 
 crypt_storage_wrapper_type crypt_storage_wrapper_get_type(const struct crypt_storage_wrapper *cw);
 #endif
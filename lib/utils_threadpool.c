@@ -0,0 +1,414 @@
+/*
+ * Simple worker thread pool for parallel processing
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "internal.h"
+#include "utils_threadpool.h"
+
+struct crypt_threadpool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	pthread_t *threads;
+	unsigned int threads_count;
+
+	/* application supplied executor replaces worker threads */
+	crypt_executor_run_fn executor;
+	void *executor_usrptr;
+	unsigned int executor_threads;
+
+	/* current run */
+	crypt_threadpool_fn fn;
+	void *arg;
+	unsigned int jobs;
+	unsigned int next_job;
+	unsigned int active;
+	unsigned int failed_job;
+	int r;
+
+	bool cancelled;
+	bool exit;
+};
+
+/* Must be called with tp->lock held, returns with lock held */
+static void process_jobs(struct crypt_threadpool *tp)
+{
+	unsigned int job;
+	int r;
+
+	while (tp->next_job < tp->jobs) {
+		job = tp->next_job++;
+		tp->active++;
+		pthread_mutex_unlock(&tp->lock);
+
+		r = tp->fn(tp->arg, job);
+
+		pthread_mutex_lock(&tp->lock);
+		tp->active--;
+		if (r < 0) {
+			/* jobs with lower index were already scheduled */
+			tp->next_job = tp->jobs;
+			if (job < tp->failed_job) {
+				tp->failed_job = job;
+				tp->r = r;
+			}
+		}
+	}
+
+	if (!tp->active)
+		pthread_cond_signal(&tp->done_cond);
+}
+
+/* Job wrapper for application executor, keeps failure semantics of the pool */
+static int executor_job(void *arg, unsigned int job)
+{
+	struct crypt_threadpool *tp = arg;
+	bool skip;
+	int r;
+
+	pthread_mutex_lock(&tp->lock);
+	skip = tp->cancelled || job >= tp->jobs || job > tp->failed_job;
+	pthread_mutex_unlock(&tp->lock);
+
+	if (skip)
+		return 0;
+
+	r = tp->fn(tp->arg, job);
+
+	if (r < 0) {
+		pthread_mutex_lock(&tp->lock);
+		if (job < tp->failed_job) {
+			tp->failed_job = job;
+			tp->r = r;
+		}
+		pthread_mutex_unlock(&tp->lock);
+	}
+
+	return r < 0 ? r : 0;
+}
+
+static int executor_run(struct crypt_threadpool *tp, unsigned int jobs,
+			crypt_threadpool_fn fn, void *arg)
+{
+	int r;
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->fn) {
+		pthread_mutex_unlock(&tp->lock);
+		return -EBUSY;
+	}
+	tp->fn = fn;
+	tp->arg = arg;
+	tp->jobs = jobs;
+	tp->failed_job = UINT_MAX;
+	tp->cancelled = false;
+	tp->r = 0;
+	pthread_mutex_unlock(&tp->lock);
+
+	r = tp->executor(jobs, executor_job, tp, tp->executor_usrptr);
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->r)
+		r = tp->r;
+	tp->jobs = 0;
+	tp->fn = NULL;
+	tp->arg = NULL;
+	pthread_mutex_unlock(&tp->lock);
+
+	return r;
+}
+
+#if defined(__linux__) && defined(CPU_SETSIZE)
+/* CPUs of NUMA node allowed for this process, false if none or unknown */
+static bool numa_node_cpuset(int node, cpu_set_t *set)
+{
+	cpu_set_t allowed;
+	char path[64];
+	unsigned int first, last, cpu;
+	int c = 0;
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node) < 0)
+		return false;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	/* cpulist format is "0-3,8,10-11" */
+	CPU_ZERO(set);
+	while (c != EOF && c != '\n' && fscanf(f, "%u", &first) == 1) {
+		last = first;
+		c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%u", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+	}
+	fclose(f);
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return false;
+
+	CPU_AND(set, set, &allowed);
+
+	return CPU_COUNT(set) > 0;
+}
+#endif
+
+static void *worker_thread(void *arg)
+{
+	struct crypt_threadpool *tp = arg;
+
+	pthread_mutex_lock(&tp->lock);
+	while (!tp->exit) {
+		if (tp->next_job < tp->jobs)
+			process_jobs(tp);
+		else
+			pthread_cond_wait(&tp->work_cond, &tp->lock);
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	return NULL;
+}
+
+/*
+ * Worker threads attributes binding them to the device NUMA node CPUs
+ * (see crypt_set_thread_affinity), NULL for default placement.
+ * The calling thread is never pinned.
+ */
+static pthread_attr_t *thread_attr_numa(struct crypt_device *cd, pthread_attr_t *attr)
+{
+#if defined(__linux__) && defined(CPU_SETSIZE)
+	cpu_set_t set;
+	int node = crypt_get_numa_node(cd);
+
+	if (node < 0 || !numa_node_cpuset(node, &set))
+		return NULL;
+
+	if (pthread_attr_init(attr))
+		return NULL;
+
+	if (pthread_attr_setaffinity_np(attr, sizeof(set), &set)) {
+		pthread_attr_destroy(attr);
+		return NULL;
+	}
+
+	log_dbg(cd, "Binding worker threads to %d CPUs of NUMA node %d.", CPU_COUNT(&set), node);
+	return attr;
+#else
+	return NULL;
+#endif
+}
+
+int crypt_threadpool_init(struct crypt_device *cd, struct crypt_threadpool **tp,
+			  unsigned int threads)
+{
+	struct crypt_threadpool *p;
+	pthread_attr_t attr_numa, *attr;
+	unsigned int i;
+
+	if (!tp)
+		return -EINVAL;
+
+	p = crypt_zalloc(sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&p->lock, NULL)) {
+		free(p);
+		return -ENOMEM;
+	}
+	if (pthread_cond_init(&p->work_cond, NULL)) {
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		return -ENOMEM;
+	}
+	if (pthread_cond_init(&p->done_cond, NULL)) {
+		pthread_cond_destroy(&p->work_cond);
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		return -ENOMEM;
+	}
+
+	crypt_get_executor(cd, &p->executor, &p->executor_usrptr);
+	if (p->executor) {
+		p->executor_threads = threads ?: 1;
+		log_dbg(cd, "Thread pool uses application executor.");
+		*tp = p;
+		return 0;
+	}
+
+	/* The calling thread always participates in processing. */
+	if (threads > 1) {
+		p->threads = calloc(threads - 1, sizeof(*p->threads));
+		if (!p->threads) {
+			crypt_threadpool_destroy(p);
+			return -ENOMEM;
+		}
+
+		attr = thread_attr_numa(cd, &attr_numa);
+
+		for (i = 0; i < threads - 1; i++) {
+			if (pthread_create(&p->threads[i], attr, worker_thread, p)) {
+				log_dbg(cd, "Cannot create worker thread, using %u threads.", i + 1);
+				break;
+			}
+			p->threads_count++;
+		}
+
+		if (attr)
+			pthread_attr_destroy(attr);
+	}
+
+	log_dbg(cd, "Thread pool initialized with %u threads.", p->threads_count + 1);
+
+	*tp = p;
+	return 0;
+}
+
+void crypt_threadpool_destroy(struct crypt_threadpool *tp)
+{
+	unsigned int i;
+
+	if (!tp)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->exit = true;
+	pthread_cond_broadcast(&tp->work_cond);
+	pthread_mutex_unlock(&tp->lock);
+
+	for (i = 0; i < tp->threads_count; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	pthread_cond_destroy(&tp->done_cond);
+	pthread_cond_destroy(&tp->work_cond);
+	pthread_mutex_destroy(&tp->lock);
+	free(tp->threads);
+	free(tp);
+}
+
+unsigned int crypt_threadpool_threads(const struct crypt_threadpool *tp)
+{
+	if (tp && tp->executor)
+		return tp->executor_threads;
+
+	return tp ? tp->threads_count + 1 : 1;
+}
+
+void crypt_threadpool_cancel(struct crypt_threadpool *tp)
+{
+	if (!tp)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->next_job = tp->jobs;
+	tp->cancelled = true;
+	pthread_mutex_unlock(&tp->lock);
+}
+
+int crypt_threadpool_start(struct crypt_threadpool *tp, unsigned int jobs,
+			   crypt_threadpool_fn fn, void *arg)
+{
+	unsigned int job;
+	int r;
+
+	if (!fn)
+		return -EINVAL;
+
+	/* Application executor runs synchronously, wait has nothing to join. */
+	if (tp && tp->executor)
+		return executor_run(tp, jobs, fn, arg);
+
+	/* No pool or no worker threads, process everything in caller context. */
+	if (!tp || !tp->threads_count) {
+		for (job = 0; job < jobs; job++)
+			if ((r = fn(arg, job)) < 0)
+				return r;
+		return 0;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	if (tp->fn) {
+		pthread_mutex_unlock(&tp->lock);
+		return -EBUSY;
+	}
+	tp->fn = fn;
+	tp->arg = arg;
+	tp->jobs = jobs;
+	tp->next_job = 0;
+	tp->failed_job = UINT_MAX;
+	tp->cancelled = false;
+	tp->r = 0;
+	pthread_cond_broadcast(&tp->work_cond);
+	pthread_mutex_unlock(&tp->lock);
+
+	return 0;
+}
+
+int crypt_threadpool_wait(struct crypt_threadpool *tp)
+{
+	int r;
+
+	if (!tp || !tp->threads_count)
+		return 0;
+
+	pthread_mutex_lock(&tp->lock);
+	if (!tp->fn) {
+		pthread_mutex_unlock(&tp->lock);
+		return 0;
+	}
+
+	process_jobs(tp);
+	while (tp->active)
+		pthread_cond_wait(&tp->done_cond, &tp->lock);
+
+	r = tp->r;
+	tp->jobs = tp->next_job = 0;
+	tp->fn = NULL;
+	tp->arg = NULL;
+	pthread_mutex_unlock(&tp->lock);
+
+	return r;
+}
+
+int crypt_threadpool_run(struct crypt_threadpool *tp, unsigned int jobs,
+			 crypt_threadpool_fn fn, void *arg)
+{
+	int r;
+
+	r = crypt_threadpool_start(tp, jobs, fn, arg);
+	if (r < 0)
+		return r;
+
+	return crypt_threadpool_wait(tp);
+}
@@ -0,0 +1,62 @@
+/*
+ * Simple worker thread pool for parallel processing
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTILS_THREADPOOL_H
+#define _UTILS_THREADPOOL_H
+
+struct crypt_device;
+struct crypt_threadpool;
+
+/*
+ * Job callback, job is index in <0, jobs) of the current run.
+ * Negative return value stops scheduling of jobs with higher index.
+ */
+typedef int (*crypt_threadpool_fn)(void *arg, unsigned int job);
+
+int crypt_threadpool_init(struct crypt_device *cd, struct crypt_threadpool **tp,
+			  unsigned int threads);
+void crypt_threadpool_destroy(struct crypt_threadpool *tp);
+unsigned int crypt_threadpool_threads(const struct crypt_threadpool *tp);
+
+/*
+ * Run jobs on all pool threads (including the caller thread) and wait
+ * for completion. Returns result of the failed job with the lowest index
+ * or 0 if all jobs succeeded.
+ */
+int crypt_threadpool_run(struct crypt_threadpool *tp, unsigned int jobs,
+			 crypt_threadpool_fn fn, void *arg);
+
+/*
+ * Asynchronous variant, start processes jobs on worker threads only and
+ * returns immediately, so the caller can do other work (I/O) meanwhile.
+ * Wait joins processing of the remaining jobs and returns as run above.
+ * Without worker threads all jobs are processed directly in start.
+ */
+int crypt_threadpool_start(struct crypt_threadpool *tp, unsigned int jobs,
+			   crypt_threadpool_fn fn, void *arg);
+int crypt_threadpool_wait(struct crypt_threadpool *tp);
+
+/*
+ * Stop scheduling of not yet started jobs of the current run,
+ * already running jobs are finished. Safe to call from any thread.
+ */
+void crypt_threadpool_cancel(struct crypt_threadpool *tp);
+
+#endif
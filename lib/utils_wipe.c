@@ -25,12 +25,29 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <linux/fs.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+# include <sys/sysmacros.h>     /* for major, minor */
+#endif
 #include "internal.h"
+#include "utils_threadpool.h"
+#include "utils_bufpool.h"
 
 /* block device zeroout ioctls, introduced in Linux kernel 3.7 */
 #ifndef BLKZEROOUT
 #define BLKZEROOUT _IO(0x12,127)
 #endif
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+
+/* Range for one offloaded zeroout or discard request */
+#define WIPE_OFFLOAD_CHUNK	(UINT64_C(1) << 30)
+/* Sampled blocks verified after discard */
+#define WIPE_VERIFY_SAMPLES	3
+/* Internal flag, caller syncs device itself */
+#define WIPE_NO_SYNC		(UINT32_C(1) << 31)
+/* Maximal wipe block for merged ranges */
+#define WIPE_RANGES_BLOCK	(1024 * 1024)
 
 static int wipe_zeroout(struct crypt_device *cd, int devfd,
 			uint64_t offset, uint64_t length)
@@ -52,6 +69,84 @@ static int wipe_zeroout(struct crypt_device *cd, int devfd,
 	return 0;
 }
 
+static bool wipe_verify_zero(struct crypt_device *cd, int devfd, size_t bsize,
+			     size_t alignment, char *buf, size_t buf_size,
+			     uint64_t offset, uint64_t length)
+{
+	uint64_t sample;
+	size_t i, len;
+	int n;
+
+	len = buf_size < length ? buf_size : length;
+
+	for (n = 0; n < WIPE_VERIFY_SAMPLES; n++) {
+		sample = offset + (length - len) * n / (WIPE_VERIFY_SAMPLES - 1);
+		sample -= sample % bsize;
+		if (read_blockwise_offset(devfd, bsize, alignment, buf, len, sample) != (ssize_t)len)
+			return false;
+		for (i = 0; i < len; i++)
+			if (buf[i]) {
+				log_dbg(cd, "Discarded range at %" PRIu64 " does not read zeroes.", sample);
+				return false;
+			}
+	}
+
+	return true;
+}
+
+/*
+ * Zero whole range by offloaded requests in large chunks, write zeroes
+ * if device supports it, otherwise verified discard (if allowed).
+ * The offset is moved after the last zeroed chunk, rest of range
+ * (from the first failed chunk) is left for normal wipe.
+ */
+static int wipe_zero_offload(struct crypt_device *cd, int devfd, struct device *device,
+			     size_t bsize, size_t alignment, char *buf, size_t buf_size,
+			     uint64_t *offset, uint64_t dev_size, uint32_t flags,
+			     int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			     void *usrptr)
+{
+	uint64_t range[2], write_zeroes = 0, discard = 0;
+	struct stat st;
+	bool use_discard;
+
+	if (fstat(devfd, &st) < 0 || !S_ISBLK(st.st_mode) || (*offset % bsize))
+		return 0;
+
+	(void)crypt_dev_queue_limit(major(st.st_rdev), minor(st.st_rdev), "write_zeroes_max_bytes", &write_zeroes);
+	if (flags & CRYPT_WIPE_ALLOW_DISCARD)
+		(void)crypt_dev_queue_limit(major(st.st_rdev), minor(st.st_rdev), "discard_max_bytes", &discard);
+
+	if (!write_zeroes && !discard)
+		return 0;
+
+	use_discard = !write_zeroes;
+	log_dbg(cd, "Zeroing device %s by offloaded %s.", device_path(device),
+		use_discard ? "discard" : "write zeroes");
+
+	while (dev_size - *offset >= bsize) {
+		range[0] = *offset;
+		range[1] = dev_size - *offset > WIPE_OFFLOAD_CHUNK ? WIPE_OFFLOAD_CHUNK : dev_size - *offset;
+		range[1] -= range[1] % bsize;
+
+		if (use_discard) {
+			if (ioctl(devfd, BLKDISCARD, &range) < 0 ||
+			    !wipe_verify_zero(cd, devfd, bsize, alignment, buf, buf_size, range[0], range[1]))
+				break;
+		} else if (ioctl(devfd, BLKZEROOUT, &range) < 0) {
+			log_dbg(cd, "BLKZEROOUT failed at offset %" PRIu64 ".", range[0]);
+			break;
+		}
+
+		*offset += range[1];
+
+		if (progress && progress(dev_size, *offset, usrptr))
+			return -EINTR;
+	}
+
+	return 0;
+}
+
 /*
  * Wipe using Peter Gutmann method described in
  * https://www.cs.auckland.ac.nz/~pgut001/pubs/secure_del.html
@@ -79,42 +174,145 @@ static void wipeSpecial(char *buffer, size_t buffer_size, unsigned int turn)
 	}
 }
 
-static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
-			      size_t alignment, char *buffer,
-			      uint64_t offset, size_t size)
+/*
+ * Random wipe data are AES-CTR keystream with key and counter seeded once
+ * from RNG, it is much faster than reading RNG for every block.
+ */
+#define WIPE_RNG_KEY_SIZE	32
+#define WIPE_RNG_BLOCK		16
+#define WIPE_RNG_CHUNK		(64 * 1024)
+
+struct wipe_rng {
+	struct crypt_cipher *cipher;
+	uint8_t ctr[WIPE_RNG_BLOCK];
+};
+
+static void wipe_rng_init(struct crypt_device *cd, struct wipe_rng *rng)
 {
-	int r = 0;
-	unsigned int i;
-	ssize_t written;
+	char key[WIPE_RNG_KEY_SIZE];
 
-	for (i = 0; i < 39; ++i) {
-		if (i <  5) {
-			r = crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL);
-		} else if (i >=  5 && i < 32) {
-			wipeSpecial(buffer, size, i - 5);
-			r = 0;
-		} else if (i >= 32 && i < 38) {
-			r = crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL);
-		} else if (i >= 38 && i < 39) {
-			memset(buffer, 0xFF, size);
-			r = 0;
-		}
-		if (r < 0)
-			return -EIO;
+	rng->cipher = NULL;
+
+	if (crypt_random_get(cd, key, sizeof(key), CRYPT_RND_NORMAL) ||
+	    crypt_random_get(cd, (char *)rng->ctr, sizeof(rng->ctr), CRYPT_RND_NORMAL))
+		goto out;
+
+	if (crypt_cipher_init(&rng->cipher, "aes", "ctr", key, sizeof(key))) {
+		log_dbg(cd, "Cannot initialize AES-CTR keystream, using RNG for wipe data.");
+		rng->cipher = NULL;
+	}
+out:
+	crypt_safe_memzero(key, sizeof(key));
+}
+
+static void wipe_rng_destroy(struct wipe_rng *rng)
+{
+	if (rng->cipher)
+		crypt_cipher_destroy(rng->cipher);
+	crypt_safe_memzero(rng, sizeof(*rng));
+}
+
+static void wipe_rng_ctr_add(uint8_t *ctr, uint64_t blocks)
+{
+	int i;
+
+	for (i = WIPE_RNG_BLOCK - 1; i >= 0 && blocks; i--) {
+		blocks += ctr[i];
+		ctr[i] = blocks & 0xff;
+		blocks >>= 8;
+	}
+}
 
-		written = write_lseek_blockwise(fd, bsize, alignment,
-						buffer, size, offset);
-		if (written < 0 || written != (ssize_t)size)
+static int wipe_rng_get(struct crypt_device *cd, struct wipe_rng *rng, char *buf, size_t len)
+{
+	size_t chunk;
+
+	if (!rng->cipher || (len % WIPE_RNG_BLOCK))
+		return crypt_random_get(cd, buf, len, CRYPT_RND_NORMAL) ? -EIO : 0;
+
+	/* Keystream XORed over previous buffer content is still keystream. */
+	while (len) {
+		chunk = len > WIPE_RNG_CHUNK ? WIPE_RNG_CHUNK : len;
+		if (crypt_cipher_encrypt(rng->cipher, buf, buf, chunk,
+					 (const char *)rng->ctr, sizeof(rng->ctr)))
 			return -EIO;
+		wipe_rng_ctr_add(rng->ctr, chunk / WIPE_RNG_BLOCK);
+		buf += chunk;
+		len -= chunk;
 	}
 
-	/* Rewrite it finally with random */
-	if (crypt_random_get(cd, buffer, size, CRYPT_RND_NORMAL) < 0)
-		return -EIO;
+	return 0;
+}
 
-	written = write_lseek_blockwise(fd, bsize, alignment, buffer, size, offset);
-	if (written < 0 || written != (ssize_t)size)
-		return -EIO;
+/*
+ * Gutmann wipe is done in passes over large windows of the device,
+ * so the disk streams sequentially instead of seeking back for every block.
+ * Passes 0-4, 32-37 and final pass 39 are random, 5-31 fixed patterns
+ * and 38 is all ones.
+ */
+#define WIPE_SPECIAL_PASSES	40
+#define WIPE_SPECIAL_WINDOW	(UINT64_C(256) * 1024 * 1024)
+
+static int wipe_special_fill(struct crypt_device *cd, struct wipe_rng *rng,
+			     char *buf, size_t len, unsigned int pass, bool *filled)
+{
+	if (pass < 5 || (pass >= 32 && pass < 38) || pass == 39)
+		return wipe_rng_get(cd, rng, buf, len);
+
+	/* fixed patterns are prepared once per pass */
+	if (*filled)
+		return 0;
+
+	if (pass < 32)
+		wipeSpecial(buf, len, pass - 5);
+	else
+		memset(buf, 0xFF, len);
+	*filled = true;
+
+	return 0;
+}
+
+static int wipe_special_device(struct crypt_device *cd, int devfd, size_t bsize,
+			       size_t alignment, char *sf, size_t wipe_block_size,
+			       uint64_t *offset, uint64_t dev_size, struct wipe_rng *rng,
+			       int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+			       void *usrptr)
+{
+	uint64_t window, off;
+	unsigned int pass;
+	size_t len;
+	bool filled;
+	int r;
+
+	while (*offset < dev_size) {
+		window = dev_size - *offset;
+		if (window > WIPE_SPECIAL_WINDOW)
+			window = WIPE_SPECIAL_WINDOW;
+
+		for (pass = 0; pass < WIPE_SPECIAL_PASSES; pass++) {
+			filled = false;
+			for (off = *offset; off < *offset + window; off += len) {
+				len = wipe_block_size;
+				if (off + len > *offset + window)
+					len = *offset + window - off;
+
+				r = wipe_special_fill(cd, rng, sf, len, pass, &filled);
+				if (r)
+					return -EIO;
+
+				if (write_blockwise_offset(devfd, bsize, alignment, sf,
+							   len, off) != (ssize_t)len) {
+					log_err(cd, _("Device wipe error, offset %" PRIu64 "."), off);
+					return -EIO;
+				}
+			}
+		}
+
+		*offset += window;
+
+		if (progress && progress(dev_size, *offset, usrptr))
+			return -EINTR;
+	}
 
 	return 0;
 }
@@ -122,14 +320,10 @@ static int crypt_wipe_special(struct crypt_device *cd, int fd, size_t bsize,
 static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pattern,
 		      char *sf, size_t device_block_size, size_t alignment,
 		      size_t wipe_block_size, uint64_t offset, bool *need_block_init,
-		      bool blockdev)
+		      bool blockdev, struct wipe_rng *rng)
 {
 	int r;
 
-	if (pattern == CRYPT_WIPE_SPECIAL)
-		return crypt_wipe_special(cd, devfd, device_block_size, alignment,
-					  sf, offset, wipe_block_size);
-
 	if (*need_block_init) {
 		if (pattern == CRYPT_WIPE_ZERO) {
 			memset(sf, 0, wipe_block_size);
@@ -137,8 +331,7 @@ static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pat
 			r = 0;
 		} else if (pattern == CRYPT_WIPE_RANDOM ||
 			   pattern == CRYPT_WIPE_ENCRYPTED_ZERO) {
-			r = crypt_random_get(cd, sf, wipe_block_size,
-					     CRYPT_RND_NORMAL) ? -EIO : 0;
+			r = wipe_rng_get(cd, rng, sf, wipe_block_size);
 			*need_block_init = true;
 		} else
 			r = -EINVAL;
@@ -164,21 +357,146 @@ static int wipe_block(struct crypt_device *cd, int devfd, crypt_wipe_pattern pat
 	return -EIO;
 }
 
-int crypt_wipe_device(struct crypt_device *cd,
+/*
+ * Parallel wipe keeps up to WIPE_QUEUE_DEPTH aligned writes in flight,
+ * every job fills its own buffer and writes it at disjoint offset.
+ * Progress is reported after every round of jobs from caller thread.
+ */
+#define WIPE_QUEUE_DEPTH 8
+
+struct wipe_parallel {
+	struct crypt_device *cd;
+	int devfd;
+	crypt_wipe_pattern pattern;
+	bool blockdev;
+	size_t wipe_block_size;
+	uint64_t offset;
+	unsigned int jobs;
+	char *buffers[WIPE_QUEUE_DEPTH];
+	bool need_block_init[WIPE_QUEUE_DEPTH];
+	struct wipe_rng rng[WIPE_QUEUE_DEPTH];
+};
+
+static int wipe_parallel_job(void *arg, unsigned int job)
+{
+	struct wipe_parallel *wp = arg;
+	uint64_t offset = wp->offset + (uint64_t)job * wp->wipe_block_size;
+	char *buf = wp->buffers[job];
+	int r;
+
+	if (wp->pattern == CRYPT_WIPE_ZERO) {
+		if (wp->need_block_init[job]) {
+			memset(buf, 0, wp->wipe_block_size);
+			wp->need_block_init[job] = false;
+		}
+		if (wp->blockdev && !wipe_zeroout(wp->cd, wp->devfd, offset, wp->wipe_block_size))
+			return 0;
+	} else if ((r = wipe_rng_get(wp->cd, &wp->rng[job], buf, wp->wipe_block_size)))
+		return r;
+
+	if (write_buffer_offset(wp->devfd, buf, wp->wipe_block_size, offset) != (ssize_t)wp->wipe_block_size)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Wipe all whole aligned blocks from *offset, remaining tail is left for
+ * serial wipe. Returns -ENOTSUP if parallel wipe cannot be used.
+ */
+static int wipe_device_parallel(struct crypt_device *cd, int devfd, crypt_wipe_pattern pattern,
+				size_t bsize, size_t alignment, size_t wipe_block_size,
+				uint64_t *offset, uint64_t dev_size, bool blockdev,
+				int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+				void *usrptr)
+{
+	struct crypt_threadpool *tp = NULL;
+	struct wipe_parallel wp = {
+		.cd = cd,
+		.devfd = devfd,
+		.pattern = pattern,
+		.blockdev = blockdev,
+		.wipe_block_size = wipe_block_size,
+	};
+	unsigned int i, jobs, threads = crypt_get_threads(cd);
+	uint64_t blocks;
+	int r = -ENOTSUP;
+
+	if (pattern != CRYPT_WIPE_ZERO && pattern != CRYPT_WIPE_RANDOM &&
+	    pattern != CRYPT_WIPE_ENCRYPTED_ZERO)
+		return -ENOTSUP;
+
+	if (threads < 2 || (*offset % bsize) || (wipe_block_size % bsize) ||
+	    (dev_size - *offset) / wipe_block_size < 2)
+		return -ENOTSUP;
+
+	wp.jobs = threads > WIPE_QUEUE_DEPTH ? WIPE_QUEUE_DEPTH : threads;
+
+	for (i = 0; i < wp.jobs; i++) {
+		wp.buffers[i] = crypt_buffer_get(cd, wipe_block_size, alignment, 0);
+		if (!wp.buffers[i])
+			goto out;
+		memset(wp.buffers[i], 0, wipe_block_size);
+		wp.need_block_init[i] = true;
+		if (pattern != CRYPT_WIPE_ZERO)
+			wipe_rng_init(cd, &wp.rng[i]);
+	}
+
+	if (crypt_threadpool_init(cd, &tp, wp.jobs))
+		goto out;
+
+	log_dbg(cd, "Using %u parallel writes for wipe.", wp.jobs);
+
+	wp.offset = *offset;
+	blocks = (dev_size - wp.offset) / wipe_block_size;
+	r = 0;
+
+	while (blocks) {
+		jobs = blocks > wp.jobs ? wp.jobs : blocks;
+
+		r = crypt_threadpool_run(tp, jobs, wipe_parallel_job, &wp);
+		if (r) {
+			log_err(cd, _("Device wipe error, offset %" PRIu64 "."), wp.offset);
+			break;
+		}
+
+		wp.offset += (uint64_t)jobs * wipe_block_size;
+		blocks -= jobs;
+
+		if (progress && progress(dev_size, wp.offset, usrptr)) {
+			r = -EINTR;
+			break;
+		}
+	}
+
+	*offset = wp.offset;
+out:
+	crypt_threadpool_destroy(tp);
+	for (i = 0; i < wp.jobs; i++) {
+		wipe_rng_destroy(&wp.rng[i]);
+		crypt_buffer_put(cd, wp.buffers[i], wipe_block_size, 0);
+	}
+
+	return r;
+}
+
+static int _crypt_wipe_device(struct crypt_device *cd,
 	struct device *device,
 	crypt_wipe_pattern pattern,
 	uint64_t offset,
 	uint64_t length,
 	size_t wipe_block_size,
+	uint32_t flags,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr)
 {
 	int r, devfd;
 	struct stat st;
-	size_t bsize, alignment;
+	size_t bsize, alignment, sf_size = 0;
 	char *sf = NULL;
 	uint64_t dev_size;
 	bool need_block_init = true;
+	struct wipe_rng rng = {};
 
 	/* Note: LUKS1 calls it with wipe_block not aligned to multiple of bsize */
 	bsize = device_block_size(cd, device);
@@ -217,9 +535,12 @@ int crypt_wipe_device(struct crypt_device *cd,
 		}
 	}
 
-	r = posix_memalign((void **)&sf, alignment, wipe_block_size);
-	if (r)
+	sf_size = wipe_block_size;
+	sf = crypt_buffer_get(cd, sf_size, alignment, 0);
+	if (!sf) {
+		r = -ENOMEM;
 		goto out;
+	}
 
 	if (lseek(devfd, offset, SEEK_SET) < 0) {
 		log_err(cd, _("Cannot seek to device offset."));
@@ -237,12 +558,43 @@ int crypt_wipe_device(struct crypt_device *cd,
 		pattern = CRYPT_WIPE_RANDOM;
 	}
 
+	if (pattern == CRYPT_WIPE_RANDOM || pattern == CRYPT_WIPE_ENCRYPTED_ZERO ||
+	    pattern == CRYPT_WIPE_SPECIAL) {
+		memset(sf, 0, wipe_block_size);
+		wipe_rng_init(cd, &rng);
+	}
+
+	if (pattern == CRYPT_WIPE_SPECIAL) {
+		r = wipe_special_device(cd, devfd, bsize, alignment, sf, wipe_block_size,
+					&offset, dev_size, &rng, progress, usrptr);
+		goto sync;
+	}
+
+	if (pattern == CRYPT_WIPE_ZERO) {
+		r = wipe_zero_offload(cd, devfd, device, bsize, alignment, sf, wipe_block_size,
+				      &offset, dev_size, flags, progress, usrptr);
+		if (r)
+			goto sync;
+	}
+
+	r = wipe_device_parallel(cd, devfd, pattern, bsize, alignment, wipe_block_size,
+				 &offset, dev_size, S_ISBLK(st.st_mode), progress, usrptr);
+	if (r && r != -ENOTSUP)
+		goto sync;
+
+	if (lseek(devfd, offset, SEEK_SET) < 0) {
+		log_err(cd, _("Cannot seek to device offset."));
+		r = -EINVAL;
+		goto sync;
+	}
+	r = 0;
+
 	while (offset < dev_size) {
 		if ((offset + wipe_block_size) > dev_size)
 			wipe_block_size = dev_size - offset;
 
 		r = wipe_block(cd, devfd, pattern, sf, bsize, alignment,
-			       wipe_block_size, offset, &need_block_init, S_ISBLK(st.st_mode));
+			       wipe_block_size, offset, &need_block_init, S_ISBLK(st.st_mode), &rng);
 		if (r) {
 			log_err(cd,_("Device wipe error, offset %" PRIu64 "."), offset);
 			break;
@@ -256,12 +608,28 @@ int crypt_wipe_device(struct crypt_device *cd,
 		}
 	}
 
-	device_sync(cd, device);
+sync:
+	if (!(flags & WIPE_NO_SYNC))
+		device_sync(cd, device);
 out:
-	free(sf);
+	wipe_rng_destroy(&rng);
+	crypt_buffer_put(cd, sf, sf_size, 0);
 	return r;
 }
 
+int crypt_wipe_device(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	return _crypt_wipe_device(cd, device, pattern, offset, length,
+				  wipe_block_size, 0, progress, usrptr);
+}
+
 int crypt_wipe(struct crypt_device *cd,
 	const char *dev_path,
 	crypt_wipe_pattern pattern,
@@ -301,11 +669,111 @@ int crypt_wipe(struct crypt_device *cd,
 	log_dbg(cd, "Wipe [%u] device %s, offset %" PRIu64 ", length %" PRIu64 ", block %zu.",
 		(unsigned)pattern, device_path(device), offset, length, wipe_block_size);
 
-	r = crypt_wipe_device(cd, device, pattern, offset, length,
-			      wipe_block_size, progress, usrptr);
+	/* Internal flag, never accepted from API */
+	r = _crypt_wipe_device(cd, device, pattern, offset, length,
+			       wipe_block_size, flags & ~WIPE_NO_SYNC, progress, usrptr);
 
 	if (dev_path)
 		device_free(cd, device);
 
 	return r;
 }
+
+static int wipe_range_cmp(const void *a, const void *b)
+{
+	const struct crypt_wipe_range *r1 = a, *r2 = b;
+
+	if (r1->offset < r2->offset)
+		return -1;
+	return r1->offset > r2->offset ? 1 : 0;
+}
+
+/*
+ * Wipe more ranges (e.g. keyslot areas) at once. Ranges are sorted
+ * (array is reordered), adjacent or overlapping ones are merged and
+ * the device is synced only once at the end.
+ */
+int crypt_wipe_device_ranges(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	struct crypt_wipe_range *ranges,
+	unsigned int count)
+{
+	uint64_t offset, length;
+	size_t wipe_block_size;
+	unsigned int i;
+	int r = 0;
+
+	if (!ranges || !count)
+		return 0;
+
+	qsort(ranges, count, sizeof(*ranges), wipe_range_cmp);
+
+	for (i = 0; i < count && !r; ) {
+		offset = ranges[i].offset;
+		length = ranges[i].length;
+
+		for (i++; i < count && ranges[i].offset <= offset + length; i++)
+			if (ranges[i].offset + ranges[i].length > offset + length)
+				length = ranges[i].offset + ranges[i].length - offset;
+
+		if (!length)
+			continue;
+
+		wipe_block_size = length > WIPE_RANGES_BLOCK ? WIPE_RANGES_BLOCK : length;
+		log_dbg(cd, "Wiping merged range %" PRIu64 " - %" PRIu64 ".", offset, offset + length);
+
+		r = _crypt_wipe_device(cd, device, pattern, offset, length,
+				       wipe_block_size, WIPE_NO_SYNC, NULL, NULL);
+	}
+
+	device_sync(cd, device);
+
+	return r;
+}
+
+/*
+ * Discard device area (no data are written). Returns -ENOTSUP if the device
+ * does not support discards, the caller should wipe the area instead.
+ */
+int crypt_discard_device(struct crypt_device *cd,
+	struct device *device,
+	uint64_t offset,
+	uint64_t length)
+{
+	uint64_t range[2], discard = 0;
+	struct stat st;
+	int devfd;
+
+	if (MISALIGNED_512(offset) || MISALIGNED_512(length))
+		return -EINVAL;
+
+	if (device_is_locked(device))
+		devfd = device_open_locked(cd, device, O_RDWR);
+	else
+		devfd = device_open(cd, device, O_RDWR);
+	if (devfd < 0)
+		return errno ? -errno : -EINVAL;
+
+	if (fstat(devfd, &st) < 0 || !S_ISBLK(st.st_mode) ||
+	    !crypt_dev_queue_limit(major(st.st_rdev), minor(st.st_rdev), "discard_max_bytes", &discard) ||
+	    !discard) {
+		log_dbg(cd, "Device %s does not support discards.", device_path(device));
+		return -ENOTSUP;
+	}
+
+	while (length) {
+		range[0] = offset;
+		range[1] = length > WIPE_OFFLOAD_CHUNK ? WIPE_OFFLOAD_CHUNK : length;
+
+		if (ioctl(devfd, BLKDISCARD, &range) < 0) {
+			log_dbg(cd, "BLKDISCARD failed at offset %" PRIu64 ".", offset);
+			return -ENOTSUP;
+		}
+
+		offset += range[1];
+		length -= range[1];
+	}
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Process-wide queue of asynchronous library work
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "internal.h"
+#include "utils_workqueue.h"
+
+struct crypt_work {
+	crypt_work_fn fn;
+	void *arg;
+	struct crypt_work *next;
+};
+
+static pthread_mutex_t wq_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct crypt_work *wq_head, *wq_tail;
+static unsigned int wq_threads;
+
+static void *worker(void *arg __attribute__((unused)))
+{
+	struct crypt_work *w;
+
+	pthread_mutex_lock(&wq_lock);
+	while ((w = wq_head)) {
+		wq_head = w->next;
+		if (!wq_head)
+			wq_tail = NULL;
+		pthread_mutex_unlock(&wq_lock);
+
+		w->fn(w->arg);
+		free(w);
+
+		pthread_mutex_lock(&wq_lock);
+	}
+	wq_threads--;
+	pthread_mutex_unlock(&wq_lock);
+
+	return NULL;
+}
+
+int crypt_work_submit(crypt_work_fn fn, void *arg)
+{
+	struct crypt_work *w;
+	unsigned int max_threads;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int r = 0;
+
+	if (!fn)
+		return -EINVAL;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->fn = fn;
+	w->arg = arg;
+	w->next = NULL;
+
+	max_threads = crypt_cpusonline();
+	if (max_threads > CRYPT_WORKQUEUE_MAX_THREADS)
+		max_threads = CRYPT_WORKQUEUE_MAX_THREADS;
+
+	pthread_mutex_lock(&wq_lock);
+	if (wq_tail)
+		wq_tail->next = w;
+	else
+		wq_head = w;
+	wq_tail = w;
+
+	/* Workers exit on empty queue, so every running one is busy */
+	if (wq_threads < max_threads) {
+		if (pthread_attr_init(&attr))
+			r = -ENOMEM;
+		else {
+			if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) ||
+			    pthread_create(&thread, &attr, worker, NULL))
+				r = -ENOMEM;
+			pthread_attr_destroy(&attr);
+		}
+
+		if (!r)
+			wq_threads++;
+		else if (!wq_threads) {
+			/* No worker would ever run the item, queue contains only this one */
+			wq_head = wq_tail = NULL;
+			free(w);
+		} else
+			r = 0;
+	}
+	pthread_mutex_unlock(&wq_lock);
+
+	return r;
+}
@@ -0,0 +1,35 @@
+/*
+ * Process-wide queue of asynchronous library work
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UTILS_WORKQUEUE_H
+#define _UTILS_WORKQUEUE_H
+
+/*
+ * Work item is run once on a worker thread. Workers are shared by all
+ * device contexts, started on demand (up to the number of online CPUs,
+ * at most CRYPT_WORKQUEUE_MAX_THREADS) and they exit when the queue is empty.
+ */
+typedef void (*crypt_work_fn)(void *arg);
+
+#define CRYPT_WORKQUEUE_MAX_THREADS 16
+
+int crypt_work_submit(crypt_work_fn fn, void *arg);
+
+#endif
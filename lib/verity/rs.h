@@ -23,6 +23,8 @@
 #ifndef _LIBFEC_RS_H
 #define _LIBFEC_RS_H
 
+#include <stddef.h>
+
 /* Special reserved value encoding zero in index form. */
 #define A0 (rs->nn)
 
@@ -30,6 +32,10 @@
 
 typedef unsigned char data_t;
 
+/* dst = a ^ c * src in GF(2^8), tbl is nibble multiplication table for c */
+typedef void (*rs_gf_mul_xor_fn)(data_t *dst, const data_t *a, const data_t *src,
+				 const data_t *tbl, size_t len);
+
 /* Reed-Solomon codec control block */
 struct rs {
 	int mm;          /* Bits per symbol */
@@ -42,6 +48,8 @@ struct rs {
 	int prim;        /* Primitive element, index form */
 	int iprim;       /* prim-th root of 1, index form */
 	int pad;         /* Padding bytes in shortened block */
+	data_t *gf_tables; /* Multiplication tables for lanes processing */
+	rs_gf_mul_xor_fn gf_mul_xor; /* Vectorized multiply-accumulate */
 };
 
 static inline int modnn(struct rs *rs, int x)
@@ -60,4 +68,11 @@ void free_rs_char(struct rs *rs);
 void encode_rs_char(struct rs *rs, data_t *data, data_t *parity);
 int decode_rs_char(struct rs *rs, data_t *data);
 
+/* Interleaved codewords, symbol i of codeword b is data[i * stride + b] */
+int init_rs_lanes(struct rs *rs);
+void encode_rs_lanes(struct rs *rs, const data_t *data, size_t stride,
+		     data_t *parity, size_t lanes);
+int decode_rs_lanes(struct rs *rs, data_t *data, size_t stride,
+		    const data_t *parity, size_t lanes, unsigned int *errors);
+
 #endif
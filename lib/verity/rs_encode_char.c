@@ -128,6 +128,11 @@ struct rs *init_rs_char(int symsize, int gfpoly, int fcr, int prim, int nroots,
 	for (i = 0; i <= nroots; i++)
 		rs->genpoly[i] = rs->index_of[rs->genpoly[i]];
 
+	if (init_rs_lanes(rs)) {
+		free_rs_char(rs);
+		return NULL;
+	}
+
 	return rs;
 }
 
@@ -139,6 +144,7 @@ void free_rs_char(struct rs *rs)
 	free(rs->alpha_to);
 	free(rs->index_of);
 	free(rs->genpoly);
+	free(rs->gf_tables);
 	free(rs);
 }
 
@@ -0,0 +1,303 @@
+/*
+ * Reed-Solomon codec, vectorized processing of interleaved codewords
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "rs.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RS_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define RS_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Codewords are processed in lanes, symbol i of all codewords (lanes) is
+ * stored contiguously. Multiplication by a constant in GF(2^8) is done
+ * by two 16 entry lookup tables (for low and high nibble), that fits
+ * byte shuffle instructions (PSHUFB, TBL).
+ *
+ * Tables are stored in rs->gf_tables, nroots tables for generator
+ * polynomial coefficients (encoding) followed by nroots tables for
+ * syndrome roots (decoding).
+ */
+#define RS_TABLE_SIZE 32
+#define RS_LANES 128
+
+static data_t gf_mul(struct rs *rs, data_t a, data_t b)
+{
+	if (!a || !b)
+		return 0;
+	return rs->alpha_to[modnn(rs, rs->index_of[a] + rs->index_of[b])];
+}
+
+static void gf_table(struct rs *rs, data_t *tbl, data_t c)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		tbl[i] = gf_mul(rs, c, i);
+		tbl[16 + i] = gf_mul(rs, c, i << 4);
+	}
+}
+
+/* dst = a ^ c * src, c is defined by tbl */
+static void gf_mul_xor_generic(data_t *dst, const data_t *a, const data_t *src,
+			       const data_t *tbl, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = a[i] ^ tbl[src[i] & 0x0f] ^ tbl[16 + (src[i] >> 4)];
+}
+
+#if RS_SIMD_X86
+__attribute__((target("ssse3")))
+static void gf_mul_xor_ssse3(data_t *dst, const data_t *a, const data_t *src,
+			     const data_t *tbl, size_t len)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)tbl);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(tbl + 16));
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i s, r;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		r = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+				  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		r = _mm_xor_si128(r, _mm_loadu_si128((const __m128i *)(a + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), r);
+	}
+
+	gf_mul_xor_generic(dst + i, a + i, src + i, tbl, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_xor_avx2(data_t *dst, const data_t *a, const data_t *src,
+			    const data_t *tbl, size_t len)
+{
+	__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tbl));
+	__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tbl + 16)));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i s, r;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		r = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+				     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+		r = _mm256_xor_si256(r, _mm256_loadu_si256((const __m256i *)(a + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), r);
+	}
+	_mm256_zeroupper();
+
+	gf_mul_xor_generic(dst + i, a + i, src + i, tbl, len - i);
+}
+#endif
+
+#if RS_SIMD_NEON
+static void gf_mul_xor_neon(data_t *dst, const data_t *a, const data_t *src,
+			    const data_t *tbl, size_t len)
+{
+	uint8x16_t lo = vld1q_u8(tbl);
+	uint8x16_t hi = vld1q_u8(tbl + 16);
+	uint8x16_t mask = vdupq_n_u8(0x0f);
+	uint8x16_t s, r;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = vld1q_u8(src + i);
+		r = veorq_u8(vqtbl1q_u8(lo, vandq_u8(s, mask)),
+			     vqtbl1q_u8(hi, vshrq_n_u8(s, 4)));
+		vst1q_u8(dst + i, veorq_u8(r, vld1q_u8(a + i)));
+	}
+
+	gf_mul_xor_generic(dst + i, a + i, src + i, tbl, len - i);
+}
+#endif
+
+static rs_gf_mul_xor_fn gf_mul_xor_select(void)
+{
+#if RS_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return gf_mul_xor_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return gf_mul_xor_ssse3;
+#elif RS_SIMD_NEON
+	return gf_mul_xor_neon;
+#endif
+	return gf_mul_xor_generic;
+}
+
+int init_rs_lanes(struct rs *rs)
+{
+	int i;
+
+	rs->gf_mul_xor = gf_mul_xor_select();
+	if (!rs->nroots)
+		return 0;
+
+	rs->gf_tables = malloc(2 * rs->nroots * RS_TABLE_SIZE);
+	if (!rs->gf_tables)
+		return -1;
+
+	/* generator polynomial coefficients, genpoly is in index form */
+	for (i = 0; i < rs->nroots; i++)
+		gf_table(rs, &rs->gf_tables[i * RS_TABLE_SIZE], rs->alpha_to[rs->genpoly[i]]);
+
+	/* syndrome roots */
+	for (i = 0; i < rs->nroots; i++)
+		gf_table(rs, &rs->gf_tables[(rs->nroots + i) * RS_TABLE_SIZE],
+			 rs->alpha_to[modnn(rs, (rs->fcr + i) * rs->prim)]);
+
+	return 0;
+}
+
+static const data_t zero_lanes[RS_LANES];
+
+static void encode_rs_lanes_chunk(struct rs *rs, const data_t *data, size_t stride,
+				  data_t *parity, size_t lanes)
+{
+	data_t rows[rs->nroots][RS_LANES], *fb;
+	int i, j, start = 0, n = rs->nroots;
+	size_t b;
+
+	memset(rows, 0, sizeof(rows));
+
+	/*
+	 * The same LFSR as in encode_rs_char(), parity registers are
+	 * a ring buffer of rows, rows[start] is parity[0].
+	 */
+	for (i = 0; i < rs->nn - rs->nroots - rs->pad; i++, data += stride) {
+		fb = rows[start];
+		for (b = 0; b < lanes; b++)
+			fb[b] ^= data[b];
+
+		for (j = 1; j < n; j++)
+			rs->gf_mul_xor(rows[(start + j) % n], rows[(start + j) % n], fb,
+				       &rs->gf_tables[(n - j) * RS_TABLE_SIZE], lanes);
+
+		/* feedback row becomes the last parity register */
+		rs->gf_mul_xor(fb, zero_lanes, fb, rs->gf_tables, lanes);
+		start = (start + 1) % n;
+	}
+
+	for (b = 0; b < lanes; b++)
+		for (j = 0; j < n; j++)
+			parity[b * n + j] = rows[(start + j) % n][b];
+}
+
+/*
+ * Encode lanes codewords, symbol i of codeword b is data[i * stride + b].
+ * Parity of codeword b is stored in parity[b * nroots], as produced
+ * by encode_rs_char().
+ */
+void encode_rs_lanes(struct rs *rs, const data_t *data, size_t stride,
+		     data_t *parity, size_t lanes)
+{
+	size_t b, n;
+
+	if (!rs->nroots)
+		return;
+
+	for (b = 0; b < lanes; b += n) {
+		n = RS_MIN(lanes - b, RS_LANES);
+		encode_rs_lanes_chunk(rs, data + b, stride, parity + b * rs->nroots, n);
+	}
+}
+
+static int decode_rs_lanes_chunk(struct rs *rs, data_t *data, size_t stride,
+				 const data_t *parity, size_t lanes, unsigned int *errors)
+{
+	data_t syn[rs->nroots][RS_LANES], row[RS_LANES], cw[rs->nn];
+	const data_t *in;
+	int i, j, k = rs->nn - rs->nroots - rs->pad, r;
+	size_t b;
+	data_t nonzero;
+
+	/* syndromes by Horner scheme, the same as in decode_rs_char() */
+	for (i = 0; i < rs->nroots; i++)
+		memcpy(syn[i], data, lanes);
+
+	for (j = 1; j < rs->nn - rs->pad; j++) {
+		if (j < k)
+			in = &data[j * stride];
+		else {
+			for (b = 0; b < lanes; b++)
+				row[b] = parity[b * rs->nroots + j - k];
+			in = row;
+		}
+
+		for (i = 0; i < rs->nroots; i++)
+			rs->gf_mul_xor(syn[i], in, syn[i],
+				       &rs->gf_tables[(rs->nroots + i) * RS_TABLE_SIZE], lanes);
+	}
+
+	/* only codewords with errors are processed by the scalar decoder */
+	for (b = 0; b < lanes; b++) {
+		for (i = 0, nonzero = 0; i < rs->nroots; i++)
+			nonzero |= syn[i][b];
+		if (!nonzero)
+			continue;
+
+		for (j = 0; j < k; j++)
+			cw[j] = data[j * stride + b];
+		memcpy(&cw[k], &parity[b * rs->nroots], rs->nroots);
+
+		r = decode_rs_char(rs, cw);
+		if (r < 0)
+			return r;
+		*errors += r;
+
+		for (j = 0; j < k; j++)
+			data[j * stride + b] = cw[j];
+	}
+
+	return 0;
+}
+
+/*
+ * Decode lanes codewords in the same layout as encode_rs_lanes(),
+ * data are corrected in place. Returns negative value if any codeword
+ * cannot be repaired, otherwise adds number of errors to errors.
+ */
+int decode_rs_lanes(struct rs *rs, data_t *data, size_t stride,
+		    const data_t *parity, size_t lanes, unsigned int *errors)
+{
+	size_t b, n;
+	int r;
+
+	if (!rs->nroots)
+		return 0;
+
+	for (b = 0; b < lanes; b += n) {
+		n = RS_MIN(lanes - b, RS_LANES);
+		r = decode_rs_lanes_chunk(rs, data + b, stride, parity + b * rs->nroots, n, errors);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
@@ -25,11 +25,14 @@
 #include <stdint.h>
 
 #define VERITY_MAX_HASH_TYPE 1
+/* Default size limit of hash tree created in memory */
+#define VERITY_STAGE_MEMORY_DEFAULT (UINT64_C(256) * 1024 * 1024)
 #define VERITY_BLOCK_SIZE_OK(x)	((x) % 512 || (x) < 512 || \
 				(x) > (512 * 1024) || (x) & ((x)-1))
 
 struct crypt_device;
 struct crypt_params_verity;
+struct crypt_verity_block_range;
 struct device;
 
 int VERITY_read_sb(struct crypt_device *cd,
@@ -56,17 +59,84 @@ int VERITY_verify(struct crypt_device *cd,
 		const char *root_hash,
 		size_t root_hash_size);
 
+int VERITY_verify_corrupted(struct crypt_device *cd,
+			    struct crypt_params_verity *verity_hdr,
+			    const char *root_hash,
+			    size_t root_hash_size,
+			    struct crypt_verity_block_range **ranges,
+			    size_t *ranges_count);
+
+int VERITY_verify_sample(struct crypt_device *cd,
+			 struct crypt_params_verity *verity_hdr,
+			 const char *root_hash,
+			 size_t root_hash_size,
+			 uint32_t percent,
+			 uint64_t seed,
+			 uint64_t *verified_blocks);
+
 int VERITY_create(struct crypt_device *cd,
 		  struct crypt_params_verity *verity_hdr,
 		  const char *root_hash,
 		  size_t root_hash_size);
 
+int VERITY_create_fec(struct crypt_device *cd,
+		      struct crypt_params_verity *verity_hdr,
+		      struct device *fec_device,
+		      const char *root_hash,
+		      size_t root_hash_size);
+
+int VERITY_create_stream(struct crypt_device *cd,
+			 struct crypt_params_verity *params,
+			 int data_fd,
+			 struct device *data_device,
+			 uint64_t max_blocks,
+			 char *root_hash,
+			 size_t root_hash_size);
+
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_block_range *ranges,
+		  size_t ranges_count,
+		  char *root_hash,
+		  size_t root_hash_size);
+
 int VERITY_FEC_process(struct crypt_device *cd,
 		      struct crypt_params_verity *params,
 		      struct device *fec_device,
 		      int check_fec,
 		      unsigned int *errors);
 
+int VERITY_FEC_repair(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const struct crypt_verity_block_range *ranges,
+		      size_t ranges_count,
+		      uint64_t *repaired);
+
+/*
+ * Receiver of data area read by FEC encoder. Data block n of RS round r
+ * (column n) is data block n * column_blocks + r, one window of rounds
+ * gives a run of consecutive data blocks for every column.
+ */
+struct verity_fec_tap {
+	int (*init)(void *arg, uint64_t column_blocks, uint64_t window_blocks);
+	/* called from worker threads, columns of one window in parallel */
+	int (*job)(void *arg, unsigned int column, uint64_t block,
+		   const uint8_t *data, uint64_t blocks);
+	/* called after every window with number of completed rounds */
+	int (*flush)(void *arg, uint64_t rounds);
+	void *arg;
+};
+
+int VERITY_FEC_encode_data(struct crypt_device *cd,
+			   struct crypt_params_verity *params,
+			   struct device *fec_device,
+			   struct verity_fec_tap *tap);
+
+int VERITY_FEC_encode_hash(struct crypt_device *cd,
+			   struct crypt_params_verity *params,
+			   struct device *fec_device);
+
 uint64_t VERITY_hash_offset_block(struct crypt_params_verity *params);
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params);
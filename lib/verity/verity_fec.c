@@ -21,10 +21,12 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "verity.h"
 #include "internal.h"
 #include "rs.h"
+#include "utils_threadpool.h"
 
 /* ecc parameters */
 #define FEC_RSM 255
@@ -33,20 +35,24 @@
 
 #define FEC_INPUT_DEVICES 2
 
+/* size of RS input processed in one parallel batch */
+#define FEC_BATCH_SIZE (16 * 1024 * 1024)
+
 /* parameters to init_rs_char */
-#define FEC_PARAMS(roots) \
+#define FEC_PARAMS(roots, pad) \
     8,          /* symbol size in bits */ \
     0x11d,      /* field generator polynomial coefficients */ \
     0,          /* first root of the generator */ \
     1,          /* primitive element to generate polynomial roots */ \
     (roots),    /* polynomial degree (number of roots) */ \
-    0           /* padding bytes at the front of shortened block */
+    (pad)       /* padding bytes at the front of shortened block */
 
 struct fec_input_device {
 	struct device *device;
 	int fd;
 	uint64_t start;
 	uint64_t count;
+	bool zero;	/* area is part of RS blocks, but encoded as zeros */
 };
 
 struct fec_context {
@@ -56,10 +62,28 @@ struct fec_context {
 	uint64_t blocks;
 	uint64_t rounds;
 	uint32_t block_size;
+	uint32_t first_block;	/* RS blocks before are all zeros (shortened code) */
 	struct fec_input_device *inputs;
 	size_t ninputs;
 };
 
+/*
+ * Parity is linear in its input, so data and hash area can be encoded
+ * in separate passes: data area with zero hash area while the hash tree
+ * is being built from the same reads, then the hash area alone added
+ * to the stored parity.
+ */
+struct fec_pass {
+	bool data;			/* hash area is encoded as zeros */
+	bool hash;			/* data area is encoded as zeros, parity is added */
+	struct verity_fec_tap *tap;	/* receives data area read in data pass */
+
+	/* repair pass, only rounds with listed blocks are decoded and written back */
+	const struct crypt_verity_block_range *ranges;
+	size_t ranges_count;
+	uint64_t repaired;
+};
+
 /* computes ceil(x / y) */
 static inline uint64_t FEC_div_round_up(uint64_t x, uint64_t y)
 {
@@ -73,34 +97,159 @@ static inline uint64_t FEC_interleave(struct fec_context *ctx, uint64_t offset)
 			(offset % ctx->rsn) * ctx->rounds * ctx->block_size;
 }
 
-/* returns data for a byte at the specified RS offset */
+/*
+ * returns data for a byte at the specified RS offset, the same byte
+ * of consecutive rounds is stored sequentially, so count can cover
+ * more rounds (and span more input devices)
+ */
 static int FEC_read_interleaved(struct fec_context *ctx, uint64_t i,
 				void *output, size_t count)
 {
-	size_t n;
-	uint64_t offset = FEC_interleave(ctx, i);
+	size_t n, len;
+	uint64_t pos, offset = FEC_interleave(ctx, i);
+	uint8_t *out = output;
+
+	for (n = 0, pos = 0; count && n < ctx->ninputs; pos += ctx->inputs[n++].count) {
+		if (offset >= pos + ctx->inputs[n].count)
+			continue;
+
+		len = ctx->inputs[n].count - (offset - pos);
+		if (len > count)
+			len = count;
+
+		if (ctx->inputs[n].zero) {
+			memset(out, 0, len);
+			goto next;
+		}
+
+		/* FIXME: read_lseek_blockwise candidate */
+		if (lseek(ctx->inputs[n].fd, ctx->inputs[n].start + offset - pos, SEEK_SET) < 0)
+			return -1;
+		if (read_buffer(ctx->inputs[n].fd, out, len) != (ssize_t)len)
+			return -1;
+next:
+		out += len;
+		offset += len;
+		count -= len;
+	}
 
 	/* offsets outside input area are assumed to contain zeros */
-	if (offset >= ctx->size) {
-		memset(output, 0, count);
+	memset(out, 0, count);
+	return 0;
+}
+
+/* one batch of RS rounds processed in parallel, one round per job */
+struct fec_batch {
+	struct fec_context *ctx;
+	struct rs *rs;
+	uint8_t *data;
+	size_t stride;
+	uint8_t *parity;
+	unsigned int *errors;
+	int decode;
+
+	/* data area passed to tap, one job per RS block position */
+	struct verity_fec_tap *tap;
+	uint64_t first_round;
+	unsigned int rounds;
+	uint64_t data_blocks;
+};
+
+static int FEC_tap_job(struct fec_batch *fb, unsigned int i)
+{
+	struct fec_context *ctx = fb->ctx;
+	uint64_t block = i * ctx->rounds + fb->first_round, blocks = fb->rounds;
+
+	if (block >= fb->data_blocks)
+		return 0;
+	if (blocks > fb->data_blocks - block)
+		blocks = fb->data_blocks - block;
+
+	return fb->tap->job(fb->tap->arg, i, block,
+			    &fb->data[(size_t)i * fb->rounds * ctx->block_size], blocks);
+}
+
+static int FEC_round_job(void *arg, unsigned int job)
+{
+	struct fec_batch *fb = arg;
+	struct fec_context *ctx = fb->ctx;
+	uint8_t *data, *parity;
+
+	if (job >= fb->rounds)
+		return FEC_tap_job(fb, job - fb->rounds);
+
+	data = &fb->data[(size_t)job * ctx->block_size];
+	parity = &fb->parity[(size_t)job * ctx->roots * ctx->block_size];
+	fb->errors[job] = 0;
+
+	/*
+	 * Byte b of all RS blocks in the round forms one codeword, so
+	 * the data buffer is already in lanes layout for the RS codec.
+	 */
+	if (!fb->decode) {
+		encode_rs_lanes(fb->rs, data, fb->stride, parity, ctx->block_size);
 		return 0;
 	}
 
-	/* find the correct input device and read from it */
-	for (n = 0; n < ctx->ninputs; ++n) {
-		if (offset >= ctx->inputs[n].count) {
-			offset -= ctx->inputs[n].count;
-			continue;
+	/* coverity[tainted_data] */
+	if (decode_rs_lanes(fb->rs, data, fb->stride, parity,
+			    ctx->block_size, &fb->errors[job]) < 0) {
+		fb->errors[job] = UINT_MAX;
+		return -EPERM;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads input for rounds, block i of round n is stored in buf at offset
+ * ((i - first_block) * rounds + n) * block_size. The same block of all rounds
+ * in a window is stored sequentially on the input devices, so input is read
+ * with one large sequential read per RS block index, in increasing offset order.
+ */
+static int FEC_read_rounds(struct crypt_device *cd, struct fec_context *ctx,
+			   uint8_t *buf, uint64_t first_round, uint64_t rounds)
+{
+	size_t size = rounds * ctx->block_size;
+	uint32_t i;
+
+	for (i = ctx->first_block; i < ctx->rsn; ++i, buf += size) {
+		if (FEC_read_interleaved(ctx, first_round * ctx->rsn * ctx->block_size + i,
+					 buf, size)) {
+			log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), first_round, i);
+			return -EIO;
 		}
+	}
 
-		/* FIXME: read_lseek_blockwise candidate */
-		if (lseek(ctx->inputs[n].fd, ctx->inputs[n].start + offset, SEEK_SET) < 0)
-			return -1;
-		return (read_buffer(ctx->inputs[n].fd, output, count) == (ssize_t)count) ? 0 : -1;
+	return 0;
+}
+
+static void FEC_init_context(struct crypt_device *cd, struct fec_context *ctx,
+			     struct crypt_params_verity *params,
+			     struct fec_input_device *inputs, size_t ninputs)
+{
+	size_t n;
+
+	/* initialize parameters */
+	ctx->roots = params->fec_roots;
+	ctx->rsn = FEC_RSM - ctx->roots;
+	ctx->block_size = params->data_block_size;
+	ctx->first_block = 0;
+	ctx->inputs = inputs;
+	ctx->ninputs = ninputs;
+
+	/* calculate the total area covered by error correction codes */
+	ctx->size = 0;
+	for (n = 0; n < ctx->ninputs; ++n) {
+		log_dbg(cd, "FEC input %s, offset %" PRIu64 " [bytes], length %" PRIu64 " [bytes]%s",
+			device_path(ctx->inputs[n].device), ctx->inputs[n].start, ctx->inputs[n].count,
+			ctx->inputs[n].zero ? " (skipped)" : "");
+		ctx->size += ctx->inputs[n].count;
 	}
 
-	/* should never be reached */
-	return -1;
+	/* each byte in a data block is covered by a different code */
+	ctx->blocks = FEC_div_round_up(ctx->size, ctx->block_size);
+	ctx->rounds = FEC_div_round_up(ctx->blocks, ctx->rsn);
 }
 
 /* encodes/decode inputs to/from fd */
@@ -108,97 +257,362 @@ static int FEC_process_inputs(struct crypt_device *cd,
 			      struct crypt_params_verity *params,
 			      struct fec_input_device *inputs,
 			      size_t ninputs, int fd,
-			      int decode, unsigned int *errors)
+			      int decode, struct fec_pass *pass,
+			      unsigned int *errors)
 {
-	int r = 0;
-	unsigned int i;
+	int r = 0, r_io, cur = 0;
+	unsigned int i, jobs;
 	struct fec_context ctx;
-	uint32_t b;
-	uint64_t n;
-	uint8_t rs_block[FEC_RSM];
-	uint8_t *buf = NULL;
-	void *rs;
+	struct fec_batch fb = {};
+	struct crypt_threadpool *tp = NULL;
+	uint64_t n, batch_rounds, rounds, next_rounds;
+	size_t round_size, parity_size;
+	uint8_t *buf[2] = {}, *stored = NULL;
+	off_t parity_offset = 0;
+	void *rs = NULL;
 
-	/* initialize parameters */
-	ctx.roots = params->fec_roots;
-	ctx.rsn = FEC_RSM - ctx.roots;
-	ctx.block_size = params->data_block_size;
-	ctx.inputs = inputs;
-	ctx.ninputs = ninputs;
+	FEC_init_context(cd, &ctx, params, inputs, ninputs);
+
+	/* RS blocks with data area only are zero in hash pass, code is shortened */
+	if (pass && pass->hash)
+		ctx.first_block = inputs[0].count / ((uint64_t)ctx.block_size * ctx.rounds);
 
-	rs = init_rs_char(FEC_PARAMS(ctx.roots));
+	rs = init_rs_char(FEC_PARAMS(ctx.roots, ctx.first_block));
 	if (!rs) {
 		log_err(cd, _("Failed to allocate RS context."));
 		return -ENOMEM;
 	}
 
-	/* calculate the total area covered by error correction codes */
-	ctx.size = 0;
-	for (n = 0; n < ctx.ninputs; ++n) {
-		log_dbg(cd, "FEC input %s, offset %" PRIu64 " [bytes], length %" PRIu64 " [bytes]",
-			device_path(ctx.inputs[n].device), ctx.inputs[n].start, ctx.inputs[n].count);
-		ctx.size += ctx.inputs[n].count;
+	if (crypt_threadpool_init(cd, &tp, crypt_get_threads(cd))) {
+		r = -ENOMEM;
+		goto out;
 	}
 
-	/* each byte in a data block is covered by a different code */
-	ctx.blocks = FEC_div_round_up(ctx.size, ctx.block_size);
-	ctx.rounds = FEC_div_round_up(ctx.blocks, ctx.rsn);
-
-	buf = malloc((size_t)ctx.block_size * ctx.rsn);
-	if (!buf) {
+	/*
+	 * Rounds are independent, every batch of rounds is processed in
+	 * parallel and its parity is read or written as one contiguous buffer.
+	 * The next batch input is read while the current one is processed.
+	 */
+	round_size = (size_t)ctx.block_size * (ctx.rsn - ctx.first_block);
+	parity_size = (size_t)ctx.block_size * ctx.roots;
+	batch_rounds = FEC_BATCH_SIZE / ((size_t)ctx.block_size * ctx.rsn) ?: 1;
+	if (batch_rounds < 2 * crypt_threadpool_threads(tp))
+		batch_rounds = 2 * crypt_threadpool_threads(tp);
+	if (batch_rounds > ctx.rounds)
+		batch_rounds = ctx.rounds;
+
+	buf[0] = malloc(batch_rounds * round_size);
+	if (batch_rounds < ctx.rounds)
+		buf[1] = malloc(batch_rounds * round_size);
+	fb.parity = malloc(batch_rounds * parity_size);
+	fb.errors = calloc(batch_rounds, sizeof(*fb.errors));
+	if (pass && pass->hash)
+		stored = malloc(batch_rounds * parity_size);
+	if (!buf[0] || (batch_rounds < ctx.rounds && !buf[1]) || !fb.parity || !fb.errors ||
+	    (pass && pass->hash && !stored)) {
 		log_err(cd, _("Failed to allocate buffer."));
 		r = -ENOMEM;
 		goto out;
 	}
 
+	fb.ctx = &ctx;
+	fb.rs = rs;
+	fb.decode = decode;
+	if (pass && pass->tap) {
+		fb.tap = pass->tap;
+		fb.data_blocks = inputs[0].count / ctx.block_size;
+		r = fb.tap->init(fb.tap->arg, ctx.rounds, batch_rounds);
+		if (r)
+			goto out;
+	}
+
+	if (stored) {
+		parity_offset = lseek(fd, 0, SEEK_CUR);
+		if (parity_offset < 0) {
+			r = -EIO;
+			goto out;
+		}
+	}
+
+	r = FEC_read_rounds(cd, &ctx, buf[cur], 0, batch_rounds);
+	if (r)
+		goto out;
+
 	/* encode/decode input */
-	for (n = 0; n < ctx.rounds; ++n) {
-		for (i = 0; i < ctx.rsn; ++i) {
-			if (FEC_read_interleaved(&ctx, n * ctx.rsn * ctx.block_size + i,
-						 &buf[i * ctx.block_size], ctx.block_size)) {
-				log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), n, i);
+	for (n = 0; n < ctx.rounds; n += rounds) {
+		rounds = ctx.rounds - n;
+		if (rounds > batch_rounds)
+			rounds = batch_rounds;
+
+		/* decoding from parity device */
+		if (decode && read_buffer(fd, fb.parity, rounds * parity_size) < 0) {
+			log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
+			r = -EIO;
+			goto out;
+		}
+
+		/* parity of data area to be completed with hash area */
+		if (stored && read_buffer_offset(fd, stored, rounds * parity_size,
+				parity_offset + n * parity_size) != (ssize_t)(rounds * parity_size)) {
+			log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
+			r = -EIO;
+			goto out;
+		}
+
+		fb.data = buf[cur];
+		fb.stride = rounds * ctx.block_size;
+		fb.first_round = n;
+		fb.rounds = rounds;
+		/* jobs not run after a failure must not leave results of previous batch */
+		memset(fb.errors, 0, batch_rounds * sizeof(*fb.errors));
+		jobs = rounds;
+		if (fb.tap)
+			jobs += FEC_div_round_up(fb.data_blocks, ctx.rounds);
+		r = crypt_threadpool_start(tp, jobs, FEC_round_job, &fb);
+
+		r_io = 0;
+		next_rounds = ctx.rounds - n - rounds;
+		if (next_rounds > batch_rounds)
+			next_rounds = batch_rounds;
+		if (!r && next_rounds)
+			r_io = FEC_read_rounds(cd, &ctx, buf[!cur], n + rounds, next_rounds);
+
+		if (!r)
+			r = crypt_threadpool_wait(tp);
+		if (r == -EPERM) {
+			for (i = 0; i < rounds && fb.errors[i] != UINT_MAX; i++);
+			log_err(cd, _("Failed to repair parity for block %" PRIu64 "."), n + i);
+			goto out;
+		} else if (r)
+			goto out;
+		if (r_io) {
+			r = r_io;
+			goto out;
+		}
+		cur = !cur;
+
+		if (fb.tap) {
+			r = fb.tap->flush(fb.tap->arg, n + rounds);
+			if (r)
+				goto out;
+		}
+
+		if (decode) {
+			/* return number of detected errors */
+			if (errors)
+				for (i = 0; i < rounds; i++)
+					*errors += fb.errors[i];
+		} else if (stored) {
+			for (i = 0; i < rounds * parity_size; i++)
+				fb.parity[i] ^= stored[i];
+			if (write_buffer_offset(fd, fb.parity, rounds * parity_size,
+					parity_offset + n * parity_size) != (ssize_t)(rounds * parity_size)) {
+				log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
 				r = -EIO;
 				goto out;
 			}
+		} else if (write_buffer(fd, fb.parity, rounds * parity_size) < 0) {
+			/* encoding and writing parity data to fec device */
+			log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
+			r = -EIO;
+			goto out;
 		}
+	}
+out:
+	crypt_threadpool_destroy(tp);
+	free_rs_char(rs);
+	free(buf[0]);
+	free(buf[1]);
+	free(stored);
+	free(fb.parity);
+	free(fb.errors);
+	return r;
+}
 
-		for (b = 0; b < ctx.block_size; ++b) {
-			for (i = 0; i < ctx.rsn; ++i)
-				rs_block[i] = buf[i * ctx.block_size + b];
+/* writes one repaired block back to its input device */
+static int FEC_write_block(struct fec_context *ctx, uint64_t block, const void *data)
+{
+	uint64_t pos, offset = block * ctx->block_size;
+	size_t n;
 
-			/* decoding from parity device */
-			if (decode) {
-				if (read_buffer(fd, &rs_block[ctx.rsn], ctx.roots) < 0) {
-					log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
+	for (n = 0, pos = 0; n < ctx->ninputs; pos += ctx->inputs[n++].count) {
+		if (offset >= pos + ctx->inputs[n].count)
+			continue;
+
+		if (write_buffer_offset(ctx->inputs[n].fd, data, ctx->block_size,
+					ctx->inputs[n].start + offset - pos) != (ssize_t)ctx->block_size)
+			return -EIO;
+		return 0;
+	}
+
+	/* zero padding after the input area is not stored */
+	return 0;
+}
+
+/* unrecoverable round must not cancel decoding of the others in batch */
+static int FEC_repair_job(void *arg, unsigned int job)
+{
+	FEC_round_job(arg, job);
+	return 0;
+}
+
+/*
+ * Decodes only RS rounds containing listed blocks and writes corrected
+ * blocks back to input devices. Rounds are gathered from all over the
+ * inputs (block i of round n is block i * rounds + n), so every block
+ * is read separately, selected rounds are decoded in parallel batches.
+ */
+static int FEC_repair_inputs(struct crypt_device *cd,
+			     struct crypt_params_verity *params,
+			     struct fec_input_device *inputs,
+			     size_t ninputs, int fd,
+			     struct fec_pass *pass)
+{
+	int r = 0;
+	struct fec_context ctx;
+	struct fec_batch fb = { .decode = 1 };
+	struct crypt_threadpool *tp = NULL;
+	uint64_t n, k, block, last, next = 0, failed = 0, *round = NULL;
+	uint64_t selected_count = 0;
+	size_t i, j, rounds, batch_rounds, parity_size;
+	uint8_t *selected = NULL, *orig = NULL, *data, *old;
+	void *rs = NULL;
+
+	FEC_init_context(cd, &ctx, params, inputs, ninputs);
+
+	/* block n belongs to round n % rounds */
+	selected = calloc(ctx.rounds, 1);
+	if (!selected) {
+		r = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < pass->ranges_count; i++) {
+		block = pass->ranges[i].start;
+		if (block >= ctx.blocks)
+			continue;
+		last = block + pass->ranges[i].count;
+		if (last > ctx.blocks || last < block)
+			last = ctx.blocks;
+		if (last - block > ctx.rounds)
+			last = block + ctx.rounds;
+		for (; block < last; block++)
+			selected[block % ctx.rounds] = 1;
+	}
+	for (n = 0; n < ctx.rounds; n++)
+		selected_count += selected[n];
+
+	log_dbg(cd, "FEC repair of %" PRIu64 " of %" PRIu64 " RS rounds.", selected_count, ctx.rounds);
+	if (!selected_count)
+		goto out;
+
+	rs = init_rs_char(FEC_PARAMS(ctx.roots, 0));
+	if (!rs) {
+		log_err(cd, _("Failed to allocate RS context."));
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (crypt_threadpool_init(cd, &tp, crypt_get_threads(cd))) {
+		r = -ENOMEM;
+		goto out;
+	}
 
-				/* coverity[tainted_data] */
-				r = decode_rs_char(rs, rs_block);
-				if (r < 0) {
-					log_err(cd, _("Failed to repair parity for block %" PRIu64 "."), n);
-					r = -EPERM;
+	parity_size = (size_t)ctx.block_size * ctx.roots;
+	batch_rounds = FEC_BATCH_SIZE / ((size_t)ctx.block_size * ctx.rsn) ?: 1;
+	if (batch_rounds < 2 * crypt_threadpool_threads(tp))
+		batch_rounds = 2 * crypt_threadpool_threads(tp);
+	if (batch_rounds > selected_count)
+		batch_rounds = selected_count;
+
+	fb.data = malloc(batch_rounds * ctx.rsn * ctx.block_size);
+	orig = malloc(batch_rounds * ctx.rsn * ctx.block_size);
+	fb.parity = malloc(batch_rounds * parity_size);
+	fb.errors = calloc(batch_rounds, sizeof(*fb.errors));
+	round = malloc(batch_rounds * sizeof(*round));
+	if (!fb.data || !orig || !fb.parity || !fb.errors || !round) {
+		log_err(cd, _("Failed to allocate buffer."));
+		r = -ENOMEM;
+		goto out;
+	}
+
+	fb.ctx = &ctx;
+	fb.rs = rs;
+
+	while (next < ctx.rounds) {
+		for (rounds = 0; rounds < batch_rounds && next < ctx.rounds; next++)
+			if (selected[next])
+				round[rounds++] = next;
+		if (!rounds)
+			break;
+
+		/* block i of j-th selected round is at (i * rounds + j) * block_size */
+		for (j = 0; j < rounds; j++) {
+			n = round[j];
+			for (i = 0; i < ctx.rsn; i++) {
+				if (FEC_read_interleaved(&ctx, n * ctx.rsn * ctx.block_size + i,
+						&fb.data[(i * rounds + j) * ctx.block_size], ctx.block_size)) {
+					log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), n, (int)i);
+					r = -EIO;
 					goto out;
 				}
-				/* return number of detected errors */
-				if (errors)
-					*errors += r;
-				r = 0;
-			} else {
-				/* encoding and writing parity data to fec device */
-				encode_rs_char(rs, rs_block, &rs_block[ctx.rsn]);
-				if (write_buffer(fd, &rs_block[ctx.rsn], ctx.roots) < 0) {
-					log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
+			}
+			if (read_buffer_offset(fd, &fb.parity[j * parity_size], parity_size,
+					params->fec_area_offset + n * parity_size) != (ssize_t)parity_size) {
+				log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
+				r = -EIO;
+				goto out;
+			}
+		}
+		memcpy(orig, fb.data, rounds * ctx.rsn * ctx.block_size);
+
+		fb.stride = rounds * ctx.block_size;
+		fb.rounds = rounds;
+		memset(fb.errors, 0, batch_rounds * sizeof(*fb.errors));
+		r = crypt_threadpool_run(tp, rounds, FEC_repair_job, &fb);
+		if (r)
+			goto out;
+
+		for (j = 0; j < rounds; j++) {
+			if (fb.errors[j] == UINT_MAX) {
+				log_err(cd, _("Failed to repair parity for block %" PRIu64 "."), round[j]);
+				failed++;
+				continue;
+			}
+			if (!fb.errors[j])
+				continue;
+
+			for (i = 0; i < ctx.rsn; i++) {
+				k = (i * rounds + j) * ctx.block_size;
+				data = &fb.data[k];
+				old = &orig[k];
+				block = i * ctx.rounds + round[j];
+				if (block >= ctx.blocks || !memcmp(data, old, ctx.block_size))
+					continue;
+
+				log_dbg(cd, "FEC repaired block %" PRIu64 ".", block);
+				if (FEC_write_block(&ctx, block, data)) {
+					log_err(cd, _("Failed to write repaired block %" PRIu64 "."), block);
 					r = -EIO;
 					goto out;
 				}
+				pass->repaired++;
 			}
 		}
 	}
+
+	if (failed) {
+		log_err(cd, _("Cannot repair %" PRIu64 " RS blocks."), failed);
+		r = -EPERM;
+	}
 out:
+	crypt_threadpool_destroy(tp);
 	free_rs_char(rs);
-	free(buf);
+	free(selected);
+	free(round);
+	free(orig);
+	free(fb.data);
+	free(fb.parity);
+	free(fb.errors);
 	return r;
 }
 
@@ -218,10 +632,10 @@ static int VERITY_FEC_validate(struct crypt_device *cd, struct crypt_params_veri
 	return 0;
 }
 
-int VERITY_FEC_process(struct crypt_device *cd,
-		      struct crypt_params_verity *params,
-		      struct device *fec_device, int check_fec,
-		      unsigned int *errors)
+static int FEC_process(struct crypt_device *cd,
+		       struct crypt_params_verity *params,
+		       struct device *fec_device, int check_fec,
+		       struct fec_pass *pass, unsigned int *errors)
 {
 	int r = -EIO, fd = -1;
 	size_t ninputs = FEC_INPUT_DEVICES;
@@ -230,12 +644,14 @@ int VERITY_FEC_process(struct crypt_device *cd,
 			.device = crypt_data_device(cd),
 			.fd = -1,
 			.start = 0,
-			.count =  params->data_size * params->data_block_size
+			.count =  params->data_size * params->data_block_size,
+			.zero = pass && pass->hash
 		},{
 			.device = crypt_metadata_device(cd),
 			.fd = -1,
 			.start = VERITY_hash_offset_block(params) * params->data_block_size,
-			.count = (VERITY_FEC_blocks(cd, fec_device, params) - params->data_size) * params->data_block_size
+			.count = (VERITY_FEC_blocks(cd, fec_device, params) - params->data_size) * params->data_block_size,
+			.zero = pass && pass->data
 		}
 	};
 
@@ -248,10 +664,14 @@ int VERITY_FEC_process(struct crypt_device *cd,
 		log_err(cd, _("Invalid FEC segment length."));
 		return -EINVAL;
 	}
-	if (!inputs[1].count)
+	if (!inputs[1].count) {
+		/* nothing to add to parity of data area */
+		if (pass && pass->hash)
+			return 0;
 		ninputs--;
+	}
 
-	if (check_fec)
+	if (check_fec || (pass && pass->ranges))
 		fd = open(device_path(fec_device), O_RDONLY);
 	else
 		fd = open(device_path(fec_device), O_RDWR);
@@ -266,19 +686,22 @@ int VERITY_FEC_process(struct crypt_device *cd,
 		goto out;
 	}
 
-	/* input devices */
-	inputs[0].fd = open(device_path(inputs[0].device), O_RDONLY);
+	/* input devices, repaired blocks are written back */
+	inputs[0].fd = open(device_path(inputs[0].device), pass && pass->ranges ? O_RDWR : O_RDONLY);
 	if (inputs[0].fd == -1) {
 		log_err(cd, _("Cannot open device %s."), device_path(inputs[0].device));
 		goto out;
 	}
-	inputs[1].fd = open(device_path(inputs[1].device), O_RDONLY);
+	inputs[1].fd = open(device_path(inputs[1].device), pass && pass->ranges ? O_RDWR : O_RDONLY);
 	if (inputs[1].fd == -1) {
 		log_err(cd, _("Cannot open device %s."), device_path(inputs[1].device));
 		goto out;
 	}
 
-	r = FEC_process_inputs(cd, params, inputs, ninputs, fd, check_fec, errors);
+	if (pass && pass->ranges)
+		r = FEC_repair_inputs(cd, params, inputs, ninputs, fd, pass);
+	else
+		r = FEC_process_inputs(cd, params, inputs, ninputs, fd, check_fec, pass, errors);
 out:
 	if (inputs[0].fd != -1)
 		close(inputs[0].fd);
@@ -290,6 +713,62 @@ out:
 	return r;
 }
 
+int VERITY_FEC_process(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device, int check_fec,
+		      unsigned int *errors)
+{
+	return FEC_process(cd, params, fec_device, check_fec, NULL, errors);
+}
+
+/*
+ * First pass of single pass hash and FEC creation, data area is read once
+ * and every window of RS rounds is passed to tap while its parity is encoded.
+ */
+int VERITY_FEC_encode_data(struct crypt_device *cd,
+			   struct crypt_params_verity *params,
+			   struct device *fec_device,
+			   struct verity_fec_tap *tap)
+{
+	struct fec_pass pass = { .data = true, .tap = tap };
+
+	return FEC_process(cd, params, fec_device, 0, &pass, NULL);
+}
+
+/* Second pass, adds already created hash area to parity of data area */
+int VERITY_FEC_encode_hash(struct crypt_device *cd,
+			   struct crypt_params_verity *params,
+			   struct device *fec_device)
+{
+	struct fec_pass pass = { .hash = true };
+
+	return FEC_process(cd, params, fec_device, 0, &pass, NULL);
+}
+
+/*
+ * Repairs blocks in listed ranges (FEC block numbers, data area followed
+ * by hash area), only RS rounds containing these blocks are decoded.
+ */
+int VERITY_FEC_repair(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const struct crypt_verity_block_range *ranges,
+		      size_t ranges_count,
+		      uint64_t *repaired)
+{
+	struct fec_pass pass = { .ranges = ranges, .ranges_count = ranges_count };
+	int r;
+
+	if (!ranges || !ranges_count)
+		return 0;
+
+	r = FEC_process(cd, params, fec_device, 0, &pass, NULL);
+	if (repaired)
+		*repaired = pass.repaired;
+
+	return r;
+}
+
 /* All blocks that are covered by FEC */
 uint64_t VERITY_FEC_blocks(struct crypt_device *cd,
 			   struct device *fec_device,
@@ -19,13 +19,17 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "verity.h"
 #include "internal.h"
+#include "utils_threadpool.h"
 
 #define VERITY_MAX_LEVELS	63
 #define VERITY_MAX_DIGEST_SIZE	1024
@@ -46,34 +50,6 @@ static unsigned get_bits_down(size_t u)
 	return i;
 }
 
-static int verify_zero(struct crypt_device *cd, FILE *wr, size_t bytes)
-{
-	char *block = NULL;
-	size_t i;
-	int r;
-
-	block = malloc(bytes);
-	if (!block)
-		return -ENOMEM;
-
-	if (fread(block, bytes, 1, wr) != 1) {
-		log_dbg(cd, "EIO while reading spare area.");
-		r = -EIO;
-		goto out;
-	}
-	for (i = 0; i < bytes; i++)
-		if (block[i]) {
-			log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
-				ftello(wr) - bytes);
-			r = -EPERM;
-			goto out;
-		}
-	r = 0;
-out:
-	free(block);
-	return r;
-}
-
 static int verify_hash_block(const char *hash_name, int version,
 			      char *hash, size_t hash_size,
 			      const char *data, size_t data_size,
@@ -141,294 +117,2145 @@ static int hash_levels(size_t hash_block_size, size_t digest_size,
 	return 0;
 }
 
-static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
-				   uint64_t data_block, size_t data_block_size,
-				   uint64_t hash_block, size_t hash_block_size,
-				   uint64_t blocks, int version,
-				   const char *hash_name, int verify,
-				   char *calculated_digest, size_t digest_size,
-				   const char *salt, size_t salt_size)
+/* Size of data processed by one hashing job */
+#define VERITY_JOB_SIZE		(512 * 1024)
+/* Size of data read in one batch */
+#define VERITY_BATCH_SIZE	(16 * 1024 * 1024)
+/* Regular files are read in larger batches, next batch is read ahead to page cache */
+#define VERITY_FILE_BATCH_SIZE	(32 * 1024 * 1024)
+
+struct verity_hash_batch {
+	const char *hash_name;
+	const char *salt;
+	size_t salt_size;
+	int version;
+	size_t digest_size;
+	size_t slot_size;
+	size_t data_block_size;
+	size_t hash_block_size;
+	size_t hash_per_block;
+
+	const char *data;	/* input blocks of batch */
+	uint64_t first_block;	/* index of first input block in batch */
+	uint64_t blocks;	/* number of input blocks in batch */
+	unsigned int job_blocks;
+
+	char *hashes;		/* output hash blocks */
+	uint64_t first_hash_block;
+
+	/*
+	 * Input block equal to zero_block (zeroes for data, hash block
+	 * of zero block digests for upper levels) has constant zero_digest.
+	 * Blocks in holes of sparse data file are not read at all.
+	 */
+	const char *zero_block;
+	const char *zero_digest;
+	const uint8_t *holes;	/* bitmap of input blocks in holes */
+};
+
+/* Digest of the zero block of previous level, carried between levels */
+struct verity_zero {
+	char digest[VERITY_MAX_DIGEST_SIZE];
+	int level;
+};
+
+static bool hash_block_is_zero(const struct verity_hash_batch *b, uint64_t i)
 {
-	char *left_block, *data_buffer;
-	char read_digest[VERITY_MAX_DIGEST_SIZE];
-	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
-	size_t digest_size_full = 1 << get_bits_up(digest_size);
-	uint64_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
-	uint64_t seek_rd, seek_wr;
-	size_t left_bytes;
-	unsigned i;
-	int r;
+	if (b->holes && (b->holes[i / 8] & (1 << (i % 8))))
+		return true;
 
-	if (digest_size > sizeof(read_digest))
-		return -EINVAL;
+	return !memcmp(b->data + i * b->data_block_size, b->zero_block, b->data_block_size);
+}
 
-	if (uint64_mult_overflow(&seek_rd, data_block, data_block_size) ||
-	    uint64_mult_overflow(&seek_wr, hash_block, hash_block_size)) {
-		log_err(cd, _("Device offset overflow."));
+static int hash_batch_job(void *arg, unsigned int job)
+{
+	struct verity_hash_batch *b = arg;
+	uint64_t i, k, n, z, start = (uint64_t)job * b->job_blocks, end = start + b->job_blocks;
+	struct crypt_hash *ctx = NULL;
+	char *hash;
+	int r = 0;
+
+	if (end > b->blocks)
+		end = b->blocks;
+
+	if (crypt_hash_init(&ctx, b->hash_name))
 		return -EINVAL;
+
+	/* Digests are continuous only inside one hash block */
+	for (i = start; i < end && !r; i += n) {
+		k = b->first_block + i;
+		n = b->hash_per_block - k % b->hash_per_block;
+		if (n > end - i)
+			n = end - i;
+		hash = b->hashes + (k / b->hash_per_block - b->first_hash_block) * b->hash_block_size +
+		       (k % b->hash_per_block) * b->slot_size;
+
+		/* Zero blocks get precomputed digest, the rest is hashed in runs */
+		if (b->zero_block) {
+			for (z = 0; z < n && hash_block_is_zero(b, i + z); z++)
+				memcpy(hash + z * b->slot_size, b->zero_digest, b->digest_size);
+			if (z) {
+				n = z;
+				continue;
+			}
+			for (z = 1; z < n && !hash_block_is_zero(b, i + z); z++)
+				;
+			n = z;
+		}
+
+		r = crypt_hash_many(ctx,
+				    b->version == 1 ? b->salt : NULL, b->version == 1 ? b->salt_size : 0,
+				    b->version == 0 ? b->salt : NULL, b->version == 0 ? b->salt_size : 0,
+				    b->data + i * b->data_block_size, b->data_block_size, n,
+				    hash, b->digest_size, b->slot_size);
 	}
 
-	if (fseeko(rd, seek_rd, SEEK_SET)) {
-		log_dbg(cd, "Cannot seek to requested position in data device.");
-		return -EIO;
+	crypt_hash_destroy(ctx);
+	return r ? -EINVAL : 0;
+}
+
+static int verify_failed(struct crypt_device *cd, struct verity_hash_batch *b,
+			 const char *read_hashes, size_t hash_blocks, uint64_t total_blocks,
+			 uint64_t seek_rd, uint64_t seek_wr)
+{
+	uint64_t block, position;
+	size_t i, offset, slot, digests;
+
+	for (i = 0; i < hash_blocks * b->hash_block_size; i++)
+		if (read_hashes[i] != b->hashes[i])
+			break;
+
+	block = b->first_hash_block + i / b->hash_block_size;
+	offset = i % b->hash_block_size;
+	slot = offset / b->slot_size;
+
+	digests = b->hash_per_block;
+	if ((block + 1) * b->hash_per_block > total_blocks)
+		digests = total_blocks - block * b->hash_per_block;
+
+	if (slot < digests && (offset % b->slot_size) < b->digest_size) {
+		position = seek_rd + (block * b->hash_per_block + slot) * b->data_block_size;
+		log_err(cd, _("Verification failed at position %" PRIu64 "."), position);
+	} else {
+		if (slot < digests)
+			offset = slot * b->slot_size + b->digest_size;
+		else
+			offset = digests * b->slot_size;
+		position = seek_wr + block * b->hash_block_size + offset;
+		log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."), position);
 	}
 
-	if (wr && fseeko(wr, seek_wr, SEEK_SET)) {
-		log_dbg(cd, "Cannot seek to requested position in hash device.");
-		return -EIO;
+	return -EPERM;
+}
+
+/*
+ * Corrupted blocks found by verification. If requested, they are collected
+ * as ranges of blocks covered by FEC (data area followed by hash area).
+ */
+struct verity_errors {
+	uint64_t count;
+	bool collect;
+	int r;
+	uint64_t rd_base;	/* FEC block of the first input block of level */
+	uint64_t wr_base;	/* FEC block of the first hash block of level */
+	struct crypt_verity_block_range *ranges;
+	size_t ranges_count;
+	size_t ranges_alloc;
+};
+
+static void verity_errors_add(struct verity_errors *e, uint64_t block, uint64_t count)
+{
+	struct crypt_verity_block_range *range;
+	size_t alloc;
+
+	if (!e->collect || e->r)
+		return;
+
+	if (e->ranges_count) {
+		range = &e->ranges[e->ranges_count - 1];
+		if (block >= range->start && block <= range->start + range->count) {
+			if (block + count > range->start + range->count)
+				range->count = block + count - range->start;
+			return;
+		}
 	}
 
-	left_block = malloc(hash_block_size);
-	data_buffer = malloc(data_block_size);
-	if (!left_block || !data_buffer) {
-		r = -ENOMEM;
-		goto out;
+	if (e->ranges_count == e->ranges_alloc) {
+		alloc = e->ranges_alloc ? 2 * e->ranges_alloc : 64;
+		range = realloc(e->ranges, alloc * sizeof(*range));
+		if (!range) {
+			e->r = -ENOMEM;
+			return;
+		}
+		e->ranges = range;
+		e->ranges_alloc = alloc;
 	}
 
-	memset(left_block, 0, hash_block_size);
-	while (blocks_to_write--) {
-		left_bytes = hash_block_size;
-		for (i = 0; i < hash_per_block; i++) {
-			if (!blocks)
-				break;
-			blocks--;
-			if (fread(data_buffer, data_block_size, 1, rd) != 1) {
-				log_dbg(cd, "Cannot read data device block.");
-				r = -EIO;
-				goto out;
-			}
+	e->ranges[e->ranges_count].start = block;
+	e->ranges[e->ranges_count].count = count;
+	e->ranges_count++;
+}
 
-			if (verify_hash_block(hash_name, version,
-					calculated_digest, digest_size,
-					data_buffer, data_block_size,
-					salt, salt_size)) {
-				r = -EINVAL;
-				goto out;
-			}
+static void verify_failed_range(struct crypt_device *cd, uint64_t first, uint64_t last,
+				size_t block_size, uint64_t seek_rd, struct verity_errors *errors)
+{
+	if (first == last)
+		log_err(cd, _("Verification failed at position %" PRIu64 "."),
+			seek_rd + first * block_size);
+	else
+		log_err(cd, _("Verification failed at positions %" PRIu64 "-%" PRIu64 "."),
+			seek_rd + first * block_size, seek_rd + (last + 1) * block_size - 1);
 
-			if (!wr)
-				break;
-			if (verify) {
-				if (fread(read_digest, digest_size, 1, wr) != 1) {
-					log_dbg(cd, "Cannot read digest form hash device.");
-					r = -EIO;
-					goto out;
-				}
-				if (crypt_backend_memeq(read_digest, calculated_digest, digest_size)) {
-					log_err(cd, _("Verification failed at position %" PRIu64 "."),
-						ftello(rd) - data_block_size);
-					r = -EPERM;
-					goto out;
-				}
-			} else {
-				if (fwrite(calculated_digest, digest_size, 1, wr) != 1) {
-					log_dbg(cd, "Cannot write digest to hash device.");
-					r = -EIO;
-					goto out;
-				}
-			}
-			if (version == 0) {
-				left_bytes -= digest_size;
-			} else {
-				if (digest_size_full - digest_size) {
-					if (verify) {
-						r = verify_zero(cd, wr, digest_size_full - digest_size);
-						if (r)
-							goto out;
-					} else if (fwrite(left_block, digest_size_full - digest_size, 1, wr) != 1) {
-						log_dbg(cd, "Cannot write spare area to hash device.");
-						r = -EIO;
-						goto out;
-					}
-				}
-				left_bytes -= digest_size_full;
+	errors->count += last - first + 1;
+	verity_errors_add(errors, errors->rd_base + first, last - first + 1);
+}
+
+/*
+ * Report all corrupted blocks in mismatching hash blocks,
+ * continuous ranges of corrupted input blocks are reported once.
+ */
+static void verify_failed_all(struct crypt_device *cd, struct verity_hash_batch *b,
+			      const char *read_hashes, size_t hash_blocks, uint64_t total_blocks,
+			      uint64_t seek_rd, uint64_t seek_wr, struct verity_errors *errors)
+{
+	const char *rd, *calc;
+	uint64_t block, k, first = 0, last = 0;
+	size_t i, offset, slot, digests;
+	bool range = false;
+
+	for (i = 0; i < hash_blocks; i++) {
+		rd = read_hashes + i * b->hash_block_size;
+		calc = b->hashes + i * b->hash_block_size;
+		if (!memcmp(rd, calc, b->hash_block_size))
+			continue;
+
+		block = b->first_hash_block + i;
+		digests = b->hash_per_block;
+		if ((block + 1) * b->hash_per_block > total_blocks)
+			digests = total_blocks - block * b->hash_per_block;
+
+		/* Mismatch can be caused by the hash block itself */
+		verity_errors_add(errors, errors->wr_base + block, 1);
+
+		for (slot = 0; slot < digests; slot++) {
+			if (!memcmp(rd + slot * b->slot_size, calc + slot * b->slot_size, b->digest_size))
+				continue;
+
+			k = block * b->hash_per_block + slot;
+			if (range && k == last + 1) {
+				last = k;
+				continue;
 			}
+			if (range)
+				verify_failed_range(cd, first, last, b->data_block_size, seek_rd, errors);
+			first = last = k;
+			range = true;
 		}
-		if (wr && left_bytes) {
-			if (verify) {
-				r = verify_zero(cd , wr, left_bytes);
-				if (r)
-					goto out;
-			} else if (fwrite(left_block, left_bytes, 1, wr) != 1) {
-				log_dbg(cd, "Cannot write remaining spare area to hash device.");
-				r = -EIO;
-				goto out;
+
+		for (offset = 0; offset < b->hash_block_size; offset++) {
+			slot = offset / b->slot_size;
+			if (slot < digests && (offset % b->slot_size) < b->digest_size)
+				continue;
+			if (rd[offset] != calc[offset]) {
+				log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
+					seek_wr + block * b->hash_block_size + offset);
+				errors->count++;
+				break;
 			}
 		}
 	}
-	r = 0;
-out:
-	free(left_block);
-	free(data_buffer);
-	return r;
-}
 
-static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
-	struct crypt_params_verity *params,
-	char *root_hash, size_t digest_size)
-{
-	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
-	FILE *data_file = NULL;
-	FILE *hash_file = NULL, *hash_file_2;
-	uint64_t hash_level_block[VERITY_MAX_LEVELS];
-	uint64_t hash_level_size[VERITY_MAX_LEVELS];
-	uint64_t data_file_blocks;
-	uint64_t data_device_offset_max = 0, hash_device_offset_max = 0;
-	uint64_t hash_position = VERITY_hash_offset_block(params);
-	uint64_t dev_size;
-	int levels, i, r;
+	if (range)
+		verify_failed_range(cd, first, last, b->data_block_size, seek_rd, errors);
+}
 
-	log_dbg(cd, "Hash %s %s, data device %s, data blocks %" PRIu64
-		", hash_device %s, offset %" PRIu64 ".",
-		verify ? "verification" : "creation", params->hash_name,
-		device_path(crypt_data_device(cd)), params->data_size,
-		device_path(crypt_metadata_device(cd)), hash_position);
+struct verity_io {
+	struct device *device;
+	int fd;
+	size_t block_size;
+	size_t alignment;
+	uint64_t file_size;	/* regular file only */
+};
 
-	if (digest_size > sizeof(calculated_digest))
-		return -EINVAL;
+static int verity_io_open(struct crypt_device *cd, struct verity_io *io,
+			  struct device *device, int flags)
+{
+	struct stat st;
 
-	if (!params->data_size) {
-		r = device_size(crypt_data_device(cd), &dev_size);
-		if (r < 0)
-			return r;
+	memset(io, 0, sizeof(*io));
+	io->device = device;
 
-		data_file_blocks = dev_size / params->data_block_size;
-	} else
-		data_file_blocks = params->data_size;
+	/*
+	 * Regular files are always accessed through page cache. Direct-io is
+	 * disabled for the whole device (fd is shared), not only for this fd.
+	 */
+	if (!stat(device_path(device), &st) && S_ISREG(st.st_mode))
+		device_disable_direct_io(device);
 
-	if (uint64_mult_overflow(&data_device_offset_max, params->data_size, params->data_block_size)) {
-		log_err(cd, _("Device offset overflow."));
-		return -EINVAL;
+	io->fd = device_open(cd, device, flags);
+	if (io->fd < 0 || fstat(io->fd, &st) < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(device));
+		return -EIO;
 	}
-	log_dbg(cd, "Data device size required: %" PRIu64 " bytes.", data_device_offset_max);
 
-	if (hash_levels(params->hash_block_size, digest_size, data_file_blocks, &hash_position,
-		&levels, &hash_level_block[0], &hash_level_size[0])) {
-		log_err(cd, _("Hash area overflow."));
+	io->alignment = device_alignment(device);
+	if (!io->alignment)
 		return -EINVAL;
+
+	/*
+	 * Hash image file is extended during hash creation, block-wise
+	 * read-modify-write cannot be used beyond its end. Regular files
+	 * are accessed without block alignment.
+	 */
+	if (S_ISREG(st.st_mode)) {
+		io->file_size = st.st_size;
+		io->block_size = 1;
+		return 0;
 	}
-	if (uint64_mult_overflow(&hash_device_offset_max, hash_position, params->hash_block_size)) {
-		log_err(cd, _("Device offset overflow."));
+
+	io->block_size = device_block_size(cd, device);
+	if (!io->block_size)
 		return -EINVAL;
-	}
-	log_dbg(cd, "Hash device size required: %" PRIu64 " bytes.",
-		hash_device_offset_max - params->hash_area_offset);
-	log_dbg(cd, "Using %d hash levels.", levels);
 
-	data_file = fopen(device_path(crypt_data_device(cd)), "r");
-	if (!data_file) {
-		log_err(cd, _("Cannot open device %s."),
-			device_path(crypt_data_device(cd))
-		);
-		r = -EIO;
-		goto out;
-	}
+	return 0;
+}
 
-	hash_file = fopen(device_path(crypt_metadata_device(cd)), verify ? "r" : "r+");
-	if (!hash_file) {
-		log_err(cd, _("Cannot open device %s."),
-			device_path(crypt_metadata_device(cd)));
-		r = -EIO;
-		goto out;
-	}
+static void verity_io_readahead(struct verity_io *io, uint64_t offset, uint64_t length)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	/* Direct-io bypasses page cache, read-ahead is provided by double buffering */
+	if (io->block_size == 1 || !device_direct_io(io->device))
+		(void)posix_fadvise(io->fd, offset, length, POSIX_FADV_SEQUENTIAL);
+#endif
+}
 
-	memset(calculated_digest, 0, digest_size);
+/* Regular file only, the next batch is read to page cache while current one is hashed */
+static void verity_io_willneed(struct verity_io *io, uint64_t length, uint64_t offset)
+{
+#ifdef POSIX_FADV_WILLNEED
+	if (io->block_size == 1 && offset < io->file_size)
+		(void)posix_fadvise(io->fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
 
-	for (i = 0; i < levels; i++) {
-		if (!i) {
-			r = create_or_verify(cd, data_file, hash_file,
-						    0, params->data_block_size,
-						    hash_level_block[i], params->hash_block_size,
-						    data_file_blocks, params->hash_type, params->hash_name, verify,
-						    calculated_digest, digest_size, params->salt, params->salt_size);
-			if (r)
-				goto out;
-		} else {
-			hash_file_2 = fopen(device_path(crypt_metadata_device(cd)), "r");
-			if (!hash_file_2) {
-				log_err(cd, _("Cannot open device %s."),
-					device_path(crypt_metadata_device(cd)));
-				r = -EIO;
-				goto out;
-			}
-			r = create_or_verify(cd, hash_file_2, hash_file,
-						    hash_level_block[i - 1], params->hash_block_size,
-						    hash_level_block[i], params->hash_block_size,
-						    hash_level_size[i - 1], params->hash_type, params->hash_name, verify,
-						    calculated_digest, digest_size, params->salt, params->salt_size);
-			fclose(hash_file_2);
-			if (r)
-				goto out;
-		}
-	}
+static int verity_io_read(struct verity_io *io, void *buf, size_t length, uint64_t offset)
+{
+	if (read_lseek_blockwise(io->fd, io->block_size, io->alignment,
+				 buf, length, offset) != (ssize_t)length)
+		return -EIO;
+	return 0;
+}
 
-	if (levels)
-		r = create_or_verify(cd, hash_file, NULL,
-					    hash_level_block[levels - 1], params->hash_block_size,
-					    0, params->hash_block_size,
-					    1, params->hash_type, params->hash_name, verify,
-					    calculated_digest, digest_size, params->salt, params->salt_size);
-	else
-		r = create_or_verify(cd, data_file, NULL,
-					    0, params->data_block_size,
-					    0, params->hash_block_size,
-					    data_file_blocks, params->hash_type, params->hash_name, verify,
-					    calculated_digest, digest_size, params->salt, params->salt_size);
-out:
-	if (verify) {
-		if (r)
-			log_err(cd, _("Verification of data area failed."));
-		else {
-			log_dbg(cd, "Verification of data area succeeded.");
-			r = crypt_backend_memeq(root_hash, calculated_digest, digest_size) ? -EFAULT : 0;
-			if (r)
-				log_err(cd, _("Verification of root hash failed."));
-			else
-				log_dbg(cd, "Verification of root hash succeeded.");
-		}
-	} else {
-		if (r == -EIO)
-			log_err(cd, _("Input/output error while creating hash area."));
-		else if (r)
-			log_err(cd, _("Creation of hash area failed."));
-		else {
-			fsync(fileno(hash_file));
-			memcpy(root_hash, calculated_digest, digest_size);
-		}
+static int verity_io_write(struct verity_io *io, void *buf, size_t length, uint64_t offset)
+{
+	if (write_lseek_blockwise(io->fd, io->block_size, io->alignment,
+				  buf, length, offset) != (ssize_t)length)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Read blocks from regular file, whole blocks inside holes are not read,
+ * only marked in holes bitmap. Other devices are read completely.
+ */
+static int verity_io_read_sparse(struct verity_io *io, char *buf, uint64_t blocks,
+				 size_t block_size, uint64_t offset, uint8_t *holes)
+{
+	uint64_t pos, end = offset + blocks * block_size, first, last;
+	off_t data, hole;
+
+	memset(holes, 0, (blocks + 7) / 8);
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	if (io->block_size != 1 || end > io->file_size)
+		return verity_io_read(io, buf, blocks * block_size, offset);
+
+	for (pos = offset; pos < end; pos = offset + last * block_size) {
+		data = lseek(io->fd, pos, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			data = end;
+		else if (data < 0)
+			return verity_io_read(io, buf + (pos - offset), end - pos, pos);
+		if ((uint64_t)data > end)
+			data = end;
+
+		/* Only blocks completely inside hole */
+		first = (pos - offset + block_size - 1) / block_size;
+		last = ((uint64_t)data - offset) / block_size;
+		for (; first < last; first++)
+			holes[first / 8] |= 1 << (first % 8);
+
+		if ((uint64_t)data == end)
+			break;
+
+		hole = lseek(io->fd, data, SEEK_HOLE);
+		if (hole < 0 || (uint64_t)hole > end)
+			hole = end;
+
+		first = ((uint64_t)data - offset) / block_size;
+		last = ((uint64_t)hole - offset + block_size - 1) / block_size;
+		if (verity_io_read(io, buf + first * block_size, (last - first) * block_size,
+				   offset + first * block_size))
+			return -EIO;
 	}
 
-	if (data_file)
-		fclose(data_file);
-	if (hash_file)
-		fclose(hash_file);
-	return r;
+	return 0;
+#else
+	return verity_io_read(io, buf, blocks * block_size, offset);
+#endif
 }
 
-/* Verify verity device using userspace crypto backend */
-int VERITY_verify(struct crypt_device *cd,
-		  struct crypt_params_verity *verity_hdr,
-		  const char *root_hash,
-		  size_t root_hash_size)
+static void *verity_io_alloc(struct verity_io *io, size_t size)
 {
-	return VERITY_create_or_verify_hash(cd, 1, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+	void *buf;
+
+	if (posix_memalign(&buf, io->alignment, size))
+		return NULL;
+
+	return buf;
 }
 
-/* Create verity hash */
-int VERITY_create(struct crypt_device *cd,
-		  struct crypt_params_verity *verity_hdr,
-		  const char *root_hash,
-		  size_t root_hash_size)
+static int verity_read_batch(struct verity_io *io, char *buf, uint64_t blocks,
+			     size_t block_size, uint64_t offset, uint8_t *holes)
 {
-	unsigned pgsize = (unsigned)crypt_getpagesize();
+	/* Batch of the same size follows, start its read-ahead */
+	verity_io_willneed(io, blocks * block_size, offset + blocks * block_size);
 
-	if (verity_hdr->salt_size > 256)
+	if (holes)
+		return verity_io_read_sparse(io, buf, blocks, block_size, offset, holes);
+
+	return verity_io_read(io, buf, blocks * block_size, offset);
+}
+
+/*
+ * Zero block of data level is all zeroes, zero block of upper level is
+ * hash block filled with zero block digests of the previous level.
+ */
+static int verity_zero_block(struct verity_hash_batch *b, struct verity_zero *zero,
+			     char **zero_block, char *zero_digest)
+{
+	size_t i;
+
+	*zero_block = calloc(1, b->data_block_size);
+	if (!*zero_block)
+		return -ENOMEM;
+
+	if (zero->level)
+		for (i = 0; i < b->hash_per_block && (i + 1) * b->slot_size <= b->data_block_size; i++)
+			memcpy(*zero_block + i * b->slot_size, zero->digest, b->digest_size);
+
+	if (verify_hash_block(b->hash_name, b->version, zero_digest, b->digest_size,
+			      *zero_block, b->data_block_size, b->salt, b->salt_size))
 		return -EINVAL;
 
-	if (verity_hdr->data_block_size > pgsize)
-		log_err(cd, _("WARNING: Kernel cannot activate device if data "
-			      "block size exceeds page size (%u)."), pgsize);
+	memcpy(zero->digest, zero_digest, b->digest_size);
+	zero->level++;
+
+	return 0;
+}
+
+/* Size of stored hash blocks of one level read at once in tree verification */
+#define VERITY_HASH_WINDOW	(4 * 1024 * 1024)
 
-	return VERITY_create_or_verify_hash(cd, 0, verity_hdr, CONST_CAST(char*)root_hash, root_hash_size);
+struct verity_tree_level {
+	char *window;		/* stored hash blocks */
+	uint64_t first;		/* index of the first block in window */
+	uint64_t count;		/* number of blocks in window */
+	char *pending;		/* hash block filled by digests of lower level */
+};
+
+/*
+ * Verification of all levels in one pass in data order. Every verified
+ * hash block is hashed directly to the pending block of the level above,
+ * so stored hash blocks are read exactly once, in windows per level.
+ * Memory is bounded by tree depth x window size.
+ */
+struct verity_tree {
+	struct crypt_params_verity *params;
+	struct verity_io *io;
+	const uint64_t *hash_level_block;
+	const uint64_t *hash_level_size;
+	uint64_t data_blocks;
+	size_t digest_size;
+	size_t slot_size;
+	size_t hash_per_block;
+	uint64_t window_blocks;
+	int levels;
+	char *root_digest;
+	bool done;
+	struct verity_tree_level level[VERITY_MAX_LEVELS];
+};
+
+static void verity_tree_free(struct verity_tree *t)
+{
+	int l;
+
+	for (l = 0; l < t->levels; l++) {
+		free(t->level[l].window);
+		free(t->level[l].pending);
+	}
+}
+
+static int verity_tree_init(struct verity_tree *t, struct crypt_params_verity *params,
+			    struct verity_io *io, const uint64_t *hash_level_block,
+			    const uint64_t *hash_level_size, uint64_t data_blocks,
+			    int levels, size_t digest_size, char *root_digest)
+{
+	int l;
+
+	memset(t, 0, sizeof(*t));
+	t->params = params;
+	t->io = io;
+	t->hash_level_block = hash_level_block;
+	t->hash_level_size = hash_level_size;
+	t->data_blocks = data_blocks;
+	t->levels = levels;
+	t->digest_size = digest_size;
+	t->slot_size = params->hash_type ? (size_t)1 << get_bits_up(digest_size) : digest_size;
+	t->hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
+	t->window_blocks = VERITY_HASH_WINDOW / params->hash_block_size ?: 1;
+	t->root_digest = root_digest;
+
+	for (l = 1; l < levels; l++) {
+		t->level[l].pending = verity_io_alloc(io, params->hash_block_size);
+		if (!t->level[l].pending)
+			return -ENOMEM;
+		memset(t->level[l].pending, 0, params->hash_block_size);
+	}
+
+	return 0;
+}
+
+/* Stored hash block of level, the next window is read when needed */
+static const char *verity_tree_stored(struct verity_tree *t, int l, uint64_t block)
+{
+	struct verity_tree_level *tl = &t->level[l];
+	size_t hash_block_size = t->params->hash_block_size;
+	uint64_t count, offset;
+
+	if (tl->count && block >= tl->first && block < tl->first + tl->count)
+		return tl->window + (block - tl->first) * hash_block_size;
+
+	count = t->hash_level_size[l] - block;
+	if (count > t->window_blocks)
+		count = t->window_blocks;
+	offset = (t->hash_level_block[l] + block) * hash_block_size;
+
+	if (!tl->window) {
+		tl->window = verity_io_alloc(t->io, t->window_blocks * hash_block_size);
+		if (!tl->window)
+			return NULL;
+	}
+
+	tl->count = 0;
+	if (verity_io_read(t->io, tl->window, count * hash_block_size, offset))
+		return NULL;
+	tl->first = block;
+	tl->count = count;
+
+	return tl->window;
+}
+
+/* Compare calculated hash block with the stored one and continue to the level above */
+static int verity_tree_push(struct crypt_device *cd, struct verity_tree *t, int l,
+			    const char *hashes, uint64_t block)
+{
+	struct crypt_params_verity *p = t->params;
+	struct verity_hash_batch b = {
+		.digest_size = t->digest_size,
+		.slot_size = t->slot_size,
+		.data_block_size = l ? p->hash_block_size : p->data_block_size,
+		.hash_block_size = p->hash_block_size,
+		.hash_per_block = t->hash_per_block,
+		.hashes = CONST_CAST(char*)hashes,
+		.first_hash_block = block,
+	};
+	struct verity_tree_level *up;
+	const char *stored;
+	char *digest;
+	int r;
+
+	stored = verity_tree_stored(t, l, block);
+	if (!stored) {
+		log_dbg(cd, "Cannot read digest form hash device.");
+		return -EIO;
+	}
+
+	if (crypt_backend_memeq(stored, hashes, p->hash_block_size))
+		return verify_failed(cd, &b, stored, 1, l ? t->hash_level_size[l - 1] : t->data_blocks,
+				     l ? t->hash_level_block[l - 1] * p->hash_block_size : 0,
+				     t->hash_level_block[l] * p->hash_block_size);
+
+	if (l == t->levels - 1) {
+		r = verify_hash_block(p->hash_name, p->hash_type, t->root_digest, t->digest_size,
+				      hashes, p->hash_block_size, p->salt, p->salt_size);
+		t->done = !r;
+		return r ? -EINVAL : 0;
+	}
+
+	up = &t->level[l + 1];
+	digest = up->pending + (block % t->hash_per_block) * t->slot_size;
+	if (verify_hash_block(p->hash_name, p->hash_type, digest, t->digest_size,
+			      hashes, p->hash_block_size, p->salt, p->salt_size))
+		return -EINVAL;
+
+	if ((block + 1) % t->hash_per_block && block + 1 < t->hash_level_size[l])
+		return 0;
+
+	r = verity_tree_push(cd, t, l + 1, up->pending, block / t->hash_per_block);
+	memset(up->pending, 0, p->hash_block_size);
+	return r;
+}
+
+static int create_or_verify(struct crypt_device *cd, struct crypt_threadpool *tp,
+				   struct verity_io *rd, struct verity_io *wr,
+				   uint64_t data_block, size_t data_block_size,
+				   uint64_t hash_block, size_t hash_block_size,
+				   uint64_t blocks, int version,
+				   const char *hash_name, int verify,
+				   char *calculated_digest, size_t digest_size,
+				   const char *salt, size_t salt_size,
+				   struct verity_zero *zero, struct verity_errors *errors,
+				   struct verity_tree *tree)
+{
+	char *data_buffer[2] = {}, *hash_buffer = NULL, *read_buffer = NULL, *zero_block = NULL;
+	char zero_digest[VERITY_MAX_DIGEST_SIZE];
+	uint8_t *holes[2] = {};
+	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
+	size_t digest_size_full = 1 << get_bits_up(digest_size);
+	size_t hash_buffer_size;
+	uint64_t seek_rd, seek_wr, batch_blocks, i, n, done_blocks, next_blocks, total_blocks = blocks;
+	unsigned int jobs, cur = 0;
+	struct verity_hash_batch b = {
+		.hash_name = hash_name,
+		.salt = salt,
+		.salt_size = salt_size,
+		.version = version,
+		.digest_size = digest_size,
+		.slot_size = version ? digest_size_full : digest_size,
+		.data_block_size = data_block_size,
+		.hash_block_size = hash_block_size,
+		.hash_per_block = hash_per_block,
+	};
+	int r, r_io;
+
+	if (uint64_mult_overflow(&seek_rd, data_block, data_block_size) ||
+	    uint64_mult_overflow(&seek_wr, hash_block, hash_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		return -EINVAL;
+	}
+
+	if (!blocks)
+		return 0;
+
+	/* Root hash, only one block is hashed */
+	if (!wr) {
+		data_buffer[0] = verity_io_alloc(rd, data_block_size);
+		if (!data_buffer[0])
+			return -ENOMEM;
+
+		r = 0;
+		if (verity_io_read(rd, data_buffer[0], data_block_size, seek_rd)) {
+			log_dbg(cd, "Cannot read data device block.");
+			r = -EIO;
+		} else if (verify_hash_block(hash_name, version,
+				calculated_digest, digest_size,
+				data_buffer[0], data_block_size,
+				salt, salt_size))
+			r = -EINVAL;
+
+		free(data_buffer[0]);
+		return r;
+	}
+
+	/*
+	 * Input blocks are hashed in batches, every batch is split to jobs
+	 * processed in parallel. Hash blocks are written in order, the last
+	 * incomplete hash block is carried over to the next batch.
+	 * Input is double buffered, the next batch is read while worker
+	 * threads process the current one.
+	 */
+	b.job_blocks = VERITY_JOB_SIZE / data_block_size ?: 1;
+	jobs = (rd->block_size == 1 ? VERITY_FILE_BATCH_SIZE : VERITY_BATCH_SIZE) /
+	       (b.job_blocks * data_block_size);
+	if (jobs < 2 * crypt_threadpool_threads(tp))
+		jobs = 2 * crypt_threadpool_threads(tp);
+	batch_blocks = (uint64_t)jobs * b.job_blocks;
+	if (batch_blocks > blocks)
+		batch_blocks = blocks;
+	hash_buffer_size = (batch_blocks / hash_per_block + 2) * hash_block_size;
+
+	data_buffer[0] = verity_io_alloc(rd, batch_blocks * data_block_size);
+	if (batch_blocks < total_blocks)
+		data_buffer[1] = verity_io_alloc(rd, batch_blocks * data_block_size);
+	hash_buffer = verity_io_alloc(wr, hash_buffer_size);
+	if (verify && !tree)
+		read_buffer = verity_io_alloc(wr, hash_buffer_size);
+	if (!data_buffer[0] || (batch_blocks < total_blocks && !data_buffer[1]) ||
+	    !hash_buffer || (verify && !tree && !read_buffer)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	memset(hash_buffer, 0, hash_buffer_size);
+	b.hashes = hash_buffer;
+
+	if (zero) {
+		r = verity_zero_block(&b, zero, &zero_block, zero_digest);
+		if (r)
+			goto out;
+		b.zero_block = zero_block;
+		b.zero_digest = zero_digest;
+
+		/* Holes can be skipped only in data (level 0) */
+		if (zero->level == 1 && rd->block_size == 1) {
+			holes[0] = malloc((batch_blocks + 7) / 8);
+			holes[1] = malloc((batch_blocks + 7) / 8);
+			if (!holes[0] || !holes[1]) {
+				r = -ENOMEM;
+				goto out;
+			}
+		}
+	}
+
+	verity_io_readahead(rd, seek_rd, total_blocks * data_block_size);
+
+	next_blocks = batch_blocks;
+	if (verity_read_batch(rd, data_buffer[cur], next_blocks, data_block_size, seek_rd, holes[cur])) {
+		log_dbg(cd, "Cannot read data device block.");
+		r = -EIO;
+		goto out;
+	}
+
+	for (done_blocks = 0; done_blocks < total_blocks; done_blocks += b.blocks) {
+		b.data = data_buffer[cur];
+		b.holes = holes[cur];
+		b.first_block = done_blocks;
+		b.blocks = next_blocks;
+
+		jobs = (b.blocks + b.job_blocks - 1) / b.job_blocks;
+		r = crypt_threadpool_start(tp, jobs, hash_batch_job, &b);
+
+		/* Read next batch while the current one is being hashed */
+		r_io = 0;
+		next_blocks = total_blocks - done_blocks - b.blocks;
+		if (next_blocks > batch_blocks)
+			next_blocks = batch_blocks;
+		if (!r && next_blocks &&
+		    verity_read_batch(rd, data_buffer[!cur], next_blocks, data_block_size,
+				      seek_rd + (done_blocks + b.blocks) * data_block_size, holes[!cur]))
+			r_io = -EIO;
+
+		if (!r)
+			r = crypt_threadpool_wait(tp);
+		if (r) {
+			r = -EINVAL;
+			goto out;
+		}
+		if (r_io) {
+			log_dbg(cd, "Cannot read data device block.");
+			r = r_io;
+			goto out;
+		}
+		cur = !cur;
+
+		/* Number of completed hash blocks in batch */
+		if (done_blocks + b.blocks == total_blocks)
+			n = (total_blocks + hash_per_block - 1) / hash_per_block - b.first_hash_block;
+		else
+			n = (done_blocks + b.blocks) / hash_per_block - b.first_hash_block;
+
+		if (!n)
+			continue;
+
+		if (tree) {
+			for (i = 0; i < n; i++) {
+				r = verity_tree_push(cd, tree, 0, hash_buffer + i * hash_block_size,
+						     b.first_hash_block + i);
+				if (r)
+					goto out;
+			}
+		} else if (verify) {
+			if (verity_io_read(wr, read_buffer, n * hash_block_size,
+					   seek_wr + b.first_hash_block * hash_block_size)) {
+				log_dbg(cd, "Cannot read digest form hash device.");
+				r = -EIO;
+				goto out;
+			}
+			if (crypt_backend_memeq(read_buffer, hash_buffer, n * hash_block_size)) {
+				if (!errors) {
+					r = verify_failed(cd, &b, read_buffer, n, total_blocks, seek_rd, seek_wr);
+					goto out;
+				}
+				verify_failed_all(cd, &b, read_buffer, n, total_blocks, seek_rd, seek_wr, errors);
+			}
+		} else if (verity_io_write(wr, hash_buffer, n * hash_block_size,
+					   seek_wr + b.first_hash_block * hash_block_size)) {
+			log_dbg(cd, "Cannot write digest to hash device.");
+			r = -EIO;
+			goto out;
+		}
+
+		/* Carry over partially filled hash block */
+		if ((done_blocks + b.blocks) % hash_per_block)
+			memmove(hash_buffer, hash_buffer + n * hash_block_size, hash_block_size);
+		else
+			memset(hash_buffer, 0, hash_block_size);
+		memset(hash_buffer + hash_block_size, 0, hash_buffer_size - hash_block_size);
+		b.first_hash_block += n;
+	}
+	r = 0;
+out:
+	free(holes[1]);
+	free(holes[0]);
+	free(zero_block);
+	free(read_buffer);
+	free(hash_buffer);
+	free(data_buffer[1]);
+	free(data_buffer[0]);
+	return r;
+}
+
+/* Level 0 hash blocks staged for every FEC column */
+#define VERITY_FEC_STAGE_BLOCKS	16
+
+/*
+ * Level 0 of hash tree created from data read by FEC encoder. Every column
+ * (RS block position) covers a continuous range of data blocks, its digests
+ * are staged and written in whole hash blocks. Hash blocks shared by
+ * neighbouring columns are assembled separately and written at the end.
+ */
+struct verity_fec_column {
+	char *hashes;
+	uint64_t first_hash_block;
+};
+
+struct verity_fec_level {
+	struct verity_hash_batch b;
+	struct verity_io *wr;
+	uint64_t seek_wr;
+	uint64_t blocks;
+	uint64_t column_blocks;
+	unsigned int columns;
+	size_t stage_blocks;
+	size_t window_hash_blocks;
+	struct verity_fec_column *col;
+	char *edges;		/* shared hash block at the start of column */
+};
+
+static void fec_level_range(struct verity_fec_level *l, unsigned int c,
+			    uint64_t *start, uint64_t *end)
+{
+	*start = c * l->column_blocks;
+	*end = *start + l->column_blocks;
+	if (*end > l->blocks)
+		*end = l->blocks;
+}
+
+static void fec_level_merge(struct verity_fec_level *l, char *dst, const char *src)
+{
+	size_t i;
+
+	for (i = 0; i < l->b.hash_block_size; i++)
+		dst[i] |= src[i];
+}
+
+static int fec_level_init(void *arg, uint64_t column_blocks, uint64_t window_blocks)
+{
+	struct verity_fec_level *l = arg;
+	size_t size;
+	unsigned int c;
+	uint64_t start, end;
+
+	l->column_blocks = column_blocks;
+	l->columns = (l->blocks + column_blocks - 1) / column_blocks;
+	l->window_hash_blocks = window_blocks / l->b.hash_per_block + 2;
+	l->stage_blocks = 2 * l->window_hash_blocks;
+	if (l->stage_blocks < VERITY_FEC_STAGE_BLOCKS)
+		l->stage_blocks = VERITY_FEC_STAGE_BLOCKS;
+	size = l->stage_blocks * l->b.hash_block_size;
+
+	l->col = calloc(l->columns, sizeof(*l->col));
+	l->edges = calloc(l->columns, l->b.hash_block_size);
+	if (!l->col || !l->edges)
+		return -ENOMEM;
+
+	for (c = 0; c < l->columns; c++) {
+		l->col[c].hashes = verity_io_alloc(l->wr, size);
+		if (!l->col[c].hashes)
+			return -ENOMEM;
+		memset(l->col[c].hashes, 0, size);
+		fec_level_range(l, c, &start, &end);
+		l->col[c].first_hash_block = start / l->b.hash_per_block;
+	}
+
+	return 0;
+}
+
+static int fec_level_job(void *arg, unsigned int column, uint64_t block,
+			 const uint8_t *data, uint64_t blocks)
+{
+	struct verity_fec_level *l = arg;
+	struct verity_hash_batch b = l->b;
+
+	b.data = (const char *)data;
+	b.first_block = block;
+	b.blocks = blocks;
+	b.job_blocks = blocks;
+	b.hashes = l->col[column].hashes;
+	b.first_hash_block = l->col[column].first_hash_block;
+
+	return hash_batch_job(&b, 0);
+}
+
+/* Write completed hash blocks of column, shared ones go to edges */
+static int fec_level_write(struct verity_fec_level *l, unsigned int c, uint64_t done)
+{
+	struct verity_fec_column *col = &l->col[c];
+	size_t hpb = l->b.hash_per_block, hbs = l->b.hash_block_size;
+	uint64_t h, first = 0, n = 0, start, end;
+	char *buf;
+
+	fec_level_range(l, c, &start, &end);
+
+	for (h = col->first_hash_block; h < done; h++) {
+		buf = col->hashes + (h - col->first_hash_block) * hbs;
+		if (h == start / hpb && start % hpb)
+			fec_level_merge(l, l->edges + c * hbs, buf);
+		else if (h == (end - 1) / hpb && end % hpb && end < l->blocks)
+			fec_level_merge(l, l->edges + (c + 1) * hbs, buf);
+		else if (!n++)
+			first = h;
+	}
+
+	if (n && verity_io_write(l->wr, col->hashes + (first - col->first_hash_block) * hbs,
+				 n * hbs, l->seek_wr + first * hbs))
+		return -EIO;
+
+	return 0;
+}
+
+static int fec_level_flush(void *arg, uint64_t rounds)
+{
+	struct verity_fec_level *l = arg;
+	struct verity_fec_column *col;
+	size_t hpb = l->b.hash_per_block, hbs = l->b.hash_block_size;
+	uint64_t start, end, next, done;
+	unsigned int c;
+	int r;
+
+	for (c = 0; c < l->columns; c++) {
+		col = &l->col[c];
+		fec_level_range(l, c, &start, &end);
+		next = start + rounds;
+		if (next > end)
+			next = end;
+
+		/* Flush when the next window could overflow stage */
+		if (next == end)
+			done = (end + hpb - 1) / hpb;
+		else {
+			done = next / hpb;
+			if (col->first_hash_block + l->stage_blocks - done >= l->window_hash_blocks)
+				continue;
+		}
+		if (done == col->first_hash_block)
+			continue;
+
+		r = fec_level_write(l, c, done);
+		if (r)
+			return r;
+
+		/* Carry over partially filled hash block */
+		if (next != end)
+			memmove(col->hashes, col->hashes + (done - col->first_hash_block) * hbs, hbs);
+		memset(col->hashes + hbs, 0, (l->stage_blocks - 1) * hbs);
+		col->first_hash_block = done;
+	}
+
+	return 0;
+}
+
+/* Hash blocks shared by more columns are complete after the last window */
+static int fec_level_finish(struct verity_fec_level *l)
+{
+	size_t hpb = l->b.hash_per_block, hbs = l->b.hash_block_size;
+	unsigned int c, e;
+	uint64_t h;
+
+	for (c = 1; c < l->columns; c = e) {
+		e = c + 1;
+		if (!((c * l->column_blocks) % hpb))
+			continue;
+
+		h = c * l->column_blocks / hpb;
+		for (; e < l->columns && e * l->column_blocks / hpb == h; e++)
+			fec_level_merge(l, l->edges + c * hbs, l->edges + e * hbs);
+
+		if (verity_io_write(l->wr, l->edges + c * hbs, hbs, l->seek_wr + h * hbs))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static void fec_level_free(struct verity_fec_level *l)
+{
+	unsigned int c;
+
+	if (l->col)
+		for (c = 0; c < l->columns; c++)
+			free(l->col[c].hashes);
+	free(l->col);
+	free(l->edges);
+}
+
+/*
+ * Create level 0 of hash tree from data read by FEC encoder, data device
+ * is read only once for both hash tree and FEC. Parity of hash area is
+ * added later, when the whole hash tree is written.
+ */
+static int create_fec_level(struct crypt_device *cd, struct crypt_params_verity *params,
+			    struct device *fec_device, struct verity_io *wr,
+			    uint64_t hash_block, uint64_t blocks, size_t digest_size,
+			    struct verity_zero *zero)
+{
+	char zero_digest[VERITY_MAX_DIGEST_SIZE], *zero_block = NULL;
+	struct verity_fec_level l = {
+		.b = {
+			.hash_name = params->hash_name,
+			.salt = params->salt,
+			.salt_size = params->salt_size,
+			.version = params->hash_type,
+			.digest_size = digest_size,
+			.slot_size = params->hash_type ? (size_t)1 << get_bits_up(digest_size) : digest_size,
+			.data_block_size = params->data_block_size,
+			.hash_block_size = params->hash_block_size,
+			.hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size),
+		},
+		.wr = wr,
+		.blocks = blocks,
+	};
+	struct verity_fec_tap tap = {
+		.init = fec_level_init,
+		.job = fec_level_job,
+		.flush = fec_level_flush,
+		.arg = &l,
+	};
+	int r;
+
+	if (uint64_mult_overflow(&l.seek_wr, hash_block, params->hash_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		return -EINVAL;
+	}
+
+	r = verity_zero_block(&l.b, zero, &zero_block, zero_digest);
+	if (!r) {
+		l.b.zero_block = zero_block;
+		l.b.zero_digest = zero_digest;
+		r = VERITY_FEC_encode_data(cd, params, fec_device, &tap);
+	}
+	if (!r)
+		r = fec_level_finish(&l);
+
+	fec_level_free(&l);
+	free(zero_block);
+	return r;
+}
+
+/*
+ * Staging area for hash tree creation, memory file or scratch device.
+ * Hash blocks are stored there without hash area offset.
+ */
+static int verity_stage_open(struct crypt_device *cd, struct verity_io *io,
+			     struct device **device, uint64_t size)
+{
+	const char *path = crypt_get_verity_stage(cd);
+	char zero[SECTOR_SIZE] = {};
+	uint64_t dev_size;
+	int r;
+
+	if (path)
+		r = device_alloc(cd, device, path);
+	else
+		r = device_alloc_memory(cd, device, zero, sizeof(zero), size);
+	if (r < 0) {
+		log_err(cd, _("Cannot allocate hash tree staging area."));
+		return r;
+	}
+
+	r = verity_io_open(cd, io, *device, O_RDWR);
+	if (r)
+		return r;
+
+	/* Regular file is extended, device must be large enough */
+	if (io->block_size != 1 && (device_size(*device, &dev_size) || dev_size < size)) {
+		log_err(cd, _("Device %s is too small."), device_path(*device));
+		return -EINVAL;
+	}
+
+	log_dbg(cd, "Hash tree (%" PRIu64 " bytes) is staged in %s.", size, path ?: "memory");
+	return 0;
+}
+
+/* Copy staged hash blocks to hash device in one sequential pass */
+static int verity_stage_copy(struct verity_io *in, struct verity_io *out, uint64_t to,
+			     uint64_t blocks, size_t block_size)
+{
+	uint64_t n, from = 0, chunk = VERITY_BATCH_SIZE / block_size ?: 1;
+	char *buf;
+	int r = 0;
+
+	buf = verity_io_alloc(in->alignment > out->alignment ? in : out, chunk * block_size);
+	if (!buf)
+		return -ENOMEM;
+
+	verity_io_readahead(in, 0, blocks * block_size);
+
+	for (; blocks && !r; blocks -= n, from += n, to += n) {
+		n = blocks > chunk ? chunk : blocks;
+		if (verity_io_read(in, buf, n * block_size, from * block_size) ||
+		    verity_io_write(out, buf, n * block_size, to * block_size))
+			r = -EIO;
+	}
+
+	free(buf);
+	return r;
+}
+
+static int VERITY_create_or_verify_hash(struct crypt_device *cd, bool verify,
+	struct crypt_params_verity *params, struct device *fec_device,
+	char *root_hash, size_t digest_size, struct verity_errors *verify_errors)
+{
+	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
+	struct crypt_threadpool *tp = NULL;
+	struct verity_io data_io = {}, hash_io = {}, hash_io_rd = {}, stage_io = {};
+	struct verity_io *hash_wr = &hash_io, *hash_rd = &hash_io_rd;
+	struct device *stage_device = NULL;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t data_file_blocks;
+	uint64_t data_device_offset_max = 0, hash_device_offset_max = 0;
+	uint64_t hash_position = VERITY_hash_offset_block(params);
+	uint64_t dev_size, hash_start = hash_position, stage_base = 0;
+	struct verity_errors errors = {};
+	struct verity_zero zero = {};
+	struct verity_tree tree = {};
+	int levels, i, r;
+
+	/* Continue on corrupted blocks, all are reported */
+	if (verify && !verify_errors && (params->flags & CRYPT_VERITY_CHECK_HASH_ALL))
+		verify_errors = &errors;
+
+	log_dbg(cd, "Hash %s %s, data device %s, data blocks %" PRIu64
+		", hash_device %s, offset %" PRIu64 ".",
+		verify ? "verification" : "creation", params->hash_name,
+		device_path(crypt_data_device(cd)), params->data_size,
+		device_path(crypt_metadata_device(cd)), hash_position);
+
+	if (digest_size > sizeof(calculated_digest))
+		return -EINVAL;
+
+	if (!params->data_size) {
+		r = device_size(crypt_data_device(cd), &dev_size);
+		if (r < 0)
+			return r;
+
+		data_file_blocks = dev_size / params->data_block_size;
+	} else
+		data_file_blocks = params->data_size;
+
+	if (uint64_mult_overflow(&data_device_offset_max, params->data_size, params->data_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		return -EINVAL;
+	}
+	log_dbg(cd, "Data device size required: %" PRIu64 " bytes.", data_device_offset_max);
+
+	if (hash_levels(params->hash_block_size, digest_size, data_file_blocks, &hash_position,
+		&levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+	if (uint64_mult_overflow(&hash_device_offset_max, hash_position, params->hash_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		return -EINVAL;
+	}
+	log_dbg(cd, "Hash device size required: %" PRIu64 " bytes.",
+		hash_device_offset_max - params->hash_area_offset);
+	log_dbg(cd, "Using %d hash levels.", levels);
+
+	r = verity_io_open(cd, &data_io, crypt_data_device(cd), O_RDONLY);
+	if (r)
+		goto out;
+
+	r = verity_io_open(cd, &hash_io, crypt_metadata_device(cd), verify ? O_RDONLY : O_RDWR);
+	if (r)
+		goto out;
+
+	/*
+	 * FEC of data area covers the whole separate hash image, the file
+	 * must be extended to its final size before the hash area is written.
+	 */
+	if (fec_device && hash_io.block_size == 1 && hash_io.file_size < hash_device_offset_max &&
+	    device_is_identical(crypt_metadata_device(cd), fec_device) <= 0 &&
+	    ftruncate(hash_io.fd, hash_device_offset_max)) {
+		r = -EIO;
+		goto out;
+	}
+
+	/* Lower hash levels are read back through separate read-only descriptor */
+	r = verity_io_open(cd, &hash_io_rd, crypt_metadata_device(cd), O_RDONLY);
+	if (r)
+		goto out;
+
+	/* Hash tree is created separately, hash device is written only at the end */
+	if (!verify && !fec_device && levels && (params->flags & CRYPT_VERITY_CREATE_STAGED)) {
+		r = verity_stage_open(cd, &stage_io, &stage_device,
+				      (hash_position - hash_start) * params->hash_block_size);
+		if (r)
+			goto out;
+		hash_wr = hash_rd = &stage_io;
+		stage_base = hash_start;
+	}
+
+	if (crypt_threadpool_init(cd, &tp, crypt_get_threads(cd)))
+		log_dbg(cd, "Cannot initialize thread pool, hashing in one thread.");
+
+	memset(calculated_digest, 0, digest_size);
+
+	/*
+	 * Without error collection all levels are verified in one pass over
+	 * data, level by level processing is used to report all corrupted blocks.
+	 */
+	if (verify && !verify_errors && levels) {
+		r = verity_tree_init(&tree, params, &hash_io, hash_level_block, hash_level_size,
+				     data_file_blocks, levels, digest_size, calculated_digest);
+		if (!r)
+			r = create_or_verify(cd, tp, &data_io, &hash_io,
+					     0, params->data_block_size,
+					     hash_level_block[0], params->hash_block_size,
+					     data_file_blocks, params->hash_type, params->hash_name, verify,
+					     calculated_digest, digest_size, params->salt, params->salt_size,
+					     &zero, NULL, &tree);
+		if (!r && !tree.done)
+			r = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < levels; i++) {
+		if (verify_errors) {
+			verify_errors->rd_base = i ? data_file_blocks + hash_level_block[i - 1] - hash_start : 0;
+			verify_errors->wr_base = data_file_blocks + hash_level_block[i] - hash_start;
+		}
+
+		if (!i && fec_device) {
+			r = create_fec_level(cd, params, fec_device, &hash_io,
+					     hash_level_block[i], data_file_blocks,
+					     digest_size, &zero);
+			if (r)
+				goto out;
+		} else if (!i) {
+			r = create_or_verify(cd, tp, &data_io, hash_wr,
+						    0, params->data_block_size,
+						    hash_level_block[i] - stage_base, params->hash_block_size,
+						    data_file_blocks, params->hash_type, params->hash_name, verify,
+						    calculated_digest, digest_size, params->salt, params->salt_size,
+					    &zero, verify_errors, NULL);
+			if (r)
+				goto out;
+		} else {
+			r = create_or_verify(cd, tp, hash_rd, hash_wr,
+						    hash_level_block[i - 1] - stage_base, params->hash_block_size,
+						    hash_level_block[i] - stage_base, params->hash_block_size,
+						    hash_level_size[i - 1], params->hash_type, params->hash_name, verify,
+						    calculated_digest, digest_size, params->salt, params->salt_size,
+					    &zero, verify_errors, NULL);
+			if (r)
+				goto out;
+		}
+	}
+
+	if (levels)
+		r = create_or_verify(cd, tp, hash_rd, NULL,
+					    hash_level_block[levels - 1] - stage_base, params->hash_block_size,
+					    0, params->hash_block_size,
+					    1, params->hash_type, params->hash_name, verify,
+					    calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, verify_errors, NULL);
+	else
+		r = create_or_verify(cd, tp, &data_io, NULL,
+					    0, params->data_block_size,
+					    0, params->hash_block_size,
+					    data_file_blocks, params->hash_type, params->hash_name, verify,
+					    calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, verify_errors, NULL);
+
+	if (!r && stage_device)
+		r = verity_stage_copy(&stage_io, &hash_io, hash_start,
+				      hash_position - hash_start, params->hash_block_size);
+
+	if (!r && verify_errors && verify_errors->count) {
+		log_err(cd, _("Verification found %" PRIu64 " corrupted blocks."), verify_errors->count);
+		r = -EPERM;
+	}
+
+	/* Data parity is already written, add completed hash area */
+	if (!r && fec_device) {
+		if (levels)
+			r = VERITY_FEC_encode_hash(cd, params, fec_device);
+		else
+			r = VERITY_FEC_process(cd, params, fec_device, 0, NULL);
+	}
+out:
+	if (verify) {
+		if (r)
+			log_err(cd, _("Verification of data area failed."));
+		else {
+			log_dbg(cd, "Verification of data area succeeded.");
+			r = crypt_backend_memeq(root_hash, calculated_digest, digest_size) ? -EFAULT : 0;
+			if (!r)
+				log_dbg(cd, "Verification of root hash succeeded.");
+			else {
+				log_err(cd, _("Verification of root hash failed."));
+				/* Root hash is calculated from the top level hash block */
+				if (verify_errors)
+					verity_errors_add(verify_errors, levels ?
+						data_file_blocks + hash_level_block[levels - 1] - hash_start : 0, 1);
+			}
+		}
+	} else {
+		if (r == -EIO)
+			log_err(cd, _("Input/output error while creating hash area."));
+		else if (r)
+			log_err(cd, _("Creation of hash area failed."));
+		else {
+			device_sync(cd, crypt_metadata_device(cd));
+			memcpy(root_hash, calculated_digest, digest_size);
+		}
+	}
+
+	verity_tree_free(&tree);
+	crypt_threadpool_destroy(tp);
+	device_free(cd, stage_device);
+	return r;
+}
+
+/* Verify verity device using userspace crypto backend */
+int VERITY_verify(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	return VERITY_create_or_verify_hash(cd, 1, verity_hdr, NULL, CONST_CAST(char*)root_hash, root_hash_size, NULL);
+}
+
+/*
+ * Verify verity device and return ranges of corrupted blocks covered by FEC
+ * (data blocks followed by hash area blocks). Returns -EPERM or -EFAULT with
+ * allocated ranges if corruption is found.
+ */
+int VERITY_verify_corrupted(struct crypt_device *cd,
+			    struct crypt_params_verity *verity_hdr,
+			    const char *root_hash,
+			    size_t root_hash_size,
+			    struct crypt_verity_block_range **ranges,
+			    size_t *ranges_count)
+{
+	struct verity_errors errors = { .collect = true };
+	int r;
+
+	r = VERITY_create_or_verify_hash(cd, 1, verity_hdr, NULL, CONST_CAST(char*)root_hash,
+					 root_hash_size, &errors);
+	if (errors.r)
+		r = errors.r;
+
+	if (r == -EPERM || r == -EFAULT) {
+		*ranges = errors.ranges;
+		*ranges_count = errors.ranges_count;
+	} else
+		free(errors.ranges);
+
+	return r;
+}
+
+/*
+ * Sampled verification, every sample is one level 0 hash block with data
+ * blocks it covers. Digests of the sample are verified along the path
+ * to the top hash block (verified against root hash once), only blocks
+ * on the path are read. Samples are verified in parallel.
+ */
+struct verity_sample {
+	struct crypt_params_verity *params;
+	struct verity_io *data_io;
+	struct verity_io *hash_io;
+	const uint64_t *hash_level_block;
+	uint64_t data_blocks;
+	size_t digest_size;
+	size_t slot_size;
+	size_t hash_per_block;
+	int levels;
+
+	uint64_t *samples;		/* sorted level 0 hash block indexes */
+	uint64_t *failed;		/* failed position of sample, UINT64_MAX if valid */
+};
+
+/* splitmix64, only to spread samples reproducibly for the same seed */
+static uint64_t sample_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * Every sample is taken from its own equal part of level 0, without seed
+ * at the beginning of the part, with seed at pseudo-random position inside.
+ */
+static void sample_select(uint64_t *samples, uint64_t count, uint64_t total, uint64_t seed)
+{
+	uint64_t i, start, end, state = seed;
+
+	for (i = 0; i < count; i++) {
+		start = i * (total / count) + i * (total % count) / count;
+		end = (i + 1) * (total / count) + (i + 1) * (total % count) / count;
+		samples[i] = start;
+		if (seed && end > start + 1)
+			samples[i] += sample_random(&state) % (end - start);
+	}
+}
+
+static int sample_job(void *arg, unsigned int job)
+{
+	struct verity_sample *s = arg;
+	struct crypt_params_verity *p = s->params;
+	struct crypt_hash *ctx = NULL;
+	char *data = NULL, *hashes = NULL, *block[2] = {}, digest[VERITY_MAX_DIGEST_SIZE];
+	uint64_t index = s->samples[job], first = index * s->hash_per_block, offset, n;
+	unsigned int cur = 0;
+	int l, r = -ENOMEM;
+
+	n = s->data_blocks - first;
+	if (n > s->hash_per_block)
+		n = s->hash_per_block;
+
+	data = verity_io_alloc(s->data_io, n * p->data_block_size);
+	hashes = verity_io_alloc(s->hash_io, p->hash_block_size);
+	block[0] = verity_io_alloc(s->hash_io, p->hash_block_size);
+	block[1] = verity_io_alloc(s->hash_io, p->hash_block_size);
+	if (!data || !hashes || !block[0] || !block[1])
+		goto out;
+
+	if (crypt_hash_init(&ctx, p->hash_name)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = -EIO;
+	if (verity_io_read(s->data_io, data, n * p->data_block_size, first * p->data_block_size))
+		goto out;
+
+	offset = (s->hash_level_block[0] + index) * p->hash_block_size;
+	if (verity_io_read(s->hash_io, block[cur], p->hash_block_size, offset))
+		goto out;
+
+	/* Level 0, digests of data blocks are compared with the whole hash block */
+	memset(hashes, 0, p->hash_block_size);
+	if (crypt_hash_many(ctx,
+			    p->hash_type == 1 ? p->salt : NULL, p->hash_type == 1 ? p->salt_size : 0,
+			    p->hash_type == 0 ? p->salt : NULL, p->hash_type == 0 ? p->salt_size : 0,
+			    data, p->data_block_size, n, hashes, s->digest_size, s->slot_size)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = -EPERM;
+	if (crypt_backend_memeq(hashes, block[cur], p->hash_block_size)) {
+		s->failed[job] = first * p->data_block_size;
+		goto out;
+	}
+
+	/* Upper levels, only the digest of the child block on the path is checked */
+	for (l = 1; l < s->levels; l++) {
+		if (verify_hash_block(p->hash_name, p->hash_type, digest, s->digest_size,
+				      block[cur], p->hash_block_size, p->salt, p->salt_size)) {
+			r = -EINVAL;
+			goto out;
+		}
+
+		cur = !cur;
+		offset = (s->hash_level_block[l] + index / s->hash_per_block) * p->hash_block_size;
+		if (verity_io_read(s->hash_io, block[cur], p->hash_block_size, offset)) {
+			r = -EIO;
+			goto out;
+		}
+
+		if (crypt_backend_memeq(digest, block[cur] + (index % s->hash_per_block) * s->slot_size,
+					s->digest_size)) {
+			s->failed[job] = (s->hash_level_block[l - 1] + index) * p->hash_block_size;
+			goto out;
+		}
+		index /= s->hash_per_block;
+	}
+	r = 0;
+out:
+	crypt_hash_destroy(ctx);
+	free(block[1]);
+	free(block[0]);
+	free(hashes);
+	free(data);
+	return r;
+}
+
+/*
+ * Verify verity device only partially, percent of level 0 hash blocks
+ * (with all data blocks they cover) is verified.
+ */
+int VERITY_verify_sample(struct crypt_device *cd,
+			 struct crypt_params_verity *verity_hdr,
+			 const char *root_hash,
+			 size_t root_hash_size,
+			 uint32_t percent,
+			 uint64_t seed,
+			 uint64_t *verified_blocks)
+{
+	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
+	struct crypt_threadpool *tp = NULL;
+	struct verity_io data_io = {}, hash_io = {};
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t hash_position = VERITY_hash_offset_block(verity_hdr);
+	uint64_t data_file_blocks, dev_size, count, i, blocks = 0;
+	struct verity_sample s = {
+		.params = verity_hdr,
+		.data_io = &data_io,
+		.hash_io = &hash_io,
+		.hash_level_block = hash_level_block,
+		.digest_size = root_hash_size,
+	};
+	int r;
+
+	if (root_hash_size > sizeof(calculated_digest) || !percent || percent > 100)
+		return -EINVAL;
+
+	if (!verity_hdr->data_size) {
+		r = device_size(crypt_data_device(cd), &dev_size);
+		if (r < 0)
+			return r;
+
+		data_file_blocks = dev_size / verity_hdr->data_block_size;
+	} else
+		data_file_blocks = verity_hdr->data_size;
+
+	if (hash_levels(verity_hdr->hash_block_size, root_hash_size, data_file_blocks, &hash_position,
+		&s.levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+
+	/* Whole device fits into one block, there is nothing to sample */
+	if (percent == 100 || !s.levels) {
+		r = VERITY_verify(cd, verity_hdr, root_hash, root_hash_size);
+		if (!r && verified_blocks)
+			*verified_blocks = data_file_blocks;
+		return r;
+	}
+
+	s.data_blocks = data_file_blocks;
+	s.hash_per_block = 1 << get_bits_down(verity_hdr->hash_block_size / root_hash_size);
+	s.slot_size = verity_hdr->hash_type ? 1 << get_bits_up(root_hash_size) : root_hash_size;
+
+	count = (hash_level_size[0] * percent + 99) / 100;
+	if (count > UINT_MAX)
+		return -EINVAL;
+
+	log_dbg(cd, "Sampled hash verification %s, data device %s, %" PRIu64 " of %" PRIu64
+		" hash blocks, seed %" PRIu64 ", using %d hash levels.", verity_hdr->hash_name,
+		device_path(crypt_data_device(cd)), count, hash_level_size[0], seed, s.levels);
+
+	s.samples = malloc(count * sizeof(*s.samples));
+	s.failed = malloc(count * sizeof(*s.failed));
+	if (!s.samples || !s.failed) {
+		r = -ENOMEM;
+		goto out;
+	}
+	sample_select(s.samples, count, hash_level_size[0], seed);
+	for (i = 0; i < count; i++)
+		s.failed[i] = UINT64_MAX;
+
+	r = verity_io_open(cd, &data_io, crypt_data_device(cd), O_RDONLY);
+	if (!r)
+		r = verity_io_open(cd, &hash_io, crypt_metadata_device(cd), O_RDONLY);
+	if (r)
+		goto out;
+
+	/* The top level hash block is shared by all paths */
+	r = create_or_verify(cd, NULL, &hash_io, NULL,
+			     hash_level_block[s.levels - 1], verity_hdr->hash_block_size,
+			     0, verity_hdr->hash_block_size,
+			     1, verity_hdr->hash_type, verity_hdr->hash_name, 1,
+			     calculated_digest, root_hash_size, verity_hdr->salt, verity_hdr->salt_size,
+			     NULL, NULL, NULL);
+	if (r)
+		goto out;
+
+	if (crypt_backend_memeq(root_hash, calculated_digest, root_hash_size)) {
+		log_err(cd, _("Verification of root hash failed."));
+		r = -EFAULT;
+		goto out;
+	}
+
+	if (crypt_threadpool_init(cd, &tp, crypt_get_threads(cd)))
+		log_dbg(cd, "Cannot initialize thread pool, hashing in one thread.");
+
+	r = crypt_threadpool_run(tp, count, sample_job, &s);
+
+	for (i = 0; i < count; i++) {
+		if (s.failed[i] != UINT64_MAX) {
+			log_err(cd, _("Verification failed at position %" PRIu64 "."), s.failed[i]);
+			break;
+		}
+		blocks += data_file_blocks - s.samples[i] * s.hash_per_block < s.hash_per_block ?
+			  data_file_blocks - s.samples[i] * s.hash_per_block : s.hash_per_block;
+	}
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while verifying hash area."));
+	else if (r == -EPERM)
+		log_err(cd, _("Verification of data area failed."));
+	else if (!r) {
+		log_dbg(cd, "Sampled verification of %" PRIu64 " data blocks succeeded.", blocks);
+		if (verified_blocks)
+			*verified_blocks = blocks;
+	}
+
+	crypt_threadpool_destroy(tp);
+	free(s.failed);
+	free(s.samples);
+	return r;
+}
+
+/* Create verity hash */
+int VERITY_create(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	unsigned pgsize = (unsigned)crypt_getpagesize();
+
+	if (verity_hdr->salt_size > 256)
+		return -EINVAL;
+
+	if (verity_hdr->data_block_size > pgsize)
+		log_err(cd, _("WARNING: Kernel cannot activate device if data "
+			      "block size exceeds page size (%u)."), pgsize);
+
+	return VERITY_create_or_verify_hash(cd, 0, verity_hdr, NULL, CONST_CAST(char*)root_hash, root_hash_size, NULL);
+}
+
+/* Create verity hash and FEC, data device is read only once */
+int VERITY_create_fec(struct crypt_device *cd,
+		      struct crypt_params_verity *verity_hdr,
+		      struct device *fec_device,
+		      const char *root_hash,
+		      size_t root_hash_size)
+{
+	unsigned pgsize = (unsigned)crypt_getpagesize();
+	int r;
+
+	if (verity_hdr->salt_size > 256)
+		return -EINVAL;
+
+	if (verity_hdr->data_block_size > pgsize)
+		log_err(cd, _("WARNING: Kernel cannot activate device if data "
+			      "block size exceeds page size (%u)."), pgsize);
+
+	/* Single pass needs FEC layout of data area known in advance */
+	if (!verity_hdr->data_size || verity_hdr->data_block_size != verity_hdr->hash_block_size) {
+		r = VERITY_create_or_verify_hash(cd, 0, verity_hdr, NULL,
+						 CONST_CAST(char*)root_hash, root_hash_size, NULL);
+		if (!r)
+			r = VERITY_FEC_process(cd, verity_hdr, fec_device, 0, NULL);
+		return r;
+	}
+
+	return VERITY_create_or_verify_hash(cd, 0, verity_hdr, fec_device,
+					    CONST_CAST(char*)root_hash, root_hash_size, NULL);
+}
+
+/*
+ * Level 0 of hash tree from data stream, read until EOF. Input is double
+ * buffered as in create_or_verify(), data can be copied to output device.
+ * Returns number of data blocks and digest of the first data block.
+ */
+static int create_stream_level(struct crypt_device *cd, struct crypt_threadpool *tp,
+			       int fd, struct verity_io *out, struct verity_io *wr,
+			       uint64_t hash_block, uint64_t max_blocks,
+			       struct crypt_params_verity *params, size_t digest_size,
+			       struct verity_zero *zero, uint64_t *blocks, char *first_digest)
+{
+	char *data_buffer[2] = {}, *hash_buffer = NULL, *zero_block = NULL;
+	char zero_digest[VERITY_MAX_DIGEST_SIZE];
+	size_t hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
+	size_t data_block_size = params->data_block_size, hash_block_size = params->hash_block_size;
+	size_t hash_buffer_size, batch_size;
+	ssize_t next_size;
+	uint64_t seek_wr, batch_blocks, n, done_blocks = 0;
+	unsigned int jobs, cur = 0;
+	struct verity_hash_batch b = {
+		.hash_name = params->hash_name,
+		.salt = params->salt,
+		.salt_size = params->salt_size,
+		.version = params->hash_type,
+		.digest_size = digest_size,
+		.slot_size = params->hash_type ? (size_t)1 << get_bits_up(digest_size) : digest_size,
+		.data_block_size = data_block_size,
+		.hash_block_size = hash_block_size,
+		.hash_per_block = hash_per_block,
+	};
+	int r, r_io;
+
+	if (uint64_mult_overflow(&seek_wr, hash_block, hash_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		return -EINVAL;
+	}
+
+	b.job_blocks = VERITY_JOB_SIZE / data_block_size ?: 1;
+	jobs = VERITY_BATCH_SIZE / (b.job_blocks * data_block_size);
+	if (jobs < 2 * crypt_threadpool_threads(tp))
+		jobs = 2 * crypt_threadpool_threads(tp);
+	batch_blocks = (uint64_t)jobs * b.job_blocks;
+	batch_size = batch_blocks * data_block_size;
+	hash_buffer_size = (batch_blocks / hash_per_block + 2) * hash_block_size;
+
+	data_buffer[0] = verity_io_alloc(out ?: wr, batch_size);
+	data_buffer[1] = verity_io_alloc(out ?: wr, batch_size);
+	hash_buffer = verity_io_alloc(wr, hash_buffer_size);
+	if (!data_buffer[0] || !data_buffer[1] || !hash_buffer) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	memset(hash_buffer, 0, hash_buffer_size);
+	b.hashes = hash_buffer;
+
+	r = verity_zero_block(&b, zero, &zero_block, zero_digest);
+	if (r)
+		goto out;
+	b.zero_block = zero_block;
+	b.zero_digest = zero_digest;
+
+	next_size = read_buffer(fd, data_buffer[cur], batch_size);
+
+	while (next_size > 0) {
+		if (next_size % data_block_size) {
+			log_err(cd, _("Data stream size is not a multiple of data block size."));
+			r = -EINVAL;
+			goto out;
+		}
+
+		b.data = data_buffer[cur];
+		b.first_block = done_blocks;
+		b.blocks = next_size / data_block_size;
+
+		if (max_blocks && b.blocks > max_blocks - done_blocks) {
+			log_err(cd, _("Data area overlaps with hash area."));
+			r = -EINVAL;
+			goto out;
+		}
+
+		jobs = (b.blocks + b.job_blocks - 1) / b.job_blocks;
+		r = crypt_threadpool_start(tp, jobs, hash_batch_job, &b);
+
+		/* Copy and read next batch while the current one is being hashed */
+		r_io = 0;
+		if (!r && out && verity_io_write(out, data_buffer[cur], next_size,
+						 done_blocks * data_block_size)) {
+			log_dbg(cd, "Cannot write data device block.");
+			r_io = -EIO;
+		}
+		if (!r && !r_io) {
+			if ((size_t)next_size == batch_size)
+				next_size = read_buffer(fd, data_buffer[!cur], batch_size);
+			else
+				next_size = 0;
+			if (next_size < 0) {
+				log_dbg(cd, "Cannot read data stream.");
+				r_io = -EIO;
+			}
+		}
+
+		if (!r)
+			r = crypt_threadpool_wait(tp);
+		if (r) {
+			r = -EINVAL;
+			goto out;
+		}
+		if (r_io) {
+			r = r_io;
+			goto out;
+		}
+		cur = !cur;
+
+		if (!done_blocks)
+			memcpy(first_digest, hash_buffer, digest_size);
+		done_blocks += b.blocks;
+
+		/* Number of completed hash blocks in batch */
+		if (!next_size)
+			n = (done_blocks + hash_per_block - 1) / hash_per_block - b.first_hash_block;
+		else
+			n = done_blocks / hash_per_block - b.first_hash_block;
+
+		if (!n)
+			continue;
+
+		if (verity_io_write(wr, hash_buffer, n * hash_block_size,
+				    seek_wr + b.first_hash_block * hash_block_size)) {
+			log_dbg(cd, "Cannot write digest to hash device.");
+			r = -EIO;
+			goto out;
+		}
+
+		/* Carry over partially filled hash block */
+		if (done_blocks % hash_per_block)
+			memmove(hash_buffer, hash_buffer + n * hash_block_size, hash_block_size);
+		else
+			memset(hash_buffer, 0, hash_block_size);
+		memset(hash_buffer + hash_block_size, 0, hash_buffer_size - hash_block_size);
+		b.first_hash_block += n;
+	}
+
+	if (next_size < 0) {
+		log_dbg(cd, "Cannot read data stream.");
+		r = -EIO;
+		goto out;
+	}
+
+	*blocks = done_blocks;
+	r = 0;
+out:
+	free(zero_block);
+	free(hash_buffer);
+	free(data_buffer[1]);
+	free(data_buffer[0]);
+	return r;
+}
+
+/* Move hash blocks to higher offset, overlapping areas are copied from the end */
+static int verity_move_blocks(struct verity_io *io, uint64_t from, uint64_t to,
+			      uint64_t blocks, size_t block_size)
+{
+	uint64_t n, chunk = VERITY_BATCH_SIZE / block_size ?: 1;
+	char *buf;
+	int r = 0;
+
+	if (from == to)
+		return 0;
+
+	buf = verity_io_alloc(io, chunk * block_size);
+	if (!buf)
+		return -ENOMEM;
+
+	for (; blocks && !r; blocks -= n) {
+		n = blocks > chunk ? chunk : blocks;
+		if (verity_io_read(io, buf, n * block_size, (from + blocks - n) * block_size) ||
+		    verity_io_write(io, buf, n * block_size, (to + blocks - n) * block_size))
+			r = -EIO;
+	}
+
+	free(buf);
+	return r;
+}
+
+/*
+ * Create verity hash from data stream (pipe), read until EOF. Data can be
+ * copied to data device. Hash area layout depends on the number of data
+ * blocks, so level 0 is created at the start of hash area and moved
+ * behind upper levels when the stream ends.
+ */
+int VERITY_create_stream(struct crypt_device *cd,
+			 struct crypt_params_verity *params,
+			 int data_fd,
+			 struct device *data_device,
+			 uint64_t max_blocks,
+			 char *root_hash,
+			 size_t digest_size)
+{
+	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
+	struct crypt_threadpool *tp = NULL;
+	struct verity_io data_io, hash_io, hash_io_rd;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t hash_start = VERITY_hash_offset_block(params), hash_position = hash_start;
+	uint64_t data_file_blocks = 0;
+	unsigned pgsize = (unsigned)crypt_getpagesize();
+	struct verity_zero zero = {};
+	int levels, i, r;
+
+	if (params->salt_size > 256 || digest_size > sizeof(calculated_digest))
+		return -EINVAL;
+
+	if (params->data_block_size > pgsize)
+		log_err(cd, _("WARNING: Kernel cannot activate device if data "
+			      "block size exceeds page size (%u)."), pgsize);
+
+	log_dbg(cd, "Hash creation %s from data stream%s%s, hash_device %s, offset %" PRIu64 ".",
+		params->hash_name, data_device ? " copied to " : "",
+		data_device ? device_path(data_device) : "",
+		device_path(crypt_metadata_device(cd)), hash_start);
+
+	if (data_device) {
+		r = verity_io_open(cd, &data_io, data_device, O_RDWR);
+		if (r)
+			goto out;
+	}
+
+	r = verity_io_open(cd, &hash_io, crypt_metadata_device(cd), O_RDWR);
+	if (r)
+		goto out;
+
+	r = verity_io_open(cd, &hash_io_rd, crypt_metadata_device(cd), O_RDONLY);
+	if (r)
+		goto out;
+
+	if (crypt_threadpool_init(cd, &tp, crypt_get_threads(cd)))
+		log_dbg(cd, "Cannot initialize thread pool, hashing in one thread.");
+
+	memset(calculated_digest, 0, digest_size);
+
+	r = create_stream_level(cd, tp, data_fd, data_device ? &data_io : NULL, &hash_io,
+				hash_start, max_blocks, params, digest_size, &zero,
+				&data_file_blocks, calculated_digest);
+	if (r)
+		goto out;
+
+	if (!data_file_blocks) {
+		log_err(cd, _("Data stream is empty."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (hash_levels(params->hash_block_size, digest_size, data_file_blocks, &hash_position,
+		&levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		r = -EINVAL;
+		goto out;
+	}
+	log_dbg(cd, "Streamed %" PRIu64 " data blocks, using %d hash levels.", data_file_blocks, levels);
+
+	/* Only one data block, its digest is the root hash */
+	if (!levels)
+		goto out;
+
+	r = verity_move_blocks(&hash_io, hash_start, hash_level_block[0],
+			       hash_level_size[0], params->hash_block_size);
+	if (r)
+		goto out;
+
+	for (i = 1; i < levels; i++) {
+		r = create_or_verify(cd, tp, &hash_io_rd, &hash_io,
+				     hash_level_block[i - 1], params->hash_block_size,
+				     hash_level_block[i], params->hash_block_size,
+				     hash_level_size[i - 1], params->hash_type, params->hash_name, 0,
+				     calculated_digest, digest_size, params->salt, params->salt_size,
+				     &zero, NULL, NULL);
+		if (r)
+			goto out;
+	}
+
+	r = create_or_verify(cd, tp, &hash_io_rd, NULL,
+			     hash_level_block[levels - 1], params->hash_block_size,
+			     0, params->hash_block_size,
+			     1, params->hash_type, params->hash_name, 0,
+			     calculated_digest, digest_size, params->salt, params->salt_size,
+			     NULL, NULL, NULL);
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while creating hash area."));
+	else if (r)
+		log_err(cd, _("Creation of hash area failed."));
+	else {
+		if (data_device)
+			device_sync(cd, data_device);
+		device_sync(cd, crypt_metadata_device(cd));
+		params->data_size = data_file_blocks;
+		memcpy(root_hash, calculated_digest, digest_size);
+	}
+
+	crypt_threadpool_destroy(tp);
+	return r;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct crypt_verity_block_range *r1 = a, *r2 = b;
+
+	if (r1->start < r2->start)
+		return -1;
+	return r1->start > r2->start ? 1 : 0;
+}
+
+/*
+ * Convert sorted ranges of input blocks to merged ranges of hash blocks
+ * at the level above (in place).
+ */
+static size_t ranges_to_hash_blocks(struct crypt_verity_block_range *ranges,
+				    size_t count, size_t hash_per_block)
+{
+	uint64_t start, end;
+	size_t i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		start = ranges[i].start / hash_per_block;
+		end = (ranges[i].start + ranges[i].count + hash_per_block - 1) / hash_per_block;
+		if (n && start <= ranges[n - 1].start + ranges[n - 1].count) {
+			if (end > ranges[n - 1].start + ranges[n - 1].count)
+				ranges[n - 1].count = end - ranges[n - 1].start;
+			continue;
+		}
+		ranges[n].start = start;
+		ranges[n].count = end - start;
+		n++;
+	}
+
+	return n;
+}
+
+/* Update hash area for changed data blocks only */
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *params,
+		  const struct crypt_verity_block_range *ranges,
+		  size_t ranges_count,
+		  char *root_hash,
+		  size_t digest_size)
+{
+	char calculated_digest[VERITY_MAX_DIGEST_SIZE];
+	struct crypt_threadpool *tp = NULL;
+	struct crypt_verity_block_range *r_blocks = NULL;
+	struct verity_io data_io, hash_io, *rd;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t data_file_blocks, dev_size, input_block, input_blocks, start, end;
+	uint64_t hash_position = VERITY_hash_offset_block(params);
+	size_t hash_per_block, input_block_size, count, i;
+	int levels, l, r;
+
+	if (digest_size > sizeof(calculated_digest))
+		return -EINVAL;
+
+	if (!params->data_size) {
+		r = device_size(crypt_data_device(cd), &dev_size);
+		if (r < 0)
+			return r;
+
+		data_file_blocks = dev_size / params->data_block_size;
+	} else
+		data_file_blocks = params->data_size;
+
+	if (hash_levels(params->hash_block_size, digest_size, data_file_blocks, &hash_position,
+		&levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ranges_count; i++)
+		if (!ranges[i].count || ranges[i].start >= data_file_blocks ||
+		    ranges[i].count > data_file_blocks - ranges[i].start) {
+			log_err(cd, _("Data block range %" PRIu64 "+%" PRIu64 " is out of device."),
+				ranges[i].start, ranges[i].count);
+			return -EINVAL;
+		}
+
+	log_dbg(cd, "Hash update %s, data device %s, data blocks %" PRIu64
+		", hash_device %s, %zu changed ranges, using %d hash levels.",
+		params->hash_name, device_path(crypt_data_device(cd)), data_file_blocks,
+		device_path(crypt_metadata_device(cd)), ranges_count, levels);
+
+	if (ranges_count) {
+		r_blocks = malloc(ranges_count * sizeof(*r_blocks));
+		if (!r_blocks)
+			return -ENOMEM;
+		memcpy(r_blocks, ranges, ranges_count * sizeof(*r_blocks));
+		qsort(r_blocks, ranges_count, sizeof(*r_blocks), range_cmp);
+	}
+	count = ranges_count;
+
+	r = verity_io_open(cd, &data_io, crypt_data_device(cd), O_RDONLY);
+	if (!r)
+		r = verity_io_open(cd, &hash_io, crypt_metadata_device(cd), O_RDWR);
+	if (r)
+		goto out;
+
+	if (crypt_threadpool_init(cd, &tp, crypt_get_threads(cd)))
+		log_dbg(cd, "Cannot initialize thread pool, hashing in one thread.");
+
+	hash_per_block = 1 << get_bits_down(params->hash_block_size / digest_size);
+	memset(calculated_digest, 0, digest_size);
+
+	for (l = 0; l < levels; l++) {
+		if (!l) {
+			rd = &data_io;
+			input_block = 0;
+			input_block_size = params->data_block_size;
+			input_blocks = data_file_blocks;
+		} else {
+			rd = &hash_io;
+			input_block = hash_level_block[l - 1];
+			input_block_size = params->hash_block_size;
+			input_blocks = hash_level_size[l - 1];
+		}
+
+		/* Rehash complete hash blocks covering changed input blocks */
+		count = ranges_to_hash_blocks(r_blocks, count, hash_per_block);
+		for (i = 0; i < count; i++) {
+			start = r_blocks[i].start * hash_per_block;
+			end = (r_blocks[i].start + r_blocks[i].count) * hash_per_block;
+			if (end > input_blocks)
+				end = input_blocks;
+
+			log_dbg(cd, "Level %d: updating hash blocks %" PRIu64 "-%" PRIu64 ".",
+				l, r_blocks[i].start, r_blocks[i].start + r_blocks[i].count - 1);
+
+			r = create_or_verify(cd, tp, rd, &hash_io,
+					     input_block + start, input_block_size,
+					     hash_level_block[l] + r_blocks[i].start, params->hash_block_size,
+					     end - start, params->hash_type, params->hash_name, 0,
+					     calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, NULL, NULL);
+			if (r)
+				goto out;
+		}
+	}
+
+	if (levels)
+		r = create_or_verify(cd, tp, &hash_io, NULL,
+				     hash_level_block[levels - 1], params->hash_block_size,
+				     0, params->hash_block_size,
+				     1, params->hash_type, params->hash_name, 0,
+				     calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, NULL, NULL);
+	else
+		r = create_or_verify(cd, tp, &data_io, NULL,
+				     0, params->data_block_size,
+				     0, params->hash_block_size,
+				     data_file_blocks, params->hash_type, params->hash_name, 0,
+				     calculated_digest, digest_size, params->salt, params->salt_size,
+					    NULL, NULL, NULL);
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while updating hash area."));
+	else if (r)
+		log_err(cd, _("Update of hash area failed."));
+	else {
+		device_sync(cd, crypt_metadata_device(cd));
+		memcpy(root_hash, calculated_digest, digest_size);
+	}
+
+	crypt_threadpool_destroy(tp);
+	free(r_blocks);
+	return r;
 }
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params)
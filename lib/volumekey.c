@@ -23,6 +23,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "internal.h"
 
@@ -38,6 +40,7 @@ struct volume_key *crypt_alloc_volume_key(size_t keylength, const char *key)
 		return NULL;
 
 	vk->key_description = NULL;
+	vk->key_serial = 0;
 	vk->keylength = keylength;
 	vk->id = -1;
 	vk->next = NULL;
@@ -145,3 +148,234 @@ struct volume_key *crypt_generate_volume_key(struct crypt_device *cd, size_t key
 	}
 	return vk;
 }
+
+/*
+ * Process-wide cache of unlocked volume keys (opt-in).
+ *
+ * Entry is keyed by header UUID, header sequence id and digest id, so any
+ * header update (e.g. passphrase change) invalidates it. Passphrase is never
+ * stored, entry keeps only a HMAC of it with a random per-process key, so
+ * the cached key is returned only for the same passphrase, without PBKDF.
+ * Entries live in locked memory and expire after configured timeout.
+ */
+#define VK_CACHE_ENTRIES 32
+#define VK_CACHE_HASH "sha256"
+#define VK_CACHE_TAG_L 32
+
+struct vk_cache_entry {
+	char uuid[40];
+	uint64_t seqid;
+	int digest;
+	int keyslot;
+	int vk_id;
+	uint64_t expires;
+	char tag[VK_CACHE_TAG_L];
+	size_t keylength;
+	char key[];
+};
+
+static pthread_mutex_t vk_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vk_cache_entry *vk_cache[VK_CACHE_ENTRIES];
+static unsigned int vk_cache_timeout = 0;
+static char *vk_cache_secret = NULL;
+
+static uint64_t vk_cache_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return UINT64_MAX;
+
+	return (uint64_t)ts.tv_sec;
+}
+
+/* Must be called with vk_cache_lock held */
+static void vk_cache_drop(unsigned int i)
+{
+	crypt_safe_free(vk_cache[i]);
+	vk_cache[i] = NULL;
+}
+
+/* Must be called with vk_cache_lock held */
+static void vk_cache_expire(uint64_t now)
+{
+	unsigned int i;
+
+	for (i = 0; i < VK_CACHE_ENTRIES; i++)
+		if (vk_cache[i] && vk_cache[i]->expires <= now)
+			vk_cache_drop(i);
+}
+
+/* Must be called with vk_cache_lock held */
+static int vk_cache_tag(const char *uuid, uint64_t seqid, int digest,
+			const char *password, size_t password_len, char *tag)
+{
+	struct crypt_hmac *hmac;
+	uint64_t le_seqid = cpu_to_le64(seqid);
+	int32_t le_digest = cpu_to_le32(digest);
+	int r;
+
+	r = crypt_hmac_init(&hmac, VK_CACHE_HASH, vk_cache_secret, VK_CACHE_TAG_L);
+	if (r < 0)
+		return r;
+
+	r = crypt_hmac_write(hmac, uuid, strlen(uuid) + 1);
+	if (!r)
+		r = crypt_hmac_write(hmac, (const char *)&le_seqid, sizeof(le_seqid));
+	if (!r)
+		r = crypt_hmac_write(hmac, (const char *)&le_digest, sizeof(le_digest));
+	if (!r && password_len)
+		r = crypt_hmac_write(hmac, password, password_len);
+	if (!r)
+		r = crypt_hmac_final(hmac, tag, VK_CACHE_TAG_L);
+	crypt_hmac_destroy(hmac);
+
+	return r;
+}
+
+void crypt_vk_cache_flush(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&vk_cache_lock);
+	for (i = 0; i < VK_CACHE_ENTRIES; i++)
+		vk_cache_drop(i);
+	pthread_mutex_unlock(&vk_cache_lock);
+}
+
+void crypt_vk_cache_set_timeout(unsigned int timeout)
+{
+	pthread_mutex_lock(&vk_cache_lock);
+	vk_cache_timeout = timeout;
+	pthread_mutex_unlock(&vk_cache_lock);
+
+	if (!timeout)
+		crypt_vk_cache_flush();
+}
+
+bool crypt_vk_cache_enabled(void)
+{
+	return __atomic_load_n(&vk_cache_timeout, __ATOMIC_RELAXED) != 0;
+}
+
+int crypt_vk_cache_get(struct crypt_device *cd, const char *uuid, uint64_t seqid, int digest,
+		       int keyslot, const char *password, size_t password_len,
+		       struct volume_key **vk)
+{
+	char tag[VK_CACHE_TAG_L];
+	struct vk_cache_entry *e;
+	unsigned int i;
+	int r = -ENOENT;
+
+	if (!uuid || !*uuid || !vk)
+		return -EINVAL;
+
+	pthread_mutex_lock(&vk_cache_lock);
+	if (!vk_cache_timeout || !vk_cache_secret)
+		goto out;
+
+	vk_cache_expire(vk_cache_now());
+
+	if (vk_cache_tag(uuid, seqid, digest, password, password_len, tag) < 0)
+		goto out;
+
+	for (i = 0; i < VK_CACHE_ENTRIES; i++) {
+		e = vk_cache[i];
+		if (!e || e->seqid != seqid || e->digest != digest || strcmp(e->uuid, uuid))
+			continue;
+		if (keyslot != CRYPT_ANY_SLOT && keyslot != e->keyslot)
+			continue;
+		if (crypt_backend_memeq(e->tag, tag, VK_CACHE_TAG_L))
+			continue;
+
+		*vk = crypt_alloc_volume_key(e->keylength, e->key);
+		if (!*vk) {
+			r = -ENOMEM;
+			goto out;
+		}
+		crypt_volume_key_set_id(*vk, e->vk_id);
+		log_dbg(cd, "Volume key for keyslot %d found in cache.", e->keyslot);
+		r = e->keyslot;
+		break;
+	}
+out:
+	pthread_mutex_unlock(&vk_cache_lock);
+	crypt_safe_memzero(tag, sizeof(tag));
+	return r;
+}
+
+void crypt_vk_cache_put(struct crypt_device *cd, const char *uuid, uint64_t seqid, int digest,
+			int keyslot, const char *password, size_t password_len,
+			const struct volume_key *vk)
+{
+	struct vk_cache_entry *e = NULL;
+	unsigned int i, slot = 0;
+	uint64_t now;
+
+	if (!uuid || !*uuid || strlen(uuid) >= sizeof(e->uuid) || !vk || keyslot < 0)
+		return;
+
+	pthread_mutex_lock(&vk_cache_lock);
+	if (!vk_cache_timeout)
+		goto out;
+
+	if (!vk_cache_secret) {
+		vk_cache_secret = crypt_safe_alloc(VK_CACHE_TAG_L);
+		if (!vk_cache_secret)
+			goto out;
+		if (crypt_random_get(cd, vk_cache_secret, VK_CACHE_TAG_L, CRYPT_RND_KEY) < 0) {
+			crypt_safe_free(vk_cache_secret);
+			vk_cache_secret = NULL;
+			goto out;
+		}
+	}
+
+	e = crypt_safe_alloc(sizeof(*e) + vk->keylength);
+	if (!e)
+		goto out;
+
+	if (vk_cache_tag(uuid, seqid, digest, password, password_len, e->tag) < 0) {
+		crypt_safe_free(e);
+		goto out;
+	}
+
+	now = vk_cache_now();
+	vk_cache_expire(now);
+
+	strcpy(e->uuid, uuid);
+	e->seqid = seqid;
+	e->digest = digest;
+	e->keyslot = keyslot;
+	e->vk_id = vk->id;
+	e->expires = now + vk_cache_timeout;
+	e->keylength = vk->keylength;
+	memcpy(e->key, vk->key, vk->keylength);
+
+	/* Replace entry with the same key or the one expiring first */
+	for (i = 0; i < VK_CACHE_ENTRIES; i++) {
+		if (!vk_cache[i] || (!strcmp(vk_cache[i]->uuid, uuid) &&
+		    vk_cache[i]->digest == digest && vk_cache[i]->keyslot == keyslot)) {
+			slot = i;
+			break;
+		}
+		if (vk_cache[i]->expires < vk_cache[slot]->expires)
+			slot = i;
+	}
+
+	if (vk_cache[slot])
+		vk_cache_drop(slot);
+	vk_cache[slot] = e;
+	log_dbg(cd, "Volume key for keyslot %d stored in cache.", keyslot);
+out:
+	pthread_mutex_unlock(&vk_cache_lock);
+}
+
+void crypt_vk_cache_destroy(void)
+{
+	crypt_vk_cache_flush();
+
+	pthread_mutex_lock(&vk_cache_lock);
+	crypt_safe_free(vk_cache_secret);
+	vk_cache_secret = NULL;
+	pthread_mutex_unlock(&vk_cache_lock);
+}
@@ -21,6 +21,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
 #include <uuid/uuid.h>
 
 #include "cryptsetup.h"
@@ -206,7 +207,7 @@ static int action_open_plain(void)
 		/* Skip blkid scan when activating plain device with offset */
 		if (!ARG_UINT64(OPT_OFFSET_ID)) {
 			/* Print all present signatures in read-only mode */
-			r = tools_detect_signatures(action_argv[0], PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID));
+			r = tools_detect_signatures(action_argv[0], PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID), 0);
 			if (r < 0)
 				goto out;
 		}
@@ -246,6 +247,7 @@ static int action_open_plain(void)
 		activate_flags |= CRYPT_ACTIVATE_SHARED;
 
 	set_activation_flags(&activate_flags);
+	set_perf_profile_flags(cd, &activate_flags);
 
 	if (!tools_is_stdin(ARG_STR(OPT_KEY_FILE_ID))) {
 		/* If no hash, key is read directly, read size is always key_size
@@ -269,6 +271,9 @@ static int action_open_plain(void)
 		r = crypt_activate_by_passphrase(cd, activated_name,
 			CRYPT_ANY_SLOT, password, passwordLen, activate_flags);
 	}
+
+	if (r >= 0)
+		set_activation_cpumask(cd, activated_name);
 out:
 	crypt_free(cd);
 	crypt_free(cd1);
@@ -323,6 +328,290 @@ out:
 	return r;
 }
 
+/* One line of --batch-file manifest: <name> <device> [<key file>|random] [<options>] */
+struct open_batch_entry {
+	char *name;
+	char *device;
+	char *key_file;		/* NULL for ephemeral random key */
+	char cipher[MAX_CIPHER_LEN];
+	char cipher_mode[MAX_CIPHER_LEN];
+	size_t key_size;
+	uint64_t offset;
+	uint64_t skip;
+	uint32_t sector_size;
+	struct crypt_device *cd;
+};
+
+static int open_batch_parse_uint64(const char *value, uint64_t *ret)
+{
+	char *end = NULL;
+
+	if (!isdigit(*value))
+		return -EINVAL;
+
+	errno = 0;
+	*ret = strtoull(value, &end, 10);
+	if (errno || !end || *end)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int open_batch_parse_options(struct open_batch_entry *e, char *options, bool plain)
+{
+	char *opt, *value, *save = NULL;
+	uint64_t tmp;
+
+	for (opt = strtok_r(options, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+
+		if (!strcmp(opt, "cipher")) {
+			if (plain && crypt_parse_name_and_mode(value, e->cipher, NULL, e->cipher_mode) < 0)
+				return -EINVAL;
+			/* loop-AES cipher is passed as a whole */
+			if (!plain && snprintf(e->cipher, sizeof(e->cipher), "%s", value) >= (int)sizeof(e->cipher))
+				return -EINVAL;
+			continue;
+		}
+
+		if (open_batch_parse_uint64(value, &tmp))
+			return -EINVAL;
+
+		if (!strcmp(opt, "size") && tmp && !(tmp % 8) && tmp / 8 <= 512)
+			e->key_size = tmp / 8;
+		else if (!strcmp(opt, "offset"))
+			e->offset = tmp;
+		else if (!strcmp(opt, "skip"))
+			e->skip = tmp;
+		else if (!strcmp(opt, "sector-size") && plain && tmp <= UINT32_MAX)
+			e->sector_size = tmp;
+		else
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void open_batch_free(struct open_batch_entry *entries, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		crypt_free(entries[i].cd);
+		free(entries[i].name);
+		free(entries[i].device);
+		free(entries[i].key_file);
+	}
+	free(entries);
+}
+
+static int open_batch_read(const char *path, bool plain,
+			   struct open_batch_entry **ret, size_t *ret_count)
+{
+	struct open_batch_entry *entries = NULL, *tmp, *e;
+	size_t count = 0, alloc = 0, len = 0;
+	unsigned int line_nr = 0;
+	char *line = NULL, *p, *name, *device, *key, *options, *save;
+	FILE *f;
+	int r = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		log_err(_("Cannot open batch file %s."), path);
+		return -EINVAL;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		line_nr++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+
+		save = NULL;
+		name = strtok_r(p, " \t\n", &save);
+		device = strtok_r(NULL, " \t\n", &save);
+		key = strtok_r(NULL, " \t\n", &save);
+		options = strtok_r(NULL, " \t\n", &save);
+
+		if (!device || strtok_r(NULL, " \t\n", &save)) {
+			log_err(_("Invalid entry on line %u of %s."), line_nr, path);
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (!tmp) {
+				r = -ENOMEM;
+				goto out;
+			}
+			entries = tmp;
+		}
+
+		e = &entries[count++];
+		memset(e, 0, sizeof(*e));
+		e->offset = ARG_UINT64(OPT_OFFSET_ID);
+		if (plain) {
+			e->skip = ARG_UINT64(OPT_SKIP_ID);
+			e->sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID) ?: SECTOR_SIZE;
+			e->key_size = (ARG_UINT32(OPT_KEY_SIZE_ID) ?: DEFAULT_PLAIN_KEYBITS) / 8;
+			r = crypt_parse_name_and_mode(ARG_STR(OPT_CIPHER_ID) ?: DEFAULT_CIPHER(PLAIN),
+						      e->cipher, NULL, e->cipher_mode);
+		} else {
+			e->skip = ARG_SET(OPT_SKIP_ID) ? ARG_UINT64(OPT_SKIP_ID) : ARG_UINT64(OPT_OFFSET_ID);
+			e->key_size = (ARG_UINT32(OPT_KEY_SIZE_ID) ?: DEFAULT_LOOPAES_KEYBITS) / 8;
+			if (snprintf(e->cipher, sizeof(e->cipher), "%s",
+				     ARG_STR(OPT_CIPHER_ID) ?: DEFAULT_LOOPAES_CIPHER) >= (int)sizeof(e->cipher))
+				r = -EINVAL;
+		}
+
+		e->name = strdup(name);
+		e->device = strdup(device);
+		if (key && strcmp(key, "random") && strcmp(key, "-"))
+			e->key_file = strdup(key);
+		if (!e->name || !e->device || (key && !e->key_file && strcmp(key, "random") && strcmp(key, "-"))) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		if (!r && options && strcmp(options, "-"))
+			r = open_batch_parse_options(e, options, plain);
+		if (!r && !plain && !e->key_file) {
+			log_err(_("Key file is required for loop-AES device on line %u of %s."), line_nr, path);
+			r = -EINVAL;
+			goto out;
+		}
+		if (r < 0) {
+			log_err(_("Invalid entry on line %u of %s."), line_nr, path);
+			goto out;
+		}
+	}
+
+	if (!count) {
+		log_err(_("No devices to open in batch file %s."), path);
+		r = -EINVAL;
+	}
+out:
+	free(line);
+	fclose(f);
+
+	if (r < 0)
+		open_batch_free(entries, count);
+	else {
+		*ret = entries;
+		*ret_count = count;
+	}
+
+	return r;
+}
+
+static int open_batch_activate(struct open_batch_entry *e, const char *key, uint32_t activate_flags)
+{
+	struct crypt_params_plain params_plain = {
+		.hash = NULL,
+		.offset = e->offset,
+		.skip = e->skip,
+		.sector_size = e->sector_size
+	};
+	struct crypt_params_loopaes params_loopaes = {
+		.hash = ARG_STR(OPT_HASH_ID),
+		.offset = e->offset,
+		.skip = e->skip
+	};
+	bool plain = !strcmp(device_type, "plain");
+	int r;
+
+	r = crypt_init(&e->cd, e->device);
+	if (r < 0)
+		return r;
+
+	if (plain) {
+		if (ARG_SET(OPT_DEVICE_SIZE_ID))
+			params_plain.size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE;
+		else if (ARG_SET(OPT_SIZE_ID))
+			params_plain.size = ARG_UINT64(OPT_SIZE_ID);
+
+		r = crypt_format(e->cd, CRYPT_PLAIN, e->cipher, e->cipher_mode,
+				 NULL, NULL, e->key_size, &params_plain);
+		set_perf_profile_flags(e->cd, &activate_flags);
+	} else
+		r = crypt_format(e->cd, CRYPT_LOOPAES, e->cipher,
+				 NULL, NULL, NULL, e->key_size, &params_loopaes);
+	if (r < 0)
+		return r;
+
+	/* Ephemeral key is used directly as volume key, key file is never hashed */
+	if (key)
+		return crypt_activate_by_volume_key(e->cd, e->name, key, e->key_size, activate_flags);
+
+	return crypt_activate_by_keyfile_device_offset(e->cd, e->name, CRYPT_ANY_SLOT,
+			e->key_file, plain ? e->key_size : 0, 0, activate_flags);
+}
+
+/*
+ * Bulk open of plain and loop-AES devices. Ephemeral keys are read
+ * in one RNG pass and udev is synchronized once for all devices.
+ */
+static int action_open_batch(void)
+{
+	struct open_batch_entry *entries = NULL;
+	char *keys = NULL;
+	size_t i, count = 0, keys_size = 0, keys_read, key_offset = 0;
+	uint32_t activate_flags = 0;
+	bool plain = !strcmp(device_type, "plain");
+	int r, r_entry;
+
+	r = open_batch_read(ARG_STR(OPT_BATCH_FILE_ID), plain, &entries, &count);
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < count; i++)
+		if (!entries[i].key_file)
+			keys_size += entries[i].key_size;
+
+	if (keys_size) {
+		r = crypt_keyfile_device_read(NULL, "/dev/urandom", &keys, &keys_read,
+					      0, keys_size, 0);
+		if (!r && keys_read != keys_size)
+			r = -EINVAL;
+		if (r < 0) {
+			log_err(_("Cannot generate ephemeral volume keys."));
+			goto out;
+		}
+	}
+
+	if (ARG_SET(OPT_SHARED_ID))
+		activate_flags |= CRYPT_ACTIVATE_SHARED;
+	set_activation_flags(&activate_flags);
+
+	crypt_udev_defer(1);
+	for (i = 0; i < count; i++) {
+		r_entry = open_batch_activate(&entries[i],
+				entries[i].key_file ? NULL : keys + key_offset, activate_flags);
+		if (!entries[i].key_file)
+			key_offset += entries[i].key_size;
+		check_signal(&r_entry);
+		if (r_entry < 0) {
+			log_err(_("Activation of device %s failed."), entries[i].name);
+			if (!r)
+				r = r_entry;
+		}
+		if (quit)
+			break;
+	}
+	/* waits for udev processing of all created devices */
+	crypt_udev_defer(0);
+out:
+	crypt_safe_free(keys);
+	open_batch_free(entries, count);
+
+	return r;
+}
+
 static int tcrypt_load(struct crypt_device *cd, struct crypt_params_tcrypt *params)
 {
 	int r, tries, eperm = 0;
@@ -779,6 +1068,48 @@ out:
 	return r;
 }
 
+/* More devices are removed in dependency order with udev synchronized once per level */
+static int close_many(uint32_t flags)
+{
+	struct crypt_deactivation *d;
+	int i, r = 0;
+
+	if (ARG_SET(OPT_HEADER_ID)) {
+		log_err(_("Option --header can be used only with one device."));
+		return -EINVAL;
+	}
+
+	d = calloc(action_argc, sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+
+	for (i = 0; i < action_argc && !r; i++) {
+		d[i].name = action_argv[i];
+		d[i].flags = flags;
+		r = crypt_init_by_name(&d[i].cd, action_argv[i]);
+	}
+
+	if (r)
+		goto out;
+
+	r = crypt_deactivate_by_name_batch(d, action_argc);
+
+	for (i = 0; i < action_argc; i++) {
+		if (d[i].result < 0)
+			log_err(_("Deactivation of device %s failed."), d[i].name);
+		else if (ARG_SET(OPT_DEFERRED_ID) && crypt_status(d[i].cd, d[i].name) >= CRYPT_ACTIVE)
+			log_std(_("Device %s is still active and scheduled for deferred removal.\n"),
+				  d[i].name);
+	}
+out:
+
+	for (i = 0; i < action_argc; i++)
+		crypt_free(d[i].cd);
+	free(d);
+
+	return r;
+}
+
 static int action_close(void)
 {
 	struct crypt_device *cd = NULL;
@@ -791,6 +1122,9 @@ static int action_close(void)
 	if (ARG_SET(OPT_CANCEL_DEFERRED_ID))
 		flags |= CRYPT_DEACTIVATE_DEFERRED_CANCEL;
 
+	if (action_argc > 1)
+		return close_many(flags);
+
 	r = crypt_init_by_name_and_header(&cd, action_argv[0], ARG_STR(OPT_HEADER_ID));
 	if (r == 0)
 		r = crypt_deactivate_by_name(cd, action_argv[0], flags);
@@ -837,6 +1171,11 @@ static int action_resize(void)
 				goto out;
 		}
 
+		/* Active table may still reference volume key in kernel keyring */
+		r = crypt_resize(cd, action_argv[0], dev_size);
+		if (r != -EPERM)
+			goto resized;
+
 		/* try load VK in kernel keyring using token */
 		r = crypt_activate_by_token_pin(cd, NULL, ARG_STR(OPT_TOKEN_TYPE_ID),
 						ARG_INT32(OPT_TOKEN_ID_ID), NULL, 0, NULL,
@@ -868,23 +1207,144 @@ static int action_resize(void)
 out:
 	if (r >= 0)
 		r = crypt_resize(cd, action_argv[0], dev_size);
-
+resized:
 	crypt_safe_free(password);
 	crypt_free(cd);
 	return r;
 }
 
+static void status_json_string(const char *value)
+{
+	const char *p;
+
+	if (!value) {
+		log_std("null");
+		return;
+	}
+
+	log_std("\"");
+	for (p = value; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			log_std("\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			log_std("\\u%04x", (unsigned char)*p);
+		else
+			log_std("%c", *p);
+	}
+	log_std("\"");
+}
+
+static int status_all_json(const struct crypt_active_device_status *st, unsigned *count)
+{
+	log_std("%s\n  { \"name\": ", (*count)++ ? "," : "");
+	status_json_string(st->name);
+	log_std(", \"type\": ");
+	status_json_string(st->type);
+	log_std(", \"target\": \"%s\", \"cipher\": ", st->target);
+	status_json_string(st->cipher);
+	log_std(", \"integrity\": ");
+	status_json_string(st->integrity);
+	log_std(", \"device\": ");
+	status_json_string(st->device);
+	log_std(", \"key_size\": %u, \"key_location\": \"%s\", \"sector_size\": %u, "
+		"\"offset\": %" PRIu64 ", \"size\": %" PRIu64 ", \"iv_offset\": %" PRIu64 ", "
+		"\"segments\": %u, \"readonly\": %s, \"suspended\": %s, \"in_use\": %s",
+		st->volume_key_size * 8,
+		(st->flags & CRYPT_ACTIVATE_KEYRING_KEY) ? "keyring" : "dm-crypt",
+		st->sector_size, st->offset, st->size, st->iv_offset, st->segments,
+		(st->flags & CRYPT_ACTIVATE_READONLY) ? "true" : "false",
+		(st->flags & CRYPT_ACTIVATE_SUSPENDED) ? "true" : "false",
+		st->busy ? "true" : "false");
+
+	if (ARG_SET(OPT_STATS_ID))
+		log_std(", \"stats\": { \"read_ios\": %" PRIu64 ", \"read_sectors\": %" PRIu64
+			", \"read_ms\": %" PRIu64 ", \"write_ios\": %" PRIu64 ", \"write_sectors\": %" PRIu64
+			", \"write_ms\": %" PRIu64 ", \"in_flight\": %" PRIu64 ", \"busy_ms\": %" PRIu64 " }",
+			st->stats.read_ios, st->stats.read_sectors, st->stats.read_ticks_ms,
+			st->stats.write_ios, st->stats.write_sectors, st->stats.write_ticks_ms,
+			st->stats.in_flight, st->stats.io_ticks_ms);
+	log_std(" }");
+
+	return 0;
+}
+
+static int status_all_callback(const struct crypt_active_device_status *st, void *usrptr)
+{
+	if (ARG_SET(OPT_JSON_ID))
+		return status_all_json(st, usrptr);
+
+	log_std("%s/%s is active%s.\n", crypt_get_dir(), st->name,
+		st->busy ? " and is in use" : "");
+	log_std("  type:    %s\n", st->type);
+	if (st->cipher) {
+		log_std("  cipher:  %s\n", st->cipher);
+		log_std("  keysize: %u bits\n", st->volume_key_size * 8);
+		log_std("  key location: %s\n", (st->flags & CRYPT_ACTIVATE_KEYRING_KEY) ? "keyring" : "dm-crypt");
+	} else
+		log_std("  target:  %s\n", st->target);
+	if (st->integrity)
+		log_std("  integrity: %s\n", st->integrity);
+	if (st->tag_size)
+		log_std("  integrity tag size: %u bytes\n", st->tag_size);
+	if (st->device)
+		log_std("  device:  %s\n", st->device);
+	if (st->sector_size)
+		log_std("  sector size:  %u\n", st->sector_size);
+	log_std("  offset:  %" PRIu64 " sectors\n", st->offset);
+	log_std("  size:    %" PRIu64 " sectors\n", st->size);
+	if (st->iv_offset)
+		log_std("  skipped: %" PRIu64 " sectors\n", st->iv_offset);
+	log_std("  mode:    %s%s\n", st->flags & CRYPT_ACTIVATE_READONLY ?
+				   "readonly" : "read/write",
+				   (st->flags & CRYPT_ACTIVATE_SUSPENDED) ? " (suspended)" : "");
+	if (ARG_SET(OPT_STATS_ID)) {
+		log_std("  reads:   %" PRIu64 " (%" PRIu64 " sectors, %" PRIu64 " ms)\n",
+			st->stats.read_ios, st->stats.read_sectors, st->stats.read_ticks_ms);
+		log_std("  writes:  %" PRIu64 " (%" PRIu64 " sectors, %" PRIu64 " ms)\n",
+			st->stats.write_ios, st->stats.write_sectors, st->stats.write_ticks_ms);
+		log_std("  in flight: %" PRIu64 "\n", st->stats.in_flight);
+		log_std("  busy:    %" PRIu64 " ms\n", st->stats.io_ticks_ms);
+	}
+
+	return 0;
+}
+
+/*
+ * Status of all active devices, queried by library in one pass
+ * (no per device context initialization, volume keys are not read).
+ */
+static int action_status_all(void)
+{
+	unsigned count = 0;
+	int r;
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("[");
+
+	r = crypt_status_all(NULL, ARG_SET(OPT_STATS_ID) ? CRYPT_STATUS_ALL_STATS : 0,
+			     status_all_callback, &count);
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("%s]\n", count ? "\n" : "");
+
+	return r;
+}
+
 static int action_status(void)
 {
 	crypt_status_info ci;
 	crypt_reencrypt_info ri;
 	struct crypt_active_device cad;
+	struct crypt_active_stats stats = { .size = sizeof(stats) };
 	struct crypt_params_integrity ip = {};
 	struct crypt_device *cd = NULL;
 	char *backing_file;
 	const char *device;
 	int path = 0, r = 0;
 
+	if (ARG_SET(OPT_ALL_ID))
+		return action_status_all();
+
 	/* perhaps a path, not a dm device name */
 	if (strchr(action_argv[0], '/'))
 		path = 1;
@@ -959,13 +1419,28 @@ static int action_status(void)
 				 CRYPT_ACTIVATE_SAME_CPU_CRYPT|
 				 CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS|
 				 CRYPT_ACTIVATE_NO_READ_WORKQUEUE|
-				 CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE))
-			log_std("  flags:   %s%s%s%s%s\n",
+				 CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE|
+				 CRYPT_ACTIVATE_HIGH_PRIORITY|
+				 CRYPT_ACTIVATE_INLINE_CRYPT))
+			log_std("  flags:   %s%s%s%s%s%s%s\n",
 				(cad.flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) ? "discards " : "",
 				(cad.flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? "same_cpu_crypt " : "",
 				(cad.flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) ? "submit_from_crypt_cpus " : "",
 				(cad.flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE) ? "no_read_workqueue " : "",
-				(cad.flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? "no_write_workqueue" : "");
+				(cad.flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? "no_write_workqueue " : "",
+				(cad.flags & CRYPT_ACTIVATE_HIGH_PRIORITY) ? "high_priority " : "",
+				(cad.flags & CRYPT_ACTIVATE_INLINE_CRYPT) ? "inline_crypt" : "");
+
+		if (ARG_SET(OPT_STATS_ID) && !crypt_get_active_stats(cd, action_argv[0], &stats)) {
+			log_std("  reads:   %" PRIu64 " (%" PRIu64 " sectors, %" PRIu64 " ms)\n",
+				stats.read_ios, stats.read_sectors, stats.read_ticks_ms);
+			log_std("  writes:  %" PRIu64 " (%" PRIu64 " sectors, %" PRIu64 " ms)\n",
+				stats.write_ios, stats.write_sectors, stats.write_ticks_ms);
+			log_std("  in flight: %" PRIu64 "\n", stats.in_flight);
+			log_std("  busy:    %" PRIu64 " ms\n", stats.io_ticks_ms);
+			if (ip.tag_size)
+				log_std("  integrity failures: %" PRIu64 "\n", stats.integrity_failures);
+		}
 	}
 out:
 	crypt_free(cd);
@@ -989,6 +1464,35 @@ static int benchmark_callback(uint32_t time_ms, void *usrptr)
 	return r;
 }
 
+/*
+ * Benchmark JSON output (--json), one object with arrays of kdf and cipher results.
+ */
+static unsigned int json_sections, json_items;
+
+static void benchmark_json_array_begin(const char *name)
+{
+	log_std("%s  \"%s\": [", json_sections++ ? ",\n" : "{\n", name);
+	json_items = 0;
+}
+
+static void benchmark_json_array_end(void)
+{
+	log_std("\n  ]");
+}
+
+/* Starts array item with its (escaped) string members, other members follow */
+static void benchmark_json_item(const char *name1, const char *value1,
+				const char *name2, const char *value2)
+{
+	log_std("%s{ \"%s\": ", json_items++ ? ",\n    " : "\n    ", name1);
+	status_json_string(value1);
+	if (name2) {
+		log_std(", \"%s\": ", name2);
+		status_json_string(value2);
+	}
+	log_std(", ");
+}
+
 static int action_benchmark_kdf(const char *kdf, const char *hash, size_t key_size)
 {
 	int r;
@@ -1001,7 +1505,14 @@ static int action_benchmark_kdf(const char *kdf, const char *hash, size_t key_si
 
 		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foobarfo", 8, "0123456789abcdef", 16, key_size,
 					&benchmark_callback, &pbkdf);
-		if (r < 0)
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_item("type", kdf, "hash", hash);
+		if (ARG_SET(OPT_JSON_ID) && r < 0)
+			log_std("\"available\": false }");
+		else if (ARG_SET(OPT_JSON_ID))
+			log_std("\"iterations\": %u, \"time_ms\": %u, \"key_size\": %zu }",
+				pbkdf.iterations, pbkdf.time_ms, key_size * 8);
+		else if (r < 0)
 			log_std(_("PBKDF2-%-9s     N/A\n"), hash);
 		else
 			log_std(_("PBKDF2-%-9s %7u iterations per second for %zu-bit key\n"),
@@ -1017,7 +1528,16 @@ static int action_benchmark_kdf(const char *kdf, const char *hash, size_t key_si
 		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foobarfo", 8,
 			"0123456789abcdef0123456789abcdef", 32,
 			key_size, &benchmark_callback, &pbkdf);
-		if (r < 0)
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_item("type", kdf, NULL, NULL);
+		if (ARG_SET(OPT_JSON_ID) && r < 0)
+			log_std("\"available\": false }");
+		else if (ARG_SET(OPT_JSON_ID))
+			log_std("\"iterations\": %u, \"memory\": %u, "
+				"\"threads\": %u, \"time_ms\": %u, \"key_size\": %zu }",
+				pbkdf.iterations, pbkdf.max_memory_kb,
+				pbkdf.parallel_threads, pbkdf.time_ms, key_size * 8);
+		else if (r < 0)
 			log_std(_("%-10s N/A\n"), kdf);
 		else
 			log_std(_("%-10s %4u iterations, %5u memory, "
@@ -1053,27 +1573,405 @@ static int benchmark_cipher_loop(const char *cipher, const char *cipher_mode,
 	return r;
 }
 
-static int action_benchmark(void)
+static void benchmark_cipher_json(const char *cipher, const char *cipher_mode, size_t key_size,
+				  int r, double enc_mbr, double dec_mbr)
 {
-	static struct {
-		const char *cipher;
-		const char *mode;
-		size_t key_size;
-	} bciphers[] = {
-		{ "aes",     "cbc", 16 },
-		{ "serpent", "cbc", 16 },
-		{ "twofish", "cbc", 16 },
-		{ "aes",     "cbc", 32 },
-		{ "serpent", "cbc", 32 },
-		{ "twofish", "cbc", 32 },
-		{ "aes",     "xts", 32 },
-		{ "serpent", "xts", 32 },
-		{ "twofish", "xts", 32 },
-		{ "aes",     "xts", 64 },
-		{ "serpent", "xts", 64 },
-		{ "twofish", "xts", 64 },
-		{  NULL, NULL, 0 }
+	benchmark_json_item("cipher", cipher, "mode", cipher_mode);
+	if (r < 0)
+		log_std("\"key_size\": %zu, \"available\": false }", key_size * 8);
+	else
+		log_std("\"key_size\": %zu, \"encryption_mbs\": %.1f, \"decryption_mbs\": %.1f }",
+			key_size * 8, enc_mbr, dec_mbr);
+}
+
+/*
+ * Sweep of sector sizes, request sizes and thread counts for one cipher.
+ * Thread counts are powers of two up to --threads.
+ */
+static int benchmark_cipher_matrix(const char *cipher, const char *cipher_mode, size_t key_size)
+{
+	static const uint32_t sector_sizes[] = { 512, 1024, 2048, 4096, 0 };
+	static const size_t buffer_sizes[] = { 4096, 65536, 1024 * 1024, 0 };
+	struct crypt_params_benchmark params = { .time_ms = 250 };
+	struct crypt_benchmark_result res;
+	uint32_t max_threads = ARG_UINT32(OPT_THREADS_ID) ?: 1;
+	int i, j, r = 0, measured = 0;
+
+	if (!ARG_SET(OPT_JSON_ID))
+		/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+		log_std(_("# Sector |  Request | Threads |      Encryption |      Decryption |  Enc p99 |  Dec p99\n"));
+
+	for (i = 0; sector_sizes[i]; i++) {
+		if (ARG_SET(OPT_SECTOR_SIZE_ID) && sector_sizes[i] != ARG_UINT32(OPT_SECTOR_SIZE_ID))
+			continue;
+		params.sector_size = sector_sizes[i];
+
+		for (j = 0; buffer_sizes[j]; j++) {
+			if (buffer_sizes[j] < params.sector_size)
+				continue;
+			params.buffer_size = buffer_sizes[j];
+
+			for (params.threads = 1; ; params.threads *= 2) {
+				if (params.threads > max_threads)
+					params.threads = max_threads;
+				r = crypt_benchmark_cipher(NULL, cipher, cipher_mode, key_size, 0, &params, &res);
+				check_signal(&r);
+				if (r == -EINTR || r == -ENOTSUP)
+					return r;
+				if (r >= 0)
+					measured++;
+				if (ARG_SET(OPT_JSON_ID))
+					benchmark_json_item("cipher", cipher, "mode", cipher_mode);
+				if (ARG_SET(OPT_JSON_ID) && r < 0)
+					log_std("\"key_size\": %zu, "
+						"\"sector_size\": %u, \"request_size\": %zu, \"threads\": %u, "
+						"\"available\": false }",
+						key_size * 8, params.sector_size, params.buffer_size, params.threads);
+				else if (ARG_SET(OPT_JSON_ID))
+					log_std("\"key_size\": %zu, "
+						"\"sector_size\": %u, \"request_size\": %zu, \"threads\": %u, "
+						"\"encryption_mbs\": %.1f, \"decryption_mbs\": %.1f, "
+						"\"encryption_p50_us\": %.1f, \"encryption_p99_us\": %.1f, "
+						"\"decryption_p50_us\": %.1f, \"decryption_p99_us\": %.1f }",
+						key_size * 8,
+						params.sector_size, params.buffer_size, params.threads,
+						res.encryption_mbs, res.decryption_mbs,
+						res.encryption_p50_us, res.encryption_p99_us,
+						res.decryption_p50_us, res.decryption_p99_us);
+				else if (r < 0)
+					log_std("%8u  %7zuK  %7u %17s %17s\n", params.sector_size,
+						params.buffer_size / 1024, params.threads, _("N/A"), _("N/A"));
+				else
+					log_std("%8u  %7zuK  %7u  %10.1f MiB/s  %10.1f MiB/s  %6.0f us  %6.0f us\n",
+						params.sector_size, params.buffer_size / 1024, params.threads,
+						res.encryption_mbs, res.decryption_mbs,
+						res.encryption_p99_us, res.decryption_p99_us);
+				if (params.threads == max_threads)
+					break;
+			}
+		}
+	}
+
+	return measured ? 0 : r;
+}
+
+static const struct {
+	const char *cipher;
+	const char *mode;
+	size_t key_size;
+} bciphers[] = {
+	{ "aes",     "cbc", 16 },
+	{ "serpent", "cbc", 16 },
+	{ "twofish", "cbc", 16 },
+	{ "aes",     "cbc", 32 },
+	{ "serpent", "cbc", 32 },
+	{ "twofish", "cbc", 32 },
+	{ "aes",     "xts", 32 },
+	{ "serpent", "xts", 32 },
+	{ "twofish", "xts", 32 },
+	{ "aes",     "xts", 64 },
+	{ "serpent", "xts", 64 },
+	{ "twofish", "xts", 64 },
+	{  NULL, NULL, 0 }
+};
+
+static const struct {
+	const char *cipher;
+	const char *integrity;
+	size_t key_size; /* without integrity key */
+} baeads[] = {
+	{ "aes-gcm-random",  "aead",        32 },
+	{ "aegis128-random", "aead",        16 },
+	{ "aegis256-random", "aead",        32 },
+	{ "chacha20-random", "poly1305",    32 },
+	{ "aes-xts-plain64", "hmac-sha256", 64 },
+	{ "aes-xts-random",  "hmac-sha256", 64 },
+	{ "aes-xts-plain64", "hmac-sha512", 64 },
+	{  NULL, NULL, 0 }
+};
+
+static int benchmark_aead_one(const char *cipher_spec, const char *integrity_spec, size_t key_size)
+{
+	struct crypt_params_benchmark params = {
+		.threads = ARG_UINT32(OPT_THREADS_ID),
+		.sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID),
+	};
+	struct crypt_benchmark_aead_result res;
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN], integrity[MAX_CIPHER_LEN];
+	int r, integrity_key_size;
+
+	r = crypt_parse_name_and_mode(cipher_spec, cipher, NULL, cipher_mode);
+	if (r < 0) {
+		log_err(_("No known cipher specification pattern detected."));
+		return r;
+	}
+
+	r = crypt_parse_integrity_mode(integrity_spec, integrity, &integrity_key_size);
+	if (r < 0) {
+		log_err(_("No known integrity specification pattern detected."));
+		return r;
+	}
+
+	r = crypt_benchmark_aead(NULL, cipher, cipher_mode, integrity,
+				 key_size + integrity_key_size, &params, &res);
+	check_signal(&r);
+
+	if (ARG_SET(OPT_JSON_ID))
+		benchmark_json_item("cipher", cipher_spec, "integrity", integrity_spec);
+	if (ARG_SET(OPT_JSON_ID) && r < 0)
+		log_std("\"key_size\": %zu, \"available\": false }", key_size * 8);
+	else if (ARG_SET(OPT_JSON_ID))
+		log_std("\"key_size\": %zu, "
+			"\"tag_size\": %u, \"encryption_mbs\": %.1f, \"decryption_mbs\": %.1f, "
+			"\"write_mbs\": %.1f, \"read_mbs\": %.1f }",
+			key_size * 8, res.tag_size,
+			res.encryption_mbs, res.decryption_mbs, res.write_mbs, res.read_mbs);
+	else if (r < 0)
+		log_std("%24s  %12s  %5zub  %4s %17s %17s %17s %17s\n", cipher_spec, integrity_spec,
+			key_size * 8, "-", _("N/A"), _("N/A"), _("N/A"), _("N/A"));
+	else
+		log_std("%24s  %12s  %5zub  %4u  %10.1f MiB/s  %10.1f MiB/s  %10.1f MiB/s  %10.1f MiB/s\n",
+			cipher_spec, integrity_spec, key_size * 8, res.tag_size, res.encryption_mbs,
+			res.decryption_mbs, res.write_mbs, res.read_mbs);
+
+	return r;
+}
+
+/*
+ * LUKS2 authenticated encryption (--integrity), either for --cipher
+ * or for all known AEAD configurations with requested integrity.
+ */
+static int action_benchmark_aead(void)
+{
+	int i, r = -ENOENT, found = 0, measured = 0;
+
+	if (ARG_SET(OPT_JSON_ID))
+		benchmark_json_array_begin("aead");
+	else
+		/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+		log_std(_("#              Algorithm |   Integrity |   Key | Tag |      Encryption |      Decryption |    Write (eff.) |     Read (eff.)\n"));
+
+	if (ARG_SET(OPT_CIPHER_ID)) {
+		r = benchmark_aead_one(ARG_STR(OPT_CIPHER_ID), ARG_STR(OPT_INTEGRITY_ID),
+				       (ARG_UINT32(OPT_KEY_SIZE_ID) ?: DEFAULT_PLAIN_KEYBITS) / 8);
+		if (!r)
+			measured++;
+	} else for (i = 0; baeads[i].cipher; i++) {
+		if (strcmp(baeads[i].integrity, ARG_STR(OPT_INTEGRITY_ID)))
+			continue;
+		found++;
+		r = benchmark_aead_one(baeads[i].cipher, baeads[i].integrity, baeads[i].key_size);
+		if (r == -ENOTSUP || r == -EINTR)
+			break;
+		if (!r)
+			measured++;
+	}
+
+	if (ARG_SET(OPT_JSON_ID)) {
+		benchmark_json_array_end();
+		log_std("\n}\n");
+	}
+
+	if (!ARG_SET(OPT_CIPHER_ID) && !found)
+		log_err(_("No authenticated encryption benchmark for integrity %s."), ARG_STR(OPT_INTEGRITY_ID));
+	else if (!measured && ARG_SET(OPT_CIPHER_ID) && r != -ENOTSUP && r != -EINTR)
+		log_err(_("Cipher %s with integrity %s is not available."),
+			ARG_STR(OPT_CIPHER_ID), ARG_STR(OPT_INTEGRITY_ID));
+
+	return measured ? 0 : r;
+}
+
+/*
+ * Recommend the fastest cipher and sector size for LUKS2 data encryption.
+ * Only XTS mode (as used by default) with key size at least --key-size
+ * (default 256 bits) is considered. The slower direction decides.
+ */
+static int action_benchmark_recommend(void)
+{
+	struct crypt_params_benchmark params = { .threads = 1, .buffer_size = 65536, .time_ms = 250 };
+	struct crypt_benchmark_result res;
+	size_t min_key_size = (ARG_UINT32(OPT_KEY_SIZE_ID) ?: DEFAULT_LUKS1_KEYBITS) / 8;
+	double enc_mbr, dec_mbr, mbr, best_mbr = 0.0;
+	uint32_t sector_size = SECTOR_SIZE;
+	int i, best = -1, r = -ENOENT;
+
+	if (ARG_SET(OPT_JSON_ID))
+		benchmark_json_array_begin("cipher");
+
+	for (i = 0; bciphers[i].cipher; i++) {
+		if (strcmp(bciphers[i].mode, "xts") || bciphers[i].key_size < min_key_size)
+			continue;
+
+		r = benchmark_cipher_loop(bciphers[i].cipher, bciphers[i].mode,
+					  bciphers[i].key_size, &enc_mbr, &dec_mbr);
+		check_signal(&r);
+		if (r == -ENOTSUP || r == -EINTR)
+			break;
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_cipher_json(bciphers[i].cipher, bciphers[i].mode,
+					      bciphers[i].key_size, r, enc_mbr, dec_mbr);
+		if (r < 0)
+			continue;
+
+		mbr = enc_mbr < dec_mbr ? enc_mbr : dec_mbr;
+		log_dbg("Cipher %s-%s, %zu-bit key: %.1f MiB/s.", bciphers[i].cipher,
+			bciphers[i].mode, bciphers[i].key_size * 8, mbr);
+		if (mbr > best_mbr) {
+			best_mbr = mbr;
+			best = i;
+		}
+	}
+
+	if (ARG_SET(OPT_JSON_ID))
+		benchmark_json_array_end();
+
+	if (best < 0) {
+		if (ARG_SET(OPT_JSON_ID))
+			log_std("\n}\n");
+		if (r != -ENOTSUP && r != -EINTR)
+			log_err(_("No cipher meeting requested key size is available."));
+		return r < 0 ? r : -ENOENT;
+	}
+
+	/* Larger sector size is used only if it is measurably faster */
+	if (ARG_SET(OPT_SECTOR_SIZE_ID))
+		sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID);
+	else {
+		params.sector_size = SECTOR_SIZE;
+		if (!crypt_benchmark_cipher(NULL, bciphers[best].cipher, bciphers[best].mode,
+					    bciphers[best].key_size, 0, &params, &res)) {
+			mbr = res.encryption_mbs < res.decryption_mbs ? res.encryption_mbs : res.decryption_mbs;
+			params.sector_size = MAX_SECTOR_SIZE;
+			if (!crypt_benchmark_cipher(NULL, bciphers[best].cipher, bciphers[best].mode,
+						    bciphers[best].key_size, 0, &params, &res) &&
+			    (res.encryption_mbs < res.decryption_mbs ? res.encryption_mbs : res.decryption_mbs) > mbr * 1.05)
+				sector_size = MAX_SECTOR_SIZE;
+		}
+	}
+
+	if (ARG_SET(OPT_JSON_ID))
+		log_std(",\n  \"recommended\": { \"cipher\": \"%s-%s-plain64\", \"key_size\": %zu, "
+			"\"sector_size\": %u }\n}\n", bciphers[best].cipher, bciphers[best].mode,
+			bciphers[best].key_size * 8, sector_size);
+	else
+		log_std("--cipher %s-%s-plain64 --key-size %zu --sector-size %u\n",
+			bciphers[best].cipher, bciphers[best].mode,
+			bciphers[best].key_size * 8, sector_size);
+
+	return 0;
+}
+
+/*
+ * Kernel device-mapper stack overhead. Temporary dm-zero device is measured
+ * as baseline, then dm-crypt over it with the requested sector size and
+ * performance flags, both with sequential and random direct I/O.
+ */
+static int action_benchmark_stack(void)
+{
+	static const struct {
+		const char *pattern;
+		uint32_t block_size;
+		uint32_t queue_depth;
+		int random;
+	} bloads[] = {
+		{ "seq",  131072,  1, 0 },
+		{ "seq",  131072,  8, 0 },
+		{ "rand",   4096,  1, 1 },
+		{ "rand",   4096,  8, 1 },
+		{ "rand",   4096, 32, 1 },
+		{ NULL, 0, 0, 0 }
 	};
+	struct crypt_params_benchmark_stack params = {
+		.sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID),
+		.time_ms = 500,
+	};
+	struct crypt_benchmark_stack_result res;
+	const char *cipher_spec = ARG_STR(OPT_CIPHER_ID) ?: DEFAULT_CIPHER(LUKS1);
+	size_t key_size = (ARG_UINT32(OPT_KEY_SIZE_ID) ?: DEFAULT_LUKS1_KEYBITS) / 8;
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	const char *stack;
+	int i, crypt, measured = 0, r;
+
+	r = crypt_parse_name_and_mode(cipher_spec, cipher, NULL, cipher_mode);
+	if (r < 0) {
+		log_err(_("No known cipher specification pattern detected."));
+		return r;
+	}
+
+	if (ARG_SET(OPT_PERF_SAME_CPU_CRYPT_ID))
+		params.flags |= CRYPT_ACTIVATE_SAME_CPU_CRYPT;
+	if (ARG_SET(OPT_PERF_SUBMIT_FROM_CRYPT_CPUS_ID))
+		params.flags |= CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS;
+	if (ARG_SET(OPT_PERF_NO_READ_WORKQUEUE_ID))
+		params.flags |= CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+	if (ARG_SET(OPT_PERF_NO_WRITE_WORKQUEUE_ID))
+		params.flags |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+	if (ARG_SET(OPT_PERF_HIGH_PRIORITY_ID))
+		params.flags |= CRYPT_ACTIVATE_HIGH_PRIORITY;
+
+	if (ARG_SET(OPT_JSON_ID))
+		benchmark_json_array_begin("stack");
+	else
+		/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+		log_std(_("#                Stack | Pattern |  Block |  QD |  Write IOPS | Write MiB/s |  Write p99 |   Read IOPS |  Read MiB/s |   Read p99\n"));
+
+	/* dm-zero baseline first, then dm-crypt stack */
+	for (crypt = 0, r = 0; crypt < 2 && r != -EINTR; crypt++) {
+		stack = crypt ? cipher_spec : "dm-zero";
+		for (i = 0; bloads[i].pattern; i++) {
+			params.block_size = bloads[i].block_size;
+			params.queue_depth = bloads[i].queue_depth;
+			params.random = bloads[i].random;
+
+			r = crypt_benchmark_stack(NULL, crypt ? cipher : NULL, crypt ? cipher_mode : NULL,
+						  key_size, &params, &res);
+			check_signal(&r);
+			if (r == -EINTR)
+				break;
+
+			if (ARG_SET(OPT_JSON_ID))
+				benchmark_json_item("stack", stack, "pattern", bloads[i].pattern);
+			if (ARG_SET(OPT_JSON_ID) && r < 0)
+				log_std("\"block_size\": %u, \"queue_depth\": %u, \"available\": false }",
+					bloads[i].block_size, bloads[i].queue_depth);
+			else if (ARG_SET(OPT_JSON_ID))
+				log_std("\"block_size\": %u, "
+					"\"queue_depth\": %u, \"write_iops\": %.0f, \"write_mbs\": %.1f, "
+					"\"write_p50_us\": %.1f, \"write_p99_us\": %.1f, \"read_iops\": %.0f, "
+					"\"read_mbs\": %.1f, \"read_p50_us\": %.1f, \"read_p99_us\": %.1f }",
+					bloads[i].block_size,
+					bloads[i].queue_depth, res.write_iops, res.write_mbs, res.write_p50_us,
+					res.write_p99_us, res.read_iops, res.read_mbs, res.read_p50_us, res.read_p99_us);
+			else if (r < 0)
+				log_std("%22s  %7s  %6u  %3u %12s %12s %11s %12s %12s %11s\n", stack,
+					bloads[i].pattern, bloads[i].block_size, bloads[i].queue_depth,
+					_("N/A"), _("N/A"), _("N/A"), _("N/A"), _("N/A"), _("N/A"));
+			else
+				log_std("%22s  %7s  %6u  %3u  %11.0f  %10.1f  %7.0f us  %11.0f  %10.1f  %7.0f us\n",
+					stack, bloads[i].pattern, bloads[i].block_size, bloads[i].queue_depth,
+					res.write_iops, res.write_mbs, res.write_p99_us, res.read_iops,
+					res.read_mbs, res.read_p99_us);
+
+			if (!r)
+				measured++;
+			else if (r == -EPERM || r == -EACCES || r == -ENOTSUP)
+				break;
+		}
+	}
+
+	if (ARG_SET(OPT_JSON_ID)) {
+		benchmark_json_array_end();
+		log_std("\n}\n");
+	}
+
+	if (!measured && r != -EINTR)
+		log_err(_("Cannot create temporary device-mapper devices for benchmark."));
+
+	return measured ? 0 : r;
+}
+
+static int action_benchmark(void)
+{
 	static struct {
 		const char *type;
 		const char *hash;
@@ -1094,11 +1992,32 @@ static int action_benchmark(void)
 	char *c;
 	int i, r;
 
-	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	if (ARG_SET(OPT_RECOMMEND_ID)) {
+		r = action_benchmark_recommend();
+		goto out;
+	}
+
+	if (ARG_SET(OPT_STACK_ID)) {
+		r = action_benchmark_stack();
+		goto out;
+	}
+
+	if (!ARG_SET(OPT_JSON_ID))
+		log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+
+	if (ARG_SET(OPT_INTEGRITY_ID)) {
+		r = action_benchmark_aead();
+		goto out;
+	}
+
 	if (set_pbkdf || ARG_SET(OPT_HASH_ID)) {
 		if (!set_pbkdf && ARG_SET(OPT_HASH_ID))
 			set_pbkdf = CRYPT_KDF_PBKDF2;
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_array_begin("kdf");
 		r = action_benchmark_kdf(set_pbkdf, ARG_STR(OPT_HASH_ID), key_size);
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_array_end();
 	} else if (ARG_SET(OPT_CIPHER_ID)) {
 		r = crypt_parse_name_and_mode(ARG_STR(OPT_CIPHER_ID), cipher, NULL, cipher_mode);
 		if (r < 0) {
@@ -1108,24 +2027,48 @@ static int action_benchmark(void)
 		if ((c  = strchr(cipher_mode, '-')))
 			*c = '\0';
 
-		r = benchmark_cipher_loop(cipher, cipher_mode, key_size, &enc_mbr, &dec_mbr);
-		if (!r) {
-			width = strlen(cipher) + strlen(cipher_mode) + 1;
-			if (width < 11)
-				width = 11;
-			/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
-			log_std(_("#%*s Algorithm |       Key |      Encryption |      Decryption\n"), width - 11, "");
-			log_std("%*s-%s  %9db  %10.1f MiB/s  %10.1f MiB/s\n", width - (int)strlen(cipher_mode) - 1,
-				cipher, cipher_mode, key_size*8, enc_mbr, dec_mbr);
-		} else if (r < 0)
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_array_begin("cipher");
+
+		if (ARG_SET(OPT_THREADS_ID) || ARG_SET(OPT_SECTOR_SIZE_ID)) {
+			if (!ARG_SET(OPT_JSON_ID))
+				log_std(_("# Cipher %s-%s, %db key.\n"), cipher, cipher_mode, key_size * 8);
+			r = benchmark_cipher_matrix(cipher, cipher_mode, key_size);
+			if (r < 0 && r != -ENOTSUP && r != -EINTR)
+				log_err(_("Cipher %s (with %i bits key) is not available."), ARG_STR(OPT_CIPHER_ID), key_size * 8);
+		} else if (!(r = benchmark_cipher_loop(cipher, cipher_mode, key_size, &enc_mbr, &dec_mbr))) {
+			if (ARG_SET(OPT_JSON_ID))
+				benchmark_cipher_json(cipher, cipher_mode, key_size, r, enc_mbr, dec_mbr);
+			else {
+				width = strlen(cipher) + strlen(cipher_mode) + 1;
+				if (width < 11)
+					width = 11;
+				/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+				log_std(_("#%*s Algorithm |       Key |      Encryption |      Decryption\n"), width - 11, "");
+				log_std("%*s-%s  %9db  %10.1f MiB/s  %10.1f MiB/s\n", width - (int)strlen(cipher_mode) - 1,
+					cipher, cipher_mode, key_size*8, enc_mbr, dec_mbr);
+			}
+		} else if (r < 0) {
+			if (ARG_SET(OPT_JSON_ID))
+				benchmark_cipher_json(cipher, cipher_mode, key_size, r, enc_mbr, dec_mbr);
 			log_err(_("Cipher %s (with %i bits key) is not available."), ARG_STR(OPT_CIPHER_ID), key_size * 8);
+		}
+
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_array_end();
 	} else {
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_array_begin("kdf");
 		for (i = 0; bkdfs[i].type; i++) {
 			r = action_benchmark_kdf(bkdfs[i].type, bkdfs[i].hash, key_size);
 			check_signal(&r);
 			if (r == -EINTR)
 				break;
 		}
+		if (ARG_SET(OPT_JSON_ID)) {
+			benchmark_json_array_end();
+			benchmark_json_array_begin("cipher");
+		}
 
 		for (i = 0; bciphers[i].cipher; i++) {
 			r = benchmark_cipher_loop(bciphers[i].cipher, bciphers[i].mode,
@@ -1135,6 +2078,13 @@ static int action_benchmark(void)
 				break;
 			if (r == -ENOENT)
 				skipped++;
+
+			if (ARG_SET(OPT_JSON_ID)) {
+				benchmark_cipher_json(bciphers[i].cipher, bciphers[i].mode,
+						      bciphers[i].key_size, r, enc_mbr, dec_mbr);
+				continue;
+			}
+
 			if (i == 0)
 				/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
 				log_std(_("#     Algorithm |       Key |      Encryption |      Decryption\n"));
@@ -1150,10 +2100,15 @@ static int action_benchmark(void)
 				log_std("%15s  %9zub %17s %17s\n", cipher,
 					bciphers[i].key_size*8, _("N/A"), _("N/A"));
 		}
+		if (ARG_SET(OPT_JSON_ID))
+			benchmark_json_array_end();
 		if (skipped && skipped == i)
 			r = -ENOTSUP;
 	}
 
+	if (ARG_SET(OPT_JSON_ID))
+		log_std("\n}\n");
+out:
 	if (r == -ENOTSUP) {
 		log_err(_("Required kernel crypto interface not available."));
 #ifdef ENABLE_AF_ALG
@@ -1284,7 +2239,8 @@ static int action_luksRepair(void)
 		goto out;
 	}
 
-	r = tools_detect_signatures(action_argv[0], PRB_FILTER_LUKS, NULL, ARG_SET(OPT_BATCH_MODE_ID));
+	r = tools_detect_signatures(action_argv[0], PRB_FILTER_LUKS, NULL, ARG_SET(OPT_BATCH_MODE_ID),
+				    TOOLS_PROBE_AREA_SIZE);
 	if (r < 0)
 		goto out;
 
@@ -1361,6 +2317,7 @@ int luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_password
 	char *msg = NULL, *key = NULL, *password = NULL;
 	char cipher [MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN], integrity[MAX_CIPHER_LEN];
 	size_t passwordLen, signatures;
+	uint64_t start_us, probe_size = TOOLS_PROBE_AREA_SIZE;
 	struct crypt_device *cd = NULL;
 	struct crypt_params_luks1 params1 = {
 		.hash = ARG_STR(OPT_HASH_ID) ?: DEFAULT_LUKS1_HASH,
@@ -1467,8 +2424,17 @@ int luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_password
 			goto out;
 	}
 
+	/* Only area overwritten by metadata is probed (and device end for RAID superblocks) */
+	if (ARG_UINT64(OPT_OFFSET_ID) * SECTOR_SIZE > probe_size)
+		probe_size = ARG_UINT64(OPT_OFFSET_ID) * SECTOR_SIZE;
+	if (2 * ARG_UINT64(OPT_LUKS2_METADATA_SIZE_ID) + ARG_UINT64(OPT_LUKS2_KEYSLOTS_SIZE_ID) > probe_size)
+		probe_size = 2 * ARG_UINT64(OPT_LUKS2_METADATA_SIZE_ID) + ARG_UINT64(OPT_LUKS2_KEYSLOTS_SIZE_ID);
+
 	/* Print all present signatures in read-only mode */
-	r = tools_detect_signatures(header_device, PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID));
+	start_us = timing_usec();
+	r = tools_detect_signatures(header_device, PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID),
+				    probe_size);
+	timing_phase(_("device probe"), start_us);
 	if (r < 0)
 		goto out;
 
@@ -1517,8 +2483,14 @@ int luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_password
 	if (ARG_SET(OPT_INTEGRITY_LEGACY_PADDING_ID))
 		crypt_set_compatibility(cd, CRYPT_COMPAT_LEGACY_INTEGRITY_PADDING);
 
-	r = crypt_format(cd, type, cipher, cipher_mode,
-			 ARG_STR(OPT_UUID_ID), key, keysize, params);
+	start_us = timing_usec();
+	if (ARG_SET(OPT_INTEGRITY_INLINE_ID))
+		r = crypt_format_inline(cd, type, cipher, cipher_mode,
+					ARG_STR(OPT_UUID_ID), key, keysize, params);
+	else
+		r = crypt_format(cd, type, cipher, cipher_mode,
+				 ARG_STR(OPT_UUID_ID), key, keysize, params);
+	timing_phase(_("format"), start_us);
 	check_signal(&r);
 	if (r < 0)
 		goto out;
@@ -1527,9 +2499,11 @@ int luksFormat(struct crypt_device **r_cd, char **r_password, size_t *r_password
 	if (r < 0)
 		goto out;
 
+	start_us = timing_usec();
 	r = crypt_keyslot_add_by_volume_key(cd, ARG_INT32(OPT_KEY_SLOT_ID),
 					    key, keysize,
 					    password, passwordLen);
+	timing_phase(_("keyslot add"), start_us);
 	if (r < 0) {
 		(void) tools_wipe_all_signatures(header_device, true, false);
 		goto out;
@@ -1570,6 +2544,7 @@ static int action_open_luks(void)
 	char *password = NULL;
 	size_t passwordLen;
 	struct stat st;
+	uint64_t start_us;
 
 	if (ARG_SET(OPT_REFRESH_ID)) {
 		activated_name = action_argc > 1 ? action_argv[1] : action_argv[0];
@@ -1582,7 +2557,10 @@ static int action_open_luks(void)
 
 		activated_name = ARG_SET(OPT_TEST_PASSPHRASE_ID) ? NULL : action_argv[1];
 
-		if ((r = crypt_init_data_device(&cd, header_device, data_device)))
+		start_us = timing_usec();
+		r = crypt_init_data_device(&cd, header_device, data_device);
+		timing_phase(_("device probe"), start_us);
+		if (r)
 			goto out;
 
 		if ((r = crypt_load(cd, luksType(device_type), NULL))) {
@@ -1607,6 +2585,7 @@ static int action_open_luks(void)
 	}
 
 	set_activation_flags(&activate_flags);
+	set_perf_profile_flags(cd, &activate_flags);
 
 	if (ARG_SET(OPT_VOLUME_KEY_FILE_ID)) {
 		keysize = crypt_get_volume_key_size(cd);
@@ -1644,8 +2623,10 @@ static int action_open_luks(void)
 			if (r < 0)
 				goto out;
 
+			start_us = timing_usec();
 			r = crypt_activate_by_passphrase(cd, activated_name,
 				ARG_INT32(OPT_KEY_SLOT_ID), password, passwordLen, activate_flags);
+			timing_phase(_("passphrase activation"), start_us);
 			tools_keyslot_msg(r, UNLOCKED);
 			tools_passphrase_msg(r);
 			check_signal(&r);
@@ -1659,6 +2640,9 @@ out:
 	     crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, cad.flags & activate_flags)))
 		log_err(_("Device activated but cannot make flags persistent."));
 
+	if (r >= 0)
+		set_activation_cpumask(cd, activated_name);
+
 	crypt_safe_free(key);
 	crypt_safe_free(password);
 	crypt_free(cd);
@@ -2185,6 +3169,40 @@ out:
 	return r;
 }
 
+/* Rewrap keyslots with estimated unlock time outside of half to double of --iter-time */
+static int luksConvertKey_rebalance(struct crypt_device *cd)
+{
+	const struct crypt_pbkdf_type *pbkdf = crypt_get_pbkdf_type(cd);
+	struct crypt_keyslot_context *kc = NULL;
+	char *password = NULL;
+	size_t password_size = 0;
+	int r;
+
+	if (!pbkdf || !pbkdf->time_ms)
+		return -EINVAL;
+
+	r = tools_get_key(_("Enter passphrase for keyslots to be rebalanced: "),
+		      &password, &password_size,
+		      ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
+		      ARG_UINT32(OPT_TIMEOUT_ID), verify_passphrase(0), 0, cd);
+	if (r < 0)
+		return r;
+
+	r = crypt_keyslot_context_init_by_passphrase(cd, password, password_size, &kc);
+	if (!r)
+		r = crypt_keyslots_rebalance_by_keyslot_context(cd, &kc, 1,
+				pbkdf->time_ms / 2, pbkdf->time_ms * 2);
+	if (r >= 0) {
+		log_verbose(_("Rewrapped %d keyslots."), r);
+		r = 0;
+	}
+	tools_passphrase_msg(r);
+
+	crypt_keyslot_context_free(kc);
+	crypt_safe_free(password);
+	return r;
+}
+
 static int action_luksConvertKey(void)
 {
 	struct crypt_device *cd = NULL;
@@ -2217,6 +3235,11 @@ static int action_luksConvertKey(void)
 		goto out;
 	}
 
+	if (ARG_SET(OPT_REBALANCE_ID)) {
+		r = luksConvertKey_rebalance(cd);
+		goto out;
+	}
+
 	r = tools_get_key(_("Enter passphrase for keyslot to be converted: "),
 		      &password, &password_size,
 		      ARG_UINT64(OPT_KEYFILE_OFFSET_ID), ARG_UINT32(OPT_KEYFILE_SIZE_ID), ARG_STR(OPT_KEY_FILE_ID),
@@ -2431,14 +3454,81 @@ out:
 	return r;
 }
 
+/* Full metadata parse is done only with --dump-json-metadata */
+static void scan_json_metadata(const char *device)
+{
+	struct crypt_device *cd = NULL;
+	const char *json = NULL;
+
+	if (!crypt_init(&cd, device)) {
+		crypt_set_log_callback(cd, quiet_log, &log_parms);
+		if (!crypt_load(cd, CRYPT_LUKS2, NULL))
+			(void)crypt_dump_json(cd, &json, 0);
+	}
+
+	log_std(", \"metadata\": %s", json ?: "null");
+	crypt_free(cd);
+}
+
+static int action_scan(void)
+{
+	struct crypt_header_summary *h;
+	int i, r;
+
+	h = calloc(action_argc, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	for (i = 0; i < action_argc; i++)
+		h[i].device = action_argv[i];
+
+	r = crypt_header_scan_batch(h, action_argc, ARG_UINT32(OPT_THREADS_ID));
+	if (r < 0)
+		goto out;
+
+	log_std("[");
+	for (i = 0; i < action_argc; i++) {
+		log_std("%s\n  { \"device\": ", i ? "," : "");
+		status_json_string(h[i].device);
+		log_std(", \"result\": %d", h[i].result);
+		if (!h[i].result) {
+			log_std(", \"version\": %u, \"uuid\": ", h[i].version);
+			status_json_string(h[i].uuid);
+			if (h[i].version == 2) {
+				log_std(", \"label\": ");
+				status_json_string(h[i].label);
+				log_std(", \"subsystem\": ");
+				status_json_string(h[i].subsystem);
+				log_std(", \"seqid\": %" PRIu64 ", \"hdr_size\": %" PRIu64,
+					h[i].seqid, h[i].hdr_size);
+				if (ARG_SET(OPT_DUMP_JSON_ID))
+					scan_json_metadata(h[i].device);
+			}
+		}
+		log_std(" }");
+	}
+	log_std("\n]\n");
+out:
+	free(h);
+	return r;
+}
+
 static int action_luksSuspend(void)
 {
 	struct crypt_device *cd = NULL;
 	int r;
 
+	if (ARG_SET(OPT_CACHE_KEY_ID) && !ARG_UINT32(OPT_CACHE_KEY_ID)) {
+		log_err(_("Option --cache-key requires non-zero timeout."));
+		return -EINVAL;
+	}
+
 	r = crypt_init_by_name_and_header(&cd, action_argv[0], uuid_or_device(ARG_STR(OPT_HEADER_ID)));
 	if (!r) {
-		r = crypt_suspend(cd, action_argv[0]);
+		if (ARG_SET(OPT_CACHE_KEY_ID))
+			r = crypt_suspend_cache_key(cd, action_argv[0], ARG_UINT32(OPT_CACHE_KEY_ID));
+		else
+			r = crypt_suspend(cd, action_argv[0]);
 		if (r == -ENODEV)
 			log_err(_("%s is not active %s device name."), action_argv[0], "LUKS");
 	}
@@ -2483,6 +3573,13 @@ static int action_luksResume(void)
 		goto out;
 	}
 
+	/* volume key cached by luksSuspend --cache-key */
+	if (isLUKS2(crypt_get_type(cd)) &&
+	    (r = crypt_resume_by_cached_key(cd, action_argv[0])) >= 0) {
+		log_verbose(_("Volume resumed by cached volume key."));
+		goto out;
+	}
+
 	/* try to resume LUKS2 device by token first */
 	r = crypt_resume_by_token_pin(cd, action_argv[0], ARG_STR(OPT_TOKEN_TYPE_ID),
 					ARG_INT32(OPT_TOKEN_ID_ID), NULL, 0, NULL);
@@ -2607,6 +3704,9 @@ static int action_open(void)
 	if (!device_type)
 		return -EINVAL;
 
+	if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_open_batch();
+
 	if (!strcmp(device_type, "luks") ||
 	    !strcmp(device_type, "luks1") ||
 	    !strcmp(device_type, "luks2")) {
@@ -2649,7 +3749,7 @@ static int action_luksErase(void)
 	struct crypt_device *cd = NULL;
 	crypt_keyslot_info ki;
 	char *msg = NULL;
-	int i, max, r;
+	int i, max, r, *keyslots = NULL, count = 0;
 
 	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
 		goto out;
@@ -2679,67 +3779,136 @@ static int action_luksErase(void)
 		goto out;
 	}
 
+	keyslots = calloc(max, sizeof(*keyslots));
+	if (!keyslots) {
+		r = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < max; i++) {
 		ki = crypt_keyslot_status(cd, i);
-		if (ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST) {
-			r = crypt_keyslot_destroy(cd, i);
-			if (r < 0)
-				goto out;
-			tools_keyslot_msg(i, REMOVED);
-		}
+		if (ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST)
+			keyslots[count++] = i;
 	}
+
+	if (count) {
+		r = crypt_keyslots_destroy(cd, keyslots, count);
+		if (r < 0)
+			goto out;
+	}
+
+	for (i = 0; i < count; i++)
+		tools_keyslot_msg(keyslots[i], REMOVED);
 out:
+	free(keyslots);
 	free(msg);
 	crypt_free(cd);
 	return r;
 }
 
-static int action_luksConvert(void)
+struct convert_job {
+	struct crypt_device *cd;
+	const char *to_type;
+	pthread_t thread;
+	bool started;
+	int r;
+};
+
+static void *_convert_thread(void *arg)
+{
+	struct convert_job *job = arg;
+
+	job->r = crypt_convert(job->cd, job->to_type, NULL);
+	return NULL;
+}
+
+static int _luksConvert_prepare(struct crypt_device **cd, const char *device, const char *to_type)
 {
-	struct crypt_device *cd = NULL;
 	char *msg = NULL;
-	const char *to_type, *from_type;
+	const char *from_type;
 	int r;
 
-	if (!strcmp(device_type, "luks2")) {
-		to_type = CRYPT_LUKS2;
-	} else if (!strcmp(device_type, "luks1")) {
-		to_type = CRYPT_LUKS1;
-	} else {
-		log_err(_("Invalid LUKS type, only luks1 and luks2 are supported."));
-		return -EINVAL;
-	}
-
-	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
+	if ((r = crypt_init(cd, device)))
 		return r;
 
-	if ((r = crypt_load(cd, CRYPT_LUKS, NULL)) ||
-	    !(from_type = crypt_get_type(cd))) {
-		log_err(_("Device %s is not a valid LUKS device."),
-			uuid_or_device_header(NULL));
-		crypt_free(cd);
-		return r;
+	if ((r = crypt_load(*cd, CRYPT_LUKS, NULL)) ||
+	    !(from_type = crypt_get_type(*cd))) {
+		log_err(_("Device %s is not a valid LUKS device."), device);
+		return r ?: -EINVAL;
 	}
 
 	if (!strcmp(from_type, to_type)) {
 		log_err(_("Device is already %s type."), to_type);
-		crypt_free(cd);
 		return -EINVAL;
 	}
 
 	r = 0;
 	if (!ARG_SET(OPT_BATCH_MODE_ID)) {
 		if (asprintf(&msg, _("This operation will convert %s to %s format.\n"),
-				    uuid_or_device_header(NULL), to_type) == -1)
+				    device, to_type) == -1)
 			r = -ENOMEM;
 		else if (!yesDialog(msg, _("Operation aborted, device was NOT converted.\n")))
 			r = -EPERM;
 	}
 
-	r = r ?: crypt_convert(cd, to_type, NULL);
-
 	free(msg);
-	crypt_free(cd);
+	return r;
+}
+
+/*
+ * All devices are loaded and confirmed first, so nothing is converted
+ * if any of them cannot be. Conversions then run in parallel.
+ */
+static int action_luksConvert(void)
+{
+	struct convert_job *jobs;
+	const char *to_type;
+	int i, r = 0;
+
+	if (!strcmp(device_type, "luks2")) {
+		to_type = CRYPT_LUKS2;
+	} else if (!strcmp(device_type, "luks1")) {
+		to_type = CRYPT_LUKS1;
+	} else {
+		log_err(_("Invalid LUKS type, only luks1 and luks2 are supported."));
+		return -EINVAL;
+	}
+
+	if (action_argc > 1 && ARG_SET(OPT_HEADER_ID)) {
+		log_err(_("Option --header can be used only with one device."));
+		return -EINVAL;
+	}
+
+	jobs = calloc(action_argc, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	for (i = 0; i < action_argc && !r; i++) {
+		jobs[i].to_type = to_type;
+		r = _luksConvert_prepare(&jobs[i].cd, i ? uuid_or_device(action_argv[i]) :
+					 uuid_or_device_header(NULL), to_type);
+	}
+
+	for (i = 0; i < action_argc && !r; i++)
+		jobs[i].started = action_argc > 1 &&
+				  !pthread_create(&jobs[i].thread, NULL, _convert_thread, &jobs[i]);
+
+	for (i = 0; i < action_argc; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		else if (!r)
+			_convert_thread(&jobs[i]);
+	}
+
+	for (i = 0; i < action_argc; i++) {
+		if (jobs[i].r && action_argc > 1)
+			log_err(_("Conversion of device %s failed."), crypt_get_device_name(jobs[i].cd));
+		if (!r && jobs[i].r)
+			r = jobs[i].r;
+		crypt_free(jobs[i].cd);
+	}
+
+	free(jobs);
 	return r;
 }
 
@@ -2771,8 +3940,9 @@ static int action_luksConfig(void)
 	struct crypt_device *cd = NULL;
 	int r;
 
-	if (!ARG_SET(OPT_PRIORITY_ID) && !ARG_SET(OPT_LABEL_ID) && !ARG_SET(OPT_SUBSYSTEM_ID)) {
-		log_err(_("Option --priority, --label or --subsystem is missing."));
+	if (!ARG_SET(OPT_PRIORITY_ID) && !ARG_SET(OPT_LABEL_ID) && !ARG_SET(OPT_SUBSYSTEM_ID) &&
+	    !ARG_SET(OPT_KEYSLOT_TELEMETRY_ID)) {
+		log_err(_("Option --priority, --label, --subsystem or --keyslot-telemetry is missing."));
 		return -EINVAL;
 	}
 
@@ -2790,6 +3960,9 @@ static int action_luksConfig(void)
 
 	if ((ARG_SET(OPT_LABEL_ID) || ARG_SET(OPT_SUBSYSTEM_ID)) && (r = _config_labels(cd)))
 		goto out;
+
+	if (ARG_SET(OPT_KEYSLOT_TELEMETRY_ID))
+		r = crypt_keyslot_set_telemetry(cd, !strcmp(ARG_STR(OPT_KEYSLOT_TELEMETRY_ID), "enable"));
 out:
 	crypt_free(cd);
 	return r;
@@ -3008,6 +4181,10 @@ static const char * verify_open(void)
 	if (ARG_SET(OPT_REFRESH_ID) && ARG_SET(OPT_TEST_PASSPHRASE_ID))
 		return _("Options --refresh and --test-passphrase are mutually exclusive.");
 
+	if (ARG_SET(OPT_PERF_CPUMASK_ID) && strcmp_or_null(device_type, "plain") &&
+	    strncmp(device_type, "luks", 4))
+		return _("Option --perf-cpumask is supported only for plain and LUKS devices.");
+
 	if (ARG_SET(OPT_SHARED_ID) && strcmp_or_null(device_type, "plain"))
 		return _("Option --shared is allowed only for open of plain device.");
 
@@ -3036,6 +4213,13 @@ static const char * verify_open(void)
 	if (ARG_SET(OPT_DEVICE_SIZE_ID) && ARG_SET(OPT_SIZE_ID))
 		return _("Options --device-size and --size cannot be combined.");
 
+	if (ARG_SET(OPT_BATCH_FILE_ID) && strcmp_or_null(device_type, "plain") && strcmp(device_type, "loopaes"))
+		return _("Option --batch-file is supported only for open of plain and loopaes devices.");
+
+	if (ARG_SET(OPT_BATCH_FILE_ID) && (action_argc || ARG_SET(OPT_REFRESH_ID) ||
+	    ARG_SET(OPT_KEY_FILE_ID) || ARG_SET(OPT_KEYFILE_OFFSET_ID) || ARG_SET(OPT_KEYFILE_SIZE_ID)))
+		return _("Option --batch-file cannot be combined with device arguments, --refresh or key file options.");
+
 	if (ARG_SET(OPT_UNBOUND_ID) && device_type && strncmp(device_type, "luks", 4))
 		return _("Option --unbound is allowed only for open of luks device.");
 
@@ -3073,6 +4257,19 @@ static const char *verify_reencrypt(void)
 	if (ARG_SET(OPT_ACTIVE_NAME_ID) && ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID))
 		return _("Options --active-name and --force-offline-reencrypt cannot be combined.");
 
+	if (ARG_SET(OPT_USED_RANGES_ID) && (isLUKS1(luksType(device_type)) || ARG_SET(OPT_INIT_ONLY_ID)))
+		return _("Option --used-ranges can be used only for LUKS2 reencryption run.");
+
+	if (action_argc > 1 && !ARG_SET(OPT_ENCRYPT_ID)) {
+		if (ARG_SET(OPT_DECRYPT_ID) || ARG_SET(OPT_HEADER_ID) || ARG_SET(OPT_ACTIVE_NAME_ID))
+			return _("Options --decrypt, --header and --active-name cannot be used with multiple devices.");
+		if (ARG_SET(OPT_USED_RANGES_ID))
+			return _("Option --used-ranges cannot be used with multiple devices.");
+		if (isLUKS1(luksType(device_type)))
+			return _("Reencryption of multiple devices is supported only for LUKS2 devices.");
+	} else if (ARG_SET(OPT_REENCRYPT_JOBS_ID))
+		return _("Option --reencrypt-jobs can be used only with multiple devices.");
+
 	return NULL;
 }
 
@@ -3092,6 +4289,9 @@ static const char *verify_format(void)
 	if (ARG_SET(OPT_INTEGRITY_NO_WIPE_ID) && !ARG_SET(OPT_INTEGRITY_ID))
 		return _("Option --integrity-no-wipe can be used only for format action with integrity extension.");
 
+	if (ARG_SET(OPT_INTEGRITY_INLINE_ID) && !ARG_SET(OPT_INTEGRITY_ID))
+		return _("Option --integrity-inline can be used only for format action with integrity extension.");
+
 	if (ARG_SET(OPT_USE_RANDOM_ID) && ARG_SET(OPT_USE_URANDOM_ID))
 		return  _("Only one of --use-[u]random options is allowed.");
 
@@ -3106,6 +4306,17 @@ static const char *verify_addkey(void)
 	return NULL;
 }
 
+static const char *verify_luksConvertKey(void)
+{
+	if (ARG_SET(OPT_REBALANCE_ID) && ARG_SET(OPT_KEY_SLOT_ID))
+		return _("Options --key-slot and --rebalance cannot be combined.");
+
+	if (ARG_SET(OPT_REBALANCE_ID) && ARG_SET(OPT_PBKDF_FORCE_ITERATIONS_ID))
+		return _("Options --pbkdf-force-iterations and --rebalance cannot be combined.");
+
+	return NULL;
+}
+
 static const char *verify_luksDump(void)
 {
 	if (ARG_SET(OPT_UNBOUND_ID) && ARG_INT32(OPT_KEY_SLOT_ID) == CRYPT_ANY_SLOT)
@@ -3114,6 +4325,15 @@ static const char *verify_luksDump(void)
 	return NULL;
 }
 
+static const char *verify_benchmark(void)
+{
+	if (ARG_SET(OPT_STACK_ID) && (ARG_SET(OPT_RECOMMEND_ID) || ARG_SET(OPT_INTEGRITY_ID) ||
+	    ARG_SET(OPT_THREADS_ID) || ARG_SET(OPT_PBKDF_ID) || ARG_SET(OPT_HASH_ID)))
+		return _("Option --stack cannot be combined with --recommend, --integrity, --threads or PBKDF options.");
+
+	return NULL;
+}
+
 static const char *verify_token(void)
 {
 	if (strcmp(action_argv[0], "add") &&
@@ -3156,23 +4376,24 @@ static struct action_type {
 	const char *desc;
 } action_types[] = {
 	{ OPEN_ACTION,		action_open,		verify_open,		1, N_("<device> [--type <type>] [<name>]"),N_("open device as <name>") },
-	{ CLOSE_ACTION,		action_close,		verify_close,		1, N_("<name>"), N_("close device (remove mapping)") },
+	{ CLOSE_ACTION,		action_close,		verify_close,		1, N_("<name> [<name>...]"), N_("close device (remove mapping)") },
 	{ RESIZE_ACTION,	action_resize,		verify_resize,		1, N_("<name>"), N_("resize active device") },
 	{ STATUS_ACTION,	action_status,		NULL,			1, N_("<name>"), N_("show device status") },
-	{ BENCHMARK_ACTION,	action_benchmark,	NULL,			0, N_("[--cipher <cipher>]"), N_("benchmark cipher") },
+	{ BENCHMARK_ACTION,	action_benchmark,	verify_benchmark,	0, N_("[--cipher <cipher>]"), N_("benchmark cipher") },
 	{ REPAIR_ACTION,	action_luksRepair,	NULL,			1, N_("<device>"), N_("try to repair on-disk metadata") },
 	{ REENCRYPT_ACTION,	action_reencrypt,	verify_reencrypt,	0, N_("<device>"), N_("reencrypt LUKS2 device") },
 	{ ERASE_ACTION,		action_luksErase,	NULL,			1, N_("<device>"), N_("erase all keyslots (remove encryption key)") },
-	{ CONVERT_ACTION,	action_luksConvert,	NULL,			1, N_("<device>"), N_("convert LUKS from/to LUKS2 format") },
+	{ CONVERT_ACTION,	action_luksConvert,	NULL,			1, N_("<device> [<device>...]"), N_("convert LUKS from/to LUKS2 format") },
 	{ CONFIG_ACTION,	action_luksConfig,	verify_config,		1, N_("<device>"), N_("set permanent configuration options for LUKS2") },
 	{ FORMAT_ACTION,	action_luksFormat,	verify_format,		1, N_("<device> [<new key file>]"), N_("formats a LUKS device") },
 	{ ADDKEY_ACTION,	action_luksAddKey,	verify_addkey,		1, N_("<device> [<new key file>]"), N_("add key to LUKS device") },
 	{ REMOVEKEY_ACTION,	action_luksRemoveKey,	NULL,			1, N_("<device> [<key file>]"), N_("removes supplied key or key file from LUKS device") },
 	{ CHANGEKEY_ACTION,	action_luksChangeKey,	NULL,			1, N_("<device> [<key file>]"), N_("changes supplied key or key file of LUKS device") },
-	{ CONVERTKEY_ACTION,	action_luksConvertKey,	NULL,			1, N_("<device> [<key file>]"), N_("converts a key to new pbkdf parameters") },
+	{ CONVERTKEY_ACTION,	action_luksConvertKey,	verify_luksConvertKey,	1, N_("<device> [<key file>]"), N_("converts a key to new pbkdf parameters") },
 	{ KILLKEY_ACTION,	action_luksKillSlot,	NULL,			2, N_("<device> <key slot>"), N_("wipes key with number <key slot> from LUKS device") },
 	{ UUID_ACTION,		action_luksUUID,	NULL,			1, N_("<device>"), N_("print UUID of LUKS device") },
 	{ ISLUKS_ACTION,	action_isLuks,		NULL,			1, N_("<device>"), N_("tests <device> for LUKS partition header") },
+	{ SCAN_ACTION,		action_scan,		NULL,			1, N_("<device> [<device>...]"), N_("scan LUKS binary headers of many devices (JSON output)") },
 	{ LUKSDUMP_ACTION,	action_luksDump,	verify_luksDump,	1, N_("<device>"), N_("dump LUKS partition information") },
 	{ TCRYPTDUMP_ACTION,	action_tcryptDump,	verify_tcryptdump,	1, N_("<device>"), N_("dump TCRYPT device information") },
 	{ BITLKDUMP_ACTION,	action_bitlkDump,	NULL,			1, N_("<device>"), N_("dump BITLK device information") },
@@ -3385,6 +4606,19 @@ static void basic_options_cb(poptContext popt_context,
 			      _("Unsupported encryption sector size."),
 			      poptGetInvocationName(popt_context));
 		break;
+	case OPT_PERF_CPUMASK_ID:
+		if (!*ARG_STR(OPT_PERF_CPUMASK_ID) ||
+		    strspn(ARG_STR(OPT_PERF_CPUMASK_ID), "0123456789abcdefABCDEF,") != strlen(ARG_STR(OPT_PERF_CPUMASK_ID)))
+			usage(popt_context, EXIT_FAILURE,
+			_("Option --perf-cpumask requires hexadecimal CPU mask."),
+			poptGetInvocationName(popt_context));
+		break;
+	case OPT_PERF_PROFILE_ID:
+		if (strcmp(ARG_STR(OPT_PERF_PROFILE_ID), "auto"))
+			usage(popt_context, EXIT_FAILURE,
+			_("Option --perf-profile can be only auto."),
+			poptGetInvocationName(popt_context));
+		break;
 	case OPT_PRIORITY_ID:
 		if (strcmp(ARG_STR(OPT_PRIORITY_ID), "normal") &&
 		    strcmp(ARG_STR(OPT_PRIORITY_ID), "prefer") &&
@@ -3393,6 +4627,13 @@ static void basic_options_cb(poptContext popt_context,
 			_("Option --priority can be only ignore/normal/prefer."),
 			poptGetInvocationName(popt_context));
 		break;
+	case OPT_KEYSLOT_TELEMETRY_ID:
+		if (strcmp(ARG_STR(OPT_KEYSLOT_TELEMETRY_ID), "enable") &&
+		    strcmp(ARG_STR(OPT_KEYSLOT_TELEMETRY_ID), "disable"))
+			usage(popt_context, EXIT_FAILURE,
+			_("Option --keyslot-telemetry can be only enable/disable."),
+			poptGetInvocationName(popt_context));
+		break;
 	}
 }
 
@@ -3533,9 +4774,16 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Unknown action."),
 		      poptGetInvocationName(popt_context));
 
-	if (action_argc < action->required_action_argc)
+	if (action_argc < action->required_action_argc &&
+	    !(!strcmp(aname, STATUS_ACTION) && ARG_SET(OPT_ALL_ID)) &&
+	    !(!strcmp(aname, OPEN_ACTION) && ARG_SET(OPT_BATCH_FILE_ID)))
 		help_args(action, popt_context);
 
+	if (ARG_SET(OPT_ALL_ID) && action_argc)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --all cannot be used with device name."),
+		      poptGetInvocationName(popt_context));
+
 	/* this routine short circuits to exit() on error */
 	tools_check_args(action->type, tool_core_args, ARRAY_SIZE(tool_core_args), popt_context);
 
@@ -3595,11 +4843,17 @@ int main(int argc, const char **argv)
 	if (ARG_SET(OPT_DISABLE_EXTERNAL_TOKENS_ID))
 		(void) crypt_token_external_disable();
 
+	if (ARG_SET(OPT_PARALLEL_UNLOCK_ID))
+		(void) crypt_parallel_unlock(NULL, 1);
+
 	if (ARG_SET(OPT_DISABLE_LOCKS_ID) && crypt_metadata_locking(NULL, 0)) {
 		log_std(_("Cannot disable metadata locking."));
 		r = EXIT_FAILURE;
 	} else {
+		if (ARG_SET(OPT_DEBUG_TIMING_ID))
+			timing_init();
 		r = run_action(action);
+		timing_report();
 	}
 
 	tools_cleanup();
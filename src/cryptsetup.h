@@ -99,6 +99,16 @@ struct tools_progress_params {
 	bool json_output;
 	const char *interrupt_message;
 	const char *device;
+	/* smoothed speed */
+	double rate;
+	double last_tdiff;
+	uint64_t last_bytes;
+	/* reencryption step phases (set cd to enable) */
+	struct crypt_device *cd;
+	uint64_t last_step_offset;
+	uint64_t last_step_us;
+	uint64_t phase_us[4];
+	uint64_t phase_total_us[4];
 };
 
 int tools_progress(uint64_t size, uint64_t offset, void *usrptr);
@@ -116,7 +126,11 @@ typedef enum {
 	PRB_ONLY_LUKS
 } tools_probe_filter_info;
 
-int tools_detect_signatures(const char *device, tools_probe_filter_info filter, size_t *count, bool batch_mode);
+/* Probed area at the device start (and end) for operations writing only metadata */
+#define TOOLS_PROBE_AREA_SIZE (16 * 1024 * 1024)
+
+int tools_detect_signatures(const char *device, tools_probe_filter_info filter, size_t *count,
+			    bool batch_mode, uint64_t probe_size);
 int tools_wipe_all_signatures(const char *path, bool exclusive, bool only_luks);
 int tools_superblock_block_size(const char *device, char *sb_name,
 				size_t sb_name_len, unsigned *r_block_size);
@@ -25,10 +25,16 @@ ARG(OPT_ACTIVE_NAME, '\0', POPT_ARG_STRING, N_("Override device autodetection of
 
 ARG(OPT_ALIGN_PAYLOAD, '\0', POPT_ARG_STRING, N_("Align payload at <n> sector boundaries - for luksFormat"), N_("SECTORS"), CRYPT_ARG_UINT32, {}, OPT_ALIGN_PAYLOAD_ACTIONS)
 
+ARG(OPT_ALL, '\0', POPT_ARG_NONE, N_("Show status of all active devices"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALL_ACTIONS)
+
 ARG(OPT_ALLOW_DISCARDS, '\0', POPT_ARG_NONE, N_("Allow discards (aka TRIM) requests for device"), NULL, CRYPT_ARG_BOOL, {}, OPT_ALLOW_DISCARDS_ACTIONS)
 
+ARG(OPT_BATCH_FILE, '\0', POPT_ARG_STRING, N_("Open all plain or loop-AES devices listed in manifest file"), NULL, CRYPT_ARG_STRING, {}, OPT_BATCH_FILE_ACTIONS)
+
 ARG(OPT_BATCH_MODE, 'q', POPT_ARG_NONE, N_("Do not ask for confirmation"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_CACHE_KEY, '\0', POPT_ARG_STRING, N_("Keep volume key in kernel keyring for fast resume (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, OPT_CACHE_KEY_ACTIONS)
+
 ARG(OPT_CANCEL_DEFERRED, '\0', POPT_ARG_NONE, N_("Cancel a previously set deferred device removal"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
 ARG(OPT_CIPHER, 'c', POPT_ARG_STRING, N_("The cipher used to encrypt the disk (see /proc/crypto)"), NULL, CRYPT_ARG_STRING, {}, {})
@@ -37,6 +43,8 @@ ARG(OPT_DEBUG, '\0', POPT_ARG_NONE, N_("Show debug messages"), NULL, CRYPT_ARG_B
 
 ARG(OPT_DEBUG_JSON, '\0', POPT_ARG_NONE, N_("Show debug messages including JSON metadata"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_DEBUG_TIMING, '\0', POPT_ARG_NONE, N_("Print time spent in individual phases of the operation"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEBUG_TIMING_ACTIONS)
+
 ARG(OPT_DEFERRED, '\0', POPT_ARG_NONE, N_("Device removal is deferred until the last user closes it"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
 ARG(OPT_DEVICE_SIZE, '\0', POPT_ARG_STRING, N_("Use only specified device size (ignore rest of device). DANGEROUS!"), N_("bytes"), CRYPT_ARG_UINT64, {}, OPT_DEVICE_SIZE_ACTIONS)
@@ -71,8 +79,12 @@ ARG(OPT_HOTZONE_SIZE, '\0', POPT_ARG_STRING, N_("Maximal reencryption hotzone si
 
 ARG(OPT_INIT_ONLY, '\0', POPT_ARG_NONE, N_("Initialize LUKS2 reencryption in metadata only."), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_INLINE_CRYPT, '\0', POPT_ARG_NONE, N_("Use inline encryption hardware if supported (LUKS2 only)"), NULL, CRYPT_ARG_BOOL, {}, OPT_INLINE_CRYPT_ACTIONS)
+
 ARG(OPT_INTEGRITY, 'I', POPT_ARG_STRING, N_("Data integrity algorithm (LUKS2 only)"), NULL, CRYPT_ARG_STRING, {}, OPT_INTEGRITY_ACTIONS)
 
+ARG(OPT_INTEGRITY_INLINE, '\0', POPT_ARG_NONE, N_("Store integrity tags in device per-sector metadata (inline mode)"), NULL, CRYPT_ARG_BOOL, {}, OPT_INTEGRITY_INLINE_ACTIONS)
+
 ARG(OPT_INTEGRITY_LEGACY_PADDING,'\0', POPT_ARG_NONE, N_("Use inefficient legacy padding (old kernels)"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_INTEGRITY_NO_JOURNAL, '\0', POPT_ARG_NONE, N_("Disable journal for integrity device"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -83,6 +95,8 @@ ARG(OPT_ITER_TIME, 'i', POPT_ARG_STRING, N_("PBKDF iteration time for LUKS (in m
 
 ARG(OPT_IV_LARGE_SECTORS, '\0', POPT_ARG_NONE, N_("Use IV counted in sector size (not in 512 bytes)"), NULL , CRYPT_ARG_BOOL, {}, OPT_IV_LARGE_SECTORS_ACTIONS)
 
+ARG(OPT_JSON, '\0', POPT_ARG_NONE, N_("Print benchmark results or status in json format (suitable for machine processing)"), NULL, CRYPT_ARG_BOOL, {}, OPT_JSON_ACTIONS)
+
 ARG(OPT_JSON_FILE, '\0', POPT_ARG_STRING, N_("Read or write the json from or to a file"), NULL, CRYPT_ARG_STRING, {}, {})
 
 ARG(OPT_KEEP_KEY, '\0', POPT_ARG_NONE, N_("Do not change volume key."), NULL, CRYPT_ARG_BOOL, {}, OPT_KEEP_KEY_ACTIONS)
@@ -101,6 +115,8 @@ ARG(OPT_KEYFILE_SIZE, 'l', POPT_ARG_STRING, N_("Limits the read from keyfile"),
 
 ARG(OPT_KEYSLOT_CIPHER, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot: The cipher used for keyslot encryption"), NULL, CRYPT_ARG_STRING, {}, OPT_KEYSLOT_CIPHER_ACTIONS)
 
+ARG(OPT_KEYSLOT_TELEMETRY, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot unlock telemetry: enable, disable"), NULL, CRYPT_ARG_STRING, {}, OPT_KEYSLOT_TELEMETRY_ACTIONS)
+
 ARG(OPT_KEYSLOT_KEY_SIZE, '\0', POPT_ARG_STRING, N_("LUKS2 keyslot: The size of the encryption key"), N_("BITS"), CRYPT_ARG_UINT32, {}, OPT_KEYSLOT_KEY_SIZE_ACTIONS)
 
 ARG(OPT_LABEL, '\0', POPT_ARG_STRING, N_("Set label for the LUKS2 device"), NULL, CRYPT_ARG_STRING, {}, OPT_LABEL_ACTIONS)
@@ -123,18 +139,28 @@ ARG(OPT_NEW_TOKEN_ID, '\0', POPT_ARG_STRING, N_("Token number (default: any)"),
 
 ARG(OPT_OFFSET, 'o', POPT_ARG_STRING, N_("The start offset in the backend device"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_OFFSET_ACTIONS)
 
+ARG(OPT_PARALLEL_UNLOCK, '\0', POPT_ARG_NONE, N_("Try all keyslots and tokens in parallel"), NULL, CRYPT_ARG_BOOL, {}, OPT_PARALLEL_UNLOCK_ACTIONS)
+
 ARG(OPT_PBKDF, '\0', POPT_ARG_STRING, N_("PBKDF algorithm (for LUKS2): argon2i, argon2id, pbkdf2"), NULL, CRYPT_ARG_STRING, {}, OPT_PBKDF_ACTIONS)
 
+ARG(OPT_PBKDF_CACHE, '\0', POPT_ARG_STRING, N_("File with cached PBKDF benchmark results"), NULL, CRYPT_ARG_STRING, {}, OPT_PBKDF_CACHE_ACTIONS)
+
 ARG(OPT_PBKDF_FORCE_ITERATIONS, '\0', POPT_ARG_STRING, N_("PBKDF iterations cost (forced, disables benchmark)"), "LONG", CRYPT_ARG_UINT32, {}, OPT_PBKDF_FORCE_ITERATIONS_ACTIONS)
 
 ARG(OPT_PBKDF_MEMORY, '\0', POPT_ARG_STRING, N_("PBKDF memory cost limit"), N_("kilobytes"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_LUKS2_MEMORY_KB }, {})
 
 ARG(OPT_PBKDF_PARALLEL, '\0', POPT_ARG_STRING, N_("PBKDF parallel cost"), N_("threads"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_LUKS2_PARALLEL_THREADS }, {})
 
+ARG(OPT_PERF_CPUMASK, '\0', POPT_ARG_STRING, N_("Restrict dm-crypt encryption workqueue to CPUs in hexadecimal mask"), N_("mask"), CRYPT_ARG_STRING, {}, OPT_PERF_CPUMASK_ACTIONS)
+
+ARG(OPT_PERF_HIGH_PRIORITY, '\0', POPT_ARG_NONE, N_("Use dm-crypt high priority workqueues"), NULL, CRYPT_ARG_BOOL, {}, {})
+
 ARG(OPT_PERF_NO_READ_WORKQUEUE, '\0', POPT_ARG_NONE, N_("Bypass dm-crypt workqueue and process read requests synchronously"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERF_NO_WRITE_WORKQUEUE, '\0', POPT_ARG_NONE, N_("Bypass dm-crypt workqueue and process write requests synchronously"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_PERF_PROFILE, '\0', POPT_ARG_STRING, N_("Select dm-crypt performance options automatically (auto)"), NULL, CRYPT_ARG_STRING, {}, OPT_PERF_PROFILE_ACTIONS)
+
 ARG(OPT_PERF_SAME_CPU_CRYPT, '\0', POPT_ARG_NONE, N_("Use dm-crypt same_cpu_crypt performance compatibility option"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_PERF_SUBMIT_FROM_CRYPT_CPUS, '\0', POPT_ARG_NONE, N_("Use dm-crypt submit_from_crypt_cpus performance compatibility option"), NULL, CRYPT_ARG_BOOL, {}, {})
@@ -149,8 +175,14 @@ ARG(OPT_PROGRESS_FREQUENCY, '\0', POPT_ARG_STRING, N_("Progress line update (in
 
 ARG(OPT_READONLY, 'r', POPT_ARG_NONE, N_("Create a readonly mapping"), NULL, CRYPT_ARG_BOOL, {}, {})
 
+ARG(OPT_REBALANCE, '\0', POPT_ARG_NONE, N_("Rewrap keyslots with unlock time far from --iter-time on this host"), NULL, CRYPT_ARG_BOOL, {}, OPT_REBALANCE_ACTIONS)
+
+ARG(OPT_RECOMMEND, '\0', POPT_ARG_NONE, N_("Print the fastest cipher and sector size options for luksFormat"), NULL, CRYPT_ARG_BOOL, {}, OPT_RECOMMEND_ACTIONS)
+
 ARG(OPT_REDUCE_DEVICE_SIZE, '\0', POPT_ARG_STRING, N_("Reduce data device size (move data offset). DANGEROUS!"), N_("bytes"), CRYPT_ARG_UINT64, {}, {})
 
+ARG(OPT_REENCRYPT_JOBS, '\0', POPT_ARG_STRING, N_("Maximal number of devices reencrypted in parallel"), N_("number"), CRYPT_ARG_UINT32, {}, OPT_REENCRYPT_JOBS_ACTIONS)
+
 ARG(OPT_REFRESH, '\0', POPT_ARG_NONE, N_("Refresh (reactivate) device with new parameters"), NULL, CRYPT_ARG_BOOL, {}, OPT_REFRESH_ACTIONS)
 
 ARG(OPT_RESILIENCE, '\0', POPT_ARG_STRING, N_("Reencryption hotzone resilience type (checksum,journal,none)"), NULL, CRYPT_ARG_STRING, {}, {})
@@ -169,6 +201,10 @@ ARG(OPT_SIZE, 'b', POPT_ARG_STRING, N_("The size of the device"), N_("SECTORS"),
 
 ARG(OPT_SKIP, 'p', POPT_ARG_STRING, N_("How many sectors of the encrypted data to skip at the beginning"), N_("SECTORS"), CRYPT_ARG_UINT64, {}, OPT_SKIP_ACTIONS)
 
+ARG(OPT_STACK, '\0', POPT_ARG_NONE, N_("Benchmark device-mapper stack over temporary dm-zero device (requires root)"), NULL, CRYPT_ARG_BOOL, {}, OPT_STACK_ACTIONS)
+
+ARG(OPT_STATS, '\0', POPT_ARG_NONE, N_("Print I/O statistics of active device"), NULL, CRYPT_ARG_BOOL, {}, OPT_STATS_ACTIONS)
+
 ARG(OPT_SUBSYSTEM, '\0', POPT_ARG_STRING, N_("Set subsystem label for the LUKS2 device"), NULL, CRYPT_ARG_STRING, {}, OPT_SUBSYSTEM_ACTIONS)
 
 ARG(OPT_TCRYPT_BACKUP, '\0', POPT_ARG_NONE, N_("Use backup (secondary) TCRYPT header"), NULL, CRYPT_ARG_BOOL, {}, OPT_TCRYPT_BACKUP_ACTIONS)
@@ -181,6 +217,8 @@ ARG(OPT_TEST_ARGS, '\0', POPT_ARG_NONE, N_("Do not run action, just validate all
 
 ARG(OPT_TEST_PASSPHRASE, '\0', POPT_ARG_NONE, N_("Do not activate device, just check passphrase"), NULL, CRYPT_ARG_BOOL, {}, OPT_TEST_PASSPHRASE_ACTIONS)
 
+ARG(OPT_THREADS, '\0', POPT_ARG_STRING, N_("Number of threads used for cipher benchmark or header scan"), N_("number"), CRYPT_ARG_UINT32, {}, OPT_THREADS_ACTIONS)
+
 ARG(OPT_TIMEOUT, 't', POPT_ARG_STRING, N_("Timeout for interactive passphrase prompt (in seconds)"), N_("secs"), CRYPT_ARG_UINT32, {}, {})
 
 ARG(OPT_TOKEN_ID, '\0', POPT_ARG_STRING, N_("Token number (default: any)"), "INT", CRYPT_ARG_INT32, { .i32_value = CRYPT_ANY_TOKEN }, {})
@@ -201,6 +239,8 @@ ARG(OPT_USE_RANDOM, '\0', POPT_ARG_NONE, N_("Use /dev/random for generating volu
 
 ARG(OPT_USE_URANDOM, '\0', POPT_ARG_NONE, N_("Use /dev/urandom for generating volume key"), NULL, CRYPT_ARG_BOOL, {}, OPT_USE_URANDOM_ACTIONS)
 
+ARG(OPT_USED_RANGES, '\0', POPT_ARG_STRING, N_("File with data areas in use, reencryption skips other areas"), NULL, CRYPT_ARG_STRING, {}, OPT_USED_RANGES_ACTIONS)
+
 ARG(OPT_UUID, '\0', POPT_ARG_STRING, N_("UUID for device to use"), NULL, CRYPT_ARG_STRING, {}, OPT_UUID_ACTIONS)
 
 ARG(OPT_VERACRYPT, '\0', POPT_ARG_NONE, N_("Scan also for VeraCrypt compatible device"), NULL, CRYPT_ARG_BOOL, {}, {})
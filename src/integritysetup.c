@@ -76,6 +76,39 @@ static int _read_keys(char **integrity_key, struct crypt_params_integrity *param
 	return 0;
 }
 
+/*
+ * Wipe block is aligned to interleave area, so parallel writers
+ * in wipe work with different dm-integrity areas.
+ */
+#define INTEGRITY_WIPE_BLOCK_MAX (16 * 1024 * 1024)
+
+static size_t _wipe_block_size(struct crypt_device *cd)
+{
+	struct crypt_params_integrity ip;
+	size_t area, block;
+
+	if (crypt_get_integrity_info(cd, &ip) || !ip.interleave_sectors)
+		return DEFAULT_WIPE_BLOCK;
+
+	area = (size_t)ip.interleave_sectors * SECTOR_SIZE;
+	if (area > INTEGRITY_WIPE_BLOCK_MAX)
+		return DEFAULT_WIPE_BLOCK;
+
+	block = area;
+	while (block < DEFAULT_WIPE_BLOCK)
+		block += area;
+
+	return block;
+}
+
+static int _set_threads(struct crypt_device *cd)
+{
+	if (!ARG_SET(OPT_THREADS_ID))
+		return 0;
+
+	return crypt_set_threads(cd, ARG_UINT32(OPT_THREADS_ID));
+}
+
 static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 {
 	char tmp_name[64], tmp_path[128], tmp_uuid[40];
@@ -110,7 +143,7 @@ static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 
 	/* Wipe the device */
 	set_int_handler(0);
-	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, DEFAULT_WIPE_BLOCK,
+	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, _wipe_block_size(cd),
 		       0, &tools_progress, &prog_parms);
 	if (crypt_deactivate(cd, tmp_name))
 		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
@@ -190,7 +223,7 @@ static int action_format(void)
 			goto out;
 	}
 
-	r = tools_detect_signatures(action_argv[0], PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID));
+	r = tools_detect_signatures(action_argv[0], PRB_FILTER_NONE, &signatures, ARG_SET(OPT_BATCH_MODE_ID), 0);
 	if (r < 0)
 		goto out;
 
@@ -204,7 +237,10 @@ static int action_format(void)
 	if (ARG_SET(OPT_INTEGRITY_LEGACY_HMAC_ID))
 		crypt_set_compatibility(cd, CRYPT_COMPAT_LEGACY_INTEGRITY_HMAC);
 
-	r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params);
+	if (ARG_SET(OPT_INTEGRITY_INLINE_ID))
+		r = crypt_format_inline(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params);
+	else
+		r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params);
 	if (r < 0) /* FIXME: call wipe signatures again */
 		goto out;
 
@@ -212,7 +248,7 @@ static int action_format(void)
 		log_std(_("Formatted with tag size %u, internal integrity %s.\n"),
 			params2.tag_size, params2.integrity);
 
-	if (!ARG_SET(OPT_NO_WIPE_ID))
+	if (!ARG_SET(OPT_NO_WIPE_ID) && !(r = _set_threads(cd)))
 		r = _wipe_data_device(cd, integrity_key);
 out:
 	crypt_safe_free(integrity_key);
@@ -276,9 +312,13 @@ static int action_resize(void)
 					"You can interrupt this by pressing CTRL+c "
 					"(rest of not wiped device will contain invalid checksum).\n"));
 
+			r = _set_threads(cd);
+			if (r)
+				goto out;
+
 			set_int_handler(0);
 			r = crypt_wipe(cd, path, CRYPT_WIPE_ZERO, old_dev_size * SECTOR_SIZE,
-				      (new_dev_size - old_dev_size) * SECTOR_SIZE, DEFAULT_WIPE_BLOCK,
+				      (new_dev_size - old_dev_size) * SECTOR_SIZE, _wipe_block_size(cd),
 				      0, &tools_progress, &prog_parms);
 			set_int_block(0);
 		} else {
@@ -413,6 +453,7 @@ static int action_status(void)
 	struct crypt_device *cd = NULL;
 	char *backing_file;
 	const char *device, *metadata_device;
+	uint64_t recalc_sector, data_sectors;
 	int path = 0, r = 0;
 
 	/* perhaps a path, not a dm device name */
@@ -474,15 +515,21 @@ static int action_status(void)
 		log_std("  sector size:  %u bytes\n", crypt_get_sector_size(cd));
 		log_std("  interleave sectors: %u\n", ip.interleave_sectors);
 		log_std("  size:    %" PRIu64 " sectors\n", cad.size);
-		log_std("  mode:    %s%s\n",
+		log_std("  mode:    %s%s%s\n",
 			cad.flags & CRYPT_ACTIVATE_READONLY ? "readonly" : "read/write",
-			cad.flags & CRYPT_ACTIVATE_RECOVERY ? " recovery" : "");
+			cad.flags & CRYPT_ACTIVATE_RECOVERY ? " recovery" : "",
+			cad.flags & CRYPT_ACTIVATE_INLINE_MODE ? " inline" : "");
 		log_std("  failures: %" PRIu64 "\n",
 			crypt_get_active_integrity_failures(cd, action_argv[0]));
+		if (!crypt_get_active_integrity_recalc(cd, action_argv[0], &recalc_sector, &data_sectors))
+			log_std("  recalculation: %s, %" PRIu64 " of %" PRIu64 " sectors (%.1f%%)\n",
+				cad.flags & CRYPT_ACTIVATE_RECALCULATE ? "running" : "paused",
+				recalc_sector, data_sectors,
+				data_sectors ? 100.0 * recalc_sector / data_sectors : 0.0);
 		if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP) {
 			log_std("  bitmap 512-byte sectors per bit: %u\n", ip.journal_watermark);
 			log_std("  bitmap flush interval: %u ms\n", ip.journal_commit_time);
-		} if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL) {
+		} if (cad.flags & (CRYPT_ACTIVATE_NO_JOURNAL | CRYPT_ACTIVATE_INLINE_MODE)) {
 			log_std("  journal: not active\n");
 		} else {
 			log_std("  journal size: %" PRIu64 " bytes\n", ip.journal_size);
@@ -524,6 +571,79 @@ static int action_dump(void)
 	return r;
 }
 
+static int action_tune(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_integrity params = {
+		.tag_size = ARG_UINT32(OPT_TAG_SIZE_ID),
+		.sector_size = ARG_UINT32(OPT_SECTOR_SIZE_ID),
+	};
+	struct crypt_integrity_tune tune;
+	crypt_integrity_tune_mode mode = CRYPT_INTEGRITY_TUNE_JOURNAL;
+	char integrity[MAX_CIPHER_LEN];
+	int r;
+
+	if (ARG_SET(OPT_INTEGRITY_BITMAP_MODE_ID))
+		mode = CRYPT_INTEGRITY_TUNE_BITMAP;
+	else if (ARG_SET(OPT_INTEGRITY_NO_JOURNAL_ID))
+		mode = CRYPT_INTEGRITY_TUNE_DIRECT;
+
+	r = crypt_parse_hash_integrity_mode(ARG_STR(OPT_INTEGRITY_ID), integrity);
+	if (r < 0) {
+		log_err(_("No known integrity specification pattern detected."));
+		return r;
+	}
+	params.integrity = integrity;
+
+	r = crypt_init(&cd, action_argv[0]);
+	if (r < 0)
+		return r;
+
+	r = crypt_integrity_tune(cd, mode, &params, &tune);
+	if (r == -EBUSY)
+		log_err(_("Device %s is in use, benchmark needs exclusive access."), action_argv[0]);
+	else if (r < 0)
+		log_err(_("Cannot benchmark device %s."), action_argv[0]);
+	if (r < 0)
+		goto out;
+
+	log_std(_("Write latency:        %.3f ms\n"), tune.write_latency_ms);
+	log_std(_("Write bandwidth:      %.1f MiB/s\n"), tune.write_mbs);
+	log_std(_("Write amplification:  %.2f\n"), tune.write_amplification);
+	log_std(_("Recommended options: "));
+	if (mode == CRYPT_INTEGRITY_TUNE_JOURNAL)
+		log_std(" --journal-size %" PRIu64 " --journal-watermark %u --journal-commit-time %u",
+			params.journal_size, params.journal_watermark, params.journal_commit_time);
+	else if (mode == CRYPT_INTEGRITY_TUNE_BITMAP)
+		log_std(" --integrity-bitmap-mode --bitmap-sectors-per-bit %u --bitmap-flush-time %u",
+			params.journal_watermark, params.journal_commit_time);
+	else
+		log_std(" --integrity-no-journal");
+	log_std(" --buffer-sectors %u\n", params.buffer_sectors);
+out:
+	crypt_free(cd);
+	return r;
+}
+
+static int action_recalculate(void)
+{
+	uint32_t flags;
+
+	if (!strcmp(action_argv[0], "start"))
+		flags = CRYPT_ACTIVATE_RECALCULATE;
+	else if (!strcmp(action_argv[0], "reset"))
+		flags = CRYPT_ACTIVATE_RECALCULATE | CRYPT_ACTIVATE_RECALCULATE_RESET;
+	else if (!strcmp(action_argv[0], "stop"))
+		flags = 0;
+	else {
+		log_err(_("Unknown recalculate operation %s."), action_argv[0]);
+		return -EINVAL;
+	}
+
+	return crypt_retune(NULL, action_argv[1], flags,
+			    CRYPT_ACTIVATE_RECALCULATE | CRYPT_ACTIVATE_RECALCULATE_RESET);
+}
+
 static struct action_type {
 	const char *type;
 	int (*handler)(void);
@@ -537,6 +657,8 @@ static struct action_type {
 	{ STATUS_ACTION,action_status, 1, N_("<name>"),N_("show active device status") },
 	{ DUMP_ACTION,	action_dump,   1, N_("<integrity_device>"),N_("show on-disk information") },
 	{ RESIZE_ACTION,action_resize, 1, N_("<name>"), N_("resize active device") },
+	{ TUNE_ACTION,	action_tune,   1, N_("<integrity_device>"), N_("benchmark device and recommend parameters") },
+	{ RECALCULATE_ACTION, action_recalculate, 2, N_("<start|stop|reset> <name>"), N_("control background recalculation of integrity tags") },
 	{}
 };
 
@@ -748,6 +870,14 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Journal options cannot be used in bitmap mode."),
 		      poptGetInvocationName(popt_context));
 
+	if (ARG_SET(OPT_INTEGRITY_INLINE_ID) &&
+	    (ARG_SET(OPT_DATA_DEVICE_ID) || ARG_SET(OPT_JOURNAL_SIZE_ID) ||
+	     ARG_SET(OPT_INTERLEAVE_SECTORS_ID) || ARG_SET(OPT_JOURNAL_INTEGRITY_ID) ||
+	     ARG_SET(OPT_JOURNAL_CRYPT_ID) || ARG_SET(OPT_JOURNAL_WATERMARK_ID) ||
+	     ARG_SET(OPT_JOURNAL_COMMIT_TIME_ID)))
+		usage(popt_context, EXIT_FAILURE, _("Journal and detached data device options cannot be used in inline mode."),
+		      poptGetInvocationName(popt_context));
+
 	if (!ARG_SET(OPT_INTEGRITY_BITMAP_MODE_ID) &&
 	    (ARG_SET(OPT_BITMAP_FLUSH_TIME_ID) || ARG_SET(OPT_BITMAP_SECTORS_PER_BIT_ID)))
 		usage(popt_context, EXIT_FAILURE, _("Bitmap options can be used only in bitmap mode."),
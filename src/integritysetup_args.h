@@ -31,16 +31,20 @@
 #define STATUS_ACTION	"status"
 #define DUMP_ACTION	"dump"
 #define RESIZE_ACTION	"resize"
+#define RECALCULATE_ACTION	"recalculate"
+#define TUNE_ACTION	"tune"
 
 #define OPT_ALLOW_DISCARDS_ACTIONS		{ OPEN_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
+#define OPT_INTEGRITY_INLINE_ACTIONS		{ FORMAT_ACTION }
 #define OPT_INTEGRITY_RECALCULATE_ACTIONS	{ OPEN_ACTION }
 #define OPT_JOURNAL_SIZE_ACTIONS		{ FORMAT_ACTION }
 #define OPT_NO_WIPE_ACTIONS			{ FORMAT_ACTION }
 #define OPT_INTERLEAVE_SECTORS_ACTIONS		{ FORMAT_ACTION }
 #define OPT_PROGRESS_JSON_ACTIONS		{ FORMAT_ACTION, RESIZE_ACTION }
-#define OPT_SECTOR_SIZE_ACTIONS			{ FORMAT_ACTION }
-#define OPT_TAG_SIZE_ACTIONS			{ FORMAT_ACTION }
+#define OPT_SECTOR_SIZE_ACTIONS			{ FORMAT_ACTION, TUNE_ACTION }
+#define OPT_TAG_SIZE_ACTIONS			{ FORMAT_ACTION, TUNE_ACTION }
+#define OPT_THREADS_ACTIONS			{ FORMAT_ACTION, RESIZE_ACTION }
 #define OPT_DEVICE_SIZE_ACTIONS			{ RESIZE_ACTION }
 #define OPT_SIZE_ACTIONS			{ RESIZE_ACTION }
 #define OPT_WIPE_ACTIONS			{ RESIZE_ACTION }
@@ -24,20 +24,27 @@
 
 #define OPT_ACTIVE_NAME			"active-name"
 #define OPT_ALIGN_PAYLOAD		"align-payload"
+#define OPT_ALL				"all"
 #define OPT_ALLOW_DISCARDS		"allow-discards"
+#define OPT_BATCH_FILE			"batch-file"
 #define OPT_BATCH_MODE			"batch-mode"
 #define OPT_BITMAP_FLUSH_TIME		"bitmap-flush-time"
 #define OPT_BITMAP_SECTORS_PER_BIT	"bitmap-sectors-per-bit"
 #define OPT_BLOCK_SIZE			"block-size"
 #define OPT_BUFFER_SECTORS		"buffer-sectors"
+#define OPT_CACHE_KEY			"cache-key"
 #define OPT_CANCEL_DEFERRED		"cancel-deferred"
+#define OPT_CHANGED_BLOCKS		"changed-blocks"
+#define OPT_CHECK_ALL			"check-all"
 #define OPT_CHECK_AT_MOST_ONCE		"check-at-most-once"
 #define OPT_CIPHER			"cipher"
 #define OPT_DATA_BLOCK_SIZE		"data-block-size"
 #define OPT_DATA_BLOCKS			"data-blocks"
+#define OPT_DATA_STREAM			"data-stream"
 #define OPT_DATA_DEVICE			"data-device"
 #define OPT_DEBUG			"debug"
 #define OPT_DEBUG_JSON			"debug-json"
+#define OPT_DEBUG_TIMING		"debug-timing"
 #define OPT_DEFERRED			"deferred"
 #define OPT_DEVICE_SIZE			"device-size"
 #define OPT_DECRYPT			"decrypt"
@@ -58,14 +65,18 @@
 #define OPT_HASH			"hash"
 #define OPT_HASH_BLOCK_SIZE		"hash-block-size"
 #define OPT_HASH_OFFSET			"hash-offset"
+#define OPT_HASH_STAGING		"hash-staging"
+#define OPT_HASH_STAGING_DEVICE		"hash-staging-device"
 #define OPT_HEADER			"header"
 #define OPT_HEADER_BACKUP_FILE		"header-backup-file"
 #define OPT_HOTZONE_SIZE		"hotzone-size"
 #define OPT_IGNORE_CORRUPTION		"ignore-corruption"
 #define OPT_IGNORE_ZERO_BLOCKS		"ignore-zero-blocks"
 #define OPT_INIT_ONLY			"init-only"
+#define OPT_INLINE_CRYPT		"inline-crypt"
 #define OPT_INTEGRITY			"integrity"
 #define OPT_INTEGRITY_BITMAP_MODE	"integrity-bitmap-mode"
+#define OPT_INTEGRITY_INLINE		"integrity-inline"
 #define OPT_INTEGRITY_KEY_FILE		"integrity-key-file"
 #define OPT_INTEGRITY_KEY_SIZE		"integrity-key-size"
 #define OPT_INTEGRITY_LEGACY_PADDING	"integrity-legacy-padding"
@@ -79,6 +90,7 @@
 #define OPT_INTERLEAVE_SECTORS		"interleave-sectors"
 #define OPT_ITER_TIME			"iter-time"
 #define OPT_IV_LARGE_SECTORS		"iv-large-sectors"
+#define OPT_JSON			"json"
 #define OPT_JSON_FILE			"json-file"
 #define OPT_JOURNAL_COMMIT_TIME		"journal-commit-time"
 #define OPT_JOURNAL_CRYPT		"journal-crypt"
@@ -98,6 +110,7 @@
 #define OPT_KEYFILE_SIZE		"keyfile-size"
 #define OPT_KEYSLOT_CIPHER		"keyslot-cipher"
 #define OPT_KEYSLOT_KEY_SIZE		"keyslot-key-size"
+#define OPT_KEYSLOT_TELEMETRY		"keyslot-telemetry"
 #define OPT_NO_SUPERBLOCK		"no-superblock"
 #define OPT_NO_WIPE			"no-wipe"
 #define OPT_WIPE			"wipe"
@@ -114,21 +127,30 @@
 #define OPT_NEW_TOKEN_ID		"new-token-id"
 #define OPT_OFFSET			"offset"
 #define OPT_PANIC_ON_CORRUPTION		"panic-on-corruption"
+#define OPT_PARALLEL_UNLOCK		"parallel-unlock"
 #define OPT_PBKDF			"pbkdf"
+#define OPT_PBKDF_CACHE			"pbkdf-cache"
 #define OPT_PBKDF_FORCE_ITERATIONS	"pbkdf-force-iterations"
 #define OPT_PBKDF_MEMORY		"pbkdf-memory"
 #define OPT_PBKDF_PARALLEL		"pbkdf-parallel"
+#define OPT_PERF_CPUMASK		"perf-cpumask"
+#define OPT_PERF_HIGH_PRIORITY		"perf-high_priority"
 #define OPT_PERF_NO_READ_WORKQUEUE	"perf-no_read_workqueue"
 #define OPT_PERF_NO_WRITE_WORKQUEUE	"perf-no_write_workqueue"
+#define OPT_PERF_PROFILE		"perf-profile"
 #define OPT_PERF_SAME_CPU_CRYPT		"perf-same_cpu_crypt"
 #define OPT_PERF_SUBMIT_FROM_CRYPT_CPUS	"perf-submit_from_crypt_cpus"
 #define OPT_PERSISTENT			"persistent"
 #define OPT_PLUGIN			"plugin"
+#define OPT_PREFETCH_CLUSTER		"prefetch-cluster"
 #define OPT_PRIORITY			"priority"
 #define OPT_PROGRESS_JSON		"progress-json"
 #define OPT_PROGRESS_FREQUENCY		"progress-frequency"
 #define OPT_READONLY			"readonly"
+#define OPT_REBALANCE			"rebalance"
+#define OPT_RECOMMEND			"recommend"
 #define OPT_REDUCE_DEVICE_SIZE		"reduce-device-size"
+#define OPT_REENCRYPT_JOBS		"reencrypt-jobs"
 #define OPT_REFRESH			"refresh"
 #define OPT_RESILIENCE			"resilience"
 #define OPT_RESILIENCE_HASH		"resilience-hash"
@@ -137,11 +159,15 @@
 #define OPT_ROOT_HASH_FILE		"root-hash-file"
 #define OPT_ROOT_HASH_SIGNATURE		"root-hash-signature"
 #define OPT_SALT			"salt"
+#define OPT_SAMPLE			"sample"
+#define OPT_SAMPLE_SEED			"sample-seed"
 #define OPT_SECTOR_SIZE			"sector-size"
 #define OPT_SERIALIZE_MEMORY_HARD_PBKDF	"serialize-memory-hard-pbkdf"
 #define OPT_SHARED			"shared"
 #define OPT_SIZE			"size"
 #define OPT_SKIP			"skip"
+#define OPT_STACK			"stack"
+#define OPT_STATS			"stats"
 #define OPT_SUBSYSTEM			"subsystem"
 #define OPT_TAG_SIZE			"tag-size"
 #define OPT_TCRYPT_BACKUP		"tcrypt-backup"
@@ -149,6 +175,7 @@
 #define OPT_TCRYPT_SYSTEM		"tcrypt-system"
 #define OPT_TEST_ARGS			"test-args"
 #define OPT_TEST_PASSPHRASE		"test-passphrase"
+#define OPT_THREADS			"threads"
 #define OPT_TIMEOUT			"timeout"
 #define OPT_TOKEN_ID			"token-id"
 #define OPT_TOKEN_ONLY			"token-only"
@@ -162,6 +189,7 @@
 #define OPT_USE_RANDOM			"use-random"
 #define OPT_USE_URANDOM			"use-urandom"
 #define OPT_USE_TASKLETS		"use-tasklets"
+#define OPT_USED_RANGES			"used-ranges"
 #define OPT_UUID			"uuid"
 #define OPT_VERACRYPT			"veracrypt"
 #define OPT_VERACRYPT_PIM		"veracrypt-pim"
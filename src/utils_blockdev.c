@@ -197,13 +197,38 @@ static void report_superblock(const char *value, const char *device, bool batch_
 		log_std(_("WARNING: Device %s already contains a '%s' superblock signature.\n"), device, value);
 }
 
+static int probe_signatures(struct blkid_handle *h, const char *device,
+		size_t *count, bool batch_mode)
+{
+	blk_probe_status pr;
+
+	while ((pr = blk_probe(h)) < PRB_EMPTY) {
+		if (blk_is_partition(h))
+			report_partition(blk_get_partition_type(h), device, batch_mode);
+		else if (blk_is_superblock(h))
+			report_superblock(blk_get_superblock_type(h), device, batch_mode);
+		else {
+			log_dbg("Internal tools_detect_signatures() error.");
+			return -EINVAL;
+		}
+		(*count)++;
+	}
+
+	return pr == PRB_FAIL ? -EINVAL : 0;
+}
+
+/*
+ * With probe_size set only the device start and the (probe_size aligned)
+ * device end areas are probed, RAID superblocks at the end are still found
+ * but blkid does not read through the whole device.
+ */
 int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
-		size_t *count,bool batch_mode)
+		size_t *count, bool batch_mode, uint64_t probe_size)
 {
 	int r;
 	size_t tmp_count;
 	struct blkid_handle *h;
-	blk_probe_status pr;
+	uint64_t device_size = 0;
 
 	if (!count)
 		count = &tmp_count;
@@ -215,11 +240,28 @@ int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
 		return 0;
 	}
 
-	if ((r = blk_init_by_path(&h, device))) {
+	if (probe_size)
+		r = blk_init_by_path_area(&h, device, 0, 0);
+	else
+		r = blk_init_by_path(&h, device);
+	if (r) {
 		log_err(_("Failed to initialize device signature probes."));
 		return -EINVAL;
 	}
 
+	if (probe_size) {
+		/* keep MiB alignment, md superblock offsets are relative to the area end */
+		probe_size = (probe_size + (1024 * 1024 - 1)) & ~(uint64_t)(1024 * 1024 - 1);
+		device_size = blk_get_device_size(h);
+		/* small device, probe it whole */
+		if (device_size <= 2 * probe_size)
+			probe_size = 0;
+		else if (blk_set_area(h, 0, probe_size)) {
+			r = -EINVAL;
+			goto out;
+		}
+	}
+
 	switch (filter) {
 	case PRB_FILTER_LUKS:
 		if (blk_superblocks_filter_luks(h)) {
@@ -238,21 +280,18 @@ int tools_detect_signatures(const char *device, tools_probe_filter_info filter,
 		}
 	}
 
-	while ((pr = blk_probe(h)) < PRB_EMPTY) {
-		if (blk_is_partition(h))
-			report_partition(blk_get_partition_type(h), device, batch_mode);
-		else if (blk_is_superblock(h))
-			report_superblock(blk_get_superblock_type(h), device, batch_mode);
-		else {
-			log_dbg("Internal tools_detect_signatures() error.");
-			r = -EINVAL;
-			goto out;
-		}
-		(*count)++;
-	}
+	r = probe_signatures(h, device, count, batch_mode);
+	if (r < 0 || !probe_size || filter == PRB_ONLY_LUKS)
+		goto out;
 
-	if (pr == PRB_FAIL)
+	/* Area start stays aligned so RAID superblock offsets are computed as for whole device */
+	log_dbg("Probing device end area, %" PRIu64 " bytes.", probe_size);
+	if (blk_set_area(h, device_size - probe_size - (device_size % probe_size), 0)) {
 		r = -EINVAL;
+		goto out;
+	}
+	blk_set_chains_for_area_end(h);
+	r = probe_signatures(h, device, count, batch_mode);
 out:
 	blk_free(h);
 	return r;
@@ -20,6 +20,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
+#include <time.h>
+
 #include "cryptsetup.h"
 #include "cryptsetup_args.h"
 #include "utils_luks.h"
@@ -91,6 +94,12 @@ void set_activation_flags(uint32_t *flags)
 	if (ARG_SET(OPT_PERF_NO_WRITE_WORKQUEUE_ID))
 		*flags |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
 
+	if (ARG_SET(OPT_PERF_HIGH_PRIORITY_ID))
+		*flags |= CRYPT_ACTIVATE_HIGH_PRIORITY;
+
+	if (ARG_SET(OPT_INLINE_CRYPT_ID))
+		*flags |= CRYPT_ACTIVATE_INLINE_CRYPT;
+
 	if (ARG_SET(OPT_INTEGRITY_NO_JOURNAL_ID))
 		*flags |= CRYPT_ACTIVATE_NO_JOURNAL;
 
@@ -111,10 +120,44 @@ void set_activation_flags(uint32_t *flags)
 		*flags |= CRYPT_ACTIVATE_IV_LARGE_SECTORS;
 }
 
+void set_perf_profile_flags(struct crypt_device *cd, uint32_t *flags)
+{
+	uint32_t perf_flags;
+
+	if (!ARG_SET(OPT_PERF_PROFILE_ID))
+		return;
+
+	if (crypt_perf_flags_suggest(cd, &perf_flags)) {
+		log_verbose(_("Cannot select performance options automatically, using defaults."));
+		return;
+	}
+
+	log_verbose(_("Selected performance options:%s%s%s%s."),
+		    perf_flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT ? " same_cpu_crypt" : "",
+		    perf_flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS ? " submit_from_crypt_cpus" : "",
+		    perf_flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE ? " no_read_workqueue" : "",
+		    perf_flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE ? " no_write_workqueue" : "");
+	*flags |= perf_flags;
+}
+
+void set_activation_cpumask(struct crypt_device *cd, const char *name)
+{
+	if (!ARG_SET(OPT_PERF_CPUMASK_ID) || !name)
+		return;
+
+	if (crypt_set_cpumask(cd, name, ARG_STR(OPT_PERF_CPUMASK_ID)))
+		log_err(_("Device activated but cannot set CPU mask."));
+}
+
 int set_pbkdf_params(struct crypt_device *cd, const char *dev_type)
 {
 	const struct crypt_pbkdf_type *pbkdf_default;
 	struct crypt_pbkdf_type pbkdf = {};
+	int r;
+
+	if (ARG_SET(OPT_PBKDF_CACHE_ID) &&
+	    (r = crypt_set_pbkdf_cache(cd, ARG_STR(OPT_PBKDF_CACHE_ID))))
+		return r;
 
 	pbkdf_default = crypt_get_pbkdf_default(dev_type);
 	if (!pbkdf_default)
@@ -272,3 +315,115 @@ out:
 		close(fd);
 	return r;
 }
+
+/*
+ * --debug-timing support, phases measured by the tool itself
+ * and spans reported by the library trace callback.
+ */
+#define TIMING_MAX_ENTRIES 64
+
+struct timing_entry {
+	const char *phase;
+	char name[32];
+	unsigned int count;
+	uint64_t total_us;
+	uint64_t bytes;
+};
+
+static struct timing_entry timing_entries[TIMING_MAX_ENTRIES];
+static unsigned int timing_count = 0;
+static bool timing_enabled = false;
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t timing_usec(void)
+{
+	struct timespec ts;
+
+	if (!timing_enabled || clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Every KDF run has its own row, other operations are summarized */
+static void timing_add(const char *phase, const char *name, uint64_t duration_us,
+		       uint64_t bytes, bool summarize)
+{
+	struct timing_entry *e = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&timing_lock);
+	for (i = 0; summarize && i < timing_count; i++)
+		if (timing_entries[i].phase == phase &&
+		    !strncmp(timing_entries[i].name, name, sizeof(timing_entries[i].name) - 1)) {
+			e = &timing_entries[i];
+			break;
+		}
+
+	if (!e && timing_count < TIMING_MAX_ENTRIES) {
+		e = &timing_entries[timing_count++];
+		e->phase = phase;
+		snprintf(e->name, sizeof(e->name), "%s", name);
+	}
+
+	if (e) {
+		e->count++;
+		e->total_us += duration_us;
+		e->bytes += bytes;
+	}
+	pthread_mutex_unlock(&timing_lock);
+}
+
+void timing_phase(const char *phase, uint64_t start_us)
+{
+	if (timing_enabled)
+		timing_add(phase, "", timing_usec() - start_us, 0, false);
+}
+
+static void timing_trace(struct crypt_device *cd, const struct crypt_trace_span *span, void *usrptr)
+{
+	static const char *phases[] = {
+		[CRYPT_TRACE_KDF] = "keyslot KDF",
+		[CRYPT_TRACE_HEADER_READ] = "header load",
+		[CRYPT_TRACE_HEADER_WRITE] = "header write",
+		[CRYPT_TRACE_DM_IOCTL] = "device-mapper",
+		[CRYPT_TRACE_UDEV_WAIT] = "udev settle",
+		[CRYPT_TRACE_TOKEN] = "token",
+		[CRYPT_TRACE_REENCRYPT_STEP] = "reencryption step",
+	};
+
+	if ((unsigned)span->type >= ARRAY_SIZE(phases) || !phases[span->type])
+		return;
+
+	timing_add(phases[span->type], span->name, span->duration_us, span->type == CRYPT_TRACE_KDF ? span->bytes : 0,
+		   span->type != CRYPT_TRACE_KDF);
+}
+
+void timing_init(void)
+{
+	timing_enabled = true;
+	crypt_set_trace_callback(NULL, timing_trace, NULL);
+}
+
+void timing_report(void)
+{
+	struct timing_entry *e;
+	unsigned int i;
+
+	if (!timing_enabled || !timing_count)
+		return;
+
+	crypt_set_trace_callback(NULL, NULL, NULL);
+
+	log_std(_("Timing breakdown:\n"));
+	log_std("  %-34s %6s %12s\n", _("Phase"), _("Count"), _("Time [ms]"));
+	for (i = 0; i < timing_count; i++) {
+		e = &timing_entries[i];
+		if (*e->name && e->bytes)
+			log_std("  %-18s %-15s %6u %12.3f (%" PRIu64 " KiB)\n", e->phase, e->name,
+				e->count, (double)e->total_us / 1000, e->bytes / 1024);
+		else
+			log_std("  %-18s %-15s %6u %12.3f\n", e->phase, e->name,
+				e->count, (double)e->total_us / 1000);
+	}
+}
@@ -35,6 +35,10 @@ int verify_passphrase(int def);
 
 void set_activation_flags(uint32_t *flags);
 
+void set_perf_profile_flags(struct crypt_device *cd, uint32_t *flags);
+
+void set_activation_cpumask(struct crypt_device *cd, const char *name);
+
 int set_pbkdf_params(struct crypt_device *cd, const char *dev_type);
 
 int set_tries_tty(void);
@@ -49,4 +53,12 @@ int reencrypt_luks1(const char *device);
 
 int reencrypt_luks1_in_progress(const char *device);
 
+uint64_t timing_usec(void);
+
+void timing_phase(const char *phase, uint64_t start_us);
+
+void timing_init(void);
+
+void timing_report(void);
+
 #endif /* UTILS_LUKS_H */
@@ -33,6 +33,12 @@
 #define REMAIN_SECONDS(A) (SECONDS((A))) % 60
 #define REMAIN_MINUTES(A) (MINUTES((A))) % 60
 
+/* weight of the last interval in exponentially smoothed speed */
+#define RATE_SMOOTHING 0.3
+
+/* reencryption step phases, indexes to phase_us arrays */
+enum { PHASE_READ = 0, PHASE_CRYPT, PHASE_WRITE, PHASE_COMMIT, PHASE_COUNT };
+
 /* The difference in microseconds between two times in "timeval" format. */
 static uint64_t time_diff(struct timeval *start, struct timeval *end)
 {
@@ -83,7 +89,8 @@ static bool time_to_human_string(uint64_t usecs, char *buf, size_t buf_len)
 	return true;
 }
 
-static void log_progress(uint64_t bytes, uint64_t device_size, uint64_t eta, double uib, const char *ustr, const char *eol)
+static void log_progress(uint64_t bytes, uint64_t device_size, uint64_t eta, double uib, const char *ustr,
+			 const char *bound, const char *eol)
 {
 	double progress;
 	int r;
@@ -115,8 +122,16 @@ static void log_progress(uint64_t bytes, uint64_t device_size, uint64_t eta, dou
 	 * to get translated as well. 'eol' is always new-line or empty.
 	 * See above.
 	 */
-	log_std(_("Progress: %5.1f%%, ETA %s, %s, %s%s"),
-		progress, time, written, speed, eol);
+	if (bound)
+		/*
+		 * TRANSLATORS: 'bound' is one of translated "read", "crypto",
+		 * "write" or "metadata" strings, see reencrypt_bottleneck().
+		 */
+		log_std(_("Progress: %5.1f%%, ETA %s, %s, %s, bottleneck %s%s"),
+			progress, time, written, speed, bound, eol);
+	else
+		log_std(_("Progress: %5.1f%%, ETA %s, %s, %s%s"),
+			progress, time, written, speed, eol);
 }
 
 static void log_progress_final(uint64_t time_spent, uint64_t bytes, double uib, const char *ustr)
@@ -182,11 +197,94 @@ static bool calculate_tdiff(bool final, uint64_t bytes, struct tools_progress_pa
 	return true;
 }
 
+/*
+ * Speed smoothed over reporting intervals, so ETA does not jump
+ * with every short stall (or burst) of the device.
+ */
+static double progress_rate(struct tools_progress_params *parms, uint64_t bytes, double tdiff)
+{
+	double rate;
+
+	if (parms->rate <= 0 || tdiff <= parms->last_tdiff || bytes < parms->last_bytes)
+		rate = (double)(bytes - parms->start_offset) / tdiff;
+	else
+		rate = RATE_SMOOTHING * (bytes - parms->last_bytes) / (tdiff - parms->last_tdiff) +
+		       (1 - RATE_SMOOTHING) * parms->rate;
+
+	parms->rate = rate;
+	parms->last_tdiff = tdiff;
+	parms->last_bytes = bytes;
+
+	return rate;
+}
+
+static uint64_t progress_eta_usec(uint64_t device_size, uint64_t bytes, double rate)
+{
+	if (rate <= 0 || bytes >= device_size)
+		return 0;
+
+	return (uint64_t)((device_size - bytes) / rate * 1E6);
+}
+
+/* Accumulate phase timing of reencryption steps finished since the last call */
+static void reencrypt_phases_update(struct tools_progress_params *parms)
+{
+	struct crypt_reencrypt_step_stats stats;
+	uint64_t us[PHASE_COUNT];
+	int i;
+
+	if (!parms->cd || crypt_reencrypt_step_stats(parms->cd, &stats))
+		return;
+
+	/* final progress report repeats the last step */
+	if (stats.offset == parms->last_step_offset && stats.step_us == parms->last_step_us)
+		return;
+	parms->last_step_offset = stats.offset;
+	parms->last_step_us = stats.step_us;
+
+	us[PHASE_READ] = stats.read_us;
+	us[PHASE_CRYPT] = stats.crypt_us;
+	us[PHASE_WRITE] = stats.write_us;
+	us[PHASE_COMMIT] = stats.commit_us;
+
+	for (i = 0; i < PHASE_COUNT; i++) {
+		parms->phase_us[i] += us[i];
+		parms->phase_total_us[i] += us[i];
+	}
+}
+
+/* The phase with most time spent since the last report */
+static const char *reencrypt_bottleneck(struct tools_progress_params *parms)
+{
+	const char *names[PHASE_COUNT] = {
+		[PHASE_READ] = _("read"),
+		[PHASE_CRYPT] = _("crypto"),
+		[PHASE_WRITE] = _("write"),
+		[PHASE_COMMIT] = _("metadata"),
+	};
+	int i, max = 0;
+
+	if (!parms->cd)
+		return NULL;
+
+	for (i = 1; i < PHASE_COUNT; i++)
+		if (parms->phase_us[i] > parms->phase_us[max])
+			max = i;
+
+	if (!parms->phase_us[max])
+		return NULL;
+
+	for (i = 0; i < PHASE_COUNT; i++)
+		parms->phase_us[i] = 0;
+
+	return names[max];
+}
+
 static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct tools_progress_params *parms)
 {
 	uint64_t eta;
 	double tdiff, uib;
-	const char *eol, *ustr;
+	const char *eol, *ustr, *bound;
 	bool final = (bytes == device_size);
 
 	if (!calculate_tdiff(final, bytes, parms, &tdiff))
@@ -197,9 +295,13 @@ static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct too
 	else
 		eol = "";
 
-	uib = (double)(bytes - parms->start_offset) / tdiff;
+	if (final)
+		uib = (double)(bytes - parms->start_offset) / tdiff;
+	else
+		uib = progress_rate(parms, bytes, tdiff);
 
-	eta = (uint64_t)((device_size / uib - tdiff) * 1E6);
+	eta = progress_eta_usec(device_size, bytes, uib);
+	bound = reencrypt_bottleneck(parms);
 
 	if (uib > 1073741824.0f) {
 		uib /= 1073741824.0f;
@@ -219,15 +321,34 @@ static void tools_time_progress(uint64_t device_size, uint64_t bytes, struct too
 	if (final)
 		log_progress_final((uint64_t)(tdiff * 1E6), bytes, uib, ustr);
 	else
-		log_progress(bytes, device_size, eta, uib, ustr, eol);
+		log_progress(bytes, device_size, eta, uib, ustr, bound, eol);
 
 	fflush(stdout);
 }
 
-static void log_progress_json(const char *device, uint64_t bytes, uint64_t device_size, uint64_t eta, uint64_t uib, uint64_t time_spent)
+static void log_progress_json(const char *device, uint64_t bytes, uint64_t device_size, uint64_t eta, uint64_t uib, uint64_t time_spent,
+			      struct tools_progress_params *parms)
 {
 	int r;
-	char json[PATH_MAX+256];
+	char json[PATH_MAX+512], phases[256] = "";
+	const char *bound;
+
+	if (parms->cd) {
+		bound = reencrypt_bottleneck(parms);
+		r = snprintf(phases, sizeof(phases),
+			     ",\"read_ms\":\"%"	PRIu64 "\","	/* in milliseconds, since start */
+			     "\"crypt_ms\":\"%"	PRIu64 "\","	/* in milliseconds, since start */
+			     "\"write_ms\":\"%"	PRIu64 "\","	/* in milliseconds, since start */
+			     "\"commit_ms\":\"%"	PRIu64 "\","	/* in milliseconds, since start */
+			     "\"bottleneck\":\"%s\"",		/* since the last report */
+			     parms->phase_total_us[PHASE_READ] / 1000,
+			     parms->phase_total_us[PHASE_CRYPT] / 1000,
+			     parms->phase_total_us[PHASE_WRITE] / 1000,
+			     parms->phase_total_us[PHASE_COMMIT] / 1000,
+			     bound ?: "");
+		if (r < 0 || (size_t)r >= sizeof(phases))
+			phases[0] = '\0';
+	}
 
 	r = snprintf(json, sizeof(json) - 1,
 		     "{\"device\":\"%s\","
@@ -235,8 +356,8 @@ static void log_progress_json(const char *device, uint64_t bytes, uint64_t devic
 		     "\"device_size\":\"%"	PRIu64 "\","	/* in bytes */
 		     "\"speed\":\"%"		PRIu64 "\","	/* in bytes per second */
 		     "\"eta_ms\":\"%"		PRIu64 "\","	/* in milliseconds */
-		     "\"time_ms\":\"%"		PRIu64 "\"}\n",	/* in milliseconds */
-		     device, bytes, device_size, uib, eta, time_spent);
+		     "\"time_ms\":\"%"		PRIu64 "\"%s}\n",	/* in milliseconds */
+		     device, bytes, device_size, uib, eta, time_spent, phases);
 
 	if (r < 0 || (size_t)r >= sizeof(json) - 1)
 		return;
@@ -252,14 +373,18 @@ static void tools_time_progress_json(uint64_t device_size, uint64_t bytes, struc
 	if (!calculate_tdiff(final, bytes, parms, &tdiff))
 		return;
 
-	uib = (double)(bytes - parms->start_offset) / tdiff;
+	if (final)
+		uib = (double)(bytes - parms->start_offset) / tdiff;
+	else
+		uib = progress_rate(parms, bytes, tdiff);
 
 	log_progress_json(parms->device,
 			  bytes,
 			  device_size,
-			  final ? UINT64_C(0) : (uint64_t)((device_size / uib - tdiff) * 1E3),
+			  final ? UINT64_C(0) : progress_eta_usec(device_size, bytes, uib) / 1000,
 			  (uint64_t)uib,
-			  (uint64_t)(tdiff * 1E3));
+			  (uint64_t)(tdiff * 1E3),
+			  parms);
 
 	fflush(stdout);
 }
@@ -269,6 +394,9 @@ int tools_progress(uint64_t size, uint64_t offset, void *usrptr)
 	int r = 0;
 	struct tools_progress_params *parms = (struct tools_progress_params *)usrptr;
 
+	if (parms)
+		reencrypt_phases_update(parms);
+
 	if (parms && parms->json_output)
 		tools_time_progress_json(size, offset, parms);
 	else if (parms && !parms->batch_mode)
@@ -20,6 +20,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <poll.h>
+#include <signal.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+# include <sys/sysmacros.h>     /* for major, minor */
+#endif
+#include <sys/wait.h>
 #include <uuid/uuid.h>
 
 #include "cryptsetup.h"
@@ -39,6 +45,39 @@ enum device_status_info {
 	DEVICE_INVALID		/* device is invalid */
 };
 
+/* number of concurrently running reencryption jobs */
+static uint32_t reencrypt_jobs = 1;
+
+/*
+ * Reencryption context of a multi-device job is loaded in the forked child,
+ * library worker threads and io_uring rings cannot be inherited over fork().
+ * The parent only initializes metadata and verifies the passphrase.
+ */
+struct reencrypt_deferred {
+	char *active_name;
+	char *password;
+	size_t password_len;
+	int keyslot_old;
+	int keyslot_new;
+};
+
+static struct reencrypt_deferred *reencrypt_deferred = NULL;
+
+static uint64_t reencrypt_hotzone_size(void)
+{
+	uint64_t size = ARG_UINT64(OPT_HOTZONE_SIZE_ID);
+
+	/* hotzone size limit is shared by all concurrently running jobs */
+	if (size && reencrypt_jobs > 1) {
+		size /= reencrypt_jobs;
+		size -= size % MAX_SECTOR_SIZE;
+		if (!size)
+			size = MAX_SECTOR_SIZE;
+	}
+
+	return size / SECTOR_SIZE;
+}
+
 static void _set_reencryption_flags(uint32_t *flags)
 {
 	if (ARG_SET(OPT_INIT_ONLY_ID))
@@ -48,6 +87,44 @@ static void _set_reencryption_flags(uint32_t *flags)
 		*flags |= CRYPT_REENCRYPT_RESUME_ONLY;
 }
 
+static int reencrypt_init_by_passphrase(struct crypt_device *cd,
+	const char *active_name, const char *password, size_t password_len,
+	int keyslot_old, int keyslot_new, const char *cipher, const char *cipher_mode,
+	const struct crypt_params_reencrypt *params)
+{
+	struct reencrypt_deferred *d = reencrypt_deferred;
+	struct crypt_params_reencrypt init_params;
+	int r;
+
+	if (!d || (params->flags & CRYPT_REENCRYPT_INITIALIZE_ONLY))
+		return crypt_reencrypt_init_by_passphrase(cd, active_name, password,
+				password_len, keyslot_old, keyslot_new, cipher, cipher_mode, params);
+
+	if (params->flags & CRYPT_REENCRYPT_RESUME_ONLY)
+		r = crypt_activate_by_passphrase(cd, NULL, keyslot_old, password, password_len, 0);
+	else {
+		init_params = *params;
+		init_params.flags |= CRYPT_REENCRYPT_INITIALIZE_ONLY;
+		r = crypt_reencrypt_init_by_passphrase(cd, NULL, password, password_len,
+				keyslot_old, keyslot_new, cipher, cipher_mode, &init_params);
+	}
+	if (r < 0)
+		return r;
+
+	d->password = crypt_safe_alloc(password_len + 1);
+	if (!d->password)
+		return -ENOMEM;
+	memcpy(d->password, password, password_len);
+	d->password_len = password_len;
+	d->keyslot_old = keyslot_old;
+	d->keyslot_new = keyslot_new;
+
+	if (active_name && !(d->active_name = strdup(active_name)))
+		return -ENOMEM;
+
+	return 0;
+}
+
 static int reencrypt_check_passphrase(struct crypt_device *cd,
 	int keyslot,
 	const char *passphrase,
@@ -254,7 +331,7 @@ static int reencrypt_verify_and_update_params(struct crypt_params_reencrypt *par
 	} else
 		params->resilience = NULL;
 
-	params->max_hotzone_size = ARG_UINT64(OPT_HOTZONE_SIZE_ID) / SECTOR_SIZE;
+	params->max_hotzone_size = reencrypt_hotzone_size();
 	params->device_size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE;
 	params->flags = CRYPT_REENCRYPT_RESUME_ONLY;
 
@@ -327,7 +404,7 @@ static int reencrypt_luks2_load(struct crypt_device *cd, const char *data_device
 	if (!ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID))
 		r = reencrypt_get_active_name(cd, data_device, &active_name);
 	if (r >= 0)
-		r = crypt_reencrypt_init_by_passphrase(cd, active_name, password,
+		r = reencrypt_init_by_passphrase(cd, active_name, password,
 				passwordLen, ARG_INT32(OPT_KEY_SLOT_ID),
 				ARG_INT32(OPT_KEY_SLOT_ID), NULL, NULL, &params);
 out:
@@ -502,7 +579,7 @@ static int encrypt_luks2_init(struct crypt_device **cd, const char *data_device,
 		.direction = data_shift < 0 ? CRYPT_REENCRYPT_BACKWARD : CRYPT_REENCRYPT_FORWARD,
 		.resilience = ARG_STR(OPT_RESILIENCE_ID) ?: "checksum",
 		.hash = ARG_STR(OPT_RESILIENCE_HASH_ID) ?: "sha256",
-		.max_hotzone_size = ARG_UINT64(OPT_HOTZONE_SIZE_ID) / SECTOR_SIZE,
+		.max_hotzone_size = reencrypt_hotzone_size(),
 		.device_size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE,
 		.luks2 = &luks2_params,
 		.flags = CRYPT_REENCRYPT_INITIALIZE_ONLY
@@ -736,7 +813,7 @@ static int decrypt_luks2_datashift_init(struct crypt_device **cd,
 		.hash = ARG_STR(OPT_RESILIENCE_HASH_ID) ?: "sha256",
 		.data_shift = crypt_get_data_offset(*cd),
 		.device_size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE,
-		.max_hotzone_size = ARG_UINT64(OPT_HOTZONE_SIZE_ID) / SECTOR_SIZE,
+		.max_hotzone_size = reencrypt_hotzone_size(),
 		.flags = CRYPT_REENCRYPT_MOVE_FIRST_SEGMENT
 	};
 
@@ -862,7 +939,7 @@ static int decrypt_luks2_init(struct crypt_device *cd, const char *data_device)
 		.hash = ARG_STR(OPT_RESILIENCE_HASH_ID) ?: "sha256",
 		.data_shift = imaxabs(data_shift) / SECTOR_SIZE,
 		.device_size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE,
-		.max_hotzone_size = ARG_UINT64(OPT_HOTZONE_SIZE_ID) / SECTOR_SIZE,
+		.max_hotzone_size = reencrypt_hotzone_size(),
 	};
 
 	if (!luks2_reencrypt_eligible(cd))
@@ -1094,7 +1171,7 @@ static int reencrypt_luks2_init(struct crypt_device *cd, const char *data_device
 		.resilience = data_shift ? "datashift" : (ARG_STR(OPT_RESILIENCE_ID) ?: "checksum"),
 		.hash = ARG_STR(OPT_RESILIENCE_HASH_ID) ?: "sha256",
 		.data_shift = imaxabs(data_shift) / SECTOR_SIZE,
-		.max_hotzone_size = ARG_UINT64(OPT_HOTZONE_SIZE_ID) / SECTOR_SIZE,
+		.max_hotzone_size = reencrypt_hotzone_size(),
 		.device_size = ARG_UINT64(OPT_DEVICE_SIZE_ID) / SECTOR_SIZE,
 		.luks2 = &luks2_params,
 	};
@@ -1276,7 +1353,7 @@ static int reencrypt_luks2_init(struct crypt_device *cd, const char *data_device
 			goto out;
 	}
 
-	r = crypt_reencrypt_init_by_passphrase(cd,
+	r = reencrypt_init_by_passphrase(cd,
 			ARG_SET(OPT_INIT_ONLY_ID) ? NULL : active_name,
 			kp[keyslot_old].password, kp[keyslot_old].passwordLen,
 			keyslot_old, kp[keyslot_old].new, cipher, mode, &params);
@@ -1296,6 +1373,62 @@ out:
 	return r;
 }
 
+/*
+ * Used areas file contains lines with offset and length in bytes
+ * (relative to data segment start), empty lines and '#' comments are ignored.
+ */
+static int reencrypt_set_used_ranges(struct crypt_device *cd)
+{
+	struct crypt_reencrypt_range empty = {}, *ranges = NULL, *tmp;
+	size_t count = 0, alloc = 0, len = 0;
+	uint64_t offset, length;
+	unsigned int line_nr = 0;
+	char *line = NULL, *p;
+	FILE *f;
+	int r = 0;
+
+	if (!ARG_SET(OPT_USED_RANGES_ID))
+		return 0;
+
+	f = fopen(ARG_STR(OPT_USED_RANGES_ID), "r");
+	if (!f) {
+		log_err(_("Cannot open used areas file %s."), ARG_STR(OPT_USED_RANGES_ID));
+		return -EINVAL;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		line_nr++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+
+		if (sscanf(p, "%" SCNu64 " %" SCNu64, &offset, &length) != 2) {
+			log_err(_("Invalid used area on line %u of %s."), line_nr, ARG_STR(OPT_USED_RANGES_ID));
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(ranges, alloc * sizeof(*ranges));
+			if (!tmp) {
+				r = -ENOMEM;
+				goto out;
+			}
+			ranges = tmp;
+		}
+		ranges[count].offset = offset;
+		ranges[count++].length = length;
+	}
+
+	r = crypt_reencrypt_set_used_ranges(cd, ranges ?: &empty, count);
+out:
+	free(line);
+	free(ranges);
+	fclose(f);
+	return r;
+}
+
 static int reencrypt_luks2_resume(struct crypt_device *cd)
 {
 	int r;
@@ -1305,12 +1438,19 @@ static int reencrypt_luks2_resume(struct crypt_device *cd)
 		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
 		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
 		.interrupt_message = _("\nReencryption interrupted."),
-		.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file)
+		.device = tools_get_device_name(crypt_get_device_name(cd), &backing_file),
+		.cd = cd
 	};
 
 	if (ARG_SET(OPT_FORCE_OFFLINE_REENCRYPT_ID) && !ARG_SET(OPT_BATCH_MODE_ID))
 		log_std(_("Resuming LUKS reencryption in forced offline mode.\n"));
 
+	r = reencrypt_set_used_ranges(cd);
+	if (r < 0) {
+		free(backing_file);
+		return r;
+	}
+
 	set_int_handler(0);
 	r = crypt_reencrypt_run(cd, tools_progress, &prog_parms);
 	free(backing_file);
@@ -1322,7 +1462,8 @@ static int check_broken_luks_signature(const char *device)
 	int r;
 	size_t count;
 
-	r = tools_detect_signatures(device, PRB_ONLY_LUKS, &count, ARG_SET(OPT_BATCH_MODE_ID));
+	r = tools_detect_signatures(device, PRB_ONLY_LUKS, &count, ARG_SET(OPT_BATCH_MODE_ID),
+				    TOOLS_PROBE_AREA_SIZE);
 	if (r < 0)
 		return -EINVAL;
 	if (count) {
@@ -1490,6 +1631,364 @@ static int _reencrypt(struct crypt_device *cd, enum device_status_info dev_st, c
 	return reencrypt_luks2_resume(cd);
 }
 
+/*
+ * Multi-device reencryption.
+ *
+ * All devices are loaded, passphrases are verified and reencryption metadata
+ * are initialized serially, so passphrase queries do not interleave. Then the
+ * reencryption context of every device is loaded and run in a forked child
+ * process (no library threads are started before fork), at most
+ * --reencrypt-jobs children at a time. Child processes report progress over
+ * a pipe and the parent prints the aggregate progress of all devices.
+ */
+struct reencrypt_job {
+	const char *device;
+	char *controller;
+	struct crypt_device *cd;
+	struct reencrypt_deferred load;
+	pid_t pid;
+	uint64_t size;
+	uint64_t offset;
+	int r;
+	bool started;
+	bool done;
+};
+
+struct reencrypt_job_msg {
+	uint32_t index;
+	uint64_t size;
+	uint64_t offset;
+};
+
+struct reencrypt_job_progress {
+	int fd;
+	uint32_t index;
+};
+
+static int reencrypt_job_progress(uint64_t size, uint64_t offset, void *usrptr)
+{
+	int r = 0;
+	struct reencrypt_job_progress *p = usrptr;
+	struct reencrypt_job_msg msg = {
+		.index = p->index,
+		.size = size,
+		.offset = offset
+	};
+
+	/* message is smaller than PIPE_BUF, write is atomic */
+	if (write(p->fd, &msg, sizeof(msg)) != (ssize_t)sizeof(msg))
+		log_dbg("Failed to report reencryption progress.");
+
+	check_signal(&r);
+	return r;
+}
+
+/*
+ * Devices on the same controller share its bandwidth. The controller
+ * is approximated by the deepest PCI function in the sysfs device path,
+ * virtual devices (loop, dm) are all grouped together.
+ */
+static char *reencrypt_device_controller(const char *device)
+{
+	char path[PATH_MAX], *sysfs, *p, *end = NULL;
+	unsigned int domain, bus, slot, fn;
+	struct stat st;
+
+	if (stat(device, &st) < 0 || !S_ISBLK(st.st_mode))
+		return strdup(device);
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		     major(st.st_rdev), minor(st.st_rdev)) < 0)
+		return strdup(device);
+
+	sysfs = realpath(path, NULL);
+	if (!sysfs)
+		return strdup(device);
+
+	for (p = strchr(sysfs, '/'); p; p = strchr(p + 1, '/'))
+		if (sscanf(p + 1, "%x:%x:%x.%x", &domain, &bus, &slot, &fn) == 4)
+			end = p + 1 + strcspn(p + 1, "/");
+
+	if (!end)
+		end = strstr(sysfs, "/block/");
+	if (end)
+		*end = '\0';
+
+	log_dbg("Device %s controller %s.", device, sysfs);
+	return sysfs;
+}
+
+static int reencrypt_job_prepare(struct reencrypt_job *job)
+{
+	enum device_status_info dev_st;
+	int r;
+
+	dev_st = load_luks(&job->cd, NULL, uuid_or_device(job->device));
+	if (dev_st == DEVICE_INVALID)
+		return -EINVAL;
+
+	if (!ARG_SET(OPT_INIT_ONLY_ID))
+		reencrypt_deferred = &job->load;
+
+	if (dev_st == DEVICE_LUKS2_REENCRYPT) {
+		if (ARG_SET(OPT_INIT_ONLY_ID)) {
+			log_err(_("LUKS2 reencryption already initialized. Aborting operation."));
+			r = -EINVAL;
+		} else
+			r = reencrypt_luks2_load(job->cd, job->device);
+	} else if (dev_st == DEVICE_LUKS2) {
+		if (ARG_SET(OPT_RESUME_ONLY_ID)) {
+			log_err(_("Device reencryption not in progress."));
+			r = -EINVAL;
+		} else
+			r = reencrypt_luks2_init(job->cd, job->device);
+	} else {
+		log_err(_("Device %s is not a valid LUKS2 device."), uuid_or_device(job->device));
+		r = -EINVAL;
+	}
+
+	reencrypt_deferred = NULL;
+	if (r < 0)
+		return r;
+
+	job->controller = reencrypt_device_controller(crypt_get_device_name(job->cd));
+	return job->controller ? 0 : -ENOMEM;
+}
+
+/* Prefer pending device with the least running jobs on the same controller. */
+static struct reencrypt_job *reencrypt_job_next(struct reencrypt_job *jobs, size_t count)
+{
+	struct reencrypt_job *next = NULL;
+	size_t i, j, busy, next_busy = SIZE_MAX;
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].started || jobs[i].done)
+			continue;
+
+		for (busy = 0, j = 0; j < count; j++)
+			if (jobs[j].started && !jobs[j].done &&
+			    !strcmp(jobs[j].controller, jobs[i].controller))
+				busy++;
+
+		if (busy < next_busy) {
+			next = &jobs[i];
+			next_busy = busy;
+		}
+	}
+
+	return next;
+}
+
+/* Runs in the child process, reencryption metadata are already initialized */
+static int reencrypt_job_load(struct reencrypt_job *job)
+{
+	struct crypt_params_reencrypt params = {};
+	char *hash = NULL;
+	int r;
+
+	if (crypt_reencrypt_status(job->cd, &params) != CRYPT_REENCRYPT_CLEAN)
+		return -EINVAL;
+
+	r = reencrypt_verify_and_update_params(&params, &hash);
+	if (!r)
+		r = crypt_reencrypt_init_by_passphrase(job->cd, job->load.active_name,
+				job->load.password, job->load.password_len,
+				job->load.keyslot_old, job->load.keyslot_new,
+				NULL, NULL, &params);
+	free(hash);
+	return r;
+}
+
+static int reencrypt_job_start(struct reencrypt_job *jobs, struct reencrypt_job *job, int fd)
+{
+	int r;
+	struct reencrypt_job_progress prog = {
+		.fd = fd,
+		.index = job - jobs
+	};
+
+	log_dbg("Starting reencryption of device %s.", job->device);
+	fflush(stdout);
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		log_err(_("Cannot fork reencryption job for device %s."), job->device);
+		return -EINVAL;
+	}
+
+	if (job->pid) {
+		job->started = true;
+		return 0;
+	}
+
+	r = reencrypt_job_load(job);
+	crypt_safe_free(job->load.password);
+	job->load.password = NULL;
+	if (r >= 0)
+		r = crypt_reencrypt_run(job->cd, reencrypt_job_progress, &prog);
+	if (r < 0)
+		log_err(_("Reencryption of device %s failed."), job->device);
+	crypt_free(job->cd);
+	fflush(stdout);
+	_exit(r < 0 ? -r : 0);
+}
+
+static void reencrypt_job_reap(struct reencrypt_job *jobs, size_t count)
+{
+	int status;
+	pid_t pid;
+	size_t i;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < count; i++) {
+			if (jobs[i].pid != pid)
+				continue;
+			jobs[i].done = true;
+			if (WIFEXITED(status))
+				jobs[i].r = -WEXITSTATUS(status);
+			else
+				jobs[i].r = -EINTR;
+			log_dbg("Reencryption of device %s finished (%d).", jobs[i].device, jobs[i].r);
+		}
+	}
+}
+
+static void reencrypt_jobs_progress(struct reencrypt_job *jobs, size_t count,
+				    struct tools_progress_params *parms)
+{
+	size_t i;
+	bool all_done = true;
+	uint64_t size = 0, offset = 0;
+
+	for (i = 0; i < count; i++) {
+		size += jobs[i].size;
+		offset += jobs[i].offset;
+		if (!jobs[i].done)
+			all_done = false;
+	}
+
+	/* do not report final progress until all devices are finished */
+	if (!size || (!all_done && offset >= size))
+		return;
+
+	if (tools_progress(size, offset, parms))
+		parms->interrupt_message = NULL;
+}
+
+static int reencrypt_multi(int action_argc, const char **action_argv)
+{
+	struct reencrypt_job *jobs, *job;
+	struct reencrypt_job_msg msg;
+	struct tools_progress_params prog_parms = {
+		.frequency = ARG_UINT32(OPT_PROGRESS_FREQUENCY_ID),
+		.batch_mode = ARG_SET(OPT_BATCH_MODE_ID),
+		.json_output = ARG_SET(OPT_PROGRESS_JSON_ID),
+		.interrupt_message = _("\nReencryption interrupted."),
+		.device = "all",
+	};
+	struct pollfd pfd = { .events = POLLIN };
+	size_t i, count = action_argc, running;
+	bool stop = false, signalled = false;
+	long cpus;
+	int r = 0, fds[2] = { -1, -1 };
+
+	jobs = calloc(count, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	reencrypt_jobs = ARG_UINT32(OPT_REENCRYPT_JOBS_ID);
+	if (!reencrypt_jobs) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		reencrypt_jobs = cpus > 0 ? (uint32_t)cpus : 1;
+	}
+	if (reencrypt_jobs > count)
+		reencrypt_jobs = count;
+	log_dbg("Reencrypting %zu devices, %u concurrent jobs.", count, reencrypt_jobs);
+
+	for (i = 0; i < count && r >= 0; i++) {
+		jobs[i].device = action_argv[i];
+		r = reencrypt_job_prepare(&jobs[i]);
+	}
+
+	if (r < 0 || ARG_SET(OPT_INIT_ONLY_ID))
+		goto out;
+
+	if (pipe(fds) < 0) {
+		r = -errno;
+		goto out;
+	}
+	pfd.fd = fds[0];
+
+	set_int_handler(0);
+
+	do {
+		for (running = 0, i = 0; i < count; i++)
+			if (jobs[i].started && !jobs[i].done)
+				running++;
+
+		while (!quit && !stop && running < reencrypt_jobs &&
+		       (job = reencrypt_job_next(jobs, count))) {
+			if (reencrypt_job_start(jobs, job, fds[1]) < 0) {
+				job->done = true;
+				job->r = -EINVAL;
+				stop = true;
+				break;
+			}
+			running++;
+		}
+
+		/* forward interrupt to all running jobs, they stop after current hotzone */
+		if ((quit || stop) && !signalled) {
+			for (i = 0; i < count; i++)
+				if (jobs[i].started && !jobs[i].done)
+					kill(jobs[i].pid, SIGTERM);
+			signalled = true;
+		}
+
+		if (!running)
+			break;
+
+		if (poll(&pfd, 1, 500) > 0 && (pfd.revents & POLLIN)) {
+			while (read(fds[0], &msg, sizeof(msg)) == (ssize_t)sizeof(msg)) {
+				if (msg.index < count) {
+					jobs[msg.index].size = msg.size;
+					jobs[msg.index].offset = msg.offset;
+				}
+				pfd.revents = 0;
+				if (poll(&pfd, 1, 0) <= 0)
+					break;
+			}
+			reencrypt_jobs_progress(jobs, count, &prog_parms);
+		}
+
+		reencrypt_job_reap(jobs, count);
+	} while (true);
+
+	reencrypt_jobs_progress(jobs, count, &prog_parms);
+
+	for (i = 0; i < count; i++) {
+		if (!jobs[i].started) {
+			log_std(_("Reencryption of device %s not started.\n"), jobs[i].device);
+			if (!r)
+				r = -EINTR;
+		} else if (jobs[i].r < 0 && !r)
+			r = jobs[i].r;
+	}
+out:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	for (i = 0; i < count; i++) {
+		crypt_free(jobs[i].cd);
+		free(jobs[i].controller);
+		crypt_safe_free(jobs[i].load.password);
+		free(jobs[i].load.active_name);
+	}
+	free(jobs);
+	return r;
+}
+
 int reencrypt(int action_argc, const char **action_argv)
 {
 	enum device_status_info dev_st;
@@ -1502,6 +2001,9 @@ int reencrypt(int action_argc, const char **action_argv)
 		return r;
 	}
 
+	if (action_argc > 1 && !ARG_SET(OPT_ENCRYPT_ID))
+		return reencrypt_multi(action_argc, action_argv);
+
 	if (ARG_SET(OPT_ACTIVE_NAME_ID))
 		dev_st = load_luks2_by_name(&cd, ARG_STR(OPT_ACTIVE_NAME_ID), ARG_STR(OPT_HEADER_ID));
 	else
@@ -72,14 +72,52 @@ static int _prepare_format(struct crypt_params_verity *params,
 	return 0;
 }
 
+/* Create or overwrite the root hash file */
+static int _write_root_hash_file(struct crypt_device *cd, const char *path)
+{
+	char *root_hash_bytes = NULL;
+	size_t root_hash_size;
+	int root_hash_fd = -1, i, r;
+
+	root_hash_size = crypt_get_volume_key_size(cd);
+	root_hash_bytes = malloc(root_hash_size);
+	if (!root_hash_bytes)
+		return -ENOMEM;
+
+	r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, root_hash_bytes, &root_hash_size, NULL, 0);
+	if (r < 0)
+		goto out;
+
+	root_hash_fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+	if (root_hash_fd == -1) {
+		log_err(_("Cannot create root hash file %s for writing."), path);
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < (int)root_hash_size; i++)
+		if (dprintf(root_hash_fd, "%02hhx", root_hash_bytes[i]) != 2) {
+			log_err(_("Cannot write to root hash file %s."), path);
+			r = -EIO;
+			goto out;
+		}
+
+	log_dbg("Created root hash file %s.", path);
+	r = 0;
+out:
+	free(root_hash_bytes);
+	if (root_hash_fd != -1)
+		close(root_hash_fd);
+	return r;
+}
+
 static int action_format(void)
 {
 	struct crypt_device *cd = NULL;
 	struct crypt_params_verity params = {};
 	uint32_t flags = CRYPT_VERITY_CREATE_HASH;
-	char *root_hash_bytes = NULL;
-	size_t root_hash_size;
-	int root_hash_fd = -1, i, r;
+	const char *data_device = action_argv[0];
+	int r;
 
 	/* Try to create hash image if doesn't exist */
 	r = open(action_argv[1], O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
@@ -90,6 +128,19 @@ static int action_format(void)
 		log_dbg("Created hash image %s.", action_argv[1]);
 		close(r);
 	}
+	/* Try to create data image for data stream if doesn't exist, "-" only hashes stream */
+	if (ARG_SET(OPT_DATA_STREAM_ID)) {
+		if (!strcmp(action_argv[0], "-"))
+			data_device = NULL;
+		else if ((r = open(action_argv[0], O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR)) < 0 &&
+			 errno != EEXIST) {
+			log_err(_("Cannot create data image %s for writing."), action_argv[0]);
+			return -EINVAL;
+		} else if (r >= 0) {
+			log_dbg("Created data image %s.", action_argv[0]);
+			close(r);
+		}
+	}
 	/* Try to create FEC image if doesn't exist */
 	if (ARG_SET(OPT_FEC_DEVICE_ID)) {
 		r = open(ARG_STR(OPT_FEC_DEVICE_ID), O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
@@ -105,66 +156,116 @@ static int action_format(void)
 	if ((r = crypt_init(&cd, action_argv[1])))
 		goto out;
 
+	if (ARG_SET(OPT_THREADS_ID) &&
+	    (r = crypt_set_threads(cd, ARG_UINT32(OPT_THREADS_ID))))
+		goto out;
+
 	if (ARG_SET(OPT_NO_SUPERBLOCK_ID))
 		flags |= CRYPT_VERITY_NO_HEADER;
 
-	r = _prepare_format(&params, action_argv[0], flags);
+	if (ARG_SET(OPT_HASH_STAGING_ID) || ARG_SET(OPT_HASH_STAGING_DEVICE_ID)) {
+		flags |= CRYPT_VERITY_CREATE_STAGED;
+		if ((r = crypt_set_verity_stage(cd, ARG_STR(OPT_HASH_STAGING_DEVICE_ID), 0)))
+			goto out;
+	}
+
+	r = _prepare_format(&params, data_device, flags);
 	if (r < 0)
 		goto out;
 
-	r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, ARG_STR(OPT_UUID_ID), NULL, 0, &params);
+	if (ARG_SET(OPT_DATA_STREAM_ID))
+		r = crypt_format_verity_stream(cd, ARG_STR(OPT_UUID_ID), &params, STDIN_FILENO);
+	else
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, ARG_STR(OPT_UUID_ID), NULL, 0, &params);
 	if (r < 0)
 		goto out;
 
 	crypt_dump(cd);
 
-	/* Create or overwrite the root hash file */
-	if (ARG_SET(OPT_ROOT_HASH_FILE_ID)) {
-		root_hash_size = crypt_get_volume_key_size(cd);
-		root_hash_bytes = malloc(root_hash_size);
-		if (!root_hash_bytes) {
-			r = -ENOMEM;
-			goto out;
-		}
+	if (ARG_SET(OPT_ROOT_HASH_FILE_ID))
+		r = _write_root_hash_file(cd, ARG_STR(OPT_ROOT_HASH_FILE_ID));
+out:
+	crypt_free(cd);
+	free(CONST_CAST(char*)params.salt);
+	return r;
+}
 
-		r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, root_hash_bytes, &root_hash_size, NULL, 0);
-		if (r < 0)
-			goto out;
+/*
+ * Prefetch cluster is dm-verity module parameter, so it is shared
+ * by all active verity devices. Value 0 disables prefetch.
+ */
+#define DM_VERITY_PREFETCH_CLUSTER "/sys/module/dm_verity/parameters/prefetch_cluster"
 
-		root_hash_fd = open(ARG_STR(OPT_ROOT_HASH_FILE_ID), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
-		if (root_hash_fd == -1) {
-			log_err(_("Cannot create root hash file %s for writing."), ARG_STR(OPT_ROOT_HASH_FILE_ID));
-			r = -EINVAL;
-			goto out;
-		}
+static int _set_prefetch_cluster(uint32_t bytes)
+{
+	char buf[16];
+	int fd, len, r = 0;
 
-		for (i = 0; i < (int)root_hash_size; i++)
-			if (dprintf(root_hash_fd, "%02hhx", root_hash_bytes[i]) != 2) {
-				log_err(_("Cannot write to root hash file %s."), ARG_STR(OPT_ROOT_HASH_FILE_ID));
-				r = -EIO;
-				goto out;
-			}
+	len = snprintf(buf, sizeof(buf), "%" PRIu32, bytes);
+	if (len < 0 || (size_t)len >= sizeof(buf))
+		return -EINVAL;
 
-		log_dbg("Created root hash file %s.", ARG_STR(OPT_ROOT_HASH_FILE_ID));
+	fd = open(DM_VERITY_PREFETCH_CLUSTER, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write_buffer(fd, buf, len) != len) {
+		log_err(_("Cannot set dm-verity prefetch cluster size."));
+		r = -EINVAL;
 	}
-out:
-	crypt_free(cd);
-	free(CONST_CAST(char*)params.salt);
-	free(root_hash_bytes);
-	if (root_hash_fd != -1)
-		close(root_hash_fd);
+
+	if (fd >= 0)
+		close(fd);
 	return r;
 }
 
+static int _get_prefetch_cluster(uint32_t *bytes)
+{
+	char buf[16];
+	ssize_t len;
+	int fd;
+
+	fd = open(DM_VERITY_PREFETCH_CLUSTER, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -ENOENT;
+
+	len = read_buffer(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -EINVAL;
+	buf[len] = '\0';
+
+	return sscanf(buf, "%" SCNu32, bytes) == 1 ? 0 : -EINVAL;
+}
+
+static uint32_t _activation_flags(void)
+{
+	uint32_t activate_flags = CRYPT_ACTIVATE_READONLY;
+
+	if (ARG_SET(OPT_IGNORE_CORRUPTION_ID))
+		activate_flags |= CRYPT_ACTIVATE_IGNORE_CORRUPTION;
+	if (ARG_SET(OPT_RESTART_ON_CORRUPTION_ID))
+		activate_flags |= CRYPT_ACTIVATE_RESTART_ON_CORRUPTION;
+	if (ARG_SET(OPT_PANIC_ON_CORRUPTION_ID))
+		activate_flags |= CRYPT_ACTIVATE_PANIC_ON_CORRUPTION;
+	if (ARG_SET(OPT_IGNORE_ZERO_BLOCKS_ID))
+		activate_flags |= CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS;
+	if (ARG_SET(OPT_CHECK_AT_MOST_ONCE_ID))
+		activate_flags |= CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE;
+	if (ARG_SET(OPT_USE_TASKLETS_ID))
+		activate_flags |= CRYPT_ACTIVATE_TASKLETS;
+
+	return activate_flags;
+}
+
 static int _activate(const char *dm_device,
 		      const char *data_device,
 		      const char *hash_device,
 		      const char *root_hash,
-		      uint32_t flags)
+		      uint32_t flags,
+		      bool repair)
 {
 	struct crypt_device *cd = NULL;
 	struct crypt_params_verity params = {};
-	uint32_t activate_flags = CRYPT_ACTIVATE_READONLY;
+	uint32_t activate_flags = _activation_flags();
+	uint64_t repaired = 0, verified = 0;
 	char *root_hash_bytes = NULL, *root_hash_from_file = NULL;
 	ssize_t hash_size, hash_size_hex;
 	struct stat st;
@@ -174,18 +275,9 @@ static int _activate(const char *dm_device,
 	if ((r = crypt_init_data_device(&cd, hash_device, data_device)))
 		goto out;
 
-	if (ARG_SET(OPT_IGNORE_CORRUPTION_ID))
-		activate_flags |= CRYPT_ACTIVATE_IGNORE_CORRUPTION;
-	if (ARG_SET(OPT_RESTART_ON_CORRUPTION_ID))
-		activate_flags |= CRYPT_ACTIVATE_RESTART_ON_CORRUPTION;
-	if (ARG_SET(OPT_PANIC_ON_CORRUPTION_ID))
-		activate_flags |= CRYPT_ACTIVATE_PANIC_ON_CORRUPTION;
-	if (ARG_SET(OPT_IGNORE_ZERO_BLOCKS_ID))
-		activate_flags |= CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS;
-	if (ARG_SET(OPT_CHECK_AT_MOST_ONCE_ID))
-		activate_flags |= CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE;
-	if (ARG_SET(OPT_USE_TASKLETS_ID))
-		activate_flags |= CRYPT_ACTIVATE_TASKLETS;
+	if (ARG_SET(OPT_THREADS_ID) &&
+	    (r = crypt_set_threads(cd, ARG_UINT32(OPT_THREADS_ID))))
+		goto out;
 
 	if (!ARG_SET(OPT_NO_SUPERBLOCK_ID)) {
 		params.flags = flags;
@@ -243,6 +335,21 @@ static int _activate(const char *dm_device,
 		goto out;
 	}
 
+	if (repair) {
+		r = crypt_verity_repair(cd, root_hash_bytes, hash_size, &repaired);
+		if (repaired)
+			log_std(_("Repaired %" PRIu64 " blocks.\n"), repaired);
+		goto out;
+	}
+
+	if (ARG_SET(OPT_SAMPLE_ID)) {
+		r = crypt_verity_verify_sample(cd, root_hash_bytes, hash_size, ARG_UINT32(OPT_SAMPLE_ID),
+					       ARG_UINT64(OPT_SAMPLE_SEED_ID), &verified);
+		if (!r)
+			log_verbose(_("Verified %" PRIu64 " sampled data blocks."), verified);
+		goto out;
+	}
+
 	if (ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID)) {
 		// FIXME: check max file size
 		if (stat(ARG_STR(OPT_ROOT_HASH_SIGNATURE_ID), &st) || !S_ISREG(st.st_mode) || !st.st_size) {
@@ -262,6 +369,13 @@ static int _activate(const char *dm_device,
 					 hash_size,
 					 signature, signature_size,
 					 activate_flags);
+
+	/* dm-verity module is loaded now, set its parameter */
+	if (!r && dm_device && ARG_SET(OPT_PREFETCH_CLUSTER_ID)) {
+		r = _set_prefetch_cluster(ARG_UINT32(OPT_PREFETCH_CLUSTER_ID));
+		if (r < 0)
+			crypt_deactivate(cd, dm_device);
+	}
 out:
 	crypt_safe_free(signature);
 	crypt_free(cd);
@@ -273,8 +387,221 @@ out:
 	return r;
 }
 
+/* One line of --batch-file manifest: <name> <data_device> <hash_device> <root_hash> [<signature>] */
+struct open_batch_entry {
+	char *name;
+	char *data_device;
+	char *hash_device;
+	char *root_hash;
+	char *signature_file;
+	char *root_hash_bytes;
+	char *signature;
+	int signature_size;
+};
+
+static void open_batch_free(struct open_batch_entry *entries, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		free(entries[i].name);
+		free(entries[i].data_device);
+		free(entries[i].hash_device);
+		free(entries[i].root_hash);
+		free(entries[i].signature_file);
+		free(entries[i].root_hash_bytes);
+		crypt_safe_free(entries[i].signature);
+	}
+	free(entries);
+}
+
+static int open_batch_read(const char *path, struct open_batch_entry **ret, size_t *ret_count)
+{
+	struct open_batch_entry *entries = NULL, *tmp, *e;
+	size_t count = 0, alloc = 0, len = 0;
+	unsigned int line_nr = 0;
+	char *line = NULL, *p, *name, *data_device, *hash_device, *root_hash, *signature, *save;
+	FILE *f;
+	int r = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		log_err(_("Cannot open batch file %s."), path);
+		return -EINVAL;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		line_nr++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+
+		save = NULL;
+		name = strtok_r(p, " \t\n", &save);
+		data_device = strtok_r(NULL, " \t\n", &save);
+		hash_device = strtok_r(NULL, " \t\n", &save);
+		root_hash = strtok_r(NULL, " \t\n", &save);
+		signature = strtok_r(NULL, " \t\n", &save);
+
+		if (!root_hash || strtok_r(NULL, " \t\n", &save)) {
+			log_err(_("Invalid entry on line %u of %s."), line_nr, path);
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (!tmp) {
+				r = -ENOMEM;
+				goto out;
+			}
+			entries = tmp;
+		}
+
+		e = &entries[count++];
+		memset(e, 0, sizeof(*e));
+		e->name = strdup(name);
+		e->data_device = strdup(data_device);
+		e->hash_device = strdup(hash_device);
+		e->root_hash = strdup(root_hash);
+		if (signature && strcmp(signature, "-"))
+			e->signature_file = strdup(signature);
+		if (!e->name || !e->data_device || !e->hash_device || !e->root_hash ||
+		    (signature && strcmp(signature, "-") && !e->signature_file)) {
+			r = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if (!count) {
+		log_err(_("No devices to open in batch file %s."), path);
+		r = -EINVAL;
+	}
+out:
+	free(line);
+	fclose(f);
+
+	if (r < 0)
+		open_batch_free(entries, count);
+	else {
+		*ret = entries;
+		*ret_count = count;
+	}
+
+	return r;
+}
+
+static int open_batch_prepare(struct crypt_device *cd, struct open_batch_entry *e)
+{
+	struct stat st;
+	int r;
+
+	if (crypt_hex_to_bytes(e->root_hash, &e->root_hash_bytes, 0) != crypt_get_volume_key_size(cd)) {
+		log_err(_("Invalid root hash string specified."));
+		return -EINVAL;
+	}
+
+	if (!e->signature_file)
+		return 0;
+
+	if (stat(e->signature_file, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		log_err(_("Invalid signature file %s."), e->signature_file);
+		return -EINVAL;
+	}
+	e->signature_size = st.st_size;
+	r = tools_read_vk(e->signature_file, &e->signature, e->signature_size);
+	if (r < 0)
+		log_err(_("Cannot read signature file %s."), e->signature_file);
+
+	return r;
+}
+
+/*
+ * Bulk open of verity devices. Superblocks are loaded in parallel, the same
+ * signature is uploaded to keyring only once and udev is synchronized once
+ * for all devices.
+ */
+static int action_open_batch(void)
+{
+	struct crypt_params_verity params = {
+		.hash_area_offset = ARG_UINT64(OPT_HASH_OFFSET_ID),
+	};
+	struct open_batch_entry *entries = NULL;
+	struct crypt_verity_load *loads = NULL;
+	struct crypt_verity_activation *activations = NULL;
+	uint32_t activate_flags = _activation_flags();
+	size_t i, count = 0;
+	int r;
+
+	r = open_batch_read(ARG_STR(OPT_BATCH_FILE_ID), &entries, &count);
+	if (r < 0)
+		return r;
+
+	loads = calloc(count, sizeof(*loads));
+	activations = calloc(count, sizeof(*activations));
+	if (!loads || !activations) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		r = crypt_init_data_device(&loads[i].cd, entries[i].hash_device, entries[i].data_device);
+		if (r < 0)
+			goto out;
+		loads[i].params = &params;
+	}
+
+	r = crypt_load_verity_batch(loads, count);
+	for (i = 0; i < count; i++)
+		if (loads[i].result < 0)
+			log_err(_("Device %s is not a valid VERITY device."), entries[i].hash_device);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		r = open_batch_prepare(loads[i].cd, &entries[i]);
+		if (r < 0)
+			goto out;
+
+		activations[i] = (struct crypt_verity_activation) {
+			.cd = loads[i].cd,
+			.name = entries[i].name,
+			.root_hash = entries[i].root_hash_bytes,
+			.root_hash_size = crypt_get_volume_key_size(loads[i].cd),
+			.signature = entries[i].signature,
+			.signature_size = entries[i].signature_size,
+			.flags = activate_flags
+		};
+	}
+
+	r = crypt_activate_by_signed_key_batch(activations, count);
+	for (i = 0; i < count; i++)
+		if (activations[i].result < 0)
+			log_err(_("Activation of device %s failed."), entries[i].name);
+
+	/* dm-verity module is loaded now, set its parameter */
+	if (!r && ARG_SET(OPT_PREFETCH_CLUSTER_ID)) {
+		r = _set_prefetch_cluster(ARG_UINT32(OPT_PREFETCH_CLUSTER_ID));
+		for (i = 0; r < 0 && i < count; i++)
+			crypt_deactivate(loads[i].cd, entries[i].name);
+	}
+out:
+	if (loads)
+		for (i = 0; i < count; i++)
+			crypt_free(loads[i].cd);
+	free(loads);
+	free(activations);
+	open_batch_free(entries, count);
+
+	return r;
+}
+
 static int action_open(void)
 {
+	if (ARG_SET(OPT_BATCH_FILE_ID))
+		return action_open_batch();
+
 	if (action_argc < 4 && !ARG_SET(OPT_ROOT_HASH_FILE_ID)) {
 		log_err(_("Command requires <root_hash> or --root-hash-file option as argument."));
 		return -EINVAL;
@@ -284,7 +611,8 @@ static int action_open(void)
 			 action_argv[0],
 			 action_argv[2],
 			 ARG_SET(OPT_ROOT_HASH_FILE_ID) ? NULL : action_argv[3],
-			 ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID) ? CRYPT_VERITY_ROOT_HASH_SIGNATURE : 0);
+			 ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID) ? CRYPT_VERITY_ROOT_HASH_SIGNATURE : 0,
+			 false);
 }
 
 static int action_verify(void)
@@ -298,7 +626,175 @@ static int action_verify(void)
 			 action_argv[0],
 			 action_argv[1],
 			 ARG_SET(OPT_ROOT_HASH_FILE_ID) ? NULL : action_argv[2],
-			 CRYPT_VERITY_CHECK_HASH);
+			 CRYPT_VERITY_CHECK_HASH |
+			 (ARG_SET(OPT_CHECK_ALL_ID) ? CRYPT_VERITY_CHECK_HASH_ALL : 0),
+			 false);
+}
+
+static int action_repair(void)
+{
+	if (action_argc < 3 && !ARG_SET(OPT_ROOT_HASH_FILE_ID)) {
+		log_err(_("Command requires <root_hash> or --root-hash-file option as argument."));
+		return -EINVAL;
+	}
+
+	if (!ARG_SET(OPT_FEC_DEVICE_ID)) {
+		log_err(_("Command requires --fec-device option."));
+		return -EINVAL;
+	}
+
+	return _activate(NULL,
+			 action_argv[0],
+			 action_argv[1],
+			 ARG_SET(OPT_ROOT_HASH_FILE_ID) ? NULL : action_argv[2],
+			 0, true);
+}
+
+/* Block number or <first>-<last> range, both range ends are required */
+static int _parse_block_range(const char *token, unsigned long long *start,
+			      unsigned long long *end)
+{
+	char *endp;
+
+	if (!isdigit((unsigned char)*token))
+		return -EINVAL;
+
+	errno = 0;
+	*start = strtoull(token, &endp, 10);
+	if (*endp == '-') {
+		token = endp + 1;
+		if (!isdigit((unsigned char)*token))
+			return -EINVAL;
+		*end = strtoull(token, &endp, 10);
+	} else
+		*end = *start;
+
+	if (errno || *endp || *end < *start)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Changed blocks file contains data block numbers or inclusive ranges
+ * <first>-<last>, separated by white space or new lines.
+ */
+static int _read_changed_blocks(const char *path, struct crypt_verity_block_range **ranges,
+				size_t *ranges_count)
+{
+	struct crypt_verity_block_range *tmp, *r = NULL;
+	unsigned long long start, end;
+	size_t count = 0, alloc = 0;
+	char token[64];
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		log_err(_("Cannot read changed blocks file %s."), path);
+		return -EINVAL;
+	}
+
+	while (fscanf(f, "%63s", token) == 1) {
+		if (_parse_block_range(token, &start, &end)) {
+			log_err(_("Invalid block range %s in file %s."), token, path);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (count == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			tmp = realloc(r, alloc * sizeof(*r));
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			r = tmp;
+		}
+		r[count].start = start;
+		r[count].count = end - start + 1;
+		count++;
+	}
+
+	if (!ret && ferror(f)) {
+		log_err(_("Cannot read changed blocks file %s."), path);
+		ret = -EIO;
+	}
+	fclose(f);
+
+	if (ret) {
+		free(r);
+		return ret;
+	}
+
+	log_dbg("Read %zu changed block ranges from %s.", count, path);
+	*ranges = r;
+	*ranges_count = count;
+	return 0;
+}
+
+static int action_update(void)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_block_range *ranges = NULL;
+	size_t ranges_count = 0;
+	char *root_hash = NULL;
+	int r;
+
+	if (!ARG_SET(OPT_CHANGED_BLOCKS_ID)) {
+		log_err(_("Command requires --changed-blocks option as argument."));
+		return -EINVAL;
+	}
+
+	r = _read_changed_blocks(ARG_STR(OPT_CHANGED_BLOCKS_ID), &ranges, &ranges_count);
+	if (r < 0)
+		return r;
+
+	if ((r = crypt_init_data_device(&cd, action_argv[1], action_argv[0])))
+		goto out;
+
+	if (ARG_SET(OPT_THREADS_ID) &&
+	    (r = crypt_set_threads(cd, ARG_UINT32(OPT_THREADS_ID))))
+		goto out;
+
+	if (!ARG_SET(OPT_NO_SUPERBLOCK_ID)) {
+		params.hash_area_offset = ARG_UINT64(OPT_HASH_OFFSET_ID);
+		params.fec_area_offset = ARG_UINT64(OPT_FEC_OFFSET_ID);
+		params.fec_device = ARG_STR(OPT_FEC_DEVICE_ID);
+		params.fec_roots = ARG_UINT32(OPT_FEC_ROOTS_ID);
+		r = crypt_load(cd, CRYPT_VERITY, &params);
+		if (r)
+			log_err(_("Device %s is not a valid VERITY device."), action_argv[1]);
+	} else {
+		r = _prepare_format(&params, action_argv[0], CRYPT_VERITY_NO_HEADER);
+		if (r < 0)
+			goto out;
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &params);
+	}
+	if (r < 0)
+		goto out;
+
+	root_hash = malloc(crypt_get_volume_key_size(cd));
+	if (!root_hash) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_verity_update(cd, ranges, ranges_count, root_hash, crypt_get_volume_key_size(cd));
+	if (r < 0)
+		goto out;
+
+	crypt_dump(cd);
+
+	if (ARG_SET(OPT_ROOT_HASH_FILE_ID))
+		r = _write_root_hash_file(cd, ARG_STR(OPT_ROOT_HASH_FILE_ID));
+out:
+	crypt_free(cd);
+	free(root_hash);
+	free(ranges);
+	free(CONST_CAST(char*)params.salt);
+	return r;
 }
 
 static int action_close(void)
@@ -337,6 +833,7 @@ static int action_status(void)
 	struct stat st;
 	char *backing_file, *root_hash;
 	size_t root_hash_size;
+	uint32_t prefetch_cluster;
 	unsigned path = 0;
 	int r = 0;
 
@@ -445,8 +942,11 @@ static int action_status(void)
 				(cad.flags & CRYPT_ACTIVATE_RESTART_ON_CORRUPTION) ? "restart_on_corruption " : "",
 				(cad.flags & CRYPT_ACTIVATE_PANIC_ON_CORRUPTION) ? "panic_on_corruption " : "",
 				(cad.flags & CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS) ? "ignore_zero_blocks " : "",
-				(cad.flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE) ? "check_at_most_once" : "",
+				(cad.flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE) ? "check_at_most_once " : "",
 				(cad.flags & CRYPT_ACTIVATE_TASKLETS) ? "try_verify_in_tasklet" : "");
+
+		if (!_get_prefetch_cluster(&prefetch_cluster))
+			log_std("  prefetch:    %" PRIu32 " bytes\n", prefetch_cluster);
 	}
 out:
 	crypt_free(cd);
@@ -488,6 +988,8 @@ static struct action_type {
 } action_types[] = {
 	{ "format",	action_format, 2, N_("<data_device> <hash_device>"),N_("format device") },
 	{ "verify",	action_verify, 2, N_("<data_device> <hash_device> [<root_hash>]"),N_("verify device") },
+	{ "repair",	action_repair, 2, N_("<data_device> <hash_device> [<root_hash>]"),N_("repair corrupted blocks using FEC") },
+	{ "update",	action_update, 2, N_("<data_device> <hash_device>"),N_("update hash area for changed data blocks") },
 	{ "open",	action_open,   3, N_("<data_device> <name> <hash_device> [<root_hash>]"),N_("open device as <name>") },
 	{ "close",	action_close,  1, N_("<name>"),N_("close device (remove mapping)") },
 	{ "status",	action_status, 1, N_("<name>"),N_("show active device status") },
@@ -646,7 +1148,8 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Unknown action."),
 		      poptGetInvocationName(popt_context));
 
-	if (action_argc < action->required_action_argc) {
+	if (action_argc < action->required_action_argc &&
+	    !(!strcmp(aname, "open") && ARG_SET(OPT_BATCH_FILE_ID))) {
 		char buf[128];
 		if (snprintf(buf, 128,_("%s: requires %s as arguments"), action->type, action->arg_desc) < 0)
 			buf[0] = '\0';
@@ -671,6 +1174,38 @@ int main(int argc, const char **argv)
 		      _("Options --cancel-deferred and --deferred cannot be used at the same time."),
 		      poptGetInvocationName(popt_context));
 
+	if (ARG_SET(OPT_DATA_STREAM_ID) && ARG_SET(OPT_DATA_BLOCKS_ID))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --data-blocks cannot be combined with option --data-stream."),
+		      poptGetInvocationName(popt_context));
+
+	if ((ARG_SET(OPT_HASH_STAGING_ID) || ARG_SET(OPT_HASH_STAGING_DEVICE_ID)) &&
+	    (ARG_SET(OPT_DATA_STREAM_ID) || ARG_SET(OPT_FEC_DEVICE_ID)))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Hash staging cannot be combined with options --data-stream or --fec-device."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_BATCH_FILE_ID) && (action_argc || ARG_SET(OPT_NO_SUPERBLOCK_ID) ||
+	    ARG_SET(OPT_FEC_DEVICE_ID) || ARG_SET(OPT_ROOT_HASH_FILE_ID) || ARG_SET(OPT_ROOT_HASH_SIGNATURE_ID)))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --batch-file cannot be combined with device arguments, --no-superblock, --fec-device or root hash options."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_SAMPLE_ID) && (!ARG_UINT32(OPT_SAMPLE_ID) || ARG_UINT32(OPT_SAMPLE_ID) > 100))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --sample must be a percentage between 1 and 100."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_SAMPLE_ID) && ARG_SET(OPT_CHECK_ALL_ID))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --sample cannot be combined with option --check-all."),
+		      poptGetInvocationName(popt_context));
+
+	if (ARG_SET(OPT_SAMPLE_SEED_ID) && !ARG_SET(OPT_SAMPLE_ID))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --sample-seed is allowed only with option --sample."),
+		      poptGetInvocationName(popt_context));
+
 	if (ARG_SET(OPT_DEBUG_ID)) {
 		crypt_set_debug_level(CRYPT_DEBUG_ALL);
 		dbg_version_and_cmd(argc, argv);
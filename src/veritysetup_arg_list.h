@@ -21,14 +21,22 @@
 
 /* long name, short name, popt type, help description, units, internal argument type, default value, allowed actions (empty=global) */
 
+ARG(OPT_BATCH_FILE, '\0', POPT_ARG_STRING, N_("Open all verity devices listed in manifest file"), NULL, CRYPT_ARG_STRING, {}, OPT_BATCH_FILE_ACTIONS)
+
 ARG(OPT_CANCEL_DEFERRED, '\0', POPT_ARG_NONE, N_("Cancel a previously set deferred device removal"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
 
+ARG(OPT_CHANGED_BLOCKS, '\0', POPT_ARG_STRING, N_("Path to file with list of changed data blocks"), NULL, CRYPT_ARG_STRING, {}, OPT_CHANGED_BLOCKS_ACTIONS)
+
+ARG(OPT_CHECK_ALL, '\0', POPT_ARG_NONE, N_("Do not stop verification on the first corrupted block, report all"), NULL, CRYPT_ARG_BOOL, {}, OPT_CHECK_ALL_ACTIONS)
+
 ARG(OPT_CHECK_AT_MOST_ONCE, '\0', POPT_ARG_NONE, N_("Verify data block only the first time it is read"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DATA_BLOCK_SIZE, '\0', POPT_ARG_STRING, N_("Block size on the data device"), N_("bytes"), CRYPT_ARG_UINT32, { .u32_value = DEFAULT_VERITY_DATA_BLOCK }, {})
 
 ARG(OPT_DATA_BLOCKS, '\0', POPT_ARG_STRING, N_("The number of blocks in the data file"), N_("blocks"), CRYPT_ARG_UINT64, {}, {})
 
+ARG(OPT_DATA_STREAM, '\0', POPT_ARG_NONE, N_("Read data from standard input and copy it to data device"), NULL, CRYPT_ARG_BOOL, {}, OPT_DATA_STREAM_ACTIONS)
+
 ARG(OPT_DEBUG, '\0', POPT_ARG_NONE, N_("Show debug messages"), NULL, CRYPT_ARG_BOOL, {}, {})
 
 ARG(OPT_DEFERRED, '\0', POPT_ARG_NONE, N_("Device removal is deferred until the last user closes it"), NULL, CRYPT_ARG_BOOL, {}, OPT_DEFERRED_ACTIONS)
@@ -47,6 +55,10 @@ ARG(OPT_HASH_BLOCK_SIZE, '\0', POPT_ARG_STRING, N_("Block size on the hash devic
 
 ARG(OPT_HASH_OFFSET, '\0', POPT_ARG_STRING, N_("Starting offset on the hash device"), N_("bytes"), CRYPT_ARG_UINT64, {}, {})
 
+ARG(OPT_HASH_STAGING, '\0', POPT_ARG_NONE, N_("Create hash tree in memory and write it to hash device at once"), NULL, CRYPT_ARG_BOOL, {}, OPT_HASH_STAGING_ACTIONS)
+
+ARG(OPT_HASH_STAGING_DEVICE, '\0', POPT_ARG_STRING, N_("Create hash tree on scratch device and write it to hash device at once"), N_("path"), CRYPT_ARG_STRING, {}, OPT_HASH_STAGING_ACTIONS)
+
 ARG(OPT_IGNORE_CORRUPTION, '\0', POPT_ARG_NONE, N_("Ignore corruption, log it only"), NULL, CRYPT_ARG_BOOL, {}, OPT_IGNORE_CORRUPTION_ACTIONS)
 
 ARG(OPT_IGNORE_ZERO_BLOCKS, '\0', POPT_ARG_NONE, N_("Do not verify zeroed blocks"), NULL, CRYPT_ARG_BOOL, {}, OPT_IGNORE_ZERO_BLOCKS_ACTIONS)
@@ -55,6 +67,8 @@ ARG(OPT_NO_SUPERBLOCK, '\0', POPT_ARG_NONE, N_("Do not use verity superblock"),
 
 ARG(OPT_PANIC_ON_CORRUPTION, '\0', POPT_ARG_NONE, N_("Panic kernel if corruption is detected"), NULL, CRYPT_ARG_BOOL, {}, OPT_PANIC_ON_CORRUPTION_ACTIONS)
 
+ARG(OPT_PREFETCH_CLUSTER, '\0', POPT_ARG_STRING, N_("Size of hash and data prefetch cluster (dm-verity module parameter)"), N_("bytes"), CRYPT_ARG_UINT32, {}, OPT_PREFETCH_CLUSTER_ACTIONS)
+
 ARG(OPT_RESTART_ON_CORRUPTION, '\0', POPT_ARG_NONE, N_("Restart kernel if corruption is detected"), NULL, CRYPT_ARG_BOOL, {}, OPT_RESTART_ON_CORRUPTION_ACTIONS)
 
 ARG(OPT_ROOT_HASH_FILE, '\0', POPT_ARG_STRING, N_("Path to root hash file"), NULL, CRYPT_ARG_STRING, {}, OPT_ROOT_HASH_FILE_ACTIONS)
@@ -63,6 +77,12 @@ ARG(OPT_ROOT_HASH_SIGNATURE, '\0', POPT_ARG_STRING, N_("Path to root hash signat
 
 ARG(OPT_SALT, 's', POPT_ARG_STRING, N_("Salt"), N_("hex string"), CRYPT_ARG_STRING, {}, {})
 
+ARG(OPT_SAMPLE, '\0', POPT_ARG_STRING, N_("Verify only given percentage of the device (spot check)"), N_("percent"), CRYPT_ARG_UINT32, {}, OPT_SAMPLE_ACTIONS)
+
+ARG(OPT_SAMPLE_SEED, '\0', POPT_ARG_STRING, N_("Seed for pseudo-random selection of verified samples"), N_("number"), CRYPT_ARG_UINT64, {}, OPT_SAMPLE_SEED_ACTIONS)
+
+ARG(OPT_THREADS, '\0', POPT_ARG_STRING, N_("Number of threads used for hash computation"), N_("number"), CRYPT_ARG_UINT32, {}, OPT_THREADS_ACTIONS)
+
 ARG(OPT_USE_TASKLETS, '\0', POPT_ARG_NONE, N_("Use kernel tasklets for performance"), NULL, CRYPT_ARG_BOOL, {}, OPT_USE_TASKLETS_ACTIONS)
 
 ARG(OPT_UUID, '\0', POPT_ARG_STRING, N_("UUID for device to use"), NULL, CRYPT_ARG_STRING, {}, {})
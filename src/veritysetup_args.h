@@ -29,16 +29,27 @@
 #define DUMP_ACTION	"dump"
 #define FORMAT_ACTION	"format"
 #define OPEN_ACTION	"open"
+#define REPAIR_ACTION	"repair"
 #define STATUS_ACTION	"status"
+#define UPDATE_ACTION	"update"
 #define VERIFY_ACTION	"verify"
 
+#define OPT_BATCH_FILE_ACTIONS			{ OPEN_ACTION }
+#define OPT_CHANGED_BLOCKS_ACTIONS		{ UPDATE_ACTION }
+#define OPT_CHECK_ALL_ACTIONS			{ VERIFY_ACTION }
+#define OPT_DATA_STREAM_ACTIONS			{ FORMAT_ACTION }
 #define OPT_DEFERRED_ACTIONS			{ CLOSE_ACTION }
+#define OPT_HASH_STAGING_ACTIONS		{ FORMAT_ACTION }
 #define OPT_IGNORE_CORRUPTION_ACTIONS		{ OPEN_ACTION }
 #define OPT_IGNORE_ZERO_BLOCKS_ACTIONS		{ OPEN_ACTION }
 #define OPT_RESTART_ON_CORRUPTION_ACTIONS	{ OPEN_ACTION }
 #define OPT_PANIC_ON_CORRUPTION_ACTIONS		{ OPEN_ACTION }
-#define OPT_ROOT_HASH_FILE_ACTIONS		{ FORMAT_ACTION, OPEN_ACTION, VERIFY_ACTION }
+#define OPT_PREFETCH_CLUSTER_ACTIONS		{ OPEN_ACTION }
+#define OPT_ROOT_HASH_FILE_ACTIONS		{ FORMAT_ACTION, OPEN_ACTION, REPAIR_ACTION, UPDATE_ACTION, VERIFY_ACTION }
 #define OPT_ROOT_HASH_SIGNATURE_ACTIONS		{ OPEN_ACTION }
+#define OPT_SAMPLE_ACTIONS			{ VERIFY_ACTION }
+#define OPT_SAMPLE_SEED_ACTIONS			{ VERIFY_ACTION }
+#define OPT_THREADS_ACTIONS			{ FORMAT_ACTION, REPAIR_ACTION, UPDATE_ACTION, VERIFY_ACTION }
 #define OPT_USE_TASKLETS_ACTIONS		{ OPEN_ACTION }
 
 enum {
@@ -27,6 +27,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <sys/types.h>
@@ -62,6 +64,7 @@ typedef int32_t key_serial_t;
 #define REQS_LUKS2_HEADER "luks2_header_requirements"
 #define NO_REQS_LUKS2_HEADER "luks2_header_requirements_free"
 #define BACKUP_FILE "csetup_backup_file"
+#define PBKDF_CACHE_FILE "csetup_pbkdf_cache"
 #define IMAGE1 "compatimage2.img"
 #define IMAGE_EMPTY "empty.img"
 #define IMAGE_EMPTY_SMALL "empty_small.img"
@@ -355,6 +358,7 @@ static void _cleanup(void)
 	remove(REQS_LUKS2_HEADER);
 	remove(NO_REQS_LUKS2_HEADER);
 	remove(BACKUP_FILE);
+	remove(PBKDF_CACHE_FILE);
 	remove(IMAGE_PV_LUKS2_SEC);
 	remove(IMAGE_PV_LUKS2_SEC ".bcp");
 	remove(IMAGE_EMPTY_SMALL);
@@ -666,6 +670,33 @@ static void SuspendDevice(void)
 	OK_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key, &key_size, KEY1, strlen(KEY1)));
 	OK_(crypt_resume_by_volume_key(cd, CDEVICE_1, key, key_size));
 	OK_(crypt_deactivate(cd, CDEVICE_1));
+
+#ifdef KERNEL_KEYRING
+	/* Resume by volume key cached in kernel keyring */
+	if (t_dm_crypt_keyring_support()) {
+		OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, CRYPT_ACTIVATE_KEYRING_KEY));
+		EQ_(crypt_suspend_cache_key(cd, CDEVICE_1, 60), -ENOTSUP);
+		OK_(crypt_deactivate(cd, CDEVICE_1));
+
+		OK_(crypt_volume_key_keyring(cd, 0));
+		OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
+		FAIL_(crypt_suspend_cache_key(cd, CDEVICE_1, 0), "no timeout");
+		FAIL_(crypt_resume_by_cached_key(cd, CDEVICE_1), "not suspended");
+		OK_(crypt_suspend_cache_key(cd, CDEVICE_1, 60));
+		OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+		EQ_(CRYPT_ACTIVATE_SUSPENDED, cad.flags & CRYPT_ACTIVATE_SUSPENDED);
+		OK_(crypt_resume_by_cached_key(cd, CDEVICE_1));
+		OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+		EQ_(0, cad.flags & CRYPT_ACTIVATE_SUSPENDED);
+
+		/* cached key is used only once */
+		OK_(crypt_suspend(cd, CDEVICE_1));
+		EQ_(crypt_resume_by_cached_key(cd, CDEVICE_1), -ENOENT);
+		OK_(crypt_resume_by_volume_key(cd, CDEVICE_1, key, key_size));
+		OK_(crypt_deactivate(cd, CDEVICE_1));
+		OK_(crypt_volume_key_keyring(cd, 1));
+	}
+#endif
 	CRYPT_FREE(cd);
 
 	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
@@ -930,6 +961,13 @@ static void AddDeviceLuks2(void)
 	OK_(crypt_keyslot_destroy(cd, 2));
 	OK_(crypt_keyslot_destroy(cd, 3));
 	OK_(crypt_keyslot_destroy(cd, 4));
+	EQ_(1, crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, KEY1, strlen(KEY1)));
+	EQ_(2, crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, KEY1, strlen(KEY1)));
+	FAIL_(crypt_keyslots_destroy(cd, (const int[]){ 2, 1 }, 0), "no keyslots");
+	FAIL_(crypt_keyslots_destroy(cd, (const int[]){ 2, 1, 3 }, 3), "keyslot not used");
+	OK_(crypt_keyslots_destroy(cd, (const int[]){ 2, 1 }, 2));
+	EQ_(CRYPT_SLOT_INACTIVE, crypt_keyslot_status(cd, 1));
+	EQ_(CRYPT_SLOT_INACTIVE, crypt_keyslot_status(cd, 2));
 	OK_(crypt_deactivate(cd, CDEVICE_2));
 	_remove_keyfiles();
 
@@ -1933,6 +1971,10 @@ static void Tokens(void)
 	char passptr[] = PASSPHRASE;
 	char passptr1[] = PASSPHRASE1;
 	struct crypt_active_device cad;
+	struct crypt_activation act[2];
+	struct crypt_activation_request *req;
+	struct crypt_keyslot_context *kc;
+	struct pollfd pfd;
 
 	static const crypt_token_handler th = {
 		.name = "test_token",
@@ -2097,6 +2139,56 @@ static void Tokens(void)
 	OK_(crypt_keyslot_set_priority(cd, 8, CRYPT_SLOT_PRIORITY_PREFER));
 	OK_(crypt_keyslot_set_priority(cd, 12,CRYPT_SLOT_PRIORITY_PREFER));
 
+	// parallel keyslot trial respects priorities as well
+	OK_(crypt_parallel_unlock(cd, 1));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 12);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), 8);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, "foo", 3, 0), "wrong passphrase");
+	OK_(crypt_parallel_unlock(cd, 0));
+
+	// batch activation
+	memset(act, 0, sizeof(act));
+	act[0].cd = cd;
+	act[0].name = CDEVICE_1;
+	act[0].keyslot = CRYPT_ANY_SLOT;
+	act[0].passphrase = PASSPHRASE;
+	act[0].passphrase_size = strlen(PASSPHRASE);
+	EQ_(crypt_activate_by_passphrase_batch(act, 2), -EINVAL);
+	EQ_(act[0].result, 12);
+	EQ_(act[1].result, -EINVAL);
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_activate_by_passphrase_batch(act, 1), -EEXIST);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	act[0].name = NULL;
+	act[0].passphrase = "foo";
+	act[0].passphrase_size = 3;
+	FAIL_(crypt_activate_by_passphrase_batch(act, 1), "wrong passphrase");
+	EQ_(act[0].result, -EPERM);
+	FAIL_(crypt_activate_by_passphrase_batch(NULL, 1), "no activations");
+
+	// asynchronous activation
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE, strlen(PASSPHRASE), &kc));
+	FAIL_(crypt_activate_by_keyslot_context_async(cd, CDEVICE_1, CRYPT_ANY_SLOT, NULL, 0, &req), "no keyslot context");
+	OK_(crypt_activate_by_keyslot_context_async(cd, CDEVICE_1, CRYPT_ANY_SLOT, kc, 0, &req));
+	pfd.fd = crypt_activation_request_get_fd(req);
+	pfd.events = POLLIN;
+	GE_(pfd.fd, 0);
+	EQ_(poll(&pfd, 1, -1), 1);
+	EQ_(crypt_activation_request_result(req), 12);
+	crypt_activation_request_free(req);
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	crypt_keyslot_context_free(kc);
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, "foo", 3, &kc));
+	OK_(crypt_activate_by_keyslot_context_async(cd, NULL, CRYPT_ANY_SLOT, kc, 0, &req));
+	crypt_activation_request_free(req);
+	OK_(crypt_activate_by_keyslot_context_async(cd, NULL, CRYPT_ANY_SLOT, kc, 0, &req));
+	pfd.fd = crypt_activation_request_get_fd(req);
+	EQ_(poll(&pfd, 1, -1), 1);
+	EQ_(crypt_activation_request_result(req), -EPERM);
+	crypt_activation_request_free(req);
+	crypt_keyslot_context_free(kc);
+
 	// expected unusable with CRYPT_ANY_TOKEN
 	EQ_(crypt_token_json_set(cd, 1, TEST_TOKEN_JSON("\"0\", \"3\"")), 1);
 
@@ -2156,6 +2248,9 @@ static void Tokens(void)
 	EQ_(crypt_token_max(CRYPT_LUKS2), 32);
 	FAIL_(crypt_token_max(CRYPT_LUKS1), "No token support in LUKS1");
 	FAIL_(crypt_token_max(NULL), "No LUKS format specified");
+
+	// no external handler is referenced after all contexts are released
+	OK_(crypt_token_external_flush());
 	_cleanup_dmdevices();
 }
 
@@ -2688,6 +2783,7 @@ static void LuksConvert(void)
 static void Pbkdf(void)
 {
 	const struct crypt_pbkdf_type *pbkdf;
+	uint32_t iterations, memory;
 
 	const char *cipher = "aes", *mode="xts-plain64";
 	struct crypt_pbkdf_type argon2 = {
@@ -2751,6 +2847,42 @@ static void Pbkdf(void)
 	NOTNULL_(crypt_get_pbkdf_type(cd));
 	CRYPT_FREE(cd);
 
+	// test Argon2 memory lock flag
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	argon2.flags = CRYPT_PBKDF_LOCK_MEMORY;
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	argon2.flags = 0;
+	NOTNULL_(pbkdf = crypt_get_pbkdf_type(cd));
+	EQ_(pbkdf->flags, CRYPT_PBKDF_LOCK_MEMORY);
+	OK_(crypt_format(cd, CRYPT_LUKS2, cipher, mode, NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	CRYPT_FREE(cd);
+
+	// test PBKDF benchmark cache
+	remove(PBKDF_CACHE_FILE);
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_cache(cd, PBKDF_CACHE_FILE));
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, cipher, mode, NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	NOTNULL_(pbkdf = crypt_get_pbkdf_type(cd));
+	iterations = pbkdf->iterations;
+	memory = pbkdf->max_memory_kb;
+	CRYPT_FREE(cd);
+	OK_(access(PBKDF_CACHE_FILE, R_OK));
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_set_pbkdf_cache(cd, PBKDF_CACHE_FILE));
+	OK_(crypt_set_pbkdf_type(cd, &argon2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, cipher, mode, NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	NOTNULL_(pbkdf = crypt_get_pbkdf_type(cd));
+	EQ_(pbkdf->iterations, iterations);
+	EQ_(pbkdf->max_memory_kb, memory);
+	OK_(crypt_set_pbkdf_cache(cd, NULL));
+	CRYPT_FREE(cd);
+	remove(PBKDF_CACHE_FILE);
+
 	// test LUKSv1 device
 	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
 	OK_(crypt_format(cd, CRYPT_LUKS1, cipher, mode, NULL, NULL, 32, NULL));
@@ -3665,6 +3797,12 @@ static void Luks2Integrity(void)
 	OK_(crypt_init(&cd, DEVICE_2));
 	FAIL_(crypt_format(cd, CRYPT_LUKS2, cipher, cipher_mode, NULL, NULL, key_size - 32, &params), "Wrong key size.");
 	FAIL_(crypt_format(cd, CRYPT_LUKS2, cipher, "xts-plainx", NULL, NULL, key_size, &params), "Wrong cipher.");
+
+	// Test devices do not provide per-sector metadata, inline mode must fail
+	EQ_(crypt_format_inline(cd, CRYPT_LUKS2, cipher, cipher_mode, NULL, NULL, key_size, &params), -ENOTSUP);
+	EQ_(crypt_format_inline(cd, CRYPT_LUKS1, cipher, "xts-plain64", NULL, NULL, 32, NULL), -EINVAL);
+	params.integrity = NULL;
+	EQ_(crypt_format_inline(cd, CRYPT_LUKS2, cipher, "xts-plain64", NULL, NULL, 32, &params), -EINVAL);
 	CRYPT_FREE(cd);
 }
 
@@ -3675,6 +3813,7 @@ static int check_flag(uint32_t flags, uint32_t flag)
 
 static void Luks2Refresh(void)
 {
+	struct crypt_active_stats stats = { .size = sizeof(stats) };
 	uint64_t r_payload_offset;
 	char key[128], key1[128];
 	const char *cipher = "aes", *mode = "xts-plain64";
@@ -3752,6 +3891,31 @@ static void Luks2Refresh(void)
 		cad.flags = 0;
 	}
 
+	/* retune active device without volume key */
+	if (t_dm_crypt_cpu_switch_support()) {
+		OK_(crypt_retune(cd, CDEVICE_1, CRYPT_ACTIVATE_SAME_CPU_CRYPT, CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS));
+		OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+		OK_(check_flag(cad.flags, CRYPT_ACTIVATE_SAME_CPU_CRYPT));
+		FAIL_(check_flag(cad.flags, CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS), "Flag not cleared.");
+		if (t_dm_crypt_discard_support())
+			OK_(check_flag(cad.flags, CRYPT_ACTIVATE_ALLOW_DISCARDS));
+		cad.flags = 0;
+	}
+	FAIL_(crypt_retune(cd, CDEVICE_1, 0, CRYPT_ACTIVATE_READONLY), "Unsupported flag.");
+	FAIL_(crypt_retune(cd, CDEVICE_1, 0, CRYPT_ACTIVATE_NO_JOURNAL), "No integrity device.");
+	FAIL_(crypt_retune(cd, CDEVICE_1, 0, CRYPT_ACTIVATE_RECALCULATE), "No integrity device.");
+	FAIL_(crypt_get_active_integrity_recalc(cd, CDEVICE_1, NULL, NULL), "No integrity device.");
+	FAIL_(crypt_retune(cd, CDEVICE_2, 0, CRYPT_ACTIVATE_SAME_CPU_CRYPT), "Device not active.");
+
+	/* I/O statistics of active device */
+	OK_(crypt_get_active_stats(cd, CDEVICE_1, &stats));
+	EQ_(stats.integrity_failures, 0);
+	FAIL_(crypt_get_active_stats(cd, CDEVICE_2, &stats), "Device not active.");
+	FAIL_(crypt_get_active_stats(cd, CDEVICE_1, NULL), "No stats.");
+	stats.size = sizeof(stats) + 1;
+	FAIL_(crypt_get_active_stats(cd, CDEVICE_1, &stats), "Unknown structure size.");
+	stats.size = sizeof(stats);
+
 	/* do not allow reactivation with read-only (and drop flag silently because activation behaves exactly same) */
 	OK_(crypt_activate_by_passphrase(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), CRYPT_ACTIVATE_REFRESH | CRYPT_ACTIVATE_READONLY));
 	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
@@ -3849,6 +4013,20 @@ static void Luks2Flags(void)
 	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_ACTIVATION, &flags));
 	EQ_(flags,CRYPT_ACTIVATE_ALLOW_DISCARDS | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS);
 
+	flags = CRYPT_ACTIVATE_HIGH_PRIORITY | CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+	OK_(crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, flags));
+	flags = 0;
+	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_ACTIVATION, &flags));
+	EQ_(flags, CRYPT_ACTIVATE_HIGH_PRIORITY | CRYPT_ACTIVATE_NO_READ_WORKQUEUE);
+	OK_(crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION,
+		CRYPT_ACTIVATE_ALLOW_DISCARDS | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS));
+
+	/* CPU mask is validated before device lookup */
+	EQ_(crypt_set_cpumask(cd, CDEVICE_1, ""), -EINVAL);
+	EQ_(crypt_set_cpumask(cd, CDEVICE_1, "0x3"), -EINVAL);
+	EQ_(crypt_set_cpumask(cd, CDEVICE_1, "3 "), -EINVAL);
+	FAIL_(crypt_set_cpumask(cd, CDEVICE_1, "ff,00000000"), "Device not active");
+
 	/* label and subsystem (second label */
 	OK_(crypt_set_label(cd, "label", "subsystem"));
 	OK_(strcmp("label", crypt_get_label(cd)));
@@ -3898,6 +4076,11 @@ static void Luks2Reencryption(void)
 		.hash = "sha256",
 		.luks2 = &params2,
 	};
+	struct crypt_params_reencrypt_tuning tuning = { .size = sizeof(tuning) };
+	const struct crypt_reencrypt_range used_ranges[] = {
+		{ .offset = 16 * 4096, .length = 4096 },
+		{ .offset = 0, .length = 8192 },
+	};
 	dev_t devno;
 
 	const char *vk_hex = "bb21babe733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
@@ -4139,6 +4322,184 @@ static void Luks2Reencryption(void)
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 	CRYPT_FREE(cd);
 
+	/* Pipelined offline reencryption (hotzone prefetch) */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.device_size = 0;
+	rparams.flags = 0;
+	rparams.max_hotzone_size = 2;
+	tuning.pipeline_depth = 2;
+	OK_(crypt_reencrypt_set_tuning(cd, &tuning));
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	/* interrupt with next hotzone already prefetched */
+	test_progress_steps = 3;
+	OK_(crypt_reencrypt_run(cd, &test_progress, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_CLEAN);
+	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY;
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	CRYPT_FREE(cd);
+
+	/* Read back verification of finished hotzones */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.flags = 0;
+	tuning.verify_percent = 101;
+	FAIL_(crypt_reencrypt_set_tuning(cd, &tuning), "Invalid verify percentage.");
+	tuning.size = 2;
+	FAIL_(crypt_reencrypt_set_tuning(cd, &tuning), "Invalid structure size.");
+	tuning.size = sizeof(tuning);
+	tuning.verify_percent = 100;
+	OK_(crypt_reencrypt_set_tuning(cd, &tuning));
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	tuning.pipeline_depth = 0;
+	tuning.verify_percent = 0;
+	CRYPT_FREE(cd);
+
+	/* backward direction with journal resilience */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.flags = 0;
+	rparams.direction = CRYPT_REENCRYPT_BACKWARD;
+	rparams.resilience = "journal";
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	rparams.direction = CRYPT_REENCRYPT_FORWARD;
+	rparams.resilience = "checksum";
+	rparams.max_hotzone_size = 0;
+	rparams.device_size = 8;
+	CRYPT_FREE(cd);
+
+	/* Adaptive hotzone size */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.device_size = 0;
+	rparams.flags = CRYPT_REENCRYPT_ADAPTIVE_HOTZONE;
+	rparams.resilience = "none";
+	rparams.max_hotzone_size = 8;
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	rparams.flags = 0;
+	rparams.resilience = "checksum";
+	rparams.max_hotzone_size = 0;
+	rparams.device_size = 8;
+	CRYPT_FREE(cd);
+
+	/* Postponed metadata commit ("none" resilience only) */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.device_size = 0;
+	rparams.resilience = "none";
+	rparams.max_hotzone_size = 2;
+	tuning.commit_steps = 4;
+	OK_(crypt_reencrypt_set_tuning(cd, &tuning));
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	/* interrupted with postponed commit */
+	test_progress_steps = 3;
+	OK_(crypt_reencrypt_run(cd, &test_progress, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_CLEAN);
+	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY;
+	tuning.commit_steps = 0;
+	tuning.commit_ms = 1;
+	OK_(crypt_reencrypt_set_tuning(cd, &tuning));
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	rparams.flags = 0;
+	rparams.resilience = "checksum";
+	rparams.max_hotzone_size = 0;
+	tuning.commit_ms = 0;
+	rparams.device_size = 8;
+	CRYPT_FREE(cd);
+
+	/* Throttled reencryption (best-effort class, lowest priority) */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.device_size = 0;
+	rparams.max_hotzone_size = 8;
+	tuning.max_rate_mbs = 64;
+	tuning.ioprio = (2 << 13) | 7;
+	tuning.max_latency_ms = 1000;
+	OK_(crypt_reencrypt_set_tuning(cd, &tuning));
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	rparams.max_hotzone_size = 0;
+	tuning.max_rate_mbs = 0;
+	tuning.ioprio = 0;
+	tuning.max_latency_ms = 0;
+	rparams.device_size = 8;
+	CRYPT_FREE(cd);
+
+	/* Offline throughput mode (direct-io, default large hotzone) */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	rparams.device_size = 0;
+	rparams.flags = CRYPT_REENCRYPT_OFFLINE_THROUGHPUT;
+	rparams.resilience = "none";
+	FAIL_(crypt_reencrypt_init_by_passphrase(cd, CDEVICE_1, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Online reencryption.");
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	rparams.flags = 0;
+	rparams.resilience = "checksum";
+	rparams.device_size = 8;
+	CRYPT_FREE(cd);
+
+	/* Skip hotzones outside of used data areas */
+	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "cbc-essiv:sha256", NULL, NULL, 32, &params2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_key(cd, 1, NULL, 64, PASSPHRASE, strlen(PASSPHRASE), CRYPT_VOLUME_KEY_NO_SEGMENT), 1);
+	rparams.device_size = 0;
+	rparams.max_hotzone_size = 8;
+	FAIL_(crypt_reencrypt_set_used_ranges(cd, used_ranges, 2), "No reencryption context.");
+	NOTFAIL_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 0, 1, "aes", "xts-plain64", &rparams), "Failed to initialize reencryption.");
+	FAIL_(crypt_reencrypt_set_used_ranges(cd, NULL, 2), "Missing ranges.");
+	OK_(crypt_reencrypt_set_used_ranges(cd, used_ranges, 2));
+	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	EQ_(crypt_reencrypt_status(cd, NULL), CRYPT_REENCRYPT_NONE);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	rparams.max_hotzone_size = 0;
+	rparams.device_size = 8;
+	CRYPT_FREE(cd);
+
 	params2.sector_size = 512;
 	OK_(crypt_init(&cd, DMDIR L_DEVICE_OK));
 	OK_(crypt_init(&cd2, DMDIR H_DEVICE));
@@ -4219,7 +4580,8 @@ static void Luks2Reencryption(void)
 	EQ_(retparams.mode, CRYPT_REENCRYPT_REENCRYPT);
 	OK_(strcmp(retparams.resilience, "datashift"));
 	EQ_(crypt_get_data_offset(cd), 32760);
-	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY;
+	/* area left after data shift is discarded (or wiped if not supported) */
+	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY | CRYPT_REENCRYPT_DISCARD_UNUSED;
 	EQ_(crypt_reencrypt_init_by_passphrase(cd, NULL, PASSPHRASE, strlen(PASSPHRASE), 1, 0, "aes", "xts-plain64", &rparams), 2);
 	OK_(crypt_reencrypt_run(cd, NULL, NULL));
 	CRYPT_FREE(cd);
@@ -4558,8 +4920,12 @@ static void Luks2Reencryption(void)
 	CRYPT_FREE(cd);
 	OK_(crypt_init_by_name(&cd, CDEVICE_1));
 	rparams.flags = CRYPT_REENCRYPT_RESUME_ONLY;
+	/* device stack refreshed once per 3 hotzones */
+	tuning.online_batch_steps = 3;
+	OK_(crypt_reencrypt_set_tuning(cd, &tuning));
 	OK_(crypt_reencrypt_init_by_passphrase(cd, CDEVICE_1, PASSPHRASE, strlen(PASSPHRASE), 6, 1, "aes", "xts-plain64", &rparams));
 	OK_(crypt_reencrypt_run(cd, NULL, NULL));
+	tuning.online_batch_steps = 0;
 	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
 	EQ_(cad.flags & CRYPT_ACTIVATE_ALLOW_DISCARDS, CRYPT_ACTIVATE_ALLOW_DISCARDS);
 	EQ_(cad.flags & CRYPT_ACTIVATE_KEYRING_KEY, 0);
@@ -5009,6 +5375,1314 @@ static void VolumeKeyGet(void)
 	_cleanup_dmdevices();
 }
 
+static void KeyslotsAddBatch(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	struct crypt_keyslot_context *um, *kcs[3];
+	int keyslots[3] = { CRYPT_ANY_SLOT, 5, CRYPT_ANY_SLOT };
+	const char *passphrases[3] = { PASSPHRASE1, KEY1, KEY2 };
+	uint64_t r_payload_offset;
+	int i;
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, &params));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE, strlen(PASSPHRASE), &um));
+	for (i = 0; i < 3; i++)
+		OK_(crypt_keyslot_context_init_by_passphrase(cd, passphrases[i], strlen(passphrases[i]), &kcs[i]));
+
+	FAIL_(crypt_keyslots_add_by_keyslot_context(cd, CRYPT_ANY_SLOT, um, keyslots, kcs, 0, 0), "no keyslots");
+	FAIL_(crypt_keyslots_add_by_keyslot_context(cd, CRYPT_ANY_SLOT, um, keyslots, kcs, 3, CRYPT_VOLUME_KEY_SET), "unsupported flag");
+	FAIL_(crypt_set_pbkdf_memory_limit(cd, UINT64_MAX), "over physical memory");
+	OK_(crypt_set_pbkdf_memory_limit(cd, 64));
+	OK_(crypt_keyslots_add_by_keyslot_context(cd, CRYPT_ANY_SLOT, um, keyslots, kcs, 3, 0));
+	OK_(crypt_set_pbkdf_memory_limit(cd, 0));
+	EQ_(keyslots[0], 1);
+	EQ_(keyslots[1], 5);
+	EQ_(keyslots[2], 2);
+	for (i = 0; i < 3; i++)
+		EQ_(crypt_keyslot_status(cd, keyslots[i]), CRYPT_SLOT_ACTIVE);
+
+	// occupied keyslot fails the whole batch
+	keyslots[0] = CRYPT_ANY_SLOT;
+	keyslots[1] = 5;
+	FAIL_(crypt_keyslots_add_by_keyslot_context(cd, CRYPT_ANY_SLOT, um, keyslots, kcs, 2, 0), "keyslot full");
+	EQ_(crypt_keyslot_status(cd, 3), CRYPT_SLOT_INACTIVE);
+	crypt_keyslot_context_free(um);
+	for (i = 0; i < 3; i++)
+		crypt_keyslot_context_free(kcs[i]);
+	CRYPT_FREE(cd);
+
+	// all keyslots are stored on disk
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, KEY1, strlen(KEY1), 0), 5);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, KEY2, strlen(KEY2), 0), 2);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void VolumeKeyCache(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128], key2[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_volume_key_cache(NULL, 60));
+
+	// first unlock fills the cache, repeated one uses it
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	memset(key2, 0, key_size);
+	EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(memcmp(key, key2, key_size));
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	memset(key2, 0, key_size);
+	EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(memcmp(key, key2, key_size));
+	EQ_(crypt_volume_key_get(cd, 0, key2, &key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	// cached key is bound to passphrase and keyslot
+	FAIL_(crypt_volume_key_get(cd, 1, key2, &key_size, PASSPHRASE, strlen(PASSPHRASE)), "wrong passphrase");
+	FAIL_(crypt_volume_key_get(cd, 0, key2, &key_size, PASSPHRASE1, strlen(PASSPHRASE1)), "wrong passphrase");
+	EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+
+	// header update invalidates cached keys
+	EQ_(crypt_keyslot_change_by_passphrase(cd, 0, 0, PASSPHRASE, strlen(PASSPHRASE), KEY1, strlen(KEY1)), 0);
+	FAIL_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &key_size, PASSPHRASE, strlen(PASSPHRASE)), "wrong passphrase");
+	EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &key_size, KEY1, strlen(KEY1)), 0);
+	OK_(memcmp(key, key2, key_size));
+	CRYPT_FREE(cd);
+
+	OK_(crypt_volume_key_cache(NULL, 0));
+
+	_cleanup_dmdevices();
+}
+
+#define TEST_THREADS 8
+
+struct thread_test {
+	pthread_t thread;
+	const char *vk;
+	size_t vk_size;
+	int r;
+};
+
+/* Uses only its own context, test macros are not thread safe. */
+static void *context_thread(void *arg)
+{
+	struct thread_test *t = arg;
+	struct crypt_device *tcd;
+	char key[256];
+	size_t key_size = t->vk_size;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if ((t->r = crypt_init(&tcd, DMDIR H_DEVICE)))
+			return NULL;
+
+		t->r = crypt_load(tcd, CRYPT_LUKS2, NULL);
+		if (!t->r && crypt_status(tcd, CDEVICE_1) != CRYPT_INACTIVE)
+			t->r = -EINVAL;
+		if (!t->r)
+			t->r = crypt_volume_key_get(tcd, CRYPT_ANY_SLOT, key, &key_size,
+						    PASSPHRASE, strlen(PASSPHRASE));
+		if (t->r >= 0)
+			t->r = (key_size != t->vk_size || memcmp(key, t->vk, key_size)) ? -EINVAL : 0;
+		if (!t->r && strcmp(crypt_get_cipher(tcd), "aes"))
+			t->r = -EINVAL;
+
+		crypt_free(tcd);
+		if (t->r)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static void ConcurrentContexts(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	struct thread_test t[TEST_THREADS];
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+	int i;
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	CRYPT_FREE(cd);
+
+	// independent contexts over the same device used from different threads
+	for (i = 0; i < TEST_THREADS; i++) {
+		t[i].vk = key;
+		t[i].vk_size = key_size;
+		t[i].r = -EINVAL;
+		OK_(pthread_create(&t[i].thread, NULL, context_thread, &t[i]));
+	}
+	for (i = 0; i < TEST_THREADS; i++)
+		OK_(pthread_join(t[i].thread, NULL));
+	for (i = 0; i < TEST_THREADS; i++)
+		EQ_(t[i].r, 0);
+
+	_cleanup_dmdevices();
+}
+
+struct trace_test {
+	unsigned int spans[CRYPT_TRACE_REENCRYPT_STEP + 1];
+	int result;
+};
+
+static void trace_callback(struct crypt_device *_cd, const struct crypt_trace_span *span, void *usrptr)
+{
+	struct trace_test *t = usrptr;
+
+	if (span->type > CRYPT_TRACE_REENCRYPT_STEP || !span->name)
+		return;
+
+	t->spans[span->type]++;
+	if (span->result < 0)
+		t->result = span->result;
+}
+
+static void Tracing(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	struct trace_test t = {}, t_default = {};
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	crypt_set_trace_callback(cd, trace_callback, &t);
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(t.result, 0);
+	OK_(!t.spans[CRYPT_TRACE_KDF]);
+	OK_(!t.spans[CRYPT_TRACE_HEADER_WRITE]);
+	CRYPT_FREE(cd);
+
+	// default callback is used by contexts without own callback
+	crypt_set_trace_callback(NULL, trace_callback, &t_default);
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(!t_default.spans[CRYPT_TRACE_HEADER_READ]);
+	memset(&t, 0, sizeof(t));
+	crypt_set_trace_callback(cd, trace_callback, &t);
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	OK_(!t.spans[CRYPT_TRACE_KDF]);
+	OK_(!t.spans[CRYPT_TRACE_DM_IOCTL]);
+	EQ_(t.result, 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	CRYPT_FREE(cd);
+	crypt_set_trace_callback(NULL, NULL, NULL);
+
+	_cleanup_dmdevices();
+}
+
+static void Statistics(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	struct crypt_stats stats = { .size = sizeof(stats) };
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	FAIL_(crypt_get_stats(NULL), "no stats structure");
+	stats.size = sizeof(stats) + 1;
+	FAIL_(crypt_get_stats(&stats), "unknown structure size");
+	stats.size = sizeof(stats);
+	crypt_reset_stats();
+	OK_(crypt_get_stats(&stats));
+	EQ_(stats.kdf_count, 0);
+	EQ_(stats.dm_ioctls, 0);
+	EQ_(stats.metadata_writes, 0);
+	EQ_(stats.io_write_bytes, 0);
+
+	// counters are updated without any trace callback
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(crypt_get_stats(&stats));
+	OK_(!stats.kdf_count);
+	OK_(!stats.metadata_writes);
+	OK_(!stats.metadata_write_bytes);
+	OK_(!stats.io_write_bytes);
+	CRYPT_FREE(cd);
+
+	crypt_reset_stats();
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_get_stats(&stats));
+	OK_(!stats.kdf_count);
+	OK_(!stats.metadata_reads);
+	OK_(!stats.dm_ioctls);
+	OK_(!stats.io_read_bytes);
+	CRYPT_FREE(cd);
+
+	crypt_reset_stats();
+	OK_(crypt_get_stats(&stats));
+	EQ_(stats.kdf_count, 0);
+	EQ_(stats.metadata_reads, 0);
+
+	_cleanup_dmdevices();
+}
+
+struct status_all_test {
+	int found;
+	int has_key;
+	uint32_t key_size;
+	char type[16];
+	char cipher[64];
+	char key[64];
+};
+
+static int status_all_callback(const struct crypt_active_device_status *st, void *usrptr)
+{
+	struct status_all_test *t = usrptr;
+
+	if (strcmp(st->name, CDEVICE_1))
+		return 0;
+
+	t->found++;
+	t->key_size = st->volume_key_size;
+	t->has_key = st->volume_key ? 1 : 0;
+	if (st->volume_key && st->volume_key_size <= sizeof(t->key))
+		memcpy(t->key, st->volume_key, st->volume_key_size);
+	snprintf(t->type, sizeof(t->type), "%s", st->type ?: "");
+	snprintf(t->cipher, sizeof(t->cipher), "%s", st->cipher ?: "");
+
+	return 0;
+}
+
+static void StatusAll(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	struct status_all_test t = {};
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	// volume key in dm table, not in kernel keyring
+	OK_(crypt_volume_key_keyring(cd, 0));
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
+
+	FAIL_(crypt_status_all(cd, 0, NULL, NULL), "No callback");
+	OK_(crypt_status_all(cd, 0, status_all_callback, &t));
+	EQ_(t.found, 1);
+	EQ_(t.has_key, 0);
+	EQ_(t.key_size, key_size);
+	OK_(strcmp(t.type, CRYPT_LUKS2));
+	OK_(strcmp(t.cipher, "aes-xts-plain64"));
+
+	// key material only on request
+	memset(&t, 0, sizeof(t));
+	OK_(crypt_status_all(NULL, CRYPT_STATUS_ALL_VOLUME_KEY, status_all_callback, &t));
+	EQ_(t.found, 1);
+	EQ_(t.has_key, 1);
+	OK_(memcmp(t.key, key, key_size));
+
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	memset(&t, 0, sizeof(t));
+	OK_(crypt_status_all(NULL, 0, status_all_callback, &t));
+	EQ_(t.found, 0);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void DeactivateBatch(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 512
+	};
+	struct crypt_params_plain pl_params = {
+		.hash = "sha256",
+		.skip = 0,
+		.offset = 0,
+		.size = 0
+	};
+	struct crypt_deactivation d[2] = {};
+	struct crypt_device *cd2 = NULL;
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1024));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
+
+	// plain device stacked over LUKS2 device
+	OK_(crypt_init(&cd2, DMDIR CDEVICE_1));
+	OK_(crypt_format(cd2, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, 16, &pl_params));
+	OK_(crypt_activate_by_volume_key(cd2, CDEVICE_2, key, 16, 0));
+
+	FAIL_(crypt_deactivate_by_name_batch(NULL, 1), "No deactivations");
+	FAIL_(crypt_deactivate_by_name_batch(d, 0), "No deactivations");
+
+	// lower device requested first, it must be removed after the stacked one
+	d[0].cd = cd;
+	d[0].name = CDEVICE_1;
+	d[1].cd = cd2;
+	d[1].name = CDEVICE_2;
+	OK_(crypt_deactivate_by_name_batch(d, 2));
+	EQ_(d[0].result, 0);
+	EQ_(d[1].result, 0);
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_INACTIVE);
+	EQ_(crypt_status(cd2, CDEVICE_2), CRYPT_INACTIVE);
+
+	// not active device
+	d[1].name = CDEVICE_1;
+	EQ_(crypt_deactivate_by_name_batch(d, 2), -ENODEV);
+	EQ_(d[0].result, -ENODEV);
+
+	crypt_free(cd2);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void InitByNameLazy(void)
+{
+	struct crypt_params_luks2 params = {
+		.sector_size = 4096
+	};
+	struct crypt_params_integrity ip;
+	struct crypt_active_device cad;
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t ks_size, key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128], uuid[64];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1024));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, &params));
+	OK_(crypt_set_label(cd, "lazylabel", NULL));
+	snprintf(uuid, sizeof(uuid), "%s", crypt_get_uuid(cd));
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
+	CRYPT_FREE(cd);
+
+	FAIL_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, UINT32_C(1) << 31), "Unknown flag");
+	FAIL_(crypt_init_by_name_flags(&cd, CDEVICE_2, NULL, CRYPT_INIT_METADATA_LAZY), "Not active");
+
+	// values from dm table only
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_METADATA_LAZY));
+	OK_(strcmp(crypt_get_type(cd), CRYPT_LUKS2));
+	OK_(strcmp(crypt_get_cipher(cd), "aes"));
+	OK_(strcmp(crypt_get_cipher_mode(cd), "xts-plain64"));
+	EQ_(crypt_get_volume_key_size(cd), key_size);
+	EQ_(crypt_get_sector_size(cd), 4096);
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	EQ_(cad.offset, r_payload_offset);
+
+	// header loaded on demand
+	OK_(strcmp(crypt_get_uuid(cd), uuid));
+	OK_(strcmp(crypt_get_label(cd), "lazylabel"));
+	OK_(strcmp(crypt_get_type(cd), CRYPT_LUKS2));
+	EQ_(crypt_get_data_offset(cd), r_payload_offset);
+	CRYPT_FREE(cd);
+
+	// metadata-only APIs trigger load as well
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_METADATA_LAZY));
+	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_INACTIVE);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_METADATA_LAZY));
+	OK_(crypt_get_integrity_info(cd, &ip));
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init_by_name_flags(&cd, CDEVICE_1, NULL, CRYPT_INIT_METADATA_LAZY));
+	OK_(!crypt_keyslot_get_encryption(cd, CRYPT_ANY_SLOT, &ks_size));
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void HeaderScanBatch(void)
+{
+	struct crypt_header_summary h[3] = {
+		{ .device = DMDIR H_DEVICE },
+		{ .device = "/dev/zero" },
+		{ .device = DMDIR H_DEVICE "_missing" },
+	};
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128], uuid[64];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	OK_(crypt_set_label(cd, "scanlabel", "scansubsystem"));
+	snprintf(uuid, sizeof(uuid), "%s", crypt_get_uuid(cd));
+	CRYPT_FREE(cd);
+
+	FAIL_(crypt_header_scan_batch(NULL, 1, 0), "No headers");
+	FAIL_(crypt_header_scan_batch(h, 0, 0), "No headers");
+
+	OK_(crypt_header_scan_batch(h, 3, 2));
+	OK_(h[0].result);
+	EQ_(h[0].version, 2);
+	OK_(strcmp(h[0].uuid, uuid));
+	OK_(strcmp(h[0].label, "scanlabel"));
+	OK_(strcmp(h[0].subsystem, "scansubsystem"));
+	EQ_(h[1].result, -EINVAL);
+	EQ_(h[2].result, -ENOENT);
+
+	_cleanup_dmdevices();
+}
+
+static void MemoryDevice(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2, vk_size;
+	uint64_t r_payload_offset;
+	char key[128], key2[128], *buf;
+	struct stat st;
+	int fd;
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	remove(BACKUP_FILE);
+	OK_(crypt_header_backup(cd, CRYPT_LUKS2, BACKUP_FILE));
+	CRYPT_FREE(cd);
+
+	fd = open(BACKUP_FILE, O_RDONLY);
+	GE_(fd, 0);
+	OK_(fstat(fd, &st));
+	buf = malloc(st.st_size);
+	NOTNULL_(buf);
+	EQ_(read(fd, buf, st.st_size), st.st_size);
+	close(fd);
+
+	FAIL_(crypt_init_by_buffer(&cd, NULL, st.st_size, 0), "No buffer");
+	FAIL_(crypt_init_by_buffer(&cd, buf, 0, 0), "Empty buffer");
+	FAIL_(crypt_init_by_buffer(&cd, buf, st.st_size, st.st_size - 1), "Device smaller than buffer");
+
+	OK_(crypt_init_by_buffer(&cd, buf, st.st_size, 0));
+	/* metadata changes must not touch the buffer */
+	memset(buf, 0, st.st_size);
+	free(buf);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	vk_size = key_size;
+	EQ_(crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &vk_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	EQ_(vk_size, key_size);
+	OK_(memcmp(key, key2, key_size));
+	FAIL_(crypt_activate_by_passphrase(cd, CDEVICE_1, 1, PASSPHRASE, strlen(PASSPHRASE), 0), "Memory device");
+	remove(BACKUP_FILE);
+	OK_(crypt_header_backup(cd, CRYPT_LUKS2, BACKUP_FILE));
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init(&cd, BACKUP_FILE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	CRYPT_FREE(cd);
+
+	remove(BACKUP_FILE);
+	_cleanup_dmdevices();
+}
+
+static void HeaderBackupBatch(void)
+{
+	struct crypt_header_backup_request b[2] = {
+		{ .requested_type = CRYPT_LUKS2, .backup_file = BACKUP_FILE },
+		{ .backup_file = BACKUP_FILE "2" },
+	};
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(set_fast_pbkdf(cd));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	CRYPT_FREE(cd);
+
+	remove(BACKUP_FILE);
+	remove(BACKUP_FILE "2");
+	FAIL_(crypt_header_backup_batch(NULL, 1), "No backups");
+	FAIL_(crypt_header_backup_batch(b, 1), "No device handle");
+
+	OK_(crypt_init(&b[0].cd, DMDIR H_DEVICE));
+	OK_(crypt_init(&b[1].cd, DMDIR H_DEVICE));
+	OK_(crypt_header_backup_batch(b, 2));
+	OK_(b[0].result);
+	OK_(b[1].result);
+	OK_(_system("cmp -s " BACKUP_FILE " " BACKUP_FILE "2", 1));
+
+	/* existing backup file must not be overwritten */
+	FAIL_(crypt_header_backup_batch(b, 2), "Backup file exists");
+	EQ_(b[0].result, -EINVAL);
+	crypt_free(b[0].cd);
+	crypt_free(b[1].cd);
+
+	/* restore from backup made by in-kernel copy */
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_header_restore(cd, CRYPT_LUKS2, BACKUP_FILE "2"));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	CRYPT_FREE(cd);
+
+	remove(BACKUP_FILE);
+	remove(BACKUP_FILE "2");
+	_cleanup_dmdevices();
+}
+
+static void ThreadAffinity(void)
+{
+	OK_(crypt_init(&cd, DEVICE_2));
+	FAIL_(crypt_set_thread_affinity(NULL, CRYPT_AFFINITY_DEVICE_NUMA), "No context");
+	FAIL_(crypt_set_thread_affinity(cd, 0x80), "Unknown flag");
+	OK_(crypt_set_thread_affinity(cd, CRYPT_AFFINITY_DEVICE_NUMA));
+	OK_(crypt_set_threads(cd, 4));
+
+	/* parallel wipe with bound workers and buffers */
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 1024*1024, 0, NULL, NULL));
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_RANDOM, 0, 4*1024*1024, 1024*1024, 0, NULL, NULL));
+
+	OK_(crypt_set_thread_affinity(cd, CRYPT_AFFINITY_NONE));
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 1024*1024, 0, NULL, NULL));
+	CRYPT_FREE(cd);
+}
+
+static int executor_serial(unsigned int jobs, int (*fn)(void *arg, unsigned int job),
+			   void *arg, void *usrptr)
+{
+	unsigned int job, *count = usrptr;
+	int r;
+
+	/* reverse order, library must not depend on job ordering */
+	for (job = jobs; job > 0; job--) {
+		(*count)++;
+		if ((r = fn(arg, job - 1)) < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static void ThreadExecutor(void)
+{
+	unsigned int count = 0;
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	FAIL_(crypt_set_executor(NULL, executor_serial, &count), "No context");
+	OK_(crypt_set_executor(cd, executor_serial, &count));
+	OK_(crypt_set_threads(cd, 4));
+
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 1024*1024, 0, NULL, NULL));
+	OK_(!count);
+
+	/* back to internal worker threads */
+	count = 0;
+	OK_(crypt_set_executor(cd, NULL, NULL));
+	OK_(crypt_wipe(cd, NULL, CRYPT_WIPE_ZERO, 0, 4*1024*1024, 1024*1024, 0, NULL, NULL));
+	EQ_(count, 0);
+	CRYPT_FREE(cd);
+}
+
+static void KeyslotsRebalance(void)
+{
+	struct crypt_pbkdf_type pbkdf = _fips_mode ? min_pbkdf2 : min_argon2;
+	struct crypt_keyslot_context *kc = NULL, *kc1 = NULL, *kcs[2];
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	/* short target time keeps the host benchmark fast */
+	pbkdf.time_ms = 100;
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE, strlen(PASSPHRASE), &kc));
+	OK_(crypt_keyslot_context_init_by_passphrase(cd, PASSPHRASE1, strlen(PASSPHRASE1), &kc1));
+	kcs[0] = kc;
+	kcs[1] = kc1;
+
+	FAIL_(crypt_keyslots_rebalance_by_keyslot_context(cd, NULL, 1, 0, 1000), "No contexts");
+	FAIL_(crypt_keyslots_rebalance_by_keyslot_context(cd, kcs, 0, 0, 1000), "No contexts");
+	FAIL_(crypt_keyslots_rebalance_by_keyslot_context(cd, kcs, 1, 1000, 10), "Invalid window");
+
+	/* minimal PBKDF cost is always within window */
+	EQ_(crypt_keyslots_rebalance_by_keyslot_context(cd, kcs, 2, 0, UINT32_MAX), 0);
+
+	/* too fast keyslots, only keyslot unlocked by provided context is rewrapped */
+	EQ_(crypt_keyslots_rebalance_by_keyslot_context(cd, kcs, 1, 50, 1000), 1);
+	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	CRYPT_FREE(cd);
+
+	crypt_keyslot_context_free(kc);
+	crypt_keyslot_context_free(kc1);
+	_cleanup_dmdevices();
+}
+
+static void KeyslotAreaAllocation(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset, offsets[4], offset, length;
+	char key[128];
+	int i;
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+
+	/* consecutive allocations get increasing areas */
+	for (i = 0; i < 4; i++) {
+		EQ_(crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), i);
+		OK_(crypt_keyslot_area(cd, i, &offsets[i], &length));
+		if (i)
+			OK_(offsets[i] <= offsets[i - 1]);
+	}
+
+	/* freed area is reused first */
+	OK_(crypt_keyslot_destroy(cd, 1));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	OK_(crypt_keyslot_area(cd, 1, &offset, &length));
+	EQ_(offset, offsets[1]);
+
+	OK_(crypt_keyslot_destroy(cd, 0));
+	OK_(crypt_keyslot_destroy(cd, 2));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(crypt_keyslot_area(cd, 0, &offset, &length));
+	EQ_(offset, offsets[0]);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+	OK_(crypt_keyslot_area(cd, 2, &offset, &length));
+	EQ_(offset, offsets[2]);
+	CRYPT_FREE(cd);
+
+	/* areas are the same after reload */
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	for (i = 0; i < 4; i++) {
+		OK_(crypt_keyslot_area(cd, i, &offset, &length));
+		EQ_(offset, offsets[i]);
+	}
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void ContextClone(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	FAIL_(crypt_context_clone(&cd2, cd), "No header loaded");
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	FAIL_(crypt_context_clone(NULL, cd), "No clone handle");
+
+	/* clone sees the same header, changes are private until reload */
+	OK_(crypt_context_clone(&cd2, cd));
+	OK_(strcmp(crypt_get_type(cd2), CRYPT_LUKS2));
+	OK_(strcmp(crypt_get_uuid(cd2), crypt_get_uuid(cd)));
+	EQ_(crypt_keyslot_status(cd2, 0), CRYPT_SLOT_ACTIVE_LAST);
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 1, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_INACTIVE);
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+	CRYPT_FREE(cd2);
+
+	/* memory lean context */
+	FAIL_(crypt_set_memory_lean(NULL, 1), "No context");
+	OK_(crypt_set_memory_lean(cd, 1));
+	OK_(crypt_context_clone(&cd2, cd));
+	CRYPT_FREE(cd);
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+	FAIL_(crypt_keyslot_add_by_volume_key(cd2, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), "Keyslot in use");
+	OK_(crypt_keyslot_destroy(cd2, 2));
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	OK_(crypt_set_memory_lean(cd2, 0));
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+	CRYPT_FREE(cd2);
+
+	_cleanup_dmdevices();
+}
+
+static void KeyslotTelemetry(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	struct crypt_keyslot_telemetry telemetry;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+
+	/* disabled by default, nothing is recorded */
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	EQ_(crypt_keyslot_get_telemetry(cd, 1, &telemetry), -ENOENT);
+	FAIL_(crypt_keyslot_get_telemetry(cd, 1, NULL), "No telemetry buffer");
+	FAIL_(crypt_keyslot_get_telemetry(cd, 32, &telemetry), "Invalid keyslot");
+
+	/* only activation is recorded, not passphrase checks or volume key reads */
+	OK_(crypt_keyslot_set_telemetry(cd, 1));
+	EQ_(crypt_keyslot_get_telemetry(cd, 1, &telemetry), -ENOENT);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	key_size = sizeof(key);
+	EQ_(crypt_volume_key_get(cd, 1, key, &key_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	EQ_(crypt_keyslot_get_telemetry(cd, 1, &telemetry), -ENOENT);
+
+	/* the most used keyslot is tried first in the same priority class */
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 2, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	EQ_(crypt_activate_by_passphrase(cd, CDEVICE_1, 2, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	FAIL_(crypt_activate_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), "Wrong passphrase");
+	OK_(crypt_keyslot_get_telemetry(cd, 1, &telemetry));
+	EQ_(telemetry.unlocks, 1);
+	OK_(crypt_keyslot_get_telemetry(cd, 2, &telemetry));
+	EQ_(telemetry.unlocks, 2);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+	OK_(crypt_keyslot_get_telemetry(cd, 2, &telemetry));
+	EQ_(telemetry.unlocks, 2);
+
+	/* priority still wins over telemetry */
+	OK_(crypt_keyslot_set_priority(cd, 1, CRYPT_SLOT_PRIORITY_PREFER));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(crypt_keyslot_set_priority(cd, 1, CRYPT_SLOT_PRIORITY_NORMAL));
+
+	/* telemetry is stored in metadata */
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_keyslot_get_telemetry(cd, 2, &telemetry));
+	EQ_(telemetry.unlocks, 2);
+
+	/* removed keyslot loses its telemetry */
+	OK_(crypt_keyslot_destroy(cd, 2));
+	EQ_(crypt_keyslot_get_telemetry(cd, 2, &telemetry), -ENOENT);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+	EQ_(crypt_keyslot_get_telemetry(cd, 2, &telemetry), -ENOENT);
+
+	/* disabling removes all recorded data */
+	OK_(crypt_keyslot_set_telemetry(cd, 0));
+	EQ_(crypt_keyslot_get_telemetry(cd, 1, &telemetry), -ENOENT);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	EQ_(crypt_keyslot_get_telemetry(cd, 1, &telemetry), -ENOENT);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void KeyslotHint(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	const char *hint_dir = "keyslot-hint-test";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+	(void)rmdir(hint_dir);
+	OK_(mkdir(hint_dir, 0700));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+
+	/* explicit hint */
+	FAIL_(crypt_set_keyslot_hint(cd, -2), "Invalid keyslot");
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(crypt_set_keyslot_hint(cd, 2));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), "Wrong passphrase");
+	OK_(crypt_set_keyslot_hint(cd, 5));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+
+	/* priority still wins over hint */
+	OK_(crypt_set_keyslot_hint(cd, 2));
+	OK_(crypt_keyslot_set_priority(cd, 1, CRYPT_SLOT_PRIORITY_PREFER));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(crypt_keyslot_set_priority(cd, 1, CRYPT_SLOT_PRIORITY_NORMAL));
+
+	/* successful keyslot is cached for the next context */
+	OK_(crypt_set_keyslot_hint_cache(cd, hint_dir));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(crypt_set_keyslot_hint_cache(cd, hint_dir));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+
+	/* explicit hint takes precedence and updates the cache */
+	OK_(crypt_set_keyslot_hint(cd, 1));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(crypt_set_keyslot_hint(cd, CRYPT_ANY_SLOT));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+
+	/* cache is ignored for removed keyslot */
+	OK_(crypt_keyslot_destroy(cd, 1));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 2);
+	OK_(crypt_set_keyslot_hint_cache(cd, NULL));
+	CRYPT_FREE(cd);
+
+	_system("rm -rf keyslot-hint-test", 0);
+	_cleanup_dmdevices();
+}
+
+static void TokenBatch(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	struct crypt_token_update updates[3] = {
+		{ .token = CRYPT_ANY_TOKEN, .json = "{\"type\":\"batch-a\",\"keyslots\":[\"0\"]}" },
+		{ .token = CRYPT_ANY_TOKEN, .json = "{\"type\":\"batch-b\",\"keyslots\":[]}" },
+		{ .token = 5, .json = "{\"type\":\"batch-c\",\"keyslots\":[]}" },
+	};
+	uint64_t r_payload_offset;
+	const char *json, *type;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	FAIL_(crypt_token_json_set_batch(cd, NULL, 1), "No updates");
+	FAIL_(crypt_token_json_set_batch(cd, updates, 0), "No updates");
+
+	/* import */
+	OK_(crypt_token_json_set_batch(cd, updates, 3));
+	EQ_(updates[0].result, 0);
+	EQ_(updates[1].result, 1);
+	EQ_(updates[2].result, 5);
+	EQ_(crypt_token_status(cd, 1, &type), CRYPT_TOKEN_EXTERNAL_UNKNOWN);
+	OK_(strcmp(type, "batch-b"));
+	EQ_(crypt_token_is_assigned(cd, 0, 0), 0);
+
+	/* replace and remove, stored in metadata */
+	updates[0].token = 0;
+	updates[0].json = "{\"type\":\"batch-d\",\"keyslots\":[]}";
+	updates[1].token = 1;
+	updates[1].json = NULL;
+	OK_(crypt_token_json_set_batch(cd, updates, 2));
+	CRYPT_FREE(cd);
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_token_json_get(cd, 0, &json), 0);
+	OK_(!strstr(json, "batch-d"));
+	EQ_(crypt_token_status(cd, 1, NULL), CRYPT_TOKEN_INACTIVE);
+	EQ_(crypt_token_status(cd, 5, NULL), CRYPT_TOKEN_EXTERNAL_UNKNOWN);
+
+	/* invalid token cancels the whole batch */
+	updates[0].token = 5;
+	updates[0].json = NULL;
+	updates[1].token = 2;
+	updates[1].json = "{\"type\":\"batch-e\",\"keyslots\":[\"7\"]}";
+	FAIL_(crypt_token_json_set_batch(cd, updates, 2), "Token references missing keyslot");
+	EQ_(updates[0].result, -EINVAL);
+	EQ_(updates[1].result, -EINVAL);
+	EQ_(crypt_token_status(cd, 5, NULL), CRYPT_TOKEN_EXTERNAL_UNKNOWN);
+	EQ_(crypt_token_status(cd, 2, NULL), CRYPT_TOKEN_INACTIVE);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void TokenEscrow(void)
+{
+#ifdef KERNEL_KEYRING
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	const struct crypt_token_params_luks2_escrow params = {
+		.key_description = KEY_DESC_TEST0
+	}, params_missing = {
+		.key_description = KEY_DESC_TEST1
+	};
+	uint64_t r_payload_offset;
+	struct crypt_keyslot_context *kc;
+	key_serial_t kid;
+	const char *type;
+	char key[128], key2[128];
+
+	if (!t_dm_crypt_keyring_support()) {
+		printf("WARNING: Kernel keyring not supported, skipping test.\n");
+		return;
+	}
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	kid = add_key("user", KEY_DESC_TEST0, PASSPHRASE1, strlen(PASSPHRASE1), KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	FAIL_(crypt_token_luks2_escrow_set(cd, CRYPT_ANY_TOKEN, 0, PASSPHRASE, strlen(PASSPHRASE), NULL), "No params");
+	FAIL_(crypt_token_luks2_escrow_set(cd, CRYPT_ANY_TOKEN, 0, PASSPHRASE1, strlen(PASSPHRASE1), &params), "Wrong passphrase");
+	FAIL_(crypt_token_luks2_escrow_set(cd, CRYPT_ANY_TOKEN, 0, PASSPHRASE, strlen(PASSPHRASE), &params_missing), "Missing host key");
+	EQ_(crypt_token_luks2_escrow_set(cd, CRYPT_ANY_TOKEN, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), &params), 0);
+	EQ_(crypt_token_status(cd, 0, &type), CRYPT_TOKEN_INTERNAL);
+	OK_(strcmp(type, "luks2-escrow"));
+	EQ_(crypt_token_is_assigned(cd, 0, 0), 0);
+	CRYPT_FREE(cd);
+
+	/* unlock by token, volume key must match */
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_token(cd, NULL, CRYPT_ANY_TOKEN, NULL, 0), 0);
+	EQ_(crypt_activate_by_token(cd, CDEVICE_1, 0, NULL, 0), 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_keyslot_context_init_by_token(cd, 0, NULL, NULL, 0, NULL, &kc));
+	EQ_(crypt_volume_key_get_by_keyslot_context(cd, CRYPT_ANY_SLOT, key2, &key_size, kc), 0);
+	OK_(memcmp(key, key2, key_size));
+	crypt_keyslot_context_free(kc);
+
+	/* wrong host key */
+	NOTFAIL_(keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING), "Test or kernel keyring are broken.");
+	kid = add_key("user", KEY_DESC_TEST0, PASSPHRASE, strlen(PASSPHRASE), KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+	EQ_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), -EPERM);
+
+	/* missing host key, passphrase keyslot is fallback */
+	NOTFAIL_(keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING), "Test or kernel keyring are broken.");
+	FAIL_(crypt_activate_by_token(cd, NULL, 0, NULL, 0), "Missing host key");
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+#else
+	printf("WARNING: cryptsetup compiled with kernel keyring service disabled, skipping test.\n");
+#endif
+}
+
+static void KeyslotContextCache(void)
+{
+#ifdef KERNEL_KEYRING
+	const struct crypt_token_params_luks2_keyring params = {
+		.key_description = KEY_DESC_TEST0
+	};
+	struct crypt_keyslot_context *kc;
+	uint64_t r_payload_offset;
+	key_serial_t kid;
+	size_t key_size = 32;
+	char key[128];
+
+	if (!t_dm_crypt_keyring_support()) {
+		printf("WARNING: Kernel keyring not supported, skipping test.\n");
+		return;
+	}
+
+	kid = add_key("user", KEY_DESC_TEST0, PASSPHRASE, strlen(PASSPHRASE), KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, NULL, 32, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_token_luks2_keyring_set(cd, 0, &params), 0);
+	EQ_(crypt_token_assign_keyslot(cd, 0, 0), 0);
+
+	/* buffer that did not open keyslot is not kept */
+	kid = add_key("user", KEY_DESC_TEST0, "xxx", 3, KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+	OK_(crypt_keyslot_context_init_by_token(cd, 0, NULL, NULL, 0, NULL, &kc));
+	FAIL_(crypt_volume_key_get_by_keyslot_context(cd, CRYPT_ANY_SLOT, key, &key_size, kc), "Wrong passphrase");
+	kid = add_key("user", KEY_DESC_TEST0, PASSPHRASE, strlen(PASSPHRASE), KEY_SPEC_THREAD_KEYRING);
+	NOTFAIL_(kid, "Test or kernel keyring are broken.");
+	EQ_(crypt_volume_key_get_by_keyslot_context(cd, CRYPT_ANY_SLOT, key, &key_size, kc), 0);
+	crypt_keyslot_context_free(kc);
+
+	/* token buffer is fetched once, context keeps it for later unlocks */
+	OK_(crypt_keyslot_context_init_by_token(cd, 0, NULL, NULL, 0, NULL, &kc));
+	EQ_(crypt_volume_key_get_by_keyslot_context(cd, CRYPT_ANY_SLOT, key, &key_size, kc), 0);
+	NOTFAIL_(keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING), "Test or kernel keyring are broken.");
+	EQ_(crypt_volume_key_get_by_keyslot_context(cd, CRYPT_ANY_SLOT, key, &key_size, kc), 0);
+	crypt_keyslot_context_free(kc);
+
+	/* new context has to call token handler again */
+	OK_(crypt_keyslot_context_init_by_token(cd, 0, NULL, NULL, 0, NULL, &kc));
+	FAIL_(crypt_volume_key_get_by_keyslot_context(cd, CRYPT_ANY_SLOT, key, &key_size, kc), "Missing key");
+	crypt_keyslot_context_free(kc);
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+#else
+	printf("WARNING: cryptsetup compiled with kernel keyring service disabled, skipping test.\n");
+#endif
+}
+
+/* Compare JSON areas of both LUKS2 header copies (default 16 KiB header) */
+static int _luks2_hdr_copies_equal(const char *device)
+{
+	char json1[16384 - 4096], json2[16384 - 4096];
+	int fd, r = 0;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (pread(fd, json1, sizeof(json1), 4096) == (ssize_t)sizeof(json1) &&
+	    pread(fd, json2, sizeof(json2), 16384 + 4096) == (ssize_t)sizeof(json2))
+		r = !memcmp(json1, json2, sizeof(json1));
+
+	close(fd);
+	return r;
+}
+
+static int _luks2_hdr_corrupt_secondary(const char *device)
+{
+	const char junk[] = "corrupted";
+	int fd, r;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		return -EINVAL;
+
+	r = pwrite(fd, junk, sizeof(junk), 16384 + 4096 + 8192) == (ssize_t)sizeof(junk) ? 0 : -EIO;
+	if (!r)
+		r = fsync(fd);
+
+	close(fd);
+	return r;
+}
+
+static void Luks2HeaderWrite(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(vk_hex) / 2;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	OK_(crypt_set_label(cd, "label", NULL));
+	OK_(_luks2_hdr_copies_equal(DMDIR H_DEVICE) ? 0 : -1);
+
+	/* secondary copy corrupted after load is rewritten even if metadata are unchanged */
+	OK_(_luks2_hdr_corrupt_secondary(DMDIR H_DEVICE));
+	OK_(crypt_set_label(cd, "label", NULL));
+	OK_(_luks2_hdr_copies_equal(DMDIR H_DEVICE) ? 0 : -1);
+
+	/* partial update of changed metadata repairs the secondary copy as well */
+	OK_(_luks2_hdr_corrupt_secondary(DMDIR H_DEVICE));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 1);
+	OK_(_luks2_hdr_copies_equal(DMDIR H_DEVICE) ? 0 : -1);
+	CRYPT_FREE(cd);
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE, strlen(PASSPHRASE), 0), 1);
+	OK_(strcmp(crypt_get_label(cd), "label"));
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
+static void Luks2InlineCrypt(void)
+{
+	const char *vk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a"
+			     "a6de7a1abb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78";
+	size_t key_size = strlen(vk_hex) / 2;
+	struct crypt_active_device cad;
+	uint64_t r_payload_offset;
+	char key[128];
+
+	crypt_decode_key(key, vk_hex, key_size);
+
+	OK_(get_luks2_offsets(0, 0, 0, NULL, &r_payload_offset));
+	OK_(create_dmdevice_over_loop(H_DEVICE, r_payload_offset + 1));
+
+	OK_(crypt_init(&cd, DMDIR H_DEVICE));
+	OK_(crypt_set_pbkdf_type(cd, &min_pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+
+	/* inline encryption passes volume key in table, keyring cannot be used */
+	FAIL_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size,
+		CRYPT_ACTIVATE_INLINE_CRYPT | CRYPT_ACTIVATE_KEYRING_KEY), "Keyring with inline encryption.");
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_INACTIVE);
+
+	/* loop device has no inline encryption engine, dm-crypt is used */
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, CRYPT_ACTIVATE_INLINE_CRYPT));
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	EQ_(cad.flags & CRYPT_ACTIVATE_INLINE_CRYPT, 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+
+	/* inline encryption is used only on request */
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, key, key_size, 0));
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	EQ_(cad.flags & CRYPT_ACTIVATE_INLINE_CRYPT, 0);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	CRYPT_FREE(cd);
+
+	_cleanup_dmdevices();
+}
+
 static int _crypt_load_check(struct crypt_device *_cd)
 {
 #ifdef HAVE_BLKID
@@ -5136,6 +6810,29 @@ int main(int argc, char *argv[])
 #endif
 	RUN_(LuksKeyslotAdd, "Adding keyslot via new API");
 	RUN_(VolumeKeyGet, "Getting volume key via keyslot context API");
+	RUN_(KeyslotsAddBatch, "Adding more keyslots at once");
+	RUN_(VolumeKeyCache, "Process-wide volume key cache");
+	RUN_(ConcurrentContexts, "Independent contexts used from multiple threads");
+	RUN_(Tracing, "Tracing of library operations");
+	RUN_(Statistics, "Process-wide library statistics");
+	RUN_(StatusAll, "Status of all active devices");
+	RUN_(DeactivateBatch, "Deactivation of many devices");
+	RUN_(InitByNameLazy, "Init by name with postponed header load");
+	RUN_(HeaderScanBatch, "Scan of LUKS binary headers");
+	RUN_(MemoryDevice, "Metadata operations on memory buffer");
+	RUN_(HeaderBackupBatch, "Parallel header backup");
+	RUN_(KeyslotsRebalance, "Rebalance of keyslot PBKDF cost");
+	RUN_(KeyslotAreaAllocation, "Keyslot area allocation");
+	RUN_(ContextClone, "Context cloning and memory lean mode");
+	RUN_(KeyslotTelemetry, "Keyslot unlock telemetry");
+	RUN_(KeyslotHint, "Keyslot trial hint");
+	RUN_(TokenBatch, "Token batch update");
+	RUN_(ThreadAffinity, "NUMA affinity of worker threads");
+	RUN_(ThreadExecutor, "Application supplied executor");
+	RUN_(TokenEscrow, "Builtin volume key escrow token");
+	RUN_(KeyslotContextCache, "Keyslot context keeps token buffer");
+	RUN_(Luks2HeaderWrite, "LUKS2 header partial write");
+	RUN_(Luks2InlineCrypt, "LUKS2 inline encryption request");
 	RUN_(Luks2Repair, "LUKS2 repair"); // test disables metadata locking. Run always last!
 
 	_cleanup();
@@ -1007,6 +1007,12 @@ static void AddDeviceLuks(void)
 	FAIL_(crypt_activate_by_keyfile_offset(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, strlen(KEY2), 2, 0), "not enough data");
 	FAIL_(crypt_activate_by_keyfile_offset(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, 0, strlen(KEY2) + 1, 0), "cannot seek");
 	FAIL_(crypt_activate_by_keyfile_offset(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, 0, 2, 0), "wrong key");
+	OK_(crypt_parallel_unlock(cd, 1));
+	EQ_(1, crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, KEY1, strlen(KEY1), 0));
+	EQ_(7, crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, passphrase, strlen(passphrase), 0));
+	EQ_(2, crypt_activate_by_keyfile(cd, NULL, CRYPT_ANY_SLOT, KEYFILE2, 0, 0));
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, passphrase2, strlen(passphrase2), 0), "wrong key");
+	OK_(crypt_parallel_unlock(cd, 0));
 	EQ_(2, crypt_activate_by_keyfile(cd, CDEVICE_2, CRYPT_ANY_SLOT, KEYFILE2, 0, 0));
 	OK_(crypt_keyslot_destroy(cd, 1));
 	OK_(crypt_keyslot_destroy(cd, 2));
@@ -1079,6 +1085,7 @@ static void AddDeviceLuks(void)
 static void UseTempVolumes(void)
 {
 	char tmp[256];
+	uint32_t perf_flags;
 
 	// Tepmporary device without keyslot but with on-disk LUKS header
 	OK_(crypt_init(&cd, DEVICE_2));
@@ -1089,7 +1096,28 @@ static void UseTempVolumes(void)
 	CRYPT_FREE(cd);
 
 	OK_(crypt_init_by_name(&cd, CDEVICE_2));
+	OK_(crypt_refresh_dm_features(cd));
+	GE_(crypt_status(cd, CDEVICE_2), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_2));
+	CRYPT_FREE(cd);
+	OK_(crypt_refresh_dm_features(NULL));
+
+	// Deferred udev synchronization
+	OK_(crypt_udev_settle(0));
+	OK_(crypt_udev_defer(1));
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_format(cd, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, 16, NULL));
+	OK_(crypt_activate_by_volume_key(cd, CDEVICE_2, NULL, 0, 0));
+	OK_(crypt_udev_settle(1));
+	GE_(crypt_status(cd, CDEVICE_2), CRYPT_ACTIVE);
 	OK_(crypt_deactivate(cd, CDEVICE_2));
+	OK_(crypt_udev_defer(0));
+	OK_(crypt_udev_settle(0));
+	EQ_(crypt_status(cd, CDEVICE_2), CRYPT_INACTIVE);
+	FAIL_(crypt_perf_flags_suggest(cd, NULL), "no flags");
+	OK_(crypt_perf_flags_suggest(cd, &perf_flags));
+	EQ_(perf_flags & ~(CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS |
+			   CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE), 0);
 	CRYPT_FREE(cd);
 
 	// Dirty checks: device without UUID
@@ -1636,6 +1664,8 @@ static void VerityTest(void)
 	char salt[256], root_hash[256], root_hash_out[256];
 	size_t root_hash_out_size = 256;
 	struct crypt_active_device cad;
+	struct crypt_verity_activation va = {};
+	struct crypt_verity_load vl[2] = {};
 	struct crypt_params_verity params = {
 		.data_device = DEVICE_EMPTY,
 		.salt = salt,
@@ -1685,6 +1715,19 @@ static void VerityTest(void)
 	EQ_(strcmp(DEVICE_2, crypt_get_metadata_device_name(cd)), 0);
 	CRYPT_FREE(cd);
 
+	/* batch load */
+	OK_(crypt_init_data_device(&vl[0].cd, DEVICE_2, DEVICE_EMPTY));
+	OK_(crypt_init_data_device(&vl[1].cd, DEVICE_1, DEVICE_EMPTY));
+	FAIL_(crypt_load_verity_batch(NULL, 1), "No loads");
+	FAIL_(crypt_load_verity_batch(vl, 2), "Not a VERITY device");
+	EQ_(vl[0].result, 0);
+	FAIL_(vl[1].result, "Not a VERITY device");
+	OK_(strcmp(CRYPT_VERITY, crypt_get_type(vl[0].cd)));
+	EQ_(crypt_get_volume_key_size(vl[0].cd), 32);
+	OK_(crypt_load_verity_batch(vl, 1));
+	crypt_free(vl[0].cd);
+	crypt_free(vl[1].cd);
+
 	/* Verify */
 	OK_(crypt_init(&cd, DEVICE_2));
 	memset(&params, 0, sizeof(params));
@@ -1741,6 +1784,20 @@ static void VerityTest(void)
 	OK_(crypt_deactivate(cd, CDEVICE_1));
 	root_hash[1] = ~root_hash[1];
 
+	/* batch activation */
+	va.cd = cd;
+	va.name = CDEVICE_1;
+	va.root_hash = root_hash;
+	va.root_hash_size = 32;
+	va.flags = CRYPT_ACTIVATE_READONLY;
+	FAIL_(crypt_activate_by_signed_key_batch(NULL, 1), "No activations");
+	OK_(crypt_activate_by_signed_key_batch(&va, 1));
+	EQ_(va.result, 0);
+	GE_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_activate_by_signed_key_batch(&va, 1), -EEXIST);
+	EQ_(va.result, -EEXIST);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+
 	/* data fail */
 	OK_(crypt_set_data_device(cd, DEVICE_1));
 	OK_(crypt_activate_by_volume_key(cd, CDEVICE_1, root_hash, 32, CRYPT_ACTIVATE_READONLY));
@@ -2017,13 +2074,16 @@ static void IntegrityTest(void)
 		.tag_size = 4,
 		.integrity = "crc32c",
 		.sector_size = 4096,
-	}, ip = {};
+	}, ip = {}, tp = {};
+	struct crypt_integrity_tune tune;
 	struct crypt_active_device cad;
 	int ret;
 
 	// FIXME: this should be more detailed
 
 	OK_(crypt_init(&cd,DEVICE_1));
+	FAIL_(crypt_integrity_tune(cd, CRYPT_INTEGRITY_TUNE_JOURNAL, NULL, &tune), "params field required");
+	FAIL_(crypt_integrity_tune(cd, CRYPT_INTEGRITY_TUNE_DIRECT + 1, &tp, &tune), "invalid mode");
 	FAIL_(crypt_format(cd,CRYPT_INTEGRITY,NULL,NULL,NULL,NULL,0,NULL), "params field required");
 	ret = crypt_format(cd,CRYPT_INTEGRITY,NULL,NULL,NULL,NULL,0,&params);
 	if (ret < 0) {
@@ -2083,6 +2143,7 @@ static void WipeTest(void)
 	OK_(crypt_wipe(cd, DEVICE_1, CRYPT_WIPE_ZERO, 0, 4096, 0, 0, NULL, NULL));
 	OK_(crypt_wipe(cd, DEVICE_1, CRYPT_WIPE_RANDOM, 0, 4096, 0, 0, NULL, NULL));
 	OK_(crypt_wipe(cd, DEVICE_1, CRYPT_WIPE_RANDOM, 0, 4096, 0, CRYPT_WIPE_NO_DIRECT_IO, NULL, NULL));
+	OK_(crypt_wipe(cd, DEVICE_1, CRYPT_WIPE_ZERO, 0, 4096, 0, CRYPT_WIPE_ALLOW_DISCARD, NULL, NULL));
 	CRYPT_FREE(cd);
 
 	OK_(crypt_init(&cd, DEVICE_1));
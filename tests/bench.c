@@ -0,0 +1,539 @@
+/*
+ * cryptsetup library microbenchmarks
+ *
+ * Copyright (C) 2023 Red Hat, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Every benchmark case is run BENCH_REPEATS times with the same fixed
+ * parameters, one JSON object per case is printed to stdout:
+ *
+ * {"benchmark":"storage-encrypt","case":"aes-xts-plain64/512","repeats":5,
+ *  "iterations":64,"bytes":67108864,"min_ns":"...","median_ns":"...","mib_s":"..."}
+ *
+ * Device based benchmarks (verity, LUKS2 header, wipe) use the device given
+ * on command line (loop or ramdisk of at least 88 MiB, its content is DESTROYED)
+ * or a temporary file in the current directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "luks1/af.h"
+
+#define BENCH_REPEATS	5
+#define BENCH_MIB	(1024 * 1024)
+
+#define DATA_SIZE	(64 * BENCH_MIB)
+#define HASH_SIZE	(4 * BENCH_MIB)
+#define FEC_SIZE	(4 * BENCH_MIB)
+#define HDR_SIZE	(16 * BENCH_MIB)
+
+static const char *filter;
+static const char *bench_device;
+static char tmp_file[] = "./bench-tmp-XXXXXX";
+static char data_path[PATH_MAX], hash_path[PATH_MAX], fec_path[PATH_MAX];
+
+struct bench_case {
+	const char *benchmark;
+	const char *name;
+	unsigned int iterations;
+	uint64_t bytes;		/* processed by all iterations */
+	int (*run)(struct bench_case *c);
+	void *ctx;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_run(struct bench_case *c)
+{
+	uint64_t t[BENCH_REPEATS], start;
+	double mib_s = 0;
+	int i, r;
+
+	if (filter && !strstr(c->benchmark, filter))
+		return 0;
+
+	/* warm up caches and lazy initialization */
+	if ((r = c->run(c)) < 0) {
+		fprintf(stderr, "Benchmark %s (%s) failed (%d).\n", c->benchmark, c->name, r);
+		return r;
+	}
+
+	for (i = 0; i < BENCH_REPEATS; i++) {
+		start = now_ns();
+		if ((r = c->run(c)) < 0) {
+			fprintf(stderr, "Benchmark %s (%s) failed (%d).\n", c->benchmark, c->name, r);
+			return r;
+		}
+		t[i] = now_ns() - start;
+	}
+
+	qsort(t, BENCH_REPEATS, sizeof(*t), cmp_u64);
+	if (c->bytes && t[BENCH_REPEATS / 2])
+		mib_s = (double)c->bytes / BENCH_MIB / (t[BENCH_REPEATS / 2] / 1E9);
+
+	printf("{\"benchmark\":\"%s\",\"case\":\"%s\",\"repeats\":%d,\"iterations\":%u,"
+	       "\"bytes\":\"%" PRIu64 "\",\"min_ns\":\"%" PRIu64 "\",\"median_ns\":\"%" PRIu64 "\","
+	       "\"mib_s\":\"%.1f\"}\n", c->benchmark, c->name, BENCH_REPEATS, c->iterations,
+	       c->bytes, t[0], t[BENCH_REPEATS / 2], mib_s);
+	fflush(stdout);
+
+	return 0;
+}
+
+/* crypt_storage_encrypt */
+struct storage_ctx {
+	struct crypt_storage *s;
+	char *buf;
+	size_t buf_size;
+};
+
+static int run_storage(struct bench_case *c)
+{
+	struct storage_ctx *sc = c->ctx;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < c->iterations; i++)
+		if ((r = crypt_storage_encrypt(sc->s, (uint64_t)i * (sc->buf_size >> SECTOR_SHIFT),
+					       sc->buf_size, sc->buf)))
+			return r;
+	return 0;
+}
+
+static int bench_storage(const char *cipher, const char *mode, size_t key_size, size_t sector_size)
+{
+	struct storage_ctx sc = { .buf_size = BENCH_MIB };
+	char key[64] = {}, name[64];
+	struct bench_case c = {
+		.benchmark = "storage-encrypt",
+		.name = name,
+		.iterations = 64,
+		.run = run_storage,
+		.ctx = &sc,
+	};
+	int r;
+
+	snprintf(name, sizeof(name), "%s-%s/%zu", cipher, mode, sector_size);
+	c.bytes = (uint64_t)c.iterations * sc.buf_size;
+
+	r = crypt_storage_init(&sc.s, sector_size, cipher, mode, key, key_size, false);
+	if (r < 0) {
+		fprintf(stderr, "Cipher %s-%s not available, skipped.\n", cipher, mode);
+		return 0;
+	}
+
+	sc.buf = aligned_alloc(4096, sc.buf_size);
+	if (!sc.buf) {
+		crypt_storage_destroy(sc.s);
+		return -ENOMEM;
+	}
+	memset(sc.buf, 0x5a, sc.buf_size);
+
+	r = bench_run(&c);
+
+	free(sc.buf);
+	crypt_storage_destroy(sc.s);
+	return r;
+}
+
+/* AF_split / AF_merge */
+struct af_ctx {
+	char key[64];
+	char *split;
+	size_t key_size;
+	unsigned int stripes;
+	const char *hash;
+};
+
+static int run_af_split(struct bench_case *c)
+{
+	struct af_ctx *ac = c->ctx;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < c->iterations; i++)
+		if ((r = AF_split(NULL, ac->key, ac->split, ac->key_size, ac->stripes, ac->hash)))
+			return r;
+	return 0;
+}
+
+static int run_af_merge(struct bench_case *c)
+{
+	struct af_ctx *ac = c->ctx;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < c->iterations; i++)
+		if ((r = AF_merge(ac->split, ac->key, ac->key_size, ac->stripes, ac->hash)))
+			return r;
+	return 0;
+}
+
+static int bench_af(const char *hash)
+{
+	struct af_ctx ac = { .key_size = 64, .stripes = 4000, .hash = hash };
+	char name[64];
+	struct bench_case c = {
+		.name = name,
+		.iterations = 32,
+		.ctx = &ac,
+	};
+	int r;
+
+	snprintf(name, sizeof(name), "%s/%zu/%u", hash, ac.key_size, ac.stripes);
+	c.bytes = (uint64_t)c.iterations * ac.key_size * ac.stripes;
+
+	ac.split = crypt_safe_alloc(ac.key_size * ac.stripes);
+	if (!ac.split)
+		return -ENOMEM;
+
+	c.benchmark = "af-split";
+	c.run = run_af_split;
+	r = bench_run(&c);
+	if (!r) {
+		c.benchmark = "af-merge";
+		c.run = run_af_merge;
+		r = bench_run(&c);
+	}
+
+	crypt_safe_free(ac.split);
+	return r;
+}
+
+/* crypt_pbkdf */
+struct pbkdf_ctx {
+	const char *kdf;
+	const char *hash;
+	uint32_t iterations, memory, parallel;
+};
+
+static int run_pbkdf(struct bench_case *c)
+{
+	struct pbkdf_ctx *pc = c->ctx;
+	char key[64];
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < c->iterations; i++)
+		if ((r = crypt_pbkdf(pc->kdf, pc->hash, "password", 8, "saltsaltsaltsalt", 16,
+				     key, sizeof(key), pc->iterations, pc->memory, pc->parallel)))
+			return r;
+	return 0;
+}
+
+static int bench_pbkdf(const char *kdf, const char *hash, uint32_t iterations,
+		       uint32_t memory, uint32_t parallel)
+{
+	struct pbkdf_ctx pc = { kdf, hash, iterations, memory, parallel };
+	char name[64];
+	struct bench_case c = {
+		.benchmark = "pbkdf",
+		.name = name,
+		.iterations = 1,
+		.run = run_pbkdf,
+		.ctx = &pc,
+	};
+
+	if (memory)
+		snprintf(name, sizeof(name), "%s/t%u/m%u/p%u", kdf, iterations, memory, parallel);
+	else
+		snprintf(name, sizeof(name), "%s-%s/%u", kdf, hash, iterations);
+
+	return bench_run(&c);
+}
+
+/* device based benchmarks */
+static int device_paths(void)
+{
+	int fd;
+
+	if (bench_device) {
+		/* data, hash and FEC areas are in separate parts of the same device */
+		snprintf(data_path, sizeof(data_path), "%s", bench_device);
+		snprintf(hash_path, sizeof(hash_path), "%s", bench_device);
+		snprintf(fec_path, sizeof(fec_path), "%s", bench_device);
+		return 0;
+	}
+
+	fd = mkstemp(tmp_file);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, DATA_SIZE + HASH_SIZE + FEC_SIZE + HDR_SIZE)) {
+		close(fd);
+		unlink(tmp_file);
+		return -EIO;
+	}
+	close(fd);
+
+	snprintf(data_path, sizeof(data_path), "%s", tmp_file);
+	snprintf(hash_path, sizeof(hash_path), "%s", tmp_file);
+	snprintf(fec_path, sizeof(fec_path), "%s", tmp_file);
+	return 0;
+}
+
+/* VERITY create_or_verify_hash and FEC_process_inputs */
+struct verity_ctx {
+	bool fec;
+	bool verify;
+	char root_hash[64];
+	size_t root_hash_size;
+};
+
+static int run_verity(struct bench_case *c)
+{
+	struct verity_ctx *vc = c->ctx;
+	struct crypt_device *cd;
+	struct crypt_params_verity params = {
+		.hash_name = "sha256",
+		.data_device = data_path,
+		.salt = "0123456789abcdef0123456789abcdef",
+		.salt_size = 32,
+		.hash_type = 1,
+		.data_block_size = 4096,
+		.hash_block_size = 4096,
+		.data_size = DATA_SIZE / 4096,
+		.hash_area_offset = DATA_SIZE,
+		.fec_device = vc->fec ? fec_path : NULL,
+		.fec_area_offset = DATA_SIZE + HASH_SIZE,
+		.fec_roots = vc->fec ? 2 : 0,
+		.flags = CRYPT_VERITY_NO_HEADER | (vc->verify ? CRYPT_VERITY_CHECK_HASH : CRYPT_VERITY_CREATE_HASH),
+	};
+	size_t size = sizeof(vc->root_hash);
+	int r;
+
+	if ((r = crypt_init(&cd, hash_path)))
+		return r;
+
+	if (vc->verify) {
+		r = crypt_load(cd, CRYPT_VERITY, &params);
+		if (!r)
+			r = crypt_activate_by_volume_key(cd, NULL, vc->root_hash, vc->root_hash_size, 0);
+	} else {
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &params);
+		if (!r)
+			r = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, vc->root_hash, &size, NULL, 0);
+		if (r >= 0) {
+			vc->root_hash_size = size;
+			r = 0;
+		}
+	}
+
+	crypt_free(cd);
+	return r;
+}
+
+static int bench_verity(void)
+{
+	struct verity_ctx vc = {};
+	struct bench_case c = {
+		.iterations = 1,
+		.bytes = DATA_SIZE,
+		.run = run_verity,
+		.ctx = &vc,
+	};
+	int r;
+
+	c.benchmark = "verity-create";
+	c.name = "sha256/4096";
+	r = bench_run(&c);
+
+	if (!r) {
+		vc.verify = true;
+		c.benchmark = "verity-verify";
+		r = bench_run(&c);
+	}
+
+	if (!r) {
+		vc.verify = false;
+		vc.fec = true;
+		c.benchmark = "verity-create-fec";
+		c.name = "sha256/4096/roots2";
+		r = bench_run(&c);
+	}
+
+	return r;
+}
+
+/* LUKS2_disk_hdr_read with JSON validation */
+static int run_luks2_load(struct bench_case *c)
+{
+	struct crypt_device *cd;
+	unsigned int i;
+	int r = 0;
+
+	for (i = 0; i < c->iterations && !r; i++) {
+		if ((r = crypt_init(&cd, c->ctx)))
+			return r;
+		r = crypt_load(cd, CRYPT_LUKS2, NULL);
+		crypt_free(cd);
+	}
+
+	return r;
+}
+
+static int bench_luks2_load(void)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = "sha256",
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	struct crypt_params_luks2 params = {
+		.sector_size = 512,
+	};
+	struct bench_case c = {
+		.benchmark = "luks2-header-load",
+		.name = "32-keyslots",
+		.iterations = 100,
+		.run = run_luks2_load,
+		.ctx = data_path,
+	};
+	struct crypt_device *cd;
+	char key[64] = {};
+	int i, r;
+
+	/* overwrites verity data area, the header fits into it */
+	r = crypt_init(&cd, data_path);
+	if (r)
+		return r;
+
+	r = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (!r)
+		r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, sizeof(key), &params);
+	for (i = 0; !r && i < 32; i++)
+		r = crypt_keyslot_add_by_volume_key(cd, i, key, sizeof(key), "password", 8) < 0 ? -EINVAL : 0;
+	crypt_free(cd);
+	if (r)
+		return r;
+
+	return bench_run(&c);
+}
+
+/* crypt_wipe_device */
+static int run_wipe(struct bench_case *c)
+{
+	struct crypt_device *cd;
+	int r;
+
+	if ((r = crypt_init(&cd, data_path)))
+		return r;
+
+	r = crypt_wipe(cd, data_path, CRYPT_WIPE_ZERO, 0, c->bytes, *(size_t *)c->ctx, 0, NULL, NULL);
+
+	crypt_free(cd);
+	return r;
+}
+
+static int bench_wipe(size_t block_size)
+{
+	char name[64];
+	struct bench_case c = {
+		.benchmark = "wipe",
+		.name = name,
+		.iterations = 1,
+		.bytes = DATA_SIZE,
+		.run = run_wipe,
+		.ctx = &block_size,
+	};
+
+	snprintf(name, sizeof(name), "zero/%zu", block_size);
+	return bench_run(&c);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Use:\tbench [-f benchmark] [device]\n"
+		"\tContent of the device is DESTROYED, temporary file is used if not set.\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "f:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		bench_device = argv[optind];
+
+	if (init_crypto(NULL)) {
+		fprintf(stderr, "Cannot initialize crypto backend.\n");
+		return EXIT_FAILURE;
+	}
+
+	r = bench_storage("aes", "xts-plain64", 64, 512);
+	if (!r)
+		r = bench_storage("aes", "xts-plain64", 64, 4096);
+	if (!r)
+		r = bench_storage("aes", "cbc-essiv:sha256", 32, 512);
+	if (!r)
+		r = bench_af("sha256");
+	if (!r)
+		r = bench_pbkdf(CRYPT_KDF_PBKDF2, "sha256", 100000, 0, 0);
+	if (!r)
+		r = bench_pbkdf(CRYPT_KDF_ARGON2ID, NULL, 4, 65536, 4);
+
+	if (!r && (!filter || strstr("verity-create-fec verity-verify luks2-header-load wipe", filter))) {
+		r = device_paths();
+		if (!r)
+			r = bench_verity();
+		if (!r)
+			r = bench_luks2_load();
+		if (!r)
+			r = bench_wipe(BENCH_MIB);
+		if (!r)
+			r = bench_wipe(64 * 1024);
+		if (!bench_device)
+			unlink(tmp_file);
+	}
+
+	crypt_backend_destroy();
+
+	return r ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -994,6 +994,23 @@ static struct base64_test_vector base64_test_vectors[] = {
               "YmxhaCBibGFoIGJsYWg=" },
 };
 
+/* Decode only, whitespace and invalid input (mixed fast and slow decoder path) */
+static struct base64_decode_test_vector {
+	const char *encoded;
+	size_t decoded_len;
+	const char *decoded;
+	int result;
+} base64_decode_test_vectors[] = {
+	{ "Zm9vYmFy\n", 6, "foobar", 0 },
+	{ " Zm9v YmFy ", 6, "foobar", 0 },
+	{ "Zm9vYmFyZm9v\r\n\tYg==\n", 10, "foobarfoob", 0 },
+	{ "Zm 9vYm\nFy", 6, "foobar", 0 },
+	{ "Zm9vYmE=Zm9v", 0, NULL, -EINVAL },
+	{ "Zm9vYm*y", 0, NULL, -EINVAL },
+	{ "Zm9vY", 0, NULL, -EINVAL },
+	{ "=m9v", 0, NULL, -EINVAL },
+};
+
 /* UTF8 to UTF16LE test vectors */
 struct utf8_16_test_vector {
 	size_t len8;
@@ -1053,6 +1070,66 @@ static int pbkdf_test_vectors(void)
 	return EXIT_SUCCESS;
 }
 
+static int pbkdf_abort_cb(void *usrptr)
+{
+	int *calls = usrptr;
+
+	return (*calls)++ > 0;
+}
+
+static int pbkdf_abort_test(void)
+{
+	const struct {
+		const char *type, *hash;
+		uint32_t iterations, memory, parallel;
+	} kdfs[] = {
+		{ "pbkdf2", "sha256", 100000, 0, 0 },
+		{ "argon2i", NULL, 3, 1024, 1 },
+		{ "argon2id", NULL, 3, 1024, 2 },
+	};
+	char key[32], key_ref[32];
+	unsigned int i;
+	int r, calls;
+
+	for (i = 0; i < ARRAY_SIZE(kdfs); i++) {
+		printf("PBKDF abort %s ", kdfs[i].type);
+		if (crypt_pbkdf(kdfs[i].type, kdfs[i].hash, "password", 8, "saltsaltsaltsalt", 16,
+				key_ref, sizeof(key_ref), kdfs[i].iterations, kdfs[i].memory,
+				kdfs[i].parallel) < 0) {
+			printf("[N/A]\n");
+			continue;
+		}
+
+		/* abort on the second check of the hook */
+		calls = 0;
+		crypt_pbkdf_set_abort(pbkdf_abort_cb, &calls);
+		r = crypt_pbkdf(kdfs[i].type, kdfs[i].hash, "password", 8, "saltsaltsaltsalt", 16,
+				key, sizeof(key), kdfs[i].iterations, kdfs[i].memory,
+				kdfs[i].parallel);
+		crypt_pbkdf_set_abort(NULL, NULL);
+
+		if (!r && memcmp(key, key_ref, sizeof(key))) {
+			printf("[FAILED]\n");
+			return EXIT_FAILURE;
+		}
+		if (!r && calls) {
+			printf("[FAILED (not aborted)]\n");
+			return EXIT_FAILURE;
+		}
+		if (!r) {
+			printf("[N/A (not supported)]\n");
+			continue;
+		}
+		if (r != -ECANCELED) {
+			printf("[FAILED (%d)]\n", r);
+			return EXIT_FAILURE;
+		}
+		printf("[OK]\n");
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int crc32_test(const struct hash_test_vector *vector, unsigned int i)
 {
 	uint32_t crc32;
@@ -1075,6 +1152,52 @@ static int crc32_test(const struct hash_test_vector *vector, unsigned int i)
 	return EXIT_SUCCESS;
 }
 
+/* bitwise reference, accelerated implementations must match it */
+static uint32_t crc32_reference(uint32_t crc, const unsigned char *buf, size_t len, uint32_t poly)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+	}
+
+	return crc;
+}
+
+static int crc32_long_test(void)
+{
+	unsigned char data[1100];
+	size_t offset, len;
+
+	printf("CRC32 long buffers: ");
+
+	if ((crypt_crc32c(~0, (const unsigned char *)"123456789", 9) ^ ~0) != 0xe3069283) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (len = 0; len < sizeof(data); len++)
+		data[len] = (unsigned char)(len * 131 + 17);
+
+	/* unaligned start, short tails and lengths around folding thresholds */
+	for (offset = 0; offset < 9; offset++) {
+		for (len = 0; len < sizeof(data) - offset; len += (len < 300 ? 1 : 61)) {
+			if (crypt_crc32(~0, data + offset, len) !=
+			    crc32_reference(~0, data + offset, len, 0xedb88320) ||
+			    crypt_crc32c(~0, data + offset, len) !=
+			    crc32_reference(~0, data + offset, len, 0x82f63b78)) {
+				printf("[FAILED (%zu/%zu)]\n", offset, len);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	printf("[crc32][crc32c]\n");
+
+	return EXIT_SUCCESS;
+}
+
 static int hash_test(void)
 {
 	const struct hash_test_vector *vector;
@@ -1158,6 +1281,145 @@ static int hash_test(void)
 	return EXIT_SUCCESS;
 }
 
+static int hash_many_compare(struct crypt_hash *h, const char *prefix, size_t prefix_length,
+			     const char *suffix, size_t suffix_length,
+			     const char *data, size_t block_size, size_t blocks,
+			     const char *digests, size_t digest_size, size_t digest_stride)
+{
+	char result[64];
+	size_t i;
+
+	for (i = 0; i < blocks; i++) {
+		if (prefix_length && crypt_hash_write(h, prefix, prefix_length))
+			return -EINVAL;
+		if (crypt_hash_write(h, data + i * block_size, block_size))
+			return -EINVAL;
+		if (suffix_length && crypt_hash_write(h, suffix, suffix_length))
+			return -EINVAL;
+		if (crypt_hash_final(h, result, digest_size))
+			return -EINVAL;
+		if (memcmp(result, digests + i * digest_stride, digest_size))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int hash_many_test(void)
+{
+	const char *hashes[] = { "sha1", "sha256", "sha512" };
+	const char salt[] = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef!";
+	char data[7 * 100], digests[7 * 64];
+	struct crypt_hash *h;
+	unsigned int i;
+	int r, size;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (char)(i * 7 + 3);
+
+	for (i = 0; i < ARRAY_SIZE(hashes); i++) {
+		printf("Hash batch %s: ", hashes[i]);
+		size = crypt_hash_size(hashes[i]);
+		if (size < 0) {
+			printf("[N/A]\n");
+			continue;
+		}
+
+		if (crypt_hash_init(&h, hashes[i])) {
+			printf("[N/A (init)]\n");
+			continue;
+		}
+
+		/* no salt, continuous digests */
+		r = crypt_hash_many(h, NULL, 0, NULL, 0, data, 100, 7, digests, size, size);
+		if (!r)
+			r = hash_many_compare(h, NULL, 0, NULL, 0, data, 100, 7, digests, size, size);
+		if (r) {
+			printf("[FAILED]\n");
+			crypt_hash_destroy(h);
+			return EXIT_FAILURE;
+		}
+		printf("[plain]");
+
+		/* salt prefix, truncated digests with stride */
+		r = crypt_hash_many(h, salt, sizeof(salt), NULL, 0, data, 100, 7, digests, 16, 64);
+		if (!r)
+			r = hash_many_compare(h, salt, sizeof(salt), NULL, 0, data, 100, 7, digests, 16, 64);
+		if (r) {
+			printf("[FAILED]\n");
+			crypt_hash_destroy(h);
+			return EXIT_FAILURE;
+		}
+		printf("[prefix]");
+
+		/* salt suffix */
+		r = crypt_hash_many(h, NULL, 0, salt, 32, data, 100, 7, digests, size, 64);
+		if (!r)
+			r = hash_many_compare(h, NULL, 0, salt, 32, data, 100, 7, digests, size, 64);
+		if (r) {
+			printf("[FAILED]\n");
+			crypt_hash_destroy(h);
+			return EXIT_FAILURE;
+		}
+		printf("[suffix]\n");
+
+		crypt_hash_destroy(h);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int sha256_chain_test(void)
+{
+	/* lengths covering one, two (BitLocker KDF) and three block messages */
+	const size_t lengths[] = { 0, 15, 16, 48, 79, 80, 150 };
+	char data[150], digest[32], result[32], counter[8];
+	struct crypt_hash *h;
+	unsigned int i, j, k;
+
+	printf("SHA-256 chain: ");
+	if (crypt_hash_init(&h, "sha256")) {
+		printf("[N/A]\n");
+		return EXIT_SUCCESS;
+	}
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (char)(i * 11 + 5);
+
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		memset(result, (int)i, sizeof(result));
+		for (j = 0; j < 100; j++) {
+			for (k = 0; k < sizeof(counter); k++)
+				counter[k] = (char)((uint64_t)(1000 + j) >> (8 * k));
+			if (crypt_hash_write(h, result, sizeof(result)) ||
+			    (lengths[i] && crypt_hash_write(h, data, lengths[i])) ||
+			    crypt_hash_write(h, counter, sizeof(counter)) ||
+			    crypt_hash_final(h, result, sizeof(result))) {
+				crypt_hash_destroy(h);
+				return EXIT_FAILURE;
+			}
+		}
+
+		memset(digest, (int)i, sizeof(digest));
+		if (crypt_sha256_chain(digest, data, lengths[i], 1000, 100) ||
+		    memcmp(digest, result, sizeof(result))) {
+			printf("[FAILED]\n");
+			crypt_hash_destroy(h);
+			return EXIT_FAILURE;
+		}
+		printf("[%zu]", lengths[i]);
+	}
+	printf("\n");
+
+	crypt_hash_destroy(h);
+
+	/* message does not fit internal buffer */
+	if (crypt_sha256_chain(digest, data, 1024, 0, 1) != -EINVAL)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
 static int hmac_test(void)
 {
 	const struct hmac_test_vector *vector;
@@ -1399,6 +1661,7 @@ static int base64_test(void)
 	unsigned int i;
 	char *s;
 	size_t s_len;
+	int r;
 
 	for (i = 0; i < ARRAY_SIZE(base64_test_vectors); i++) {
 		printf("BASE64 %02d ", i);
@@ -1433,6 +1696,23 @@ static int base64_test(void)
 		free(s);
 	}
 
+	for (i = 0; i < ARRAY_SIZE(base64_decode_test_vectors); i++) {
+		printf("BASE64 DECODE %02d ", i);
+		s = NULL;
+		s_len = 0;
+		r = crypt_base64_decode(&s, &s_len, base64_decode_test_vectors[i].encoded,
+					strlen(base64_decode_test_vectors[i].encoded));
+		if (r != base64_decode_test_vectors[i].result ||
+		    (!r && (s_len != base64_decode_test_vectors[i].decoded_len ||
+			    memcmp(s, base64_decode_test_vectors[i].decoded, s_len)))) {
+			printf("[DECODE FAILED]\n");
+			free(s);
+			return EXIT_FAILURE;
+		}
+		printf("[decode]\n");
+		free(s);
+	}
+
 	return EXIT_SUCCESS;
 }
 
@@ -1527,9 +1807,21 @@ int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[]
 	if (pbkdf_test_vectors())
 		exit_test("PBKDF test failed.", EXIT_FAILURE);
 
+	if (pbkdf_abort_test())
+		exit_test("PBKDF abort test failed.", EXIT_FAILURE);
+
 	if (hash_test())
 		exit_test("HASH test failed.", EXIT_FAILURE);
 
+	if (crc32_long_test())
+		exit_test("CRC32 test failed.", EXIT_FAILURE);
+
+	if (hash_many_test())
+		exit_test("HASH batch test failed.", EXIT_FAILURE);
+
+	if (sha256_chain_test())
+		exit_test("SHA-256 chain test failed.", EXIT_FAILURE);
+
 	if (hmac_test())
 		exit_test("HMAC test failed.", EXIT_FAILURE);
 
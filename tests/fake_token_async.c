@@ -0,0 +1,111 @@
+/*
+ * Fake asynchronous token handler used by async-test-plugin.
+ * Passphrase is returned only through CRYPTSETUP_TOKEN_1.1 open_start/poll/finish
+ * after a short timer expires, the synchronous open always fails.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <libcryptsetup.h>
+
+#define FAKE_ASYNC_PASSPHRASE "async_test"
+#define FAKE_ASYNC_DELAY_NS   (50 * 1000 * 1000)
+
+struct fake_async_ctx {
+	int fd;
+	bool done;
+};
+
+int cryptsetup_token_open(struct crypt_device *cd __attribute__((unused)),
+	int token __attribute__((unused)),
+	char **buffer __attribute__((unused)),
+	size_t *buffer_len __attribute__((unused)),
+	void *usrptr __attribute__((unused)))
+{
+	return -EINVAL;
+}
+
+void cryptsetup_token_buffer_free(void *buffer, size_t buffer_len)
+{
+	if (buffer)
+		memset(buffer, 0, buffer_len);
+	free(buffer);
+}
+
+const char *cryptsetup_token_version(void)
+{
+	return "1.0";
+}
+
+int cryptsetup_token_open_start(struct crypt_device *cd __attribute__((unused)),
+	int token __attribute__((unused)),
+	const char *pin __attribute__((unused)),
+	size_t pin_size __attribute__((unused)),
+	void *usrptr __attribute__((unused)),
+	void **ctx)
+{
+	struct itimerspec its = { .it_value.tv_nsec = FAKE_ASYNC_DELAY_NS };
+	struct fake_async_ctx *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (c->fd < 0 || timerfd_settime(c->fd, 0, &its, NULL) < 0) {
+		if (c->fd >= 0)
+			close(c->fd);
+		free(c);
+		return -EINVAL;
+	}
+
+	*ctx = c;
+	return 0;
+}
+
+int cryptsetup_token_open_poll(struct crypt_device *cd __attribute__((unused)),
+	void *ctx,
+	int *fd)
+{
+	struct fake_async_ctx *c = ctx;
+	uint64_t expirations;
+
+	if (c->done)
+		return 0;
+
+	if (read(c->fd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations)) {
+		c->done = true;
+		return 0;
+	}
+
+	if (errno != EAGAIN && errno != EINTR)
+		return -EINVAL;
+
+	*fd = c->fd;
+	return -EINPROGRESS;
+}
+
+int cryptsetup_token_open_finish(struct crypt_device *cd __attribute__((unused)),
+	void *ctx,
+	char **buffer,
+	size_t *buffer_len)
+{
+	struct fake_async_ctx *c = ctx;
+	int r = 0;
+
+	if (!c->done)
+		r = -ECANCELED;
+	else if (!(*buffer = strdup(FAKE_ASYNC_PASSPHRASE)))
+		r = -ENOMEM;
+	else
+		*buffer_len = strlen(FAKE_ASYNC_PASSPHRASE);
+
+	close(c->fd);
+	free(c);
+	return r;
+}
@@ -27,24 +27,13 @@ extern "C" {
 void empty_log(int level, const char *msg, void *usrptr) {}
 
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
-	int fd, r;
+	int r;
 	struct crypt_device *cd = NULL;
-	char name[] = "/tmp/test-script-fuzz.XXXXXX";
-
-	fd = mkostemp(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC);
-	if (fd == -1)
-		err(EXIT_FAILURE, "mkostemp() failed");
-
-	/* enlarge header */
-	if (ftruncate(fd, FILESIZE) == -1)
-		goto out;
-
-	if (write_buffer(fd, data, size) != (ssize_t) size)
-		goto out;
 
 	crypt_set_log_callback(NULL, empty_log, NULL);
 
-	if (crypt_init(&cd, name) == 0) {
+	/* header enlarged to FILESIZE in memory, no temporary file needed */
+	if (crypt_init_by_buffer(&cd, data, size, size > FILESIZE ? 0 : FILESIZE) == 0) {
 		r = crypt_load(cd, CRYPT_LUKS1, NULL);
 		if (r == 0)
 			goto out;
@@ -57,8 +46,6 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
 	}
 out:
 	crypt_free(cd);
-	close(fd);
-	unlink(name);
 	return 0;
 }
 }
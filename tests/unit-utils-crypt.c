@@ -226,6 +226,84 @@ static int test_hex_conversion(void)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Safe memory allocator test (slab and large allocations)
+ */
+static const size_t safe_memory_sizes[] = { 1, 47, 48, 100, 4000, 4080, 4081, 100000 };
+
+static int test_safe_memory(void)
+{
+	struct crypt_safe_memory_stats stats_start, stats;
+	char *mem[ARRAY_SIZE(safe_memory_sizes)];
+	size_t used = 0;
+	unsigned int i, j;
+
+	printf("SAFEMEM:");
+	if (crypt_safe_memory_stats(NULL) >= 0 || crypt_safe_memory_stats(&stats_start)) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(safe_memory_sizes); i++) {
+		printf("[%zu]", safe_memory_sizes[i]);
+		mem[i] = crypt_safe_alloc(safe_memory_sizes[i]);
+		if (!mem[i]) {
+			printf("[FAILED]\n");
+			return EXIT_FAILURE;
+		}
+		for (j = 0; j < safe_memory_sizes[i]; j++)
+			if (mem[i][j]) {
+				printf("[FAILED]\n");
+				return EXIT_FAILURE;
+			}
+		memset(mem[i], 0xaa, safe_memory_sizes[i]);
+		used += safe_memory_sizes[i];
+	}
+
+	if (crypt_safe_memory_stats(&stats) ||
+	    stats.allocations != stats_start.allocations + ARRAY_SIZE(safe_memory_sizes) ||
+	    stats.used_bytes != stats_start.used_bytes + used) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	/* shrink in the same chunk, content must be preserved */
+	mem[3] = crypt_safe_realloc(mem[3], 10);
+	mem[3] = crypt_safe_realloc(mem[3], 100);
+	if (!mem[3] || mem[3][9] != (char)0xaa || mem[3][10] || mem[3][99]) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	/* grow to a larger size class */
+	mem[0] = crypt_safe_realloc(mem[0], 5000);
+	if (!mem[0] || mem[0][0] != (char)0xaa || mem[0][1] || mem[0][4999]) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+	used += 4999;
+
+	if (crypt_safe_memory_stats(&stats) ||
+	    stats.used_bytes != stats_start.used_bytes + used) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(safe_memory_sizes); i++)
+		crypt_safe_free(mem[i]);
+
+	if (crypt_safe_memory_stats(&stats) ||
+	    stats.allocations != stats_start.allocations ||
+	    stats.used_bytes != stats_start.used_bytes ||
+	    stats.locked_bytes > stats.slab_bytes + stats_start.locked_bytes) {
+		printf("[FAILED]\n");
+		return EXIT_FAILURE;
+	}
+	printf("[OK]\n");
+
+	return EXIT_SUCCESS;
+}
+
 static void __attribute__((noreturn)) exit_test(const char *msg, int r)
 {
 	if (msg)
@@ -255,5 +333,8 @@ int main(__attribute__ ((unused)) int argc, __attribute__ ((unused))char *argv[]
 	if (test_hex_conversion())
 		exit_test("HEX conversion test failed.", EXIT_FAILURE);
 
+	if (test_safe_memory())
+		exit_test("Safe memory test failed.", EXIT_FAILURE);
+
 	exit_test(NULL, EXIT_SUCCESS);
 }